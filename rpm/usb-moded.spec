@@ -248,6 +248,20 @@ system bus.
 This package contains configuration to enable sharing the cellular data
 connection over the USB with the android gadget driver.
 
+%package connection-sharing-ncm-config
+Summary:  USB mode controller - USB/cellular data connection sharing config
+Conflicts: usb-moded-connection-sharing-android-config
+Conflicts: usb-moded-connection-sharing-android-connman-config
+
+%description connection-sharing-ncm-config
+Usb_moded is a daemon to control the USB states. For this
+it loads unloads the relevant usb gadget modules, keeps track
+of the filesystem(s) and notifies about changes on the DBUS
+system bus.
+
+This package contains configuration to enable sharing the cellular data
+connection over the USB with the ncm gadget function.
+
 %package connection-sharing-android-connman-config
 Summary:  USB mode controller - USB/cellular data connection sharing config
 
@@ -467,6 +481,11 @@ systemctl daemon-reload || :
 %{_sysconfdir}/usb-moded/dyn-modes/connection_sharing.ini
 %{_sysconfdir}/usb-moded/run/udhcpd-connection-sharing.ini
 
+%files connection-sharing-ncm-config
+%defattr(-,root,root,-)
+%{_sysconfdir}/usb-moded/dyn-modes/connection_sharing-ncm.ini
+%{_sysconfdir}/usb-moded/run/udhcpd-connection-sharing.ini
+
 %files connection-sharing-android-connman-config
 %defattr(-,root,root,-)
 %{_sysconfdir}/usb-moded/dyn-modes/connection_sharing-android-connman.ini
@@ -24,6 +24,7 @@
 
 #include "usb_moded-android.h"
 
+#include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
@@ -40,7 +41,11 @@
  * ANDROID
  * ------------------------------------------------------------------------- */
 
+static bool  android_shadow_matches   (const char *path, const char *text);
+static void  android_shadow_update    (const char *path, const char *text);
+static void  android_shadow_clear     (void);
 static bool  android_write_file       (const char *path, const char *text);
+static bool  android_write_config     (const char *path, const char *text);
 bool         android_in_use           (void);
 static bool  android_probe            (void);
 gchar       *android_get_serial       (void);
@@ -52,6 +57,9 @@ bool         android_set_function     (const char *function);
 bool         android_set_productid    (const char *id);
 bool         android_set_vendorid     (const char *id);
 bool         android_set_attr         (const char *function, const char *attr, const char *value);
+bool         android_is_configured    (void);
+static bool  android_gadget_apply     (const gadget_config_t *config);
+static bool  android_gadget_clear_luns(size_t count);
 
 /* ========================================================================= *
  * Data
@@ -59,10 +67,80 @@ bool         android_set_attr         (const char *function, const char *attr, c
 
 static int android_probed = -1;
 
+/** Last successfully written value for android_usb control files
+ *
+ * Maps path -> value, used for skipping writes that would not change
+ * anything. Each write can cause gadget re-enumeration on some kernels.
+ *
+ * Accessed from the worker thread, and from the main thread while
+ * initializing before mode selection is enabled.
+ */
+static GHashTable *android_shadow = 0;
+
+/** Gadget backend operations for android_usb */
+const gadget_backend_t android_gadget_backend =
+{
+    .gb_name          = "android",
+    .gb_max_luns      = 1,
+    .gb_keeps_netif   = false,
+    .gb_in_use        = android_in_use,
+    .gb_apply         = android_gadget_apply,
+    .gb_clear_luns    = android_gadget_clear_luns,
+    .gb_set_charging  = android_set_charging_mode,
+    .gb_is_configured = android_is_configured,
+    .gb_take_adopted  = 0,
+    .gb_get_ifname    = 0,
+};
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
 
+/** Check if control file is known to hold the given value
+ *
+ * @param path  Control file path
+ * @param text  Value to check
+ *
+ * @return true if text was the last value written to path, false otherwise
+ */
+static bool
+android_shadow_matches(const char *path, const char *text)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return android_shadow && !g_strcmp0(g_hash_table_lookup(android_shadow, path), text);
+}
+
+/** Update last written value of a control file
+ *
+ * @param path  Control file path
+ * @param text  Value written, or NULL if state is not known
+ */
+static void
+android_shadow_update(const char *path, const char *text)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !android_shadow )
+        android_shadow = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    if( text )
+        g_hash_table_replace(android_shadow, g_strdup(path), g_strdup(text));
+    else
+        g_hash_table_remove(android_shadow, path);
+}
+
+/** Forget all last written values
+ */
+static void
+android_shadow_clear(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( android_shadow )
+        g_hash_table_unref(android_shadow), android_shadow = 0;
+}
+
 static bool
 android_write_file(const char *path, const char *text)
 {
@@ -73,14 +151,23 @@ android_write_file(const char *path, const char *text)
     if( !path || !text )
         goto EXIT;
 
+    if( android_shadow_matches(path, text) ) {
+        log_debug("SKIP %s '%s'", path, text);
+        ack = true;
+        goto EXIT;
+    }
+
     log_debug("WRITE %s '%s'", path, text);
 
     char buff[64];
     snprintf(buff, sizeof buff, "%s\n", text);
 
-    if( write_to_file(path, buff) == -1 )
+    if( write_to_file(path, buff) == -1 ) {
+        android_shadow_update(path, 0);
         goto EXIT;
+    }
 
+    android_shadow_update(path, text);
     ack = true;
 
 EXIT:
@@ -88,6 +175,36 @@ EXIT:
     return ack;
 }
 
+/** Write control file that can be changed only while gadget is disabled
+ *
+ * The gadget is disabled only if the value actually changes. Enabling
+ * is left to the caller, so that all changes made in between get
+ * bracketed within a single disable / enable cycle.
+ *
+ * @param path  Control file path
+ * @param text  Value to write
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+android_write_config(const char *path, const char *text)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !path || !text )
+        return false;
+
+    if( android_shadow_matches(path, text) ) {
+        log_debug("SKIP %s '%s'", path, text);
+        return true;
+    }
+
+    if( !android_set_enabled(false) )
+        return false;
+
+    return android_write_file(path, text);
+}
+
 bool
 android_in_use(void)
 {
@@ -234,7 +351,9 @@ EXIT:
 void
 android_quit(void)
 {
-    /* For now this exists for symmetry with other backends only */
+    LOG_REGISTER_CONTEXT;
+
+    android_shadow_clear();
 }
 
 bool
@@ -299,15 +418,12 @@ android_set_function(const char *function)
     if( !android_in_use() )
         goto EXIT;
 
-    if( !android_set_enabled(false) )
-        goto EXIT;
-
-    if( !android_write_file(ANDROID0_FUNCTIONS, function) )
+    /* Gadget gets disabled if function list changes. It is left
+     * disabled, so that caller can adjust attributes etc before
+     * enabling */
+    if( !android_write_config(ANDROID0_FUNCTIONS, function) )
         goto EXIT;
 
-    /* Leave disabled, so that caller can adjust attributes
-     * etc before enabling */
-
     ack = true;
 EXIT:
 
@@ -334,7 +450,7 @@ android_set_productid(const char *id)
             snprintf(str, sizeof str, "%04x", num);
             id = str;
         }
-        ack = android_write_file(ANDROID0_ID_PRODUCT, id);
+        ack = android_write_config(ANDROID0_ID_PRODUCT, id);
     }
     log_debug("ANDROID %s(%s) -> %d", __func__, id, ack);
     return ack;
@@ -358,7 +474,7 @@ android_set_vendorid(const char *id)
             snprintf(str, sizeof str, "%04x", num);
             id = str;
         }
-        ack = android_write_file(ANDROID0_ID_VENDOR, id);
+        ack = android_write_config(ANDROID0_ID_VENDOR, id);
     }
     log_debug("ANDROID %s(%s) -> %d", __func__, id, ack);
     return ack;
@@ -385,3 +501,86 @@ android_set_attr(const char *function, const char *attr, const char *value)
               function, attr, value, ack);
     return ack;
 }
+
+/** Check if android gadget has been configured by the host
+ *
+ * @return true if gadget state is CONFIGURED, false otherwise
+ */
+bool
+android_is_configured(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return android_in_use() && common_file_has_value(ANDROID0_STATE, "CONFIGURED");
+}
+
+/** Program android gadget according to configuration and enable it
+ *
+ * @param config  Desired gadget configuration
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+android_gadget_apply(const gadget_config_t *config)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    /* Lun file can be changed only while disabled */
+    if( config->gc_lun_count && !android_set_enabled(false) )
+        goto EXIT;
+
+    if( config->gc_functions && !android_set_function(config->gc_functions) )
+        goto EXIT;
+
+    if( config->gc_productid )
+        android_set_productid(config->gc_productid);
+
+    if( config->gc_vendorid )
+        android_set_vendorid(config->gc_vendorid);
+
+    if( config->gc_lun_count ) {
+        const gadget_lun_t *lun = &config->gc_luns[0];
+        android_set_attr("f_mass_storage", "lun/nofua",
+                         lun->gl_nofua ? "1" : "0");
+        android_set_attr("f_mass_storage", "lun/ro",
+                         lun->gl_ro ? "1" : "0");
+        android_set_attr("f_mass_storage", "lun/file", lun->gl_file);
+    }
+
+    for( size_t i = 0; i < G_N_ELEMENTS(config->gc_extra_path); ++i ) {
+        if( config->gc_extra_path[i] && config->gc_extra_value[i] )
+            write_to_file(config->gc_extra_path[i], config->gc_extra_value[i]);
+    }
+
+    /* Of the network function tunables android_usb exposes only the
+     * host side address of ecm, and ncm has no attributes at all */
+    if( config->gc_net_host_addr && config->gc_functions &&
+        strstr(config->gc_functions, "ecm") )
+        android_set_attr("f_ecm", "ethaddr", config->gc_net_host_addr);
+    if( config->gc_net_qmult || config->gc_net_dev_addr )
+        log_debug("ANDROID: network function tunables not supported");
+
+    ack = android_set_enabled(true);
+
+EXIT:
+    return ack;
+}
+
+/** Detach android mass storage lun
+ *
+ * @param count  Number of luns in use (unused, only one is supported)
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+android_gadget_clear_luns(size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)count;
+
+    android_set_enabled(false);
+    return android_set_attr("f_mass_storage", "lun/file", "");
+}
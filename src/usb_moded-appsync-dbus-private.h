@@ -43,6 +43,7 @@
 gboolean dbusappsync_init_connection(void);
 gboolean dbusappsync_init           (void);
 void     dbusappsync_cleanup        (void);
-int      dbusappsync_launch_app     (char *launch);
+void     dbusappsync_cancel_launches(void);
+int      dbusappsync_launch_app     (const char *name, const char *launch, int post);
 
 #endif /* USB_MODED_APPSYNC_DBUS_PRIVATE_H_ */
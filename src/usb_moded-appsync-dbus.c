@@ -28,15 +28,55 @@
 
 #include "usb_moded-appsync-dbus-private.h"
 
+#include "usb_moded.h"
 #include "usb_moded-appsync.h"
+#include "usb_moded-common.h"
 #include "usb_moded-log.h"
+#include "usb_moded-trace.h"
+
+#include "../dbus-gmain/dbus-gmain.h"
+
+#include <pthread.h> // NOTRIM
+#include <unistd.h>
 
 #include <dbus/dbus.h>
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Address of user session bus socket, as printf format */
+#define DBUSAPPSYNC_SESSION_ADDRESS_FMT "unix:path=/run/user/%u/bus"
+
+/** Maximum time to wait for application launch replies [ms] */
+#define DBUSAPPSYNC_LAUNCH_TIMEOUT_MS (5 * 1000)
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Application launch request that is waiting for reply */
+typedef struct dbusappsync_launch_t
+{
+    /** Application name */
+    gchar *dl_name;
+
+    /** 0=pre-enum app, or 1=post-enum app */
+    int    dl_post;
+} dbusappsync_launch_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * DBUSAPPSYNC_LAUNCH
+ * ------------------------------------------------------------------------- */
+
+static dbusappsync_launch_t *dbusappsync_launch_create  (const char *name, int post);
+static void                  dbusappsync_launch_delete_cb(void *self);
+static void                  dbusappsync_launch_reply_cb (DBusPendingCall *pc, void *aptr);
+
 /* ------------------------------------------------------------------------- *
  * DBUSAPPSYNC
  * ------------------------------------------------------------------------- */
@@ -45,11 +85,13 @@ static void              dbusappsync_release_name      (void);
 static gboolean          dbusappsync_obtain_name       (void);
 static DBusHandlerResult dbusappsync_msg_handler       (DBusConnection *const connection, DBusMessage *const msg, gpointer const user_data);
 static DBusHandlerResult dbusappsync_handle_disconnect (DBusConnection *conn, DBusMessage *msg, void *user_data);
-static void              dbusappsync_cleanup_connection(void);
+static void              dbusappsync_cancel_launches_locked(void);
+static void              dbusappsync_cleanup_connection_locked(void);
 gboolean                 dbusappsync_init_connection   (void);
 gboolean                 dbusappsync_init              (void);
 void                     dbusappsync_cleanup           (void);
-int                      dbusappsync_launch_app        (char *launch);
+void                     dbusappsync_cancel_launches   (void);
+int                      dbusappsync_launch_app        (const char *name, const char *launch, int post);
 
 /* ========================================================================= *
  * Data
@@ -59,8 +101,109 @@ static DBusConnection *dbus_connection_ses  = NULL;  // connection
 static gboolean        dbus_connection_name = FALSE; // have name
 static gboolean        dbus_connection_disc = FALSE; // got disconnected
 
+/** User whose session bus the connection state refers to */
+static uid_t           dbus_connection_uid  = UID_UNKNOWN;
+
+/** Launch requests waiting for reply, as DBusPendingCall refs */
+static GSList         *dbus_connection_pending = NULL;
+
+/** Mutex for accessing session bus connection state
+ *
+ * Launch requests are made from the worker thread, while the
+ * connection is (re)established and dispatched in the main thread.
+ */
+static pthread_mutex_t dbusappsync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define DBUSAPPSYNC_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&dbusappsync_mutex) != 0 ) { \
+        log_crit("DBUSAPPSYNC LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define DBUSAPPSYNC_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&dbusappsync_mutex) != 0 ) { \
+        log_crit("DBUSAPPSYNC UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
 /* ========================================================================= *
- * Functions
+ * DBUSAPPSYNC_LAUNCH
+ * ========================================================================= */
+
+static dbusappsync_launch_t *dbusappsync_launch_create(const char *name, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dbusappsync_launch_t *self = g_malloc0(sizeof *self);
+
+    self->dl_name = g_strdup(name);
+    self->dl_post = post;
+
+    return self;
+}
+
+static void dbusappsync_launch_delete_cb(void *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dbusappsync_launch_t *launch = self;
+
+    if( launch ) {
+        g_free(launch->dl_name);
+        g_free(launch);
+    }
+}
+
+/**
+ * Handle reply to application launch request
+ *
+ * Applications that were started successfully are marked active,
+ * which allows usb enumeration to proceed as soon as all pre-enum
+ * applications are up - instead of waiting for the enumeration timer.
+ */
+static void dbusappsync_launch_reply_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dbusappsync_launch_t *launch = aptr;
+    DBusMessage          *rsp    = dbus_pending_call_steal_reply(pc);
+    DBusError             err    = DBUS_ERROR_INIT;
+    bool                  ok     = false;
+
+    DBUSAPPSYNC_LOCKED_ENTER;
+    GSList *link = g_slist_find(dbus_connection_pending, pc);
+    if( link ) {
+        dbus_connection_pending = g_slist_delete_link(dbus_connection_pending, link);
+        dbus_pending_call_unref(pc);
+    }
+    DBUSAPPSYNC_LOCKED_LEAVE;
+
+    /* Launch was canceled while reply was being dispatched */
+    if( !link ) {
+        log_debug("ignoring stale launch reply for '%s'", launch->dl_name);
+        goto EXIT;
+    }
+
+    if( !rsp )
+        log_err("could not start '%s': no reply", launch->dl_name);
+    else if( dbus_set_error_from_message(&err, rsp) )
+        log_err("could not start '%s': %s: %s", launch->dl_name, err.name, err.message);
+    else
+        ok = true;
+
+    if( ok )
+        appsync_mark_active(launch->dl_name, launch->dl_post);
+
+EXIT:
+    if( rsp )
+        dbus_message_unref(rsp);
+    dbus_error_free(&err);
+}
+
+/* ========================================================================= *
+ * DBUSAPPSYNC
  * ========================================================================= */
 
 static void dbusappsync_release_name(void)
@@ -209,6 +352,7 @@ static DBusHandlerResult dbusappsync_msg_handler(DBusConnection *const connectio
                 // we failed to generate reply above -> generate one
                 reply = dbus_message_new_error(msg, DBUS_ERROR_FAILED, member);
             }
+            trace_count(TRACE_COUNTER_DBUS_SEND);
             if( !reply || !dbus_connection_send(connection, reply, 0) )
             {
                 log_debug("Failed sending reply. Out Of Memory!\n");
@@ -233,19 +377,45 @@ static DBusHandlerResult dbusappsync_handle_disconnect(DBusConnection *conn, DBu
     if( dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL, "Disconnected") )
     {
         log_warning("disconnected from session bus - expecting restart/stop soon\n");
+        DBUSAPPSYNC_LOCKED_ENTER;
         dbus_connection_disc = TRUE;
-        dbusappsync_cleanup_connection();
+        dbusappsync_cleanup_connection_locked();
+        DBUSAPPSYNC_LOCKED_LEAVE;
     }
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
+/**
+ * Cancel launch requests that are still waiting for reply
+ *
+ * @note Assumes that connection state is already locked.
+ */
+static void dbusappsync_cancel_launches_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( GSList *iter = dbus_connection_pending; iter; iter = iter->next )
+    {
+        DBusPendingCall *pc = iter->data;
+        dbus_pending_call_cancel(pc);
+        dbus_pending_call_unref(pc);
+    }
+    g_slist_free(dbus_connection_pending), dbus_connection_pending = 0;
+}
+
 /**
  * Detach from session bus
+ *
+ * Launch requests that are still waiting for reply are canceled.
+ *
+ * @note Assumes that connection state is already locked.
  */
-static void dbusappsync_cleanup_connection(void)
+static void dbusappsync_cleanup_connection_locked(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    dbusappsync_cancel_launches_locked();
+
     if( dbus_connection_ses != 0 )
     {
         /* Remove message filters */
@@ -258,15 +428,21 @@ static void dbusappsync_cleanup_connection(void)
             dbusappsync_release_name();
         }
 
+        dbus_connection_close(dbus_connection_ses);
         dbus_connection_unref(dbus_connection_ses);
         dbus_connection_ses = NULL;
-        //dbus_connection_disc = FALSE;
+        dbus_connection_name = FALSE;
+        log_debug("succesfully cleaned up appsync dbus\n");
     }
-    log_debug("succesfully cleaned up appsync dbus\n");
 }
 
 /**
- * Attach to session bus
+ * Attach to session bus of the current user
+ *
+ * The connection is kept open across mode switches, so that launching
+ * applications does not involve connect round trips. If the current
+ * user has changed, the connection is re-established to the session
+ * of the new user.
  */
 gboolean dbusappsync_init_connection(void)
 {
@@ -274,11 +450,27 @@ gboolean dbusappsync_init_connection(void)
 
     gboolean  result = FALSE;
     DBusError error  = DBUS_ERROR_INIT;
+    gchar    *addr   = 0;
+    uid_t     uid    = usbmoded_get_current_user();
+
+    DBUSAPPSYNC_LOCKED_ENTER;
 
     if( dbus_connection_ses != 0 )
     {
-        result = TRUE;
-        goto EXIT;
+        if( dbus_connection_uid == uid )
+        {
+            result = TRUE;
+            goto EXIT;
+        }
+        log_debug("user changed; dropping session bus connection");
+        dbusappsync_cleanup_connection_locked();
+    }
+
+    if( dbus_connection_uid != uid )
+    {
+        // session of another user might be alive
+        dbus_connection_uid  = uid;
+        dbus_connection_disc = FALSE;
     }
 
     if( dbus_connection_disc )
@@ -287,10 +479,24 @@ gboolean dbusappsync_init_connection(void)
         goto EXIT;
     }
 
+    if( uid == UID_UNKNOWN )
+    {
+        log_warning("current user unknown; skip session bus connect");
+        goto EXIT;
+    }
+
     /* Connect to session bus */
-    if ((dbus_connection_ses = dbus_bus_get(DBUS_BUS_SESSION, &error)) == NULL)
+    addr = g_strdup_printf(DBUSAPPSYNC_SESSION_ADDRESS_FMT, (unsigned)uid);
+    if( (dbus_connection_ses = dbus_connection_open_private(addr, &error)) == NULL )
+    {
+        log_err("%s: can't connect: %s: %s", addr, error.name, error.message);
+        goto EXIT;
+    }
+
+    if( !dbus_bus_register(dbus_connection_ses, &error) )
     {
-        log_err("Failed to open connection to session message bus; %s\n",  error.message);
+        log_err("%s: can't register: %s: %s", addr, error.name, error.message);
+        dbusappsync_cleanup_connection_locked();
         goto EXIT;
     }
 
@@ -303,10 +509,11 @@ gboolean dbusappsync_init_connection(void)
     /* Make sure we do not get forced to exit if dbus session dies or stops */
     dbus_connection_set_exit_on_disconnect(dbus_connection_ses, FALSE);
 
-    /* Connect D-Bus to the mainloop (Seems it is only needed once and is done at the main
-     * D-Bus init
-     * dbus_connection_setup_with_g_main(dbus_connection_ses, NULL);
-     */
+    /* Connect D-Bus to the mainloop, so that method calls and
+     * launch replies get dispatched */
+    dbus_gmain_set_up_connection(dbus_connection_ses, NULL);
+
+    log_debug("connected to %s", addr);
 
     /* Request service name */
     if( !dbusappsync_obtain_name() )
@@ -318,6 +525,9 @@ gboolean dbusappsync_init_connection(void)
     result = TRUE;
 
 EXIT:
+    DBUSAPPSYNC_LOCKED_LEAVE;
+
+    g_free(addr);
     dbus_error_free(&error);
     return result;
 }
@@ -353,35 +563,102 @@ void dbusappsync_cleanup(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    dbusappsync_cleanup_connection();
-    // NOP
+    DBUSAPPSYNC_LOCKED_ENTER;
+    dbusappsync_cleanup_connection_locked();
+    DBUSAPPSYNC_LOCKED_LEAVE;
+}
+
+/**
+ * Cancel launch requests that are still waiting for reply
+ *
+ * Used on appsync deactivation, so that late replies do not mark
+ * applications active outside of mode activation.
+ */
+void dbusappsync_cancel_launches(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBUSAPPSYNC_LOCKED_ENTER;
+    dbusappsync_cancel_launches_locked();
+    DBUSAPPSYNC_LOCKED_LEAVE;
 }
 
 /**
  * Launch applications over dbus that need to be synchronized
+ *
+ * The start request is sent without waiting for reply, so that
+ * all applications of an activation phase get launched in parallel.
+ * When the reply arrives, successfully started application is
+ * marked active via #appsync_mark_active().
+ *
+ * @param name    Application name
+ * @param launch  D-Bus service name to start
+ * @param post    0=pre-enum app, or 1=post-enum app
+ *
+ * @return 0 if request was sent, or -1 on failure
  */
-int dbusappsync_launch_app(char *launch)
+int dbusappsync_launch_app(const char *name, const char *launch, int post)
 {
     LOG_REGISTER_CONTEXT;
 
-    int ret = -1; // assume failure
+    int                   ret   = -1; // assume failure
+    DBusMessage          *req   = 0;
+    DBusPendingCall      *pc    = 0;
+    dbusappsync_launch_t *data  = 0;
+    dbus_uint32_t         flags = 0;
+
+    DBUSAPPSYNC_LOCKED_ENTER;
 
     if( dbus_connection_ses == 0 )
     {
         log_err("could not start '%s': no session bus connection", launch);
+        goto EXIT;
     }
-    else
+
+    req = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+                                       DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS,
+                                       "StartServiceByName");
+    if( !req ||
+        !dbus_message_append_args(req,
+                                  DBUS_TYPE_STRING, &launch,
+                                  DBUS_TYPE_UINT32, &flags,
+                                  DBUS_TYPE_INVALID) )
     {
-        DBusError error = DBUS_ERROR_INIT;
-        if( !dbus_bus_start_service_by_name(dbus_connection_ses, launch, 0, NULL, &error) )
-        {
-            log_err("could not start '%s': %s: %s", launch, error.name, error.message);
-            dbus_error_free(&error);
-        }
-        else
-        {
-            ret = 0; // success
-        }
+        log_err("could not start '%s': failed to construct request", launch);
+        goto EXIT;
+    }
+
+    trace_count(TRACE_COUNTER_DBUS_SEND);
+    if( !dbus_connection_send_with_reply(dbus_connection_ses, req, &pc,
+                                         DBUSAPPSYNC_LAUNCH_TIMEOUT_MS) || !pc )
+    {
+        log_err("could not start '%s': failed to send request", launch);
+        goto EXIT;
     }
+
+    data = dbusappsync_launch_create(name, post);
+    if( !dbus_pending_call_set_notify(pc, dbusappsync_launch_reply_cb, data,
+                                      dbusappsync_launch_delete_cb) )
+    {
+        log_err("could not start '%s': failed to set reply notify", launch);
+        dbusappsync_launch_delete_cb(data);
+        dbus_pending_call_cancel(pc);
+        goto EXIT;
+    }
+
+    /* Reply callback can't run before the lock is released */
+    dbus_connection_pending = g_slist_prepend(dbus_connection_pending, pc), pc = 0;
+    log_debug("launch '%s' requested", launch);
+    ret = 0; // success
+
+EXIT:
+    DBUSAPPSYNC_LOCKED_LEAVE;
+
+    if( pc )
+        dbus_pending_call_unref(pc);
+    if( req )
+        dbus_message_unref(req);
+
     return ret;
 }
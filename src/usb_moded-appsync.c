@@ -30,11 +30,11 @@
 #include "usb_moded-appsync.h"
 
 #include "usb_moded.h"
+#include "usb_moded-inicache.h"
 #include "usb_moded-log.h"
 #include "usb_moded-systemd.h"
 
 #include <unistd.h>
-#include <glob.h>
 
 /* ========================================================================= *
  * Types
@@ -62,6 +62,7 @@ typedef struct application_t
     app_state_t  state;    /**< marker to check if the app has started sucessfully */
     int          systemd;  /**< marker to know if we start it with systemd or not */
     int          post;     /**< marker to indicate when to start the app */
+    gchar      **after;    /**< names of apps that must be started first */
 } application_t;
 
 /* ========================================================================= *
@@ -73,17 +74,20 @@ typedef struct application_t
  * ------------------------------------------------------------------------- */
 
 static bool           application_is_valid  (const application_t *self);
-static application_t *application_load      (const char *filename);
+static application_t *application_load      (const inicache_t *cache, size_t file);
 static void           application_free      (application_t *self);
 static void           application_free_cb   (gpointer self);
 static gint           application_compare_cb(gconstpointer a, gconstpointer b);
+static bool           application_is_pending(const application_t *self, const char *mode, int post);
+static bool           application_equal     (const application_t *self, const application_t *that);
 
 /* ------------------------------------------------------------------------- *
  * APPLIST
  * ------------------------------------------------------------------------- */
 
 static void   applist_free(GList *list);
-static GList *applist_load(const char *conf_dir);
+static GList *applist_load(const char *conf_dir, const char *cache_name);
+static bool   applist_equal(GList *list1, GList *list2);
 
 /* ------------------------------------------------------------------------- *
  * APPSYNC
@@ -95,7 +99,11 @@ void            appsync_load_configuration        (void);
 int             appsync_activate_pre              (const char *mode);
 int             appsync_activate_post             (const char *mode);
 static int      appsync_mark_active_locked        (const char *name, int post);
+static bool     appsync_app_is_ready_locked       (const application_t *application, const char *mode, int post);
+static void     appsync_systemd_app_done_cb       (const char *unit, bool ok, void *aptr);
+static bool     appsync_start_systemd_apps_locked (const char *mode, int post);
 int             appsync_mark_active               (const char *name, int post);
+void            appsync_user_changed              (void);
 #ifdef APP_SYNC_DBUS
 static gboolean appsync_enumerate_usb_cb          (gpointer data);
 static void     appsync_start_enumerate_usb_timer (void);
@@ -162,25 +170,23 @@ static bool application_is_valid(const application_t *self)
     return self && self->name && self->mode && (self->systemd || self->launch);
 }
 
-/** Load application object from ini-file
+/** Load application object from cached ini-file
  *
- * @param filename  Path to an ini-file
+ * @param cache  Compiled appsync configuration cache
+ * @param file   Index of file within the cache
  *
  * @returns application object pointer, or NULL in case of errors
  */
-static application_t *application_load(const char *filename)
+static application_t *application_load(const inicache_t *cache, size_t file)
 {
     LOG_REGISTER_CONTEXT;
 
-    application_t *self   = NULL;
-    GKeyFile     *keyfile = NULL;
+    application_t *self     = NULL;
+    const char    *filename = inicache_path(cache, file);
 
     log_debug("loading appsync file: %s", filename);
 
-    if( !(keyfile = g_key_file_new()) )
-        goto cleanup;
-
-    if( !g_key_file_load_from_file(keyfile, filename, G_KEY_FILE_NONE, NULL) ) {
+    if( !inicache_valid(cache, file) ) {
         log_warning("failed to load appsync file: %s", filename);
         goto cleanup;
     }
@@ -188,28 +194,29 @@ static application_t *application_load(const char *filename)
     if( !(self = calloc(1, sizeof *self)) )
         goto cleanup;
 
-    self->name = g_key_file_get_string(keyfile, APP_INFO_ENTRY, APP_INFO_NAME_KEY, NULL);
+    self->name = inicache_get_string(cache, file, APP_INFO_ENTRY, APP_INFO_NAME_KEY);
     log_debug("Appname = %s\n", self->name ?: "<unset>");
 
-    self->launch = g_key_file_get_string(keyfile, APP_INFO_ENTRY, APP_INFO_LAUNCH_KEY, NULL);
+    self->launch = inicache_get_string(cache, file, APP_INFO_ENTRY, APP_INFO_LAUNCH_KEY);
     log_debug("Launch = %s\n", self->launch ?: "<unset>");
 
-    self->mode = g_key_file_get_string(keyfile, APP_INFO_ENTRY, APP_INFO_MODE_KEY, NULL);
+    self->mode = inicache_get_string(cache, file, APP_INFO_ENTRY, APP_INFO_MODE_KEY);
     log_debug("Launch mode = %s\n", self->mode ?: "<unset>");
 
-    self->systemd = g_key_file_get_integer(keyfile, APP_INFO_ENTRY, APP_INFO_SYSTEMD_KEY, NULL);
+    self->systemd = inicache_get_integer(cache, file, APP_INFO_ENTRY, APP_INFO_SYSTEMD_KEY);
     log_debug("Systemd control = %d\n", self->systemd);
 
-    self->post = g_key_file_get_integer(keyfile, APP_INFO_ENTRY, APP_INFO_POST, NULL);
+    self->post = inicache_get_integer(cache, file, APP_INFO_ENTRY, APP_INFO_POST);
     log_debug("post = %d\n", self->post);
 
+    self->after = inicache_get_string_list(cache, file, APP_INFO_ENTRY, APP_INFO_AFTER_KEY);
+    for( size_t i = 0; self->after && self->after[i]; ++i )
+        log_debug("after = %s\n", self->after[i]);
+
     self->state = APP_STATE_DONTCARE;
 
 cleanup:
 
-    if(keyfile)
-        g_key_file_free(keyfile);
-
     /* if a minimum set of required elements is not filled in we discard the list_item */
     if( self && !application_is_valid(self) ) {
         log_warning("discarding invalid appsync file: %s", filename);
@@ -232,6 +239,7 @@ static void application_free(application_t *self)
         g_free(self->name);
         g_free(self->launch);
         g_free(self->mode);
+        g_strfreev(self->after);
         free(self);
     }
 }
@@ -263,6 +271,57 @@ static gint application_compare_cb(gconstpointer a, gconstpointer b)
     return strcasecmp(application_a->name, application_b->name);
 }
 
+/** Predicate for: systemd application is still to be started
+ *
+ * @param self  Application object
+ * @param mode  Name of usb-mode being activated
+ * @param post  0=pre-enum phase, or 1=post-enum phase
+ *
+ * @return true if application belongs to the phase and is not active yet
+ */
+static bool application_is_pending(const application_t *self, const char *mode, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (self->systemd &&
+            self->post == post &&
+            self->state == APP_STATE_INACTIVE &&
+            !strcmp(self->mode, mode));
+}
+
+/** Predicate for: application objects have the same configuration
+ *
+ * Runtime state is ignored.
+ *
+ * @param self  Application object
+ * @param that  Application object
+ *
+ * @return true if configurations are equal, false otherwise
+ */
+static bool application_equal(const application_t *self, const application_t *that)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( g_strcmp0(self->name, that->name) ||
+        g_strcmp0(self->mode, that->mode) ||
+        g_strcmp0(self->launch, that->launch) ||
+        self->systemd != that->systemd ||
+        self->post != that->post )
+        return false;
+
+    guint n1 = self->after ? g_strv_length(self->after) : 0;
+    guint n2 = that->after ? g_strv_length(that->after) : 0;
+    if( n1 != n2 )
+        return false;
+
+    for( guint i = 0; i < n1; ++i ) {
+        if( strcmp(self->after[i], that->after[i]) )
+            return false;
+    }
+
+    return true;
+}
+
 /* ========================================================================= *
  * APPLIST
  * ========================================================================= */
@@ -278,29 +337,26 @@ static void applist_free(GList *list)
 
 /** Load a list of application objects
  *
- * @param conf_dir  Path to directory containing ini-files
+ * @param conf_dir    Path to directory containing ini-files
+ * @param cache_name  Name of compiled cache for conf_dir
  *
  * @returns list of application objects, or
  *          NULL if no files were present / could be loaded
  */
-static GList *applist_load(const char *conf_dir)
+static GList *applist_load(const char *conf_dir, const char *cache_name)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList *list = 0;
-    gchar *pat  = 0;
-    glob_t gb   = {};
+    GList      *list  = 0;
+    inicache_t *cache = inicache_open(conf_dir, cache_name);
 
-    if( !(pat = g_strdup_printf("%s/*.ini", conf_dir)) )
-        goto cleanup;
-
-    if( glob(pat, 0, 0, &gb) != 0 ) {
+    if( inicache_count(cache) == 0 ) {
         log_debug("no appsync ini-files found");
         goto cleanup;
     }
 
-    for( size_t i = 0; i < gb.gl_pathc; ++i ) {
-        application_t *application = application_load(gb.gl_pathv[i]);
+    for( size_t i = 0; i < inicache_count(cache); ++i ) {
+        application_t *application = application_load(cache, i);
         if( application )
             list = g_list_append(list, application);
     }
@@ -312,12 +368,30 @@ static GList *applist_load(const char *conf_dir)
     }
 
 cleanup:
-    globfree(&gb);
-    g_free(pat);
+    inicache_close(cache);
 
     return list;
 }
 
+/** Predicate for: lists of application objects are equal
+ *
+ * @param list1  List of objects, or NULL
+ * @param list2  List of objects, or NULL
+ *
+ * @return true if lists have equal configuration, false otherwise
+ */
+static bool applist_equal(GList *list1, GList *list2)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( ; list1 && list2; list1 = list1->next, list2 = list2->next ) {
+        if( !application_equal(list1->data, list2->data) )
+            return false;
+    }
+
+    return !list1 && !list2;
+}
+
 /* ========================================================================= *
  * APPSYNC
  * ========================================================================= */
@@ -368,7 +442,8 @@ void appsync_free_configuration(void)
 /** Load appsync configuration data
  *
  * Appsync configuration files are read on usb-moded startup and whenever
- * SIGHUP is sent to usb-moded.
+ * SIGHUP is sent to usb-moded or changes in the configuration directory
+ * are detected. Reloading configuration that has not changed is a no-op.
  *
  * Appsync configuration data is stateful and accessed both from worker
  * and control threads. Due to this special care must be taken when
@@ -381,12 +456,20 @@ void appsync_load_configuration(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    GList *applist = applist_load(usbmoded_get_diag_mode() ?
-                                  CONF_DIR_DIAG_PATH : CONF_DIR_PATH);
+    bool   diag    = usbmoded_get_diag_mode();
+    GList *applist = applist_load(diag ? CONF_DIR_DIAG_PATH : CONF_DIR_PATH,
+                                  diag ? CONF_CACHE_DIAG_NAME : CONF_CACHE_NAME);
 
     APPSYNC_LOCKED_ENTER;
 
-    if( !appsync_apps_curr ) {
+    /* Nothing to do if the configuration that would be replaced
+     * has the same content */
+    GList *prev = appsync_apps_updated ? appsync_apps_next : appsync_apps_curr;
+    if( prev && applist_equal(prev, applist) ) {
+        log_debug("Appsync config not changed");
+        applist_free(applist);
+    }
+    else if( !appsync_apps_curr ) {
         log_debug("Update current appsync config");
         appsync_apps_curr = applist;
 
@@ -486,7 +569,13 @@ int appsync_activate_pre(const char *mode)
     appsync_start_enumerate_usb_timer();
 #endif
 
-    /* go through list and launch apps */
+    /* launch systemd apps */
+    if( !appsync_start_systemd_apps_locked(mode, 0) ) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    /* go through list and launch dbus apps */
     for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) )
     {
         application_t *application = iter->data;
@@ -497,17 +586,12 @@ int appsync_activate_pre(const char *mode)
             {
                 continue;
             }
-            log_debug("launching pre-enum-app %s", application->name);
             if(application->systemd)
             {
-                if(!systemd_control_service(application->name, SYSTEMD_START)) {
-                    log_debug("systemd pre-enum-app %s failed", application->name);
-                    ret = 1;
-                    goto cleanup;
-                }
-                appsync_mark_active_locked(application->name, 0);
+                continue;
             }
-            else if(application->launch)
+            log_debug("launching pre-enum-app %s", application->name);
+            if(application->launch)
             {
                 /* skipping if dbus session bus is not available,
                  * or not compiled in */
@@ -522,12 +606,12 @@ int appsync_activate_pre(const char *mode)
                     continue;
                 }
 #ifdef APP_SYNC_DBUS
-                if( dbusappsync_launch_app(application->launch) != 0 ) {
+                /* Gets marked active when launch reply arrives */
+                if( dbusappsync_launch_app(application->name, application->launch, 0) != 0 ) {
                     log_debug("dbus pre-enum-app %s failed", application->name);
                     ret = 1;
                     goto cleanup;
                 }
-                appsync_mark_active_locked(application->name, 0);
 #endif /* APP_SYNC_DBUS */
             }
         }
@@ -572,7 +656,13 @@ int appsync_activate_post(const char *mode)
     }
 #endif /* APP_SYNC_DBUS */
 
-    /* go through list and launch apps */
+    /* launch systemd apps */
+    if( !appsync_start_systemd_apps_locked(mode, 1) ) {
+        ret = 1;
+        goto cleanup;
+    }
+
+    /* go through list and launch dbus apps */
     for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) )
     {
         application_t *application = iter->data;
@@ -582,16 +672,11 @@ int appsync_activate_post(const char *mode)
             if(!application->post)
                 continue;
 
+            if( application->systemd )
+                continue;
+
             log_debug("launching post-enum-app %s\n", application->name);
-            if( application->systemd ) {
-                if(!systemd_control_service(application->name, SYSTEMD_START)) {
-                    log_err("systemd post-enum-app %s failed", application->name);
-                    ret = 1;
-                    break;
-                }
-                appsync_mark_active_locked(application->name, 1);
-            }
-            else if( application->launch ) {
+            if( application->launch ) {
                 /* skipping if dbus session bus is not available,
                  * or not compiled in */
                 if( appsync_no_dbus ) {
@@ -599,12 +684,12 @@ int appsync_activate_post(const char *mode)
                     continue;
                 }
 #ifdef APP_SYNC_DBUS
-                if( dbusappsync_launch_app(application->launch) != 0 ) {
+                /* Gets marked active when launch reply arrives */
+                if( dbusappsync_launch_app(application->name, application->launch, 1) != 0 ) {
                     log_err("dbus post-enum-app %s failed", application->name);
                     ret = 1;
                     break;
                 }
-                appsync_mark_active_locked(application->name, 1);
 #endif /* APP_SYNC_DBUS */
             }
         }
@@ -669,6 +754,123 @@ static int appsync_mark_active_locked(const char *name, int post)
     return ret;
 }
 
+/** Predicate for: all applications this one depends on have been started
+ *
+ * Only dependencies that are part of the same activation phase are
+ * considered - others are either already running or not relevant
+ * for the mode.
+ *
+ * @param application  Application object
+ * @param mode         Name of usb-mode being activated
+ * @param post         0=pre-enum phase, or 1=post-enum phase
+ *
+ * @note Assumes that appsync configuration data is already locked.
+ *
+ * @return true if application can be started, false otherwise
+ */
+static bool appsync_app_is_ready_locked(const application_t *application,
+                                        const char *mode, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; application->after && application->after[i]; ++i ) {
+        for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) ) {
+            const application_t *other = iter->data;
+            if( other != application &&
+                !strcmp(other->name, application->after[i]) &&
+                application_is_pending(other, mode, post) )
+                return false;
+        }
+    }
+    return true;
+}
+
+/** Systemd batch callback for handling application start results
+ *
+ * @param unit  Application name
+ * @param ok    true if start job was accepted by systemd
+ * @param aptr  0=pre-enum app, or 1=post-enum app
+ */
+static void appsync_systemd_app_done_cb(const char *unit, bool ok, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int post = GPOINTER_TO_INT(aptr);
+
+    if( ok )
+        appsync_mark_active_locked(unit, post);
+    else
+        log_err("systemd %s-enum-app %s failed", post ? "post" : "pre", unit);
+}
+
+/** Start systemd applications of an activation phase
+ *
+ * Start jobs for all applications that have no unmet "after"
+ * dependencies are submitted to systemd together and the replies
+ * are waited for as a batch. Then the same is repeated for
+ * applications whose dependencies got satisfied, until everything
+ * has been started or a failure occurs.
+ *
+ * @param mode  Name of usb-mode being activated
+ * @param post  0=pre-enum phase, or 1=post-enum phase
+ *
+ * @note Assumes that appsync configuration data is already locked.
+ *
+ * @return true if all applications were started, false otherwise
+ */
+static bool appsync_start_systemd_apps_locked(const char *mode, int post)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool             ack   = true;
+    systemd_batch_t *batch = 0;
+
+    for( ;; ) {
+        int pending = 0;
+        int ready   = 0;
+
+        for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) ) {
+            const application_t *application = iter->data;
+            if( !application_is_pending(application, mode, post) )
+                continue;
+            ++pending;
+            if( appsync_app_is_ready_locked(application, mode, post) )
+                ++ready;
+        }
+
+        if( pending == 0 )
+            break;
+
+        if( ready == 0 )
+            log_warning("circular appsync dependencies; starting remaining "
+                        "%s-enum-apps in one go", post ? "post" : "pre");
+
+        if( !batch )
+            batch = systemd_batch_create(SYSTEMD_MANAGER_SYSTEM);
+
+        for( GList *iter = appsync_apps_curr; iter; iter = g_list_next(iter) ) {
+            const application_t *application = iter->data;
+            if( !application_is_pending(application, mode, post) )
+                continue;
+            if( ready && !appsync_app_is_ready_locked(application, mode, post) )
+                continue;
+            log_debug("launching %s-enum-app %s", post ? "post" : "pre",
+                      application->name);
+            systemd_batch_add(batch, application->name, SYSTEMD_START);
+        }
+
+        if( !systemd_batch_wait(batch, appsync_systemd_app_done_cb,
+                                GINT_TO_POINTER(post)) ) {
+            ack = false;
+            break;
+        }
+    }
+
+    systemd_batch_delete(batch);
+
+    return ack;
+}
+
 /** Set application state as successfully started
  *
  * @param name  Application name
@@ -698,6 +900,31 @@ int appsync_mark_active(const char *name, int post)
     return ret;
 }
 
+/** React to changes in the user using the device
+ *
+ * D-Bus activated applications are launched via session bus of the
+ * current user. Re-establish the connection ahead of time, so that
+ * it is ready to use when the next mode gets activated.
+ */
+void appsync_user_changed(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+#ifdef APP_SYNC_DBUS
+    APPSYNC_LOCKED_ENTER;
+
+    /* Session of the new user might work even if the previous did not */
+    appsync_no_dbus = 0;
+
+    if( appsync_apps_curr )
+        dbusappsync_init_connection();
+    else
+        dbusappsync_cleanup();
+
+    APPSYNC_LOCKED_LEAVE;
+#endif
+}
+
 #ifdef APP_SYNC_DBUS
 static gboolean appsync_enumerate_usb_cb(gpointer data)
 {
@@ -754,8 +981,7 @@ static void appsync_enumerate_usb(void)
     timersub(&tv, &appsync_sync_tv, &tv);
     log_debug("sync to enum: %.3f seconds", tv.tv_sec + tv.tv_usec * 1e-6);
 
-    /* remove dbus service */
-    dbusappsync_cleanup();
+    /* Note: Session bus connection is kept for the next activation */
 }
 #endif /* APP_SYNC_DBUS */
 
@@ -846,9 +1072,10 @@ void appsync_deactivate_all(bool force)
     /* Then pre-apps */
     appsync_stop_apps(0);
 
-    /* Do not leave active timers behind */
+    /* Do not leave active timers or pending launches behind */
 #ifdef APP_SYNC_DBUS
     appsync_cancel_enumerate_usb_timer();
+    dbusappsync_cancel_launches();
 #endif
 
     APPSYNC_LOCKED_LEAVE;
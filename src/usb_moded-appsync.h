@@ -38,12 +38,17 @@
 # define CONF_DIR_PATH          "/etc/usb-moded/run"
 # define CONF_DIR_DIAG_PATH     "/etc/usb-moded/run-diag"
 
+/** Names of compiled caches for CONF_DIR_PATH and CONF_DIR_DIAG_PATH */
+# define CONF_CACHE_NAME        "appsync.cache"
+# define CONF_CACHE_DIAG_NAME   "appsync-diag.cache"
+
 # define APP_INFO_ENTRY         "info"
 # define APP_INFO_MODE_KEY      "mode"
 # define APP_INFO_NAME_KEY      "name"
 # define APP_INFO_LAUNCH_KEY    "launch"
 # define APP_INFO_SYSTEMD_KEY   "systemd"  // integer
 # define APP_INFO_POST          "post"     // integer
+# define APP_INFO_AFTER_KEY     "after"    // string list
 
 /* ========================================================================= *
  * Prototypes
@@ -59,6 +64,7 @@ void appsync_load_configuration  (void);
 int  appsync_activate_pre        (const char *mode);
 int  appsync_activate_post       (const char *mode);
 int  appsync_mark_active         (const char *name, int post);
+void appsync_user_changed        (void);
 void appsync_deactivate_pre      (void);
 void appsync_deactivate_post     (void);
 void appsync_deactivate_all      (bool force);
@@ -31,12 +31,26 @@
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-trace.h"
 #include "usb_moded-worker.h"
 
 #include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <signal.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** How long to wait for a subprocess to exit after SIGTERM [ms] */
+#define COMMON_SPAWN_GRACE_MS 500
 
 /* ========================================================================= *
  * Types
@@ -45,7 +59,7 @@
 /** Mapping usb mode from internal to hardware/broadcast use */
 typedef struct modemapping_t
 {
-    /** Any valid usb mode */
+    /** Internal mode name */
     const char *internal_mode;
 
     /** Mode to use for usb configuration, or NULL = internal */
@@ -53,8 +67,34 @@ typedef struct modemapping_t
 
     /** Mode to use for D-Bus broadcast, or NULL = internal */
     const char *external_mode;
+
+    /** Flag for: mode is static i.e. implies charging */
+    bool        is_static;
 } modemapping_t;
 
+/** Wakelock bookkeeping data
+ */
+typedef struct common_wakelock_t
+{
+    /** Number of active acquire calls */
+    unsigned    count;
+
+    /** Number of times the wakelock has been taken in sysfs */
+    unsigned    acquired;
+
+    /** When the wakelock was taken [ms] */
+    int64_t     held_since;
+
+    /** When the wakelock was last written to sysfs [ms] */
+    int64_t     written_at;
+
+    /** Total time the wakelock has been held [ms] */
+    int64_t     held_total;
+
+    /** Longest time the wakelock has been held [ms] */
+    int64_t     held_max;
+} common_wakelock_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -69,24 +109,46 @@ const char *cable_state_repr(cable_state_t state);
  * COMMON
  * ------------------------------------------------------------------------- */
 
-const char  *common_map_mode_to_hardware         (const char *internal_mode);
-const char  *common_map_mode_to_external         (const char *internal_mode);
-void         common_send_supported_modes_signal  (void);
-void         common_send_available_modes_signal  (void);
-void         common_send_hidden_modes_signal     (void);
-void         common_send_whitelisted_modes_signal(void);
-static void  common_write_to_sysfs_file          (const char *path, const char *text);
-void         common_acquire_wakelock             (const char *wakelock_name);
-void         common_release_wakelock             (const char *wakelock_name);
-int          common_system_                      (const char *file, int line, const char *func, const char *command);
-FILE        *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
-waitres_t    common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
-bool         common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
-static bool  common_mode_in_list                 (const char *mode, char *const *modes);
-bool         common_modename_is_internal         (const char *modename);
-bool         common_modename_is_static           (const char *modename);
-int          common_valid_mode                   (const char *mode);
-gchar       *common_get_mode_list                (mode_list_type_t type, uid_t uid);
+static void               common_mode_atom_init               (void);
+mode_atom_t               common_mode_atom                    (const char *modename);
+const char               *common_mode_atom_name               (mode_atom_t atom);
+bool                      common_mode_atom_is_static          (mode_atom_t atom);
+const char               *common_map_mode_to_hardware         (const char *internal_mode);
+const char               *common_map_mode_to_external         (const char *internal_mode);
+void                      common_send_supported_modes_signal  (void);
+void                      common_send_available_modes_signal  (void);
+void                      common_send_hidden_modes_signal     (void);
+void                      common_send_whitelisted_modes_signal(void);
+static void               common_write_to_sysfs_fd            (int *pfd, const char *path, const char *text);
+static common_wakelock_t *common_wakelock_get                 (const char *wakelock_name);
+static void               common_wakelock_write               (const char *wakelock_name, common_wakelock_t *wakelock);
+void                      common_acquire_wakelock             (const char *wakelock_name);
+void                      common_renew_wakelock               (const char *wakelock_name);
+void                      common_release_wakelock             (const char *wakelock_name);
+void                      common_wakelock_quit                (void);
+static int64_t            common_wakelock_now                 (void);
+static int                common_exec_result                  (const char *file, int line, const char *func, const char *command, int status);
+int                       common_system_                      (const char *file, int line, const char *func, const char *command);
+static int                common_spawn_pidfd                  (pid_t pid);
+static bool               common_spawn_reap                   (pid_t pid, int *status);
+static void               common_spawn_kill                   (pid_t pid, int pidfd, int *status);
+int                       common_spawn_                       (const char *file, int line, const char *func, unsigned tmo_ms, const char *input, const char *const *argv);
+static bool               common_wait_poll                    (int fd, int tmo);
+waitres_t                 common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
+waitres_t                 common_wait_path                    (unsigned tot_ms, const char *path, bool (*ready_cb)(void *aptr), void *aptr);
+bool                      common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
+bool                      common_file_has_value               (const char *path, const char *value);
+bool                      common_udc_is_configured            (void);
+static bool               common_mode_in_list                 (const char *mode, char *const *modes);
+bool                      common_modename_is_internal         (const char *modename);
+bool                      common_modename_is_static           (const char *modename);
+int                       common_valid_mode                   (const char *mode);
+static gchar             *common_build_mode_list              (mode_list_type_t type, uid_t uid);
+gchar                    *common_get_mode_list                (mode_list_type_t type, uid_t uid);
+const char               *common_peek_mode_list               (mode_list_type_t type, uid_t uid);
+static void               common_mode_list_flush              (void);
+void                      common_mode_list_quit               (void);
+static bool               common_mode_list_changed            (gchar **prev, const char *curr);
 
 /* ========================================================================= *
  * Functions
@@ -113,94 +175,177 @@ const char *cable_state_repr(cable_state_t state)
  * MODE_MAPPING
  * ------------------------------------------------------------------------- */
 
-static const modemapping_t common_modemapping[] =
+/** Mode mapping table, indexed by mode atom
+ *
+ * Dynamic modes are used as is for both hardware and D-Bus purposes.
+ */
+static const modemapping_t common_modemapping[MODE_ATOM_NUMOF] =
 {
-    {
-        .internal_mode = MODE_UNDEFINED,
-        .hardware_mode = MODE_CHARGING,
-        .external_mode = 0,
-    },
-    {
-        .internal_mode = MODE_ASK,
-        .hardware_mode = MODE_CHARGING,
-        .external_mode = 0,
-    },
-    {
-        .internal_mode = MODE_MASS_STORAGE,
-        .hardware_mode = 0,
-        .external_mode = 0,
-    },
-    {
-        .internal_mode = MODE_DEVELOPER,
-        .hardware_mode = 0,
-        .external_mode = 0,
-    },
-    {
-        .internal_mode = MODE_MTP,
-        .hardware_mode = 0,
-        .external_mode = 0,
-    },
-    {
-        .internal_mode = MODE_HOST,
-        .hardware_mode = 0,
-        .external_mode = 0,
-    },
-    {
-        .internal_mode = MODE_CONNECTION_SHARING,
-        .hardware_mode = 0,
-        .external_mode = 0,
-    },
-    {
-        .internal_mode = MODE_DIAG,
+    [MODE_ATOM_DYNAMIC] = {
+        .internal_mode = 0,
         .hardware_mode = 0,
         .external_mode = 0,
+        .is_static     = false,
     },
-    {
-        .internal_mode = MODE_ADB,
-        .hardware_mode = 0,
+    [MODE_ATOM_UNDEFINED] = {
+        .internal_mode = MODE_UNDEFINED,
+        .hardware_mode = MODE_CHARGING,
         .external_mode = 0,
+        .is_static     = true,
     },
-    {
-        .internal_mode = MODE_PC_SUITE,
+    [MODE_ATOM_BUSY] = {
+        .internal_mode = MODE_BUSY,
         .hardware_mode = 0,
         .external_mode = 0,
+        .is_static     = false,
     },
-    {
-        .internal_mode = MODE_CHARGING,
+    [MODE_ATOM_CHARGER] = {
+        .internal_mode = MODE_CHARGER,
         .hardware_mode = MODE_CHARGING,
         .external_mode = 0,
+        .is_static     = true,
     },
-    {
+    [MODE_ATOM_CHARGING_FALLBACK] = {
         .internal_mode = MODE_CHARGING_FALLBACK,
         .hardware_mode = MODE_CHARGING,
         .external_mode = 0,
+        .is_static     = true,
     },
-    {
-        .internal_mode = MODE_CHARGER,
+    [MODE_ATOM_ASK] = {
+        .internal_mode = MODE_ASK,
         .hardware_mode = MODE_CHARGING,
         .external_mode = 0,
+        .is_static     = false,
     },
-    // sentinel
-    {
-        .internal_mode = 0,
-        .hardware_mode = 0,
+    [MODE_ATOM_CHARGING] = {
+        .internal_mode = MODE_CHARGING,
+        .hardware_mode = MODE_CHARGING,
         .external_mode = 0,
-    }
+        .is_static     = true,
+    },
 };
 
+/** Lookup table for mapping mode names to mode atoms
+ *
+ * Populated once and then accessed read only from multiple threads.
+ */
+static GHashTable *common_mode_atom_lut = 0;
+
+/** Memoized mode lists: [SUPPORTED|AVAILABLE] -> (uid -> mode list) */
+static GHashTable *common_mode_list_cache[2] = { 0, 0 };
+
+/** Configuration generation #common_mode_list_cache is based on */
+static unsigned    common_mode_list_cache_config_gen = 0;
+
+/** Mode list generation #common_mode_list_cache is based on */
+static unsigned    common_mode_list_cache_modelist_gen = 0;
+
+/** Diag mode state #common_mode_list_cache is based on */
+static bool        common_mode_list_cache_diag_mode = false;
+
+/** Wakelock name -> common_wakelock_t lookup table */
+static GHashTable *common_wakelock_lut = 0;
+
+/** Cached file descriptors for wakelock sysfs files */
+static int         common_wakelock_fd   = -1;
+static int         common_wakeunlock_fd = -1;
+
+/** Last values broadcast via mode list D-Bus signals */
+static gchar      *common_sent_supported_modes   = 0;
+static gchar      *common_sent_available_modes   = 0;
+static gchar      *common_sent_hidden_modes      = 0;
+static gchar      *common_sent_whitelisted_modes = 0;
+
+/** Populate mode name to mode atom lookup table
+ */
+static void
+common_mode_atom_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static gsize done = 0;
+
+    if( g_once_init_enter(&done) ) {
+        GHashTable *lut = g_hash_table_new(g_str_hash, g_str_equal);
+        for( int atom = 0; atom < MODE_ATOM_NUMOF; ++atom ) {
+            const char *name = common_modemapping[atom].internal_mode;
+            if( name )
+                g_hash_table_insert(lut, (gpointer)name, GINT_TO_POINTER(atom));
+        }
+        common_mode_atom_lut = lut;
+        g_once_init_leave(&done, 1);
+    }
+}
+
+/** Map mode name to mode atom
+ *
+ * Note: This function is safe to call from worker thread too.
+ *
+ * @param modename  Mode name, or NULL
+ *
+ * @return mode atom, or MODE_ATOM_DYNAMIC for non-internal modes
+ */
+mode_atom_t
+common_mode_atom(const char *modename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    mode_atom_t atom = MODE_ATOM_DYNAMIC;
+
+    if( modename ) {
+        common_mode_atom_init();
+        atom = GPOINTER_TO_INT(g_hash_table_lookup(common_mode_atom_lut,
+                                                   modename));
+    }
+    return atom;
+}
+
+/** Map mode atom to mode name
+ *
+ * @param atom  Mode atom
+ *
+ * @return mode name, or NULL for MODE_ATOM_DYNAMIC
+ */
+const char *
+common_mode_atom_name(mode_atom_t atom)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *name = 0;
+
+    if( atom >= 0 && atom < MODE_ATOM_NUMOF )
+        name = common_modemapping[atom].internal_mode;
+
+    return name;
+}
+
+/** Check if mode atom refers to a static i.e. charging mode
+ *
+ * @param atom  Mode atom
+ *
+ * @return true if mode is static, false otherwise
+ */
+bool
+common_mode_atom_is_static(mode_atom_t atom)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool is_static = false;
+
+    if( atom >= 0 && atom < MODE_ATOM_NUMOF )
+        is_static = common_modemapping[atom].is_static;
+
+    return is_static;
+}
+
 const char *
 common_map_mode_to_hardware(const char *internal_mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    const char *hardware_mode = 0;
+    mode_atom_t atom          = common_mode_atom(internal_mode);
+    const char *hardware_mode = common_modemapping[atom].hardware_mode;
 
-    for( size_t i = 0; common_modemapping[i].internal_mode; ++i ) {
-        if( strcmp(common_modemapping[i].internal_mode, internal_mode) )
-            continue;
-        hardware_mode = common_modemapping[i].hardware_mode;
-        break;
-    }
     return hardware_mode ?: internal_mode;
 }
 
@@ -209,14 +354,9 @@ common_map_mode_to_external(const char *internal_mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    const char *external_mode = 0;
+    mode_atom_t atom          = common_mode_atom(internal_mode);
+    const char *external_mode = common_modemapping[atom].external_mode;
 
-    for( size_t i = 0; common_modemapping[i].internal_mode; ++i ) {
-        if( strcmp(common_modemapping[i].internal_mode, internal_mode) )
-            continue;
-        external_mode = common_modemapping[i].external_mode;
-        break;
-    }
     return external_mode ?: internal_mode;
 }
 
@@ -230,9 +370,9 @@ void common_send_supported_modes_signal(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    gchar *mode_list = common_get_mode_list(SUPPORTED_MODES_LIST, 0);
-    umdbus_send_supported_modes_signal(mode_list);
-    g_free(mode_list);
+    const char *mode_list = common_peek_mode_list(SUPPORTED_MODES_LIST, 0);
+    if( common_mode_list_changed(&common_sent_supported_modes, mode_list) )
+        umdbus_send_supported_modes_signal(mode_list);
 }
 
 /** Send available modes signal
@@ -241,9 +381,9 @@ void common_send_available_modes_signal(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    gchar *mode_list = common_get_mode_list(AVAILABLE_MODES_LIST, 0);
-    umdbus_send_available_modes_signal(mode_list);
-    g_free(mode_list);
+    const char *mode_list = common_peek_mode_list(AVAILABLE_MODES_LIST, 0);
+    if( common_mode_list_changed(&common_sent_available_modes, mode_list) )
+        umdbus_send_available_modes_signal(mode_list);
 }
 
 /** Send hidden modes signal
@@ -253,7 +393,8 @@ void common_send_hidden_modes_signal(void)
     LOG_REGISTER_CONTEXT;
 
     gchar *mode_list = config_get_hidden_modes();
-    umdbus_send_hidden_modes_signal(mode_list);
+    if( common_mode_list_changed(&common_sent_hidden_modes, mode_list) )
+        umdbus_send_hidden_modes_signal(mode_list);
     g_free(mode_list);
 }
 
@@ -264,7 +405,8 @@ void common_send_whitelisted_modes_signal(void)
     LOG_REGISTER_CONTEXT;
 
     gchar *mode_list = config_get_mode_whitelist();
-    umdbus_send_whitelisted_modes_signal(mode_list);
+    if( common_mode_list_changed(&common_sent_whitelisted_modes, mode_list) )
+        umdbus_send_whitelisted_modes_signal(mode_list);
     g_free(mode_list);
 }
 
@@ -272,42 +414,86 @@ void common_send_whitelisted_modes_signal(void)
  * SYSFS_IO
  * ------------------------------------------------------------------------- */
 
-/** Write string to already existing sysfs file
+/** Write string to already existing sysfs file via cached fd
+ *
+ * The file is opened on first use and then kept open.
  *
  * Note: Attempts to write to nonexisting files are silently ignored.
  *
+ * @param pfd  Where file descriptor is cached, -1 = not opened yet,
+ *             -2 = file does not exist
  * @param path Where to write
  * @param text What to write
  */
-static void common_write_to_sysfs_file(const char *path, const char *text)
+static void common_write_to_sysfs_fd(int *pfd, const char *path, const char *text)
 {
     LOG_REGISTER_CONTEXT;
 
-    int fd = -1;
-
-    if (!path || !text)
+    if (!path || !text || *pfd == -2)
         goto EXIT;
 
-    if ((fd = open(path, O_WRONLY)) == -1) {
-        if (errno != ENOENT) {
+    if (*pfd == -1 && (*pfd = open(path, O_WRONLY | O_CLOEXEC)) == -1) {
+        if (errno == ENOENT)
+            *pfd = -2;
+        else
             log_warning("%s: open for writing failed: %m", path);
-        }
         goto EXIT;
     }
 
-    if (write(fd, text, strlen(text)) == -1) {
+    if (write(*pfd, text, strlen(text)) == -1) {
         log_warning("%s: write failed : %m", path);
         goto EXIT;
     }
 EXIT:
-    if (fd != -1)
-        close(fd);
+    return;
 }
 
 /* ------------------------------------------------------------------------- *
  * WAKELOCKS
  * ------------------------------------------------------------------------- */
 
+/** Lookup wakelock bookkeeping data, create if needed
+ *
+ * @param wakelock_name Name of wake lock
+ *
+ * @return wakelock object
+ */
+static common_wakelock_t *common_wakelock_get(const char *wakelock_name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    common_wakelock_t *wakelock = 0;
+
+    if( !common_wakelock_lut )
+        common_wakelock_lut = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                    g_free, g_free);
+
+    if( !(wakelock = g_hash_table_lookup(common_wakelock_lut, wakelock_name)) ) {
+        wakelock = g_malloc0(sizeof *wakelock);
+        g_hash_table_insert(common_wakelock_lut, g_strdup(wakelock_name),
+                            wakelock);
+    }
+
+    return wakelock;
+}
+
+/** Write wakelock with automatic termination timeout to sysfs
+ *
+ * @param wakelock_name Name of wake lock
+ * @param wakelock      Bookkeeping data
+ */
+static void common_wakelock_write(const char *wakelock_name, common_wakelock_t *wakelock)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char buff[256];
+    snprintf(buff, sizeof buff, "%s %lld",
+             wakelock_name,
+             USB_MODED_SUSPEND_DELAY_MAXIMUM_MS * 1000000LL);
+    common_write_to_sysfs_fd(&common_wakelock_fd, "/sys/power/wake_lock", buff);
+    wakelock->written_at = common_wakelock_now();
+}
+
 /** Acquire wakelock via sysfs
  *
  * Wakelock must be released via common_release_wakelock().
@@ -316,26 +502,63 @@ EXIT:
  * do not block suspend  indefinately in case usb_moded
  * gets stuck or crashes.
  *
+ * Acquiring is reference counted and sysfs is written only when
+ * the wakelock is not already held - or when the automatic
+ * termination is getting closer than half the timeout.
+ *
  * Note: The name should be unique within the system.
  *
+ * Note: This function should be called only from the main thread.
+ *
  * @param wakelock_name Wake lock to be acquired
  */
 void common_acquire_wakelock(const char *wakelock_name)
 {
     LOG_REGISTER_CONTEXT;
 
-    char buff[256];
-    snprintf(buff, sizeof buff, "%s %lld",
-             wakelock_name,
-             USB_MODED_SUSPEND_DELAY_MAXIMUM_MS * 1000000LL);
-    common_write_to_sysfs_file("/sys/power/wake_lock", buff);
+    common_wakelock_t *wakelock = common_wakelock_get(wakelock_name);
+
+    if( wakelock->count++ == 0 ) {
+        wakelock->held_since = common_wakelock_now();
+        wakelock->acquired += 1;
+        common_wakelock_write(wakelock_name, wakelock);
+    }
+    else {
+        common_renew_wakelock(wakelock_name);
+    }
 
 #if VERBOSE_WAKELOCKING
-    log_debug("common_acquire_wakelock %s", wakelock_name);
+    log_debug("common_acquire_wakelock %s (count=%u)", wakelock_name,
+              wakelock->count);
 #endif
 }
 
+/** Extend automatic termination timeout of already held wakelock
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param wakelock_name Wake lock to be renewed
+ */
+void common_renew_wakelock(const char *wakelock_name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    common_wakelock_t *wakelock = common_wakelock_get(wakelock_name);
+
+    if( !wakelock->count )
+        goto EXIT;
+
+    int64_t elapsed = common_wakelock_now() - wakelock->written_at;
+    if( elapsed >= USB_MODED_SUSPEND_DELAY_MAXIMUM_MS / 2 )
+        common_wakelock_write(wakelock_name, wakelock);
+
+EXIT:
+    return;
+}
+
 /** Release wakelock via sysfs
+ *
+ * Note: This function should be called only from the main thread.
  *
  * @param wakelock_name Wake lock to be released
  */
@@ -343,34 +566,106 @@ void common_release_wakelock(const char *wakelock_name)
 {
     LOG_REGISTER_CONTEXT;
 
+    common_wakelock_t *wakelock = common_wakelock_get(wakelock_name);
+
 #if VERBOSE_WAKELOCKING
-    log_debug("common_release_wakelock %s", wakelock_name);
+    log_debug("common_release_wakelock %s (count=%u)", wakelock_name,
+              wakelock->count);
 #endif
 
-    common_write_to_sysfs_file("/sys/power/wake_unlock", wakelock_name);
+    if( !wakelock->count ) {
+        log_warning("wakelock %s released while not held", wakelock_name);
+        goto EXIT;
+    }
+
+    if( --wakelock->count == 0 ) {
+        int64_t held = common_wakelock_now() - wakelock->held_since;
+        wakelock->held_total += held;
+        if( wakelock->held_max < held )
+            wakelock->held_max = held;
+
+        common_write_to_sysfs_fd(&common_wakeunlock_fd,
+                                 "/sys/power/wake_unlock", wakelock_name);
+    }
+
+EXIT:
+    return;
+}
+
+/** Log wakelock statistics, release held wakelocks and close sysfs files
+ *
+ * Meant to be called on usb-moded exit so that wakelocks
+ * are not left behind.
+ */
+void common_wakelock_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( common_wakelock_lut ) {
+        GHashTableIter iter;
+        gpointer       key, val;
+
+        g_hash_table_iter_init(&iter, common_wakelock_lut);
+        while( g_hash_table_iter_next(&iter, &key, &val) ) {
+            common_wakelock_t *wakelock = val;
+
+            if( wakelock->count ) {
+                wakelock->count = 1;
+                common_release_wakelock(key);
+            }
+
+            log_notice("wakelock %s: acquired %u times, held %lld ms total,"
+                       " %lld ms max", (const char *)key, wakelock->acquired,
+                       (long long)wakelock->held_total,
+                       (long long)wakelock->held_max);
+        }
+
+        g_hash_table_unref(common_wakelock_lut),
+            common_wakelock_lut = 0;
+    }
+
+    if( common_wakelock_fd >= 0 )
+        close(common_wakelock_fd);
+    common_wakelock_fd = -1;
+
+    if( common_wakeunlock_fd >= 0 )
+        close(common_wakeunlock_fd);
+    common_wakeunlock_fd = -1;
+}
+
+/** Get monotonic timestamp in milliseconds for wakelock bookkeeping
+ */
+static int64_t common_wakelock_now(void)
+{
+    return g_get_monotonic_time() / 1000;
 }
 
 /* ------------------------------------------------------------------------- *
  * BLOCKING_OPERATION
  * ------------------------------------------------------------------------- */
 
-/** Wrapper to give visibility to blocking system() calls usb-moded is making
+/** Log outcome of a subprocess usb-moded has executed
+ *
+ * @param file     source file of the caller
+ * @param line     source line of the caller
+ * @param func     function name of the caller
+ * @param command  command line, for logging purposes
+ * @param status   wait status, or -1 if the command could not be executed
+ *
+ * @return exit code of the command, or -1 if it did not exit normally
  */
-int
-common_system_(const char *file, int line, const char *func,
-               const char *command)
+static int
+common_exec_result(const char *file, int line, const char *func,
+                   const char *command, int status)
 {
     LOG_REGISTER_CONTEXT;
 
     int         result      = -1;
-    int         status      = -1;
     char        exited[32]  = "";
     char        trapped[32] = "";
     const char *dumped      = "";
 
-    log_debug("EXEC %s; from %s:%d: %s()", command, file, line, func);
-
-    if( (status = system(command)) == -1 ) {
+    if( status == -1 ) {
         snprintf(exited, sizeof exited, " exec=failed");
     }
     else {
@@ -397,65 +692,444 @@ common_system_(const char *file, int line, const char *func,
     return result;
 }
 
-/** Wrapper to give visibility subprocesses usb-moded is invoking via popen()
+/** Wrapper to give visibility to blocking system() calls usb-moded is making
+ *
+ * Prefer common_spawn() for anything that does not need a shell.
  */
-FILE *
-common_popen_(const char *file, int line, const char *func,
-                const char *command, const char *type)
+int
+common_system_(const char *file, int line, const char *func,
+               const char *command)
 {
     LOG_REGISTER_CONTEXT;
 
-    log_debug("EXEC %s; from %s:%d: %s()",
-              command, file, line, func);
+    log_debug("EXEC %s; from %s:%d: %s()", command, file, line, func);
+    trace_count(TRACE_COUNTER_SPAWN);
 
-    return popen(command, type);
+    return common_exec_result(file, line, func, command, system(command));
 }
 
-waitres_t
-common_wait(unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr)
+/** Get pidfd for a child process
+ *
+ * @param pid  process id of a child process
+ *
+ * @return file descriptor that becomes readable when the child exits,
+ *         or -1 if pidfds are not supported
+ */
+static int
+common_spawn_pidfd(pid_t pid)
 {
     LOG_REGISTER_CONTEXT;
 
-    struct timespec ts;
+    int fd = -1;
+#ifdef SYS_pidfd_open
+    if( (fd = syscall(SYS_pidfd_open, pid, 0)) == -1 && errno != ENOSYS )
+        log_warning("pidfd_open: %m");
+#else
+    (void)pid;
+#endif
+    return fd;
+}
 
-    waitres_t res = WAIT_FAILED;
+/** Reap a child process without blocking
+ *
+ * @param pid     process id of a child process
+ * @param status  where to store wait status
+ *
+ * @return true if the child has been reaped, false if it is still running
+ */
+static bool
+common_spawn_reap(pid_t pid, int *status)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pid_t rc;
+
+    while( (rc = waitpid(pid, status, WNOHANG)) == -1 && errno == EINTR ) {}
+
+    if( rc == -1 ) {
+        /* Should not happen - but do not keep waiting if it does */
+        log_warning("waitpid: %m");
+        *status = -1;
+        return true;
+    }
+
+    return rc == pid;
+}
+
+/** Terminate and reap a child process
+ *
+ * The whole process group is sent SIGTERM first. If it does not exit
+ * within COMMON_SPAWN_GRACE_MS, SIGKILL is used.
+ *
+ * @param pid     process id of a child process
+ * @param pidfd   pidfd of the child, or -1
+ * @param status  where to store wait status
+ */
+static void
+common_spawn_kill(pid_t pid, int pidfd, int *status)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gint64 end = g_get_monotonic_time() + COMMON_SPAWN_GRACE_MS * 1000;
+
+    kill(-pid, SIGTERM);
+
+    while( !common_spawn_reap(pid, status) ) {
+        gint64 now = g_get_monotonic_time();
+        if( now >= end ) {
+            kill(-pid, SIGKILL);
+            while( waitpid(pid, status, 0) == -1 && errno == EINTR ) {}
+            break;
+        }
+
+        int tmo = (int)MIN((end - now + 999) / 1000, (gint64)10);
+        if( pidfd != -1 ) {
+            struct pollfd pfd = { .fd = pidfd, .events = POLLIN };
+            poll(&pfd, 1, tmo);
+        }
+        else {
+            poll(0, 0, tmo);
+        }
+    }
+}
+
+/** Execute a command without going through a shell
+ *
+ * The argv vector is executed via posix_spawnp(), so there is no
+ * intermediate /bin/sh process and no quoting issues with arguments.
+ *
+ * If input is given, it is fed to stdin of the command, otherwise
+ * stdin is redirected from /dev/null. The command is placed in a
+ * process group of its own, so that whatever it forks can be
+ * terminated along with it.
+ *
+ * Completion is waited via pidfd, if available. When called from the
+ * worker thread, the command is terminated also when the ongoing job
+ * gets superseded - see worker_get_cancel_fd().
+ *
+ * @param file    source file of the caller
+ * @param line    source line of the caller
+ * @param func    function name of the caller
+ * @param tmo_ms  maximum run time [ms], or zero for no limit
+ * @param input   data to write to stdin of the command, or NULL
+ * @param argv    NULL terminated command line vector
+ *
+ * @return exit code of the command, or -1 if it could not be executed,
+ *         did not exit normally, timed out, or was canceled
+ */
+int
+common_spawn_(const char *file, int line, const char *func,
+              unsigned tmo_ms, const char *input, const char *const *argv)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int    result  = -1;
+    int    status  = -1;
+    pid_t  pid     = -1;
+    int    pidfd   = -1;
+    int    pfd[2]  = { -1, -1 };
+    size_t todo    = input ? strlen(input) : 0;
+    gint64 end     = g_get_monotonic_time() + tmo_ms * (gint64)1000;
+    gchar *command = g_strjoinv(" ", (gchar **)argv);
+    bool   fa_init = false;
+    bool   at_init = false;
+    bool   aborted = false;
+
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t          at;
+    sigset_t                   sigs;
+
+    log_debug("EXEC %s; from %s:%d: %s()", command, file, line, func);
+
+    if( posix_spawn_file_actions_init(&fa) != 0 )
+        goto EXIT;
+    fa_init = true;
+
+    if( posix_spawnattr_init(&at) != 0 )
+        goto EXIT;
+    at_init = true;
+
+    if( input ) {
+        if( pipe2(pfd, O_CLOEXEC) == -1 ) {
+            log_err("pipe: %m");
+            goto EXIT;
+        }
+        posix_spawn_file_actions_adddup2(&fa, pfd[0], STDIN_FILENO);
+    }
+    else {
+        posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+                                         O_RDONLY, 0);
+    }
+
+    /* Do not pass on signal blocking used by threads, nor
+     * ignored signals - SIGPIPE in particular */
+    sigemptyset(&sigs);
+    posix_spawnattr_setsigmask(&at, &sigs);
+    sigaddset(&sigs, SIGPIPE);
+    posix_spawnattr_setsigdefault(&at, &sigs);
+    posix_spawnattr_setpgroup(&at, 0);
+    posix_spawnattr_setflags(&at, (POSIX_SPAWN_SETSIGMASK |
+                                   POSIX_SPAWN_SETSIGDEF |
+                                   POSIX_SPAWN_SETPGROUP));
+
+    int err = posix_spawnp(&pid, argv[0], &fa, &at,
+                           (char **)argv, environ);
+    if( err != 0 ) {
+        log_err("%s: spawn failed: %s", argv[0], strerror(err));
+        pid = -1;
+        goto EXIT;
+    }
+    trace_count(TRACE_COUNTER_SPAWN);
+
+    if( pfd[0] != -1 )
+        close(pfd[0]), pfd[0] = -1;
+    if( pfd[1] != -1 && todo == 0 )
+        close(pfd[1]), pfd[1] = -1;
+    if( pfd[1] != -1 )
+        fcntl(pfd[1], F_SETFL, fcntl(pfd[1], F_GETFL) | O_NONBLOCK);
+
+    pidfd = common_spawn_pidfd(pid);
 
     for( ;; ) {
-        unsigned nap_ms = (tot_ms > 200) ? 200 : tot_ms;
+        if( common_spawn_reap(pid, &status) )
+            break;
+
+        if( worker_bailing_out() ) {
+            log_warning("EXEC %s; canceled", command);
+            common_spawn_kill(pid, pidfd, &status);
+            aborted = true;
+            break;
+        }
 
-        ts.tv_sec  = (nap_ms / 1000);
-        ts.tv_nsec = (nap_ms % 1000);
-        ts.tv_nsec *= 1000 * 1000;
+        gint64 now = g_get_monotonic_time();
+        if( tmo_ms && now >= end ) {
+            log_warning("EXEC %s; timed out", command);
+            common_spawn_kill(pid, pidfd, &status);
+            aborted = true;
+            break;
+        }
 
-        for( ;; ) {
-            if( ready_cb && ready_cb(aptr) ) {
-                res = WAIT_READY;
-                goto EXIT;
-            }
+        struct pollfd fds[3];
+        nfds_t        nfd = 0;
+        int           cfd = worker_get_cancel_fd();
+
+        if( pidfd != -1 )
+            fds[nfd++] = (struct pollfd) { .fd = pidfd, .events = POLLIN };
+        if( pfd[1] != -1 )
+            fds[nfd++] = (struct pollfd) { .fd = pfd[1], .events = POLLOUT };
+        if( cfd != -1 )
+            fds[nfd++] = (struct pollfd) { .fd = cfd, .events = POLLIN };
+
+        /* Without pidfd, fall back to checking exit status at
+         * fixed intervals */
+        int tmo = (pidfd != -1) ? -1 : 20;
+        if( tmo_ms ) {
+            int left = (int)((end - now + 999) / 1000);
+            tmo = (tmo == -1) ? left : MIN(tmo, left);
+        }
+
+        if( poll(fds, nfd, tmo) == -1 && errno != EINTR ) {
+            log_warning("wait failed: %m");
+            poll(0, 0, 20);
+            continue;
+        }
 
-            if( tot_ms <= 0 ) {
-                res = WAIT_TIMEOUT;
-                goto EXIT;
+        for( nfds_t i = 0; i < nfd; ++i ) {
+            if( fds[i].fd == cfd && (fds[i].revents & POLLIN) ) {
+                char buf[64];
+                while( read(cfd, buf, sizeof buf) > 0 ) {}
             }
+        }
 
-            if( worker_bailing_out() ) {
-                log_warning("wait canceled");
-                goto EXIT;
+        if( pfd[1] != -1 ) {
+            ssize_t rc = write(pfd[1], input, todo);
+            if( rc > 0 ) {
+                input += rc, todo -= rc;
+            }
+            else if( rc == -1 && (errno == EAGAIN || errno == EINTR) ) {
+                /* retry when writable */
             }
+            else {
+                log_err("%s: write failed: %m", command);
+                todo = 0;
+            }
+            if( todo == 0 )
+                close(pfd[1]), pfd[1] = -1;
+        }
+    }
 
-            if( nanosleep(&ts, &ts) == 0 )
-                break;
+    result = common_exec_result(file, line, func, command, status);
+    if( aborted )
+        result = -1;
 
-            if( errno != EINTR ) {
-                log_warning("wait failed: %m");
-                goto EXIT;
-            }
+EXIT:
+    if( pid == -1 )
+        common_exec_result(file, line, func, command, -1);
+
+    if( pidfd != -1 )
+        close(pidfd);
+    if( pfd[0] != -1 )
+        close(pfd[0]);
+    if( pfd[1] != -1 )
+        close(pfd[1]);
+    if( at_init )
+        posix_spawnattr_destroy(&at);
+    if( fa_init )
+        posix_spawn_file_actions_destroy(&fa);
+    g_free(command);
+
+    return result;
+}
+
+/** Sleep until timeout, input from a file descriptor, or cancellation
+ *
+ * When called from the worker thread, wakes up immediately if the
+ * ongoing job gets superseded - see worker_get_cancel_fd().
+ *
+ * Input is drained and ignored, callers are expected to re-evaluate
+ * whatever condition they are waiting for anyway.
+ *
+ * @param fd   file descriptor to watch, or -1 for none
+ * @param tmo  maximum time to sleep [ms]
+ *
+ * @return true if the wait can be continued, false on failure
+ */
+static bool
+common_wait_poll(int fd, int tmo)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct pollfd pfd[2];
+    nfds_t        nfd = 0;
+    int           cfd = worker_get_cancel_fd();
+
+    if( fd != -1 )
+        pfd[nfd++] = (struct pollfd) { .fd = fd, .events = POLLIN };
+    if( cfd != -1 )
+        pfd[nfd++] = (struct pollfd) { .fd = cfd, .events = POLLIN };
+
+    int rc = poll(pfd, nfd, tmo);
+    if( rc == -1 ) {
+        if( errno == EINTR )
+            return true;
+        log_warning("wait failed: %m");
+        return false;
+    }
+
+    for( nfds_t i = 0; rc > 0 && i < nfd; ++i ) {
+        if( pfd[i].revents & POLLIN ) {
+            char buf[1024];
+            while( read(pfd[i].fd, buf, sizeof buf) > 0 ) {}
+        }
+    }
+
+    return true;
+}
+
+waitres_t
+common_wait(unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    waitres_t res = WAIT_FAILED;
+    gint64    end = g_get_monotonic_time() + tot_ms * (gint64)1000;
+
+    for( ;; ) {
+        if( ready_cb && ready_cb(aptr) ) {
+            res = WAIT_READY;
+            break;
+        }
+
+        gint64 now = g_get_monotonic_time();
+        if( now >= end ) {
+            res = WAIT_TIMEOUT;
+            break;
+        }
+
+        if( worker_bailing_out() ) {
+            log_warning("wait canceled");
+            break;
         }
 
-        tot_ms -= nap_ms;
+        int tmo = (int)MIN((end - now + 999) / 1000, (gint64)200);
+        if( !common_wait_poll(-1, tmo) )
+            break;
     }
 
-EXIT:
+    return res;
+}
+
+/** Wait for a condition that changes when directory content changes
+ *
+ * Like common_wait(), but instead of checking the condition at fixed
+ * intervals, wakes up immediately when inotify reports changes in the
+ * given directory.
+ *
+ * As not all filesystems (e.g. functionfs) report every change
+ * via inotify, the condition is also re-checked at exponentially
+ * increasing intervals, up to the same 200 ms used by common_wait().
+ * Worker bailout is noticed immediately, see common_wait_poll().
+ *
+ * @param tot_ms    maximum time to wait [ms]
+ * @param path      directory to watch, or NULL for timer based checks only
+ * @param ready_cb  condition to wait for
+ * @param aptr      context pointer to pass to ready_cb
+ *
+ * @return WAIT_READY if condition was met, WAIT_TIMEOUT if it was not
+ *         met within tot_ms, or WAIT_FAILED if wait was canceled
+ */
+waitres_t
+common_wait_path(unsigned tot_ms, const char *path,
+                 bool (*ready_cb)(void *aptr), void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const uint32_t mask = (IN_CREATE | IN_DELETE | IN_ATTRIB |
+                                  IN_MOVED_FROM | IN_MOVED_TO |
+                                  IN_DELETE_SELF | IN_UNMOUNT);
+
+    waitres_t res = WAIT_FAILED;
+    int       fd  = -1;
+    int       nap = 10;
+    gint64    end = g_get_monotonic_time() + tot_ms * (gint64)1000;
+
+    if( path ) {
+        if( (fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 )
+            log_warning("inotify_init: %m");
+        else if( inotify_add_watch(fd, path, mask) == -1 ) {
+            log_debug("%s: can't watch: %m", path);
+            close(fd), fd = -1;
+        }
+    }
+
+    for( ;; ) {
+        if( ready_cb && ready_cb(aptr) ) {
+            res = WAIT_READY;
+            break;
+        }
+
+        gint64 now = g_get_monotonic_time();
+        if( now >= end ) {
+            res = WAIT_TIMEOUT;
+            break;
+        }
+
+        if( worker_bailing_out() ) {
+            log_warning("wait canceled");
+            break;
+        }
+
+        int tmo = (int)MIN((end - now + 999) / 1000, (gint64)nap);
+        if( !common_wait_poll(fd, tmo) )
+            break;
+
+        if( nap < 200 )
+            nap = MIN(nap * 2, 200);
+    }
+
+    if( fd != -1 )
+        close(fd);
+
     return res;
 }
 
@@ -471,6 +1145,76 @@ common_msleep_(const char *file, int line, const char *func, unsigned msec)
     return common_wait(msec, 0, 0) == WAIT_TIMEOUT;
 }
 
+/** Check if a sysfs style file holds the given value
+ *
+ * Leading and trailing white space is ignored and comparison is
+ * done case insensitively. Failures are not logged, so that this
+ * can be used from wait polling callbacks.
+ *
+ * @param path   Path to file to read
+ * @param value  Value to compare against
+ *
+ * @return true if file content matches value, false otherwise
+ */
+bool
+common_file_has_value(const char *path, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    int  fd  = -1;
+    char buff[64];
+
+    if( (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 )
+        goto EXIT;
+
+    int rc = read(fd, buff, sizeof buff - 1);
+    if( rc <= 0 )
+        goto EXIT;
+
+    buff[rc] = 0;
+
+    ack = !g_ascii_strcasecmp(g_strstrip(buff), value);
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    return ack;
+}
+
+/** Check if usb device controller has been configured by the host
+ *
+ * @return true if some udc reports "configured" state, false otherwise
+ */
+bool
+common_udc_is_configured(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool           ack = false;
+    DIR           *dir = 0;
+    struct dirent *de  = 0;
+
+    if( !(dir = opendir("/sys/class/udc")) )
+        goto EXIT;
+
+    while( !ack && (de = readdir(dir)) ) {
+        if( de->d_name[0] == '.' )
+            continue;
+
+        gchar *path = g_strdup_printf("/sys/class/udc/%s/state", de->d_name);
+        ack = common_file_has_value(path, "configured");
+        g_free(path);
+    }
+
+EXIT:
+    if( dir )
+        closedir(dir);
+
+    return ack;
+}
+
 /* ------------------------------------------------------------------------- *
  * MISC
  * ------------------------------------------------------------------------- */
@@ -504,9 +1248,7 @@ common_modename_is_internal(const char *modename)
 {
     LOG_REGISTER_CONTEXT;
 
-    return (common_modename_is_static(modename) ||
-            !g_strcmp0(modename, MODE_ASK) ||
-            !g_strcmp0(modename, MODE_BUSY));
+    return common_mode_atom(modename) != MODE_ATOM_DYNAMIC;
 }
 
 /** Check if given usb mode is static
@@ -520,10 +1262,7 @@ common_modename_is_static(const char *modename)
 {
     LOG_REGISTER_CONTEXT;
 
-    return (!g_strcmp0(modename, MODE_UNDEFINED) ||
-            !g_strcmp0(modename, MODE_CHARGER) ||
-            !g_strcmp0(modename, MODE_CHARGING_FALLBACK) ||
-            !g_strcmp0(modename, MODE_CHARGING));
+    return common_mode_atom_is_static(common_mode_atom(modename));
 }
 
 /** check if a given usb_mode exists
@@ -539,7 +1278,7 @@ int common_valid_mode(const char *mode)
     int valid = 1;
     /* MODE_ASK, MODE_CHARGER and MODE_CHARGING_FALLBACK are not modes that are settable seen their special 'internal' status
      * so we only check the modes that are announed outside. Only exception is the built in MODE_CHARGING */
-    if(!strcmp(MODE_CHARGING, mode)) {
+    if( common_mode_atom(mode) == MODE_ATOM_CHARGING ) {
         valid = 0;
     }
     else
@@ -571,7 +1310,7 @@ int common_valid_mode(const char *mode)
  *
  * @return a comma-separated list of modes (MODE_ASK not included as it is not a real mode)
  */
-gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
+static gchar *common_build_mode_list(mode_list_type_t type, uid_t uid)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -637,3 +1376,108 @@ EXIT:
 
     return g_string_free(mode_list_str, false);
 }
+
+/** Get list of modes suitable for D-Bus replies and signals
+ *
+ * @param type Type of the list to return
+ * @param uid  Uid of the process requesting the information;
+ *             this is used to limit allowed modes, 0 returns all
+ *
+ * @return a comma-separated list of modes, caller must release with g_free()
+ */
+gchar *common_get_mode_list(mode_list_type_t type, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_strdup(common_peek_mode_list(type, uid));
+}
+
+/** Get cached list of modes suitable for D-Bus replies and signals
+ *
+ * The lists are memoized per list type and uid, and are rebuilt
+ * only after mode list or configuration changes.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param type Type of the list to return
+ * @param uid  Uid of the process requesting the information;
+ *             this is used to limit allowed modes, 0 returns all
+ *
+ * @return a comma-separated list of modes, owned by the cache and
+ *         valid until the next mode list or configuration change
+ */
+const char *common_peek_mode_list(mode_list_type_t type, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned  config_gen   = config_get_generation();
+    unsigned  modelist_gen = usbmoded_get_modelist_generation();
+    bool      diag_mode    = usbmoded_get_diag_mode();
+    gchar    *mode_list    = 0;
+
+    if( common_mode_list_cache_config_gen   != config_gen   ||
+        common_mode_list_cache_modelist_gen != modelist_gen ||
+        common_mode_list_cache_diag_mode    != diag_mode ) {
+        common_mode_list_flush();
+        common_mode_list_cache_config_gen   = config_gen;
+        common_mode_list_cache_modelist_gen = modelist_gen;
+        common_mode_list_cache_diag_mode    = diag_mode;
+    }
+
+    GHashTable **cache = &common_mode_list_cache[type == AVAILABLE_MODES_LIST];
+    if( !*cache )
+        *cache = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                       0, g_free);
+
+    if( !(mode_list = g_hash_table_lookup(*cache, GUINT_TO_POINTER(uid))) ) {
+        mode_list = common_build_mode_list(type, uid);
+        g_hash_table_insert(*cache, GUINT_TO_POINTER(uid), mode_list);
+    }
+
+    return mode_list;
+}
+
+/** Drop memoized mode lists
+ */
+static void common_mode_list_flush(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; i < G_N_ELEMENTS(common_mode_list_cache); ++i ) {
+        if( common_mode_list_cache[i] )
+            g_hash_table_unref(common_mode_list_cache[i]),
+                common_mode_list_cache[i] = 0;
+    }
+}
+
+/** Release memoized mode lists and last signaled values
+ */
+void common_mode_list_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    common_mode_list_flush();
+
+    g_free(common_sent_supported_modes),   common_sent_supported_modes   = 0;
+    g_free(common_sent_available_modes),   common_sent_available_modes   = 0;
+    g_free(common_sent_hidden_modes),      common_sent_hidden_modes      = 0;
+    g_free(common_sent_whitelisted_modes), common_sent_whitelisted_modes = 0;
+}
+
+/** Check if mode list differs from previously signaled one
+ *
+ * @param prev  Pointer to previously signaled value, updated on change
+ * @param curr  Current value
+ *
+ * @return true if the value changed and should be signaled, false otherwise
+ */
+static bool common_mode_list_changed(gchar **prev, const char *curr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !g_strcmp0(*prev, curr) )
+        return false;
+
+    g_free(*prev), *prev = g_strdup(curr);
+    return true;
+}
@@ -27,6 +27,8 @@
 #ifndef  USB_MODED_COMMON_H_
 # define USB_MODED_COMMON_H_
 
+# include "usb_moded-modes.h"
+
 # include <stdio.h>
 # include <stdbool.h>
 # include <glib.h>
@@ -73,6 +75,9 @@ const char *cable_state_repr(cable_state_t state);
  * COMMON
  * ------------------------------------------------------------------------- */
 
+mode_atom_t common_mode_atom                    (const char *modename);
+const char *common_mode_atom_name               (mode_atom_t atom);
+bool        common_mode_atom_is_static          (mode_atom_t atom);
 const char *common_map_mode_to_hardware         (const char *internal_mode);
 const char *common_map_mode_to_external         (const char *internal_mode);
 void        common_send_supported_modes_signal  (void);
@@ -80,22 +85,30 @@ void        common_send_available_modes_signal  (void);
 void        common_send_hidden_modes_signal     (void);
 void        common_send_whitelisted_modes_signal(void);
 void        common_acquire_wakelock             (const char *wakelock_name);
+void        common_renew_wakelock               (const char *wakelock_name);
 void        common_release_wakelock             (const char *wakelock_name);
+void        common_wakelock_quit                (void);
 int         common_system_                      (const char *file, int line, const char *func, const char *command);
-FILE       *common_popen_                       (const char *file, int line, const char *func, const char *command, const char *type);
+int         common_spawn_                       (const char *file, int line, const char *func, unsigned tmo_ms, const char *input, const char *const *argv);
 waitres_t   common_wait                         (unsigned tot_ms, bool (*ready_cb)(void *aptr), void *aptr);
+waitres_t   common_wait_path                    (unsigned tot_ms, const char *path, bool (*ready_cb)(void *aptr), void *aptr);
 bool        common_msleep_                      (const char *file, int line, const char *func, unsigned msec);
+bool        common_file_has_value               (const char *path, const char *value);
+bool        common_udc_is_configured            (void);
 bool        common_modename_is_internal         (const char *modename);
 bool        common_modename_is_static           (const char *modename);
 int         common_valid_mode                   (const char *mode);
 gchar      *common_get_mode_list                (mode_list_type_t type, uid_t uid);
+const char *common_peek_mode_list               (mode_list_type_t type, uid_t uid);
+void        common_mode_list_quit               (void);
 
 /* ========================================================================= *
  * Macros
  * ========================================================================= */
 
 # define               common_system(command)      common_system_(__FILE__,__LINE__,__FUNCTION__,(command))
-# define               common_popen(command, type) common_popen_(__FILE__,__LINE__,__FUNCTION__,(command),(type))
+# define               common_spawn(tmo_ms, ...)   common_spawn_(__FILE__,__LINE__,__FUNCTION__,(tmo_ms),0,(const char *[]){__VA_ARGS__, 0})
+# define               common_spawnv(tmo_ms, input, argv) common_spawn_(__FILE__,__LINE__,__FUNCTION__,(tmo_ms),(input),(argv))
 # define               common_msleep(msec)         common_msleep_(__FILE__,__LINE__,__FUNCTION__,(msec))
 # define               common_sleep(sec)           common_msleep_(__FILE__,__LINE__,__FUNCTION__,(sec)*1000)
 
@@ -67,6 +67,9 @@
 
 char                *config_find_mounts             (void);
 int                  config_find_sync               (void);
+gchar               *config_get_lun_setting         (const char *mountpoint, const char *key);
+gchar               *config_get_mass_storage_setting(const char *key);
+int                  config_get_modules_preload     (void);
 char                *config_find_alt_mount          (void);
 char                *config_find_udev_path          (void);
 char                *config_find_udev_subsystem     (void);
@@ -91,6 +94,8 @@ char                *config_get_group_for_mode      (const char *mode);
 set_config_result_t  config_set_network_setting     (const char *config, const char *setting);
 char                *config_get_network_setting     (const char *config);
 bool                 config_init                    (void);
+void                 config_quit                    (void);
+unsigned             config_get_generation          (void);
 char                *config_get_android_manufacturer(void);
 char                *config_get_android_vendor_id   (void);
 char                *config_get_android_product     (void);
@@ -35,10 +35,12 @@
 #include "usb_moded-config-private.h"
 
 #include "usb_moded.h"
+#include "usb_moded-confmerge.h"
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-modes.h"
+#include "usb_moded-trace.h"
 #include "usb_moded-worker.h"
 
 #ifdef USE_MER_SSU
@@ -46,7 +48,9 @@
 #endif
 
 #include <sys/stat.h>
+#include <sys/inotify.h>
 
+#include <pthread.h> // NOTRIM
 #include <unistd.h>
 #include <fcntl.h>
 #include <glob.h>
@@ -62,6 +66,9 @@
 static int           config_validate_ip              (const char *ipadd);
 char                *config_find_mounts              (void);
 int                  config_find_sync                (void);
+gchar               *config_get_lun_setting          (const char *mountpoint, const char *key);
+gchar               *config_get_mass_storage_setting (const char *key);
+int                  config_get_modules_preload      (void);
 char                *config_find_alt_mount           (void);
 char                *config_find_udev_path           (void);
 char                *config_find_udev_subsystem      (void);
@@ -78,7 +85,10 @@ static char         *config_get_network_nat_interface(void);
 static int           config_get_conf_int             (const gchar *entry, const gchar *key);
 char                *config_get_conf_string          (const gchar *entry, const gchar *key);
 static gchar        *config_make_user_key_string     (const gchar *base_key, uid_t uid);
+static gchar        *config_get_user_conf_string_locked(const confmerge_t *merge, const gchar *entry, const gchar *base_key, uid_t uid);
 gchar               *config_get_user_conf_string     (const gchar *entry, const gchar *base_key, uid_t uid);
+static gchar        *config_get_user_mode_setting    (uid_t uid);
+static gchar        *config_get_kcmdline            (void);
 static char         *config_get_kcmdline_string      (const char *entry);
 char                *config_get_mode_setting         (uid_t uid);
 set_config_result_t  config_set_config_setting       (const char *entry, const char *key, const char *value);
@@ -94,20 +104,23 @@ char                *config_get_group_for_mode       (const char *mode);
 #endif
 set_config_result_t  config_set_network_setting      (const char *config, const char *setting);
 char                *config_get_network_setting      (const char *config);
-static void          config_merge_key                (GKeyFile *dest, GKeyFile *srce, const char *grp, const char *key);
-static void          config_merge_group              (GKeyFile *dest, GKeyFile *srce, const char *grp);
-static void          config_merge_data               (GKeyFile *dest, GKeyFile *srce);
-static void          config_purge_data               (GKeyFile *dest, GKeyFile *srce);
-static void          config_purge_empty_groups       (GKeyFile *dest);
 static int           config_glob_error_cb            (const char *path, int err);
-static bool          config_merge_from_file          (GKeyFile *ini, const char *path);
-static void          config_load_static_config       (GKeyFile *ini);
-static bool          config_load_legacy_config       (GKeyFile *ini);
+static void          config_load_static_config       (confmerge_t *merge);
+static bool          config_load_legacy_config       (confmerge_t *merge);
 static void          config_remove_legacy_config     (void);
-static void          config_load_dynamic_config      (GKeyFile *ini);
-static void          config_save_dynamic_config      (GKeyFile *ini);
+static void          config_load_dynamic_config_locked(confmerge_t *merge);
+static bool          config_write_file_atomic        (const char *path, const char *data);
+static void          config_flush_dynamic_config     (void);
+static gboolean      config_save_dynamic_config_cb   (gpointer aptr);
+static bool          config_save_dynamic_config_locked(confmerge_t *merge);
+static void          config_schedule_save            (void);
 bool                 config_init                     (void);
-static GKeyFile     *config_get_settings             (void);
+void                 config_quit                     (void);
+static void          config_invalidate_settings      (void);
+static void          config_commit_settings_locked   (void);
+static void          config_clear_resolved_locked    (void);
+static confmerge_t  *config_get_settings_locked      (void);
+unsigned             config_get_generation           (void);
 char                *config_get_android_manufacturer (void);
 char                *config_get_android_vendor_id    (void);
 char                *config_get_android_product      (void);
@@ -117,6 +130,95 @@ char                *config_get_mode_whitelist       (void);
 int                  config_is_roaming_not_allowed   (void);
 bool                 config_user_clear               (uid_t uid);
 
+/* ------------------------------------------------------------------------- *
+ * CONFIG_WATCH
+ * ------------------------------------------------------------------------- */
+
+static bool          config_watch_is_config_file     (const char *name);
+static gboolean      config_watch_input_cb           (GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static bool          config_watch_start              (void);
+static void          config_watch_stop               (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Static and dynamic settings, or NULL if not loaded yet
+ *
+ * Changes made by usb-moded are applied directly to the dynamic
+ * layer, so that there is no need to reload everything after
+ * each settings change. Access only while holding config_mutex.
+ */
+static confmerge_t *config_settings_cache = 0;
+
+/** Configuration generation config_settings_cache was loaded at */
+static unsigned config_settings_cache_gen = 0;
+
+/** Current configuration generation
+ *
+ * Incremented whenever configuration files have been changed by
+ * usb-moded itself or inotify reports changes in config directories.
+ */
+static unsigned config_settings_gen = 1;
+
+/** Flag for: config directory changes are tracked via inotify
+ *
+ * When not set, the cached settings can't be trusted and are
+ * reloaded on every lookup. Access only while holding config_mutex.
+ */
+static bool config_watch_active = false;
+
+/** I/O watch id for config_watch_fd */
+static guint config_watch_id = 0;
+
+/** Mode settings resolved from config_settings_cache, keyed by uid
+ *
+ * Values are NULL for users that do not have a mode setting.
+ * Access only while holding config_mutex.
+ */
+static GHashTable *config_user_mode_cache = 0;
+
+/** Groups resolved from config_settings_cache, keyed by mode name
+ *
+ * Access only while holding config_mutex.
+ */
+static GHashTable *config_mode_group_cache = 0;
+
+/** Kernel command line, read on first use
+ *
+ * Access only while holding config_mutex.
+ */
+static gchar *config_kcmdline_cache = 0;
+
+/** Dynamic settings not yet written to USB_MODED_DYNAMIC_CONFIG_FILE
+ *
+ * Contains serialized ini data, or NULL when the file is up to date.
+ * Access only while holding config_mutex.
+ */
+static gchar *config_dynamic_pending = 0;
+
+/** Timer id for delayed saving of config_dynamic_pending */
+static guint config_save_id = 0;
+
+/** Delay between the last settings change and writing it to flash [ms] */
+#define CONFIG_SAVE_DELAY_MS 1000
+
+static pthread_mutex_t  config_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define CONFIG_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&config_mutex) != 0 ) { \
+        log_crit("CONFIG LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define CONFIG_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&config_mutex) != 0 ) { \
+        log_crit("CONFIG UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -161,6 +263,49 @@ int config_find_sync(void)
     return config_get_conf_int(FS_SYNC_ENTRY, FS_SYNC_KEY);
 }
 
+/** Get per mountpoint mass storage setting
+ *
+ * Settings are read from group named "mountpoint <path>", e.g.
+ *
+ * [mountpoint /dev/sdcard]
+ * nofua = 1
+ * write_cache = write back
+ *
+ * @param mountpoint  mountpoint as listed in [mountpoints] group
+ * @param key         setting name
+ *
+ * @return setting value, or NULL if not set; release with g_free()
+ */
+gchar *config_get_lun_setting(const char *mountpoint, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *entry = g_strdup_printf(FS_LUN_ENTRY_PREFIX "%s", mountpoint);
+    gchar *value = config_get_conf_string(entry, key);
+    g_free(entry);
+    return value;
+}
+
+/** Get mass storage function level setting
+ *
+ * @param key  setting name
+ *
+ * @return setting value, or NULL if not set; release with g_free()
+ */
+gchar *config_get_mass_storage_setting(const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return config_get_conf_string(FS_STORAGE_ENTRY, key);
+}
+
+int config_get_modules_preload(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return config_get_conf_int(MODULES_ENTRY, MODULES_PRELOAD_KEY);
+}
+
 char * config_find_alt_mount(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -269,11 +414,11 @@ static int config_get_conf_int(const gchar *entry, const gchar *key)
 {
     LOG_REGISTER_CONTEXT;
 
-    // TODO: use cached values instead of reloading every time?
-    GKeyFile *ini = config_get_settings();
+    CONFIG_LOCKED_ENTER;
+    confmerge_t *merge = config_get_settings_locked();
     // Note: zero value is returned if key does not exist
-    gint val = g_key_file_get_integer(ini, entry, key, 0);
-    g_key_file_free(ini);
+    gint val = confmerge_get_integer(merge, entry, key);
+    CONFIG_LOCKED_LEAVE;
     //log_debug("key [%s] %s value is: %d\n", entry, key, val);
     return val;
 }
@@ -282,11 +427,11 @@ char *config_get_conf_string(const gchar *entry, const gchar *key)
 {
     LOG_REGISTER_CONTEXT;
 
-    // TODO: use cached values instead of reloading every time?
-    GKeyFile *ini = config_get_settings();
+    CONFIG_LOCKED_ENTER;
+    confmerge_t *merge = config_get_settings_locked();
     // Note: null value is returned if key does not exist
-    gchar *val = g_key_file_get_string(ini, entry, key, 0);
-    g_key_file_free(ini);
+    gchar *val = confmerge_get_string(merge, entry, key);
+    CONFIG_LOCKED_LEAVE;
     //log_debug("key [%s] %s value is: %s\n", entry, key, val ?: "<null>");
     return val;
 }
@@ -304,59 +449,128 @@ static gchar *config_make_user_key_string(const gchar *base_key, uid_t uid)
     return key;
 }
 
-gchar *config_get_user_conf_string(const gchar *entry, const gchar *base_key, uid_t uid)
+/** Lookup user specific string value from settings object
+ *
+ * Note: Caller must hold config_mutex.
+ *
+ * @param merge     settings object
+ * @param entry     group name
+ * @param base_key  key name without user suffix
+ * @param uid       user id
+ *
+ * @return value string, or NULL if not set
+ */
+static gchar *config_get_user_conf_string_locked(const confmerge_t *merge, const gchar *entry,
+                                                 const gchar *base_key, uid_t uid)
 {
     LOG_REGISTER_CONTEXT;
 
     gchar *value = 0;
     gchar *key = config_make_user_key_string(base_key, uid);
     if( key )
-        value = config_get_conf_string(entry, key);
+        value = confmerge_get_string(merge, entry, key);
     /* Fallback to global config if user doesn't have a value set */
     if( !value )
-        value = config_get_conf_string(entry, base_key);
+        value = confmerge_get_string(merge, entry, base_key);
     g_free(key);
     return value;
 }
 
+gchar *config_get_user_conf_string(const gchar *entry, const gchar *base_key, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    CONFIG_LOCKED_ENTER;
+    confmerge_t *merge = config_get_settings_locked();
+    gchar *value = config_get_user_conf_string_locked(merge, entry, base_key, uid);
+    CONFIG_LOCKED_LEAVE;
+    return value;
+}
+
+/** Get mode setting for a user
+ *
+ * Resolved values are cached until configuration changes.
+ *
+ * @param uid  user id
+ *
+ * @return mode name, or NULL if not set
+ */
+static gchar *config_get_user_mode_setting(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gpointer key = GUINT_TO_POINTER(uid);
+    gpointer val = 0;
+
+    CONFIG_LOCKED_ENTER;
+    confmerge_t *merge = config_get_settings_locked();
+    if( !config_user_mode_cache )
+        config_user_mode_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                       0, g_free);
+    if( !g_hash_table_lookup_extended(config_user_mode_cache, key, 0, &val) ) {
+        val = config_get_user_conf_string_locked(merge, MODE_SETTING_ENTRY,
+                                                 MODE_SETTING_KEY, uid);
+        g_hash_table_insert(config_user_mode_cache, key, val);
+    }
+    gchar *mode = g_strdup(val);
+    CONFIG_LOCKED_LEAVE;
+
+    return mode;
+}
+
+/** Get kernel command line
+ *
+ * The command line does not change, so it is read only once.
+ *
+ * @return command line string, or NULL if not available
+ */
+static gchar *config_get_kcmdline(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    CONFIG_LOCKED_ENTER;
+    if( !config_kcmdline_cache ) {
+        gchar *data = 0;
+        if( !g_file_get_contents("/proc/cmdline", &data, 0, 0) )
+            log_debug("could not read /proc/cmdline");
+        config_kcmdline_cache = data ?: g_strdup("");
+    }
+    gchar *cmdline = g_strdup(config_kcmdline_cache);
+    CONFIG_LOCKED_LEAVE;
+
+    return cmdline;
+}
+
 static char * config_get_kcmdline_string(const char *entry)
 {
     LOG_REGISTER_CONTEXT;
 
-    int fd;
-    char cmdLine[1024];
+    gchar *cmdLine = 0;
     char *ret = NULL;
-    int len;
     gint argc = 0;
     gchar **argv = NULL;
     gchar **arg_tokens = NULL, **network_tokens = NULL;
     GError *optErr = NULL;
     int i;
 
-    if ((fd = open("/proc/cmdline", O_RDONLY)) < 0)
-    {
-        log_debug("could not read /proc/cmdline");
-        return ret;
-    }
-
-    len = read(fd, cmdLine, sizeof cmdLine - 1);
-    close(fd);
+    cmdLine = config_get_kcmdline();
 
-    if (len <= 0)
+    if (!cmdLine || !*cmdLine)
     {
         log_debug("kernel command line was empty");
+        g_free(cmdLine);
         return ret;
     }
 
-    cmdLine[len] = '\0';
-
     /* we're looking for a piece of the kernel command line matching this:
      * ip=192.168.3.100::192.168.3.1:255.255.255.0::usb0:on */
     if (!g_shell_parse_argv(cmdLine, &argc, &argv, &optErr))
     {
         g_error_free(optErr);
+        g_free(cmdLine);
         return ret;
     }
+    g_free(cmdLine);
 
     /* find the ip token */
     for (i=0; i < argc; i++)
@@ -407,7 +621,7 @@ char * config_get_mode_setting(uid_t uid)
     if( (mode = config_get_kcmdline_string(MODE_SETTING_KEY)) )
         goto EXIT;
 
-    mode = config_get_user_conf_string(MODE_SETTING_ENTRY, MODE_SETTING_KEY, uid);
+    mode = config_get_user_mode_setting(uid);
 
     /* If no default mode is configured, treat it as charging only */
     if( !mode )
@@ -429,35 +643,32 @@ set_config_result_t config_set_config_setting(const char *entry, const char *key
     LOG_REGISTER_CONTEXT;
 
     set_config_result_t ret = SET_CONFIG_UNCHANGED;
+    bool                changed = false;
 
-    GKeyFile *static_ini = g_key_file_new();
-    GKeyFile *active_ini = g_key_file_new();
-
-    gchar *prev = 0;
-
-    /* Load static configuration */
-    config_load_static_config(static_ini);
-
-    /* Merge static and dynamic settings */
-    config_merge_data(active_ini, static_ini);
-    config_load_dynamic_config(active_ini);
+    CONFIG_LOCKED_ENTER;
+    confmerge_t *merge = config_get_settings_locked();
 
-    prev = g_key_file_get_string(active_ini, entry, key, 0);
+    gchar *prev = confmerge_get_string(merge, entry, key);
     if( g_strcmp0(prev, value) ) {
-        g_key_file_set_string(active_ini, entry, key, value);
+        /* Values matching static defaults are not stored */
+        confmerge_set_string(merge, entry, key, value);
         ret = SET_CONFIG_UPDATED;
-        umdbus_send_config_signal(entry, key, value);
     }
 
-    /* Filter out dynamic data that matches static values */
-    config_purge_data(active_ini, static_ini);
-
     /* Update data on filesystem if changed */
-    config_save_dynamic_config(active_ini);
+    if( ret == SET_CONFIG_UPDATED || confmerge_purge(merge) ) {
+        if( (changed = config_save_dynamic_config_locked(merge)) )
+            config_commit_settings_locked();
+    }
+    CONFIG_LOCKED_LEAVE;
+
+    if( ret == SET_CONFIG_UPDATED )
+        umdbus_send_config_signal(entry, key, value);
+
+    if( changed )
+        config_schedule_save();
 
     g_free(prev);
-    g_key_file_free(active_ini);
-    g_key_file_free(static_ini);
 
     return ret;
 }
@@ -612,7 +823,7 @@ set_config_result_t config_set_mode_whitelist(const char *whitelist)
 
         control_settings_changed();
 
-        umdbus_send_whitelisted_modes_signal(whitelist);
+        common_send_whitelisted_modes_signal();
         common_send_available_modes_signal();
     }
 
@@ -639,10 +850,21 @@ char *config_get_group_for_mode(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    char *group = config_get_conf_string(MODE_GROUP_ENTRY, mode);
-
-    if (group == NULL)
-        group = g_strdup("sailfish-system");
+    CONFIG_LOCKED_ENTER;
+    confmerge_t *merge = config_get_settings_locked();
+    if( !config_mode_group_cache )
+        config_mode_group_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                        g_free, g_free);
+    const char *cached = g_hash_table_lookup(config_mode_group_cache, mode);
+    if( !cached ) {
+        gchar *value = confmerge_get_string(merge, MODE_GROUP_ENTRY, mode);
+        if( value == NULL )
+            value = g_strdup("sailfish-system");
+        g_hash_table_insert(config_mode_group_cache, g_strdup(mode), value);
+        cached = value;
+    }
+    char *group = g_strdup(cached);
+    CONFIG_LOCKED_LEAVE;
 
     return group;
 }
@@ -710,120 +932,11 @@ char *config_get_network_setting(const char *config)
     }
 
 EXIT:
-    modedata_free(data);
+    modedata_unref(data);
 
     return ret;
 }
 
-/**
- * Merge value from one keyfile to another
- *
- * Existing values will be overridden
- *
- * @param dest keyfile to modify
- * @param srce keyfile to merge from
- * @param grp  value group to merge
- * @param key  value key to merge
- */
-static void config_merge_key(GKeyFile *dest, GKeyFile *srce,
-                             const char *grp, const char *key)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gchar *val = g_key_file_get_value(srce, grp, key, 0);
-    if( val ) {
-        //log_debug("[%s] %s = %s", grp, key, val);
-        g_key_file_set_value(dest, grp, key, val);
-        g_free(val);
-    }
-}
-
-/**
- * Merge group of values from one keyfile to another
- *
- * @param dest keyfile to modify
- * @param srce keyfile to merge from
- * @param grp  value group to merge
- */
-static void config_merge_group(GKeyFile *dest, GKeyFile *srce,
-                               const char *grp)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gchar **key = g_key_file_get_keys(srce, grp, 0, 0);
-    if( key ) {
-        for( size_t i = 0; key[i]; ++i )
-            config_merge_key(dest, srce, grp, key[i]);
-        g_strfreev(key);
-    }
-}
-
-/**
- * Merge all groups and values from one keyfile to another
- *
- * @param dest keyfile to modify
- * @param srce keyfile to merge from
- */
-static void config_merge_data(GKeyFile *dest, GKeyFile *srce)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gchar **grp = g_key_file_get_groups(srce, 0);
-
-    if( grp ) {
-        for( size_t i = 0; grp[i]; ++i )
-            config_merge_group(dest, srce, grp[i]);
-        g_strfreev(grp);
-    }
-}
-
-static void config_purge_data(GKeyFile *dest, GKeyFile *srce)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gsize groups = 0;
-    gchar **group = g_key_file_get_groups(srce, &groups);
-    for( gsize g = 0; g < groups; ++g ) {
-        gsize keys = 0;
-        gchar **key = g_key_file_get_keys(srce, group[g], &keys, 0);
-        for( gsize k = 0; k < keys; ++k ) {
-            gchar *cur_val = g_key_file_get_value(dest, group[g], key[k], 0);
-            if( !cur_val )
-                continue;
-
-            gchar *def_val = g_key_file_get_value(srce, group[g], key[k], 0);
-
-            if( !g_strcmp0(cur_val, def_val) ) {
-                log_debug("purge redundant: [%s] %s = %s",
-                          group[g], key[k], cur_val);
-                g_key_file_remove_key(dest, group[g], key[k], 0);
-            }
-            g_free(def_val);
-            g_free(cur_val);
-        }
-        g_strfreev(key);
-    }
-    g_strfreev(group);
-}
-
-static void config_purge_empty_groups(GKeyFile *dest)
-{
-    LOG_REGISTER_CONTEXT;
-
-    gsize groups = 0;
-    gchar **group = g_key_file_get_groups(dest, &groups);
-    for( gsize g = 0; g < groups; ++g ) {
-        gsize keys = 0;
-        gchar **key = g_key_file_get_keys(dest, group[g], &keys, 0);
-        if( keys == 0 ) {
-            log_debug("purge redundant group: [%s]", group[g]);
-            g_key_file_remove_group(dest, group[g], 0);
-        }
-        g_strfreev(key);
-    }
-    g_strfreev(group);
-}
-
 /**
  * Callback function for logging errors within glob()
  *
@@ -840,27 +953,11 @@ static int config_glob_error_cb(const char *path, int err)
     return 0;
 }
 
-static bool config_merge_from_file(GKeyFile *ini, const char *path)
-{
-    LOG_REGISTER_CONTEXT;
-
-    bool      ack = false;
-    GError   *err = 0;
-    GKeyFile *tmp = g_key_file_new();
-
-    if( !g_key_file_load_from_file(tmp, path, 0, &err) ) {
-        log_debug("%s: can't load: %s", path, err->message);
-    } else {
-        //log_debug("processing %s ...", path);
-        config_merge_data(ini, tmp);
-        ack = true;
-    }
-    g_clear_error(&err);
-    g_key_file_free(tmp);
-    return ack;
-}
-
-static void config_load_static_config(GKeyFile *ini)
+/** Load static configuration files to static settings layer
+ *
+ * @param merge  settings object
+ */
+static void config_load_static_config(confmerge_t *merge)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -872,19 +969,28 @@ static void config_load_static_config(GKeyFile *ini)
         log_debug("no configuration ini-files found");
 
     /* Seed with default values */
-    g_key_file_set_string(ini, MODE_SETTING_ENTRY, MODE_SETTING_KEY, MODE_ASK);
+    confmerge_set_layer_value(merge, CONFMERGE_LAYER_STATIC,
+                              MODE_SETTING_ENTRY, MODE_SETTING_KEY, MODE_ASK);
 
     /* Override with content from config files */
     for( size_t i = 0; i < gb.gl_pathc; ++i ) {
         const char *path = gb.gl_pathv[i];
         if( strcmp(path, USB_MODED_STATIC_CONFIG_FILE) )
-            config_merge_from_file(ini, path);
+            confmerge_merge_file(merge, CONFMERGE_LAYER_STATIC, path);
     }
 
     globfree(&gb);
 }
 
-static bool config_load_legacy_config(GKeyFile *ini)
+/** Load legacy configuration file to dynamic settings layer
+ *
+ * Note: Must be called before loading dynamic settings.
+ *
+ * @param merge  settings object
+ *
+ * @return true if legacy settings were loaded, false otherwise
+ */
+static bool config_load_legacy_config(confmerge_t *merge)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -914,7 +1020,8 @@ static bool config_load_legacy_config(GKeyFile *ini)
         goto EXIT;
     }
 
-    if( !config_merge_from_file(ini, USB_MODED_STATIC_CONFIG_FILE) )
+    if( !confmerge_merge_file(merge, CONFMERGE_LAYER_DYNAMIC,
+                              USB_MODED_STATIC_CONFIG_FILE) )
         goto EXIT;
 
     /* A mode=ask setting in legacy config can be either
@@ -923,15 +1030,11 @@ static bool config_load_legacy_config(GKeyFile *ini)
      * of priority ordered static configuration files, ignore
      * such settings.
      */
-    gchar *val = g_key_file_get_value(ini, MODE_SETTING_ENTRY,
-                                      MODE_SETTING_KEY, 0);
-    if( val ) {
-        if( !g_strcmp0(val, MODE_ASK) ) {
-            g_key_file_remove_key(ini, MODE_SETTING_ENTRY,
-                                  MODE_SETTING_KEY, 0);
-        }
-        g_free(val);
-    }
+    const char *val = confmerge_get_layer_value(merge, CONFMERGE_LAYER_DYNAMIC,
+                                                MODE_SETTING_ENTRY,
+                                                MODE_SETTING_KEY);
+    if( !g_strcmp0(val, MODE_ASK) )
+        confmerge_remove(merge, MODE_SETTING_ENTRY, MODE_SETTING_KEY);
 
     ack = true;
 
@@ -957,45 +1060,204 @@ static void config_remove_legacy_config(void)
     }
 }
 
-static void config_load_dynamic_config(GKeyFile *ini)
+/** Merge dynamic settings, including changes not saved yet
+ *
+ * Note: Caller must hold config_mutex.
+ *
+ * @param merge  settings object to merge into
+ */
+static void config_load_dynamic_config_locked(confmerge_t *merge)
 {
     LOG_REGISTER_CONTEXT;
 
-    config_merge_from_file(ini, USB_MODED_DYNAMIC_CONFIG_FILE);
+    if( !config_dynamic_pending )
+        confmerge_merge_file(merge, CONFMERGE_LAYER_DYNAMIC,
+                             USB_MODED_DYNAMIC_CONFIG_FILE);
+    else
+        confmerge_merge_data(merge, CONFMERGE_LAYER_DYNAMIC,
+                             config_dynamic_pending);
 }
 
-static void config_save_dynamic_config(GKeyFile *ini)
+/** Replace file content so that either old or new data survives a crash
+ *
+ * Data is written to a temporary file that is synced to disk
+ * before it is renamed over the original file.
+ *
+ * @param path  file to write
+ * @param data  content to write
+ *
+ * @return true on success, false on failure
+ */
+static bool config_write_file_atomic(const char *path, const char *data)
 {
     LOG_REGISTER_CONTEXT;
 
-    gchar  *current_dta = 0;
-    gchar  *previous_dta = 0;
+    bool    ack  = false;
+    int     fd   = -1;
+    gchar  *temp = g_strdup_printf("%s.tmp", path);
+    gchar  *dir  = g_path_get_dirname(path);
+    size_t  size = strlen(data);
 
-    config_purge_empty_groups(ini);
-    current_dta = g_key_file_to_data(ini, 0, 0);
+    if( (fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ) {
+        log_err("%s: can't create: %m", temp);
+        goto EXIT;
+    }
 
-    g_file_get_contents(USB_MODED_DYNAMIC_CONFIG_FILE, &previous_dta, 0, 0);
-    if( g_strcmp0(previous_dta, current_dta) ) {
-        GError *err = 0;
+    for( size_t done = 0; done < size; ) {
+        ssize_t rc = write(fd, data + done, size - done);
+        if( rc == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_err("%s: write: %m", temp);
+            goto EXIT;
+        }
+        done += rc;
+    }
+
+    if( fsync(fd) == -1 ) {
+        log_err("%s: fsync: %m", temp);
+        goto EXIT;
+    }
+
+    if( close(fd) == -1 ) {
+        fd = -1;
+        log_err("%s: close: %m", temp);
+        goto EXIT;
+    }
+    fd = -1;
+
+    if( rename(temp, path) == -1 ) {
+        log_err("%s: rename to %s: %m", temp, path);
+        goto EXIT;
+    }
+
+    /* Make the rename itself persistent too */
+    if( (fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1 ) {
+        if( fsync(fd) == -1 )
+            log_warning("%s: fsync: %m", dir);
+    }
+
+    ack = true;
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    if( !ack )
+        unlink(temp);
+
+    g_free(dir);
+    g_free(temp);
+
+    return ack;
+}
+
+/** Write pending dynamic settings changes to filesystem
+ */
+static void config_flush_dynamic_config(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool saved = false;
+
+    if( config_save_id )
+        g_source_remove(config_save_id), config_save_id = 0;
+
+    /* Hold the lock until the file is in place, so that cache
+     * reloads in other threads do not see stale file content */
+    CONFIG_LOCKED_ENTER;
+    if( config_dynamic_pending ) {
         if( mkdir(USB_MODED_DYNAMIC_CONFIG_DIR, 0755) == -1 && errno != EEXIST ) {
             log_err("%s: can't create dir: %m", USB_MODED_DYNAMIC_CONFIG_DIR);
         }
-        else if( !g_file_set_contents(USB_MODED_DYNAMIC_CONFIG_FILE,
-                                      current_dta, -1, &err) ) {
-            log_err("%s: can't save: %s", USB_MODED_DYNAMIC_CONFIG_FILE,
-                    err->message);
-        }
-        else {
+        else if( config_write_file_atomic(USB_MODED_DYNAMIC_CONFIG_FILE,
+                                          config_dynamic_pending) ) {
             log_debug("%s: updated", USB_MODED_DYNAMIC_CONFIG_FILE);
-
-            /* The legacy file is not needed anymore */
-            config_remove_legacy_config();
+            saved = true;
         }
-        g_clear_error(&err);
+        g_free(config_dynamic_pending), config_dynamic_pending = 0;
+    }
+    CONFIG_LOCKED_LEAVE;
+
+    if( saved ) {
+        /* The legacy file is not needed anymore */
+        config_remove_legacy_config();
+    }
+    else {
+        /* On failure in-memory changes are lost, re-read from file */
+        config_invalidate_settings();
+    }
+}
+
+/** Timer callback for: write pending dynamic settings changes
+ *
+ * @param aptr  user data (unused)
+ *
+ * @return G_SOURCE_REMOVE to stop the timer
+ */
+static gboolean config_save_dynamic_config_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    config_save_id = 0;
+    config_flush_dynamic_config();
+    return G_SOURCE_REMOVE;
+}
+
+/** Store dynamic settings layer as pending changes
+ *
+ * Note: Caller must hold config_mutex.
+ *
+ * @param merge  settings object
+ *
+ * @return true if content differs from what was stored before,
+ *         i.e. saving needs to be scheduled, false otherwise
+ */
+static bool config_save_dynamic_config_locked(confmerge_t *merge)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar  *current_dta = 0;
+    gchar  *previous_dta = 0;
+    bool    changed = false;
+
+    current_dta = confmerge_to_data(merge, CONFMERGE_LAYER_DYNAMIC);
+
+    if( config_dynamic_pending )
+        previous_dta = g_strdup(config_dynamic_pending);
+    else
+        g_file_get_contents(USB_MODED_DYNAMIC_CONFIG_FILE, &previous_dta, 0, 0);
+
+    if( g_strcmp0(previous_dta, current_dta) ) {
+        g_free(config_dynamic_pending);
+        config_dynamic_pending = current_dta, current_dta = 0;
+        changed = true;
     }
 
     g_free(current_dta);
     g_free(previous_dta);
+
+    return changed;
+}
+
+/** Schedule saving of pending dynamic settings
+ *
+ * Changes are visible to settings lookups immediately, but
+ * writing to filesystem is delayed so that a burst of setting
+ * changes results in just one file update.
+ */
+static void config_schedule_save(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    log_debug("%s: save scheduled", USB_MODED_DYNAMIC_CONFIG_FILE);
+
+    if( config_save_id )
+        g_source_remove(config_save_id);
+    config_save_id = g_timeout_add(CONFIG_SAVE_DELAY_MS,
+                                   config_save_dynamic_config_cb, 0);
 }
 
 /**
@@ -1008,45 +1270,152 @@ bool config_init(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool      ack = true;
-
-    GKeyFile *legacy_ini = g_key_file_new();
-    GKeyFile *static_ini = g_key_file_new();
-    GKeyFile *active_ini = g_key_file_new();
+    bool         ack     = true;
+    bool         changed = false;
+    confmerge_t *merge   = confmerge_create();
 
     /* Load static configuration */
-    config_load_static_config(static_ini);
+    config_load_static_config(merge);
 
     /* Handle legacy settings */
-    if( config_load_legacy_config(legacy_ini) ) {
-        config_purge_data(legacy_ini, static_ini);
-        config_merge_data(active_ini, legacy_ini);
-    }
+    config_load_legacy_config(merge);
 
+    CONFIG_LOCKED_ENTER;
     /* Load dynamic settings */
-    config_load_dynamic_config(active_ini);
+    config_load_dynamic_config_locked(merge);
 
     /* Filter out dynamic data that matches static values */
-    config_purge_data(active_ini, static_ini);
+    confmerge_purge(merge);
 
     /* Update data on filesystem if changed */
-    config_save_dynamic_config(active_ini);
+    changed = config_save_dynamic_config_locked(merge);
 
-    g_key_file_free(active_ini);
-    g_key_file_free(static_ini);
-    g_key_file_free(legacy_ini);
+    /* Use the result as settings cache */
+    confmerge_delete(config_settings_cache);
+    config_settings_cache = merge;
+    config_commit_settings_locked();
+    CONFIG_LOCKED_LEAVE;
+
+    if( changed )
+        config_schedule_save();
+
+    /* Start tracking changes made by other parties */
+    config_watch_start();
 
     return ack;
 }
 
-static GKeyFile *config_get_settings(void)
+/** Stop config tracking and release cached settings
+ */
+void config_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    config_watch_stop();
+
+    /* Do not lose changes that are waiting for delayed save */
+    config_flush_dynamic_config();
+
+    CONFIG_LOCKED_ENTER;
+    config_clear_resolved_locked();
+    if( config_user_mode_cache )
+        g_hash_table_unref(config_user_mode_cache), config_user_mode_cache = 0;
+    if( config_mode_group_cache )
+        g_hash_table_unref(config_mode_group_cache), config_mode_group_cache = 0;
+    g_free(config_kcmdline_cache), config_kcmdline_cache = 0;
+    confmerge_delete(config_settings_cache), config_settings_cache = 0;
+    config_settings_cache_gen = 0;
+    CONFIG_LOCKED_LEAVE;
+}
+
+/** Mark cached settings as outdated
+ *
+ * The merged settings are reloaded on the next lookup.
+ */
+static void config_invalidate_settings(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    CONFIG_LOCKED_ENTER;
+    /* Skip zero so that it can't match never loaded cache */
+    if( ++config_settings_gen == 0 )
+        ++config_settings_gen;
+    log_debug("config generation: %u", config_settings_gen);
+    CONFIG_LOCKED_LEAVE;
+}
+
+/** Mark changes made directly to cached settings
+ *
+ * Configuration generation is advanced so that derived data gets
+ * re-evaluated, but the cached settings remain valid.
+ *
+ * Note: Caller must hold config_mutex.
+ */
+static void config_commit_settings_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( ++config_settings_gen == 0 )
+        ++config_settings_gen;
+    config_settings_cache_gen = config_settings_gen;
+    config_clear_resolved_locked();
+    log_debug("config generation: %u", config_settings_gen);
+}
+
+/** Forget values resolved from cached settings
+ *
+ * Note: Caller must hold config_mutex.
+ */
+static void config_clear_resolved_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( config_user_mode_cache )
+        g_hash_table_remove_all(config_user_mode_cache);
+    if( config_mode_group_cache )
+        g_hash_table_remove_all(config_mode_group_cache);
+}
+
+/** Get layered static and dynamic settings
+ *
+ * Note: Caller must hold config_mutex and must not release
+ *       the returned object.
+ *
+ * @return cached settings object
+ */
+static confmerge_t *config_get_settings_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !config_settings_cache ||
+        config_settings_cache_gen != config_settings_gen ||
+        !config_watch_active ) {
+        confmerge_delete(config_settings_cache);
+        config_clear_resolved_locked();
+        trace_count(TRACE_COUNTER_CONFIG_PARSE);
+        config_settings_cache = confmerge_create();
+        config_load_static_config(config_settings_cache);
+        config_load_dynamic_config_locked(config_settings_cache);
+        config_settings_cache_gen = config_settings_gen;
+    }
+    return config_settings_cache;
+}
+
+/** Get current configuration generation
+ *
+ * Can be used for detecting whether data derived from
+ * configuration settings needs to be re-evaluated.
+ *
+ * @return configuration generation number
+ */
+unsigned config_get_generation(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    GKeyFile *ini = g_key_file_new();
-    config_load_static_config(ini);
-    config_load_dynamic_config(ini);
-    return ini;
+    CONFIG_LOCKED_ENTER;
+    unsigned gen = config_settings_gen;
+    CONFIG_LOCKED_LEAVE;
+    return gen;
 }
 
 char * config_get_android_manufacturer(void)
@@ -1129,16 +1498,183 @@ bool config_user_clear(uid_t uid)
     }
 #endif
 
-    GKeyFile *active_ini = g_key_file_new();
-    config_load_dynamic_config(active_ini);
+    bool changed = false;
 
     char *key = config_make_user_key_string(MODE_SETTING_KEY, uid);
     if (key) {
-        if (g_key_file_remove_key(active_ini, MODE_SETTING_ENTRY, key, NULL))
-            config_save_dynamic_config(active_ini);
+        CONFIG_LOCKED_ENTER;
+        confmerge_t *merge = config_get_settings_locked();
+        if (confmerge_remove(merge, MODE_SETTING_ENTRY, key) &&
+            (changed = config_save_dynamic_config_locked(merge)))
+            config_commit_settings_locked();
+        CONFIG_LOCKED_LEAVE;
         g_free(key);
     }
 
-    g_key_file_free(active_ini);
+    if (changed)
+        config_schedule_save();
+
     return true;
 }
+
+/* ========================================================================= *
+ * CONFIG_WATCH
+ * ========================================================================= */
+
+/** Predicate for: file name refers to a configuration file
+ *
+ * @param name  file name from inotify event, or NULL
+ *
+ * @return true if name ends with ".ini", false otherwise
+ */
+static bool config_watch_is_config_file(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return name && g_str_has_suffix(name, ".ini");
+}
+
+/** Glib io watch callback for reading inotify events
+ *
+ * @param chn   glib io channel
+ * @param cnd   wakeup reason
+ * @param aptr  user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean config_watch_input_cb(GIOChannel *chn, GIOCondition cnd,
+                                      gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    gboolean keep_watch = FALSE;
+    bool     changed    = false;
+    char     buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if( cnd & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
+        goto EXIT;
+
+    int fd = g_io_channel_unix_get_fd(chn);
+    ssize_t rc = read(fd, buf, sizeof buf);
+    if( rc == -1 ) {
+        if( errno == EINTR || errno == EAGAIN )
+            keep_watch = TRUE;
+        else
+            log_err("config watch read: %m");
+        goto EXIT;
+    }
+
+    for( ssize_t pos = 0; pos + (ssize_t)sizeof(struct inotify_event) <= rc; ) {
+        const struct inotify_event *eve = (void *)(buf + pos);
+        pos += sizeof *eve + eve->len;
+        if( eve->mask & IN_Q_OVERFLOW )
+            changed = true;
+        else if( eve->len > 0 && config_watch_is_config_file(eve->name) )
+            changed = true;
+    }
+
+    keep_watch = TRUE;
+
+EXIT:
+    if( changed )
+        config_invalidate_settings();
+
+    if( !keep_watch ) {
+        log_warning("config watch disabled");
+        config_watch_id = 0;
+        CONFIG_LOCKED_ENTER;
+        config_watch_active = false;
+        CONFIG_LOCKED_LEAVE;
+    }
+
+    return keep_watch;
+}
+
+/** Start tracking configuration directory changes
+ *
+ * @return true if changes can be tracked, false otherwise
+ */
+static bool config_watch_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const dirs[] = {
+        USB_MODED_STATIC_CONFIG_DIR,
+        USB_MODED_DYNAMIC_CONFIG_DIR,
+        NULL
+    };
+
+    const uint32_t mask = (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                           IN_MOVED_FROM | IN_MOVED_TO);
+
+    bool        ack = false;
+    int         fd  = -1;
+    GIOChannel *chn = 0;
+
+    if( config_watch_id ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( (fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ) {
+        log_err("inotify_init: %m");
+        goto EXIT;
+    }
+
+    /* Make sure the dynamic config dir exists so that it can be watched */
+    if( mkdir(USB_MODED_DYNAMIC_CONFIG_DIR, 0755) == -1 && errno != EEXIST )
+        log_warning("%s: can't create dir: %m", USB_MODED_DYNAMIC_CONFIG_DIR);
+
+    for( size_t i = 0; dirs[i]; ++i ) {
+        if( inotify_add_watch(fd, dirs[i], mask) == -1 ) {
+            log_warning("%s: can't watch: %m", dirs[i]);
+            goto EXIT;
+        }
+    }
+
+    if( !(chn = g_io_channel_unix_new(fd)) )
+        goto EXIT;
+
+    config_watch_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                     config_watch_input_cb, 0);
+    if( !config_watch_id )
+        goto EXIT;
+
+    g_io_channel_set_close_on_unref(chn, true), fd = -1;
+
+    /* Whatever was cached so far might be stale */
+    CONFIG_LOCKED_ENTER;
+    ++config_settings_gen;
+    config_watch_active = true;
+    CONFIG_LOCKED_LEAVE;
+
+    ack = true;
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( fd != -1 )
+        close(fd);
+
+    if( !ack )
+        log_warning("config changes are not tracked; settings are not cached");
+
+    return ack;
+}
+
+/** Stop tracking configuration directory changes
+ */
+static void config_watch_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    CONFIG_LOCKED_ENTER;
+    config_watch_active = false;
+    CONFIG_LOCKED_LEAVE;
+
+    if( config_watch_id )
+        g_source_remove(config_watch_id), config_watch_id = 0;
+}
@@ -44,6 +44,15 @@
 # define FS_MOUNT_KEY                   "mount"
 # define FS_SYNC_ENTRY                  "sync"
 # define FS_SYNC_KEY                    "nofua"
+# define FS_LUN_ENTRY_PREFIX            "mountpoint "
+# define FS_LUN_NOFUA_KEY               "nofua"
+# define FS_LUN_RO_KEY                  "ro"
+# define FS_LUN_REMOVABLE_KEY           "removable"
+# define FS_LUN_CDROM_KEY               "cdrom"
+# define FS_LUN_WRITE_CACHE_KEY         "write_cache"
+# define FS_STORAGE_ENTRY               "mass_storage"
+# define FS_STORAGE_STALL_KEY           "stall"
+# define FS_STORAGE_NUM_BUFFERS_KEY     "num_buffers"
 # define ALT_MOUNT_ENTRY                "altmount"
 # define ALT_MOUNT_KEY                  "mount"
 # define UDEV_PATH_ENTRY                "udev"
@@ -64,6 +73,8 @@
 # define NETWORK_GATEWAY_KEY            "gateway"
 # define NETWORK_NAT_INTERFACE_KEY      "nat_interface"
 # define NETWORK_NETMASK_KEY            "netmask"
+# define NETWORK_FIREWALL_KEY           "firewall"
+# define NETWORK_DHCPD_KEY              "dhcpd"
 # define NO_ROAMING_KEY                 "noroaming"
 # define ANDROID_ENTRY                  "android"
 # define ANDROID_MANUFACTURER_KEY       "iManufacturer"
@@ -73,6 +84,8 @@
 # define MODE_HIDE_KEY                  "hide"
 # define MODE_WHITELIST_KEY             "whitelist"
 # define MODE_GROUP_ENTRY               "mode_group"
+# define MODULES_ENTRY                  "modules"
+# define MODULES_PRELOAD_KEY            "preload"
 
 /* ========================================================================= *
  * Types
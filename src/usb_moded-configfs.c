@@ -28,6 +28,7 @@
 #include "usb_moded-config-private.h"
 #include "usb_moded-log.h"
 #include "usb_moded-mac.h"
+#include "usb_moded-trace.h"
 
 #include <sys/stat.h>
 
@@ -39,7 +40,8 @@
  * ========================================================================= */
 
 /* Due to legacy these defaults must match what is required by Sony XA2 port */
-#define DEFAULT_GADGET_BASE_DIRECTORY    "/config/usb_gadget/g1"
+#define DEFAULT_GADGET_ROOT_DIRECTORY    "/config/usb_gadget"
+#define DEFAULT_GADGET_BASE_DIRECTORY    DEFAULT_GADGET_ROOT_DIRECTORY "/g1"
 #define DEFAULT_GADGET_FUNC_DIRECTORY    "functions"
 #define DEFAULT_GADGET_CONF_DIRECTORY    "configs/b.1"
 
@@ -49,49 +51,229 @@
 #define DEFAULT_GADGET_CTRL_MANUFACTURER "strings/0x409/manufacturer"
 #define DEFAULT_GADGET_CTRL_PRODUCT      "strings/0x409/product"
 #define DEFAULT_GADGET_CTRL_SERIAL       "strings/0x409/serialnumber"
+#define DEFAULT_GADGET_CTRL_STRINGS      "strings/0x409"
 
 #define DEFAULT_FUNCTION_MASS_STORAGE    "mass_storage.usb0"
 #define DEFAULT_FUNCTION_RNDIS           "rndis_bam.rndis"
 #define DEFAULT_FUNCTION_MTP             "ffs.mtp"
+#define DEFAULT_FUNCTION_NCM             "ncm.usb0"
+#define DEFAULT_FUNCTION_ECM             "ecm.usb0"
 
 #define DEFAULT_RNDIS_CTRL_WCEIS         "wceis"
 #define DEFAULT_RNDIS_CTRL_ETHADDR       "ethaddr"
 
+/* Tunables common to u_ether based functions, i.e. ncm and ecm */
+#define DEFAULT_NET_CTRL_QMULT           "qmult"
+#define DEFAULT_NET_CTRL_HOST_ADDR       "host_addr"
+#define DEFAULT_NET_CTRL_DEV_ADDR        "dev_addr"
+#define DEFAULT_NET_CTRL_IFNAME          "ifname"
+
+/* Microsoft OS descriptors, lets hosts pick a class driver for ncm */
+#define DEFAULT_GADGET_OS_DESC           "os_desc"
+#define DEFAULT_NCM_OS_DESC_COMPAT_ID    "os_desc/interface.ncm/compatible_id"
+#define NCM_OS_DESC_COMPAT_ID            "WINNCM"
+
+/** Config group for primary gadget, additional ones use "configfs-NAME" */
+#define CONFIGFS_GROUP                   "configfs"
+
+/** Maximum number of gadgets, i.e. UDCs, that can be driven */
+#define CONFIGFS_GADGETS_MAX             4
+
+/** Snapshot of primary gadget state, survives restarts but not reboots */
+#define CONFIGFS_STATE_FILE              "/run/usb-moded/configfs.state"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Gadget state as last programmed by usb-moded
+ *
+ * Used for skipping configfs writes that would not change anything.
+ */
+typedef struct configfs_state_t
+{
+    /** Flag for: cs_functions reflects what is in the config directory */
+    bool    cs_functions_valid;
+
+    /** Enabled functions, in the order they were linked */
+    gchar **cs_functions;
+
+    /** Last written idProduct value, or NULL if not known */
+    gchar  *cs_productid;
+
+    /** Last written idVendor value, or NULL if not known */
+    gchar  *cs_vendorid;
+
+    /** Last written network function tunables, or NULL if not known */
+    gchar  *cs_net_params;
+} configfs_state_t;
+
+/** Configfs gadget bound to a single UDC
+ *
+ * The primary gadget is driven by usb mode selection. Additional
+ * gadgets expose statically configured functions on other UDCs and
+ * are programmed independently of the primary one.
+ */
+typedef struct configfs_gadget_t
+{
+    /** Gadget name, used for logging and config group lookup */
+    gchar  *cg_name;
+
+    /** Gadget directories */
+    gchar  *cg_base_directory;
+    gchar  *cg_func_directory;
+    gchar  *cg_conf_directory;
+
+    /** Gadget control files */
+    gchar  *cg_ctrl_udc;
+    gchar  *cg_ctrl_id_vendor;
+    gchar  *cg_ctrl_id_product;
+    gchar  *cg_ctrl_manufacturer;
+    gchar  *cg_ctrl_product;
+    gchar  *cg_ctrl_serial;
+
+    /** Configured UDC name, or NULL to use the first unclaimed one */
+    gchar  *cg_udc_config;
+
+    /** UDC name to write when binding, or NULL if not assigned yet */
+    gchar  *cg_udc;
+
+    /** Functions to enable on init, for additional gadgets */
+    gchar  *cg_functions;
+
+    /** usb ids to use instead of the android ones, or NULL */
+    gchar  *cg_vendorid;
+    gchar  *cg_productid;
+
+    /** Gadget state as last programmed */
+    configfs_state_t cg_state;
+} configfs_gadget_t;
+
+/** Collection of gadget changes to be applied together
+ */
+struct configfs_txn_t
+{
+    /** Gadget the changes are applied to */
+    configfs_gadget_t *ct_gadget;
+
+    /** Flag for: function list should be changed */
+    bool    ct_set_functions;
+
+    /** Functions to enable, in order */
+    gchar **ct_functions;
+
+    /** idProduct value to set, or NULL to leave as is */
+    gchar  *ct_productid;
+
+    /** idVendor value to set, or NULL to leave as is */
+    gchar  *ct_vendorid;
+
+    /** UDC state to set: 1=bound, 0=unbound, -1=leave as is */
+    int     ct_udc;
+
+    /** Mass storage luns, in lun order */
+    GPtrArray *ct_luns;
+
+    /** Mass storage function stall / num_buffers values, or NULL */
+    gchar  *ct_ms_stall;
+    gchar  *ct_ms_num_buffers;
+
+    /** Network function queue length multiplier, or zero to leave as is */
+    int     ct_net_qmult;
+
+    /** Network function host / device side MAC addresses, or NULL */
+    gchar  *ct_net_host_addr;
+    gchar  *ct_net_dev_addr;
+};
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * CONFIGFS_STATE
+ * ------------------------------------------------------------------------- */
+
+static void            configfs_state_invalidate  (configfs_state_t *state);
+static void            configfs_state_save        (const configfs_gadget_t *gadget);
+static bool            configfs_state_links_match (const configfs_gadget_t *gadget, gchar **functions);
+static bool            configfs_state_id_matches  (const char *path, const char *id);
+static bool            configfs_state_adopt       (configfs_gadget_t *gadget);
+bool                   configfs_take_adopted      (void);
+static bool            configfs_strv_equal        (gchar **a, gchar **b);
+static size_t          configfs_strv_common_prefix(gchar **a, gchar **b);
+
+/* ------------------------------------------------------------------------- *
+ * CONFIGFS_TXN
+ * ------------------------------------------------------------------------- */
+
+configfs_txn_t        *configfs_txn_create        (void);
+static configfs_txn_t *configfs_txn_create_for_gadget(configfs_gadget_t *gadget);
+void                   configfs_txn_delete        (configfs_txn_t *self);
+void                   configfs_txn_set_functions (configfs_txn_t *self, const char *functions);
+void                   configfs_txn_set_productid (configfs_txn_t *self, const char *id);
+void                   configfs_txn_set_vendorid  (configfs_txn_t *self, const char *id);
+void                   configfs_txn_set_udc       (configfs_txn_t *self, bool enable);
+static void            configfs_txn_lun_free       (gpointer aptr);
+void                   configfs_txn_add_mass_storage_lun(configfs_txn_t *self, const gadget_lun_t *lun);
+void                   configfs_txn_set_mass_storage_params(configfs_txn_t *self, const char *stall, const char *num_buffers);
+void                   configfs_txn_set_net_params(configfs_txn_t *self, int qmult, const char *host_addr, const char *dev_addr);
+static bool            configfs_txn_apply_luns     (const configfs_txn_t *self);
+static gchar          *configfs_txn_net_params     (const configfs_txn_t *self);
+static bool            configfs_txn_apply_net      (const configfs_txn_t *self);
+static bool            configfs_txn_commit_udc     (configfs_txn_t *self, bool enable);
+static bool            configfs_txn_apply_functions(const configfs_txn_t *self);
+bool                   configfs_txn_commit        (configfs_txn_t *self);
+
+/* ------------------------------------------------------------------------- *
+ * CONFIGFS_GADGET
+ * ------------------------------------------------------------------------- */
+
+static configfs_gadget_t *configfs_gadget_create        (const char *name, const char *group, const char *basedef);
+static void               configfs_gadget_delete        (configfs_gadget_t *self);
+static configfs_gadget_t *configfs_gadget_primary       (void);
+static configfs_gadget_t *configfs_gadget_find_secondary(const char *name);
+size_t                    configfs_gadget_count         (void);
+bool                      configfs_gadget_is_secondary  (const char *name);
+static bool               configfs_gadget_udc_claimed   (const char *udc);
+static void               configfs_gadget_assign_udcs   (void);
+static bool               configfs_gadget_is_configured (void);
+static bool               configfs_gadget_setup         (configfs_gadget_t *self);
+bool                      configfs_gadget_set_functions (const char *name, const char *functions);
+
 /* ------------------------------------------------------------------------- *
  * CONFIGFS
  * ------------------------------------------------------------------------- */
 
-static gchar      *configfs_get_conf               (const char *key, const char *def);
+static gchar      *configfs_get_conf               (const char *group, const char *key, const char *def);
 static void        configfs_read_configuration     (void);
 static int         configfs_file_type              (const char *path);
-static const char *configfs_function_path          (char *buff, size_t size, const char *func, ...);
-static const char *configfs_unit_path              (char *buff, size_t size, const char *func, const char *unit);
-static const char *configfs_config_path            (char *buff, size_t size, const char *func);
+static const char *configfs_function_path          (const configfs_gadget_t *gadget, char *buff, size_t size, const char *func, ...);
+static const char *configfs_unit_path              (const configfs_gadget_t *gadget, char *buff, size_t size, const char *func, const char *unit);
+static const char *configfs_config_path            (const configfs_gadget_t *gadget, char *buff, size_t size, const char *func);
 static bool        configfs_mkdir                  (const char *path);
 static bool        configfs_rmdir                  (const char *path);
-static const char *configfs_register_function      (const char *function);
+static const char *configfs_register_function      (const configfs_gadget_t *gadget, const char *function);
 #ifdef DEAD_CODE
-static bool        configfs_unregister_function    (const char *function);
+static bool        configfs_unregister_function    (const configfs_gadget_t *gadget, const char *function);
 #endif //DEAD_CODE
-static const char *configfs_add_unit               (const char *function, const char *unit);
-static bool        configfs_remove_unit            (const char *function, const char *unit);
-static bool        configfs_enable_function        (const char *function);
-static bool        configfs_disable_function       (const char *function);
-static bool        configfs_disable_all_functions  (void);
+static const char *configfs_add_unit               (const configfs_gadget_t *gadget, const char *function, const char *unit);
+static bool        configfs_remove_unit            (const configfs_gadget_t *gadget, const char *function, const char *unit);
+static bool        configfs_enable_function        (const configfs_gadget_t *gadget, const char *function);
+static bool        configfs_disable_function       (const configfs_gadget_t *gadget, const char *function);
+static bool        configfs_disable_all_functions  (const configfs_gadget_t *gadget);
 static char       *configfs_strip                  (char *str);
 bool               configfs_in_use                 (void);
 static bool        configfs_probe                  (void);
-static const char *configfs_udc_enable_value       (void);
+static const char *configfs_udc_enable_value       (configfs_gadget_t *gadget);
 static bool        configfs_write_file             (const char *path, const char *text);
 static bool        configfs_read_file              (const char *path, char *buff, size_t size);
 #ifdef DEAD_CODE
-static bool        configfs_read_udc               (char *buff, size_t size);
+static bool        configfs_read_udc               (const configfs_gadget_t *gadget, char *buff, size_t size);
 #endif // DEAD_CODE
-static bool        configfs_write_udc              (const char *text);
+static bool        configfs_write_udc              (const configfs_gadget_t *gadget, const char *text);
+static gchar      *configfs_normalize_id           (const char *id);
+static bool        configfs_bind_udc               (configfs_gadget_t *gadget, bool enable);
 bool               configfs_set_udc                (bool enable);
 bool               configfs_init                   (void);
 void               configfs_quit                   (void);
@@ -99,10 +281,18 @@ bool               configfs_set_charging_mode      (void);
 bool               configfs_set_productid          (const char *id);
 bool               configfs_set_vendorid           (const char *id);
 static const char *configfs_map_function           (const char *func);
+static bool        configfs_is_net_function        (const char *func);
+static void        configfs_setup_os_desc          (const configfs_gadget_t *gadget);
 bool               configfs_set_function           (const char *functions);
+bool               configfs_prestage_functions     (const char *functions);
+static bool        configfs_lun_add                (const configfs_gadget_t *gadget, int lun);
+static bool        configfs_lun_set_attr           (const configfs_gadget_t *gadget, int lun, const char *attr, const char *value);
 bool               configfs_add_mass_storage_lun   (int lun);
 bool               configfs_remove_mass_storage_lun(int lun);
 bool               configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
+static bool        configfs_gadget_apply           (const gadget_config_t *config);
+static bool        configfs_gadget_clear_luns      (size_t count);
+static char       *configfs_gadget_get_ifname      (void);
 
 /* ========================================================================= *
  * Data
@@ -110,20 +300,36 @@ bool               configfs_set_mass_storage_attr  (int lun, const char *attr, c
 
 static int configfs_probed = -1;
 
-static gchar *GADGET_BASE_DIRECTORY    = 0;
-static gchar *GADGET_FUNC_DIRECTORY    = 0;
-static gchar *GADGET_CONF_DIRECTORY    = 0;
+/** Flag for: primary gadget was left bound as found on startup */
+static bool configfs_adopted = false;
 
-static gchar *GADGET_CTRL_UDC          = 0;
-static gchar *GADGET_CTRL_ID_VENDOR    = 0;
-static gchar *GADGET_CTRL_ID_PRODUCT   = 0;
-static gchar *GADGET_CTRL_MANUFACTURER = 0;
-static gchar *GADGET_CTRL_PRODUCT      = 0;
-static gchar *GADGET_CTRL_SERIAL       = 0;
+/** Gadget backend operations for configfs */
+const gadget_backend_t configfs_gadget_backend =
+{
+    .gb_name          = "configfs",
+    .gb_max_luns      = 0,
+    .gb_keeps_netif   = true,
+    .gb_in_use        = configfs_in_use,
+    .gb_apply         = configfs_gadget_apply,
+    .gb_clear_luns    = configfs_gadget_clear_luns,
+    .gb_set_charging  = configfs_set_charging_mode,
+    .gb_is_configured = configfs_gadget_is_configured,
+    .gb_take_adopted  = configfs_take_adopted,
+    .gb_get_ifname    = configfs_gadget_get_ifname,
+};
+
+/** Configured gadgets, primary gadget first
+ *
+ * Note: Configfs is accessed only from worker thread after init.
+ */
+static configfs_gadget_t *configfs_gadget_lut[CONFIGFS_GADGETS_MAX] = { 0 };
+static size_t             configfs_gadget_cnt = 0;
 
 static gchar *FUNCTION_MASS_STORAGE    = 0;
 static gchar *FUNCTION_RNDIS           = 0;
 static gchar *FUNCTION_MTP             = 0;
+static gchar *FUNCTION_NCM             = 0;
+static gchar *FUNCTION_ECM             = 0;
 
 static gchar *RNDIS_CTRL_WCEIS         = 0;
 static gchar *RNDIS_CTRL_ETHADDR       = 0;
@@ -132,11 +338,11 @@ static gchar *RNDIS_CTRL_ETHADDR       = 0;
  * Settings
  * ========================================================================= */
 
-static gchar *configfs_get_conf(const char *key, const char *def)
+static gchar *configfs_get_conf(const char *group, const char *key, const char *def)
 {
     LOG_REGISTER_CONTEXT;
 
-    return config_get_conf_string("configfs", key) ?: g_strdup(def);
+    return config_get_conf_string(group, key) ?: (def ? g_strdup(def) : 0);
 }
 
 /** Parse configfs configuration entries
@@ -150,6 +356,28 @@ static gchar *configfs_get_conf(const char *key, const char *def)
  * function_mass_storage = mass_storage.usb0
  * function_rndis        = rndis_bam.rndis
  * function_mtp          = ffs.mtp
+ * function_ncm          = ncm.usb0
+ * function_ecm          = ecm.usb0
+ * os_descriptors        = 0
+ *
+ * The primary gadget can be tied to a specific UDC with "udc = NAME",
+ * by default the first UDC not claimed by other gadgets is used.
+ *
+ * Additional gadgets on other UDCs are listed in the primary group
+ * and configured in groups of their own:
+ *
+ * [configfs]
+ * extra_gadgets = g2
+ *
+ * [configfs-g2]
+ * gadget_base_directory = /config/usb_gadget/g2
+ * udc                   = a800000.dwc3
+ * functions             = acm.gs0
+ * vendor_id             = 2931
+ * product_id            = 0A0B
+ *
+ * Functions of additional gadgets can be changed at runtime via the
+ * set_gadget_functions D-Bus method, see configfs_gadget_set_functions().
  */
 static void configfs_read_configuration(void)
 {
@@ -164,85 +392,64 @@ static void configfs_read_configuration(void)
 
     done = true;
 
-    gchar *temp_setting;
-
-    /* Gadget directories
-     */
-    GADGET_BASE_DIRECTORY =
-        configfs_get_conf("gadget_base_directory",
-                          DEFAULT_GADGET_BASE_DIRECTORY);
-
-    temp_setting = configfs_get_conf("gadget_func_directory",
-                             DEFAULT_GADGET_FUNC_DIRECTORY);
-    GADGET_FUNC_DIRECTORY = g_strdup_printf("%s/%s",
-                                            GADGET_BASE_DIRECTORY,
-                                            temp_setting);
-    g_free(temp_setting);
-
-    temp_setting = configfs_get_conf("gadget_conf_directory",
-                             DEFAULT_GADGET_CONF_DIRECTORY);
-    GADGET_CONF_DIRECTORY =
-        g_strdup_printf("%s/%s",
-                        GADGET_BASE_DIRECTORY,
-                        temp_setting);
-    g_free(temp_setting);
-
-    /* Gadget control files
-     */
-    GADGET_CTRL_UDC =
-        g_strdup_printf("%s/%s",
-                        GADGET_BASE_DIRECTORY,
-                        DEFAULT_GADGET_CTRL_UDC);
-
-    GADGET_CTRL_ID_VENDOR =
-        g_strdup_printf("%s/%s",
-                        GADGET_BASE_DIRECTORY,
-                        DEFAULT_GADGET_CTRL_ID_VENDOR);
-
-    GADGET_CTRL_ID_PRODUCT =
-        g_strdup_printf("%s/%s",
-                        GADGET_BASE_DIRECTORY,
-                        DEFAULT_GADGET_CTRL_ID_PRODUCT);
-
-    GADGET_CTRL_MANUFACTURER =
-        g_strdup_printf("%s/%s",
-                        GADGET_BASE_DIRECTORY,
-                        DEFAULT_GADGET_CTRL_MANUFACTURER);
-
-    GADGET_CTRL_PRODUCT =
-        g_strdup_printf("%s/%s",
-                        GADGET_BASE_DIRECTORY,
-                        DEFAULT_GADGET_CTRL_PRODUCT);
+    configfs_gadget_t *primary =
+        configfs_gadget_create("g1", CONFIGFS_GROUP,
+                               DEFAULT_GADGET_BASE_DIRECTORY);
+    configfs_gadget_lut[configfs_gadget_cnt++] = primary;
 
-    GADGET_CTRL_SERIAL =
-        g_strdup_printf("%s/%s",
-                        GADGET_BASE_DIRECTORY,
-                        DEFAULT_GADGET_CTRL_SERIAL);
+    gchar *extra = configfs_get_conf(CONFIGFS_GROUP, "extra_gadgets", 0);
+    gchar **vec = g_strsplit(extra ?: "", ",", 0);
+    for( size_t i = 0; vec[i]; ++i ) {
+        gchar *name = g_strstrip(vec[i]);
+        if( !*name )
+            continue;
+        if( configfs_gadget_cnt >= CONFIGFS_GADGETS_MAX ) {
+            log_warning("gadget %s: too many gadgets configured", name);
+            continue;
+        }
+        gchar *group   = g_strdup_printf("%s-%s", CONFIGFS_GROUP, name);
+        gchar *basedef = g_strdup_printf("%s/%s",
+                                         DEFAULT_GADGET_ROOT_DIRECTORY, name);
+        configfs_gadget_lut[configfs_gadget_cnt++] =
+            configfs_gadget_create(name, group, basedef);
+        g_free(basedef);
+        g_free(group);
+    }
+    g_strfreev(vec);
+    g_free(extra);
 
     /* Functions
      */
     FUNCTION_MASS_STORAGE =
-        configfs_get_conf("function_mass_storage",
+        configfs_get_conf(CONFIGFS_GROUP, "function_mass_storage",
                           DEFAULT_FUNCTION_MASS_STORAGE);
 
     FUNCTION_RNDIS =
-        configfs_get_conf("function_rndis",
+        configfs_get_conf(CONFIGFS_GROUP, "function_rndis",
                           DEFAULT_FUNCTION_RNDIS);
 
     FUNCTION_MTP =
-        configfs_get_conf("function_mtp",
+        configfs_get_conf(CONFIGFS_GROUP, "function_mtp",
                           DEFAULT_FUNCTION_MTP);
 
+    FUNCTION_NCM =
+        configfs_get_conf(CONFIGFS_GROUP, "function_ncm",
+                          DEFAULT_FUNCTION_NCM);
+
+    FUNCTION_ECM =
+        configfs_get_conf(CONFIGFS_GROUP, "function_ecm",
+                          DEFAULT_FUNCTION_ECM);
+
     /* Function control files */
     RNDIS_CTRL_WCEIS =
         g_strdup_printf("%s/%s/%s",
-                        GADGET_FUNC_DIRECTORY,
+                        primary->cg_func_directory,
                         FUNCTION_RNDIS,
                         DEFAULT_RNDIS_CTRL_WCEIS);
 
     RNDIS_CTRL_ETHADDR =
         g_strdup_printf("%s/%s/%s",
-                        GADGET_FUNC_DIRECTORY,
+                        primary->cg_func_directory,
                         FUNCTION_RNDIS,
                         DEFAULT_RNDIS_CTRL_ETHADDR);
 
@@ -251,181 +458,541 @@ EXIT:
 }
 
 /* ========================================================================= *
- * Functions
+ * CONFIGFS_GADGET
  * ========================================================================= */
 
-static int configfs_file_type(const char *path)
+/** Create gadget object from configuration
+ *
+ * @param name     gadget name
+ * @param group    config group to read settings from
+ * @param basedef  default gadget base directory
+ *
+ * @return gadget object, release with configfs_gadget_delete()
+ */
+static configfs_gadget_t *
+configfs_gadget_create(const char *name, const char *group, const char *basedef)
 {
     LOG_REGISTER_CONTEXT;
 
-    int type = -1;
+    configfs_gadget_t *self = g_malloc0(sizeof *self);
+    gchar *temp_setting;
 
-    if( !path )
-        goto EXIT;
+    self->cg_name = g_strdup(name);
 
-    struct stat st;
-    if( lstat(path, &st) == -1 )
-        goto EXIT;
+    /* Gadget directories
+     */
+    self->cg_base_directory =
+        configfs_get_conf(group, "gadget_base_directory", basedef);
+
+    temp_setting = configfs_get_conf(group, "gadget_func_directory",
+                                     DEFAULT_GADGET_FUNC_DIRECTORY);
+    self->cg_func_directory = g_strdup_printf("%s/%s",
+                                              self->cg_base_directory,
+                                              temp_setting);
+    g_free(temp_setting);
 
-    type = st.st_mode & S_IFMT;
+    temp_setting = configfs_get_conf(group, "gadget_conf_directory",
+                                     DEFAULT_GADGET_CONF_DIRECTORY);
+    self->cg_conf_directory = g_strdup_printf("%s/%s",
+                                              self->cg_base_directory,
+                                              temp_setting);
+    g_free(temp_setting);
 
-EXIT:
-    return type;
-}
+    /* Gadget control files
+     */
+    self->cg_ctrl_udc =
+        g_strdup_printf("%s/%s",
+                        self->cg_base_directory,
+                        DEFAULT_GADGET_CTRL_UDC);
 
-static const char *
-configfs_function_path(char *buff, size_t size, const char *func, ...)
-{
-    LOG_REGISTER_CONTEXT;
+    self->cg_ctrl_id_vendor =
+        g_strdup_printf("%s/%s",
+                        self->cg_base_directory,
+                        DEFAULT_GADGET_CTRL_ID_VENDOR);
 
-    char *pos = buff;
-    char *end = buff + size;
+    self->cg_ctrl_id_product =
+        g_strdup_printf("%s/%s",
+                        self->cg_base_directory,
+                        DEFAULT_GADGET_CTRL_ID_PRODUCT);
+
+    self->cg_ctrl_manufacturer =
+        g_strdup_printf("%s/%s",
+                        self->cg_base_directory,
+                        DEFAULT_GADGET_CTRL_MANUFACTURER);
 
-    snprintf(pos, end-pos, "%s", GADGET_FUNC_DIRECTORY);
+    self->cg_ctrl_product =
+        g_strdup_printf("%s/%s",
+                        self->cg_base_directory,
+                        DEFAULT_GADGET_CTRL_PRODUCT);
 
-    va_list va;
-    va_start(va, func);
-    while( func ) {
-        pos = strchr(pos, 0);
-        snprintf(pos, end-pos, "/%s", func);
-        func = va_arg(va, char *);
-    }
-    va_end(va);
+    self->cg_ctrl_serial =
+        g_strdup_printf("%s/%s",
+                        self->cg_base_directory,
+                        DEFAULT_GADGET_CTRL_SERIAL);
 
-    return buff;
+    /* Binding and static setup
+     */
+    self->cg_udc_config = configfs_get_conf(group, "udc", 0);
+    self->cg_functions  = configfs_get_conf(group, "functions", 0);
+    self->cg_vendorid   = configfs_get_conf(group, "vendor_id", 0);
+    self->cg_productid  = configfs_get_conf(group, "product_id", 0);
+
+    log_debug("gadget %s: base=%s udc=%s", self->cg_name,
+              self->cg_base_directory, self->cg_udc_config ?: "auto");
+
+    return self;
 }
 
-static const char *
-configfs_unit_path(char *buff, size_t size, const char *func, const char *unit)
+static void
+configfs_gadget_delete(configfs_gadget_t *self)
 {
     LOG_REGISTER_CONTEXT;
 
-    return configfs_function_path(buff, size, func, unit, NULL);
+    if( self ) {
+        configfs_state_invalidate(&self->cg_state);
+        g_free(self->cg_name);
+        g_free(self->cg_base_directory);
+        g_free(self->cg_func_directory);
+        g_free(self->cg_conf_directory);
+        g_free(self->cg_ctrl_udc);
+        g_free(self->cg_ctrl_id_vendor);
+        g_free(self->cg_ctrl_id_product);
+        g_free(self->cg_ctrl_manufacturer);
+        g_free(self->cg_ctrl_product);
+        g_free(self->cg_ctrl_serial);
+        g_free(self->cg_udc_config);
+        g_free(self->cg_udc);
+        g_free(self->cg_functions);
+        g_free(self->cg_vendorid);
+        g_free(self->cg_productid);
+        g_free(self);
+    }
 }
 
-static const char *
-configfs_config_path(char *buff, size_t size, const char *func)
+/** Get the gadget that is driven by usb mode selection
+ */
+static configfs_gadget_t *
+configfs_gadget_primary(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    snprintf(buff, size, "%s/%s", GADGET_CONF_DIRECTORY, func);
-    return buff;
+    return configfs_gadget_lut[0];
 }
 
-static bool
-configfs_mkdir(const char *path)
+/** Lookup additional gadget by name
+ *
+ * @param name  gadget name, as listed in extra_gadgets
+ *
+ * @return gadget object, or NULL if there is no such additional gadget
+ */
+static configfs_gadget_t *
+configfs_gadget_find_secondary(const char *name)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
-
-    if( mkdir(path, 0775) == -1 && errno != EEXIST ) {
-        log_err("%s: mkdir failed: %m", path);
-        goto EXIT;
+    /* Primary gadget is driven by usb mode selection */
+    for( size_t i = 1; i < configfs_gadget_count(); ++i ) {
+        if( !g_strcmp0(configfs_gadget_lut[i]->cg_name, name) )
+            return configfs_gadget_lut[i];
     }
+    return 0;
+}
 
-    if( configfs_file_type(path) != S_IFDIR ) {
-        log_err("%s: is not a directory", path);
-        goto EXIT;
-    }
+/** Check if name refers to an additional gadget
+ *
+ * Gadget objects are not changed after configfs_init(), so this is
+ * safe to call also from the main thread.
+ *
+ * @param name  gadget name, as listed in extra_gadgets
+ *
+ * @return true if additional gadget exists, false otherwise
+ */
+bool
+configfs_gadget_is_secondary(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
 
-    ack = true;
+    return configfs_gadget_find_secondary(name) != 0;
+}
 
-EXIT:
-    return ack;
+/** Get number of gadgets in use, including the primary one
+ */
+size_t
+configfs_gadget_count(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return configfs_in_use() ? configfs_gadget_cnt : 0;
 }
 
+/** Check if UDC is already bound to some gadget by configuration
+ *  or assignment
+ */
 static bool
-configfs_rmdir(const char *path)
+configfs_gadget_udc_claimed(const char *udc)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
-
-    if( rmdir(path) == -1 && errno != ENOENT ) {
-        log_err("%s: rmdir failed: %m", path);
-        goto EXIT;
+    for( size_t i = 0; i < configfs_gadget_cnt; ++i ) {
+        const configfs_gadget_t *gadget = configfs_gadget_lut[i];
+        if( !g_strcmp0(gadget->cg_udc, udc) ||
+            !g_strcmp0(gadget->cg_udc_config, udc) )
+            return true;
     }
-
-    ack = true;
-
-EXIT:
-    return ack;
+    return false;
 }
 
-static const char *
-configfs_register_function(const char *function)
+/** Assign UDCs to gadgets that do not have one yet
+ *
+ * Configured UDC names are used as is. The rest of gadgets get the
+ * first UDC in /sys/class/udc not claimed by any other gadget, which
+ * matches the historical behavior for the primary gadget.
+ */
+static void
+configfs_gadget_assign_udcs(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    const char *res = 0;
+    DIR *dir = opendir("/sys/class/udc");
 
-    static char fpath[PATH_MAX];
-    configfs_function_path(fpath, sizeof fpath, function, NULL);
+    for( size_t i = 0; i < configfs_gadget_cnt; ++i ) {
+        configfs_gadget_t *gadget = configfs_gadget_lut[i];
 
-    if( !configfs_mkdir(fpath) )
-        goto EXIT;
+        if( gadget->cg_udc )
+            continue;
 
-    log_debug("function %s is registered", function);
+        if( gadget->cg_udc_config ) {
+            gadget->cg_udc = g_strdup(gadget->cg_udc_config);
+        }
+        else if( dir ) {
+            struct dirent *de;
+            rewinddir(dir);
+            while( (de = readdir(dir)) ) {
+                if( de->d_type != DT_LNK )
+                    continue;
+                if( de->d_name[0] == '.' )
+                    continue;
+                if( configfs_gadget_udc_claimed(de->d_name) )
+                    continue;
+                gadget->cg_udc = g_strdup(de->d_name);
+                break;
+            }
+        }
 
-    res = fpath;
+        if( gadget->cg_udc )
+            log_debug("gadget %s: udc=%s", gadget->cg_name, gadget->cg_udc);
+    }
 
-EXIT:
-    return res;
+    if( dir )
+        closedir(dir);
 }
 
-#ifdef DEAD_CODE
+/** Check if the primary gadget has been configured by usb host
+ *
+ * With multiple UDCs in use, only the one bound to the primary
+ * gadget is relevant for mode selection.
+ */
 static bool
-configfs_unregister_function(const char *function)
+configfs_gadget_is_configured(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
-
-    char fpath[PATH_MAX];
-    configfs_function_path(fpath, sizeof fpath, function, NULL);
-
-    if( !configfs_rmdir(fpath) )
-        goto EXIT;
+    bool               ack     = false;
+    configfs_gadget_t *primary = configfs_gadget_primary();
 
-    log_debug("function %s is unregistered", function);
-    ack = true;
+    if( configfs_gadget_cnt < 2 || !primary || !primary->cg_udc ) {
+        ack = common_udc_is_configured();
+    }
+    else {
+        gchar *path = g_strdup_printf("/sys/class/udc/%s/state",
+                                      primary->cg_udc);
+        ack = common_file_has_value(path, "configured");
+        g_free(path);
+    }
 
-EXIT:
     return ack;
 }
-#endif
 
-static const char *
-configfs_add_unit(const char *function, const char *unit)
+/** Create and program an additional gadget
+ *
+ * @param self  gadget object
+ *
+ * @return true on success, false on failure
+ */
+static bool
+configfs_gadget_setup(configfs_gadget_t *self)
 {
     LOG_REGISTER_CONTEXT;
 
-    const char *res = 0;
+    bool   ack  = false;
+    gchar *text = 0;
+    gchar *path = 0;
 
-    static char upath[PATH_MAX];
-    configfs_unit_path(upath, sizeof upath, function, unit);
+    /* Gadget directories can be created on the fly */
+    path = g_strdup_printf("%s/%s", self->cg_base_directory,
+                           DEFAULT_GADGET_CTRL_STRINGS);
+    if( !configfs_mkdir(self->cg_base_directory) ||
+        !configfs_mkdir(path) ||
+        !configfs_mkdir(self->cg_conf_directory) )
+        goto EXIT;
 
-    if( !configfs_mkdir(upath) )
+    if( access(self->cg_ctrl_udc, F_OK) == -1 ) {
+        log_err("gadget %s: %s: %m", self->cg_name, self->cg_ctrl_udc);
         goto EXIT;
+    }
 
-    log_debug("function %s unit %s added", function, unit);
+    configfs_bind_udc(self, false);
+    configfs_state_invalidate(&self->cg_state);
 
-    res = upath;
+    if( (text = config_get_android_manufacturer()) ) {
+        configfs_write_file(self->cg_ctrl_manufacturer, text);
+        g_free(text);
+    }
 
-EXIT:
-    return res;
-}
+    if( (text = config_get_android_product()) ) {
+        configfs_write_file(self->cg_ctrl_product, text);
+        g_free(text);
+    }
 
-static bool
-configfs_remove_unit(const char *function, const char *unit)
-{
+    if( (text = android_get_serial()) ) {
+        configfs_write_file(self->cg_ctrl_serial, text);
+        g_free(text);
+    }
+
+    configfs_txn_t *txn = configfs_txn_create_for_gadget(self);
+    configfs_txn_set_vendorid(txn, self->cg_vendorid);
+    configfs_txn_set_productid(txn, self->cg_productid);
+    if( self->cg_functions ) {
+        configfs_txn_set_functions(txn, self->cg_functions);
+        configfs_txn_set_udc(txn, true);
+    }
+    ack = configfs_txn_commit(txn);
+    configfs_txn_delete(txn);
+
+EXIT:
+    g_free(path);
+
+    log_debug("gadget %s: setup -> %d", self->cg_name, ack);
+    return ack;
+}
+
+/** Change functions exposed via an additional gadget
+ *
+ * Only the given gadget is unbound / rebound, others are left as is.
+ * The primary gadget can't be changed, it is driven by usb mode
+ * selection.
+ *
+ * Note: Should be called only from the worker thread.
+ *
+ * @param name       gadget name, as listed in extra_gadgets
+ * @param functions  Comma separated list of function names to
+ *                   enable, or NULL / empty string to unbind gadget
+ *
+ * @return true if successful, false on failure
+ */
+bool
+configfs_gadget_set_functions(const char *name, const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    configfs_gadget_t *gadget = configfs_gadget_find_secondary(name);
+    if( !gadget ) {
+        log_warning("gadget %s: not an additional configfs gadget", name);
+        goto EXIT;
+    }
+
+    if( functions && !*functions )
+        functions = 0;
+
+    configfs_txn_t *txn = configfs_txn_create_for_gadget(gadget);
+    configfs_txn_set_functions(txn, functions);
+    configfs_txn_set_udc(txn, functions != 0);
+    ack = configfs_txn_commit(txn);
+    configfs_txn_delete(txn);
+
+EXIT:
+    log_debug("CONFIGFS %s(%s, %s) -> %d", __func__, name, functions, ack);
+    return ack;
+}
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+static int configfs_file_type(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int type = -1;
+
+    if( !path )
+        goto EXIT;
+
+    struct stat st;
+    if( lstat(path, &st) == -1 )
+        goto EXIT;
+
+    type = st.st_mode & S_IFMT;
+
+EXIT:
+    return type;
+}
+
+static const char *
+configfs_function_path(const configfs_gadget_t *gadget, char *buff, size_t size, const char *func, ...)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *pos = buff;
+    char *end = buff + size;
+
+    snprintf(pos, end-pos, "%s", gadget->cg_func_directory);
+
+    va_list va;
+    va_start(va, func);
+    while( func ) {
+        pos = strchr(pos, 0);
+        snprintf(pos, end-pos, "/%s", func);
+        func = va_arg(va, char *);
+    }
+    va_end(va);
+
+    return buff;
+}
+
+static const char *
+configfs_unit_path(const configfs_gadget_t *gadget, char *buff, size_t size, const char *func, const char *unit)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return configfs_function_path(gadget, buff, size, func, unit, NULL);
+}
+
+static const char *
+configfs_config_path(const configfs_gadget_t *gadget, char *buff, size_t size, const char *func)
+{
+    LOG_REGISTER_CONTEXT;
+
+    snprintf(buff, size, "%s/%s", gadget->cg_conf_directory, func);
+    return buff;
+}
+
+static bool
+configfs_mkdir(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( mkdir(path, 0775) == -1 && errno != EEXIST ) {
+        log_err("%s: mkdir failed: %m", path);
+        goto EXIT;
+    }
+
+    if( configfs_file_type(path) != S_IFDIR ) {
+        log_err("%s: is not a directory", path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+static bool
+configfs_rmdir(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( rmdir(path) == -1 && errno != ENOENT ) {
+        log_err("%s: rmdir failed: %m", path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+static const char *
+configfs_register_function(const configfs_gadget_t *gadget, const char *function)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *res = 0;
+
+    static char fpath[PATH_MAX];
+    configfs_function_path(gadget, fpath, sizeof fpath, function, NULL);
+
+    if( !configfs_mkdir(fpath) )
+        goto EXIT;
+
+    log_debug("function %s is registered", function);
+
+    res = fpath;
+
+EXIT:
+    return res;
+}
+
+#ifdef DEAD_CODE
+static bool
+configfs_unregister_function(const configfs_gadget_t *gadget, const char *function)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    char fpath[PATH_MAX];
+    configfs_function_path(gadget, fpath, sizeof fpath, function, NULL);
+
+    if( !configfs_rmdir(fpath) )
+        goto EXIT;
+
+    log_debug("function %s is unregistered", function);
+    ack = true;
+
+EXIT:
+    return ack;
+}
+#endif
+
+static const char *
+configfs_add_unit(const configfs_gadget_t *gadget, const char *function, const char *unit)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *res = 0;
+
+    static char upath[PATH_MAX];
+    configfs_unit_path(gadget, upath, sizeof upath, function, unit);
+
+    if( !configfs_mkdir(upath) )
+        goto EXIT;
+
+    log_debug("function %s unit %s added", function, unit);
+
+    res = upath;
+
+EXIT:
+    return res;
+}
+
+static bool
+configfs_remove_unit(const configfs_gadget_t *gadget, const char *function, const char *unit)
+{
     LOG_REGISTER_CONTEXT;
 
     bool ack = false;
 
     static char upath[PATH_MAX];
-    configfs_unit_path(upath, sizeof upath, function, unit);
+    configfs_unit_path(gadget, upath, sizeof upath, function, unit);
 
     if( !configfs_rmdir(upath) )
         goto EXIT;
@@ -439,20 +1006,20 @@ EXIT:
 }
 
 static bool
-configfs_enable_function(const char *function)
+configfs_enable_function(const configfs_gadget_t *gadget, const char *function)
 {
     LOG_REGISTER_CONTEXT;
 
     bool ack = false;
 
-    const char *fpath = configfs_register_function(function);
+    const char *fpath = configfs_register_function(gadget, function);
     if( !fpath ) {
         log_err("function %s is not registered", function);
         goto EXIT;
     }
 
     char cpath[PATH_MAX];
-    configfs_config_path(cpath, sizeof cpath, function);
+    configfs_config_path(gadget, cpath, sizeof cpath, function);
 
     switch( configfs_file_type(cpath) ) {
     case S_IFLNK:
@@ -480,14 +1047,14 @@ EXIT:
 }
 
 static bool
-configfs_disable_function(const char *function)
+configfs_disable_function(const configfs_gadget_t *gadget, const char *function)
 {
     LOG_REGISTER_CONTEXT;
 
     bool ack = false;
 
     char cpath[PATH_MAX];
-    configfs_config_path(cpath, sizeof cpath, function);
+    configfs_config_path(gadget, cpath, sizeof cpath, function);
 
     if( configfs_file_type(cpath) != S_IFLNK ) {
         log_err("%s: is not a symlink", cpath);
@@ -507,15 +1074,15 @@ EXIT:
 }
 
 static bool
-configfs_disable_all_functions(void)
+configfs_disable_all_functions(const configfs_gadget_t *gadget)
 {
     LOG_REGISTER_CONTEXT;
 
     bool  ack = false;
     DIR  *dir = 0;
 
-    if( !(dir = opendir(GADGET_CONF_DIRECTORY)) ) {
-        log_err("%s: opendir failed: %m", GADGET_CONF_DIRECTORY);
+    if( !(dir = opendir(gadget->cg_conf_directory)) ) {
+        log_err("%s: opendir failed: %m", gadget->cg_conf_directory);
         goto EXIT;
     }
 
@@ -526,7 +1093,7 @@ configfs_disable_all_functions(void)
         if( de->d_type != DT_LNK )
             continue;
 
-        if( !configfs_disable_function(de->d_name) )
+        if( !configfs_disable_function(gadget, de->d_name) )
             ack = false;
     }
 
@@ -578,41 +1145,24 @@ configfs_probe(void)
     configfs_read_configuration();
 
     if( configfs_probed <= 0 ) {
-        configfs_probed = (access(GADGET_BASE_DIRECTORY, F_OK) == 0 &&
-                           access(GADGET_CTRL_UDC, F_OK) == 0);
+        const configfs_gadget_t *primary = configfs_gadget_primary();
+        configfs_probed = (access(primary->cg_base_directory, F_OK) == 0 &&
+                           access(primary->cg_ctrl_udc, F_OK) == 0);
         log_warning("CONFIGFS %sdetected", configfs_probed ? "" : "not ");
     }
     return configfs_in_use();
 }
 
 static const char *
-configfs_udc_enable_value(void)
+configfs_udc_enable_value(configfs_gadget_t *gadget)
 {
     LOG_REGISTER_CONTEXT;
 
-    static bool  probed = false;
-    static char *value  = 0;
-
-    if( !probed ) {
-        probed = true;
-
-        /* Find first symlink in /sys/class/udc directory */
-        struct dirent *de;
-        DIR *dir = opendir("/sys/class/udc");
-        if( dir ) {
-            while( (de = readdir(dir)) ) {
-                if( de->d_type != DT_LNK )
-                    continue;
-                if( de->d_name[0] == '.' )
-                    continue;
-                value = strdup(de->d_name);
-                break;
-            }
-            closedir(dir);
-        }
-    }
+    /* UDC drivers might get loaded after usb-moded has started */
+    if( !gadget->cg_udc )
+        configfs_gadget_assign_udcs();
 
-    return value ?: "";
+    return gadget->cg_udc ?: "";
 }
 
 static bool
@@ -637,114 +1187,978 @@ configfs_write_file(const char *path, const char *text)
         goto EXIT;
     }
 
+    trace_count(TRACE_COUNTER_SYSFS_WRITE);
     int rc = write(fd, buff, size);
     if( rc == -1 ) {
         log_err("%s: write failure: %m", path);
         goto EXIT;
     }
 
-    if( (size_t)rc != size ) {
-        log_err("%s: write failure: partial success", path);
-        goto EXIT;
-    }
+    if( (size_t)rc != size ) {
+        log_err("%s: write failure: partial success", path);
+        goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    return ack;
+}
+
+static bool
+configfs_read_file(const char *path, char *buff, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    int  fd  = -1;
+
+    if( !path || !buff )
+        goto EXIT;
+
+    if( size < 2 )
+        goto EXIT;
+
+    if( (fd = open(path, O_RDONLY)) == -1 ) {
+        log_err("%s: can't open for reading: %m", path);
+        goto EXIT;
+    }
+
+    int rc = read(fd, buff, size - 1);
+    if( rc == -1 ) {
+        log_err("%s: read failure: %m", path);
+        goto EXIT;
+    }
+
+    buff[rc] = 0;
+    configfs_strip(buff);
+
+    ack = true;
+
+    log_debug("READ %s '%s'", path, buff);
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    return ack;
+}
+
+#ifdef DEAD_CODE
+static bool
+configfs_read_udc(const configfs_gadget_t *gadget, char *buff, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return configfs_read_file(gadget->cg_ctrl_udc, buff, size);
+}
+#endif
+
+static bool
+configfs_write_udc(const configfs_gadget_t *gadget, const char *text)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    char prev[64];
+
+    if( !configfs_read_file(gadget->cg_ctrl_udc, prev, sizeof prev) )
+        goto EXIT;
+
+    if( strcmp(prev, text) ) {
+        if( !configfs_write_file(gadget->cg_ctrl_udc, text) )
+            goto EXIT;
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+
+}
+
+/** Convert usb id from config file format to what kernel expects
+ *
+ * Config files have things like "0A02", kernel wants to see "0x0a02".
+ *
+ * @param id  usb vendor / product id
+ *
+ * @return normalized id string, release with g_free()
+ */
+static gchar *
+configfs_normalize_id(const char *id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *end = 0;
+    unsigned num = strtol(id, &end, 16);
+
+    if( end > id && *end == 0 )
+        return g_strdup_printf("0x%04x", num);
+
+    return g_strdup(id);
+}
+
+static bool
+configfs_bind_udc(configfs_gadget_t *gadget, bool enable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    log_debug("UDC %s - %s", gadget->cg_name, enable ? "ENABLE" : "DISABLE");
+
+    const char *value = "";
+
+    if( enable )
+        value = configfs_udc_enable_value(gadget);
+
+    return configfs_write_udc(gadget, value);
+}
+
+bool
+configfs_set_udc(bool enable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return configfs_bind_udc(configfs_gadget_primary(), enable);
+}
+
+/* ========================================================================= *
+ * CONFIGFS_STATE
+ * ========================================================================= */
+
+/** Forget cached gadget state
+ *
+ * Everything gets written on the next transaction commit.
+ */
+static void
+configfs_state_invalidate(configfs_state_t *state)
+{
+    LOG_REGISTER_CONTEXT;
+
+    state->cs_functions_valid = false;
+    g_strfreev(state->cs_functions),
+        state->cs_functions = 0;
+    g_free(state->cs_productid),
+        state->cs_productid = 0;
+    g_free(state->cs_vendorid),
+        state->cs_vendorid = 0;
+    g_free(state->cs_net_params),
+        state->cs_net_params = 0;
+}
+
+/** Save gadget state snapshot for use after usb-moded restart
+ *
+ * @param gadget  gadget whose state should be saved
+ */
+static void
+configfs_state_save(const configfs_gadget_t *gadget)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const configfs_state_t *state = &gadget->cg_state;
+    GKeyFile               *ini   = 0;
+    gchar                  *data  = 0;
+    gchar                  *dir   = 0;
+    GError                 *err   = 0;
+
+    if( !state->cs_functions_valid ) {
+        if( unlink(CONFIGFS_STATE_FILE) == -1 && errno != ENOENT )
+            log_warning("%s: unlink: %m", CONFIGFS_STATE_FILE);
+        goto EXIT;
+    }
+
+    ini = g_key_file_new();
+    g_key_file_set_string_list(ini, gadget->cg_name, "functions",
+                               (const gchar * const *)state->cs_functions,
+                               g_strv_length(state->cs_functions));
+    if( state->cs_productid )
+        g_key_file_set_string(ini, gadget->cg_name, "productid",
+                              state->cs_productid);
+    if( state->cs_vendorid )
+        g_key_file_set_string(ini, gadget->cg_name, "vendorid",
+                              state->cs_vendorid);
+    if( state->cs_net_params )
+        g_key_file_set_string(ini, gadget->cg_name, "net_params",
+                              state->cs_net_params);
+
+    dir  = g_path_get_dirname(CONFIGFS_STATE_FILE);
+    data = g_key_file_to_data(ini, 0, 0);
+
+    if( g_mkdir_with_parents(dir, 0755) == -1 )
+        log_warning("%s: mkdir: %m", dir);
+    else if( !g_file_set_contents(CONFIGFS_STATE_FILE, data, -1, &err) )
+        log_warning("%s: save failed: %s", CONFIGFS_STATE_FILE, err->message);
+
+EXIT:
+    g_clear_error(&err);
+    g_free(data);
+    g_free(dir);
+    if( ini )
+        g_key_file_unref(ini);
+}
+
+/** Check that functions linked to gadget config are the expected ones
+ *
+ * Link order can't be determined, only the set of functions is compared.
+ *
+ * @param gadget     gadget to check
+ * @param functions  expected functions
+ *
+ * @return true if linked functions match, false otherwise
+ */
+static bool
+configfs_state_links_match(const configfs_gadget_t *gadget, gchar **functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   ack   = false;
+    DIR   *dir   = 0;
+    guint  count = 0;
+
+    if( !(dir = opendir(gadget->cg_conf_directory)) ) {
+        log_err("%s: opendir failed: %m", gadget->cg_conf_directory);
+        goto EXIT;
+    }
+
+    struct dirent *de;
+    while( (de = readdir(dir)) ) {
+        if( de->d_type != DT_LNK )
+            continue;
+        if( !g_strv_contains((const gchar * const *)functions, de->d_name) ) {
+            log_debug("function %s is not expected", de->d_name);
+            goto EXIT;
+        }
+        ++count;
+    }
+
+    ack = (count == g_strv_length(functions));
+
+EXIT:
+    if( dir )
+        closedir(dir);
+
+    return ack;
+}
+
+/** Check that usb id in control file is the expected one
+ *
+ * @param path  idProduct / idVendor control file path
+ * @param id    expected value in normalized form, or NULL for any
+ *
+ * @return true if id matches, false otherwise
+ */
+static bool
+configfs_state_id_matches(const char *path, const char *id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   ack  = false;
+    gchar *norm = 0;
+    char   buff[64];
+
+    if( !id ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( !configfs_read_file(path, buff, sizeof buff) )
+        goto EXIT;
+
+    norm = configfs_normalize_id(buff);
+    ack  = !g_strcmp0(norm, id);
+
+EXIT:
+    g_free(norm);
+
+    return ack;
+}
+
+/** Adopt gadget state left by previous usb-moded instance
+ *
+ * If the gadget is bound and live configfs content matches the
+ * snapshot saved by #configfs_state_save(), cached state is seeded
+ * from the snapshot so that reprogramming the same configuration
+ * does not cause unbind / rebind, i.e. re-enumeration on host side.
+ *
+ * @param gadget  gadget to check
+ *
+ * @return true if the gadget was adopted, false otherwise
+ */
+static bool
+configfs_state_adopt(configfs_gadget_t *gadget)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool      ack        = false;
+    GKeyFile *ini        = g_key_file_new();
+    gchar   **functions  = 0;
+    gchar    *productid  = 0;
+    gchar    *vendorid   = 0;
+    gchar    *net_params = 0;
+    char      udc[64]    = "";
+
+    if( access(CONFIGFS_STATE_FILE, F_OK) == -1 ) {
+        /* Normal after reboot, nothing to adopt or reset */
+        log_debug("CONFIGFS %s: no saved gadget state", gadget->cg_name);
+        goto CLEANUP;
+    }
+
+    if( !configfs_read_file(gadget->cg_ctrl_udc, udc, sizeof udc) || !*udc )
+        goto EXIT;
+
+    if( strcmp(udc, configfs_udc_enable_value(gadget)) ) {
+        log_debug("bound to %s, expected %s", udc, gadget->cg_udc ?: "n/a");
+        goto EXIT;
+    }
+
+    if( !g_key_file_load_from_file(ini, CONFIGFS_STATE_FILE, 0, 0) )
+        goto EXIT;
+
+    functions  = g_key_file_get_string_list(ini, gadget->cg_name, "functions", 0, 0);
+    productid  = g_key_file_get_string(ini, gadget->cg_name, "productid", 0);
+    vendorid   = g_key_file_get_string(ini, gadget->cg_name, "vendorid", 0);
+    net_params = g_key_file_get_string(ini, gadget->cg_name, "net_params", 0);
+
+    if( !functions || !configfs_state_links_match(gadget, functions) )
+        goto EXIT;
+
+    if( !configfs_state_id_matches(gadget->cg_ctrl_id_product, productid) ||
+        !configfs_state_id_matches(gadget->cg_ctrl_id_vendor, vendorid) )
+        goto EXIT;
+
+    configfs_state_t *state = &gadget->cg_state;
+    configfs_state_invalidate(state);
+    state->cs_functions_valid = true;
+    state->cs_functions  = functions,  functions  = 0;
+    state->cs_productid  = productid,  productid  = 0;
+    state->cs_vendorid   = vendorid,   vendorid   = 0;
+    state->cs_net_params = net_params, net_params = 0;
+
+    ack = true;
+
+EXIT:
+    if( ack )
+        log_notice("CONFIGFS %s: adopted gadget state on %s",
+                   gadget->cg_name, udc);
+    else
+        log_warning("CONFIGFS %s: resetting gadget state on %s",
+                    gadget->cg_name, *udc ? udc : "unbound udc");
+
+CLEANUP:
+    g_free(net_params);
+    g_free(vendorid);
+    g_free(productid);
+    g_strfreev(functions);
+    g_key_file_unref(ini);
+
+    return ack;
+}
+
+/** Check and clear: primary gadget was adopted on startup
+ *
+ * @return true if gadget was adopted, false otherwise
+ */
+bool
+configfs_take_adopted(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool adopted = configfs_adopted;
+    configfs_adopted = false;
+    return adopted;
+}
+
+static bool
+configfs_strv_equal(gchar **a, gchar **b)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t n = configfs_strv_common_prefix(a, b);
+    return !(a && a[n]) && !(b && b[n]);
+}
+
+static size_t
+configfs_strv_common_prefix(gchar **a, gchar **b)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t n = 0;
+    if( a && b ) {
+        while( a[n] && b[n] && !strcmp(a[n], b[n]) )
+            ++n;
+    }
+    return n;
+}
+
+/* ========================================================================= *
+ * CONFIGFS_TXN
+ * ========================================================================= */
+
+/** Create gadget configuration transaction
+ *
+ * Desired gadget state is collected with configfs_txn_set_xxx()
+ * functions and then applied with configfs_txn_commit(), which
+ * compares it against cached gadget state and makes only the
+ * configfs changes that are needed.
+ *
+ * The transaction applies to the primary gadget.
+ *
+ * @return transaction object, release with configfs_txn_delete()
+ */
+configfs_txn_t *
+configfs_txn_create(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    configfs_txn_t *self = g_malloc0(sizeof *self);
+
+    self->ct_gadget        = configfs_gadget_primary();
+    self->ct_set_functions = false;
+    self->ct_functions     = 0;
+    self->ct_productid     = 0;
+    self->ct_vendorid      = 0;
+    self->ct_udc           = -1;
+    self->ct_luns          = g_ptr_array_new_with_free_func(configfs_txn_lun_free);
+    self->ct_ms_stall      = 0;
+    self->ct_ms_num_buffers = 0;
+    self->ct_net_qmult     = 0;
+    self->ct_net_host_addr = 0;
+    self->ct_net_dev_addr  = 0;
+
+    return self;
+}
+
+/** Create gadget configuration transaction for a specific gadget
+ *
+ * @param gadget  gadget object
+ *
+ * @return transaction object, release with configfs_txn_delete()
+ */
+static configfs_txn_t *
+configfs_txn_create_for_gadget(configfs_gadget_t *gadget)
+{
+    LOG_REGISTER_CONTEXT;
+
+    configfs_txn_t *self = configfs_txn_create();
+    self->ct_gadget = gadget;
+
+    return self;
+}
+
+void
+configfs_txn_delete(configfs_txn_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        g_strfreev(self->ct_functions);
+        g_free(self->ct_productid);
+        g_free(self->ct_vendorid);
+        g_ptr_array_unref(self->ct_luns);
+        g_free(self->ct_ms_stall);
+        g_free(self->ct_ms_num_buffers);
+        g_free(self->ct_net_host_addr);
+        g_free(self->ct_net_dev_addr);
+        g_free(self);
+    }
+}
+
+/** Set functions to enable
+ *
+ * @param self       transaction object
+ * @param functions  Comma separated list of function names to
+ *                   enable, or NULL to disable all
+ */
+void
+configfs_txn_set_functions(configfs_txn_t *self, const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GPtrArray *arr = g_ptr_array_new();
+
+    if( functions ) {
+        gchar **vec = g_strsplit(functions, ",", 0);
+        for( size_t i = 0; vec[i]; ++i ) {
+            /* Normalize names used by usb-moded itself and already
+             * existing configuration files etc.
+             */
+            const char *use = configfs_map_function(vec[i]);
+            if( use && *use )
+                g_ptr_array_add(arr, g_strdup(use));
+        }
+        g_strfreev(vec);
+    }
+    g_ptr_array_add(arr, 0);
+
+    g_strfreev(self->ct_functions);
+    self->ct_functions = (gchar **)g_ptr_array_free(arr, FALSE);
+    self->ct_set_functions = true;
+}
+
+void
+configfs_txn_set_productid(configfs_txn_t *self, const char *id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(self->ct_productid),
+        self->ct_productid = id ? configfs_normalize_id(id) : 0;
+}
+
+void
+configfs_txn_set_vendorid(configfs_txn_t *self, const char *id)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(self->ct_vendorid),
+        self->ct_vendorid = id ? configfs_normalize_id(id) : 0;
+}
+
+void
+configfs_txn_set_udc(configfs_txn_t *self, bool enable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    self->ct_udc = enable ? 1 : 0;
+}
+
+static void
+configfs_txn_lun_free(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gadget_lun_t *lun = aptr;
+
+    if( lun ) {
+        g_free((gchar *)lun->gl_file);
+        g_free(lun);
+    }
+}
+
+/** Add mass storage lun
+ *
+ * Luns are numbered in the order they are added. All lun directories
+ * and attributes are written within the same UDC unbind / bind cycle.
+ *
+ * @param self  transaction object
+ * @param lun   Lun backing device and attributes
+ */
+void
+configfs_txn_add_mass_storage_lun(configfs_txn_t *self, const gadget_lun_t *lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gadget_lun_t *copy = g_new0(gadget_lun_t, 1);
+    *copy = *lun;
+    copy->gl_file = g_strdup(lun->gl_file);
+    g_ptr_array_add(self->ct_luns, copy);
+}
+
+/** Set mass storage function level tunables
+ *
+ * Written together with luns, values that the kernel does not
+ * provide attributes for are skipped.
+ *
+ * @param self         transaction object
+ * @param stall        "1" to allow halting bulk endpoints, or NULL
+ * @param num_buffers  number of pipeline buffers, or NULL
+ */
+void
+configfs_txn_set_mass_storage_params(configfs_txn_t *self, const char *stall,
+                                     const char *num_buffers)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(self->ct_ms_stall),
+        self->ct_ms_stall = g_strdup(stall);
+    g_free(self->ct_ms_num_buffers),
+        self->ct_ms_num_buffers = g_strdup(num_buffers);
+}
+
+/** Set tunables for network functions
+ *
+ * Applied to ncm / ecm functions in the function list. Changing them
+ * requires relinking the functions, which is done only when needed.
+ *
+ * @param self       transaction object
+ * @param qmult      queue length multiplier for high speed, or zero
+ * @param host_addr  host side MAC address, or NULL
+ * @param dev_addr   device side MAC address, or NULL
+ */
+void
+configfs_txn_set_net_params(configfs_txn_t *self, int qmult,
+                            const char *host_addr, const char *dev_addr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    self->ct_net_qmult = qmult;
+    g_free(self->ct_net_host_addr),
+        self->ct_net_host_addr = g_strdup(host_addr);
+    g_free(self->ct_net_dev_addr),
+        self->ct_net_dev_addr = g_strdup(dev_addr);
+}
+
+/** Create mass storage luns listed in transaction
+ *
+ * @note UDC must be unbound and functions unlinked when this is called.
+ *
+ * @param self  transaction object
+ *
+ * @return true on success, false on failure
+ */
+static bool
+configfs_txn_apply_luns(const configfs_txn_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+
+    static const char * const keys[] = {
+        "cdrom", "nofua", "removable", "ro", "file",
+    };
+
+    /* Function level attributes; num_buffers exists only in
+     * kernels built with CONFIG_USB_GADGET_DEBUG_FILES */
+    const char *fkeys[] = { "stall", "num_buffers" };
+    const char *fvals[] = { self->ct_ms_stall, self->ct_ms_num_buffers };
+
+    for( size_t k = 0; k < G_N_ELEMENTS(fkeys); ++k ) {
+        if( !fvals[k] )
+            continue;
+        char path[PATH_MAX];
+        configfs_function_path(self->ct_gadget, path, sizeof path,
+                               FUNCTION_MASS_STORAGE, fkeys[k], NULL);
+        if( access(path, F_OK) == -1 )
+            log_debug("%s: not supported by kernel", path);
+        else if( !configfs_write_file(path, fvals[k]) )
+            ack = false;
+    }
+
+    for( guint i = 0; i < self->ct_luns->len; ++i ) {
+        const gadget_lun_t *lun = g_ptr_array_index(self->ct_luns, i);
+        const char *vals[] = {
+            lun->gl_cdrom     ? "1" : "0",
+            lun->gl_nofua     ? "1" : "0",
+            lun->gl_removable ? "1" : "0",
+            lun->gl_ro        ? "1" : "0",
+            lun->gl_file,
+        };
+
+        if( !configfs_lun_add(self->ct_gadget, i) ) {
+            ack = false;
+            continue;
+        }
+        for( size_t k = 0; k < G_N_ELEMENTS(keys); ++k ) {
+            if( !configfs_lun_set_attr(self->ct_gadget, i, keys[k], vals[k]) )
+                ack = false;
+        }
+    }
+
+    return ack;
+}
+
+/** Describe network function tunables of a transaction
+ *
+ * @param self  transaction object
+ *
+ * @return description for change detection, or NULL if the function
+ *         list has no network functions or there is nothing to set;
+ *         release with g_free()
+ */
+static gchar *
+configfs_txn_net_params(const configfs_txn_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *str = 0;
+
+    if( !self->ct_set_functions )
+        goto EXIT;
+
+    if( !self->ct_net_qmult && !self->ct_net_host_addr && !self->ct_net_dev_addr )
+        goto EXIT;
+
+    for( size_t i = 0; self->ct_functions[i]; ++i ) {
+        if( !configfs_is_net_function(self->ct_functions[i]) )
+            continue;
+        if( !str )
+            str = g_string_new(0);
+        g_string_append_printf(str, "%s,", self->ct_functions[i]);
+    }
+
+    if( str )
+        g_string_append_printf(str, "qmult=%d,host=%s,dev=%s",
+                               self->ct_net_qmult,
+                               self->ct_net_host_addr ?: "",
+                               self->ct_net_dev_addr ?: "");
+EXIT:
+    return str ? g_string_free(str, FALSE) : 0;
+}
+
+/** Write tunables for network functions listed in transaction
+ *
+ * @note UDC must be unbound and functions unlinked when this is
+ *       called, u_ether refuses attribute changes otherwise.
+ *
+ * @param self  transaction object
+ *
+ * @return true on success, false on failure
+ */
+static bool
+configfs_txn_apply_net(const configfs_txn_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = true;
+    char path[PATH_MAX];
+
+    for( size_t i = 0; self->ct_functions[i]; ++i ) {
+        const char *function = self->ct_functions[i];
+
+        if( !configfs_is_net_function(function) )
+            continue;
+
+        if( !configfs_register_function(self->ct_gadget, function) ) {
+            ack = false;
+            continue;
+        }
 
-    ack = true;
+        if( self->ct_net_qmult > 0 ) {
+            char qmult[16];
+            snprintf(qmult, sizeof qmult, "%d", self->ct_net_qmult);
+            configfs_function_path(self->ct_gadget, path, sizeof path,
+                                   function, DEFAULT_NET_CTRL_QMULT, NULL);
+            if( !configfs_write_file(path, qmult) )
+                ack = false;
+        }
 
-EXIT:
-    if( fd != -1 )
-        close(fd);
+        if( self->ct_net_host_addr ) {
+            configfs_function_path(self->ct_gadget, path, sizeof path,
+                                   function, DEFAULT_NET_CTRL_HOST_ADDR, NULL);
+            if( !configfs_write_file(path, self->ct_net_host_addr) )
+                ack = false;
+        }
+
+        if( self->ct_net_dev_addr ) {
+            configfs_function_path(self->ct_gadget, path, sizeof path,
+                                   function, DEFAULT_NET_CTRL_DEV_ADDR, NULL);
+            if( !configfs_write_file(path, self->ct_net_dev_addr) )
+                ack = false;
+        }
+    }
 
     return ack;
 }
 
+/** Relink function symlinks to match transaction
+ *
+ * Links that are common with previously enabled functions are
+ * left in place, the rest are removed and recreated in order.
+ *
+ * @note UDC must be unbound when this is called.
+ *
+ * @param self  transaction object
+ *
+ * @return true on success, false on failure
+ */
 static bool
-configfs_read_file(const char *path, char *buff, size_t size)
+configfs_txn_apply_functions(const configfs_txn_t *self)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
-    int  fd  = -1;
-
-    if( !path || !buff )
-        goto EXIT;
-
-    if( size < 2 )
-        goto EXIT;
+    bool                     ack    = false;
+    size_t                   keep   = 0;
+    const configfs_gadget_t *gadget = self->ct_gadget;
+    configfs_state_t        *state  = &self->ct_gadget->cg_state;
 
-    if( (fd = open(path, O_RDONLY)) == -1 ) {
-        log_err("%s: can't open for reading: %m", path);
-        goto EXIT;
+    if( !state->cs_functions_valid ) {
+        if( !configfs_disable_all_functions(gadget) )
+            goto EXIT;
     }
-
-    int rc = read(fd, buff, size - 1);
-    if( rc == -1 ) {
-        log_err("%s: read failure: %m", path);
-        goto EXIT;
+    else {
+        keep = configfs_strv_common_prefix(state->cs_functions,
+                                           self->ct_functions);
+        for( size_t i = keep; state->cs_functions[i]; ++i ) {
+            if( !configfs_disable_function(gadget, state->cs_functions[i]) )
+                goto EXIT;
+        }
     }
 
-    buff[rc] = 0;
-    configfs_strip(buff);
+    for( size_t i = keep; self->ct_functions[i]; ++i ) {
+        if( !configfs_enable_function(gadget, self->ct_functions[i]) )
+            goto EXIT;
+    }
 
     ack = true;
 
-    log_debug("READ %s '%s'", path, buff);
-
 EXIT:
-    if( fd != -1 )
-        close(fd);
+    g_strfreev(state->cs_functions),
+        state->cs_functions = 0;
+
+    if( (state->cs_functions_valid = ack) )
+        state->cs_functions = g_strdupv(self->ct_functions);
 
     return ack;
 }
 
-#ifdef DEAD_CODE
+/** Bind / unbind the UDC of transaction target gadget
+ */
 static bool
-configfs_read_udc(char *buff, size_t size)
+configfs_txn_commit_udc(configfs_txn_t *self, bool enable)
 {
     LOG_REGISTER_CONTEXT;
 
-    return configfs_read_file(GADGET_CTRL_UDC, buff, size);
+    return configfs_bind_udc(self->ct_gadget, enable);
 }
-#endif
 
-static bool
-configfs_write_udc(const char *text)
+/** Apply gadget changes collected into a transaction
+ *
+ * UDC is unbound only if functions or usb ids actually change,
+ * and it is bound again (at most once) if requested - or if it
+ * was bound before and the transaction does not specify UDC state.
+ *
+ * @param self  transaction object
+ *
+ * @return true on success, false on failure
+ */
+bool
+configfs_txn_commit(configfs_txn_t *self)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool ack = false;
+    bool   ack        = false;
+    bool   dirty      = false;
+    char   prev[64]   = "";
+    gchar *net_params = 0;
 
-    char prev[64];
+    if( !configfs_in_use() || !self->ct_gadget )
+        goto EXIT;
+
+    const configfs_gadget_t *gadget = self->ct_gadget;
+    configfs_state_t        *state  = &self->ct_gadget->cg_state;
 
-    if( !configfs_read_file(GADGET_CTRL_UDC, prev, sizeof prev) )
+    bool functions_changed =
+        (self->ct_set_functions &&
+         !(state->cs_functions_valid &&
+           configfs_strv_equal(state->cs_functions,
+                               self->ct_functions)));
+
+    bool productid_changed =
+        (self->ct_productid &&
+         g_strcmp0(state->cs_productid, self->ct_productid));
+
+    bool vendorid_changed =
+        (self->ct_vendorid &&
+         g_strcmp0(state->cs_vendorid, self->ct_vendorid));
+
+    bool luns_changed = self->ct_luns->len > 0;
+
+    net_params = configfs_txn_net_params(self);
+    bool net_changed = (net_params &&
+                        g_strcmp0(state->cs_net_params, net_params));
+
+    bool changed = (functions_changed || productid_changed ||
+                    vendorid_changed || luns_changed || net_changed);
+
+    if( !configfs_read_file(gadget->cg_ctrl_udc, prev, sizeof prev) )
         goto EXIT;
 
-    if( strcmp(prev, text) ) {
-        if( !configfs_write_file(GADGET_CTRL_UDC, text) )
+    bool was_bound  = *prev != 0;
+    bool want_bound = self->ct_udc < 0 ? was_bound : self->ct_udc > 0;
+
+    log_debug("CONFIGFS txn %s: functions=%s productid=%s vendorid=%s luns=%u net=%s udc=%s->%s",
+              gadget->cg_name,
+              functions_changed ? "change" : "keep",
+              productid_changed ? "change" : "keep",
+              vendorid_changed  ? "change" : "keep",
+              self->ct_luns->len,
+              net_changed       ? "change" : "keep",
+              was_bound  ? "bound" : "unbound",
+              want_bound ? "bound" : "unbound");
+
+    if( was_bound && (changed || !want_bound) ) {
+        if( !configfs_txn_commit_udc(self, false) )
             goto EXIT;
     }
+    else if( !changed && was_bound == want_bound ) {
+        /* Nothing to do */
+        ack = true;
+        goto EXIT;
+    }
 
-    ack = true;
+    dirty = true;
 
-EXIT:
-    return ack;
+    if( luns_changed || net_changed ) {
+        /* Luns are created and network tunables written
+         * while no functions are linked */
+        state->cs_functions_valid = false;
+        g_strfreev(state->cs_functions),
+            state->cs_functions = 0;
+        if( !configfs_disable_all_functions(gadget) )
+            goto EXIT;
+        state->cs_functions       = g_new0(gchar *, 1);
+        state->cs_functions_valid = true;
+        functions_changed = self->ct_set_functions;
+
+        if( luns_changed && !configfs_txn_apply_luns(self) )
+            log_warning("CONFIGFS: mass storage lun setup failed");
+
+        if( net_changed ) {
+            g_free(state->cs_net_params),
+                state->cs_net_params = 0;
+            if( configfs_txn_apply_net(self) )
+                state->cs_net_params = g_strdup(net_params);
+            else
+                log_warning("CONFIGFS: network function setup failed");
+        }
+    }
 
-}
+    if( functions_changed ) {
+        if( !configfs_txn_apply_functions(self) )
+            goto EXIT;
+    }
 
-bool
-configfs_set_udc(bool enable)
-{
-    LOG_REGISTER_CONTEXT;
+    if( productid_changed ) {
+        g_free(state->cs_productid),
+            state->cs_productid = 0;
+        if( !configfs_write_file(gadget->cg_ctrl_id_product, self->ct_productid) )
+            goto EXIT;
+        state->cs_productid = g_strdup(self->ct_productid);
+    }
 
-    log_debug("UDC - %s", enable ? "ENABLE" : "DISABLE");
+    if( vendorid_changed ) {
+        g_free(state->cs_vendorid),
+            state->cs_vendorid = 0;
+        if( !configfs_write_file(gadget->cg_ctrl_id_vendor, self->ct_vendorid) )
+            goto EXIT;
+        state->cs_vendorid = g_strdup(self->ct_vendorid);
+    }
 
-    const char *value = "";
+    if( want_bound ) {
+        if( !configfs_txn_commit_udc(self, true) )
+            goto EXIT;
+    }
 
-    if( enable )
-        value = configfs_udc_enable_value();
+    ack = true;
+
+EXIT:
+    /* Keep snapshot up to date for adoption after restart */
+    if( dirty && self->ct_gadget == configfs_gadget_primary() )
+        configfs_state_save(self->ct_gadget);
+
+    g_free(net_params);
 
-    return configfs_write_udc(value);
+    log_debug("CONFIGFS %s() -> %d", __func__, ack);
+    return ack;
 }
 
+/* ========================================================================= *
+ * CONFIGFS
+ * ========================================================================= */
+
 /** initialize the basic configfs values
  *
  * @return true if configfs backend is ready for use, false otherwise
@@ -757,44 +2171,60 @@ configfs_init(void)
     if( !configfs_probe() )
         goto EXIT;
 
+    configfs_gadget_t *primary = configfs_gadget_primary();
+
+    /* Configured UDCs must be known before auto assignment */
+    configfs_gadget_assign_udcs();
+
+    /* Gadget left bound by a previous usb-moded instance is kept as
+     * is, if it still matches what was programmed. This way restarts
+     * do not cause re-enumeration on host side. */
+    if( (configfs_adopted = configfs_state_adopt(primary)) )
+        goto EXTRA_GADGETS;
+
     /* Disable */
     configfs_set_udc(false);
 
+    /* Whatever was cached is not valid anymore */
+    configfs_state_invalidate(&primary->cg_state);
+
     /* Configure */
     gchar *text;
-    if( (text = config_get_android_vendor_id()) ) {
-        configfs_write_file(GADGET_CTRL_ID_VENDOR, text);
+    if( (text = primary->cg_vendorid ? g_strdup(primary->cg_vendorid) :
+         config_get_android_vendor_id()) ) {
+        configfs_write_file(primary->cg_ctrl_id_vendor, text);
         g_free(text);
     }
 
-    if( (text = config_get_android_product_id()) ) {
-        configfs_write_file(GADGET_CTRL_ID_PRODUCT, text);
+    if( (text = primary->cg_productid ? g_strdup(primary->cg_productid) :
+         config_get_android_product_id()) ) {
+        configfs_write_file(primary->cg_ctrl_id_product, text);
         g_free(text);
     }
 
     if( (text = config_get_android_manufacturer()) ) {
-        configfs_write_file(GADGET_CTRL_MANUFACTURER, text);
+        configfs_write_file(primary->cg_ctrl_manufacturer, text);
         g_free(text);
     }
 
     if( (text = config_get_android_product()) ) {
-        configfs_write_file(GADGET_CTRL_PRODUCT, text);
+        configfs_write_file(primary->cg_ctrl_product, text);
         g_free(text);
     }
 
     if( (text = android_get_serial()) ) {
-        configfs_write_file(GADGET_CTRL_SERIAL, text);
+        configfs_write_file(primary->cg_ctrl_serial, text);
         g_free(text);
     }
 
     /* Prep: charging_only */
-    configfs_register_function(FUNCTION_MASS_STORAGE);
+    configfs_register_function(primary, FUNCTION_MASS_STORAGE);
 
     /* Prep: mtp_mode */
-    configfs_register_function(FUNCTION_MTP);
+    configfs_register_function(primary, FUNCTION_MTP);
 
     /* Prep: developer_mode */
-    configfs_register_function(FUNCTION_RNDIS);
+    configfs_register_function(primary, FUNCTION_RNDIS);
     if( (text = mac_read_mac()) ) {
         configfs_write_file(RNDIS_CTRL_ETHADDR, text);
         g_free(text);
@@ -802,7 +2232,29 @@ configfs_init(void)
     /* For rndis to be discovered correctly in M$ Windows (vista and later) */
     configfs_write_file(RNDIS_CTRL_WCEIS, "1");
 
+    /* Let hosts that have a ncm class driver pick it up */
+    if( (text = configfs_get_conf(CONFIGFS_GROUP, "os_descriptors", 0)) ) {
+        if( strtol(text, 0, 0) > 0 )
+            configfs_setup_os_desc(primary);
+        g_free(text);
+    }
+
     /* Leave disabled, will enable on cable connect detected */
+
+EXTRA_GADGETS:
+    /* Additional gadgets are independent of mode selection and
+     * get bound right away. Failing ones are just left out. */
+    for( size_t i = 1; i < configfs_gadget_cnt; ) {
+        if( configfs_gadget_setup(configfs_gadget_lut[i]) ) {
+            ++i;
+            continue;
+        }
+        configfs_gadget_delete(configfs_gadget_lut[i]);
+        for( size_t k = i + 1; k < configfs_gadget_cnt; ++k )
+            configfs_gadget_lut[k - 1] = configfs_gadget_lut[k];
+        configfs_gadget_lut[--configfs_gadget_cnt] = 0;
+    }
+
 EXIT:
     return configfs_in_use();
 }
@@ -812,25 +2264,11 @@ EXIT:
 void
 configfs_quit(void)
 {
-    g_free(GADGET_BASE_DIRECTORY),
-        GADGET_BASE_DIRECTORY = 0;
-    g_free(GADGET_FUNC_DIRECTORY),
-        GADGET_FUNC_DIRECTORY = 0;
-    g_free(GADGET_CONF_DIRECTORY),
-        GADGET_CONF_DIRECTORY = 0;
-
-    g_free(GADGET_CTRL_UDC),
-        GADGET_CTRL_UDC = 0;
-    g_free(GADGET_CTRL_ID_VENDOR),
-        GADGET_CTRL_ID_VENDOR= 0;
-    g_free(GADGET_CTRL_ID_PRODUCT),
-        GADGET_CTRL_ID_PRODUCT= 0;
-    g_free(GADGET_CTRL_MANUFACTURER),
-        GADGET_CTRL_MANUFACTURER= 0;
-    g_free(GADGET_CTRL_PRODUCT),
-        GADGET_CTRL_PRODUCT = 0;
-    g_free(GADGET_CTRL_SERIAL),
-        GADGET_CTRL_SERIAL = 0;
+    for( size_t i = 0; i < configfs_gadget_cnt; ++i ) {
+        configfs_gadget_delete(configfs_gadget_lut[i]),
+            configfs_gadget_lut[i] = 0;
+    }
+    configfs_gadget_cnt = 0;
 
     g_free(FUNCTION_MASS_STORAGE),
         FUNCTION_MASS_STORAGE = 0;
@@ -838,6 +2276,10 @@ configfs_quit(void)
         FUNCTION_RNDIS = 0;
     g_free(FUNCTION_MTP),
         FUNCTION_MTP = 0;
+    g_free(FUNCTION_NCM),
+        FUNCTION_NCM = 0;
+    g_free(FUNCTION_ECM),
+        FUNCTION_ECM = 0;
 
     g_free(RNDIS_CTRL_WCEIS),
         RNDIS_CTRL_WCEIS = 0;
@@ -856,18 +2298,19 @@ configfs_set_charging_mode(void)
 
     bool ack = false;
 
-    if( !configfs_set_function("mass_storage") )
-        goto EXIT;
+    configfs_txn_t *txn = configfs_txn_create();
+
+    configfs_txn_set_functions(txn, "mass_storage");
 
     /* TODO: make this configurable */
-    configfs_set_productid("0AFE");
+    configfs_txn_set_productid(txn, "0AFE");
 
-    if( !configfs_set_udc(true) )
-        goto EXIT;
+    configfs_txn_set_udc(txn, true);
 
-    ack = true;
+    ack = configfs_txn_commit(txn);
+
+    configfs_txn_delete(txn);
 
-EXIT:
     log_debug("CONFIGFS %s() -> %d", __func__, ack);
     return ack;
 }
@@ -884,16 +2327,10 @@ configfs_set_productid(const char *id)
     bool ack = false;
 
     if( id && configfs_in_use() ) {
-        /* Config files have things like "0A02".
-         * Kernel wants to see "0x0a02" ... */
-        char *end = 0;
-        unsigned num = strtol(id, &end, 16);
-        char     str[16];
-        if( end > id && *end == 0 ) {
-            snprintf(str, sizeof str, "0x%04x", num);
-            id = str;
-        }
-        ack = configfs_write_file(GADGET_CTRL_ID_PRODUCT, id);
+        configfs_txn_t *txn = configfs_txn_create();
+        configfs_txn_set_productid(txn, id);
+        ack = configfs_txn_commit(txn);
+        configfs_txn_delete(txn);
     }
 
     log_debug("CONFIGFS %s(%s) -> %d", __func__, id, ack);
@@ -912,20 +2349,10 @@ configfs_set_vendorid(const char *id)
     bool ack = false;
 
     if( id && configfs_in_use() ) {
-        log_debug("%s(%s) was called", __func__, id);
-
-        /* Config files have things like "0A02".
-         * Kernel wants to see "0x0a02" ... */
-        char *end = 0;
-        unsigned num = strtol(id, &end, 16);
-        char     str[16];
-
-        if( end > id && *end == 0 ) {
-            snprintf(str, sizeof str, "0x%04x", num);
-            id = str;
-        }
-
-        ack = configfs_write_file(GADGET_CTRL_ID_VENDOR, id);
+        configfs_txn_t *txn = configfs_txn_create();
+        configfs_txn_set_vendorid(txn, id);
+        ack = configfs_txn_commit(txn);
+        configfs_txn_delete(txn);
     }
 
     log_debug("CONFIGFS %s(%s) -> %d", __func__, id, ack);
@@ -947,9 +2374,71 @@ configfs_map_function(const char *func)
         func = FUNCTION_MTP;
     else if( !strcmp(func, "ffs") ) // existing config files ...
         func = FUNCTION_MTP;
+    else if( !strcmp(func, "ncm") )
+        func = FUNCTION_NCM;
+    else if( !strcmp(func, "ecm") )
+        func = FUNCTION_ECM;
     return func;
 }
 
+/** Check if configfs function is u_ether based network function
+ */
+static bool
+configfs_is_net_function(const char *func)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (!g_strcmp0(func, FUNCTION_NCM) ||
+            !g_strcmp0(func, FUNCTION_ECM) ||
+            g_str_has_prefix(func, "ncm.") ||
+            g_str_has_prefix(func, "ecm."));
+}
+
+/** Enable Microsoft OS descriptors for the gadget
+ *
+ * Makes hosts that have ncm class driver, but do not bind it based on
+ * class codes alone (Windows), pick it up. Functions that do not
+ * provide compatible id are not affected.
+ *
+ * @param gadget  gadget object
+ */
+static void
+configfs_setup_os_desc(const configfs_gadget_t *gadget)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char   path[PATH_MAX];
+    gchar *desc = g_strdup_printf("%s/%s", gadget->cg_base_directory,
+                                  DEFAULT_GADGET_OS_DESC);
+
+    snprintf(path, sizeof path, "%s/use", desc);
+    if( !configfs_write_file(path, "1") )
+        goto EXIT;
+
+    snprintf(path, sizeof path, "%s/b_vendor_code", desc);
+    configfs_write_file(path, "0xcd");
+
+    snprintf(path, sizeof path, "%s/qw_sign", desc);
+    configfs_write_file(path, "MSFT100");
+
+    /* Only one configuration can be linked to os_desc */
+    const char *conf = strrchr(gadget->cg_conf_directory, '/');
+    snprintf(path, sizeof path, "%s%s", desc, conf ?: "/b.1");
+    if( configfs_file_type(path) == -1 &&
+        symlink(gadget->cg_conf_directory, path) == -1 )
+        log_err("%s: failed to symlink to %s: %m", path,
+                gadget->cg_conf_directory);
+
+    if( configfs_register_function(gadget, FUNCTION_NCM) ) {
+        configfs_function_path(gadget, path, sizeof path, FUNCTION_NCM,
+                               DEFAULT_NCM_OS_DESC_COMPAT_ID, NULL);
+        configfs_write_file(path, NCM_OS_DESC_COMPAT_ID);
+    }
+
+EXIT:
+    g_free(desc);
+}
+
 /* Set active functions
  *
  * @param function Comma separated list of function names to
@@ -964,42 +2453,78 @@ configfs_set_function(const char *functions)
 
     bool ack = false;
 
-    gchar **vec = 0;
+    configfs_txn_t *txn = configfs_txn_create();
 
-    if( !configfs_in_use() )
-        goto EXIT;
-
-    if( !configfs_set_udc(false) )
-        goto EXIT;
-
-    if( !configfs_disable_all_functions() )
-        goto EXIT;
-
-    if( functions ) {
-        vec = g_strsplit(functions, ",", 0);
-        for( size_t i = 0; vec[i]; ++i ) {
-            /* Normalize names used by usb-moded itself and already
-             * existing configuration files etc.
-             */
-            const char *use = configfs_map_function(vec[i]);
-            if( !use || !*use )
-                continue;
-            if( !configfs_enable_function(use) )
-                goto EXIT;
-        }
-    }
+    configfs_txn_set_functions(txn, functions);
 
     /* Leave disabled, so that caller can adjust attributes
      * etc before enabling */
+    configfs_txn_set_udc(txn, false);
 
-    ack = true;
+    ack = configfs_txn_commit(txn);
+
+    configfs_txn_delete(txn);
 
-EXIT:
     log_debug("CONFIGFS %s(%s) -> %d", __func__, functions, ack);
+    return ack;
+}
+
+/** Prepare function directories without activating them
+ *
+ * Registering a function that already exists is a no-op, and
+ * registered but unlinked functions do not affect the gadget,
+ * so there is nothing to undo if the functions end up not
+ * being used after all.
+ *
+ * @param functions Comma separated list of function names
+ *
+ * @return true if successful, false on failure
+ */
+bool
+configfs_prestage_functions(const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack = true;
+    gchar **vec = g_strsplit(functions ?: "", ",", 0);
+
+    for( size_t i = 0; vec[i]; ++i ) {
+        const char *function = configfs_map_function(vec[i]);
+        if( *function &&
+            !configfs_register_function(configfs_gadget_primary(), function) )
+            ack = false;
+    }
+
     g_strfreev(vec);
+
+    log_debug("CONFIGFS %s(%s) -> %d", __func__, functions, ack);
     return ack;
 }
 
+static bool
+configfs_lun_add(const configfs_gadget_t *gadget, int lun)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char unit[32];
+    snprintf(unit, sizeof unit, "lun.%d", lun);
+    return configfs_add_unit(gadget, FUNCTION_MASS_STORAGE, unit) != 0;
+}
+
+static bool
+configfs_lun_set_attr(const configfs_gadget_t *gadget, int lun,
+                      const char *attr, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char unit[32];
+    snprintf(unit, sizeof unit, "lun.%d", lun);
+    char path[PATH_MAX];
+    configfs_function_path(gadget, path, sizeof path, FUNCTION_MASS_STORAGE,
+                           unit, attr, NULL);
+    return configfs_write_file(path, value);
+}
+
 bool
 configfs_add_mass_storage_lun(int lun)
 {
@@ -1010,9 +2535,7 @@ configfs_add_mass_storage_lun(int lun)
     if( !configfs_in_use() )
         goto EXIT;
 
-    char unit[32];
-    snprintf(unit, sizeof unit, "lun.%d", lun);
-    ack = configfs_add_unit(FUNCTION_MASS_STORAGE, unit) != 0;
+    ack = configfs_lun_add(configfs_gadget_primary(), lun);
 
 EXIT:
     return ack;
@@ -1030,7 +2553,8 @@ configfs_remove_mass_storage_lun(int lun)
 
     char unit[32];
     snprintf(unit, sizeof unit, "lun.%d", lun);
-    ack = configfs_remove_unit(FUNCTION_MASS_STORAGE, unit);
+    ack = configfs_remove_unit(configfs_gadget_primary(),
+                               FUNCTION_MASS_STORAGE, unit);
 
 EXIT:
     return ack;
@@ -1046,13 +2570,111 @@ configfs_set_mass_storage_attr(int lun, const char *attr, const char *value)
     if( !configfs_in_use() )
         goto EXIT;
 
-    char unit[32];
-    snprintf(unit, sizeof unit, "lun.%d", lun);
-    char path[PATH_MAX];
-    configfs_function_path(path, sizeof path, FUNCTION_MASS_STORAGE,
-                           unit, attr, NULL);
-    ack = configfs_write_file(path, value);
+    ack = configfs_lun_set_attr(configfs_gadget_primary(), lun, attr, value);
 
 EXIT:
     return ack;
 }
+
+/** Program configfs gadget according to configuration and bind it
+ *
+ * All changes are made within a single transaction, i.e. the UDC
+ * is unbound and rebound at most once.
+ *
+ * @param config  Desired gadget configuration
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+configfs_gadget_apply(const gadget_config_t *config)
+{
+    LOG_REGISTER_CONTEXT;
+
+    configfs_txn_t *txn = configfs_txn_create();
+
+    for( size_t i = 0; i < config->gc_lun_count; ++i )
+        configfs_txn_add_mass_storage_lun(txn, &config->gc_luns[i]);
+    configfs_txn_set_mass_storage_params(txn, config->gc_ms_stall,
+                                         config->gc_ms_num_buffers);
+    if( config->gc_functions )
+        configfs_txn_set_functions(txn, config->gc_functions);
+    if( config->gc_productid )
+        configfs_txn_set_productid(txn, config->gc_productid);
+    if( config->gc_vendorid )
+        configfs_txn_set_vendorid(txn, config->gc_vendorid);
+    configfs_txn_set_net_params(txn, config->gc_net_qmult,
+                                config->gc_net_host_addr,
+                                config->gc_net_dev_addr);
+    configfs_txn_set_udc(txn, true);
+
+    bool ack = configfs_txn_commit(txn);
+    configfs_txn_delete(txn);
+    return ack;
+}
+
+/** Detach configfs mass storage luns
+ *
+ * Lun 0 is reset and the rest are removed altogether.
+ *
+ * @param count  Number of luns in use
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+configfs_gadget_clear_luns(size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    configfs_set_udc(false);
+    configfs_set_function(0);
+
+    for( size_t i = 0 ; i < count; ++i ) {
+        configfs_set_mass_storage_attr(i, "cdrom", "0");
+        configfs_set_mass_storage_attr(i, "nofua", "0");
+        configfs_set_mass_storage_attr(i, "removable", "1");
+        configfs_set_mass_storage_attr(i, "ro", "0");
+        configfs_set_mass_storage_attr(i, "file", "");
+        if( i > 0 )
+            configfs_remove_mass_storage_lun(i);
+    }
+
+    return true;
+}
+
+/** Get kernel assigned name of primary gadget network interface
+ *
+ * The ifname attribute of u_ether based functions tells which usbN
+ * interface the kernel created for the function instance.
+ *
+ * @return interface name to be released with free(), or NULL
+ */
+static char *
+configfs_gadget_get_ifname(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char                    *ifname = 0;
+    const configfs_gadget_t *gadget = configfs_gadget_primary();
+
+    if( !gadget || !gadget->cg_state.cs_functions_valid ||
+        !gadget->cg_state.cs_functions )
+        goto EXIT;
+
+    for( size_t i = 0; gadget->cg_state.cs_functions[i]; ++i ) {
+        const char *function = gadget->cg_state.cs_functions[i];
+        if( !configfs_is_net_function(function) )
+            continue;
+
+        char path[PATH_MAX];
+        char buff[64];
+        configfs_function_path(gadget, path, sizeof path, function,
+                               DEFAULT_NET_CTRL_IFNAME, NULL);
+        if( configfs_read_file(path, buff, sizeof buff) && *buff ) {
+            ifname = strdup(buff);
+            break;
+        }
+    }
+
+EXIT:
+    return ifname;
+}
@@ -24,12 +24,49 @@
 #ifndef  USB_MODED_CONFIGFS_H_
 # define USB_MODED_CONFIGFS_H_
 
+# include "usb_moded-gadget.h"
+
 # include <stdbool.h>
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+typedef struct configfs_txn_t configfs_txn_t;
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+extern const gadget_backend_t configfs_gadget_backend;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * CONFIGFS_TXN
+ * ------------------------------------------------------------------------- */
+
+configfs_txn_t *configfs_txn_create       (void);
+void            configfs_txn_delete       (configfs_txn_t *self);
+void            configfs_txn_set_functions(configfs_txn_t *self, const char *functions);
+void            configfs_txn_set_productid(configfs_txn_t *self, const char *id);
+void            configfs_txn_set_vendorid (configfs_txn_t *self, const char *id);
+void            configfs_txn_set_udc      (configfs_txn_t *self, bool enable);
+void            configfs_txn_add_mass_storage_lun(configfs_txn_t *self, const gadget_lun_t *lun);
+void            configfs_txn_set_mass_storage_params(configfs_txn_t *self, const char *stall, const char *num_buffers);
+void            configfs_txn_set_net_params(configfs_txn_t *self, int qmult, const char *host_addr, const char *dev_addr);
+bool            configfs_txn_commit       (configfs_txn_t *self);
+
+/* ------------------------------------------------------------------------- *
+ * CONFIGFS_GADGET
+ * ------------------------------------------------------------------------- */
+
+size_t configfs_gadget_count        (void);
+bool   configfs_gadget_is_secondary (const char *name);
+bool   configfs_gadget_set_functions(const char *name, const char *functions);
+
 /* ------------------------------------------------------------------------- *
  * CONFIGFS
  * ------------------------------------------------------------------------- */
@@ -42,6 +79,7 @@ bool configfs_set_charging_mode      (void);
 bool configfs_set_productid          (const char *id);
 bool configfs_set_vendorid           (const char *id);
 bool configfs_set_function           (const char *functions);
+bool configfs_prestage_functions     (const char *functions);
 bool configfs_add_mass_storage_lun   (int lun);
 bool configfs_remove_mass_storage_lun(int lun);
 bool configfs_set_mass_storage_attr  (int lun, const char *attr, const char *value);
@@ -0,0 +1,647 @@
+/**
+ * @file usb_moded-confmerge.c
+ *
+ * Layered settings storage for merging static and dynamic configuration
+ *
+ * Settings are kept in per layer two level hash tables (group -> key ->
+ * value), so that lookups and updates do not depend on the number of
+ * groups or keys. Effective value is resolved by checking the dynamic
+ * layer first and falling back to static defaults - no merged copy of
+ * the data is made.
+ *
+ * Values are stored as they appear in ini files, i.e. escapes and list
+ * separators are not processed, which allows comparing layers and
+ * writing data back without reinterpreting it.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-confmerge.h"
+
+#include "usb_moded-log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+struct confmerge_t
+{
+    /** Per layer group name -> (key -> value) lookup tables */
+    GHashTable *cm_layer[CONFMERGE_LAYER_COUNT];
+
+    /** Per layer number of values */
+    size_t      cm_count[CONFMERGE_LAYER_COUNT];
+};
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * CONFMERGE
+ * ------------------------------------------------------------------------- */
+
+static GHashTable *confmerge_new_table       (void);
+static GHashTable *confmerge_get_group       (const confmerge_t *self, confmerge_layer_t layer, const char *group);
+static GHashTable *confmerge_add_group       (confmerge_t *self, confmerge_layer_t layer, const char *group);
+static void        confmerge_insert          (confmerge_t *self, confmerge_layer_t layer, const char *group, const char *key, gchar *value);
+static bool        confmerge_remove_layer_key(confmerge_t *self, confmerge_layer_t layer, const char *group, const char *key);
+static GKeyFile   *confmerge_value_keyfile   (const char *value);
+static gchar      *confmerge_escape_string   (const char *value);
+static gint        confmerge_compare_str     (gconstpointer a, gconstpointer b);
+confmerge_t       *confmerge_create          (void);
+void               confmerge_delete          (confmerge_t *self);
+void               confmerge_clear_layer     (confmerge_t *self, confmerge_layer_t layer);
+size_t             confmerge_count           (const confmerge_t *self, confmerge_layer_t layer);
+void               confmerge_merge_keyfile   (confmerge_t *self, confmerge_layer_t layer, GKeyFile *ini);
+bool               confmerge_merge_file      (confmerge_t *self, confmerge_layer_t layer, const char *path);
+bool               confmerge_merge_data      (confmerge_t *self, confmerge_layer_t layer, const char *data);
+const char        *confmerge_get_layer_value (const confmerge_t *self, confmerge_layer_t layer, const char *group, const char *key);
+const char        *confmerge_get_value       (const confmerge_t *self, const char *group, const char *key);
+gchar             *confmerge_get_string      (const confmerge_t *self, const char *group, const char *key);
+int                confmerge_get_integer     (const confmerge_t *self, const char *group, const char *key);
+void               confmerge_set_layer_value (confmerge_t *self, confmerge_layer_t layer, const char *group, const char *key, const char *value);
+bool               confmerge_set_value       (confmerge_t *self, const char *group, const char *key, const char *value);
+bool               confmerge_set_string      (confmerge_t *self, const char *group, const char *key, const char *value);
+bool               confmerge_remove          (confmerge_t *self, const char *group, const char *key);
+size_t             confmerge_purge           (confmerge_t *self);
+gchar             *confmerge_to_data         (const confmerge_t *self, confmerge_layer_t layer);
+
+/* ========================================================================= *
+ * CONFMERGE
+ * ========================================================================= */
+
+static GHashTable *
+confmerge_new_table(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static GHashTable *
+confmerge_get_group(const confmerge_t *self, confmerge_layer_t layer,
+                    const char *group)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_hash_table_lookup(self->cm_layer[layer], group);
+}
+
+static GHashTable *
+confmerge_add_group(confmerge_t *self, confmerge_layer_t layer,
+                    const char *group)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable *keys = confmerge_get_group(self, layer, group);
+    if( !keys ) {
+        keys = confmerge_new_table();
+        g_hash_table_insert(self->cm_layer[layer], g_strdup(group), keys);
+    }
+    return keys;
+}
+
+/** Set value in a layer
+ *
+ * @param self   merge object
+ * @param layer  layer to modify
+ * @param group  group name
+ * @param key    key name
+ * @param value  raw value, ownership is transferred
+ */
+static void
+confmerge_insert(confmerge_t *self, confmerge_layer_t layer,
+                 const char *group, const char *key, gchar *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable *keys = confmerge_add_group(self, layer, group);
+
+    if( g_hash_table_replace(keys, g_strdup(key), value) )
+        self->cm_count[layer] += 1;
+}
+
+/** Remove value from a layer
+ *
+ * Groups that become empty are removed too.
+ *
+ * @return true if value existed, false otherwise
+ */
+static bool
+confmerge_remove_layer_key(confmerge_t *self, confmerge_layer_t layer,
+                           const char *group, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool        ack  = false;
+    GHashTable *keys = confmerge_get_group(self, layer, group);
+
+    if( keys && g_hash_table_remove(keys, key) ) {
+        self->cm_count[layer] -= 1;
+        if( g_hash_table_size(keys) == 0 )
+            g_hash_table_remove(self->cm_layer[layer], group);
+        ack = true;
+    }
+
+    return ack;
+}
+
+/** Make temporary keyfile for converting between raw and string values
+ *
+ * @param value  raw value, or NULL for empty keyfile
+ *
+ * @return keyfile object; caller must release with g_key_file_free()
+ */
+static GKeyFile *
+confmerge_value_keyfile(const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *keyfile = g_key_file_new();
+    if( value )
+        g_key_file_set_value(keyfile, "v", "v", value);
+    return keyfile;
+}
+
+/** Convert string to raw value
+ *
+ * Equivalent of what g_key_file_set_string() stores.
+ *
+ * @param value  string value
+ *
+ * @return raw value; caller must release with g_free()
+ */
+static gchar *
+confmerge_escape_string(const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *res = 0;
+
+    if( *value != ' ' && *value != '\t' && !strpbrk(value, "\\\n\r\t") ) {
+        res = g_strdup(value);
+    }
+    else {
+        GKeyFile *keyfile = confmerge_value_keyfile(0);
+        g_key_file_set_string(keyfile, "v", "v", value);
+        res = g_key_file_get_value(keyfile, "v", "v", 0);
+        g_key_file_free(keyfile);
+    }
+
+    return res;
+}
+
+static gint
+confmerge_compare_str(gconstpointer a, gconstpointer b)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return strcmp(a, b);
+}
+
+/** Create empty merge object
+ *
+ * @return merge object; caller must release with confmerge_delete()
+ */
+confmerge_t *
+confmerge_create(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    confmerge_t *self = g_malloc0(sizeof *self);
+
+    for( int layer = 0; layer < CONFMERGE_LAYER_COUNT; ++layer ) {
+        self->cm_layer[layer] = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                      g_free,
+                                                      (GDestroyNotify)g_hash_table_unref);
+    }
+
+    return self;
+}
+
+/** Release merge object
+ *
+ * @param self  merge object, or NULL
+ */
+void
+confmerge_delete(confmerge_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        for( int layer = 0; layer < CONFMERGE_LAYER_COUNT; ++layer )
+            g_hash_table_unref(self->cm_layer[layer]);
+        g_free(self);
+    }
+}
+
+/** Remove all values from a layer
+ *
+ * @param self   merge object
+ * @param layer  layer to clear
+ */
+void
+confmerge_clear_layer(confmerge_t *self, confmerge_layer_t layer)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_hash_table_remove_all(self->cm_layer[layer]);
+    self->cm_count[layer] = 0;
+}
+
+/** Get number of values in a layer
+ *
+ * @param self   merge object
+ * @param layer  layer to check
+ *
+ * @return number of group/key pairs
+ */
+size_t
+confmerge_count(const confmerge_t *self, confmerge_layer_t layer)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return self->cm_count[layer];
+}
+
+/** Merge all values from keyfile to a layer
+ *
+ * Existing values will be overridden.
+ *
+ * @param self   merge object
+ * @param layer  layer to modify
+ * @param ini    keyfile to merge from
+ */
+void
+confmerge_merge_keyfile(confmerge_t *self, confmerge_layer_t layer,
+                        GKeyFile *ini)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar **group = g_key_file_get_groups(ini, 0);
+
+    for( size_t g = 0; group && group[g]; ++g ) {
+        gchar **key = g_key_file_get_keys(ini, group[g], 0, 0);
+        for( size_t k = 0; key && key[k]; ++k ) {
+            gchar *val = g_key_file_get_value(ini, group[g], key[k], 0);
+            if( val )
+                confmerge_insert(self, layer, group[g], key[k], val);
+        }
+        g_strfreev(key);
+    }
+    g_strfreev(group);
+}
+
+/** Merge all values from ini file to a layer
+ *
+ * @param self   merge object
+ * @param layer  layer to modify
+ * @param path   ini file to merge from
+ *
+ * @return true if file was parsed, false otherwise
+ */
+bool
+confmerge_merge_file(confmerge_t *self, confmerge_layer_t layer,
+                     const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool      ack = false;
+    GError   *err = 0;
+    GKeyFile *tmp = g_key_file_new();
+
+    if( !g_key_file_load_from_file(tmp, path, 0, &err) ) {
+        log_debug("%s: can't load: %s", path, err->message);
+    }
+    else {
+        confmerge_merge_keyfile(self, layer, tmp);
+        ack = true;
+    }
+    g_clear_error(&err);
+    g_key_file_free(tmp);
+    return ack;
+}
+
+/** Merge all values from ini data to a layer
+ *
+ * @param self   merge object
+ * @param layer  layer to modify
+ * @param data   ini file content to merge from
+ *
+ * @return true if data was parsed, false otherwise
+ */
+bool
+confmerge_merge_data(confmerge_t *self, confmerge_layer_t layer,
+                     const char *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool      ack = false;
+    GKeyFile *tmp = g_key_file_new();
+
+    if( g_key_file_load_from_data(tmp, data, -1, 0, 0) ) {
+        confmerge_merge_keyfile(self, layer, tmp);
+        ack = true;
+    }
+    g_key_file_free(tmp);
+    return ack;
+}
+
+/** Lookup raw value from a layer
+ *
+ * @param self   merge object
+ * @param layer  layer to check
+ * @param group  group name
+ * @param key    key name
+ *
+ * @return value, or NULL if not set in the layer
+ */
+const char *
+confmerge_get_layer_value(const confmerge_t *self, confmerge_layer_t layer,
+                          const char *group, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable *keys = confmerge_get_group(self, layer, group);
+    return keys ? g_hash_table_lookup(keys, key) : 0;
+}
+
+/** Lookup effective raw value
+ *
+ * @param self   merge object
+ * @param group  group name
+ * @param key    key name
+ *
+ * @return value from topmost layer that has it, or NULL if not set
+ */
+const char *
+confmerge_get_value(const confmerge_t *self, const char *group,
+                    const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *value = 0;
+
+    for( int layer = CONFMERGE_LAYER_COUNT - 1; layer >= 0; --layer ) {
+        if( (value = confmerge_get_layer_value(self, layer, group, key)) )
+            break;
+    }
+
+    return value;
+}
+
+/** Lookup effective string value
+ *
+ * Equivalent of g_key_file_get_string().
+ *
+ * @param self   merge object
+ * @param group  group name
+ * @param key    key name
+ *
+ * @return string value, or NULL if not set; caller must release
+ *         with g_free()
+ */
+gchar *
+confmerge_get_string(const confmerge_t *self, const char *group,
+                     const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar      *res   = 0;
+    const char *value = confmerge_get_value(self, group, key);
+
+    if( !value ) {
+        /* nop */
+    }
+    else if( !strchr(value, '\\') ) {
+        res = g_strdup(value);
+    }
+    else {
+        GKeyFile *keyfile = confmerge_value_keyfile(value);
+        res = g_key_file_get_string(keyfile, "v", "v", 0);
+        g_key_file_free(keyfile);
+    }
+
+    return res;
+}
+
+/** Lookup effective integer value
+ *
+ * Equivalent of g_key_file_get_integer().
+ *
+ * @param self   merge object
+ * @param group  group name
+ * @param key    key name
+ *
+ * @return integer value, or zero if not set or not a number
+ */
+int
+confmerge_get_integer(const confmerge_t *self, const char *group,
+                      const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int         res   = 0;
+    const char *value = confmerge_get_value(self, group, key);
+
+    if( value ) {
+        char *end = 0;
+        errno = 0;
+        long num = strtol(value, &end, 10);
+        /* Like glib, allow trailing whitespace */
+        const char *tail = end;
+        while( g_ascii_isspace(*tail) )
+            ++tail;
+        if( end > value && *tail == 0 && errno == 0 &&
+            num >= G_MININT && num <= G_MAXINT )
+            res = (int)num;
+    }
+
+    return res;
+}
+
+/** Set raw value in a layer
+ *
+ * @param self   merge object
+ * @param layer  layer to modify
+ * @param group  group name
+ * @param key    key name
+ * @param value  raw value
+ */
+void
+confmerge_set_layer_value(confmerge_t *self, confmerge_layer_t layer,
+                          const char *group, const char *key,
+                          const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    confmerge_insert(self, layer, group, key, g_strdup(value));
+}
+
+/** Set effective raw value
+ *
+ * Value is stored in the dynamic layer, unless it matches static
+ * default - in which case possible dynamic override is removed.
+ *
+ * @param self   merge object
+ * @param group  group name
+ * @param key    key name
+ * @param value  raw value
+ *
+ * @return true if effective value changed, false otherwise
+ */
+bool
+confmerge_set_value(confmerge_t *self, const char *group, const char *key,
+                    const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool changed = g_strcmp0(confmerge_get_value(self, group, key), value) != 0;
+
+    const char *def = confmerge_get_layer_value(self, CONFMERGE_LAYER_STATIC,
+                                                group, key);
+    if( !g_strcmp0(def, value) )
+        confmerge_remove_layer_key(self, CONFMERGE_LAYER_DYNAMIC, group, key);
+    else if( changed )
+        confmerge_set_layer_value(self, CONFMERGE_LAYER_DYNAMIC, group, key, value);
+
+    return changed;
+}
+
+/** Set effective string value
+ *
+ * Equivalent of g_key_file_set_string(), see confmerge_set_value().
+ *
+ * @param self   merge object
+ * @param group  group name
+ * @param key    key name
+ * @param value  string value
+ *
+ * @return true if effective value changed, false otherwise
+ */
+bool
+confmerge_set_string(confmerge_t *self, const char *group, const char *key,
+                     const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *raw = confmerge_escape_string(value);
+    bool changed = confmerge_set_value(self, group, key, raw);
+    g_free(raw);
+    return changed;
+}
+
+/** Remove dynamic override
+ *
+ * @param self   merge object
+ * @param group  group name
+ * @param key    key name
+ *
+ * @return true if dynamic value existed, false otherwise
+ */
+bool
+confmerge_remove(confmerge_t *self, const char *group, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return confmerge_remove_layer_key(self, CONFMERGE_LAYER_DYNAMIC,
+                                      group, key);
+}
+
+/** Remove dynamic values that match static defaults
+ *
+ * Groups that become empty are removed too.
+ *
+ * @param self  merge object
+ *
+ * @return number of values removed
+ */
+size_t
+confmerge_purge(confmerge_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t         removed = 0;
+    GHashTableIter giter;
+    gpointer       group, keys;
+
+    g_hash_table_iter_init(&giter, self->cm_layer[CONFMERGE_LAYER_DYNAMIC]);
+    while( g_hash_table_iter_next(&giter, &group, &keys) ) {
+        GHashTable *defs = confmerge_get_group(self, CONFMERGE_LAYER_STATIC,
+                                               group);
+        if( defs ) {
+            GHashTableIter kiter;
+            gpointer       key, val;
+            g_hash_table_iter_init(&kiter, keys);
+            while( g_hash_table_iter_next(&kiter, &key, &val) ) {
+                if( g_strcmp0(g_hash_table_lookup(defs, key), val) )
+                    continue;
+                log_debug("purge redundant: [%s] %s = %s",
+                          (char *)group, (char *)key, (char *)val);
+                g_hash_table_iter_remove(&kiter);
+                ++removed;
+            }
+        }
+        if( g_hash_table_size(keys) == 0 ) {
+            log_debug("purge redundant group: [%s]", (char *)group);
+            g_hash_table_iter_remove(&giter);
+        }
+    }
+
+    self->cm_count[CONFMERGE_LAYER_DYNAMIC] -= removed;
+    return removed;
+}
+
+/** Serialize layer content in ini file format
+ *
+ * Groups and keys are sorted so that the same settings always
+ * produce identical output.
+ *
+ * @param self   merge object
+ * @param layer  layer to serialize
+ *
+ * @return ini file data; caller must release with g_free()
+ */
+gchar *
+confmerge_to_data(const confmerge_t *self, confmerge_layer_t layer)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *ini    = g_key_file_new();
+    GList    *groups = g_hash_table_get_keys(self->cm_layer[layer]);
+
+    groups = g_list_sort(groups, confmerge_compare_str);
+    for( GList *g = groups; g; g = g->next ) {
+        GHashTable *values = confmerge_get_group(self, layer, g->data);
+        GList      *keys   = g_list_sort(g_hash_table_get_keys(values),
+                                         confmerge_compare_str);
+        for( GList *k = keys; k; k = k->next )
+            g_key_file_set_value(ini, g->data, k->data,
+                                 g_hash_table_lookup(values, k->data));
+        g_list_free(keys);
+    }
+    g_list_free(groups);
+
+    gchar *data = g_key_file_to_data(ini, 0, 0);
+    g_key_file_free(ini);
+    return data;
+}
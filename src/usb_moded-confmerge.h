@@ -0,0 +1,71 @@
+/**
+ * @file usb_moded-confmerge.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_CONFMERGE_H_
+# define USB_MODED_CONFMERGE_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Settings layers, later ones override earlier ones */
+typedef enum
+{
+    /** Defaults from static configuration files */
+    CONFMERGE_LAYER_STATIC,
+
+    /** Changes made at runtime, persisted in dynamic config file */
+    CONFMERGE_LAYER_DYNAMIC,
+
+    CONFMERGE_LAYER_COUNT
+} confmerge_layer_t;
+
+typedef struct confmerge_t confmerge_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * CONFMERGE
+ * ------------------------------------------------------------------------- */
+
+confmerge_t *confmerge_create         (void);
+void         confmerge_delete         (confmerge_t *self);
+void         confmerge_clear_layer    (confmerge_t *self, confmerge_layer_t layer);
+size_t       confmerge_count          (const confmerge_t *self, confmerge_layer_t layer);
+void         confmerge_merge_keyfile  (confmerge_t *self, confmerge_layer_t layer, GKeyFile *ini);
+bool         confmerge_merge_file     (confmerge_t *self, confmerge_layer_t layer, const char *path);
+bool         confmerge_merge_data     (confmerge_t *self, confmerge_layer_t layer, const char *data);
+const char  *confmerge_get_layer_value(const confmerge_t *self, confmerge_layer_t layer, const char *group, const char *key);
+const char  *confmerge_get_value      (const confmerge_t *self, const char *group, const char *key);
+gchar       *confmerge_get_string     (const confmerge_t *self, const char *group, const char *key);
+int          confmerge_get_integer    (const confmerge_t *self, const char *group, const char *key);
+void         confmerge_set_layer_value(confmerge_t *self, confmerge_layer_t layer, const char *group, const char *key, const char *value);
+bool         confmerge_set_value      (confmerge_t *self, const char *group, const char *key, const char *value);
+bool         confmerge_set_string     (confmerge_t *self, const char *group, const char *key, const char *value);
+bool         confmerge_remove         (confmerge_t *self, const char *group, const char *key);
+size_t       confmerge_purge          (confmerge_t *self);
+gchar       *confmerge_to_data        (const confmerge_t *self, confmerge_layer_t layer);
+
+#endif /* USB_MODED_CONFMERGE_H_ */
@@ -25,6 +25,7 @@
 #include "usb_moded-control.h"
 
 #include "usb_moded.h"
+#include "usb_moded-appsync.h"
 #include "usb_moded-config-private.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
@@ -90,6 +91,7 @@ void             control_set_enabled              (bool enable);
 static bool      control_get_in_rescue_mode       (void);
 static void      control_set_in_rescue_mode       (bool in_rescue_mode);
 static void      control_rethink_usb_mode         (void);
+void             control_prestage_usb_mode        (void);
 void             control_set_cable_state          (cable_state_t cable_state);
 cable_state_t    control_get_cable_state          (void);
 void             control_clear_cable_state        (void);
@@ -105,6 +107,13 @@ bool             control_get_connection_state     (void);
  */
 static char *control_external_mode = NULL;
 
+/** Mode atom for control_external_mode
+ *
+ * Evaluated once when external mode changes, so that the
+ * mode name does not need to be re-examined afterwards.
+ */
+static mode_atom_t control_external_atom = MODE_ATOM_UNDEFINED;
+
 /* The target mode;
  *
  * What was the last target mode signaled over D-Bus.
@@ -194,11 +203,12 @@ static void control_set_external_mode(const char *mode)
               previous, mode);
 
     control_external_mode = g_strdup(mode);
+    control_external_atom = common_mode_atom(control_external_mode);
     g_free(previous);
 
     // DO THE DBUS BROADCAST
 
-    if( !strcmp(control_external_mode, MODE_ASK) ) {
+    if( control_external_atom == MODE_ATOM_ASK ) {
         /* send signal, mode will be set when the dialog service calls
          * the set_mode method call. */
         umdbus_send_event_signal(USB_CONNECTED_DIALOG_SHOW);
@@ -206,7 +216,7 @@ static void control_set_external_mode(const char *mode)
 
     umdbus_send_current_state_signal(control_external_mode);
 
-    if( strcmp(control_external_mode, MODE_BUSY) ) {
+    if( control_external_atom != MODE_ATOM_BUSY ) {
         /* Stable state reached. Synchronize target state.
          *
          * Note that normally this ends up being a nop,
@@ -227,6 +237,7 @@ void control_clear_external_mode(void)
 
     g_free(control_external_mode),
         control_external_mode = 0;
+    control_external_atom = MODE_ATOM_UNDEFINED;
 }
 
 static void control_update_external_mode(void)
@@ -465,6 +476,12 @@ void control_user_changed(void)
      */
     control_set_selected_mode(0);
 
+#ifdef APP_SYNC
+    /* Follow the user with appsync session bus connection
+     */
+    appsync_user_changed();
+#endif
+
     control_rethink_usb_mode();
 }
 
@@ -488,6 +505,11 @@ void control_device_state_changed(void)
     log_debug("in_usermode = %d; in_shutdown = %d",
               usbmoded_in_usermode(), usbmoded_in_shutdown());
 
+    /* Mode switch that is still in progress when shutdown starts
+     * would just delay things -> make the worker bail out */
+    if( usbmoded_in_shutdown() )
+        worker_wakeup();
+
     control_rethink_usb_mode();
 }
 
@@ -794,6 +816,12 @@ static void control_rethink_usb_mode(void)
                  * -> redirect to fallback charging */
                 log_debug("mode '%s' is not applicable", mode_to_use);
                 use_mode(MODE_CHARGING_FALLBACK);
+
+                /* While waiting for unlock, prepare the parts of the
+                 * mode that do not expose anything, so that only the
+                 * gadget enable and mtpd startup are left to do */
+                if( control_get_cable_state() == CABLE_STATE_PC_CONNECTED )
+                    control_prestage_usb_mode();
             }
         }
     }
@@ -815,6 +843,58 @@ BAILOUT:
     g_free(mode_to_free);
 }
 
+/** Speculatively prepare the mode pc connection is likely to activate
+ *
+ * Called while pc connection is still being debounced, and while
+ * activation of dynamic modes is blocked by device lock. Covers only
+ * the common case of control_rethink_usb_mode(): user selection or
+ * configured mode, as long as it is a dynamic mode that could be
+ * activated right away or as soon as device gets unlocked.
+ * Everything else is left to be handled by the actual mode selection.
+ */
+void control_prestage_usb_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    uid_t       current_user = usbmoded_get_current_user();
+    const char *mode         = 0;
+    gchar      *setting      = 0;
+
+    if( !usbmoded_get_prestage() )
+        goto EXIT;
+
+    if( !control_get_enabled() || !usbmoded_init_done_p() ||
+        usbmoded_in_shutdown() )
+        goto EXIT;
+
+    if( usbmoded_get_rescue_mode() || usbmoded_get_diag_mode() )
+        goto EXIT;
+
+    /* Pre-staging does not expose data, so device lock does not
+     * matter - but there must be a user session to unlock */
+    if( current_user == UID_UNKNOWN || !usbmoded_in_usermode() ||
+        control_have_pending_user_change() )
+        goto EXIT;
+
+    if( !(mode = control_get_selected_mode()) )
+        mode = setting = config_get_mode_setting(current_user);
+
+    if( common_mode_atom(mode) != MODE_ATOM_DYNAMIC )
+        goto EXIT;
+
+    if( common_valid_mode(mode) )
+        goto EXIT;
+
+    if( !usbmoded_is_mode_permitted(mode, current_user) )
+        goto EXIT;
+
+    log_debug("pre-staging mode '%s'", mode);
+    worker_request_prestage(mode);
+
+EXIT:
+    g_free(setting);
+}
+
 /** set the usb connection status
  *
  * @param cable_state CABLE_STATE_DISCONNECTED, ...
@@ -47,9 +47,15 @@
 /** Logical name for org.freedesktop.DBus.NameOwnerChanged signal */
 # define DBUS_NAME_OWNER_CHANGED_SIG     "NameOwnerChanged"
 
-/** Logical name for org.freedesktop.DBus.GetNameOwner method */
+/** Logical name for org.freedesktop.DBus.GetConnectionUnixProcessID method */
 # define DBUS_GET_CONNECTION_PID_REQ     "GetConnectionUnixProcessID"
 
+/** Logical name for org.freedesktop.DBus.GetConnectionCredentials method */
+# define DBUS_GET_CONNECTION_CREDENTIALS_REQ "GetConnectionCredentials"
+
+/** Uid key in GetConnectionCredentials reply */
+# define DBUS_CREDENTIALS_UID_KEY        "UnixUserID"
+
 /* ========================================================================= *
  * Types
  * ========================================================================= */
@@ -32,18 +32,30 @@
  * 02110-1301 USA
  */
 
+/* Message parser helpers run for every argument of every handled
+ * message, tracing them would cost more than the handlers do */
+#define LOG_DISABLE_CALL_TRACE
+
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-dbus.h"
 
 #include "usb_moded.h"
 #include "usb_moded-config-private.h"
+#include "usb_moded-configfs.h"
 #include "usb_moded-control.h"
 #include "usb_moded-log.h"
+#include "usb_moded-loopwatch.h"
+#include "usb_moded-mac.h"
 #include "usb_moded-modes.h"
-#include "usb_moded-network.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-udev.h"
+#include "usb_moded-worker.h"
 
 #include <sys/stat.h>
 
+#include <pthread.h> // NOTRIM
+#include <unistd.h>
+
 #include "../dbus-gmain/dbus-gmain.h"
 
 #ifdef SAILFISH_ACCESS_CONTROL
@@ -59,7 +71,19 @@
 #define INIT_DONE_SIGNAL    "init_done"
 #define INIT_DONE_MATCH     "type='signal',interface='"INIT_DONE_INTERFACE"',member='"INIT_DONE_SIGNAL"'"
 
-# define PID_UNKNOWN ((pid_t)-1)
+/** Match for tracking disconnects of a D-Bus client with cached uid */
+#define SENDER_GONE_MATCH_FMT \
+    "type='signal'"\
+    ",sender='"DBUS_SERVICE_DBUS"'"\
+    ",interface='"DBUS_INTERFACE_DBUS"'"\
+    ",member='"DBUS_NAME_OWNER_CHANGED_SIG"'"\
+    ",arg0='%s'"
+
+/** Upper limit for number of clients in sender uid cache */
+#define SENDER_UID_CACHE_MAX 64
+
+/** Minimum interval between mode list signal broadcasts [ms] */
+#define UMDBUS_SIGNAL_LIST_RATE_MS 250
 
 /* ========================================================================= *
  * Types
@@ -82,6 +106,9 @@ typedef struct  {
     /** Handler callback, use NULL for Introspect only  */
     void       (*handler)(umdbus_context_t *);
 
+    /** Handler uses sender uid; it is resolved before calling handler */
+    bool         needs_uid;
+
     /** Argument info for generating introspect XML */
     const char  *args;
 } member_info_t;
@@ -89,28 +116,125 @@ typedef struct  {
 /** Define incoming method call handler + introspect data
  */
 #define ADD_METHOD(NAME, FUNC, ARGS) {\
-    .type    = DBUS_MESSAGE_TYPE_METHOD_CALL,\
-    .member  = NAME,\
-    .handler = FUNC,\
-    .args    = ARGS,\
+    .type      = DBUS_MESSAGE_TYPE_METHOD_CALL,\
+    .member    = NAME,\
+    .handler   = FUNC,\
+    .needs_uid = false,\
+    .args      = ARGS,\
+}
+
+/** Define incoming method call handler that needs sender uid
+ */
+#define ADD_METHOD_UID(NAME, FUNC, ARGS) {\
+    .type      = DBUS_MESSAGE_TYPE_METHOD_CALL,\
+    .member    = NAME,\
+    .handler   = FUNC,\
+    .needs_uid = true,\
+    .args      = ARGS,\
 }
 
+/** Define method call handler that needs sender uid for access control
+ */
+#ifdef SAILFISH_ACCESS_CONTROL
+# define ADD_METHOD_ACL(NAME, FUNC, ARGS) ADD_METHOD_UID(NAME, FUNC, ARGS)
+#else
+# define ADD_METHOD_ACL(NAME, FUNC, ARGS) ADD_METHOD(NAME, FUNC, ARGS)
+#endif
+
 /** Define outgoing signal introspect data
  */
 #define ADD_SIGNAL(NAME, ARGS) {\
-    .type    = DBUS_MESSAGE_TYPE_SIGNAL,\
-    .member  = NAME,\
-    .handler = 0,\
-    .args    = ARGS,\
+    .type      = DBUS_MESSAGE_TYPE_SIGNAL,\
+    .member    = NAME,\
+    .handler   = 0,\
+    .needs_uid = false,\
+    .args      = ARGS,\
 }
 
 /** Terminate member data array
  */
 #define ADD_SENTINEL {\
-    .type    = DBUS_MESSAGE_TYPE_INVALID,\
-    .member  = 0,\
-    .handler = 0,\
-    .args    = 0,\
+    .type      = DBUS_MESSAGE_TYPE_INVALID,\
+    .member    = 0,\
+    .handler   = 0,\
+    .needs_uid = false,\
+    .args      = 0,\
+}
+
+/** Signals that are coalesced by the signal queue
+ */
+typedef enum {
+    UMDBUS_SIGNAL_TARGET_CONFIG,
+    UMDBUS_SIGNAL_TARGET_STATE,
+    UMDBUS_SIGNAL_CURRENT_STATE,
+    UMDBUS_SIGNAL_LEGACY,
+    UMDBUS_SIGNAL_SUPPORTED_MODES,
+    UMDBUS_SIGNAL_AVAILABLE_MODES,
+    UMDBUS_SIGNAL_HIDDEN_MODES,
+    UMDBUS_SIGNAL_WHITELISTED_MODES,
+    UMDBUS_SIGNAL_NUMOF
+} umdbus_signal_t;
+
+/** Read only property details for Properties interface / introspecting
+ *
+ * Use ADD_PROPERTY(), ADD_PROPERTY_UID(), ADD_PROPERTY_DETAILS() and
+ * ADD_PROPERTY_SENTINEL macros for instantiating these structures.
+ */
+typedef struct {
+    /** Property name, or NULL for sentinel */
+    const char       *name;
+
+    /** Value getter, returns mode name for details properties */
+    gchar          *(*get)(uid_t uid);
+
+    /** Value is mode details dict instead of a string */
+    bool              details;
+
+    /** Value depends on sender uid */
+    bool              per_user;
+
+    /** Queued signal that broadcasts value changes, or UMDBUS_SIGNAL_NUMOF */
+    umdbus_signal_t   signal;
+} property_info_t;
+
+/** Define string property
+ */
+#define ADD_PROPERTY(NAME, FUNC, SIGNAL) {\
+    .name     = NAME,\
+    .get      = FUNC,\
+    .details  = false,\
+    .per_user = false,\
+    .signal   = SIGNAL,\
+}
+
+/** Define string property that depends on sender uid
+ */
+#define ADD_PROPERTY_UID(NAME, FUNC, SIGNAL) {\
+    .name     = NAME,\
+    .get      = FUNC,\
+    .details  = false,\
+    .per_user = true,\
+    .signal   = SIGNAL,\
+}
+
+/** Define mode details dict property
+ */
+#define ADD_PROPERTY_DETAILS(NAME, FUNC, SIGNAL) {\
+    .name     = NAME,\
+    .get      = FUNC,\
+    .details  = true,\
+    .per_user = false,\
+    .signal   = SIGNAL,\
+}
+
+/** Terminate property data array
+ */
+#define ADD_PROPERTY_SENTINEL {\
+    .name     = 0,\
+    .get      = 0,\
+    .details  = false,\
+    .per_user = false,\
+    .signal   = UMDBUS_SIGNAL_NUMOF,\
 }
 
 /** D-Bus interface details for message handling / introspecting
@@ -118,10 +242,13 @@ typedef struct  {
 typedef struct
 {
     /** D-Bus interface name */
-    const char          *interface;
+    const char            *interface;
 
     /** Array of interface members */
-    const member_info_t *members;
+    const member_info_t   *members;
+
+    /** Array of interface properties, or NULL */
+    const property_info_t *properties;
 } interface_info_t;
 
 /** D-Bus object details for message handling / introspecting
@@ -167,10 +294,41 @@ struct umdbus_context_t {
     /** Information about message member name */
     const member_info_t    *member_info;
 
+    /** Uid of sender, valid if member_info->needs_uid is set */
+    uid_t                   uid;
+
     /** Reply message to send */
     DBusMessage            *rsp;
 };
 
+/** Signal queue slot
+ */
+typedef struct {
+    /** Signal name */
+    const char  *name;
+
+    /** Signal carries mode details dict instead of a string */
+    bool         details;
+
+    /** Skip values that equal the previously broadcast one */
+    bool         dedup;
+
+    /** Minimum interval between broadcasts, or 0 for no limit */
+    int          rate_ms;
+
+    /** Queued value, or NULL */
+    gchar       *pending;
+
+    /** Queued signal message, or NULL */
+    DBusMessage *pending_msg;
+
+    /** Previously broadcast value, or NULL */
+    gchar       *sent;
+
+    /** Monotonic time of previous broadcast [ms] */
+    int64_t      sent_at;
+} umdbus_signal_slot_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -185,8 +343,9 @@ static void member_info_introspect(const member_info_t *self, FILE *file);
  * INTERFACE_INFO
  * ------------------------------------------------------------------------- */
 
-static const member_info_t *interface_info_get_member(const interface_info_t *self, const char *member);
-static void                 interface_info_introspect(const interface_info_t *self, FILE *file);
+static const member_info_t   *interface_info_get_member  (const interface_info_t *self, const char *member);
+static const property_info_t *interface_info_get_property(const interface_info_t *self, const char *name);
+static void                   interface_info_introspect  (const interface_info_t *self, FILE *file);
 
 /* ------------------------------------------------------------------------- *
  * OBJECT_INFO
@@ -195,6 +354,16 @@ static void                 interface_info_introspect(const interface_info_t *se
 static const interface_info_t *object_info_get_interface     (const object_info_t *self, const char *interface);
 static void                    object_info_introspect        (const object_info_t *self, FILE *file, const char *interface);
 static char                   *object_info_get_introspect_xml(const object_info_t *self, const char *interface);
+static const char             *object_info_get_cached_introspect_xml(const object_info_t *self);
+
+/* ------------------------------------------------------------------------- *
+ * DISPATCH
+ * ------------------------------------------------------------------------- */
+
+static void        umdbus_dispatch_init          (void);
+static void        umdbus_dispatch_quit          (void);
+static GHashTable *umdbus_dispatch_get_interfaces(const object_info_t *object_info);
+static GHashTable *umdbus_dispatch_get_members   (const interface_info_t *interface_info);
 
 /* ------------------------------------------------------------------------- *
  * INTROSPECTABLE
@@ -202,10 +371,22 @@ static char                   *object_info_get_introspect_xml(const object_info_
 
 static void introspectable_introspect_cb(umdbus_context_t *context);
 
+/* ------------------------------------------------------------------------- *
+ * PROPERTIES
+ * ------------------------------------------------------------------------- */
+
+static bool                    properties_append_value       (DBusMessageIter *iter, const property_info_t *prop, uid_t uid);
+static bool                    properties_append_entry       (DBusMessageIter *iter, const property_info_t *prop, uid_t uid);
+static const interface_info_t *properties_get_interface      (umdbus_context_t *context, const char *interface);
+static void                    properties_get_cb             (umdbus_context_t *context);
+static void                    properties_get_all_cb         (umdbus_context_t *context);
+static void                    properties_set_cb             (umdbus_context_t *context);
+
 /* ------------------------------------------------------------------------- *
  * USB_MODED
  * ------------------------------------------------------------------------- */
 
+static const char *usb_moded_exposed_mode        (const char *mode);
 static void usb_moded_state_request_cb           (umdbus_context_t *context);
 static void usb_moded_target_state_get_cb        (umdbus_context_t *context);
 static void usb_moded_target_config_get_cb       (umdbus_context_t *context);
@@ -225,6 +406,17 @@ static void usb_moded_whitelisted_set_cb         (umdbus_context_t *context);
 static void usb_moded_network_set_cb             (umdbus_context_t *context);
 static void usb_moded_network_get_cb             (umdbus_context_t *context);
 static void usb_moded_rescue_off_cb              (umdbus_context_t *context);
+static void usb_moded_switch_stats_get_cb        (umdbus_context_t *context);
+static void usb_moded_mac_regenerate_cb          (umdbus_context_t *context);
+static void usb_moded_gadget_functions_set_cb    (umdbus_context_t *context);
+static gchar *usb_moded_current_state_prop       (uid_t uid);
+static gchar *usb_moded_target_state_prop        (uid_t uid);
+static gchar *usb_moded_config_prop              (uid_t uid);
+static gchar *usb_moded_supported_modes_prop     (uid_t uid);
+static gchar *usb_moded_available_modes_prop     (uid_t uid);
+static gchar *usb_moded_available_modes_for_user_prop(uid_t uid);
+static gchar *usb_moded_hidden_modes_prop        (uid_t uid);
+static gchar *usb_moded_whitelisted_modes_prop   (uid_t uid);
 
 /* ------------------------------------------------------------------------- *
  * UMDBUS
@@ -235,18 +427,22 @@ void                        umdbus_dump_introspect_xml          (void);
 void                        umdbus_dump_busconfig_xml           (void);
 void                        umdbus_send_config_signal           (const char *section, const char *key, const char *value);
 static DBusHandlerResult    umdbus_msg_handler                  (DBusConnection *const connection, DBusMessage *const msg, gpointer const user_data);
+static void                 umdbus_dispatch_method              (umdbus_context_t *context);
+static void                 umdbus_send_method_reply            (DBusConnection *connection, umdbus_context_t *context);
 DBusConnection             *umdbus_get_connection               (void);
 gboolean                    umdbus_init_connection              (void);
 gboolean                    umdbus_init_service                 (void);
 static void                 umdbus_cleanup_service              (void);
 void                        umdbus_cleanup                      (void);
 static DBusMessage         *umdbus_new_signal                   (const char *signal_name);
+static DBusMessage         *umdbus_new_string_signal            (const char *signal_name, const char *content);
 static int                  umdbus_send_signal_ex               (const char *signal_name, const char *content);
 static void                 umdbus_send_legacy_signal           (const char *state_ind);
 void                        umdbus_send_current_state_signal    (const char *state_ind);
 static bool                 umdbus_append_basic_entry           (DBusMessageIter *iter, const char *key, int type, const void *val);
 static bool                 umdbus_append_int32_entry           (DBusMessageIter *iter, const char *key, int val);
 static bool                 umdbus_append_string_entry          (DBusMessageIter *iter, const char *key, const char *val);
+static bool                 umdbus_append_mode_dict             (DBusMessageIter *iter, const char *mode_name);
 static bool                 umdbus_append_mode_details          (DBusMessage *msg, const char *mode_name);
 static void                 umdbus_send_mode_details_signal     (const char *mode_name);
 void                        umdbus_send_target_state_signal     (const char *state_ind);
@@ -258,7 +454,6 @@ int                         umdbus_send_hidden_modes_signal     (const char *hid
 int                         umdbus_send_whitelisted_modes_signal(const char *whitelist);
 static void                 umdbus_get_name_owner_cb            (DBusPendingCall *pc, void *aptr);
 gboolean                    umdbus_get_name_owner_async         (const char *name, usb_moded_get_name_owner_fn cb, DBusPendingCall **ppc);
-static uid_t                umdbus_get_sender_uid               (const char *name);
 const char                 *umdbus_arg_type_repr                (int type);
 const char                 *umdbus_arg_type_signature           (int type);
 const char                 *umdbus_msg_type_repr                (int type);
@@ -290,6 +485,36 @@ bool                        umdbus_append_args                  (DBusMessageIter
 DBusMessage                *umdbus_blocking_call                (DBusConnection *con, const char *dst, const char *obj, const char *iface, const char *meth, DBusError *err, int arg_type, ...);
 bool                        umdbus_parse_reply                  (DBusMessage *rsp, int arg_type, ...);
 
+/* ------------------------------------------------------------------------- *
+ * SIGNAL_QUEUE
+ * ------------------------------------------------------------------------- */
+
+static int64_t              umdbus_signal_now                   (void);
+static void                 umdbus_signal_slot_sent             (umdbus_signal_t id, const char *value);
+static void                 umdbus_signal_slot_clear_pending    (umdbus_signal_slot_t *slot);
+static void                 umdbus_signal_slot_send_locked      (umdbus_signal_slot_t *slot);
+static gboolean             umdbus_signal_flush_cb              (gpointer aptr);
+static void                 umdbus_signal_schedule_flush        (bool delayed);
+static bool                 umdbus_queue_signal                 (umdbus_signal_t id, const char *value);
+static void                 umdbus_send_properties_changed_locked(const bool *sent);
+static int                  umdbus_flush_signals                (bool force);
+static void                 umdbus_signal_queue_quit            (void);
+
+/* ------------------------------------------------------------------------- *
+ * SENDER_UID
+ * ------------------------------------------------------------------------- */
+
+static void                 umdbus_sender_uid_track             (const char *name, bool enable);
+static bool                 umdbus_sender_uid_cache_lookup      (const char *name, uid_t *puid);
+static void                 umdbus_sender_uid_cache_store       (const char *name, uid_t uid);
+static void                 umdbus_sender_uid_cache_forget      (const char *name);
+static void                 umdbus_sender_uid_cache_flush       (void);
+static void                 umdbus_handle_name_owner_changed    (DBusMessage *sig);
+static uid_t                umdbus_parse_sender_credentials     (DBusMessage *rsp);
+static void                 umdbus_query_sender_uid_cb          (DBusPendingCall *pc, void *aptr);
+static bool                 umdbus_query_sender_uid_async       (DBusMessage *msg);
+
+
 /* ========================================================================= *
  * Data
  * ========================================================================= */
@@ -297,6 +522,38 @@ bool                        umdbus_parse_reply                  (DBusMessage *rs
 static DBusConnection *umdbus_connection = NULL;
 static gboolean        umdbus_service_name_acquired   = FALSE;
 
+/** Cached sender uids: unique bus name -> uid */
+static GHashTable     *umdbus_sender_uid_cache = 0;
+
+/** Lookup table: object path -> object_info_t */
+static GHashTable     *umdbus_dispatch_objects = 0;
+
+/** Lookup table: object_info_t -> (interface name -> interface_info_t) */
+static GHashTable     *umdbus_dispatch_interfaces = 0;
+
+/** Lookup table: interface_info_t -> (member name -> member_info_t) */
+static GHashTable     *umdbus_dispatch_members = 0;
+
+/** Cached introspect XML: object_info_t -> xml text */
+static GHashTable     *umdbus_introspect_cache = 0;
+
+/** Mutex for accessing #umdbus_signal_slots */
+static pthread_mutex_t umdbus_signal_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define UMDBUS_SIGNAL_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&umdbus_signal_mutex) != 0 ) { \
+        log_crit("UMDBUS_SIGNAL LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define UMDBUS_SIGNAL_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&umdbus_signal_mutex) != 0 ) { \
+        log_crit("UMDBUS_SIGNAL UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
 /* ========================================================================= *
  * MEMBER_INFO
  * ========================================================================= */
@@ -338,10 +595,16 @@ interface_info_get_member(const interface_info_t *self, const char *member)
     LOG_REGISTER_CONTEXT;
 
     const member_info_t *mem = 0;
+    GHashTable          *lut = 0;
 
     if( !self || !member )
         goto EXIT;
 
+    if( (lut = umdbus_dispatch_get_members(self)) ) {
+        mem = g_hash_table_lookup(lut, member);
+        goto EXIT;
+    }
+
     for( size_t i = 0; self->members[i].member; ++i ) {
         if( strcmp(self->members[i].member, member) )
             continue;
@@ -352,6 +615,26 @@ EXIT:
     return mem;
 }
 
+static const property_info_t *
+interface_info_get_property(const interface_info_t *self, const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const property_info_t *prop = 0;
+
+    if( !self || !self->properties || !name )
+        goto EXIT;
+
+    for( size_t i = 0; self->properties[i].name; ++i ) {
+        if( strcmp(self->properties[i].name, name) )
+            continue;
+        prop = &self->properties[i];
+        break;
+    }
+EXIT:
+    return prop;
+}
+
 static void
 interface_info_introspect(const interface_info_t *self, FILE *file)
 {
@@ -360,6 +643,10 @@ interface_info_introspect(const interface_info_t *self, FILE *file)
     fprintf(file, "  <interface name=\"%s\">\n", self->interface);
     for( size_t i = 0; self->members[i].member; ++i )
         member_info_introspect(&self->members[i], file);
+    for( size_t i = 0; self->properties && self->properties[i].name; ++i )
+        fprintf(file, "    <property name=\"%s\" type=\"%s\" access=\"read\"/>\n",
+                self->properties[i].name,
+                self->properties[i].details ? "a{sv}" : "s");
     fprintf(file, "  </interface>\n");
 }
 
@@ -373,10 +660,16 @@ object_info_get_interface(const object_info_t *self, const char *interface)
     LOG_REGISTER_CONTEXT;
 
     const interface_info_t *ifc = 0;
+    GHashTable             *lut = 0;
 
     if( !self || !interface )
         goto EXIT;
 
+    if( (lut = umdbus_dispatch_get_interfaces(self)) ) {
+        ifc = g_hash_table_lookup(lut, interface);
+        goto EXIT;
+    }
+
     for( size_t i = 0; self->interfaces[i]; ++i ) {
         if( strcmp(self->interfaces[i]->interface, interface) )
             continue;
@@ -451,6 +744,39 @@ object_info_get_introspect_xml(const object_info_t *self, const char *interface)
     return text;
 }
 
+/** Get introspect XML for all interfaces of an object
+ *
+ * The object tree is static, so the XML is generated on the first
+ * request and then reused.
+ *
+ * @param self  Object info
+ *
+ * @return introspect XML owned by the cache, or NULL
+ */
+static const char *
+object_info_get_cached_introspect_xml(const object_info_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *text = 0;
+
+    if( !self )
+        goto EXIT;
+
+    if( !umdbus_introspect_cache )
+        umdbus_introspect_cache = g_hash_table_new_full(g_direct_hash,
+                                                        g_direct_equal,
+                                                        0, free);
+
+    if( !(text = g_hash_table_lookup(umdbus_introspect_cache, self)) ) {
+        if( (text = object_info_get_introspect_xml(self, 0)) )
+            g_hash_table_insert(umdbus_introspect_cache, (gpointer)self, text);
+    }
+
+EXIT:
+    return text;
+}
+
 /* ========================================================================= *
  * INTROSPECTABLE  --  org.freedesktop.DBus.Introspectable
  * ========================================================================= */
@@ -460,10 +786,11 @@ introspectable_introspect_cb(umdbus_context_t *context)
 {
     LOG_REGISTER_CONTEXT;
 
-    char *text = object_info_get_introspect_xml(context->object_info, 0);
-    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+    const char *text = object_info_get_cached_introspect_xml(context->object_info);
+    if( !text )
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED, context->member);
+    else if( (context->rsp = dbus_message_new_method_return(context->msg)) )
         dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &text, DBUS_TYPE_INVALID);
-    free(text);
 }
 
 static const member_info_t introspectable_members[] =
@@ -500,6 +827,228 @@ static const interface_info_t peer_interface = {
     .members  = peer_members
 };
 
+/* ========================================================================= *
+ * PROPERTIES  --  org.freedesktop.DBus.Properties
+ * ========================================================================= */
+
+/** Append property value variant to dbus iterator
+ *
+ * @param iter  Iterator to append data to
+ * @param prop  Property info
+ * @param uid   Uid of the sender
+ *
+ * @return true on success, false on failure
+ */
+static bool
+properties_append_value(DBusMessageIter *iter, const property_info_t *prop,
+                        uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   ack   = false;
+    gchar *value = prop->get(uid);
+
+    if( !prop->details ) {
+        ack = umdbus_append_string_variant(iter, value ?: "");
+    }
+    else {
+        DBusMessageIter var;
+        if( umdbus_open_container(iter, &var, DBUS_TYPE_VARIANT,
+                                  DBUS_TYPE_ARRAY_AS_STRING
+                                  DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                  DBUS_TYPE_STRING_AS_STRING
+                                  DBUS_TYPE_VARIANT_AS_STRING
+                                  DBUS_DICT_ENTRY_END_CHAR_AS_STRING) ) {
+            ack = umdbus_append_mode_dict(&var, value);
+            ack = umdbus_close_container(iter, &var, ack);
+        }
+    }
+
+    g_free(value);
+    return ack;
+}
+
+/** Append property name, variant value dict entry to dbus iterator
+ *
+ * @param iter  Iterator to append data to
+ * @param prop  Property info
+ * @param uid   Uid of the sender
+ *
+ * @return true on success, false on failure
+ */
+static bool
+properties_append_entry(DBusMessageIter *iter, const property_info_t *prop,
+                        uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    DBusMessageIter entry;
+
+    if( umdbus_open_container(iter, &entry, DBUS_TYPE_DICT_ENTRY, 0) ) {
+        ack = (umdbus_append_string(&entry, prop->name) &&
+               properties_append_value(&entry, prop, uid));
+        ack = umdbus_close_container(iter, &entry, ack);
+    }
+
+    return ack;
+}
+
+/** Lookup interface that has properties, or create error reply
+ *
+ * @param context    Method call context
+ * @param interface  Interface name from method call arguments
+ *
+ * @return interface info, or NULL
+ */
+static const interface_info_t *
+properties_get_interface(umdbus_context_t *context, const char *interface)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const interface_info_t *ifc = object_info_get_interface(context->object_info,
+                                                            interface);
+    if( !ifc || !ifc->properties ) {
+        context->rsp = dbus_message_new_error_printf(context->msg,
+                                                     DBUS_ERROR_UNKNOWN_INTERFACE,
+                                                     "Interface '%s' does not have properties",
+                                                     interface);
+        ifc = 0;
+    }
+    return ifc;
+}
+
+/** Get value of a single property
+ */
+static void
+properties_get_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char             *interface = 0;
+    const char             *name      = 0;
+    const interface_info_t *ifc       = 0;
+    const property_info_t  *prop      = 0;
+    DBusError               err       = DBUS_ERROR_INIT;
+    DBusMessageIter         body;
+
+    if( !dbus_message_get_args(context->msg, &err,
+                               DBUS_TYPE_STRING, &interface,
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_INVALID) ) {
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, context->member);
+    }
+    else if( !(ifc = properties_get_interface(context, interface)) ) {
+        /* Error reply already created */
+    }
+    else if( !(prop = interface_info_get_property(ifc, name)) ) {
+        context->rsp = dbus_message_new_error_printf(context->msg,
+                                                     DBUS_ERROR_UNKNOWN_PROPERTY,
+                                                     "Property '%s.%s' does not exist",
+                                                     interface, name);
+    }
+    else if( (context->rsp = dbus_message_new_method_return(context->msg)) ) {
+        if( !umdbus_append_init(&body, context->rsp) ||
+            !properties_append_value(&body, prop, context->uid) ) {
+            dbus_message_unref(context->rsp),
+                context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED, context->member);
+        }
+    }
+    dbus_error_free(&err);
+}
+
+/** Get values of all properties in one reply
+ *
+ * Provides full daemon state snapshot in one round trip.
+ */
+static void
+properties_get_all_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char             *interface = 0;
+    const interface_info_t *ifc       = 0;
+    DBusError               err       = DBUS_ERROR_INIT;
+    DBusMessageIter         body, dict;
+    bool                    ack       = false;
+
+    if( !dbus_message_get_args(context->msg, &err,
+                               DBUS_TYPE_STRING, &interface,
+                               DBUS_TYPE_INVALID) ) {
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, context->member);
+        goto EXIT;
+    }
+
+    if( !(ifc = properties_get_interface(context, interface)) )
+        goto EXIT;
+
+    if( !(context->rsp = dbus_message_new_method_return(context->msg)) )
+        goto EXIT;
+
+    if( umdbus_append_init(&body, context->rsp) &&
+        umdbus_open_container(&body, &dict, DBUS_TYPE_ARRAY,
+                              DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                              DBUS_TYPE_STRING_AS_STRING
+                              DBUS_TYPE_VARIANT_AS_STRING
+                              DBUS_DICT_ENTRY_END_CHAR_AS_STRING) ) {
+        ack = true;
+        for( size_t i = 0; ack && ifc->properties[i].name; ++i )
+            ack = properties_append_entry(&dict, &ifc->properties[i], context->uid);
+        ack = umdbus_close_container(&body, &dict, ack);
+    }
+
+    if( !ack )
+        dbus_message_unref(context->rsp),
+            context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED, context->member);
+
+EXIT:
+    dbus_error_free(&err);
+}
+
+/** Reject property value changes
+ *
+ * All properties are read only, state changes are made via methods.
+ */
+static void
+properties_set_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    context->rsp = dbus_message_new_error(context->msg,
+                                          DBUS_ERROR_PROPERTY_READ_ONLY,
+                                          context->member);
+}
+
+static const member_info_t properties_members[] =
+{
+    ADD_METHOD_UID("Get",
+                   properties_get_cb,
+                   "      <arg direction=\"in\" name=\"interface_name\" type=\"s\"/>\n"
+                   "      <arg direction=\"in\" name=\"property_name\" type=\"s\"/>\n"
+                   "      <arg direction=\"out\" name=\"value\" type=\"v\"/>\n"),
+    ADD_METHOD_UID("GetAll",
+                   properties_get_all_cb,
+                   "      <arg direction=\"in\" name=\"interface_name\" type=\"s\"/>\n"
+                   "      <arg direction=\"out\" name=\"props\" type=\"a{sv}\"/>\n"
+                   "      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QVariantMap\"/>\n"),
+    ADD_METHOD("Set",
+               properties_set_cb,
+               "      <arg direction=\"in\" name=\"interface_name\" type=\"s\"/>\n"
+               "      <arg direction=\"in\" name=\"property_name\" type=\"s\"/>\n"
+               "      <arg direction=\"in\" name=\"value\" type=\"v\"/>\n"),
+    ADD_SIGNAL("PropertiesChanged",
+               "      <arg name=\"interface_name\" type=\"s\"/>\n"
+               "      <arg name=\"changed_properties\" type=\"a{sv}\"/>\n"
+               "      <annotation name=\"org.qtproject.QtDBus.QtTypeName.In1\" value=\"QVariantMap\"/>\n"
+               "      <arg name=\"invalidated_properties\" type=\"as\"/>\n"),
+    ADD_SENTINEL
+};
+
+static const interface_info_t properties_interface = {
+    .interface = DBUS_INTERFACE_PROPERTIES,
+    .members  = properties_members
+};
+
 /* ========================================================================= *
  * USB_MODED -- com.meego.usb_moded
  * ========================================================================= */
@@ -508,17 +1057,31 @@ static const interface_info_t peer_interface = {
  * mode transition
  * ------------------------------------------------------------------------- */
 
-/** Get currently active usb mode
+/** Map internal mode name to the one exposed to clients
+ *
+ * @param mode  mode name
+ *
+ * @return mode name to report
  */
-static void
-usb_moded_state_request_cb(umdbus_context_t *context)
+static const char *
+usb_moded_exposed_mode(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    const char *mode = control_get_external_mode();
     /* To the outside we want to keep CHARGING and CHARGING_FALLBACK the same */
     if( !strcmp(MODE_CHARGING_FALLBACK, mode) )
         mode = MODE_CHARGING;
+    return mode;
+}
+
+/** Get currently active usb mode
+ */
+static void
+usb_moded_state_request_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *mode = usb_moded_exposed_mode(control_get_external_mode());
     if( (context->rsp = dbus_message_new_method_return(context->msg)) )
         dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID);
 }
@@ -559,7 +1122,7 @@ usb_moded_state_set_cb(umdbus_context_t *context)
     const char *mode = control_get_external_mode();
     char       *use  = 0;
     DBusError   err  = DBUS_ERROR_INIT;
-    uid_t       uid  = umdbus_get_sender_uid(context->sender);
+    uid_t       uid  = context->uid;
 
     if( !dbus_message_get_args(context->msg, &err, DBUS_TYPE_STRING, &use, DBUS_TYPE_INVALID) ) {
         log_err("parse error: %s: %s", err.name, err.message);
@@ -615,7 +1178,7 @@ usb_moded_config_set_cb(umdbus_context_t *context)
 
     char       *config = 0;
     DBusError   err    = DBUS_ERROR_INIT;
-    uid_t       uid    = umdbus_get_sender_uid(context->sender);
+    uid_t       uid    = context->uid;
 
     if( !dbus_message_get_args(context->msg, &err, DBUS_TYPE_STRING, &config, DBUS_TYPE_INVALID) ) {
         context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, context->member);
@@ -641,7 +1204,7 @@ usb_moded_config_get_cb(umdbus_context_t *context)
 {
     LOG_REGISTER_CONTEXT;
 
-    uid_t  uid    = umdbus_get_sender_uid(context->sender);
+    uid_t  uid    = context->uid;
     char  *config = config_get_mode_setting(uid);
 
     if( (context->rsp = dbus_message_new_method_return(context->msg)) )
@@ -660,11 +1223,10 @@ usb_moded_mode_list_cb(umdbus_context_t *context)
 {
     LOG_REGISTER_CONTEXT;
 
-    gchar *mode_list = common_get_mode_list(SUPPORTED_MODES_LIST, 0);
+    const char *mode_list = common_peek_mode_list(SUPPORTED_MODES_LIST, 0);
 
     if( (context->rsp = dbus_message_new_method_return(context->msg)) )
         dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &mode_list, DBUS_TYPE_INVALID);
-    g_free(mode_list);
 }
 
 /* ------------------------------------------------------------------------- *
@@ -678,11 +1240,10 @@ usb_moded_available_modes_get_cb(umdbus_context_t *context)
 {
     LOG_REGISTER_CONTEXT;
 
-    gchar *mode_list = common_get_mode_list(AVAILABLE_MODES_LIST, 0);
+    const char *mode_list = common_peek_mode_list(AVAILABLE_MODES_LIST, 0);
 
     if( (context->rsp = dbus_message_new_method_return(context->msg)) )
         dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &mode_list, DBUS_TYPE_INVALID);
-    g_free(mode_list);
 }
 
 /** Get comma separated list of modes available for selection by current user
@@ -692,12 +1253,11 @@ usb_moded_available_modes_for_user_cb(umdbus_context_t *context)
 {
     LOG_REGISTER_CONTEXT;
 
-    uid_t uid = umdbus_get_sender_uid(context->sender);
-    gchar *mode_list = common_get_mode_list(AVAILABLE_MODES_LIST, uid);
+    uid_t uid = context->uid;
+    const char *mode_list = common_peek_mode_list(AVAILABLE_MODES_LIST, uid);
 
     if( (context->rsp = dbus_message_new_method_return(context->msg)) )
         dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &mode_list, DBUS_TYPE_INVALID);
-    g_free(mode_list);
 }
 
 /* ------------------------------------------------------------------------- *
@@ -719,7 +1279,7 @@ usb_moded_mode_hide_cb(umdbus_context_t *context)
     }
 #ifdef SAILFISH_ACCESS_CONTROL
     /* do not let non-owner user hide modes */
-    else if( !sailfish_access_control_hasgroup(umdbus_get_sender_uid(context->sender), "sailfish-system") ) {
+    else if( !sailfish_access_control_hasgroup(context->uid, "sailfish-system") ) {
         context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_ACCESS_DENIED, context->member);
     }
 #endif
@@ -752,7 +1312,7 @@ usb_moded_mode_unhide_cb(umdbus_context_t *context)
     }
 #ifdef SAILFISH_ACCESS_CONTROL
     /* do not let non-owner user unhide modes */
-    else if( !sailfish_access_control_hasgroup(umdbus_get_sender_uid(context->sender), "sailfish-system") ) {
+    else if( !sailfish_access_control_hasgroup(context->uid, "sailfish-system") ) {
         context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_ACCESS_DENIED, context->member);
     }
 #endif
@@ -900,7 +1460,7 @@ usb_moded_network_set_cb(umdbus_context_t *context)
         if( SET_CONFIG_OK(ret) ) {
             if( (context->rsp = dbus_message_new_method_return(context->msg)) )
                 dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &config, DBUS_TYPE_STRING, &setting, DBUS_TYPE_INVALID);
-            network_update();
+            worker_request_network_refresh();
         }
         else {
             context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, config);
@@ -953,51 +1513,250 @@ usb_moded_rescue_off_cb(umdbus_context_t *context)
     context->rsp = dbus_message_new_method_return(context->msg);
 }
 
-static const member_info_t usb_moded_members[] =
+/** Get mode switch latency and mainloop dispatch statistics
+ */
+static void
+usb_moded_switch_stats_get_cb(umdbus_context_t *context)
 {
-    ADD_METHOD(USB_MODE_STATE_REQUEST,
-               usb_moded_state_request_cb,
-               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_TARGET_STATE_GET,
-               usb_moded_target_state_get_cb,
-               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_TARGET_CONFIG_GET,
-               usb_moded_target_config_get_cb,
-               "      <arg name=\"config\" type=\"a{sv}\" direction=\"out\"/>\n"
-               "      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QVariantMap\"/>\n"),
-    ADD_METHOD(USB_MODE_STATE_SET,
-               usb_moded_state_set_cb,
-               "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
-               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_CONFIG_SET,
-               usb_moded_config_set_cb,
-               "      <arg name=\"config\" type=\"s\" direction=\"in\"/>\n"
-               "      <arg name=\"config\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_CONFIG_GET,
-               usb_moded_config_get_cb,
-               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_LIST,
-               usb_moded_mode_list_cb,
-               "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_AVAILABLE_MODES_GET,
-               usb_moded_available_modes_get_cb,
-               "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_AVAILABLE_MODES_FOR_USER,
-               usb_moded_available_modes_for_user_cb,
-               "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_HIDE,
-               usb_moded_mode_hide_cb,
-               "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
-               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_UNHIDE,
-               usb_moded_mode_unhide_cb,
-               "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
-               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_HIDDEN_GET,
-               usb_moded_hidden_get_cb,
-               "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
-    ADD_METHOD(USB_MODE_WHITELISTED_MODES_GET,
-               usb_moded_whitelisted_modes_get_cb,
+    LOG_REGISTER_CONTEXT;
+
+    gchar *trace = trace_get_report();
+    gchar *cable = umudev_get_cable_report();
+    gchar *loop  = loopwatch_get_report();
+    gchar *stats = g_strconcat(trace, cable, loop, NULL);
+    g_free(loop);
+    g_free(cable);
+    g_free(trace);
+    if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &stats, DBUS_TYPE_INVALID);
+    g_free(stats);
+}
+
+/** Replace persistent usb ethernet address
+ *
+ * The address is otherwise kept stable so that hosts do not need to
+ * redo network setup. New address gets applied when usb-moded is
+ * restarted.
+ *
+ * Allowed for root only.
+ */
+static void
+usb_moded_mac_regenerate_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *mac = 0;
+
+    if( context->uid != 0 ) {
+        log_warning("%s denied for uid %d", context->member, (int)context->uid);
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_ACCESS_DENIED, context->member);
+    }
+    else if( !(mac = mac_regenerate_mac()) )
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_FAILED, context->member);
+    else if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+        dbus_message_append_args(context->rsp, DBUS_TYPE_STRING, &mac, DBUS_TYPE_INVALID);
+    g_free(mac);
+}
+
+/** Change functions exposed via an additional configfs gadget
+ *
+ * The primary gadget is driven by usb mode selection, this applies
+ * only to gadgets listed in configfs extra_gadgets. Changes are made
+ * asynchronously by the worker thread.
+ *
+ * Allowed for root only.
+ */
+static void
+usb_moded_gadget_functions_set_cb(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *gadget    = 0;
+    const char *functions = 0;
+    DBusError   err       = DBUS_ERROR_INIT;
+
+    if( !dbus_message_get_args(context->msg, &err,
+                               DBUS_TYPE_STRING, &gadget,
+                               DBUS_TYPE_STRING, &functions,
+                               DBUS_TYPE_INVALID) ) {
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, context->member);
+    }
+    else if( context->uid != 0 ) {
+        log_warning("%s denied for uid %d", context->member, (int)context->uid);
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_ACCESS_DENIED, context->member);
+    }
+    else if( !configfs_gadget_is_secondary(gadget) ) {
+        log_warning("%s: unknown gadget '%s'", context->member, gadget);
+        context->rsp = dbus_message_new_error(context->msg, DBUS_ERROR_INVALID_ARGS, gadget);
+    }
+    else {
+        worker_request_gadget_functions(gadget, functions);
+        if( (context->rsp = dbus_message_new_method_return(context->msg)) )
+            dbus_message_append_args(context->rsp,
+                                     DBUS_TYPE_STRING, &gadget,
+                                     DBUS_TYPE_STRING, &functions,
+                                     DBUS_TYPE_INVALID);
+    }
+    dbus_error_free(&err);
+}
+
+/* ------------------------------------------------------------------------- *
+ * properties  --  state snapshot via org.freedesktop.DBus.Properties
+ * ------------------------------------------------------------------------- */
+
+static gchar *
+usb_moded_current_state_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)uid;
+    return g_strdup(usb_moded_exposed_mode(control_get_external_mode()));
+}
+
+static gchar *
+usb_moded_target_state_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)uid;
+    return g_strdup(control_get_target_mode());
+}
+
+static gchar *
+usb_moded_config_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return config_get_mode_setting(uid);
+}
+
+static gchar *
+usb_moded_supported_modes_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)uid;
+    return g_strdup(common_peek_mode_list(SUPPORTED_MODES_LIST, 0));
+}
+
+static gchar *
+usb_moded_available_modes_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)uid;
+    return g_strdup(common_peek_mode_list(AVAILABLE_MODES_LIST, 0));
+}
+
+static gchar *
+usb_moded_available_modes_for_user_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_strdup(common_peek_mode_list(AVAILABLE_MODES_LIST, uid));
+}
+
+static gchar *
+usb_moded_hidden_modes_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)uid;
+    return config_get_hidden_modes();
+}
+
+static gchar *
+usb_moded_whitelisted_modes_prop(uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)uid;
+    return config_get_mode_whitelist();
+}
+
+/** Read only properties of USB_MODE_INTERFACE
+ *
+ * Changes are broadcast as PropertiesChanged along with the matching
+ * state signals. Values that depend on the sender are only invalidated.
+ * The default mode config is changed via sig_usb_config_ind only.
+ */
+static const property_info_t usb_moded_properties[] =
+{
+    ADD_PROPERTY(USB_MODE_PROPERTY_CURRENT_STATE,
+                 usb_moded_current_state_prop,
+                 UMDBUS_SIGNAL_CURRENT_STATE),
+    ADD_PROPERTY(USB_MODE_PROPERTY_TARGET_STATE,
+                 usb_moded_target_state_prop,
+                 UMDBUS_SIGNAL_TARGET_STATE),
+    ADD_PROPERTY_DETAILS(USB_MODE_PROPERTY_TARGET_CONFIG,
+                         usb_moded_target_state_prop,
+                         UMDBUS_SIGNAL_TARGET_CONFIG),
+    ADD_PROPERTY_UID(USB_MODE_PROPERTY_CONFIG,
+                     usb_moded_config_prop,
+                     UMDBUS_SIGNAL_NUMOF),
+    ADD_PROPERTY(USB_MODE_PROPERTY_SUPPORTED_MODES,
+                 usb_moded_supported_modes_prop,
+                 UMDBUS_SIGNAL_SUPPORTED_MODES),
+    ADD_PROPERTY(USB_MODE_PROPERTY_AVAILABLE_MODES,
+                 usb_moded_available_modes_prop,
+                 UMDBUS_SIGNAL_AVAILABLE_MODES),
+    ADD_PROPERTY_UID(USB_MODE_PROPERTY_AVAILABLE_MODES_FOR_USER,
+                     usb_moded_available_modes_for_user_prop,
+                     UMDBUS_SIGNAL_AVAILABLE_MODES),
+    ADD_PROPERTY(USB_MODE_PROPERTY_HIDDEN_MODES,
+                 usb_moded_hidden_modes_prop,
+                 UMDBUS_SIGNAL_HIDDEN_MODES),
+    ADD_PROPERTY(USB_MODE_PROPERTY_WHITELISTED_MODES,
+                 usb_moded_whitelisted_modes_prop,
+                 UMDBUS_SIGNAL_WHITELISTED_MODES),
+    ADD_PROPERTY_SENTINEL
+};
+
+static const member_info_t usb_moded_members[] =
+{
+    ADD_METHOD(USB_MODE_STATE_REQUEST,
+               usb_moded_state_request_cb,
+               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_TARGET_STATE_GET,
+               usb_moded_target_state_get_cb,
+               "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_TARGET_CONFIG_GET,
+               usb_moded_target_config_get_cb,
+               "      <arg name=\"config\" type=\"a{sv}\" direction=\"out\"/>\n"
+               "      <annotation name=\"org.qtproject.QtDBus.QtTypeName.Out0\" value=\"QVariantMap\"/>\n"),
+    ADD_METHOD_UID(USB_MODE_STATE_SET,
+                   usb_moded_state_set_cb,
+                   "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
+                   "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD_UID(USB_MODE_CONFIG_SET,
+                   usb_moded_config_set_cb,
+                   "      <arg name=\"config\" type=\"s\" direction=\"in\"/>\n"
+                   "      <arg name=\"config\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD_UID(USB_MODE_CONFIG_GET,
+                   usb_moded_config_get_cb,
+                   "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_LIST,
+               usb_moded_mode_list_cb,
+               "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_AVAILABLE_MODES_GET,
+               usb_moded_available_modes_get_cb,
+               "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD_UID(USB_MODE_AVAILABLE_MODES_FOR_USER,
+                   usb_moded_available_modes_for_user_cb,
+                   "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD_ACL(USB_MODE_HIDE,
+                   usb_moded_mode_hide_cb,
+                   "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
+                   "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD_ACL(USB_MODE_UNHIDE,
+                   usb_moded_mode_unhide_cb,
+                   "      <arg name=\"mode\" type=\"s\" direction=\"in\"/>\n"
+                   "      <arg name=\"mode\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_HIDDEN_GET,
+               usb_moded_hidden_get_cb,
+               "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD(USB_MODE_WHITELISTED_MODES_GET,
+               usb_moded_whitelisted_modes_get_cb,
                "      <arg name=\"modes\" type=\"s\" direction=\"out\"/>\n"),
     ADD_METHOD(USB_MODE_WHITELISTED_MODES_SET,
                usb_moded_whitelisted_modes_set_cb,
@@ -1023,6 +1782,18 @@ static const member_info_t usb_moded_members[] =
     ADD_METHOD(USB_MODE_USER_CONFIG_CLEAR,
                usb_moded_user_config_clear_cb,
                "      <arg name=\"uid\" type=\"u\" direction=\"in\"/>\n"),
+    ADD_METHOD(USB_MODE_SWITCH_STATS_GET,
+               usb_moded_switch_stats_get_cb,
+               "      <arg name=\"stats\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD_UID(USB_MODE_MAC_REGENERATE,
+                   usb_moded_mac_regenerate_cb,
+                   "      <arg name=\"mac\" type=\"s\" direction=\"out\"/>\n"),
+    ADD_METHOD_UID(USB_MODE_GADGET_FUNCTIONS_SET,
+                   usb_moded_gadget_functions_set_cb,
+                   "      <arg name=\"gadget\" type=\"s\" direction=\"in\"/>\n"
+                   "      <arg name=\"functions\" type=\"s\" direction=\"in\"/>\n"
+                   "      <arg name=\"gadget\" type=\"s\" direction=\"out\"/>\n"
+                   "      <arg name=\"functions\" type=\"s\" direction=\"out\"/>\n"),
     ADD_SIGNAL(USB_MODE_SIGNAL_NAME,
                "      <arg name=\"mode_or_event\" type=\"s\"/>\n"),
     ADD_SIGNAL(USB_MODE_CURRENT_STATE_SIGNAL_NAME,
@@ -1052,8 +1823,9 @@ static const member_info_t usb_moded_members[] =
 };
 
 static const interface_info_t usb_moded_interface = {
-    .interface = USB_MODE_INTERFACE,
-    .members   = usb_moded_members
+    .interface  = USB_MODE_INTERFACE,
+    .members    = usb_moded_members,
+    .properties = usb_moded_properties,
 };
 
 /* ========================================================================= *
@@ -1073,6 +1845,7 @@ static const interface_info_t *standard_interfaces[] = {
 static const interface_info_t *usb_moded_interfaces[] = {
     &introspectable_interface,
     &peer_interface,
+    &properties_interface,
     &usb_moded_interface,
     0
 };
@@ -1105,6 +1878,117 @@ static const object_info_t usb_moded_objects[] =
     },
 };
 
+/** Build hash tables for D-Bus message dispatching
+ *
+ * Replaces linear scans over the static object / interface / member
+ * tables with hash lookups. Done once, the tables do not change.
+ */
+static void
+umdbus_dispatch_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umdbus_dispatch_objects )
+        goto EXIT;
+
+    umdbus_dispatch_objects    = g_hash_table_new(g_str_hash, g_str_equal);
+    umdbus_dispatch_interfaces = g_hash_table_new_full(g_direct_hash,
+                                                       g_direct_equal, 0,
+                                                       (GDestroyNotify)g_hash_table_unref);
+    umdbus_dispatch_members    = g_hash_table_new_full(g_direct_hash,
+                                                       g_direct_equal, 0,
+                                                       (GDestroyNotify)g_hash_table_unref);
+
+    for( const object_info_t *obj = usb_moded_objects; obj->object; ++obj ) {
+        GHashTable *interfaces = g_hash_table_new(g_str_hash, g_str_equal);
+
+        g_hash_table_insert(umdbus_dispatch_objects, (gpointer)obj->object,
+                            (gpointer)obj);
+        g_hash_table_insert(umdbus_dispatch_interfaces, (gpointer)obj,
+                            interfaces);
+
+        for( size_t i = 0; obj->interfaces[i]; ++i ) {
+            const interface_info_t *ifc = obj->interfaces[i];
+
+            /* First match wins, as with linear lookup */
+            if( !g_hash_table_contains(interfaces, ifc->interface) )
+                g_hash_table_insert(interfaces, (gpointer)ifc->interface,
+                                    (gpointer)ifc);
+
+            /* Interface info is shared between objects */
+            if( g_hash_table_contains(umdbus_dispatch_members, ifc) )
+                continue;
+
+            GHashTable *members = g_hash_table_new(g_str_hash, g_str_equal);
+            g_hash_table_insert(umdbus_dispatch_members, (gpointer)ifc,
+                                members);
+
+            for( const member_info_t *mem = ifc->members; mem->member; ++mem ) {
+                if( !g_hash_table_contains(members, mem->member) )
+                    g_hash_table_insert(members, (gpointer)mem->member,
+                                        (gpointer)mem);
+            }
+        }
+    }
+
+EXIT:
+    return;
+}
+
+/** Release D-Bus message dispatching hash tables
+ */
+static void
+umdbus_dispatch_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umdbus_dispatch_objects )
+        g_hash_table_unref(umdbus_dispatch_objects),
+            umdbus_dispatch_objects = 0;
+
+    if( umdbus_dispatch_interfaces )
+        g_hash_table_unref(umdbus_dispatch_interfaces),
+            umdbus_dispatch_interfaces = 0;
+
+    if( umdbus_dispatch_members )
+        g_hash_table_unref(umdbus_dispatch_members),
+            umdbus_dispatch_members = 0;
+
+    if( umdbus_introspect_cache )
+        g_hash_table_unref(umdbus_introspect_cache),
+            umdbus_introspect_cache = 0;
+}
+
+/** Get interface name lookup table for an object
+ *
+ * @param object_info  Object info
+ *
+ * @return hash table, or NULL if object is not in dispatch tables
+ */
+static GHashTable *
+umdbus_dispatch_get_interfaces(const object_info_t *object_info)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umdbus_dispatch_init();
+    return g_hash_table_lookup(umdbus_dispatch_interfaces, object_info);
+}
+
+/** Get member name lookup table for an interface
+ *
+ * @param interface_info  Interface info
+ *
+ * @return hash table, or NULL if interface is not in dispatch tables
+ */
+static GHashTable *
+umdbus_dispatch_get_members(const interface_info_t *interface_info)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umdbus_dispatch_init();
+    return g_hash_table_lookup(umdbus_dispatch_members, interface_info);
+}
+
 /** Locate info for D-Bus object path
  */
 static const object_info_t *
@@ -1117,12 +2001,8 @@ umdbus_get_object_info(const char *object)
     if( !object )
         goto EXIT;
 
-    for( size_t i = 0; usb_moded_objects[i].object; ++i ) {
-        if( !strcmp(usb_moded_objects[i].object, object) ) {
-            obj = &usb_moded_objects[i];
-            break;
-        }
-    }
+    umdbus_dispatch_init();
+    obj = g_hash_table_lookup(umdbus_dispatch_objects, object);
 
 EXIT:
     return obj;
@@ -1173,7 +2053,9 @@ umdbus_dump_busconfig_xml(void)
             "    <deny send_destination=\"" USB_MODE_SERVICE "\"\n"
             "          send_interface=\"" USB_MODE_INTERFACE "\"/>\n"
             "    <allow send_destination=\"" USB_MODE_SERVICE "\"\n"
-            "           send_interface=\"org.freedesktop.DBus.Introspectable\"/>\n");
+            "           send_interface=\"org.freedesktop.DBus.Introspectable\"/>\n"
+            "    <allow send_destination=\"" USB_MODE_SERVICE "\"\n"
+            "           send_interface=\"" DBUS_INTERFACE_PROPERTIES "\"/>\n");
 
     for( const member_info_t *mem = usb_moded_members; mem->member; ++mem ) {
         if( mem->type != DBUS_MESSAGE_TYPE_METHOD_CALL )
@@ -1225,6 +2107,7 @@ void umdbus_send_config_signal(const char *section, const char *key, const char
                              DBUS_TYPE_STRING, &key,
                              DBUS_TYPE_STRING, &value,
                              DBUS_TYPE_INVALID);
+    trace_count(TRACE_COUNTER_DBUS_SEND);
     dbus_connection_send(umdbus_connection, msg, NULL);
 
 EXIT:
@@ -1274,53 +2157,105 @@ static DBusHandlerResult umdbus_msg_handler(DBusConnection *const connection, DB
             /* Update the cached state value */
             usbmoded_set_init_done(true);
         }
+        else if( !strcmp(context.interface, DBUS_INTERFACE_DBUS) &&
+                 !strcmp(context.member, DBUS_NAME_OWNER_CHANGED_SIG) ) {
+            umdbus_handle_name_owner_changed(msg);
+        }
         goto EXIT;
     }
 
-    /* Locate and use method call handler */
+    /* Locate method call handler */
     context.object_info    = umdbus_get_object_info(context.object);
     context.interface_info = object_info_get_interface(context.object_info,
                                                        context.interface);
     context.member_info    = interface_info_get_member(context.interface_info,
                                                        context.member);
 
-    if( context.member_info && context.member_info->type == context.type ) {
-        if( context.member_info->handler )
-            context.member_info->handler(&context);
-    }
-    else if( !context.object_info ) {
-        context.rsp = dbus_message_new_error_printf(context.msg,
-                                                    DBUS_ERROR_UNKNOWN_OBJECT,
-                                                    "Object '%s' does not exist",
-                                                    context.object);
-    }
-    else if( !context.interface_info ) {
-        context.rsp = dbus_message_new_error_printf(context.msg,
-                                                    DBUS_ERROR_UNKNOWN_INTERFACE,
-                                                    "Interface '%s' does not exist",
-                                                    context.interface);
-    }
-    else {
-        context.rsp = dbus_message_new_error_printf(context.msg,
-                                                    DBUS_ERROR_UNKNOWN_METHOD,
-                                                    "Method '%s.%s' does not exist",
-                                                    context.interface,
-                                                    context.member);
+    /* Handlers that deal with sender uid are called only after the
+     * uid is known. Unless it is cached already, reply is deferred
+     * until async uid query finishes, so that the mainloop does not
+     * get blocked by a D-Bus round trip. */
+    if( context.member_info && context.member_info->type == context.type &&
+        context.member_info->needs_uid &&
+        !umdbus_sender_uid_cache_lookup(context.sender, &context.uid) ) {
+        if( umdbus_query_sender_uid_async(msg) ) {
+            status = DBUS_HANDLER_RESULT_HANDLED;
+            goto EXIT;
+        }
+        context.uid = UID_UNKNOWN;
     }
 
+    umdbus_dispatch_method(&context);
+
 EXIT:
     if( context.rsp ) {
         status = DBUS_HANDLER_RESULT_HANDLED;
-        if( !dbus_message_get_no_reply(context.msg) ) {
-            if( !dbus_connection_send(connection, context.rsp, 0) )
-                log_debug("Failed sending reply. Out Of Memory!\n");
-        }
-        dbus_message_unref(context.rsp);
+        umdbus_send_method_reply(connection, &context);
     }
 
     return status;
 }
 
+/** Call method handler, or create error reply if there is none
+ *
+ * @param context  Method call context with object/interface/member
+ *                 lookups already done
+ */
+static void
+umdbus_dispatch_method(umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( context->member_info && context->member_info->type == context->type ) {
+        if( context->member_info->handler )
+            context->member_info->handler(context);
+    }
+    else if( !context->object_info ) {
+        context->rsp = dbus_message_new_error_printf(context->msg,
+                                                     DBUS_ERROR_UNKNOWN_OBJECT,
+                                                     "Object '%s' does not exist",
+                                                     context->object);
+    }
+    else if( !context->interface_info ) {
+        context->rsp = dbus_message_new_error_printf(context->msg,
+                                                     DBUS_ERROR_UNKNOWN_INTERFACE,
+                                                     "Interface '%s' does not exist",
+                                                     context->interface);
+    }
+    else {
+        context->rsp = dbus_message_new_error_printf(context->msg,
+                                                     DBUS_ERROR_UNKNOWN_METHOD,
+                                                     "Method '%s.%s' does not exist",
+                                                     context->interface,
+                                                     context->member);
+    }
+}
+
+/** Send and release method call reply
+ *
+ * @param connection  D-Bus connection to use
+ * @param context     Method call context with reply message
+ */
+static void
+umdbus_send_method_reply(DBusConnection *connection, umdbus_context_t *context)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !context->rsp )
+        goto EXIT;
+
+    if( !dbus_message_get_no_reply(context->msg) ) {
+        trace_count(TRACE_COUNTER_DBUS_SEND);
+        if( !dbus_connection_send(connection, context->rsp, 0) )
+            log_debug("Failed sending reply. Out Of Memory!\n");
+    }
+    dbus_message_unref(context->rsp),
+        context->rsp = 0;
+
+EXIT:
+    return;
+}
+
 DBusConnection *umdbus_get_connection(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -1365,6 +2300,10 @@ gboolean umdbus_init_connection(void)
     /* Connect D-Bus to the mainloop */
     dbus_gmain_set_up_connection(umdbus_connection, NULL);
 
+    int fd = -1;
+    if( dbus_connection_get_unix_fd(umdbus_connection, &fd) )
+        loopwatch_name_fd(fd, "dbus");
+
     /* everything went fine */
     status = TRUE;
 
@@ -1442,13 +2381,24 @@ void umdbus_cleanup(void)
     /* clean up system bus connection */
     if (umdbus_connection != NULL)
     {
+        /* Broadcast pending state changes while we still own the name */
+        umdbus_signal_queue_quit();
+
         umdbus_cleanup_service();
 
         dbus_connection_remove_filter(umdbus_connection, umdbus_msg_handler, NULL);
 
+        umdbus_sender_uid_cache_flush();
+
         dbus_connection_unref(umdbus_connection),
             umdbus_connection = NULL;
     }
+
+    if( umdbus_sender_uid_cache )
+        g_hash_table_unref(umdbus_sender_uid_cache),
+            umdbus_sender_uid_cache = 0;
+
+    umdbus_dispatch_quit();
 }
 
 /** Helper for allocating usb-moded D-Bus signal
@@ -1487,29 +2437,25 @@ EXIT:
     return msg;
 }
 
-/**
- * Helper function for sending the different signals
+/** Helper for allocating usb-moded D-Bus signal with string argument
  *
- * @param signal_name  the type of signal (normal, error, ...)
- * @param content      string which can be mode name, error, list of modes, ...
+ * @param signal_name  Name of the signal to allocate
+ * @param content      String argument, NULL is sent as empty string
  *
- * @return 0 on success, 1 on failure
+ * @return dbus message object, or NULL in case of errors
  */
-static int
-umdbus_send_signal_ex(const char *signal_name, const char *content)
+static DBusMessage *
+umdbus_new_string_signal(const char *signal_name, const char *content)
 {
     LOG_REGISTER_CONTEXT;
 
-    int result = 1;
-    DBusMessage* msg = 0;
+    DBusMessage *msg = 0;
 
     /* Assume NULL content equals no value / empty list, and that skipping
      * signal broadcast is never preferable over sending empty string. */
     if( !content )
         content = "";
 
-    log_debug("broadcast signal %s(%s)", signal_name, content);
-
     if( !(msg = umdbus_new_signal(signal_name)) )
         goto EXIT;
 
@@ -1519,10 +2465,36 @@ umdbus_send_signal_ex(const char *signal_name, const char *content)
                                   DBUS_TYPE_INVALID) )
     {
         log_err("appending arguments to signal %s failed", signal_name);
-        goto EXIT;
+        dbus_message_unref(msg), msg = 0;
     }
 
+EXIT:
+    return msg;
+}
+
+/**
+ * Helper function for sending the different signals immediately
+ *
+ * @param signal_name  the type of signal (normal, error, ...)
+ * @param content      string which can be mode name, error, list of modes, ...
+ *
+ * @return 0 on success, 1 on failure
+ */
+static int
+umdbus_send_signal_ex(const char *signal_name, const char *content)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int result = 1;
+    DBusMessage* msg = 0;
+
+    log_debug("broadcast signal %s(%s)", signal_name, content ?: "");
+
+    if( !(msg = umdbus_new_string_signal(signal_name, content)) )
+        goto EXIT;
+
     // send the message on the correct bus
+    trace_count(TRACE_COUNTER_DBUS_SEND);
     if( !dbus_connection_send(umdbus_connection, msg, 0) )
     {
         log_err("sending signal %s failed", signal_name);
@@ -1550,9 +2522,12 @@ static void umdbus_send_legacy_signal(const char *state_ind)
     LOG_REGISTER_CONTEXT;
 
     umdbus_send_signal_ex(USB_MODE_SIGNAL_NAME, state_ind);
+    umdbus_signal_slot_sent(UMDBUS_SIGNAL_LEGACY, state_ind);
 }
 
 /** Send usb_moded current state signal
+ *
+ * The signal is queued and broadcast from idle callback.
  *
  * @param state_ind mode name
  */
@@ -1560,9 +2535,8 @@ void umdbus_send_current_state_signal(const char *state_ind)
 {
     LOG_REGISTER_CONTEXT;
 
-    umdbus_send_signal_ex(USB_MODE_CURRENT_STATE_SIGNAL_NAME,
-                          state_ind);
-    umdbus_send_legacy_signal(state_ind);
+    umdbus_queue_signal(UMDBUS_SIGNAL_CURRENT_STATE, state_ind);
+    umdbus_queue_signal(UMDBUS_SIGNAL_LEGACY, state_ind);
 }
 
 /** Append string key, variant value dict entry to dbus iterator
@@ -1662,25 +2636,23 @@ umdbus_append_string_entry(DBusMessageIter *iter, const char *key,
     return umdbus_append_basic_entry(iter, key, DBUS_TYPE_STRING, &val);
 }
 
-/** Append dynamic mode configuration to dbus message
+/** Append dynamic mode configuration dict to dbus iterator
  *
- * @param msg         D-Bus message object
+ * @param iter        Iterator to append data to
  * @param mode_name   Name of the mode to use
  *
  * @return true on success, false on failure
  */
 static bool
-umdbus_append_mode_details(DBusMessage *msg, const char *mode_name)
+umdbus_append_mode_dict(DBusMessageIter *iter, const char *mode_name)
 {
     LOG_REGISTER_CONTEXT;
 
     const modedata_t *data = usbmoded_get_modedata(mode_name);
 
-    DBusMessageIter body, dict;
-
-    dbus_message_iter_init_append(msg, &body);
+    DBusMessageIter dict;
 
-    if( !dbus_message_iter_open_container(&body,
+    if( !dbus_message_iter_open_container(iter,
                                           DBUS_TYPE_ARRAY,
                                           DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
                                           DBUS_TYPE_STRING_AS_STRING
@@ -1733,46 +2705,61 @@ umdbus_append_mode_details(DBusMessage *msg, const char *mode_name)
     ADD_STR(android_extra_sysfs_value4);
     ADD_STR(idProduct);
     ADD_STR(idVendorOverride);
+    ADD_INT(net_qmult);
+    ADD_STR(net_host_addr);
+    ADD_STR(net_dev_addr);
 #endif
 
 #undef ADD_STR
 #undef ADD_INT
 
-    if( !dbus_message_iter_close_container(&body, &dict) )
+    if( !dbus_message_iter_close_container(iter, &dict) )
         goto bailout_dict;
 
     return true;
 
 bailout_dict:
-    dbus_message_iter_abandon_container(&body, &dict);
+    dbus_message_iter_abandon_container(iter, &dict);
 
 bailout_message:
     return false;
 }
 
-/** Send usb_moded target state configuration signal
+/** Append dynamic mode configuration to dbus message
  *
- * @param mode_name mode name
+ * @param msg         D-Bus message object
+ * @param mode_name   Name of the mode to use
+ *
+ * @return true on success, false on failure
  */
-static void
-umdbus_send_mode_details_signal(const char *mode_name)
+static bool
+umdbus_append_mode_details(DBusMessage *msg, const char *mode_name)
 {
-    DBusMessage* msg = 0;
-
-    if( !(msg = umdbus_new_signal(USB_MODE_TARGET_CONFIG_SIGNAL_NAME)) )
-        goto EXIT;
+    LOG_REGISTER_CONTEXT;
 
-    if( !umdbus_append_mode_details(msg, mode_name) )
-        goto EXIT;
+    DBusMessageIter body;
 
-    dbus_connection_send(umdbus_connection, msg, 0);
+    dbus_message_iter_init_append(msg, &body);
+    return umdbus_append_mode_dict(&body, mode_name);
+}
 
-EXIT:
-    if(msg != 0)
-        dbus_message_unref(msg);
+/** Send usb_moded target state configuration signal
+ *
+ * The signal is queued and broadcast from idle callback.
+ *
+ * @param mode_name mode name
+ */
+static void
+umdbus_send_mode_details_signal(const char *mode_name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umdbus_queue_signal(UMDBUS_SIGNAL_TARGET_CONFIG, mode_name);
 }
 
 /** Send usb_moded target state signal
+ *
+ * The signal is queued and broadcast from idle callback.
  *
  * @param state_ind mode name
  */
@@ -1791,8 +2778,7 @@ void umdbus_send_target_state_signal(const char *state_ind)
      */
     umdbus_send_mode_details_signal(state_ind);
 
-    umdbus_send_signal_ex(USB_MODE_TARGET_STATE_SIGNAL_NAME,
-                          state_ind);
+    umdbus_queue_signal(UMDBUS_SIGNAL_TARGET_STATE, state_ind);
 }
 
 /** Send usb_moded event signal
@@ -1803,6 +2789,10 @@ void umdbus_send_event_signal(const char *state_ind)
 {
     LOG_REGISTER_CONTEXT;
 
+    /* Events are not coalesced, but must not overtake
+     * already queued state signals either */
+    umdbus_flush_signals(true);
+
     umdbus_send_signal_ex(USB_MODE_EVENT_SIGNAL_NAME,
                           state_ind);
     umdbus_send_legacy_signal(state_ind);
@@ -1819,6 +2809,8 @@ int umdbus_send_error_signal(const char *error)
 {
     LOG_REGISTER_CONTEXT;
 
+    umdbus_flush_signals(true);
+
     return umdbus_send_signal_ex(USB_MODE_ERROR_SIGNAL_NAME, error);
 }
 
@@ -1833,7 +2825,7 @@ int umdbus_send_supported_modes_signal(const char *supported_modes)
 {
     LOG_REGISTER_CONTEXT;
 
-    return umdbus_send_signal_ex(USB_MODE_SUPPORTED_MODES_SIGNAL_NAME, supported_modes);
+    return umdbus_queue_signal(UMDBUS_SIGNAL_SUPPORTED_MODES, supported_modes) ? 0 : 1;
 }
 
 /**
@@ -1847,7 +2839,7 @@ int umdbus_send_available_modes_signal(const char *available_modes)
 {
     LOG_REGISTER_CONTEXT;
 
-    return umdbus_send_signal_ex(USB_MODE_AVAILABLE_MODES_SIGNAL_NAME, available_modes);
+    return umdbus_queue_signal(UMDBUS_SIGNAL_AVAILABLE_MODES, available_modes) ? 0 : 1;
 }
 
 /**
@@ -1861,7 +2853,7 @@ int umdbus_send_hidden_modes_signal(const char *hidden_modes)
 {
     LOG_REGISTER_CONTEXT;
 
-    return umdbus_send_signal_ex(USB_MODE_HIDDEN_MODES_SIGNAL_NAME, hidden_modes);
+    return umdbus_queue_signal(UMDBUS_SIGNAL_HIDDEN_MODES, hidden_modes) ? 0 : 1;
 }
 
 /**
@@ -1874,7 +2866,394 @@ int umdbus_send_whitelisted_modes_signal(const char *whitelist)
 {
     LOG_REGISTER_CONTEXT;
 
-    return umdbus_send_signal_ex(USB_MODE_WHITELISTED_MODES_SIGNAL_NAME, whitelist);
+    return umdbus_queue_signal(UMDBUS_SIGNAL_WHITELISTED_MODES, whitelist) ? 0 : 1;
+}
+
+/* ------------------------------------------------------------------------- *
+ * SIGNAL_QUEUE
+ * ------------------------------------------------------------------------- */
+
+/** Coalescing state for signals that carry state rather than events
+ *
+ * NOTE: Queued signals are broadcast in array order, which matches the
+ *       order in which they are emitted during mode transitions.
+ */
+static umdbus_signal_slot_t umdbus_signal_slots[UMDBUS_SIGNAL_NUMOF] =
+{
+    [UMDBUS_SIGNAL_TARGET_CONFIG] = {
+        .name    = USB_MODE_TARGET_CONFIG_SIGNAL_NAME,
+        .details = true,
+    },
+    [UMDBUS_SIGNAL_TARGET_STATE] = {
+        .name    = USB_MODE_TARGET_STATE_SIGNAL_NAME,
+        .dedup   = true,
+    },
+    [UMDBUS_SIGNAL_CURRENT_STATE] = {
+        .name    = USB_MODE_CURRENT_STATE_SIGNAL_NAME,
+        .dedup   = true,
+    },
+    [UMDBUS_SIGNAL_LEGACY] = {
+        .name    = USB_MODE_SIGNAL_NAME,
+        .dedup   = true,
+    },
+    [UMDBUS_SIGNAL_SUPPORTED_MODES] = {
+        .name    = USB_MODE_SUPPORTED_MODES_SIGNAL_NAME,
+        .dedup   = true,
+        .rate_ms = UMDBUS_SIGNAL_LIST_RATE_MS,
+    },
+    [UMDBUS_SIGNAL_AVAILABLE_MODES] = {
+        .name    = USB_MODE_AVAILABLE_MODES_SIGNAL_NAME,
+        .dedup   = true,
+        .rate_ms = UMDBUS_SIGNAL_LIST_RATE_MS,
+    },
+    [UMDBUS_SIGNAL_HIDDEN_MODES] = {
+        .name    = USB_MODE_HIDDEN_MODES_SIGNAL_NAME,
+        .dedup   = true,
+        .rate_ms = UMDBUS_SIGNAL_LIST_RATE_MS,
+    },
+    [UMDBUS_SIGNAL_WHITELISTED_MODES] = {
+        .name    = USB_MODE_WHITELISTED_MODES_SIGNAL_NAME,
+        .dedup   = true,
+        .rate_ms = UMDBUS_SIGNAL_LIST_RATE_MS,
+    },
+};
+
+/** Idle / timer callback id for flushing queued signals */
+static guint umdbus_signal_flush_id = 0;
+
+/** Flag for: #umdbus_signal_flush_id is a rate limit timer */
+static bool  umdbus_signal_flush_delayed = false;
+
+/** Get monotonic timestamp in milliseconds
+ */
+static int64_t
+umdbus_signal_now(void)
+{
+    return g_get_monotonic_time() / 1000;
+}
+
+/** Update last broadcast value of a signal
+ *
+ * For use when signal is sent without using the queue.
+ *
+ * @param id     Signal slot
+ * @param value  Value that was sent
+ */
+static void
+umdbus_signal_slot_sent(umdbus_signal_t id, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    UMDBUS_SIGNAL_LOCKED_ENTER;
+
+    umdbus_signal_slot_t *slot = &umdbus_signal_slots[id];
+    g_free(slot->sent), slot->sent = g_strdup(value ?: "");
+    slot->sent_at = umdbus_signal_now();
+
+    UMDBUS_SIGNAL_LOCKED_LEAVE;
+}
+
+/** Release queued signal data
+ *
+ * @param slot  Signal slot
+ */
+static void
+umdbus_signal_slot_clear_pending(umdbus_signal_slot_t *slot)
+{
+    if( slot->pending_msg )
+        dbus_message_unref(slot->pending_msg),
+            slot->pending_msg = 0;
+    g_free(slot->pending), slot->pending = 0;
+}
+
+/** Broadcast queued signal
+ *
+ * Must be called while holding #umdbus_signal_mutex.
+ *
+ * @param slot  Signal slot
+ */
+static void
+umdbus_signal_slot_send_locked(umdbus_signal_slot_t *slot)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !slot->pending_msg )
+        goto EXIT;
+
+    log_debug("broadcast signal %s(%s)", slot->name, slot->pending);
+    trace_count(TRACE_COUNTER_DBUS_SEND);
+
+    if( !umdbus_connection ||
+        !dbus_connection_send(umdbus_connection, slot->pending_msg, 0) )
+        log_err("sending signal %s failed", slot->name);
+
+    g_free(slot->sent), slot->sent = slot->pending, slot->pending = 0;
+    slot->sent_at = umdbus_signal_now();
+
+EXIT:
+    umdbus_signal_slot_clear_pending(slot);
+}
+
+/** Idle / timer callback for broadcasting queued signals
+ *
+ * @param aptr (unused)
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean
+umdbus_signal_flush_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    umdbus_signal_flush_id = 0;
+    umdbus_signal_flush_delayed = false;
+
+    int wait_ms = umdbus_flush_signals(false);
+    if( wait_ms >= 0 && !umdbus_signal_flush_id ) {
+        umdbus_signal_flush_id = g_timeout_add(wait_ms,
+                                               umdbus_signal_flush_cb, 0);
+        umdbus_signal_flush_delayed = true;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/** Schedule broadcasting of queued signals
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param delayed  true if all queued signals are rate limited
+ */
+static void
+umdbus_signal_schedule_flush(bool delayed)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umdbus_signal_flush_id ) {
+        if( delayed || !umdbus_signal_flush_delayed )
+            goto EXIT;
+        g_source_remove(umdbus_signal_flush_id),
+            umdbus_signal_flush_id = 0;
+    }
+
+    umdbus_signal_flush_id = g_idle_add(umdbus_signal_flush_cb, 0);
+    umdbus_signal_flush_delayed = false;
+
+EXIT:
+    return;
+}
+
+/** Queue state signal for broadcasting
+ *
+ * Repeated values of the same signal are coalesced so that only the
+ * latest one gets broadcast, and values equal to the previously
+ * broadcast one are dropped altogether.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param id     Signal slot
+ * @param value  Signal argument / mode name for details signal
+ *
+ * @return true on success, false on failure
+ */
+static bool
+umdbus_queue_signal(umdbus_signal_t id, const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool         ack = false;
+    bool         rate_limited = false;
+    DBusMessage *msg = 0;
+
+    if( !value )
+        value = "";
+
+    UMDBUS_SIGNAL_LOCKED_ENTER;
+
+    umdbus_signal_slot_t *slot = &umdbus_signal_slots[id];
+
+    if( slot->dedup && !g_strcmp0(slot->sent, value) ) {
+        /* Back to already broadcast value -> no need to send */
+        umdbus_signal_slot_clear_pending(slot);
+        ack = true;
+        goto LEAVE;
+    }
+
+    /* Construct the message already here, so that contents reflect
+     * the state at the time of the request and flushing can be done
+     * also from the worker thread. */
+    if( slot->details ) {
+        if( (msg = umdbus_new_signal(slot->name)) &&
+            !umdbus_append_mode_details(msg, value) )
+            dbus_message_unref(msg), msg = 0;
+    }
+    else {
+        msg = umdbus_new_string_signal(slot->name, value);
+    }
+
+    if( !msg )
+        goto LEAVE;
+
+    umdbus_signal_slot_clear_pending(slot);
+    slot->pending     = g_strdup(value);
+    slot->pending_msg = msg;
+    rate_limited      = slot->rate_ms > 0;
+    ack = true;
+
+LEAVE:
+    UMDBUS_SIGNAL_LOCKED_LEAVE;
+
+    if( msg )
+        umdbus_signal_schedule_flush(rate_limited);
+
+    return ack;
+}
+
+/** Broadcast PropertiesChanged for properties tracking sent signals
+ *
+ * Only changed values are included. Values that can't be constructed
+ * outside the main thread, or that differ between users, are listed
+ * as invalidated instead.
+ *
+ * Must be called while holding #umdbus_signal_mutex.
+ *
+ * @param sent  Array of UMDBUS_SIGNAL_NUMOF flags for signals just sent
+ */
+static void
+umdbus_send_properties_changed_locked(const bool *sent)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage     *msg       = 0;
+    const char      *interface = USB_MODE_INTERFACE;
+    bool             ack       = false;
+    DBusMessageIter  body, dict, list;
+
+    if( !umdbus_connection )
+        goto EXIT;
+
+    msg = dbus_message_new_signal(USB_MODE_OBJECT,
+                                  DBUS_INTERFACE_PROPERTIES,
+                                  "PropertiesChanged");
+    if( !msg || !umdbus_append_init(&body, msg) ||
+        !umdbus_append_string(&body, interface) )
+        goto EXIT;
+
+    if( !umdbus_open_container(&body, &dict, DBUS_TYPE_ARRAY,
+                               DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                               DBUS_TYPE_STRING_AS_STRING
+                               DBUS_TYPE_VARIANT_AS_STRING
+                               DBUS_DICT_ENTRY_END_CHAR_AS_STRING) )
+        goto EXIT;
+    ack = true;
+    for( const property_info_t *prop = usb_moded_properties; ack && prop->name; ++prop ) {
+        if( prop->signal == UMDBUS_SIGNAL_NUMOF || !sent[prop->signal] )
+            continue;
+        if( prop->details || prop->per_user )
+            continue;
+        const char *value = umdbus_signal_slots[prop->signal].sent ?: "";
+        if( prop->signal == UMDBUS_SIGNAL_CURRENT_STATE )
+            value = usb_moded_exposed_mode(value);
+        DBusMessageIter entry;
+        if( !(ack = umdbus_open_container(&dict, &entry, DBUS_TYPE_DICT_ENTRY, 0)) )
+            break;
+        ack = (umdbus_append_string(&entry, prop->name) &&
+               umdbus_append_string_variant(&entry, value));
+        ack = umdbus_close_container(&dict, &entry, ack);
+    }
+    if( !umdbus_close_container(&body, &dict, ack) || !ack )
+        goto EXIT;
+
+    if( !umdbus_open_container(&body, &list, DBUS_TYPE_ARRAY,
+                               DBUS_TYPE_STRING_AS_STRING) )
+        goto EXIT;
+    for( const property_info_t *prop = usb_moded_properties; ack && prop->name; ++prop ) {
+        if( prop->signal == UMDBUS_SIGNAL_NUMOF || !sent[prop->signal] )
+            continue;
+        if( prop->details || prop->per_user )
+            ack = umdbus_append_string(&list, prop->name);
+    }
+    if( !umdbus_close_container(&body, &list, ack) || !ack )
+        goto EXIT;
+
+    trace_count(TRACE_COUNTER_DBUS_SEND);
+    if( !dbus_connection_send(umdbus_connection, msg, 0) )
+        log_err("sending signal PropertiesChanged failed");
+
+EXIT:
+    if( msg )
+        dbus_message_unref(msg);
+}
+
+/** Broadcast queued signals
+ *
+ * @param force  true to ignore rate limits
+ *
+ * @return milliseconds until rate limited signals can be sent,
+ *         or -1 if there are no signals left in the queue
+ */
+static int
+umdbus_flush_signals(bool force)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int     wait_ms = -1;
+    int64_t now     = umdbus_signal_now();
+    bool    sent[UMDBUS_SIGNAL_NUMOF] = { };
+    bool    any     = false;
+
+    UMDBUS_SIGNAL_LOCKED_ENTER;
+
+    for( size_t i = 0; i < G_N_ELEMENTS(umdbus_signal_slots); ++i ) {
+        umdbus_signal_slot_t *slot = &umdbus_signal_slots[i];
+
+        if( !slot->pending_msg )
+            continue;
+
+        if( !force && slot->rate_ms > 0 && slot->sent_at ) {
+            int64_t left = slot->sent_at + slot->rate_ms - now;
+            if( left > 0 ) {
+                if( wait_ms < 0 || wait_ms > left )
+                    wait_ms = (int)left;
+                continue;
+            }
+        }
+
+        umdbus_signal_slot_send_locked(slot);
+        sent[i] = any = true;
+    }
+
+    if( any )
+        umdbus_send_properties_changed_locked(sent);
+
+    UMDBUS_SIGNAL_LOCKED_LEAVE;
+
+    return wait_ms;
+}
+
+/** Broadcast queued signals and release signal queue resources
+ */
+static void
+umdbus_signal_queue_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( umdbus_signal_flush_id )
+        g_source_remove(umdbus_signal_flush_id),
+            umdbus_signal_flush_id = 0;
+
+    umdbus_flush_signals(true);
+
+    UMDBUS_SIGNAL_LOCKED_ENTER;
+    for( size_t i = 0; i < G_N_ELEMENTS(umdbus_signal_slots); ++i ) {
+        umdbus_signal_slot_t *slot = &umdbus_signal_slots[i];
+        umdbus_signal_slot_clear_pending(slot);
+        g_free(slot->sent), slot->sent = 0;
+        slot->sent_at = 0;
+    }
+    UMDBUS_SIGNAL_LOCKED_LEAVE;
 }
 
 /** Async reply handler for umdbus_get_name_owner_async()
@@ -1982,32 +3361,322 @@ EXIT:
     return ack;
 }
 
-/**
- * Get uid of sender from D-Bus. This makes a synchronous D-Bus call
+/* ------------------------------------------------------------------------- *
+ * SENDER_UID
+ * ------------------------------------------------------------------------- */
+
+/** Start / stop tracking disconnect of a D-Bus client
+ *
+ * Match rules are added / removed without waiting for replies.
+ *
+ * @param name    Unique bus name of client
+ * @param enable  true to start tracking, or false to stop
+ */
+static void
+umdbus_sender_uid_track(const char *name, bool enable)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *match = 0;
+
+    if( !umdbus_connection )
+        goto EXIT;
+
+    if( !dbus_connection_get_is_connected(umdbus_connection) )
+        goto EXIT;
+
+    match = g_strdup_printf(SENDER_GONE_MATCH_FMT, name);
+
+    if( enable )
+        dbus_bus_add_match(umdbus_connection, match, 0);
+    else
+        dbus_bus_remove_match(umdbus_connection, match, 0);
+
+EXIT:
+    g_free(match);
+}
+
+/** Lookup sender uid from cache
+ *
+ * @param name  Unique bus name of client
+ * @param puid  Where to store uid
+ *
+ * @return true if uid was cached, false otherwise
+ */
+static bool
+umdbus_sender_uid_cache_lookup(const char *name, uid_t *puid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool     ack = false;
+    gpointer val = 0;
+
+    if( !umdbus_sender_uid_cache || !name )
+        goto EXIT;
+
+    if( !g_hash_table_lookup_extended(umdbus_sender_uid_cache, name, 0, &val) )
+        goto EXIT;
+
+    *puid = (uid_t)GPOINTER_TO_UINT(val);
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Store sender uid to cache
+ *
+ * Bus names are not reused, so cached uid remains valid until the
+ * client disconnects from bus - which is tracked via NameOwnerChanged.
+ *
+ * @param name  Unique bus name of client
+ * @param uid   Uid of client
+ */
+static void
+umdbus_sender_uid_cache_store(const char *name, uid_t uid)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !name || *name != ':' )
+        goto EXIT;
+
+    if( !umdbus_sender_uid_cache )
+        umdbus_sender_uid_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                        g_free, 0);
+
+    if( g_hash_table_contains(umdbus_sender_uid_cache, name) ) {
+        g_hash_table_insert(umdbus_sender_uid_cache, g_strdup(name),
+                            GUINT_TO_POINTER(uid));
+        goto EXIT;
+    }
+
+    /* Keep the cache bounded even if disconnect tracking
+     * would fail for some reason */
+    if( g_hash_table_size(umdbus_sender_uid_cache) >= SENDER_UID_CACHE_MAX )
+        umdbus_sender_uid_cache_flush();
+
+    log_debug("cache uid %d for %s", (int)uid, name);
+    g_hash_table_insert(umdbus_sender_uid_cache, g_strdup(name),
+                        GUINT_TO_POINTER(uid));
+    umdbus_sender_uid_track(name, true);
+
+EXIT:
+    return;
+}
+
+/** Remove sender uid from cache
+ *
+ * @param name  Unique bus name of client
+ */
+static void
+umdbus_sender_uid_cache_forget(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !umdbus_sender_uid_cache || !name )
+        goto EXIT;
+
+    if( !g_hash_table_remove(umdbus_sender_uid_cache, name) )
+        goto EXIT;
+
+    log_debug("forget uid of %s", name);
+    umdbus_sender_uid_track(name, false);
+
+EXIT:
+    return;
+}
+
+/** Remove all entries from sender uid cache
+ */
+static void
+umdbus_sender_uid_cache_flush(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTableIter iter;
+    gpointer       key;
+
+    if( !umdbus_sender_uid_cache )
+        goto EXIT;
+
+    g_hash_table_iter_init(&iter, umdbus_sender_uid_cache);
+    while( g_hash_table_iter_next(&iter, &key, 0) ) {
+        umdbus_sender_uid_track(key, false);
+        g_hash_table_iter_remove(&iter);
+    }
+
+EXIT:
+    return;
+}
+
+/** Handle NameOwnerChanged signals for clients with cached uid
+ *
+ * @param sig  NameOwnerChanged signal message
+ */
+static void
+umdbus_handle_name_owner_changed(DBusMessage *sig)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *sender = dbus_message_get_sender(sig);
+    const char *name   = 0;
+    const char *prev   = 0;
+    const char *curr   = 0;
+    DBusError   err    = DBUS_ERROR_INIT;
+
+    /* Only the bus daemon is allowed to signal owner changes */
+    if( !sender || strcmp(sender, DBUS_SERVICE_DBUS) )
+        goto EXIT;
+
+    if( !dbus_message_get_args(sig, &err,
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_STRING, &prev,
+                               DBUS_TYPE_STRING, &curr,
+                               DBUS_TYPE_INVALID) ) {
+        log_err("parse error: %s: %s", err.name, err.message);
+        goto EXIT;
+    }
+
+    if( !*curr )
+        umdbus_sender_uid_cache_forget(name);
+
+EXIT:
+    dbus_error_free(&err);
+}
+
+/** Parse uid from GetConnectionCredentials reply
+ *
+ * @param rsp  Reply message
  *
- * @param name   Name of sender from DBusMessage
  * @return Uid of the sender or UID_UNKNOWN if it can not be determined
  */
 static uid_t
-umdbus_get_sender_uid(const char *name)
+umdbus_parse_sender_credentials(DBusMessage *rsp)
 {
     LOG_REGISTER_CONTEXT;
 
-    pid_t        pid = PID_UNKNOWN;
-    uid_t        uid = UID_UNKNOWN;
-    DBusMessage *req = 0;
-    DBusMessage *rsp = 0;
-    DBusError    err = DBUS_ERROR_INIT;
-    char         path[256];
-    struct stat  st;
+    uid_t           uid = UID_UNKNOWN;
+    DBusError       err = DBUS_ERROR_INIT;
+    DBusMessageIter body, array, entry, value;
 
-    if(!umdbus_connection)
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_err("error reply: %s: %s", err.name, err.message);
+        goto EXIT;
+    }
+
+    if( !umdbus_parser_init(&body, rsp) )
         goto EXIT;
 
-    req = dbus_message_new_method_call(DBUS_INTERFACE_DBUS,
+    if( !umdbus_parser_get_array(&body, &array) )
+        goto EXIT;
+
+    while( !umdbus_parser_at_end(&array) ) {
+        const char    *key = 0;
+        dbus_uint32_t  val = 0;
+
+        if( !umdbus_parser_get_entry(&array, &entry) )
+            goto EXIT;
+
+        if( !umdbus_parser_get_string(&entry, &key) )
+            goto EXIT;
+
+        if( strcmp(key, DBUS_CREDENTIALS_UID_KEY) )
+            continue;
+
+        if( !umdbus_parser_get_variant(&entry, &value) )
+            goto EXIT;
+
+        if( !umdbus_parser_require_type(&value, DBUS_TYPE_UINT32, true) )
+            goto EXIT;
+
+        dbus_message_iter_get_basic(&value, &val);
+        uid = (uid_t)val;
+        break;
+    }
+
+EXIT:
+    dbus_error_free(&err);
+
+    return uid;
+}
+
+/** Handle reply to async sender uid query
+ *
+ * Caches the uid, calls the method handler that was waiting for
+ * it and sends the deferred reply.
+ *
+ * @param pc    Pending call object
+ * @param aptr  Method call message (as void pointer)
+ */
+static void
+umdbus_query_sender_uid_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage      *msg     = aptr;
+    DBusMessage      *rsp     = 0;
+    umdbus_context_t  context = { .msg = msg, };
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) ) {
+        log_err("did not get reply");
+        context.uid = UID_UNKNOWN;
+    }
+    else {
+        context.uid = umdbus_parse_sender_credentials(rsp);
+    }
+
+    if( !umdbus_connection )
+        goto EXIT;
+
+    context.type      = dbus_message_get_type(msg);
+    context.sender    = dbus_message_get_sender(msg);
+    context.object    = dbus_message_get_path(msg);
+    context.interface = dbus_message_get_interface(msg);
+    context.member    = dbus_message_get_member(msg);
+
+    if( context.uid != UID_UNKNOWN )
+        umdbus_sender_uid_cache_store(context.sender, context.uid);
+
+    context.object_info    = umdbus_get_object_info(context.object);
+    context.interface_info = object_info_get_interface(context.object_info,
+                                                       context.interface);
+    context.member_info    = interface_info_get_member(context.interface_info,
+                                                       context.member);
+
+    umdbus_dispatch_method(&context);
+    umdbus_send_method_reply(umdbus_connection, &context);
+
+EXIT:
+    if( rsp )
+        dbus_message_unref(rsp);
+}
+
+/** Start async sender uid query for a method call
+ *
+ * The method call message is kept alive until the query finishes
+ * and the deferred method call handling is done.
+ *
+ * @param msg  Method call message
+ *
+ * @return true if query was sent, false otherwise
+ */
+static bool
+umdbus_query_sender_uid_async(DBusMessage *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool             ack  = false;
+    DBusMessage     *req  = 0;
+    DBusPendingCall *pc   = 0;
+    const char      *name = dbus_message_get_sender(msg);
+
+    if( !umdbus_connection || !name )
+        goto EXIT;
+
+    req = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
                                        DBUS_PATH_DBUS,
                                        DBUS_INTERFACE_DBUS,
-                                       DBUS_GET_CONNECTION_PID_REQ);
+                                       DBUS_GET_CONNECTION_CREDENTIALS_REQ);
     if( !req ) {
         log_err("could not create method call message");
         goto EXIT;
@@ -2020,35 +3689,26 @@ umdbus_get_sender_uid(const char *name)
         goto EXIT;
     }
 
-    /* Synchronous D-Bus call */
-    rsp = dbus_connection_send_with_reply_and_block(umdbus_connection, req, -1, &err);
+    if( !dbus_connection_send_with_reply(umdbus_connection, req, &pc, -1) )
+        goto EXIT;
 
-    if( !rsp && dbus_error_is_set(&err) ) {
-        log_err("could not get sender pid for %s: %s: %s", name, err.name, err.message);
+    if( !pc )
         goto EXIT;
-    }
 
-    if( !dbus_message_get_args(rsp, &err,
-                               DBUS_TYPE_UINT32, &pid,
-                               DBUS_TYPE_INVALID) ) {
-        log_err("parse error: %s: %s", err.name, err.message);
+    if( !dbus_pending_call_set_notify(pc, umdbus_query_sender_uid_cb,
+                                      dbus_message_ref(msg),
+                                      (DBusFreeFunction)dbus_message_unref) ) {
+        dbus_message_unref(msg);
         goto EXIT;
     }
 
-    snprintf(path, sizeof path, "/proc/%d", (int)pid);
-    memset(&st, 0, sizeof st);
-    if( stat(path, &st) != -1 ) {
-        uid = st.st_uid;
-    }
+    ack = true;
 
 EXIT:
-
+    if( pc  ) dbus_pending_call_unref(pc);
     if( req ) dbus_message_unref(req);
-    if( rsp ) dbus_message_unref(rsp);
-
-    dbus_error_free(&err);
 
-    return uid;
+    return ack;
 }
 
 const char *
@@ -2353,7 +4013,7 @@ umdbus_append_basic_variant(DBusMessageIter *iter, int type, const DBusBasicValu
     DBusMessageIter var;
 
     if( umdbus_open_container(iter, &var, DBUS_TYPE_VARIANT, sign) ) {
-        ack = umdbus_append_basic_value(&var, DBUS_TYPE_BOOLEAN, val);
+        ack = umdbus_append_basic_value(&var, type, val);
         ack = umdbus_close_container(iter, &var, ack);
     }
 
@@ -2489,6 +4149,7 @@ umdbus_blocking_call(DBusConnection *con,
     if( !umdbus_append_args_va(&body, arg_type, va) )
         goto EXIT;
 
+    trace_count(TRACE_COUNTER_DBUS_CALL);
     if( !(rsp = dbus_connection_send_with_reply_and_block(con, req, -1, err)) ) {
         log_warning("no reply to %s.%s(): %s: %s",
                     iface, meth, err->name, err->message);
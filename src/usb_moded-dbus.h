@@ -81,6 +81,25 @@
 # define USB_MODE_AVAILABLE_MODES_FOR_USER   "get_available_modes_for_user" /* returns a comma separated list of modes which are currently available and permitted for user to select */
 # define USB_MODE_TARGET_CONFIG_GET          "get_target_mode_config" /* returns current target mode configuration */
 # define USB_MODE_USER_CONFIG_CLEAR          "clear_config" /* clear config for a user */
+# define USB_MODE_SWITCH_STATS_GET           "get_switch_stats" /* returns mode switch latency and resource usage statistics, recent traces, cable debounce and mainloop dispatch stats */
+# define USB_MODE_MAC_REGENERATE             "regenerate_mac" /* replace persistent usb ethernet address with a random one, returns the new address */
+# define USB_MODE_GADGET_FUNCTIONS_SET       "set_gadget_functions" /* change functions exposed via an additional configfs gadget, empty function list unbinds it */
+
+/**
+ * Read only properties of USB_MODE_INTERFACE
+ *
+ * Use org.freedesktop.DBus.Properties.GetAll to fetch the full state in
+ * one round trip, and PropertiesChanged to track changes.
+ **/
+# define USB_MODE_PROPERTY_CURRENT_STATE            "current_state"            /* as returned by "mode_request" */
+# define USB_MODE_PROPERTY_TARGET_STATE             "target_state"             /* as returned by "get_target_state" */
+# define USB_MODE_PROPERTY_TARGET_CONFIG            "target_config"            /* as returned by "get_target_mode_config" */
+# define USB_MODE_PROPERTY_CONFIG                   "config"                   /* as returned by "get_config" */
+# define USB_MODE_PROPERTY_SUPPORTED_MODES          "supported_modes"          /* as returned by "get_modes" */
+# define USB_MODE_PROPERTY_AVAILABLE_MODES          "available_modes"          /* as returned by "get_available_modes" */
+# define USB_MODE_PROPERTY_AVAILABLE_MODES_FOR_USER "available_modes_for_user" /* as returned by "get_available_modes_for_user" */
+# define USB_MODE_PROPERTY_HIDDEN_MODES             "hidden_modes"             /* as returned by "get_hidden" */
+# define USB_MODE_PROPERTY_WHITELISTED_MODES        "whitelisted_modes"        /* as returned by "get_whitelisted_modes" */
 
 /**
  * (Transient) states reported by "sig_usb_state_ind" that are not modes.
@@ -0,0 +1,737 @@
+/**
+ * @file usb_moded-dhcpd.c
+ *
+ * Embedded DHCPv4 server for usb network modes.
+ *
+ * Minimal server that hands out addresses from the same pool that
+ * would be written to udhcpd.conf. It is bound to the gadget network
+ * interface and driven from the main loop, so that the host gets its
+ * address without waiting for an external daemon to be started.
+ *
+ * Address, netmask, lease time and dns / router options follow the
+ * udhcpd configuration generated in usb_moded-network.c.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-dhcpd.h"
+
+#include "usb_moded-log.h"
+
+#include <sys/socket.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+
+#include <pthread.h> // NOTRIM
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+#define DHCPD_SERVER_PORT     67
+#define DHCPD_CLIENT_PORT     68
+
+/** First host number in the address pool, as in udhcpd.conf */
+#define DHCPD_POOL_FIRST      1
+
+/** Number of addresses in the pool, as in udhcpd.conf */
+#define DHCPD_POOL_SIZE       15
+
+/** Lease time offered to clients [s] */
+#define DHCPD_LEASE_TIME_S    3600
+
+/** How long an offered address is reserved for the client [s] */
+#define DHCPD_OFFER_TIME_S    30
+
+#define DHCPD_BOOTREQUEST     1
+#define DHCPD_BOOTREPLY       2
+
+#define DHCPD_MAGIC_COOKIE    0x63825363
+
+/** Minimum size of BOOTP message */
+#define DHCPD_MIN_PACKET      300
+
+/* DHCP options used */
+#define DHCPD_OPT_PAD         0
+#define DHCPD_OPT_SUBNET      1
+#define DHCPD_OPT_ROUTER      3
+#define DHCPD_OPT_DNS         6
+#define DHCPD_OPT_REQUESTED   50
+#define DHCPD_OPT_LEASE_TIME  51
+#define DHCPD_OPT_MSG_TYPE    53
+#define DHCPD_OPT_SERVER_ID   54
+#define DHCPD_OPT_END         255
+
+/* DHCP message types */
+#define DHCPD_DISCOVER        1
+#define DHCPD_OFFER           2
+#define DHCPD_REQUEST         3
+#define DHCPD_DECLINE         4
+#define DHCPD_ACK             5
+#define DHCPD_NAK             6
+#define DHCPD_RELEASE         7
+#define DHCPD_INFORM          8
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** BOOTP / DHCP message */
+typedef struct dhcpd_packet_t
+{
+    uint8_t  op;
+    uint8_t  htype;
+    uint8_t  hlen;
+    uint8_t  hops;
+    uint32_t xid;
+    uint16_t secs;
+    uint16_t flags;
+    uint32_t ciaddr;
+    uint32_t yiaddr;
+    uint32_t siaddr;
+    uint32_t giaddr;
+    uint8_t  chaddr[16];
+    uint8_t  sname[64];
+    uint8_t  file[128];
+    uint32_t cookie;
+    uint8_t  options[312];
+} __attribute__((packed)) dhcpd_packet_t;
+
+/** Address pool entry */
+typedef struct dhcpd_lease_t
+{
+    /** Hardware address of client, all zeros if not in use */
+    uint8_t dl_chaddr[16];
+
+    /** Monotonic expiry time [s] */
+    gint64  dl_expires;
+} dhcpd_lease_t;
+
+/** Options parsed from client message */
+typedef struct dhcpd_request_t
+{
+    /** DHCP message type, or zero for plain BOOTP */
+    int      dr_type;
+
+    /** Requested address, or INADDR_ANY */
+    uint32_t dr_requested;
+
+    /** Server identifier, or INADDR_ANY */
+    uint32_t dr_server_id;
+} dhcpd_request_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * DHCPD
+ * ------------------------------------------------------------------------- */
+
+static gint64          dhcpd_now           (void);
+static uint32_t        dhcpd_pool_address  (int slot);
+static int             dhcpd_pool_slot     (uint32_t address);
+static bool            dhcpd_slot_is_free  (int slot, const uint8_t *chaddr);
+static int             dhcpd_lookup_lease  (const uint8_t *chaddr);
+static int             dhcpd_select_lease  (const uint8_t *chaddr, uint32_t requested);
+static void            dhcpd_release_lease (const uint8_t *chaddr);
+static bool            dhcpd_parse_options (const dhcpd_packet_t *pkt, size_t len, dhcpd_request_t *req);
+static uint8_t        *dhcpd_add_option    (uint8_t *pos, const uint8_t *end, int code, const void *data, size_t size);
+static void            dhcpd_send_reply    (const dhcpd_packet_t *pkt, int type, uint32_t yiaddr);
+static void            dhcpd_handle_packet (const dhcpd_packet_t *pkt, size_t len);
+static gboolean        dhcpd_io_cb         (GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static void            dhcpd_stop_locked   (void);
+bool                   dhcpd_start         (const char *interface, const char *address, const char *netmask, const char *dns1, const char *dns2, bool router);
+void                   dhcpd_stop          (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Server socket, or -1 when not running */
+static int           dhcpd_fd        = -1;
+
+/** I/O watch for dhcpd_fd */
+static guint         dhcpd_watch_id  = 0;
+
+/** Server address, in network byte order */
+static uint32_t      dhcpd_address   = INADDR_ANY;
+
+/** Subnet mask, in network byte order */
+static uint32_t      dhcpd_netmask   = INADDR_ANY;
+
+/** DNS servers to advertise, in network byte order */
+static uint32_t      dhcpd_dns[2];
+
+/** Number of valid entries in dhcpd_dns */
+static size_t        dhcpd_dns_count = 0;
+
+/** Flag for: advertise server address as default router */
+static bool          dhcpd_router    = false;
+
+/** Address pool */
+static dhcpd_lease_t dhcpd_lease[DHCPD_POOL_SIZE];
+
+/** Start / stop happens in worker thread, packets are handled in main thread */
+static pthread_mutex_t dhcpd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define DHCPD_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&dhcpd_mutex) != 0 ) { \
+        log_crit("DHCPD LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define DHCPD_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&dhcpd_mutex) != 0 ) { \
+        log_crit("DHCPD UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/* ========================================================================= *
+ * DHCPD
+ * ========================================================================= */
+
+/** Get monotonic time [s]
+ */
+static gint64
+dhcpd_now(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_get_monotonic_time() / G_USEC_PER_SEC;
+}
+
+/** Get address associated with pool slot
+ *
+ * @param slot  Pool slot index
+ *
+ * @return address in network byte order
+ */
+static uint32_t
+dhcpd_pool_address(int slot)
+{
+    LOG_REGISTER_CONTEXT;
+
+    uint32_t base = ntohl(dhcpd_address) & 0xffffff00;
+    return htonl(base + DHCPD_POOL_FIRST + slot);
+}
+
+/** Get pool slot associated with address
+ *
+ * @param address  Address in network byte order
+ *
+ * @return pool slot index, or -1 if address is not in the pool
+ */
+static int
+dhcpd_pool_slot(uint32_t address)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( int slot = 0; slot < DHCPD_POOL_SIZE; ++slot ) {
+        if( dhcpd_pool_address(slot) == address )
+            return slot;
+    }
+    return -1;
+}
+
+/** Check if pool slot can be given to a client
+ *
+ * @param slot    Pool slot index
+ * @param chaddr  Client hardware address
+ *
+ * @return true if slot is free or already owned by the client
+ */
+static bool
+dhcpd_slot_is_free(int slot, const uint8_t *chaddr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const uint8_t none[16];
+    const dhcpd_lease_t *lease = &dhcpd_lease[slot];
+
+    if( dhcpd_pool_address(slot) == dhcpd_address )
+        return false;
+
+    if( !memcmp(lease->dl_chaddr, chaddr, sizeof lease->dl_chaddr) )
+        return true;
+
+    return (!memcmp(lease->dl_chaddr, none, sizeof none) ||
+            lease->dl_expires <= dhcpd_now());
+}
+
+/** Find pool slot currently assigned to a client
+ *
+ * @param chaddr  Client hardware address
+ *
+ * @return pool slot index, or -1 if client has no lease
+ */
+static int
+dhcpd_lookup_lease(const uint8_t *chaddr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( int slot = 0; slot < DHCPD_POOL_SIZE; ++slot ) {
+        if( !memcmp(dhcpd_lease[slot].dl_chaddr, chaddr,
+                    sizeof dhcpd_lease[slot].dl_chaddr) )
+            return slot;
+    }
+    return -1;
+}
+
+/** Choose pool slot to offer to a client
+ *
+ * Previous lease of the client is preferred, then the address
+ * the client asked for, then any free address.
+ *
+ * @param chaddr     Client hardware address
+ * @param requested  Requested address, or INADDR_ANY
+ *
+ * @return pool slot index, or -1 if pool is exhausted
+ */
+static int
+dhcpd_select_lease(const uint8_t *chaddr, uint32_t requested)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int slot = dhcpd_lookup_lease(chaddr);
+
+    if( slot != -1 )
+        goto EXIT;
+
+    if( requested != INADDR_ANY ) {
+        slot = dhcpd_pool_slot(requested);
+        if( slot != -1 && dhcpd_slot_is_free(slot, chaddr) )
+            goto EXIT;
+    }
+
+    for( slot = 0; slot < DHCPD_POOL_SIZE; ++slot ) {
+        if( dhcpd_slot_is_free(slot, chaddr) )
+            goto EXIT;
+    }
+    slot = -1;
+
+EXIT:
+    return slot;
+}
+
+/** Release pool slot assigned to a client
+ *
+ * @param chaddr  Client hardware address
+ */
+static void
+dhcpd_release_lease(const uint8_t *chaddr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int slot = dhcpd_lookup_lease(chaddr);
+    if( slot != -1 )
+        memset(&dhcpd_lease[slot], 0, sizeof dhcpd_lease[slot]);
+}
+
+/** Parse options relevant to the server from client message
+ *
+ * @param pkt  Received message
+ * @param len  Length of received message
+ * @param req  Where to store parsed information
+ *
+ * @return true if message could be parsed, false otherwise
+ */
+static bool
+dhcpd_parse_options(const dhcpd_packet_t *pkt, size_t len,
+                    dhcpd_request_t *req)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const uint8_t *pos = pkt->options;
+    const uint8_t *end = (const uint8_t *)pkt + len;
+
+    memset(req, 0, sizeof *req);
+
+    if( len < offsetof(dhcpd_packet_t, options) )
+        return false;
+
+    if( ntohl(pkt->cookie) != DHCPD_MAGIC_COOKIE )
+        return false;
+
+    while( pos < end ) {
+        int code = *pos++;
+        if( code == DHCPD_OPT_PAD )
+            continue;
+        if( code == DHCPD_OPT_END )
+            break;
+        if( pos >= end || pos + 1 + *pos > end )
+            return false;
+
+        int            size = *pos++;
+        const uint8_t *data = pos;
+        pos += size;
+
+        switch( code ) {
+        case DHCPD_OPT_MSG_TYPE:
+            if( size == 1 )
+                req->dr_type = data[0];
+            break;
+        case DHCPD_OPT_REQUESTED:
+            if( size == 4 )
+                memcpy(&req->dr_requested, data, 4);
+            break;
+        case DHCPD_OPT_SERVER_ID:
+            if( size == 4 )
+                memcpy(&req->dr_server_id, data, 4);
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+/** Append option to reply message
+ *
+ * @param pos   Current write position
+ * @param end   End of options buffer
+ * @param code  Option code
+ * @param data  Option data
+ * @param size  Size of option data
+ *
+ * @return updated write position
+ */
+static uint8_t *
+dhcpd_add_option(uint8_t *pos, const uint8_t *end, int code,
+                 const void *data, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Always leave room for the end option */
+    if( pos + 2 + size + 1 > end ) {
+        log_warning("dhcp option %d does not fit", code);
+        return pos;
+    }
+    *pos++ = code;
+    *pos++ = size;
+    memcpy(pos, data, size);
+    return pos + size;
+}
+
+/** Send reply to client
+ *
+ * Replies are always broadcast on the gadget interface, as the
+ * client does not have an address yet and there is no other host
+ * on the link to confuse.
+ *
+ * @param pkt     Message from client
+ * @param type    DHCP message type to send
+ * @param yiaddr  Address given to client, or INADDR_ANY
+ */
+static void
+dhcpd_send_reply(const dhcpd_packet_t *pkt, int type, uint32_t yiaddr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dhcpd_packet_t rsp;
+    memset(&rsp, 0, sizeof rsp);
+
+    rsp.op     = DHCPD_BOOTREPLY;
+    rsp.htype  = pkt->htype;
+    rsp.hlen   = pkt->hlen;
+    rsp.xid    = pkt->xid;
+    rsp.flags  = pkt->flags;
+    rsp.giaddr = pkt->giaddr;
+    rsp.yiaddr = yiaddr;
+    rsp.cookie = htonl(DHCPD_MAGIC_COOKIE);
+    memcpy(rsp.chaddr, pkt->chaddr, sizeof rsp.chaddr);
+    if( type == DHCPD_ACK && yiaddr == INADDR_ANY )
+        rsp.ciaddr = pkt->ciaddr;
+
+    uint8_t       *pos = rsp.options;
+    const uint8_t *end = rsp.options + sizeof rsp.options;
+    uint8_t        msg = type;
+
+    pos = dhcpd_add_option(pos, end, DHCPD_OPT_MSG_TYPE, &msg, 1);
+    pos = dhcpd_add_option(pos, end, DHCPD_OPT_SERVER_ID, &dhcpd_address, 4);
+
+    if( type != DHCPD_NAK ) {
+        if( yiaddr != INADDR_ANY ) {
+            uint32_t lease = htonl(DHCPD_LEASE_TIME_S);
+            pos = dhcpd_add_option(pos, end, DHCPD_OPT_LEASE_TIME, &lease, 4);
+        }
+        pos = dhcpd_add_option(pos, end, DHCPD_OPT_SUBNET, &dhcpd_netmask, 4);
+        if( dhcpd_router )
+            pos = dhcpd_add_option(pos, end, DHCPD_OPT_ROUTER,
+                                   &dhcpd_address, 4);
+        if( dhcpd_dns_count )
+            pos = dhcpd_add_option(pos, end, DHCPD_OPT_DNS, dhcpd_dns,
+                                   dhcpd_dns_count * sizeof *dhcpd_dns);
+    }
+    *pos++ = DHCPD_OPT_END;
+
+    struct sockaddr_in sa = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(DHCPD_CLIENT_PORT),
+        .sin_addr.s_addr = htonl(INADDR_BROADCAST),
+    };
+
+    /* Some clients ignore replies shorter than a BOOTP message */
+    size_t len = pos - (uint8_t *)&rsp;
+    if( len < DHCPD_MIN_PACKET )
+        len = DHCPD_MIN_PACKET;
+    if( sendto(dhcpd_fd, &rsp, len, 0, (struct sockaddr *)&sa, sizeof sa) == -1 )
+        log_warning("dhcp reply: %m");
+}
+
+/** Process message received from client
+ *
+ * @param pkt  Received message
+ * @param len  Length of received message
+ */
+static void
+dhcpd_handle_packet(const dhcpd_packet_t *pkt, size_t len)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dhcpd_request_t req;
+    int             slot = -1;
+    uint32_t        addr = INADDR_ANY;
+
+    if( pkt->op != DHCPD_BOOTREQUEST || pkt->hlen > sizeof pkt->chaddr )
+        goto EXIT;
+
+    if( !dhcpd_parse_options(pkt, len, &req) )
+        goto EXIT;
+
+    switch( req.dr_type ) {
+    case DHCPD_DISCOVER:
+        if( (slot = dhcpd_select_lease(pkt->chaddr, req.dr_requested)) == -1 ) {
+            log_warning("dhcp address pool exhausted");
+            break;
+        }
+        memcpy(dhcpd_lease[slot].dl_chaddr, pkt->chaddr,
+               sizeof dhcpd_lease[slot].dl_chaddr);
+        dhcpd_lease[slot].dl_expires = dhcpd_now() + DHCPD_OFFER_TIME_S;
+        dhcpd_send_reply(pkt, DHCPD_OFFER, dhcpd_pool_address(slot));
+        break;
+
+    case DHCPD_REQUEST:
+        if( req.dr_server_id != INADDR_ANY &&
+            req.dr_server_id != dhcpd_address ) {
+            /* Client chose some other server */
+            dhcpd_release_lease(pkt->chaddr);
+            break;
+        }
+        addr = req.dr_requested ?: pkt->ciaddr;
+        slot = dhcpd_pool_slot(addr);
+        if( slot == -1 || !dhcpd_slot_is_free(slot, pkt->chaddr) ) {
+            dhcpd_send_reply(pkt, DHCPD_NAK, INADDR_ANY);
+            break;
+        }
+        /* Drop possible other lease held by the client */
+        if( dhcpd_lookup_lease(pkt->chaddr) != slot )
+            dhcpd_release_lease(pkt->chaddr);
+        memcpy(dhcpd_lease[slot].dl_chaddr, pkt->chaddr,
+               sizeof dhcpd_lease[slot].dl_chaddr);
+        dhcpd_lease[slot].dl_expires = dhcpd_now() + DHCPD_LEASE_TIME_S;
+        log_debug("dhcp lease %s", inet_ntoa((struct in_addr){ .s_addr = addr }));
+        dhcpd_send_reply(pkt, DHCPD_ACK, addr);
+        break;
+
+    case DHCPD_DECLINE:
+    case DHCPD_RELEASE:
+        dhcpd_release_lease(pkt->chaddr);
+        break;
+
+    case DHCPD_INFORM:
+        dhcpd_send_reply(pkt, DHCPD_ACK, INADDR_ANY);
+        break;
+
+    default:
+        break;
+    }
+
+EXIT:
+    return;
+}
+
+/** I/O watch callback for: dhcp server socket
+ */
+static gboolean
+dhcpd_io_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    gboolean keep_going = FALSE;
+
+    DHCPD_LOCKED_ENTER;
+
+    /* Server might have been stopped while waiting for the lock */
+    if( dhcpd_fd == -1 || dhcpd_fd != g_io_channel_unix_get_fd(chn) )
+        goto EXIT;
+
+    if( cnd & ~G_IO_IN ) {
+        log_err("dhcp socket error");
+        dhcpd_watch_id = 0;
+        dhcpd_stop_locked();
+        goto EXIT;
+    }
+
+    for( ;; ) {
+        dhcpd_packet_t pkt;
+        ssize_t rc = recv(dhcpd_fd, &pkt, sizeof pkt, 0);
+        if( rc == -1 )
+            break;
+        dhcpd_handle_packet(&pkt, rc);
+    }
+    keep_going = TRUE;
+
+EXIT:
+    DHCPD_LOCKED_LEAVE;
+
+    return keep_going;
+}
+
+/** Stop server
+ *
+ * Must be called with dhcpd_mutex held.
+ */
+static void
+dhcpd_stop_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( dhcpd_watch_id )
+        g_source_remove(dhcpd_watch_id), dhcpd_watch_id = 0;
+
+    if( dhcpd_fd != -1 ) {
+        log_debug("dhcp server stopped");
+        close(dhcpd_fd), dhcpd_fd = -1;
+    }
+
+    memset(dhcpd_lease, 0, sizeof dhcpd_lease);
+}
+
+/** Start dhcp server on network interface
+ *
+ * Any previously running server instance is stopped.
+ *
+ * To stop: #dhcpd_stop()
+ *
+ * @param interface  Network interface to serve
+ * @param address    Address of the interface
+ * @param netmask    Network mask
+ * @param dns1       Primary dns server to advertise, or NULL
+ * @param dns2       Secondary dns server to advertise, or NULL
+ * @param router     true to advertise interface address as a router
+ *
+ * @return true if server was started, false otherwise
+ */
+bool
+dhcpd_start(const char *interface, const char *address, const char *netmask,
+            const char *dns1, const char *dns2, bool router)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool        ack = false;
+    GIOChannel *chn = 0;
+    int         one = 1;
+
+    struct sockaddr_in sa = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(DHCPD_SERVER_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+
+    DHCPD_LOCKED_ENTER;
+
+    dhcpd_stop_locked();
+
+    if( inet_pton(AF_INET, address, &dhcpd_address) != 1 ||
+        inet_pton(AF_INET, netmask, &dhcpd_netmask) != 1 ) {
+        log_err("dhcp server: invalid address %s/%s", address, netmask);
+        goto EXIT;
+    }
+
+    dhcpd_dns_count = 0;
+    if( dns1 && inet_pton(AF_INET, dns1, &dhcpd_dns[dhcpd_dns_count]) == 1 )
+        ++dhcpd_dns_count;
+    if( dns2 && g_strcmp0(dns1, dns2) &&
+        inet_pton(AF_INET, dns2, &dhcpd_dns[dhcpd_dns_count]) == 1 )
+        ++dhcpd_dns_count;
+    dhcpd_router = router;
+
+    dhcpd_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if( dhcpd_fd == -1 ) {
+        log_err("dhcp server socket: %m");
+        goto EXIT;
+    }
+
+    if( setsockopt(dhcpd_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1 ||
+        setsockopt(dhcpd_fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof one) == -1 ||
+        setsockopt(dhcpd_fd, SOL_SOCKET, SO_BINDTODEVICE,
+                   interface, strlen(interface) + 1) == -1 ) {
+        log_err("dhcp server %s: setsockopt: %m", interface);
+        goto EXIT;
+    }
+
+    if( bind(dhcpd_fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_err("dhcp server %s: bind: %m", interface);
+        goto EXIT;
+    }
+
+    if( !(chn = g_io_channel_unix_new(dhcpd_fd)) )
+        goto EXIT;
+
+    dhcpd_watch_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                    dhcpd_io_cb, 0);
+    if( !dhcpd_watch_id )
+        goto EXIT;
+
+    log_debug("dhcp server started on %s", interface);
+    ack = true;
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( !ack )
+        dhcpd_stop_locked();
+
+    DHCPD_LOCKED_LEAVE;
+
+    return ack;
+}
+
+/** Stop dhcp server, if running
+ */
+void
+dhcpd_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DHCPD_LOCKED_ENTER;
+    dhcpd_stop_locked();
+    DHCPD_LOCKED_LEAVE;
+}
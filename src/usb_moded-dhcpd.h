@@ -0,0 +1,37 @@
+/**
+ * @file usb_moded-dhcpd.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_DHCPD_H_
+# define USB_MODED_DHCPD_H_
+
+# include <stdbool.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * DHCPD
+ * ------------------------------------------------------------------------- */
+
+bool dhcpd_start(const char *interface, const char *address, const char *netmask, const char *dns1, const char *dns2, bool router);
+void dhcpd_stop (void);
+
+#endif /* USB_MODED_DHCPD_H_ */
@@ -140,6 +140,13 @@ static bool dsme_user_state = false;
 /* Flag for: dsme_state_val is SHUTDOWN | REBOOT */
 static bool dsme_shutdown_state = false;
 
+/* Flag for: dsme_state_val has been received from the running dsme
+ *
+ * Cleared when dsme drops from system bus, in which case the last
+ * known state is used until dsme comes back and reports again.
+ */
+static bool dsme_state_valid = false;
+
 /** Convert dsme state enum value to string
  */
 static const char *
@@ -185,6 +192,8 @@ dsme_state_update(dsme_state_t state)
 {
     LOG_REGISTER_CONTEXT;
 
+    dsme_state_valid = true;
+
     /* Handle state change */
     if( dsme_state_val != state ) {
         log_debug("dsme_state: %s -> %s",
@@ -550,7 +559,12 @@ dsme_dbus_device_state_query_cb(DBusPendingCall *pending, void *aptr)
 
     if( dbus_set_error_from_message(&err, rsp) )
     {
-        log_err("error reply: %s: %s", err.name, err.message);
+        /* Expected if dsme is not up yet when probing at startup */
+        if( !strcmp(err.name, DBUS_ERROR_NAME_HAS_NO_OWNER) ||
+            !strcmp(err.name, DBUS_ERROR_SERVICE_UNKNOWN) )
+            log_debug("error reply: %s: %s", err.name, err.message);
+        else
+            log_err("error reply: %s: %s", err.name, err.message);
         goto EXIT;
     }
 
@@ -601,6 +615,10 @@ dsme_dbus_device_state_query(void)
         goto EXIT;
     }
 
+    /* Query might be made before dsme is known to be running,
+     * it must not lead to dbus daemon trying to activate it */
+    dbus_message_set_auto_start(req, false);
+
     if( !dbus_connection_send_with_reply(dsme_dbus_con, req, &pc, -1) )
         goto EXIT;
 
@@ -685,11 +703,20 @@ dsme_dbus_name_owner_update(const char *owner)
 
         /* Query current state on dsme startup and initiate
          * dsmesock connection for process watchdog activity.
+         *
+         * The state query made at startup can already be in
+         * progress or have been replied to by now.
          */
         if( dsme_dbus_name_owner_val ) {
-            dsme_dbus_device_state_query();
+            if( !dsme_state_valid && !dsme_dbus_device_state_query_pc )
+                dsme_dbus_device_state_query();
             dsme_socket_connect();
         }
+        else {
+            /* Keep using the last known state, but
+             * re-query when dsme gets back */
+            dsme_state_valid = false;
+        }
     }
 }
 
@@ -811,8 +838,11 @@ dsme_dbus_init(void)
     dbus_bus_add_match(dsme_dbus_con, DSME_STATE_CHANGE_MATCH, 0);
     dbus_bus_add_match(dsme_dbus_con, DSME_OWNER_CHANGE_MATCH, 0);
 
-    /* Initiate async dsme name owner query */
+    /* Initiate async dsme name owner query and, in parallel, device
+     * state query so that in the common case of dsme already running
+     * the state is known after one round trip */
     dsme_dbus_name_owner_query();
+    dsme_dbus_device_state_query();
 
     ack = true;
 
@@ -29,9 +29,9 @@
 
 #include "usb_moded-dyn-config.h"
 
+#include "usb_moded-inicache.h"
 #include "usb_moded-log.h"
-
-#include <glob.h>
+#include "usb_moded-trace.h"
 
 /* ========================================================================= *
  * Prototypes
@@ -41,39 +41,38 @@
  * MODEDATA
  * ------------------------------------------------------------------------- */
 
+static void        modedata_delete (modedata_t *self);
+modedata_t        *modedata_ref    (const modedata_t *self);
+void               modedata_unref  (modedata_t *self);
 static void        modedata_free_cb(gpointer self);
 void               modedata_free   (modedata_t *self);
 modedata_t        *modedata_copy   (const modedata_t *that);
+bool               modedata_equal  (const modedata_t *self, const modedata_t *that);
 static gint        modedata_sort_cb(gconstpointer a, gconstpointer b);
-static modedata_t *modedata_load   (const gchar *filename);
+static modedata_t *modedata_load   (const inicache_t *cache, size_t file);
 
 /* ------------------------------------------------------------------------- *
  * MODELIST
  * ------------------------------------------------------------------------- */
 
-void   modelist_free(GList *modelist);
-GList *modelist_load(bool diag);
+void        modelist_free (GList *modelist);
+GList      *modelist_load (bool diag);
+GHashTable *modelist_index(GList *modelist);
+static gint modelist_name_cb(gconstpointer item, gconstpointer name);
+bool        modelist_reuse(GHashTable *index, GList *modelist);
 
 /* ========================================================================= *
  * MODEDATA
  * ========================================================================= */
 
-/** Type agnostice relase modedata_t object callback
+/** Destroy modedata_t object
  *
- * @param self Object pointer, or NULL
- */
-static void
-modedata_free_cb(gpointer self)
-{
-    modedata_free(self);
-}
-
-/** Relase modedata_t object
+ * Only to be called when the last reference has been dropped.
  *
  * @param self Object pointer, or NULL
  */
-void
-modedata_free(modedata_t *self)
+static void
+modedata_delete(modedata_t *self)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -94,6 +93,8 @@ modedata_free(modedata_t *self)
         g_free(self->android_extra_sysfs_value4);
         g_free(self->idProduct);
         g_free(self->idVendorOverride);
+        g_free(self->net_host_addr);
+        g_free(self->net_dev_addr);
 #ifdef CONNMAN
         g_free(self->connman_tethering);
 #endif
@@ -101,7 +102,74 @@ modedata_free(modedata_t *self)
     }
 }
 
+/** Acquire reference to modedata_t object
+ *
+ * Mode data objects are not modified after they have been loaded,
+ * so instead of cloning them, the same object can be shared between
+ * the main and worker threads.
+ *
+ * Caller must release the returned object via #modedata_unref().
+ *
+ * @param self Object pointer, or NULL
+ *
+ * @return Object pointer, or NULL
+ */
+modedata_t *
+modedata_ref(const modedata_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modedata_t *data = (modedata_t *)self;
+
+    if( data )
+        g_atomic_int_inc(&data->refcount);
+
+    return data;
+}
+
+/** Release reference to modedata_t object
+ *
+ * The object is destroyed when the last reference is dropped.
+ *
+ * @param self Object pointer, or NULL
+ */
+void
+modedata_unref(modedata_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self && g_atomic_int_dec_and_test(&self->refcount) )
+        modedata_delete(self);
+}
+
+/** Type agnostice relase modedata_t object callback
+ *
+ * @param self Object pointer, or NULL
+ */
+static void
+modedata_free_cb(gpointer self)
+{
+    modedata_unref(self);
+}
+
+/** Relase modedata_t object
+ *
+ * Equivalent to #modedata_unref().
+ *
+ * @param self Object pointer, or NULL
+ */
+void
+modedata_free(modedata_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modedata_unref(self);
+}
+
 /** Clone modedata_t object
+ *
+ * Note: Mode data objects are immutable, use #modedata_ref()
+ *       unless a private and modifiable copy is really needed.
  *
  * @param that Object pointer, or NULL
  *
@@ -118,6 +186,9 @@ modedata_copy(const modedata_t *that)
     if( !(self = calloc(1, sizeof *self)) )
         goto EXIT;
 
+    trace_count(TRACE_COUNTER_MODEDATA_COPY);
+
+    self->refcount                   = 1;
     self->mode_name                  = g_strdup(that->mode_name);
     self->mode_module                = g_strdup(that->mode_module);
     self->appsync                    = that->appsync;
@@ -139,6 +210,9 @@ modedata_copy(const modedata_t *that)
     self->idVendorOverride           = g_strdup(that->idVendorOverride);
     self->nat                        = that->nat;
     self->dhcp_server                = that->dhcp_server;
+    self->net_qmult                  = that->net_qmult;
+    self->net_host_addr              = g_strdup(that->net_host_addr);
+    self->net_dev_addr               = g_strdup(that->net_dev_addr);
 #ifdef CONNMAN
     self->connman_tethering          = g_strdup(that->connman_tethering);
 #endif
@@ -147,6 +221,53 @@ EXIT:
     return self;
 }
 
+/** Compare modedata_t objects
+ *
+ * @param self  Object pointer
+ * @param that  Object pointer
+ *
+ * @return true if both objects define the same mode, false otherwise
+ */
+bool
+modedata_equal(const modedata_t *self, const modedata_t *that)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self == that )
+        return true;
+
+    if( !self || !that )
+        return false;
+
+    return (!g_strcmp0(self->mode_name, that->mode_name) &&
+            !g_strcmp0(self->mode_module, that->mode_module) &&
+            self->appsync == that->appsync &&
+            self->network == that->network &&
+            self->mass_storage == that->mass_storage &&
+            !g_strcmp0(self->network_interface, that->network_interface) &&
+            !g_strcmp0(self->sysfs_path, that->sysfs_path) &&
+            !g_strcmp0(self->sysfs_value, that->sysfs_value) &&
+            !g_strcmp0(self->sysfs_reset_value, that->sysfs_reset_value) &&
+            !g_strcmp0(self->android_extra_sysfs_path, that->android_extra_sysfs_path) &&
+            !g_strcmp0(self->android_extra_sysfs_value, that->android_extra_sysfs_value) &&
+            !g_strcmp0(self->android_extra_sysfs_path2, that->android_extra_sysfs_path2) &&
+            !g_strcmp0(self->android_extra_sysfs_value2, that->android_extra_sysfs_value2) &&
+            !g_strcmp0(self->android_extra_sysfs_path3, that->android_extra_sysfs_path3) &&
+            !g_strcmp0(self->android_extra_sysfs_value3, that->android_extra_sysfs_value3) &&
+            !g_strcmp0(self->android_extra_sysfs_path4, that->android_extra_sysfs_path4) &&
+            !g_strcmp0(self->android_extra_sysfs_value4, that->android_extra_sysfs_value4) &&
+            !g_strcmp0(self->idProduct, that->idProduct) &&
+            !g_strcmp0(self->idVendorOverride, that->idVendorOverride) &&
+#ifdef CONNMAN
+            !g_strcmp0(self->connman_tethering, that->connman_tethering) &&
+#endif
+            self->nat == that->nat &&
+            self->dhcp_server == that->dhcp_server &&
+            self->net_qmult == that->net_qmult &&
+            !g_strcmp0(self->net_host_addr, that->net_host_addr) &&
+            !g_strcmp0(self->net_dev_addr, that->net_dev_addr));
+}
+
 /** Callback for sorting mode list alphabetically
  *
  * For use with g_list_sort()
@@ -167,22 +288,23 @@ modedata_sort_cb(gconstpointer a, gconstpointer b)
     return g_strcmp0(aa->mode_name, bb->mode_name);
 }
 
-/** Load mode data from file
+/** Load mode data from cached file
  *
- * @param filename  Path to file from which to read
+ * @param cache  Compiled mode configuration cache
+ * @param file   Index of file within the cache
  *
  * @return Mode data object, or NULL
  */
 static modedata_t *
-modedata_load(const gchar *filename)
+modedata_load(const inicache_t *cache, size_t file)
 {
     LOG_REGISTER_CONTEXT;
 
-    modedata_t *self        = NULL;
-    bool        success     = false;
-    GKeyFile   *settingsfile = g_key_file_new();
+    modedata_t *self     = NULL;
+    bool        success  = false;
+    const char *filename = inicache_path(cache, file);
 
-    if( !g_key_file_load_from_file(settingsfile, filename, G_KEY_FILE_NONE, NULL) ) {
+    if( !inicache_valid(cache, file) ) {
         log_err("%s: can't read mode configuration file", filename);
         goto EXIT;
     }
@@ -190,38 +312,43 @@ modedata_load(const gchar *filename)
     if( !(self = calloc(1, sizeof *self)) )
         goto EXIT;
 
+    self->refcount = 1;
+
     // [MODE_ENTRY = "mode"]
-    self->mode_name         = g_key_file_get_string(settingsfile, MODE_ENTRY, MODE_NAME_KEY, NULL);
-    self->mode_module       = g_key_file_get_string(settingsfile, MODE_ENTRY, MODE_MODULE_KEY, NULL);
+    self->mode_name         = inicache_get_string(cache, file, MODE_ENTRY, MODE_NAME_KEY);
+    self->mode_module       = inicache_get_string(cache, file, MODE_ENTRY, MODE_MODULE_KEY);
 
     log_debug("Dynamic mode name = %s\n", self->mode_name);
     log_debug("Dynamic mode module = %s\n", self->mode_module);
 
-    self->appsync           = g_key_file_get_integer(settingsfile, MODE_ENTRY, MODE_NEEDS_APPSYNC_KEY, NULL);
-    self->mass_storage      = g_key_file_get_integer(settingsfile, MODE_ENTRY, MODE_MASS_STORAGE_KEY, NULL);
-    self->network           = g_key_file_get_integer(settingsfile, MODE_ENTRY, MODE_NETWORK_KEY, NULL);
-    self->network_interface = g_key_file_get_string(settingsfile,  MODE_ENTRY, MODE_NETWORK_INTERFACE_KEY, NULL);
+    self->appsync           = inicache_get_integer(cache, file, MODE_ENTRY, MODE_NEEDS_APPSYNC_KEY);
+    self->mass_storage      = inicache_get_integer(cache, file, MODE_ENTRY, MODE_MASS_STORAGE_KEY);
+    self->network           = inicache_get_integer(cache, file, MODE_ENTRY, MODE_NETWORK_KEY);
+    self->network_interface = inicache_get_string(cache, file,  MODE_ENTRY, MODE_NETWORK_INTERFACE_KEY);
 
     // [MODE_OPTIONS_ENTRY = "options"]
-    self->sysfs_path                 = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_SYSFS_PATH, NULL);
-    self->sysfs_value                = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_SYSFS_VALUE, NULL);
-    self->sysfs_reset_value          = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_SYSFS_RESET_VALUE, NULL);
-
-    self->android_extra_sysfs_path   = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH, NULL);
-    self->android_extra_sysfs_path2  = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH2, NULL);
-    self->android_extra_sysfs_path3  = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH3, NULL);
-    self->android_extra_sysfs_path4  = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH4, NULL);
-    self->android_extra_sysfs_value  = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE, NULL);
-    self->android_extra_sysfs_value2 = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE2, NULL);
-    self->android_extra_sysfs_value3 = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE3, NULL);
-    self->android_extra_sysfs_value4 = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE4, NULL);
-
-    self->idProduct                  = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_IDPRODUCT, NULL);
-    self->idVendorOverride           = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_IDVENDOROVERRIDE, NULL);
-    self->nat                        = g_key_file_get_integer(settingsfile, MODE_OPTIONS_ENTRY, MODE_HAS_NAT, NULL);
-    self->dhcp_server                = g_key_file_get_integer(settingsfile, MODE_OPTIONS_ENTRY, MODE_HAS_DHCP_SERVER, NULL);
+    self->sysfs_path                 = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_SYSFS_PATH);
+    self->sysfs_value                = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_SYSFS_VALUE);
+    self->sysfs_reset_value          = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_SYSFS_RESET_VALUE);
+
+    self->android_extra_sysfs_path   = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH);
+    self->android_extra_sysfs_path2  = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH2);
+    self->android_extra_sysfs_path3  = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH3);
+    self->android_extra_sysfs_path4  = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_PATH4);
+    self->android_extra_sysfs_value  = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE);
+    self->android_extra_sysfs_value2 = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE2);
+    self->android_extra_sysfs_value3 = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE3);
+    self->android_extra_sysfs_value4 = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_ANDROID_EXTRA_SYSFS_VALUE4);
+
+    self->idProduct                  = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_IDPRODUCT);
+    self->idVendorOverride           = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_IDVENDOROVERRIDE);
+    self->nat                        = inicache_get_integer(cache, file, MODE_OPTIONS_ENTRY, MODE_HAS_NAT);
+    self->dhcp_server                = inicache_get_integer(cache, file, MODE_OPTIONS_ENTRY, MODE_HAS_DHCP_SERVER);
+    self->net_qmult                  = inicache_get_integer(cache, file, MODE_OPTIONS_ENTRY, MODE_NET_QMULT);
+    self->net_host_addr              = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_NET_HOST_ADDR);
+    self->net_dev_addr               = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_NET_DEV_ADDR);
 #ifdef CONNMAN
-    self->connman_tethering          = g_key_file_get_string(settingsfile,  MODE_OPTIONS_ENTRY, MODE_CONNMAN_TETHERING, NULL);
+    self->connman_tethering          = inicache_get_string(cache, file,  MODE_OPTIONS_ENTRY, MODE_CONNMAN_TETHERING);
 #endif
 
     //log_debug("Dynamic mode sysfs path = %s\n", self->sysfs_path);
@@ -259,8 +386,6 @@ modedata_load(const gchar *filename)
     success = true;
 
 EXIT:
-    g_key_file_free(settingsfile);
-
     if( !success )
         modedata_free(self), self = 0;
 
@@ -296,23 +421,121 @@ modelist_load(bool diag)
     LOG_REGISTER_CONTEXT;
 
     GList      *modelist = 0;
-    const char *dirpath  = diag ? DIAG_DIR_PATH : MODE_DIR_PATH;
-    gchar      *pattern  = g_strdup_printf("%s/*.ini", dirpath);
-    glob_t      gb       = {};
+    inicache_t *cache    = inicache_open(diag ? DIAG_DIR_PATH : MODE_DIR_PATH,
+                                         diag ? DIAG_CACHE_NAME : MODE_CACHE_NAME);
 
-    if( glob(pattern, 0, 0, &gb) != 0 )
+    if( inicache_count(cache) == 0 )
         log_debug("no mode configuration ini-files found");
 
-    for( size_t i = 0; i < gb.gl_pathc; ++i ) {
-        const char *filepath = gb.gl_pathv[i];
-        log_debug("Read file %s\n", filepath);
-        modedata_t *list_item = modedata_load(filepath);
+    for( size_t i = 0; i < inicache_count(cache); ++i ) {
+        log_debug("Read file %s\n", inicache_path(cache, i));
+        modedata_t *list_item = modedata_load(cache, i);
         if(list_item)
             modelist = g_list_append(modelist, list_item);
     }
 
-    globfree(&gb);
-    g_free(pattern);
+    inicache_close(cache);
 
     return g_list_sort(modelist, modedata_sort_cb);
 }
+
+/** Build mode name lookup table for mode list
+ *
+ * The returned table borrows both keys and values from the
+ * list items, i.e. it must be destroyed before the mode list
+ * is released.
+ *
+ * @param modelist List of mode data objects
+ *
+ * @return Hash table mapping mode names to mode data objects
+ */
+GHashTable *
+modelist_index(GList *modelist)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable *index = g_hash_table_new(g_str_hash, g_str_equal);
+
+    for( GList *iter = modelist; iter; iter = g_list_next(iter) ) {
+        modedata_t *data = iter->data;
+        if( g_hash_table_lookup(index, data->mode_name) )
+            log_warning("%s: duplicate mode definition ignored",
+                        data->mode_name);
+        else
+            g_hash_table_insert(index, data->mode_name, data);
+    }
+
+    return index;
+}
+
+/** Callback for finding mode list item by name
+ *
+ * For use with g_list_find_custom()
+ *
+ * @param item  Mode data object
+ * @param name  Mode name
+ *
+ * @return zero if item has the given name
+ */
+static gint
+modelist_name_cb(gconstpointer item, gconstpointer name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const modedata_t *data = item;
+
+    return g_strcmp0(data->mode_name, name);
+}
+
+/** Reuse unchanged items from current mode list in freshly loaded one
+ *
+ * Items in the new list that are equal to ones in the current list
+ * are replaced with references to the current objects, so that
+ * unchanged modes retain their identity over reloads.
+ *
+ * @param index     Lookup table for current mode list, or NULL
+ * @param modelist  Freshly loaded mode list
+ *
+ * @return true if some modes were added, removed or changed,
+ *         false if the lists are equivalent
+ */
+bool
+modelist_reuse(GHashTable *index, GList *modelist)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool changed = false;
+
+    for( GList *iter = modelist; iter; iter = g_list_next(iter) ) {
+        modedata_t *data = iter->data;
+        modedata_t *prev = index ? g_hash_table_lookup(index, data->mode_name) : 0;
+
+        if( !prev ) {
+            log_notice("mode %s: added", data->mode_name);
+            changed = true;
+        }
+        else if( !modedata_equal(prev, data) ) {
+            log_notice("mode %s: changed", data->mode_name);
+            changed = true;
+        }
+        else if( prev != data ) {
+            modedata_unref(data);
+            iter->data = modedata_ref(prev);
+        }
+    }
+
+    if( index ) {
+        GHashTableIter iter;
+        gpointer       name;
+
+        g_hash_table_iter_init(&iter, index);
+        while( g_hash_table_iter_next(&iter, &name, 0) ) {
+            if( !g_list_find_custom(modelist, name, modelist_name_cb) ) {
+                log_notice("mode %s: removed", (const char *)name);
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
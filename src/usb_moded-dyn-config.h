@@ -42,6 +42,10 @@
 # define MODE_DIR_PATH  "/etc/usb-moded/dyn-modes"
 # define DIAG_DIR_PATH  "/etc/usb-moded/diag"
 
+/** Names of compiled caches for MODE_DIR_PATH and DIAG_DIR_PATH */
+# define MODE_CACHE_NAME "dyn-modes.cache"
+# define DIAG_CACHE_NAME "diag.cache"
+
 /* - - - - - - - - - - - - - - - - - - - *
  * [mode] ini-file block
  * - - - - - - - - - - - - - - - - - - - */
@@ -85,6 +89,11 @@
 # define MODE_HAS_NAT                    "nat"           // integer
 # define MODE_HAS_DHCP_SERVER            "dhcp_server"   // integer
 
+/* Tunables for ncm / ecm network functions */
+# define MODE_NET_QMULT                  "net_qmult"     // integer
+# define MODE_NET_HOST_ADDR              "net_host_addr"
+# define MODE_NET_DEV_ADDR               "net_dev_addr"
+
 # ifdef CONNMAN
 #  define MODE_CONNMAN_TETHERING         "connman_tethering"
 # endif
@@ -119,9 +128,13 @@ typedef struct modedata_t
     gchar *idVendorOverride;               /**< Temporary vendor override for special modes used by odms in testing/manufacturing */
     int    nat;                            /**< If NAT should be set up in this mode or not */
     int    dhcp_server;                    /**< if a DHCP server needs to be configured and started or not */
+    int    net_qmult;                      /**< Queue length multiplier for ncm / ecm, or zero for default */
+    gchar *net_host_addr;                  /**< Host side MAC address for ncm / ecm, or NULL for default */
+    gchar *net_dev_addr;                   /**< Device side MAC address for ncm / ecm, or NULL for default */
 # ifdef CONNMAN
     gchar *connman_tethering;              /**< Connman's tethering technology path */
 # endif
+    gint   refcount;                       /**< Number of references held to this immutable object */
 } modedata_t;
 
 /* ========================================================================= *
@@ -132,14 +145,19 @@ typedef struct modedata_t
  * MODEDATA
  * ------------------------------------------------------------------------- */
 
-void        modedata_free(modedata_t *self);
-modedata_t *modedata_copy(const modedata_t *that);
+modedata_t *modedata_ref  (const modedata_t *self);
+void        modedata_unref(modedata_t *self);
+void        modedata_free (modedata_t *self);
+modedata_t *modedata_copy (const modedata_t *that);
+bool        modedata_equal(const modedata_t *self, const modedata_t *that);
 
 /* ------------------------------------------------------------------------- *
  * MODELIST
  * ------------------------------------------------------------------------- */
 
-void   modelist_free(GList *modelist);
-GList *modelist_load(bool diag);
+void        modelist_free (GList *modelist);
+GList      *modelist_load (bool diag);
+GHashTable *modelist_index(GList *modelist);
+bool        modelist_reuse(GHashTable *index, GList *modelist);
 
 #endif /* USB_MODED_DYN_CONFIG_H_ */
@@ -0,0 +1,264 @@
+/**
+ * @file usb_moded-gadget.c
+ *
+ * Common front end for gadget control backends.
+ *
+ * Each of configfs, android_usb and kernel module backends provides
+ * a gadget_backend_t operations table. Mode setting code describes
+ * the desired gadget state via gadget_config_t and the backend that
+ * is in use decides what needs to be written, so that the same
+ * sequencing applies regardless of the backend.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-gadget.h"
+
+#include "usb_moded-android.h"
+#include "usb_moded-common.h"
+#include "usb_moded-configfs.h"
+#include "usb_moded-log.h"
+#include "usb_moded-modules.h"
+#include "usb_moded-trace.h"
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * GADGET
+ * ------------------------------------------------------------------------- */
+
+void                    gadget_init             (void);
+void                    gadget_quit             (void);
+const gadget_backend_t *gadget_get_backend      (void);
+bool                    gadget_keeps_netif      (void);
+size_t                  gadget_max_luns         (void);
+bool                    gadget_apply            (const gadget_config_t *config);
+bool                    gadget_clear_luns       (size_t count);
+bool                    gadget_set_charging_mode(void);
+bool                    gadget_is_configured    (void);
+bool                    gadget_take_adopted     (void);
+char                   *gadget_get_ifname       (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Known backends, in probing order */
+static const gadget_backend_t * const gadget_backends[] =
+{
+    &configfs_gadget_backend,
+    &android_gadget_backend,
+    &modules_gadget_backend,
+    0
+};
+
+/** Backend selected by gadget_init() */
+static const gadget_backend_t *gadget_active_backend = 0;
+
+/* ========================================================================= *
+ * GADGET
+ * ========================================================================= */
+
+/** Select backend that is in use
+ *
+ * Should be called once backend probing has been finished.
+ */
+void
+gadget_init(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gadget_active_backend = 0;
+
+    for( size_t i = 0; gadget_backends[i]; ++i ) {
+        if( gadget_backends[i]->gb_in_use() ) {
+            gadget_active_backend = gadget_backends[i];
+            break;
+        }
+    }
+}
+
+/** Forget backend selected by gadget_init()
+ */
+void
+gadget_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gadget_active_backend = 0;
+}
+
+/** Get backend that is in use
+ *
+ * @return backend operations, or NULL if no backend is in use
+ */
+const gadget_backend_t *
+gadget_get_backend(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return gadget_active_backend;
+}
+
+/** Check if network interface persists over gadget function changes
+ *
+ * @return true if interface can be left up, false otherwise
+ */
+bool
+gadget_keeps_netif(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    return backend && backend->gb_keeps_netif;
+}
+
+/** Get maximum number of mass storage luns backend supports
+ *
+ * @return number of luns, or zero for no limit
+ */
+size_t
+gadget_max_luns(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    return backend ? backend->gb_max_luns : 0;
+}
+
+/** Program and bind gadget
+ *
+ * @param config  Desired gadget configuration
+ *
+ * @return true on success, false on failure
+ */
+bool
+gadget_apply(const gadget_config_t *config)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool                    ack     = false;
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    if( !backend ) {
+        log_crit("no backend is selected, can't configure gadget");
+        goto EXIT;
+    }
+
+    int span = trace_span_begin("gadget");
+    ack = backend->gb_apply(config);
+    trace_span_end(span);
+
+EXIT:
+    log_debug("GADGET %s(%s) -> %d", __func__,
+              config->gc_functions ?: "-", ack);
+    return ack;
+}
+
+/** Detach mass storage luns
+ *
+ * @param count  Number of luns in use
+ *
+ * @return true on success, false on failure
+ */
+bool
+gadget_clear_luns(size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    if( !backend ) {
+        log_err("no suitable backend for mass-storage mode");
+        return false;
+    }
+
+    log_debug("Disable %s mass storage", backend->gb_name);
+    return backend->gb_clear_luns(count);
+}
+
+/** Program charging only gadget
+ *
+ * @return true on success, false if not supported or failed
+ */
+bool
+gadget_set_charging_mode(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    return backend && backend->gb_set_charging && backend->gb_set_charging();
+}
+
+/** Check if host has configured the gadget
+ *
+ * @return true if gadget is in configured state, false otherwise
+ */
+bool
+gadget_is_configured(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    if( backend && backend->gb_is_configured )
+        return backend->gb_is_configured();
+
+    return common_udc_is_configured();
+}
+
+/** Check if gadget left bound by previous usb-moded instance was adopted
+ *
+ * The flag is cleared, i.e. only the first call after startup can
+ * return true.
+ *
+ * @return true if gadget was adopted as is, false otherwise
+ */
+bool
+gadget_take_adopted(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    return backend && backend->gb_take_adopted && backend->gb_take_adopted();
+}
+
+/** Get name of the network interface exposed via gadget functions
+ *
+ * The kernel picks usbN names in probing order, so the name found in
+ * mode configuration files does not necessarily match.
+ *
+ * @return interface name to be released with free(), or NULL
+ */
+char *
+gadget_get_ifname(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const gadget_backend_t *backend = gadget_get_backend();
+
+    if( backend && backend->gb_get_ifname )
+        return backend->gb_get_ifname();
+
+    return 0;
+}
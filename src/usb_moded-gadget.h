@@ -0,0 +1,148 @@
+/**
+ * @file usb_moded-gadget.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_GADGET_H_
+# define USB_MODED_GADGET_H_
+
+# include <stdbool.h>
+# include <stddef.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Mass storage lun configuration
+ */
+typedef struct gadget_lun_t
+{
+    /** Backing block device */
+    const char  *gl_file;
+
+    /** Disable "Force Unit Access" */
+    bool         gl_nofua;
+
+    /** Expose as read only */
+    bool         gl_ro;
+
+    /** Expose as removable media */
+    bool         gl_removable;
+
+    /** Expose as cdrom */
+    bool         gl_cdrom;
+} gadget_lun_t;
+
+/** Desired gadget configuration
+ *
+ * Unset (NULL) values are left as they are.
+ */
+typedef struct gadget_config_t
+{
+    /** Gadget functions to enable */
+    const char  *gc_functions;
+
+    /** Product id */
+    const char  *gc_productid;
+
+    /** Vendor id */
+    const char  *gc_vendorid;
+
+    /** Mass storage luns, in lun order */
+    const gadget_lun_t *gc_luns;
+
+    /** Number of mass storage luns */
+    size_t       gc_lun_count;
+
+    /** Mass storage function stall setting ("0" / "1"), or NULL */
+    const char  *gc_ms_stall;
+
+    /** Mass storage function buffer count, or NULL */
+    const char  *gc_ms_num_buffers;
+
+    /** Additional sysfs path / value pairs, used by android_usb only */
+    const char  *gc_extra_path[2];
+    const char  *gc_extra_value[2];
+
+    /** Network function queue length multiplier, or zero */
+    int          gc_net_qmult;
+
+    /** Network function host side MAC address */
+    const char  *gc_net_host_addr;
+
+    /** Network function device side MAC address */
+    const char  *gc_net_dev_addr;
+} gadget_config_t;
+
+/** Gadget control backend operations */
+typedef struct gadget_backend_t
+{
+    /** Backend name, for logging purposes */
+    const char *gb_name;
+
+    /** Maximum number of mass storage luns, or zero for no limit */
+    size_t      gb_max_luns;
+
+    /** Flag for: network interface survives gadget function changes */
+    bool        gb_keeps_netif;
+
+    /** Check if backend is in use */
+    bool      (*gb_in_use)(void);
+
+    /** Program gadget according to configuration and bind it */
+    bool      (*gb_apply)(const gadget_config_t *config);
+
+    /** Detach mass storage luns */
+    bool      (*gb_clear_luns)(size_t count);
+
+    /** Program charging only gadget, or NULL if not supported */
+    bool      (*gb_set_charging)(void);
+
+    /** Check if host has configured the gadget */
+    bool      (*gb_is_configured)(void);
+
+    /** Check and clear: gadget left by previous instance was adopted,
+     *  or NULL if not supported */
+    bool      (*gb_take_adopted)(void);
+
+    /** Get kernel assigned name of the network interface exposed via
+     *  enabled gadget functions, or NULL if not supported */
+    char     *(*gb_get_ifname)(void);
+} gadget_backend_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * GADGET
+ * ------------------------------------------------------------------------- */
+
+void                    gadget_init             (void);
+void                    gadget_quit             (void);
+const gadget_backend_t *gadget_get_backend      (void);
+bool                    gadget_keeps_netif      (void);
+size_t                  gadget_max_luns         (void);
+bool                    gadget_apply            (const gadget_config_t *config);
+bool                    gadget_clear_luns       (size_t count);
+bool                    gadget_set_charging_mode(void);
+bool                    gadget_is_configured    (void);
+bool                    gadget_take_adopted     (void);
+char                   *gadget_get_ifname       (void);
+
+#endif /* USB_MODED_GADGET_H_ */
@@ -0,0 +1,771 @@
+/**
+ * @file usb_moded-inicache.c
+ *
+ * Compiled cache for directories of ini files.
+ *
+ * The dyn-modes and appsync configuration directories hold a number
+ * of small ini files that rarely change. Instead of reading and
+ * parsing every file on each startup / reload, the key-value content
+ * of the whole directory is stored into a single binary file under
+ * INICACHE_DIR_PATH, which is then memory mapped and looked up in
+ * place.
+ *
+ * The cache is tied to the sources via signature computed from names,
+ * inode numbers, sizes and modification times of the ini files. If
+ * the signature does not match, the cache is recompiled and rewritten.
+ * The same file stamps are recorded also per file, so that only files
+ * that have actually changed need to be parsed again - content of the
+ * others is copied over from the stale cache. When writing is not
+ * possible, the freshly compiled data is used from memory.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-inicache.h"
+
+#include "usb_moded-log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glob.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Cache file identification; last byte is format version */
+#define INICACHE_MAGIC "UMINI\0\0\2"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Cache file header */
+typedef struct inicache_header_t
+{
+    char     ih_magic[8];      /**< INICACHE_MAGIC */
+    uint32_t ih_size;          /**< Size of the whole cache file */
+    uint32_t ih_files;         /**< Number of file records */
+    uint32_t ih_entries;       /**< Number of entry records */
+    uint32_t ih_strings;       /**< Offset of string area */
+    char     ih_signature[48]; /**< Source signature, nul terminated */
+} inicache_header_t;
+
+/** Per ini file record
+ *
+ * Offsets are relative to the string area.
+ */
+typedef struct inicache_file_t
+{
+    uint32_t if_path;          /**< Offset of source file path */
+    uint32_t if_first;         /**< Index of the first entry record */
+    uint32_t if_count;         /**< Number of entry records */
+    uint32_t if_valid;         /**< Nonzero if the file could be parsed */
+    uint32_t if_stamp;         /**< Offset of source file stamp */
+} inicache_file_t;
+
+/** Per group / key / value record
+ *
+ * Values are stored as they appear in the ini file, i.e. escapes
+ * and list separators are not processed.
+ */
+typedef struct inicache_entry_t
+{
+    uint32_t ie_group;
+    uint32_t ie_key;
+    uint32_t ie_value;
+} inicache_entry_t;
+
+/** Loaded cache data */
+struct inicache_t
+{
+    /** Cache data; either memory mapped file or heap buffer */
+    char                    *ic_data;
+
+    /** Size of ic_data */
+    size_t                   ic_size;
+
+    /** Flag for: ic_data is memory mapped */
+    bool                     ic_mapped;
+
+    const inicache_header_t *ic_header;
+    const inicache_file_t   *ic_files;
+    const inicache_entry_t  *ic_entries;
+    const char              *ic_strings;
+};
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * INICACHE
+ * ------------------------------------------------------------------------- */
+
+static gchar       *inicache_stamp          (const char *path);
+static gchar       *inicache_signature      (const char *dirpath, glob_t *gb);
+static bool         inicache_attach         (inicache_t *self, char *data, size_t size, bool mapped, const char *signature);
+static bool         inicache_map            (inicache_t *self, const char *cachepath, const char *signature);
+static uint32_t     inicache_add_string     (GByteArray *strings, GHashTable *lut, const char *str);
+static ssize_t      inicache_find_file      (const inicache_t *self, const char *path, const char *stamp);
+static GByteArray  *inicache_compile        (const glob_t *gb, const char *signature, const inicache_t *prev);
+static void         inicache_write          (const char *cachepath, const GByteArray *blob);
+static GKeyFile    *inicache_value_keyfile  (const char *value);
+inicache_t         *inicache_open           (const char *dirpath, const char *cachename);
+void                inicache_close          (inicache_t *self);
+size_t              inicache_count          (const inicache_t *self);
+const char         *inicache_path           (const inicache_t *self, size_t file);
+bool                inicache_valid          (const inicache_t *self, size_t file);
+const char         *inicache_get_value      (const inicache_t *self, size_t file, const char *group, const char *key);
+gchar              *inicache_get_string     (const inicache_t *self, size_t file, const char *group, const char *key);
+int                 inicache_get_integer    (const inicache_t *self, size_t file, const char *group, const char *key);
+gchar             **inicache_get_string_list(const inicache_t *self, size_t file, const char *group, const char *key);
+
+/* ========================================================================= *
+ * INICACHE
+ * ========================================================================= */
+
+/** Get stamp identifying content of an ini file
+ *
+ * @param path  Path to ini file
+ *
+ * @return stamp string; caller must release with g_free()
+ */
+static gchar *
+inicache_stamp(const char *path)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct stat st;
+
+    if( stat(path, &st) == -1 )
+        memset(&st, 0, sizeof st);
+
+    return g_strdup_printf("%llu %lld %lld.%09ld",
+                           (unsigned long long)st.st_ino,
+                           (long long)st.st_size,
+                           (long long)st.st_mtim.tv_sec,
+                           (long)st.st_mtim.tv_nsec);
+}
+
+/** Enumerate ini files and compute signature for them
+ *
+ * @param dirpath  Directory to scan
+ * @param gb       Where to store matching paths
+ *
+ * @return signature string; caller must release with g_free()
+ */
+static gchar *
+inicache_signature(const char *dirpath, glob_t *gb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar   *pattern = g_strdup_printf("%s/*.ini", dirpath);
+    GString *text    = g_string_new(dirpath);
+
+    if( glob(pattern, 0, 0, gb) != 0 )
+        log_debug("%s: no ini-files found", dirpath);
+
+    for( size_t i = 0; i < gb->gl_pathc; ++i ) {
+        const char *path  = gb->gl_pathv[i];
+        gchar      *stamp = inicache_stamp(path);
+        g_string_append_printf(text, "\n%s %s", path, stamp);
+        g_free(stamp);
+    }
+
+    gchar *signature = g_compute_checksum_for_string(G_CHECKSUM_SHA1,
+                                                     text->str, text->len);
+    g_string_free(text, TRUE);
+    g_free(pattern);
+
+    return signature;
+}
+
+/** Take cache data in use after checking it is consistent
+ *
+ * @param self       Cache object
+ * @param data       Cache data
+ * @param size       Size of cache data
+ * @param mapped     true if data is memory mapped, false if heap allocated
+ * @param signature  Expected source signature, or NULL to accept any
+ *
+ * @return true if data was taken in use, false otherwise
+ */
+static bool
+inicache_attach(inicache_t *self, char *data, size_t size, bool mapped,
+                const char *signature)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const inicache_header_t *hdr = (const inicache_header_t *)data;
+
+    if( size < sizeof *hdr || memcmp(hdr->ih_magic, INICACHE_MAGIC, 8) )
+        return false;
+
+    if( hdr->ih_size != size || data[size - 1] != 0 )
+        return false;
+
+    if( signature &&
+        strncmp(hdr->ih_signature, signature, sizeof hdr->ih_signature) )
+        return false;
+
+    size_t tables = (sizeof *hdr +
+                     hdr->ih_files * sizeof(inicache_file_t) +
+                     hdr->ih_entries * sizeof(inicache_entry_t));
+    if( hdr->ih_files > size || hdr->ih_entries > size ||
+        tables != hdr->ih_strings || hdr->ih_strings >= size )
+        return false;
+
+    const inicache_file_t  *files   = (const void *)(data + sizeof *hdr);
+    const inicache_entry_t *entries = (const void *)(files + hdr->ih_files);
+    size_t                  limit   = size - hdr->ih_strings;
+
+    for( uint32_t i = 0; i < hdr->ih_files; ++i ) {
+        if( files[i].if_path >= limit ||
+            files[i].if_stamp >= limit ||
+            files[i].if_first > hdr->ih_entries ||
+            files[i].if_count > hdr->ih_entries - files[i].if_first )
+            return false;
+    }
+
+    for( uint32_t i = 0; i < hdr->ih_entries; ++i ) {
+        if( entries[i].ie_group >= limit ||
+            entries[i].ie_key   >= limit ||
+            entries[i].ie_value >= limit )
+            return false;
+    }
+
+    self->ic_data    = data;
+    self->ic_size    = size;
+    self->ic_mapped  = mapped;
+    self->ic_header  = hdr;
+    self->ic_files   = files;
+    self->ic_entries = entries;
+    self->ic_strings = data + hdr->ih_strings;
+    return true;
+}
+
+/** Memory map cache file, if it is up to date
+ *
+ * @param self       Cache object
+ * @param cachepath  Path to cache file
+ * @param signature  Expected source signature, or NULL to accept any
+ *
+ * @return true if cache file was taken in use, false otherwise
+ */
+static bool
+inicache_map(inicache_t *self, const char *cachepath, const char *signature)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool         ack  = false;
+    int          fd   = -1;
+    void        *data = MAP_FAILED;
+    struct stat  st;
+
+    if( (fd = open(cachepath, O_RDONLY | O_CLOEXEC)) == -1 ) {
+        if( errno != ENOENT )
+            log_warning("%s: open: %m", cachepath);
+        goto EXIT;
+    }
+
+    if( fstat(fd, &st) == -1 || st.st_size <= 0 )
+        goto EXIT;
+
+    data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if( data == MAP_FAILED ) {
+        log_warning("%s: mmap: %m", cachepath);
+        goto EXIT;
+    }
+
+    if( !inicache_attach(self, data, st.st_size, true, signature) ) {
+        if( signature )
+            log_debug("%s: cache is stale", cachepath);
+        goto EXIT;
+    }
+
+    data = MAP_FAILED;
+    ack  = true;
+
+EXIT:
+    if( data != MAP_FAILED )
+        munmap(data, st.st_size);
+    if( fd != -1 )
+        close(fd);
+    return ack;
+}
+
+/** Append string to string area, reusing already added strings
+ *
+ * @param strings  String area
+ * @param lut      String to offset lookup table
+ * @param str      String to add
+ *
+ * @return offset of the string within the string area
+ */
+static uint32_t
+inicache_add_string(GByteArray *strings, GHashTable *lut, const char *str)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gpointer offset;
+
+    if( g_hash_table_lookup_extended(lut, str, 0, &offset) )
+        return GPOINTER_TO_UINT(offset);
+
+    uint32_t res = strings->len;
+    g_byte_array_append(strings, (const guint8 *)str, strlen(str) + 1);
+    g_hash_table_insert(lut, g_strdup(str), GUINT_TO_POINTER(res));
+    return res;
+}
+
+/** Lookup file with matching path and stamp from cache
+ *
+ * @param self   Cache object, or NULL
+ * @param path   Path to ini file
+ * @param stamp  Stamp of ini file, see inicache_stamp()
+ *
+ * @return file index, or -1 if not found
+ */
+static ssize_t
+inicache_find_file(const inicache_t *self, const char *path,
+                   const char *stamp)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; self && i < inicache_count(self); ++i ) {
+        const inicache_file_t *file = &self->ic_files[i];
+        if( !strcmp(self->ic_strings + file->if_path, path) &&
+            !strcmp(self->ic_strings + file->if_stamp, stamp) )
+            return (ssize_t)i;
+    }
+
+    return -1;
+}
+
+/** Parse ini files and compile cache data from them
+ *
+ * Files that are present with the same stamp in the previous
+ * version of the cache are not parsed, their content is copied
+ * over instead.
+ *
+ * @param gb         Paths of ini files
+ * @param signature  Source signature
+ * @param prev       Previous cache data, or NULL
+ *
+ * @return cache data
+ */
+static GByteArray *
+inicache_compile(const glob_t *gb, const char *signature,
+                 const inicache_t *prev)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t      parsed  = 0;
+
+    GByteArray *strings = g_byte_array_new();
+    GArray     *files   = g_array_new(FALSE, TRUE, sizeof(inicache_file_t));
+    GArray     *entries = g_array_new(FALSE, TRUE, sizeof(inicache_entry_t));
+    GHashTable *lut     = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, 0);
+
+    for( size_t i = 0; i < gb->gl_pathc; ++i ) {
+        const char      *path    = gb->gl_pathv[i];
+        gchar           *stamp   = inicache_stamp(path);
+        ssize_t          same    = inicache_find_file(prev, path, stamp);
+        GKeyFile        *keyfile = 0;
+        inicache_file_t  file    = {
+            .if_path  = inicache_add_string(strings, lut, path),
+            .if_first = entries->len,
+            .if_stamp = inicache_add_string(strings, lut, stamp),
+        };
+
+        g_free(stamp);
+
+        if( same != -1 ) {
+            const inicache_file_t *old = &prev->ic_files[same];
+            file.if_valid = old->if_valid;
+            for( uint32_t e = 0; e < old->if_count; ++e ) {
+                const inicache_entry_t *src = &prev->ic_entries[old->if_first + e];
+                inicache_entry_t entry = {
+                    .ie_group = inicache_add_string(strings, lut, prev->ic_strings + src->ie_group),
+                    .ie_key   = inicache_add_string(strings, lut, prev->ic_strings + src->ie_key),
+                    .ie_value = inicache_add_string(strings, lut, prev->ic_strings + src->ie_value),
+                };
+                g_array_append_val(entries, entry);
+            }
+            goto NEXT;
+        }
+
+        ++parsed;
+        keyfile = g_key_file_new();
+        if( g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, 0) ) {
+            file.if_valid = 1;
+
+            gchar **groups = g_key_file_get_groups(keyfile, 0);
+            for( size_t g = 0; groups && groups[g]; ++g ) {
+                gchar **keys = g_key_file_get_keys(keyfile, groups[g], 0, 0);
+                for( size_t k = 0; keys && keys[k]; ++k ) {
+                    gchar *value = g_key_file_get_value(keyfile, groups[g],
+                                                        keys[k], 0);
+                    inicache_entry_t entry = {
+                        .ie_group = inicache_add_string(strings, lut, groups[g]),
+                        .ie_key   = inicache_add_string(strings, lut, keys[k]),
+                        .ie_value = inicache_add_string(strings, lut, value ?: ""),
+                    };
+                    g_array_append_val(entries, entry);
+                    g_free(value);
+                }
+                g_strfreev(keys);
+            }
+            g_strfreev(groups);
+        }
+
+    NEXT:
+        file.if_count = entries->len - file.if_first;
+        g_array_append_val(files, file);
+        if( keyfile )
+            g_key_file_free(keyfile);
+    }
+
+    log_debug("parsed %zu of %zu ini-files", parsed, (size_t)gb->gl_pathc);
+
+    /* Guarantees nonempty string area that ends with nul byte */
+    g_byte_array_append(strings, (const guint8 *)"", 1);
+
+    inicache_header_t hdr;
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.ih_magic, INICACHE_MAGIC, 8);
+    hdr.ih_files   = files->len;
+    hdr.ih_entries = entries->len;
+    hdr.ih_strings = (sizeof hdr +
+                      files->len * sizeof(inicache_file_t) +
+                      entries->len * sizeof(inicache_entry_t));
+    hdr.ih_size    = hdr.ih_strings + strings->len;
+    g_strlcpy(hdr.ih_signature, signature, sizeof hdr.ih_signature);
+
+    GByteArray *blob = g_byte_array_sized_new(hdr.ih_size);
+    g_byte_array_append(blob, (const guint8 *)&hdr, sizeof hdr);
+    g_byte_array_append(blob, (const guint8 *)files->data,
+                        files->len * sizeof(inicache_file_t));
+    g_byte_array_append(blob, (const guint8 *)entries->data,
+                        entries->len * sizeof(inicache_entry_t));
+    g_byte_array_append(blob, strings->data, strings->len);
+
+    g_hash_table_unref(lut);
+    g_array_free(entries, TRUE);
+    g_array_free(files, TRUE);
+    g_byte_array_free(strings, TRUE);
+
+    return blob;
+}
+
+/** Store compiled cache data
+ *
+ * The file is replaced atomically, so that readers see either
+ * the old or the new content.
+ *
+ * @param cachepath  Path to cache file
+ * @param blob       Cache data
+ */
+static void
+inicache_write(const char *cachepath, const GByteArray *blob)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GError *err = 0;
+
+    if( g_mkdir_with_parents(INICACHE_DIR_PATH, 0755) == -1 ) {
+        log_warning("%s: mkdir: %m", INICACHE_DIR_PATH);
+    }
+    else if( !g_file_set_contents(cachepath, (const gchar *)blob->data,
+                                  blob->len, &err) ) {
+        log_warning("%s: %s", cachepath, err->message);
+    }
+    else {
+        log_debug("%s: cache updated", cachepath);
+    }
+
+    g_clear_error(&err);
+}
+
+/** Construct key file holding single raw value
+ *
+ * Used for decoding escapes and lists exactly like GKeyFile does.
+ *
+ * @param value  Raw value
+ *
+ * @return key file; caller must release with g_key_file_free()
+ */
+static GKeyFile *
+inicache_value_keyfile(const char *value)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *keyfile = g_key_file_new();
+    g_key_file_set_value(keyfile, "v", "v", value);
+    return keyfile;
+}
+
+/** Load ini files from directory via cache
+ *
+ * @param dirpath    Directory containing ini files
+ * @param cachename  Name of cache file within INICACHE_DIR_PATH
+ *
+ * @return cache object; caller must release with inicache_close()
+ */
+inicache_t *
+inicache_open(const char *dirpath, const char *cachename)
+{
+    LOG_REGISTER_CONTEXT;
+
+    inicache_t *self      = g_malloc0(sizeof *self);
+    glob_t      gb        = {};
+    gchar      *signature = inicache_signature(dirpath, &gb);
+    gchar      *cachepath = g_build_filename(INICACHE_DIR_PATH, cachename, NULL);
+
+    if( inicache_map(self, cachepath, signature) ) {
+        log_debug("%s: using cached data", dirpath);
+        goto EXIT;
+    }
+
+    /* Content of unchanged files can be reused from stale cache */
+    inicache_t *prev = g_malloc0(sizeof *prev);
+    if( !inicache_map(prev, cachepath, 0) )
+        inicache_close(prev), prev = 0;
+
+    log_debug("%s: parsing ini-files", dirpath);
+    GByteArray *blob = inicache_compile(&gb, signature, prev);
+    inicache_close(prev);
+    inicache_write(cachepath, blob);
+
+    guint size = blob->len;
+    char *data = (char *)g_byte_array_free(blob, FALSE);
+    if( !inicache_attach(self, data, size, false, signature) ) {
+        /* Should not happen - fall back to empty cache */
+        log_err("%s: compiled cache is not valid", dirpath);
+        g_free(data);
+    }
+
+EXIT:
+    g_free(cachepath);
+    g_free(signature);
+    globfree(&gb);
+    return self;
+}
+
+/** Release cache object
+ *
+ * Pointers obtained via inicache_get_value() and inicache_path()
+ * become invalid.
+ *
+ * @param self  Cache object, or NULL
+ */
+void
+inicache_close(inicache_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        if( self->ic_mapped )
+            munmap(self->ic_data, self->ic_size);
+        else
+            g_free(self->ic_data);
+        g_free(self);
+    }
+}
+
+/** Get number of ini files in cache
+ *
+ * @param self  Cache object
+ *
+ * @return number of files
+ */
+size_t
+inicache_count(const inicache_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return self->ic_header ? self->ic_header->ih_files : 0;
+}
+
+/** Get path of cached ini file
+ *
+ * @param self  Cache object
+ * @param file  File index
+ *
+ * @return path, or NULL if index is out of range
+ */
+const char *
+inicache_path(const inicache_t *self, size_t file)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( file >= inicache_count(self) )
+        return 0;
+
+    return self->ic_strings + self->ic_files[file].if_path;
+}
+
+/** Check if cached ini file could be parsed
+ *
+ * @param self  Cache object
+ * @param file  File index
+ *
+ * @return true if file content is available, false otherwise
+ */
+bool
+inicache_valid(const inicache_t *self, size_t file)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return file < inicache_count(self) && self->ic_files[file].if_valid;
+}
+
+/** Lookup raw value from cached ini file
+ *
+ * @param self   Cache object
+ * @param file   File index
+ * @param group  Group name
+ * @param key    Key name
+ *
+ * @return raw value pointing to cache data, or NULL if not found
+ */
+const char *
+inicache_get_value(const inicache_t *self, size_t file,
+                   const char *group, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( file >= inicache_count(self) )
+        return 0;
+
+    const inicache_file_t  *rec   = self->ic_files + file;
+    const inicache_entry_t *entry = self->ic_entries + rec->if_first;
+
+    for( uint32_t i = 0; i < rec->if_count; ++i, ++entry ) {
+        if( !strcmp(self->ic_strings + entry->ie_key, key) &&
+            !strcmp(self->ic_strings + entry->ie_group, group) )
+            return self->ic_strings + entry->ie_value;
+    }
+
+    return 0;
+}
+
+/** Lookup string value from cached ini file
+ *
+ * Equivalent of g_key_file_get_string().
+ *
+ * @param self   Cache object
+ * @param file   File index
+ * @param group  Group name
+ * @param key    Key name
+ *
+ * @return string value, or NULL if not found; caller must release
+ *         with g_free()
+ */
+gchar *
+inicache_get_string(const inicache_t *self, size_t file,
+                    const char *group, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar      *res   = 0;
+    const char *value = inicache_get_value(self, file, group, key);
+
+    if( !value ) {
+        /* nop */
+    }
+    else if( !strchr(value, '\\') ) {
+        res = g_strdup(value);
+    }
+    else {
+        GKeyFile *keyfile = inicache_value_keyfile(value);
+        res = g_key_file_get_string(keyfile, "v", "v", 0);
+        g_key_file_free(keyfile);
+    }
+
+    return res;
+}
+
+/** Lookup integer value from cached ini file
+ *
+ * Equivalent of g_key_file_get_integer().
+ *
+ * @param self   Cache object
+ * @param file   File index
+ * @param group  Group name
+ * @param key    Key name
+ *
+ * @return integer value, or zero if not found / not valid
+ */
+int
+inicache_get_integer(const inicache_t *self, size_t file,
+                     const char *group, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int         res   = 0;
+    const char *value = inicache_get_value(self, file, group, key);
+
+    if( value ) {
+        char *end = 0;
+        errno = 0;
+        long num = strtol(value, &end, 10);
+        if( end > value && *end == 0 && errno == 0 &&
+            num >= G_MININT && num <= G_MAXINT )
+            res = (int)num;
+    }
+
+    return res;
+}
+
+/** Lookup string list value from cached ini file
+ *
+ * Equivalent of g_key_file_get_string_list().
+ *
+ * @param self   Cache object
+ * @param file   File index
+ * @param group  Group name
+ * @param key    Key name
+ *
+ * @return string array, or NULL if not found; caller must release
+ *         with g_strfreev()
+ */
+gchar **
+inicache_get_string_list(const inicache_t *self, size_t file,
+                         const char *group, const char *key)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar     **res   = 0;
+    const char *value = inicache_get_value(self, file, group, key);
+
+    if( value ) {
+        GKeyFile *keyfile = inicache_value_keyfile(value);
+        res = g_key_file_get_string_list(keyfile, "v", "v", 0, 0);
+        g_key_file_free(keyfile);
+    }
+
+    return res;
+}
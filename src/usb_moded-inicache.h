@@ -0,0 +1,58 @@
+/**
+ * @file usb_moded-inicache.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_INICACHE_H_
+# define USB_MODED_INICACHE_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Directory for compiled ini file caches */
+# define INICACHE_DIR_PATH "/var/cache/usb-moded"
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+typedef struct inicache_t inicache_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * INICACHE
+ * ------------------------------------------------------------------------- */
+
+inicache_t  *inicache_open           (const char *dirpath, const char *cachename);
+void         inicache_close          (inicache_t *self);
+size_t       inicache_count          (const inicache_t *self);
+const char  *inicache_path           (const inicache_t *self, size_t file);
+bool         inicache_valid          (const inicache_t *self, size_t file);
+const char  *inicache_get_value      (const inicache_t *self, size_t file, const char *group, const char *key);
+gchar       *inicache_get_string     (const inicache_t *self, size_t file, const char *group, const char *key);
+int          inicache_get_integer    (const inicache_t *self, size_t file, const char *group, const char *key);
+gchar      **inicache_get_string_list(const inicache_t *self, size_t file, const char *group, const char *key);
+
+#endif /* USB_MODED_INICACHE_H_ */
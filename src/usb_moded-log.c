@@ -32,10 +32,40 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <stdlib.h>
 
-#if LOG_ENABLE_CONTEXT
-# include <assert.h> // NOTRIM
-#endif
+#include <pthread.h> // NOTRIM
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Number of log records that can be queued for the writer thread */
+#define LOG_QUEUE_SIZE   128
+
+/** Maximum length of a preformatted log record */
+#define LOG_RECORD_SIZE  768
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Preformatted log record waiting to be written */
+typedef struct log_record_t
+{
+    /** Logging level, needed for syslog output */
+    int  lr_level;
+
+    /** Logging type at the time of formatting */
+    int  lr_type;
+
+    /** Log message, with prefixes when logging to stderr */
+    char lr_text[LOG_RECORD_SIZE];
+} log_record_t;
 
 /* ========================================================================= *
  * Prototypes
@@ -47,6 +77,13 @@
 
 static char *log_strip       (char *str);
 static void  log_gettime     (struct timeval *tv);
+static void  log_write_record(const log_record_t *rec);
+static bool  log_queue_pop   (log_record_t *rec, unsigned *dropped);
+static void  log_queue_drain (void);
+static bool  log_queue_push  (const log_record_t *rec);
+static void *log_writer_main (void *aptr);
+bool         log_async_start (void);
+void         log_async_stop  (void);
 void         log_emit_va     (const char *file, const char *func, int line, int lev, const char *fmt, va_list va);
 void         log_emit_real   (const char *file, const char *func, int line, int lev, const char *fmt, ...);
 void         log_debugf      (const char *fmt, ...);
@@ -61,6 +98,15 @@ void         log_set_lineinfo(bool lineinfo);
 bool         log_get_lineinfo(void);
 void         log_init        (void);
 
+/* ------------------------------------------------------------------------- *
+ * CALL_TRACE
+ * ------------------------------------------------------------------------- */
+
+const char  *log_trace_enter   (const char *func);
+void         log_trace_leave   (const char *func);
+bool         log_set_call_trace(bool enable);
+bool         log_get_call_trace(void);
+
 /* ========================================================================= *
  * Data
  * ========================================================================= */
@@ -71,104 +117,152 @@ static int log_type  = LOG_TO_STDERR;
 static bool log_lineinfo = false;
 static struct timeval log_begtime = { 0, 0 };
 
+/** Ring buffer of records waiting for the writer thread */
+static log_record_t log_queue[LOG_QUEUE_SIZE];
+
+/** Index of the oldest queued record */
+static unsigned log_queue_head = 0;
+
+/** Number of queued records */
+static unsigned log_queue_count = 0;
+
+/** Number of records dropped due to full queue */
+static unsigned log_queue_dropped = 0;
+
+/** Flag for: writer thread is running */
+static bool log_writer_running = false;
+
+/** Flag for: writer thread should exit */
+static bool log_writer_stopping = false;
+
+/** Writer thread */
+static pthread_t log_writer_tid;
+
+/** Protects log_queue and related state; held only briefly */
+static pthread_mutex_t log_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signaled when records are added or writer should exit */
+static pthread_cond_t  log_queue_cond  = PTHREAD_COND_INITIALIZER;
+
+/** Serializes actual output so that record order is retained */
+static pthread_mutex_t log_output_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* ========================================================================= *
- * CONTEXT STACK
+ * CALL TRACE
  * ========================================================================= */
 
-#if LOG_ENABLE_CONTEXT
-typedef struct context_entry_t
-{
-    const char *func;
-    bool        done;
-} context_entry_t;
+/** Runtime switch for function call tracing
+ *
+ * Checked by LOG_REGISTER_CONTEXT on every function entry, so that
+ * when tracing is disabled the cost is a single branch.
+ */
+bool log_trace_active = false;
 
-typedef struct context_stack_t
-{
-    context_entry_t stk[256];
-    int             sp;
-    int             id;
-} context_stack_t;
+/** File descriptor for ftrace marker, or -1 */
+static int log_trace_fd = -1;
 
-static int context_count = 0;
-static __thread context_stack_t *context_stack = 0;
+/** Process id to use in trace records */
+static int log_trace_pid = 0;
 
-static bool log_entry = false;
-static bool log_leave = false;
+/** Candidate ftrace marker locations */
+static const char * const log_trace_marker_paths[] =
+{
+    "/sys/kernel/tracing/trace_marker",
+    "/sys/kernel/debug/tracing/trace_marker",
+    0
+};
 
-static void
-context_write(int tab, const char *msg)
+/** Emit function entry record to ftrace marker
+ *
+ * The records use the "B|pid|name" / "E|pid" format understood by
+ * systrace / perfetto / chrome trace viewer, while ftrace itself
+ * provides timestamps and thread ids.
+ *
+ * @param func  Name of the function being entered
+ *
+ * @return func
+ */
+const char *
+log_trace_enter(const char *func)
 {
-    int tag = 0;
-    if( context_stack ) {
-        tag = context_stack->id;
-        if( tab < 0 && context_stack->sp > 0 )
-            tab = context_stack->sp;
-    }
-    tab = (tab <= 0) ? 0 : (tab * 4);
-    char *txt = 0;
-    int   len = asprintf(&txt, "T%d %*s%s\n",
-                         tag,
-                         tab, "",
-                         msg);
-    if( len > 0 ) {
-        if( write(STDERR_FILENO, txt, len) == - 1 ) {
-            // this is debug logging - do not really care
+    int  saved = errno;
+    char buf[128];
+    int  len = snprintf(buf, sizeof buf, "B|%d|%s", log_trace_pid, func);
+    int  fd  = log_trace_fd;
+
+    if( fd != -1 && len > 0 ) {
+        if( len >= (int)sizeof buf )
+            len = sizeof buf - 1;
+        if( write(fd, buf, len) == -1 ) {
+            // this is debug tracing - do not really care
         }
-        free(txt);
     }
+    errno = saved;
+    return func;
 }
 
-static void
-context_flush(void)
+/** Emit function exit record to ftrace marker
+ *
+ * @param func  Name of the function being left
+ */
+void
+log_trace_leave(const char *func)
 {
-    for( int i = 0; i < context_stack->sp; ++i ) {
-        char msg[256];
-        if( context_stack->stk[i].done )
-            continue;
-        context_stack->stk[i].done = true;
-        if( log_leave )
-            snprintf(msg, sizeof msg, "%s() { ...",
-                     context_stack->stk[i].func);
-        else
-            snprintf(msg, sizeof msg, "%s()",
-                     context_stack->stk[i].func);
-        context_write(i, msg);
+    (void)func;
+
+    int  saved = errno;
+    char buf[32];
+    int  len = snprintf(buf, sizeof buf, "E|%d", log_trace_pid);
+    int  fd  = log_trace_fd;
+
+    if( fd != -1 && len > 0 ) {
+        if( write(fd, buf, len) == -1 ) {
+            // this is debug tracing - do not really care
+        }
     }
+    errno = saved;
 }
 
-const char *
-context_enter(const char *func)
+/** Enable / disable function call tracing
+ *
+ * Note: Should be called only while there are no other threads.
+ *
+ * @param enable  true to enable tracing, false to disable
+ *
+ * @return true if tracing is enabled, false otherwise
+ */
+bool
+log_set_call_trace(bool enable)
 {
-    if( !context_stack ) {
-        context_stack = calloc(1, sizeof *context_stack);
-        context_stack->id = ++context_count;
+    if( enable && log_trace_fd == -1 ) {
+        for( size_t i = 0; log_trace_marker_paths[i]; ++i ) {
+            log_trace_fd = open(log_trace_marker_paths[i],
+                                O_WRONLY | O_CLOEXEC);
+            if( log_trace_fd != -1 )
+                break;
+        }
+        if( log_trace_fd == -1 )
+            log_warning("ftrace marker not available; call tracing disabled");
+        log_trace_pid = getpid();
+    }
+    else if( !enable && log_trace_fd != -1 ) {
+        log_trace_active = false;
+        close(log_trace_fd), log_trace_fd = -1;
     }
 
-    context_stack->stk[context_stack->sp].func = func;
-    context_stack->stk[context_stack->sp].done = false;
-    context_stack->sp += 1;
-
-    if( log_entry )
-        context_flush();
-
-    return func;
+    log_trace_active = (log_trace_fd != -1);
+    return log_trace_active;
 }
 
-void
-context_leave(void *aptr)
+/** Check if function call tracing is enabled
+ *
+ * @return true if tracing is enabled, false otherwise
+ */
+bool
+log_get_call_trace(void)
 {
-    const char *func = *(const char **)aptr;
-    assert( context_stack->sp > 0 );
-    context_stack->sp -= 1;
-
-    if( log_leave && context_stack->stk[context_stack->sp].done ) {
-        char msg[256];
-        snprintf(msg, sizeof msg, "} %s()", func);
-        context_write(-1, msg);
-    }
-    assert( context_stack->stk[context_stack->sp].func == func );
+    return log_trace_active;
 }
-#endif // LOG_ENABLE_CONTEXT
 
 /* ========================================================================= *
  * Functions
@@ -198,6 +292,215 @@ static void log_gettime(struct timeval *tv)
     timersub(tv, &log_begtime, tv);
 }
 
+/** Write preformatted log record to the selected output
+ *
+ * Caller must hold log_output_mutex.
+ *
+ * @param rec  Log record
+ */
+static void log_write_record(const log_record_t *rec)
+{
+    switch( rec->lr_type )
+    {
+    case LOG_TO_SYSLOG:
+        syslog(rec->lr_level, "%s", rec->lr_text);
+        break;
+
+    case LOG_TO_STDERR:
+        fprintf(stderr, "%s\n", rec->lr_text);
+        fflush(stderr);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/** Take the oldest record from the queue
+ *
+ * @param rec      Where to copy the record
+ * @param dropped  Where to store number of records dropped since last pop
+ *
+ * @return true if a record was available, false otherwise
+ */
+static bool log_queue_pop(log_record_t *rec, unsigned *dropped)
+{
+    bool ack = false;
+
+    pthread_mutex_lock(&log_queue_mutex);
+
+    *dropped = log_queue_dropped, log_queue_dropped = 0;
+
+    if( log_queue_count > 0 ) {
+        *rec = log_queue[log_queue_head];
+        log_queue_head = (log_queue_head + 1) % LOG_QUEUE_SIZE;
+        log_queue_count -= 1;
+        ack = true;
+    }
+
+    pthread_mutex_unlock(&log_queue_mutex);
+
+    return ack;
+}
+
+/** Write out all queued records
+ *
+ * Caller must hold log_output_mutex.
+ */
+static void log_queue_drain(void)
+{
+    log_record_t rec;
+    unsigned     dropped = 0;
+
+    for( ;; ) {
+        bool have = log_queue_pop(&rec, &dropped);
+
+        if( dropped ) {
+            log_record_t note = {
+                .lr_level = LOG_WARNING,
+                .lr_type  = log_type,
+            };
+            snprintf(note.lr_text, sizeof note.lr_text,
+                     "%s: W: %u log messages dropped",
+                     log_get_name(), dropped);
+            log_write_record(&note);
+        }
+
+        if( !have )
+            break;
+
+        log_write_record(&rec);
+    }
+}
+
+/** Add a record to the queue
+ *
+ * @param rec  Log record
+ *
+ * @return true if the record was queued or dropped due to full queue,
+ *         false if writer thread is not running
+ */
+static bool log_queue_push(const log_record_t *rec)
+{
+    bool ack = false;
+
+    pthread_mutex_lock(&log_queue_mutex);
+
+    if( log_writer_running && !log_writer_stopping ) {
+        if( log_queue_count < LOG_QUEUE_SIZE ) {
+            unsigned tail = (log_queue_head + log_queue_count) % LOG_QUEUE_SIZE;
+            log_queue[tail] = *rec;
+            log_queue_count += 1;
+            pthread_cond_signal(&log_queue_cond);
+        }
+        else {
+            log_queue_dropped += 1;
+        }
+        ack = true;
+    }
+
+    pthread_mutex_unlock(&log_queue_mutex);
+
+    return ack;
+}
+
+/** Writer thread entry point
+ *
+ * @param aptr  Unused
+ *
+ * @return NULL
+ */
+static void *log_writer_main(void *aptr)
+{
+    (void)aptr;
+
+    for( ;; ) {
+        pthread_mutex_lock(&log_queue_mutex);
+        while( log_queue_count == 0 && !log_queue_dropped &&
+               !log_writer_stopping )
+            pthread_cond_wait(&log_queue_cond, &log_queue_mutex);
+        bool stopping = log_writer_stopping;
+        pthread_mutex_unlock(&log_queue_mutex);
+
+        pthread_mutex_lock(&log_output_mutex);
+        log_queue_drain();
+        pthread_mutex_unlock(&log_output_mutex);
+
+        if( stopping )
+            break;
+    }
+
+    return 0;
+}
+
+/** Start writing logs from a dedicated thread
+ *
+ * Once started, formatted messages are queued and written to stderr /
+ * syslog asynchronously, so that slow log consumers do not stall the
+ * logging threads. If the queue gets full, messages are dropped and
+ * the number of lost messages is reported later on.
+ *
+ * Critical messages are still written synchronously, as they are
+ * often followed by immediate exit.
+ *
+ * @return true if writer thread is running, false otherwise
+ */
+bool log_async_start(void)
+{
+    bool ack = false;
+
+    pthread_mutex_lock(&log_queue_mutex);
+
+    if( log_writer_running ) {
+        ack = true;
+    }
+    else if( pthread_create(&log_writer_tid, 0, log_writer_main, 0) == 0 ) {
+        log_writer_running  = true;
+        log_writer_stopping = false;
+        ack = true;
+    }
+
+    pthread_mutex_unlock(&log_queue_mutex);
+
+    if( ack ) {
+        static bool registered = false;
+        if( !registered && atexit(log_async_stop) == 0 )
+            registered = true;
+    }
+
+    return ack;
+}
+
+/** Stop writer thread after flushing queued messages
+ */
+void log_async_stop(void)
+{
+    bool running = false;
+
+    pthread_mutex_lock(&log_queue_mutex);
+    if( (running = log_writer_running && !log_writer_stopping) ) {
+        log_writer_stopping = true;
+        pthread_cond_signal(&log_queue_cond);
+    }
+    pthread_mutex_unlock(&log_queue_mutex);
+
+    if( !running )
+        goto EXIT;
+
+    if( pthread_equal(pthread_self(), log_writer_tid) )
+        goto EXIT;
+
+    pthread_join(log_writer_tid, 0);
+
+    pthread_mutex_lock(&log_queue_mutex);
+    log_writer_running  = false;
+    log_writer_stopping = false;
+    pthread_mutex_unlock(&log_queue_mutex);
+
+EXIT:
+    return;
+}
+
 /** Print the logged messages to the selected output
  *
  * @param file  Source file name
@@ -213,13 +516,16 @@ void log_emit_va(const char *file, const char *func, int line, int lev, const ch
     char lineinfo[128] = "";
     char timeinfo[32] = "";
     char levelinfo[8] = "";
+    log_record_t rec;
     if( log_p(lev) )
     {
         switch( log_type )
         {
         case LOG_TO_SYSLOG:
-
-            vsyslog(lev, fmt, va);
+            rec.lr_level = lev;
+            rec.lr_type  = log_type;
+            errno = saved;
+            vsnprintf(rec.lr_text, sizeof rec.lr_text, fmt, va);
             break;
 
         case LOG_TO_STDERR:
@@ -269,25 +575,28 @@ void log_emit_va(const char *file, const char *func, int line, int lev, const ch
                 errno = saved;
                 vsnprintf(msg, sizeof msg, fmt, va);
                 log_strip(msg);
-#if LOG_ENABLE_CONTEXT
-                char buf[1024];
-                snprintf(buf, sizeof buf, "%s%s%s%s",
+                rec.lr_level = lev;
+                rec.lr_type  = log_type;
+                snprintf(rec.lr_text, sizeof rec.lr_text, "%s%s%s%s",
                          lineinfo, timeinfo, levelinfo, msg);
-                context_flush();
-                context_write(-1, buf);
-#else
-                fprintf(stderr, "%s%s%s%s\n",
-                        lineinfo, timeinfo, levelinfo, msg);
-#endif
             }
-            fflush(stderr);
             break;
 
         default:
             // no logging
-            break;
+            goto EXIT;
+        }
+
+        /* Critical messages bypass the queue, everything else
+         * is written synchronously only if writer is not running */
+        if( lev <= LOG_CRIT || !log_queue_push(&rec) ) {
+            pthread_mutex_lock(&log_output_mutex);
+            log_queue_drain();
+            log_write_record(&rec);
+            pthread_mutex_unlock(&log_output_mutex);
         }
     }
+EXIT:
     errno = saved;
 }
 
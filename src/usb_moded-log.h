@@ -39,7 +39,20 @@
 # define LOG_ENABLE_DEBUG      01
 # define LOG_ENABLE_TIMESTAMPS 01
 # define LOG_ENABLE_LEVELTAGS  01
-# define LOG_ENABLE_CONTEXT    0
+
+/** Compile in support for function call tracing
+ *
+ * Tracing can be disabled for individual modules by defining
+ * LOG_DISABLE_CALL_TRACE before including any headers, and enabled
+ * at runtime via log_set_call_trace().
+ */
+# ifndef LOG_ENABLE_CONTEXT
+#  ifdef LOG_DISABLE_CALL_TRACE
+#   define LOG_ENABLE_CONTEXT  0
+#  else
+#   define LOG_ENABLE_CONTEXT  1
+#  endif
+# endif
 
 enum
 {
@@ -54,20 +67,35 @@ enum
 };
 
 /* ========================================================================= *
- * CONTEXT STACK
+ * CALL TRACE
  * ========================================================================= */
 
+const char *log_trace_enter   (const char *func);
+void        log_trace_leave   (const char *func);
+bool        log_set_call_trace(bool enable);
+bool        log_get_call_trace(void);
+
+extern bool log_trace_active;
+
 # if LOG_ENABLE_CONTEXT
-const char *context_enter(const char *func);
-void        context_leave(void *aptr);
+/** Cleanup handler for LOG_REGISTER_CONTEXT
+ *
+ * @param pfunc  Pointer to traced function name, or to NULL
+ */
+static inline void
+log_trace_leave_cb(const char **pfunc)
+{
+    if( __builtin_expect(*pfunc != 0, 0) )
+        log_trace_leave(*pfunc);
+}
 
 #  define LOG_REGISTER_CONTEXT\
-     __attribute__((cleanup(context_leave))) const char *qqq =\
-         context_enter(__func__)
-#else
-# define LOG_REGISTER_CONTEXT\
+     __attribute__((cleanup(log_trace_leave_cb))) const char *log_trace_func =\
+         __builtin_expect(log_trace_active, 0) ? log_trace_enter(__func__) : 0
+# else
+#  define LOG_REGISTER_CONTEXT\
      do{}while(0)
-#endif
+# endif
 
 /* ========================================================================= *
  * Prototypes
@@ -90,6 +118,8 @@ void        log_set_name    (const char *name);
 void        log_set_lineinfo(bool lineinfo);
 bool        log_get_lineinfo(void);
 void        log_init        (void);
+bool        log_async_start (void);
+void        log_async_stop  (void);
 
 /* ========================================================================= *
  * Macros
@@ -0,0 +1,728 @@
+/**
+ * @file usb_moded-loopwatch.c
+ *
+ * Mainloop dispatch profiling and stall detection.
+ *
+ * D-Bus handling, udev input, dsme / devicelock tracking and worker
+ * notifications all share the same mainloop. When enabled, the poll
+ * function of the default main context is wrapped so that the time
+ * spent between waking up from and returning to poll is accounted to
+ * whatever woke the mainloop up: the file descriptors that became
+ * ready, and/or expired timers.
+ *
+ * A watchdog thread flags iterations that take longer than the stall
+ * threshold while they are still in progress, and grabs a stack trace
+ * of the main thread so that also mainloop hangs can be attributed.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/* Poll wrapper runs on every mainloop iteration, tracing it
+ * would only add noise */
+#define LOG_DISABLE_CALL_TRACE
+
+#include "usb_moded-loopwatch.h"
+
+#include "usb_moded-log.h"
+
+#include <sys/eventfd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <execinfo.h>
+
+#include <pthread.h> // NOTRIM
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum length of dispatch labels */
+#define LOOPWATCH_LABEL_MAX   128
+
+/** Number of recent stalls to keep */
+#define LOOPWATCH_HISTORY_MAX 8
+
+/** Maximum number of stack frames to capture */
+#define LOOPWATCH_FRAMES_MAX  32
+
+/** Signal used for capturing main thread stack */
+#define LOOPWATCH_SIGNAL      SIGPROF
+
+/** Maximum time to wait for main thread stack capture [ms] */
+#define LOOPWATCH_CAPTURE_MS  50
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Dispatch statistics for one label */
+typedef struct loopwatch_stats_t
+{
+    /** Number of dispatches */
+    unsigned ls_count;
+
+    /** Number of dispatches exceeding stall threshold */
+    unsigned ls_stalls;
+
+    /** Sum of dispatch durations [us] */
+    gint64   ls_sum;
+
+    /** Slowest dispatch [us] */
+    gint64   ls_max;
+} loopwatch_stats_t;
+
+/** Record of one stalled dispatch */
+typedef struct loopwatch_stall_t
+{
+    /** What woke up the mainloop */
+    char    lt_label[LOOPWATCH_LABEL_MAX];
+
+    /** Monotonic end time [us] */
+    gint64  lt_end;
+
+    /** Duration [us] */
+    gint64  lt_duration;
+
+    /** Main thread stack while stalled, or NULL */
+    gchar  *lt_stack;
+} loopwatch_stall_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * LOOPWATCH
+ * ------------------------------------------------------------------------- */
+
+void          loopwatch_name_fd       (int fd, const char *name);
+static void   loopwatch_append_label  (char *label, const char *text);
+static void   loopwatch_make_label    (char *label, const GPollFD *fds, guint nfds, gint rc, bool expired);
+static void   loopwatch_dispatch_begin(gint64 now, const char *label);
+static void   loopwatch_dispatch_end  (gint64 now);
+static gint   loopwatch_poll_cb       (GPollFD *fds, guint nfds, gint timeout);
+static void   loopwatch_signal_cb     (int sig);
+static gchar *loopwatch_capture_stack (void);
+static void   loopwatch_check_stall   (void);
+static void  *loopwatch_thread_cb     (void *aptr);
+bool          loopwatch_init          (unsigned threshold_ms);
+void          loopwatch_quit          (void);
+static gint   loopwatch_compare_cb    (gconstpointer a, gconstpointer b, gpointer aptr);
+gchar        *loopwatch_get_report    (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Stall threshold [us], or zero when profiling is not enabled */
+static gint64 loopwatch_threshold = 0;
+
+/** Thread running the mainloop */
+static pthread_t loopwatch_main_thread;
+
+/** Poll function that was in use before profiling was enabled */
+static GPollFunc loopwatch_poll_prev = 0;
+
+/** File descriptor -> name lookup table
+ *
+ * Accessed only from the main thread.
+ */
+static GHashTable *loopwatch_fd_names = 0;
+
+/** Watchdog thread, or zero */
+static pthread_t loopwatch_thread_id = 0;
+
+/** eventfd descriptor for stopping watchdog thread */
+static int loopwatch_quit_evfd = -1;
+
+/** Monotonic time when current dispatch started [us], or zero */
+static gint64 loopwatch_busy_since = 0;
+
+/** What woke up the mainloop for the current dispatch */
+static char loopwatch_busy_label[LOOPWATCH_LABEL_MAX];
+
+/** Flag for: current dispatch has been reported as stalled */
+static bool loopwatch_busy_flagged = false;
+
+/** Stack captured during current dispatch, or NULL */
+static gchar *loopwatch_busy_stack = 0;
+
+/** Label -> loopwatch_stats_t lookup table */
+static GHashTable *loopwatch_stats = 0;
+
+/** Number of mainloop iterations accounted */
+static unsigned loopwatch_iterations = 0;
+
+/** Total time spent dispatching [us] */
+static gint64 loopwatch_busy_total = 0;
+
+/** Ring buffer of recent stalls */
+static loopwatch_stall_t loopwatch_history[LOOPWATCH_HISTORY_MAX];
+
+/** Number of stalls recorded in loopwatch_history */
+static unsigned loopwatch_history_count = 0;
+
+/** Stack frames captured by #loopwatch_signal_cb() */
+static void *loopwatch_frames[LOOPWATCH_FRAMES_MAX];
+
+/** Number of captured frames, or -1 while capture is pending */
+static int loopwatch_frame_count = -1;
+
+static pthread_mutex_t loopwatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define LOOPWATCH_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&loopwatch_mutex) != 0 ) { \
+        log_crit("LOOPWATCH LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define LOOPWATCH_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&loopwatch_mutex) != 0 ) { \
+        log_crit("LOOPWATCH UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/* ========================================================================= *
+ * LOOPWATCH
+ * ========================================================================= */
+
+/** Set name to use for file descriptor in dispatch statistics
+ *
+ * Descriptors without name are labeled by the /proc/self/fd symlink.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param fd    File descriptor watched from the mainloop
+ * @param name  Name to use, or NULL to remove
+ */
+void
+loopwatch_name_fd(int fd, const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( fd == -1 )
+        goto EXIT;
+
+    if( !loopwatch_fd_names )
+        loopwatch_fd_names = g_hash_table_new_full(g_direct_hash,
+                                                   g_direct_equal,
+                                                   0, g_free);
+    if( name )
+        g_hash_table_replace(loopwatch_fd_names, GINT_TO_POINTER(fd),
+                             g_strdup(name));
+    else
+        g_hash_table_remove(loopwatch_fd_names, GINT_TO_POINTER(fd));
+
+EXIT:
+    return;
+}
+
+/** Append text to dispatch label
+ *
+ * @param label  Buffer of LOOPWATCH_LABEL_MAX bytes
+ * @param text   Text to append
+ */
+static void
+loopwatch_append_label(char *label, const char *text)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( *label )
+        g_strlcat(label, "+", LOOPWATCH_LABEL_MAX);
+    g_strlcat(label, text, LOOPWATCH_LABEL_MAX);
+}
+
+/** Describe what woke up the mainloop
+ *
+ * @param label    Buffer of LOOPWATCH_LABEL_MAX bytes
+ * @param fds      Polled file descriptors
+ * @param nfds     Number of polled file descriptors
+ * @param rc       Value returned by poll
+ * @param expired  Poll timeout was reached
+ */
+static void
+loopwatch_make_label(char *label, const GPollFD *fds, guint nfds,
+                     gint rc, bool expired)
+{
+    LOG_REGISTER_CONTEXT;
+
+    *label = 0;
+
+    for( guint i = 0; rc > 0 && i < nfds; ++i ) {
+        if( !fds[i].revents )
+            continue;
+
+        const char *name = 0;
+        if( loopwatch_fd_names )
+            name = g_hash_table_lookup(loopwatch_fd_names,
+                                       GINT_TO_POINTER(fds[i].fd));
+        if( name ) {
+            loopwatch_append_label(label, name);
+            continue;
+        }
+
+        char path[64];
+        char link[64];
+        snprintf(path, sizeof path, "/proc/self/fd/%d", fds[i].fd);
+        ssize_t len = readlink(path, link, sizeof link - 1);
+        link[len < 0 ? 0 : len] = 0;
+
+        char text[96];
+        snprintf(text, sizeof text, "fd%d:%s", fds[i].fd, *link ? link : "?");
+        loopwatch_append_label(label, text);
+    }
+
+    if( rc == 0 || expired )
+        loopwatch_append_label(label, "timer");
+
+    if( !*label )
+        loopwatch_append_label(label, rc < 0 ? "interrupted" : "other");
+}
+
+/** Mark start of dispatching
+ *
+ * @param now    Monotonic time [us]
+ * @param label  What woke up the mainloop
+ */
+static void
+loopwatch_dispatch_begin(gint64 now, const char *label)
+{
+    LOG_REGISTER_CONTEXT;
+
+    LOOPWATCH_LOCKED_ENTER;
+
+    loopwatch_busy_since   = now;
+    loopwatch_busy_flagged = false;
+    g_strlcpy(loopwatch_busy_label, label, LOOPWATCH_LABEL_MAX);
+
+    LOOPWATCH_LOCKED_LEAVE;
+}
+
+/** Mark end of dispatching and account for it
+ *
+ * @param now  Monotonic time [us]
+ */
+static void
+loopwatch_dispatch_end(gint64 now)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gint64 duration = 0;
+    bool   report   = false;
+    char   label[LOOPWATCH_LABEL_MAX];
+
+    LOOPWATCH_LOCKED_ENTER;
+
+    if( !loopwatch_busy_since )
+        goto LEAVE;
+
+    duration = now - loopwatch_busy_since;
+    g_strlcpy(label, loopwatch_busy_label, sizeof label);
+
+    if( !loopwatch_stats )
+        loopwatch_stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, g_free);
+
+    loopwatch_stats_t *stats = g_hash_table_lookup(loopwatch_stats, label);
+    if( !stats ) {
+        stats = g_malloc0(sizeof *stats);
+        g_hash_table_replace(loopwatch_stats, g_strdup(label), stats);
+    }
+
+    stats->ls_count += 1;
+    stats->ls_sum   += duration;
+    if( stats->ls_max < duration )
+        stats->ls_max = duration;
+
+    loopwatch_iterations += 1;
+    loopwatch_busy_total += duration;
+
+    if( duration >= loopwatch_threshold ) {
+        stats->ls_stalls += 1;
+
+        unsigned slot = loopwatch_history_count++ % LOOPWATCH_HISTORY_MAX;
+        loopwatch_stall_t *stall = &loopwatch_history[slot];
+        g_strlcpy(stall->lt_label, label, LOOPWATCH_LABEL_MAX);
+        stall->lt_end      = now;
+        stall->lt_duration = duration;
+        g_free(stall->lt_stack),
+            stall->lt_stack = loopwatch_busy_stack,
+            loopwatch_busy_stack = 0;
+
+        /* Stalls caught by the watchdog have already been logged */
+        report = !loopwatch_busy_flagged;
+    }
+
+    g_free(loopwatch_busy_stack),
+        loopwatch_busy_stack = 0;
+    loopwatch_busy_since   = 0;
+    loopwatch_busy_flagged = false;
+
+LEAVE:
+    LOOPWATCH_LOCKED_LEAVE;
+
+    if( report )
+        log_warning("mainloop: %s dispatch took %.1f ms",
+                    label, duration * 1e-3);
+}
+
+/** Poll function wrapper for the default main context
+ *
+ * Time from returning from poll until the next poll call is
+ * accounted as dispatching. This includes also prepare and check
+ * stages, but those are negligible compared to dispatching.
+ */
+static gint
+loopwatch_poll_cb(GPollFD *fds, guint nfds, gint timeout)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gint64 entered = g_get_monotonic_time();
+    loopwatch_dispatch_end(entered);
+
+    gint rc    = loopwatch_poll_prev(fds, nfds, timeout);
+    int  saved = errno;
+
+    gint64 woken   = g_get_monotonic_time();
+    bool   expired = timeout >= 0 && woken - entered >= timeout * (gint64)1000;
+    char   label[LOOPWATCH_LABEL_MAX];
+
+    loopwatch_make_label(label, fds, nfds, rc, expired);
+    loopwatch_dispatch_begin(woken, label);
+
+    errno = saved;
+    return rc;
+}
+
+/** Signal handler for capturing main thread stack
+ *
+ * Note: backtrace() has been called once already during init, so that
+ *       it does not need to load libgcc and allocate memory here.
+ */
+static void
+loopwatch_signal_cb(int sig)
+{
+    (void)sig;
+
+    int saved = errno;
+    int count = backtrace(loopwatch_frames, LOOPWATCH_FRAMES_MAX);
+    __atomic_store_n(&loopwatch_frame_count, count, __ATOMIC_RELEASE);
+    errno = saved;
+}
+
+/** Capture stack of the main thread
+ *
+ * Note: This function should be called only from the watchdog thread.
+ *
+ * @return stack description, or NULL; release with g_free()
+ */
+static gchar *
+loopwatch_capture_stack(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *str   = 0;
+    char   **sym   = 0;
+    int      count = -1;
+
+    __atomic_store_n(&loopwatch_frame_count, -1, __ATOMIC_RELEASE);
+
+    if( pthread_kill(loopwatch_main_thread, LOOPWATCH_SIGNAL) != 0 )
+        goto EXIT;
+
+    for( int ms = 0; ms < LOOPWATCH_CAPTURE_MS; ++ms ) {
+        if( (count = __atomic_load_n(&loopwatch_frame_count,
+                                     __ATOMIC_ACQUIRE)) >= 0 )
+            break;
+        usleep(1000);
+    }
+
+    if( count <= 0 || !(sym = backtrace_symbols(loopwatch_frames, count)) )
+        goto EXIT;
+
+    /* Skip signal handler and signal trampoline frames */
+    str = g_string_new(0);
+    for( int i = 2; i < count; ++i )
+        g_string_append_printf(str, "  #%d %s\n", i - 2, sym[i]);
+
+EXIT:
+    free(sym);
+
+    return str ? g_string_free(str, FALSE) : 0;
+}
+
+/** Check if the mainloop is stalled, and report it if so
+ *
+ * Note: This function should be called only from the watchdog thread.
+ */
+static void
+loopwatch_check_stall(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gint64 since = 0;
+    gchar *stack = 0;
+    bool   still = false;
+    char   label[LOOPWATCH_LABEL_MAX];
+
+    LOOPWATCH_LOCKED_ENTER;
+    if( !loopwatch_busy_flagged )
+        since = loopwatch_busy_since;
+    g_strlcpy(label, loopwatch_busy_label, sizeof label);
+    LOOPWATCH_LOCKED_LEAVE;
+
+    if( !since || g_get_monotonic_time() - since < loopwatch_threshold )
+        goto EXIT;
+
+    stack = loopwatch_capture_stack();
+
+    /* The stack is relevant only if still in the same dispatch */
+    LOOPWATCH_LOCKED_ENTER;
+    if( (still = (loopwatch_busy_since == since && !loopwatch_busy_flagged)) ) {
+        loopwatch_busy_flagged = true;
+        g_free(loopwatch_busy_stack),
+            loopwatch_busy_stack = g_strdup(stack);
+    }
+    LOOPWATCH_LOCKED_LEAVE;
+
+    if( still )
+        log_warning("mainloop: stalled in %s dispatch for %.1f ms\n%s",
+                    label, (g_get_monotonic_time() - since) * 1e-3,
+                    stack ?: "  (stack not available)\n");
+
+EXIT:
+    g_free(stack);
+}
+
+/** Watchdog thread
+ */
+static void *
+loopwatch_thread_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    /* Leave signal processing up to the main thread */
+    sigset_t ss;
+    sigfillset(&ss);
+    pthread_sigmask(SIG_BLOCK, &ss, 0);
+
+    int period = (int)MAX(loopwatch_threshold / 4000, 10);
+
+    for( ;; ) {
+        struct pollfd pfd = { .fd = loopwatch_quit_evfd, .events = POLLIN };
+        int rc = poll(&pfd, 1, period);
+        if( rc == 0 )
+            loopwatch_check_stall();
+        else if( rc != -1 || errno != EINTR )
+            break;
+    }
+
+    return 0;
+}
+
+/** Enable mainloop dispatch profiling
+ *
+ * Note: This function should be called from the thread that
+ *       runs the mainloop.
+ *
+ * @param threshold_ms  Dispatch duration that is reported as stall
+ *
+ * @return true if profiling is enabled, false otherwise
+ */
+bool
+loopwatch_init(unsigned threshold_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( loopwatch_threshold || !threshold_ms )
+        goto EXIT;
+
+    loopwatch_main_thread = pthread_self();
+    loopwatch_threshold   = threshold_ms * (gint64)1000;
+
+    /* Make sure libgcc is loaded before it is needed in signal handler */
+    void *frame[2];
+    backtrace(frame, G_N_ELEMENTS(frame));
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = loopwatch_signal_cb;
+    sa.sa_flags   = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if( sigaction(LOOPWATCH_SIGNAL, &sa, 0) == -1 ) {
+        log_err("sigaction: %m");
+        goto FAIL;
+    }
+
+    if( (loopwatch_quit_evfd = eventfd(0, EFD_CLOEXEC)) == -1 ) {
+        log_err("eventfd: %m");
+        goto FAIL;
+    }
+
+    if( pthread_create(&loopwatch_thread_id, 0, loopwatch_thread_cb, 0) != 0 ) {
+        log_err("failed to start mainloop watchdog thread");
+        loopwatch_thread_id = 0;
+        goto FAIL;
+    }
+
+    loopwatch_poll_prev = g_main_context_get_poll_func(0);
+    g_main_context_set_poll_func(0, loopwatch_poll_cb);
+
+    log_notice("mainloop profiling enabled; stall threshold %u ms",
+               threshold_ms);
+    goto EXIT;
+
+FAIL:
+    loopwatch_quit();
+
+EXIT:
+    return loopwatch_threshold != 0;
+}
+
+/** Disable mainloop dispatch profiling and release resources
+ */
+void
+loopwatch_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( loopwatch_poll_prev ) {
+        g_main_context_set_poll_func(0, loopwatch_poll_prev);
+        loopwatch_poll_prev = 0;
+    }
+
+    if( loopwatch_thread_id ) {
+        uint64_t cnt = 1;
+        if( write(loopwatch_quit_evfd, &cnt, sizeof cnt) == -1 )
+            log_err("failed to signal mainloop watchdog thread: %m");
+        else
+            pthread_join(loopwatch_thread_id, 0);
+        loopwatch_thread_id = 0;
+    }
+
+    if( loopwatch_quit_evfd != -1 )
+        close(loopwatch_quit_evfd), loopwatch_quit_evfd = -1;
+
+    if( loopwatch_threshold ) {
+        signal(LOOPWATCH_SIGNAL, SIG_DFL);
+        loopwatch_threshold = 0;
+    }
+
+    if( loopwatch_fd_names )
+        g_hash_table_unref(loopwatch_fd_names), loopwatch_fd_names = 0;
+
+    LOOPWATCH_LOCKED_ENTER;
+
+    if( loopwatch_stats )
+        g_hash_table_unref(loopwatch_stats), loopwatch_stats = 0;
+
+    for( size_t i = 0; i < LOOPWATCH_HISTORY_MAX; ++i )
+        g_free(loopwatch_history[i].lt_stack),
+            loopwatch_history[i].lt_stack = 0;
+    loopwatch_history_count = 0;
+
+    g_free(loopwatch_busy_stack),
+        loopwatch_busy_stack = 0;
+    loopwatch_busy_since = 0;
+
+    LOOPWATCH_LOCKED_LEAVE;
+}
+
+/** Order labels by descending total dispatch time
+ */
+static gint
+loopwatch_compare_cb(gconstpointer a, gconstpointer b, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable *stats = aptr;
+    const loopwatch_stats_t *sa = g_hash_table_lookup(stats, a);
+    const loopwatch_stats_t *sb = g_hash_table_lookup(stats, b);
+
+    return (sa->ls_sum < sb->ls_sum) - (sa->ls_sum > sb->ls_sum);
+}
+
+/** Get human readable mainloop dispatch report
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @return report text, or empty string if profiling is not enabled;
+ *         release with g_free()
+ */
+gchar *
+loopwatch_get_report(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *str = g_string_new(0);
+    gint64   now = g_get_monotonic_time();
+
+    if( !loopwatch_threshold )
+        goto EXIT;
+
+    LOOPWATCH_LOCKED_ENTER;
+
+    g_string_append_printf(str, "mainloop: iterations=%u busy=%.1f ms "
+                           "threshold=%.1f ms stalls=%u\n",
+                           loopwatch_iterations,
+                           loopwatch_busy_total * 1e-3,
+                           loopwatch_threshold * 1e-3,
+                           loopwatch_history_count);
+
+    if( loopwatch_stats ) {
+        GList *labels = g_list_sort_with_data(g_hash_table_get_keys(loopwatch_stats),
+                                              loopwatch_compare_cb,
+                                              loopwatch_stats);
+        for( GList *iter = labels; iter; iter = iter->next ) {
+            const char *label = iter->data;
+            const loopwatch_stats_t *stats =
+                g_hash_table_lookup(loopwatch_stats, label);
+            g_string_append_printf(str, "  dispatch %s: count=%u avg=%.2f "
+                                   "max=%.1f ms stalls=%u\n",
+                                   label, stats->ls_count,
+                                   stats->ls_sum * 1e-3 / stats->ls_count,
+                                   stats->ls_max * 1e-3, stats->ls_stalls);
+        }
+        g_list_free(labels);
+    }
+
+    unsigned count = MIN(loopwatch_history_count, LOOPWATCH_HISTORY_MAX);
+    for( unsigned i = 0; i < count; ++i ) {
+        unsigned slot = (loopwatch_history_count - count + i) % LOOPWATCH_HISTORY_MAX;
+        const loopwatch_stall_t *stall = &loopwatch_history[slot];
+        g_string_append_printf(str, "stall: %s %.1f ms, %.1f s ago\n",
+                               stall->lt_label, stall->lt_duration * 1e-3,
+                               (now - stall->lt_end) * 1e-6);
+        if( stall->lt_stack )
+            g_string_append(str, stall->lt_stack);
+    }
+
+    LOOPWATCH_LOCKED_LEAVE;
+
+EXIT:
+    return g_string_free(str, FALSE);
+}
@@ -0,0 +1,40 @@
+/**
+ * @file usb_moded-loopwatch.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_LOOPWATCH_H_
+# define USB_MODED_LOOPWATCH_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * LOOPWATCH
+ * ------------------------------------------------------------------------- */
+
+void   loopwatch_name_fd    (int fd, const char *name);
+bool   loopwatch_init       (unsigned threshold_ms);
+void   loopwatch_quit       (void);
+gchar *loopwatch_get_report (void);
+
+#endif /* USB_MODED_LOOPWATCH_H_ */
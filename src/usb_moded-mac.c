@@ -24,12 +24,41 @@
 
 #include "usb_moded-mac.h"
 
+#include "usb_moded-android.h"
 #include "usb_moded-log.h"
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Persistent storage for the gadget ethernet address
+ *
+ * Uses the g_ether module option syntax so that the file is directly
+ * usable by the kernel module backend, and is read back by the other
+ * backends via mac_read_mac().
+ */
+#define MAC_CONF_FILE        "/etc/modprobe.d/g_ether.conf"
+
+/** Prefix used in MAC_CONF_FILE, the address follows immediately */
+#define MAC_CONF_PREFIX      "options g_ether host_addr="
+
+/** Source for stable device identity */
+#define MAC_MACHINE_ID_FILE  "/etc/machine-id"
+
+/** Salt mixed into device identity, keeps derived address from
+ *  being trivially linkable to machine-id used elsewhere */
+#define MAC_DERIVE_SALT      "usb-moded:g_ether:"
+
+#define MAC_ADDR_LEN         6
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -38,62 +67,243 @@
  * MAC
  * ------------------------------------------------------------------------- */
 
-static void  mac_random_ether_addr  (unsigned char *addr);
-void         mac_generate_random_mac(void);
-char        *mac_read_mac           (void);
+static void   mac_fix_ether_addr    (unsigned char *addr);
+static bool   mac_random_ether_addr (unsigned char *addr);
+static gchar *mac_get_device_id     (void);
+static bool   mac_derive_ether_addr (unsigned char *addr);
+static gchar *mac_format_ether_addr (const unsigned char *addr);
+static bool   mac_write_ether_addr  (const unsigned char *addr);
+void          mac_generate_mac      (void);
+gchar        *mac_regenerate_mac    (void);
+static char  *mac_read_file         (void);
+char         *mac_read_mac          (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Address read from MAC_CONF_FILE, or NULL if not available */
+static char *mac_cached_addr = NULL;
+
+/** Flag for: MAC_CONF_FILE has been read */
+static bool  mac_cached_valid = false;
+
+/** Mutex for accessing cached address
+ *
+ * Address is read both from the main thread during backend
+ * initialization and from the worker thread during mode switches.
+ */
+static pthread_mutex_t mac_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
 
-static void mac_random_ether_addr(unsigned char *addr)
+/** Make address usable as locally administered unicast address
+ *
+ * @param addr  6 byte ethernet address
+ */
+static void mac_fix_ether_addr(unsigned char *addr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    addr [0] &= 0xfe;       /* clear multicast bit */
+    addr [0] |= 0x02;       /* set local assignment bit (IEEE802) */
+}
+
+static bool mac_random_ether_addr(unsigned char *addr)
 {
     LOG_REGISTER_CONTEXT;
 
     FILE *random;
     size_t count = 0;
 
-    random = fopen("/dev/urandom", "r");
-    count = fread(addr, 1, 6, random);
-    fclose(random);
-
-    if(count > 0 )
-    {
-        addr [0] &= 0xfe;       /* clear multicast bit */
-        addr [0] |= 0x02;       /* set local assignment bit (IEEE802) */
+    if( (random = fopen("/dev/urandom", "r")) ) {
+        count = fread(addr, 1, MAC_ADDR_LEN, random);
+        fclose(random);
     }
-    else
+
+    if( count != MAC_ADDR_LEN ) {
         log_warning("MAC generation failed!\n");
+        return false;
+    }
+
+    mac_fix_ether_addr(addr);
+    return true;
 }
 
-void mac_generate_random_mac (void)
+/** Get string that stays the same over reboots and reinstalls of usb-moded
+ *
+ * Uses systemd machine-id when available, falls back to android
+ * bootloader provided serial number.
+ *
+ * @return device identity string, or NULL if not available
+ */
+static gchar *mac_get_device_id(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    unsigned char addr[6];
-    int i;
-    FILE *g_ether;
+    gchar *id = 0;
 
-    log_debug("Getting random usb ethernet mac\n");
-    mac_random_ether_addr(addr);
+    if( g_file_get_contents(MAC_MACHINE_ID_FILE, &id, 0, 0) ) {
+        g_strstrip(id);
+        if( *id ) {
+            log_debug("deriving mac from %s", MAC_MACHINE_ID_FILE);
+            goto EXIT;
+        }
+        g_free(id), id = 0;
+    }
 
-    g_ether = fopen("/etc/modprobe.d/g_ether.conf", "w");
-    if(!g_ether)
-    {
-        log_warning("Failed to write mac address to /etc/modprobe.d/g_ether.conf\n");
-        return;
+    if( (id = android_get_serial()) ) {
+        log_debug("deriving mac from device serial number");
+        goto EXIT;
     }
-    fprintf(g_ether, "options g_ether host_addr=");
 
-    for(i=0; i<5; i++)
-    {
-        fprintf(g_ether, "%02x:",addr[i]);
+EXIT:
+    return id;
+}
+
+/** Derive stable ethernet address from device identity
+ *
+ * @param addr  6 byte buffer to fill in
+ *
+ * @return true if address was derived, false if device identity
+ *         is not available
+ */
+static bool mac_derive_ether_addr(unsigned char *addr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool       ack  = false;
+    gchar     *id   = 0;
+    GChecksum *csum = 0;
+    guint8     digest[32];
+    gsize      size = sizeof digest;
+
+    if( !(id = mac_get_device_id()) )
+        goto EXIT;
+
+    csum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(csum, (const guchar *)MAC_DERIVE_SALT, -1);
+    g_checksum_update(csum, (const guchar *)id, -1);
+    g_checksum_get_digest(csum, digest, &size);
+
+    if( size < MAC_ADDR_LEN )
+        goto EXIT;
+
+    memcpy(addr, digest, MAC_ADDR_LEN);
+    mac_fix_ether_addr(addr);
+    ack = true;
+
+EXIT:
+    if( csum )
+        g_checksum_free(csum);
+    g_free(id);
+    return ack;
+}
+
+static gchar *mac_format_ether_addr(const unsigned char *addr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_strdup_printf("%02x:%02x:%02x:%02x:%02x:%02x",
+                           addr[0], addr[1], addr[2],
+                           addr[3], addr[4], addr[5]);
+}
+
+/** Persist ethernet address
+ *
+ * The file is replaced atomically, so that readers never see
+ * partially written content.
+ *
+ * @param addr  6 byte ethernet address
+ *
+ * @return true on success, false on failure
+ */
+static bool mac_write_ether_addr(const unsigned char *addr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool    ack  = false;
+    gchar  *text = mac_format_ether_addr(addr);
+    gchar  *data = g_strdup_printf("%s%s\n", MAC_CONF_PREFIX, text);
+    GError *err  = 0;
+
+    if( !g_file_set_contents(MAC_CONF_FILE, data, -1, &err) ) {
+        log_warning("Failed to write mac address to %s: %s",
+                    MAC_CONF_FILE, err ? err->message : "unknown");
+        goto EXIT;
+    }
+
+    log_debug("usb ethernet mac set to %s", text);
+    ack = true;
+
+EXIT:
+    g_clear_error(&err);
+    g_free(data);
+    g_free(text);
+    return ack;
+}
+
+/** Create persistent usb ethernet address
+ *
+ * Derives the address from device identity when possible, so that
+ * the same address is produced again even if the persistent file
+ * gets lost. Random address is used as a fallback.
+ *
+ * Should be called only when MAC_CONF_FILE does not exist, an
+ * existing address is kept as is to avoid hosts from having to
+ * re-run network setup.
+ */
+void mac_generate_mac(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned char addr[MAC_ADDR_LEN];
+
+    if( !mac_derive_ether_addr(addr) ) {
+        log_debug("Getting random usb ethernet mac\n");
+        if( !mac_random_ether_addr(addr) )
+            return;
+    }
+
+    if( mac_write_ether_addr(addr) ) {
+        pthread_mutex_lock(&mac_mutex);
+        free(mac_cached_addr), mac_cached_addr = 0;
+        mac_cached_valid = false;
+        pthread_mutex_unlock(&mac_mutex);
     }
-    fprintf(g_ether, "%02x\n",addr[i]);
-    fclose(g_ether);
 }
 
-char * mac_read_mac(void)
+/** Replace persistent usb ethernet address with a random one
+ *
+ * Used on explicit request only. The new address gets applied
+ * to the gadget the next time usb-moded is started.
+ *
+ * @return new address as text, or NULL on failure
+ */
+gchar *mac_regenerate_mac(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned char addr[MAC_ADDR_LEN];
+    gchar *res = 0;
+
+    log_debug("Regenerating random usb ethernet mac\n");
+
+    if( !mac_random_ether_addr(addr) )
+        goto EXIT;
+
+    if( !mac_write_ether_addr(addr) )
+        goto EXIT;
+
+    res = mac_format_ether_addr(addr);
+
+EXIT:
+    return res;
+}
+
+static char *mac_read_file(void)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -102,13 +312,13 @@ char * mac_read_mac(void)
     size_t read = 0;
     int test = 0;
 
-    g_ether = fopen("/etc/modprobe.d/g_ether.conf", "r");
+    g_ether = fopen(MAC_CONF_FILE, "r");
     if(!g_ether)
     {
-        log_warning("Failed to read mac address from /etc/modprobe.d/g_ether.conf\n");
+        log_warning("Failed to read mac address from %s\n", MAC_CONF_FILE);
         return NULL;
     }
-    test = fseek(g_ether, 26, SEEK_SET);
+    test = fseek(g_ether, sizeof MAC_CONF_PREFIX - 1, SEEK_SET);
     if(test == -1)
     {
         fclose(g_ether);
@@ -126,3 +336,28 @@ char * mac_read_mac(void)
     fclose(g_ether);
     return ret;
 }
+
+/** Get persistent usb ethernet address
+ *
+ * The file is read only once, as the address is applied as is
+ * until usb-moded is restarted, see #mac_regenerate_mac().
+ *
+ * @return address as text, or NULL if not available; release with free()
+ */
+char *mac_read_mac(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *ret = 0;
+
+    pthread_mutex_lock(&mac_mutex);
+    if( !mac_cached_valid ) {
+        mac_cached_addr  = mac_read_file();
+        mac_cached_valid = true;
+    }
+    if( mac_cached_addr )
+        ret = strdup(mac_cached_addr);
+    pthread_mutex_unlock(&mac_mutex);
+
+    return ret;
+}
@@ -25,6 +25,8 @@
 #ifndef  USB_MODED_MAC_H_
 # define USB_MODED_MAC_H_
 
+# include <glib.h>
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -33,7 +35,8 @@
  * MAC
  * ------------------------------------------------------------------------- */
 
-void  mac_generate_random_mac(void);
-char *mac_read_mac           (void);
+void   mac_generate_mac  (void);
+gchar *mac_regenerate_mac(void);
+char  *mac_read_mac      (void);
 
 #endif /* USB_MODED_MAC_H_ */
@@ -95,4 +95,31 @@
 # define MODE_ADB                "adb_mode"
 # define MODE_PC_SUITE           "pc_suite"
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Mode atoms
+ *
+ * Compact identifiers for internal modes, so that mode names need to
+ * be compared only once - when they enter usb-moded - and the rest of
+ * the code can deal with small integers.
+ *
+ * All dynamic modes map to MODE_ATOM_DYNAMIC.
+ *
+ * Use common_mode_atom() and common_mode_atom_name() for conversions.
+ */
+typedef enum mode_atom_t
+{
+    MODE_ATOM_DYNAMIC,
+    MODE_ATOM_UNDEFINED,
+    MODE_ATOM_BUSY,
+    MODE_ATOM_CHARGER,
+    MODE_ATOM_CHARGING_FALLBACK,
+    MODE_ATOM_ASK,
+    MODE_ATOM_CHARGING,
+
+    MODE_ATOM_NUMOF
+} mode_atom_t;
+
 #endif /* USB_MODED_MODES_H_ */
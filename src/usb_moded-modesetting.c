@@ -35,16 +35,42 @@
 #include "usb_moded-appsync.h"
 #include "usb_moded-common.h"
 #include "usb_moded-config-private.h"
-#include "usb_moded-configfs.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-gadget.h"
 #include "usb_moded-log.h"
-#include "usb_moded-modules.h"
+#include "usb_moded-mac.h"
 #include "usb_moded-network.h"
+#include "usb_moded-pipeline.h"
+#include "usb_moded-trace.h"
 #include "usb_moded-worker.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <mntent.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum time to wait for busy mountpoint to become unmountable [ms] */
+#define MODESETTING_UNMOUNT_TIMEOUT_MS       2000
+
+/** Maximum time to wait for network interface to show up [ms] */
+#define MODESETTING_NETWORK_WAIT_TIMEOUT_MS  3000
+
+/** Maximum time to wait for interfaces to settle before post appsync [ms] */
+#define MODESETTING_SETTLE_TIMEOUT_MS        350
+
+/** Maximum time to allow mount helper commands to run [ms] */
+#define MODESETTING_MOUNT_TIMEOUT_MS         30000
+
+/** Maximum time to allow ifup / ifdown commands to run [ms] */
+#define MODESETTING_IFUPDOWN_TIMEOUT_MS      30000
 
 /* ========================================================================= *
  * Types
@@ -59,6 +85,15 @@ typedef struct storage_info_t
 
     /** Device path */
     gchar *si_mountdevice;;
+
+    /** Lun attributes, from mountpoint specific config */
+    bool   si_nofua;
+    bool   si_ro;
+    bool   si_removable;
+    bool   si_cdrom;
+
+    /** Block device write cache policy to use, or NULL */
+    gchar *si_write_cache;
 } storage_info_t;
 
 /* ========================================================================= *
@@ -77,14 +112,31 @@ int                    modesetting_write_to_file_real         (const char *file,
 bool                   modesetting_is_mounted                 (const char *mountpoint);
 bool                   modesetting_mount                      (const char *mountpoint);
 bool                   modesetting_unmount                    (const char *mountpoint);
+static bool            modesetting_unmount_cb                 (void *aptr);
+static bool            modesetting_unmount_all_cb             (void *aptr);
+static bool            modesetting_enumerated_cb              (void *aptr);
 static gchar          *modesetting_mountdev                   (const char *mountpoint);
 static void            modesetting_free_storage_info          (storage_info_t *info);
+static bool            modesetting_lun_flag                   (const char *mountpoint, const char *key, bool def);
+static gchar          *modesetting_write_cache_path           (const char *mountdev);
+static void            modesetting_set_write_cache            (const storage_info_t *info, size_t count);
+static void            modesetting_restore_write_cache        (void);
 static storage_info_t *modesetting_get_storage_info           (size_t *pcount);
 static bool            modesetting_enter_mass_storage_mode    (const modedata_t *data);
 static int             modesetting_leave_mass_storage_mode    (const modedata_t *data);
-static void            modesetting_report_mass_storage_blocker(const char *mountpoint, int try);
-bool                   modesetting_enter_dynamic_mode         (void);
-void                   modesetting_leave_dynamic_mode         (void);
+static bool            modesetting_path_on_device             (const char *path, const dev_t *devs, size_t count);
+static void            modesetting_report_mass_storage_blocker(const char **mountpoints);
+static bool            modesetting_same_gadget                (const modedata_t *prev, const modedata_t *next);
+unsigned               modesetting_plan_transition            (const modedata_t *prev, const modedata_t *next);
+static bool            modesetting_network_stage_cb           (void *aptr);
+static bool            modesetting_udhcpd_stage_cb            (void *aptr);
+static bool            modesetting_settle_stage_cb            (void *aptr);
+static bool            modesetting_appsync_post_stage_cb      (void *aptr);
+#ifdef CONNMAN
+static bool            modesetting_tethering_stage_cb         (void *aptr);
+#endif
+bool                   modesetting_enter_dynamic_mode         (unsigned steps);
+void                   modesetting_leave_dynamic_mode         (unsigned steps);
 void                   modesetting_init                       (void);
 void                   modesetting_quit                       (void);
 
@@ -94,6 +146,12 @@ void                   modesetting_quit                       (void);
 
 static GHashTable *tracked_values = 0;
 
+/** Block device write cache policies to restore: path -> original value
+ *
+ * Accessed only from the worker thread.
+ */
+static GHashTable *modesetting_saved_write_cache = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -269,6 +327,8 @@ int modesetting_write_to_file_real(const char *file, int line, const char *func,
         goto cleanup;
     }
 
+    trace_count(TRACE_COUNTER_SYSFS_WRITE);
+
     while( todo > 0 )
     {
         ssize_t n = TEMP_FAILURE_RETRY(write(fd, text, todo));
@@ -300,27 +360,95 @@ bool modesetting_is_mounted(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/mountpoint -q '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    return common_spawn(MODESETTING_MOUNT_TIMEOUT_MS,
+                        "/bin/mountpoint", "-q", mountpoint) == 0;
 }
 
 bool modesetting_mount(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/mount '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    return common_spawn(MODESETTING_MOUNT_TIMEOUT_MS,
+                        "/bin/mount", mountpoint) == 0;
 }
 
 bool modesetting_unmount(const char *mountpoint)
 {
     LOG_REGISTER_CONTEXT;
 
-    char cmd[256];
-    snprintf(cmd, sizeof cmd, "/bin/umount '%s'", mountpoint);
-    return common_system(cmd) == 0;
+    bool ack = umount2(mountpoint, 0) == 0;
+
+    if( !ack )
+        log_debug("%s: umount: %m", mountpoint);
+
+    return ack;
+}
+
+/** Wait callback for: mountpoint has been unmounted
+ *
+ * @param aptr  Mountpoint path (as void pointer)
+ *
+ * @return true if mountpoint got unmounted, false otherwise
+ */
+static bool
+modesetting_unmount_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *mountpoint = aptr;
+
+    if( umount2(mountpoint, 0) == 0 )
+        return true;
+
+    /* EINVAL = not a mountpoint (anymore) */
+    return errno == EINVAL;
+}
+
+/** Wait callback for: all listed mountpoints have been unmounted
+ *
+ * Unmounted entries are removed from the array, so that each call
+ * retries only the still mounted ones.
+ *
+ * @param aptr  NULL terminated array of mountpoint paths (as void pointer)
+ *
+ * @return true if all mountpoints got unmounted, false otherwise
+ */
+static bool
+modesetting_unmount_all_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char **pending = aptr;
+    size_t       keep    = 0;
+
+    for( size_t i = 0; pending[i]; ++i ) {
+        if( modesetting_unmount_cb((void *)pending[i]) )
+            log_debug("unmounted %s", pending[i]);
+        else
+            pending[keep++] = pending[i];
+    }
+    pending[keep] = 0;
+
+    return keep == 0;
+}
+
+/** Wait callback for: gadget has been enumerated by the host
+ *
+ * Network interface readiness is handled via pipeline stage
+ * dependencies, see #modesetting_enter_dynamic_mode().
+ *
+ * @param aptr  Dynamic mode data (as void pointer)
+ *
+ * @return true if ready for post appsync actions, false otherwise
+ */
+static bool
+modesetting_enumerated_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    return gadget_is_configured();
 }
 
 static gchar *modesetting_mountdev(const char *mountpoint)
@@ -359,11 +487,119 @@ modesetting_free_storage_info(storage_info_t *info)
         for( size_t i = 0; info[i].si_mountpoint; ++i ) {
             g_free(info[i].si_mountpoint);
             g_free(info[i].si_mountdevice);
+            g_free(info[i].si_write_cache);
         }
         g_free(info);
     }
 }
 
+/** Get boolean lun setting for mountpoint
+ */
+static bool
+modesetting_lun_flag(const char *mountpoint, const char *key, bool def)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *value = config_get_lun_setting(mountpoint, key);
+    bool   flag  = value ? strtol(value, 0, 0) != 0 : def;
+    g_free(value);
+    return flag;
+}
+
+/** Get path of write cache policy control for block device
+ *
+ * Partitions do not have queue settings of their own, the ones of the
+ * disk they are on are used instead.
+ *
+ * @param mountdev  block device path, e.g. /dev/mmcblk1p1
+ *
+ * @return sysfs path, or NULL; release with g_free()
+ */
+static gchar *
+modesetting_write_cache_path(const char *mountdev)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *path = 0;
+    char  *real = realpath(mountdev, 0);
+    gchar *base = g_path_get_basename(real ?: mountdev);
+    gchar *part = g_strdup_printf("/sys/class/block/%s/partition", base);
+
+    if( access(part, F_OK) == 0 )
+        path = g_strdup_printf("/sys/class/block/%s/../queue/write_cache", base);
+    else
+        path = g_strdup_printf("/sys/class/block/%s/queue/write_cache", base);
+
+    if( access(path, F_OK) == -1 ) {
+        log_warning("%s: write cache policy not available", mountdev);
+        g_free(path), path = 0;
+    }
+
+    g_free(part);
+    g_free(base);
+    free(real);
+
+    return path;
+}
+
+/** Apply configured write cache policies for backing devices
+ *
+ * Original values are restored by #modesetting_restore_write_cache().
+ */
+static void
+modesetting_set_write_cache(const storage_info_t *info, size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; i < count; ++i ) {
+        if( !info[i].si_write_cache )
+            continue;
+
+        gchar *path = modesetting_write_cache_path(info[i].si_mountdevice);
+        if( !path )
+            continue;
+
+        if( !modesetting_saved_write_cache )
+            modesetting_saved_write_cache =
+                g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+        if( !g_hash_table_contains(modesetting_saved_write_cache, path) ) {
+            char *prev = modesetting_read_from_file(path, 64);
+            if( prev ) {
+                g_hash_table_replace(modesetting_saved_write_cache,
+                                     g_strdup(path), g_strdup(prev));
+                free(prev);
+            }
+        }
+
+        write_to_file(path, info[i].si_write_cache);
+        g_free(path);
+    }
+}
+
+/** Restore write cache policies changed for mass storage mode
+ */
+static void
+modesetting_restore_write_cache(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if( !modesetting_saved_write_cache )
+        goto EXIT;
+
+    g_hash_table_iter_init(&iter, modesetting_saved_write_cache);
+    while( g_hash_table_iter_next(&iter, &key, &value) )
+        write_to_file(key, value);
+
+    g_hash_table_remove_all(modesetting_saved_write_cache);
+
+EXIT:
+    return;
+}
+
 static storage_info_t *
 modesetting_get_storage_info(size_t *pcount)
 {
@@ -394,9 +630,18 @@ modesetting_get_storage_info(size_t *pcount)
     /* Convert into array of storage_info_t objects */
     info = g_new0(storage_info_t, count + 1);
 
+    /* Global "No Force Unit Access", can be overridden per mountpoint */
+    bool nofua = config_find_sync() != 0;
+
     for( size_t i = 0; i < count; ++i ) {
         const gchar *mountpnt = info[i].si_mountpoint = g_strdup(array[i]);
 
+        info[i].si_nofua       = modesetting_lun_flag(mountpnt, FS_LUN_NOFUA_KEY, nofua);
+        info[i].si_ro          = modesetting_lun_flag(mountpnt, FS_LUN_RO_KEY, false);
+        info[i].si_removable   = modesetting_lun_flag(mountpnt, FS_LUN_REMOVABLE_KEY, true);
+        info[i].si_cdrom       = modesetting_lun_flag(mountpnt, FS_LUN_CDROM_KEY, false);
+        info[i].si_write_cache = config_get_lun_setting(mountpnt, FS_LUN_WRITE_CACHE_KEY);
+
         if( access(mountpnt, F_OK) == -1 ) {
             log_warning("mountpoint %s does not exist", mountpnt);
             goto EXIT;
@@ -431,12 +676,14 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
 {
     LOG_REGISTER_CONTEXT;
 
-    bool            ack   = false;
-    size_t          count = 0;
-    storage_info_t *info  = 0;
-    int             nofua = 0;
-
-    char tmp[256];
+    bool            ack     = false;
+    size_t          count   = 0;
+    storage_info_t *info    = 0;
+    const char    **pending = 0;
+    gadget_lun_t   *luns    = 0;
+    gchar          *stall   = 0;
+    gchar          *buffers = 0;
+    size_t          maxluns = gadget_max_luns();
 
     /* Get mountpoint info */
     if( !(info = modesetting_get_storage_info(&count)) )
@@ -445,112 +692,80 @@ static bool modesetting_enter_mass_storage_mode(const modedata_t *data)
     /* send unmount signal so applications can release their grasp on the fs, do this here so they have time to act */
     umdbus_send_event_signal(USB_PRE_UNMOUNT);
 
-    /* Get "No Force Unit Access" from config */
-    nofua = config_find_sync();
-
-    /* Android usb mass-storage is expected to support only onle lun */
-    if( android_in_use()&& count > 1 ) {
+    /* E.g. android usb mass-storage is expected to support only one lun */
+    if( maxluns && count > maxluns ) {
         log_warning("ignoring excess mountpoints");
-        count = 1;
+        count = maxluns;
     }
 
     /* Umount filesystems */
-    for( size_t i = 0 ; i < count; ++i )
+    pending = g_new0(const char *, count + 1);
+    for( size_t i = 0, n = 0; i < count; ++i )
     {
         const gchar *mountpnt = info[i].si_mountpoint;
-        for( int tries = 0; ; ) {
 
-            if( !modesetting_is_mounted(mountpnt) ) {
-                log_debug("%s is not mounted", mountpnt);
-                break;
-            }
-
-            if( modesetting_unmount(mountpnt) ) {
-                log_debug("unmounted %s", mountpnt);
-                break;
-            }
-
-            if( ++tries == 3 ) {
-                log_err("failed to unmount %s - giving up", mountpnt);
-                modesetting_report_mass_storage_blocker(mountpnt, 2);
-                umdbus_send_error_signal(UMOUNT_ERROR);
-                goto EXIT;
-            }
-
-            log_warning("failed to unmount %s - wait a bit", mountpnt);
-            modesetting_report_mass_storage_blocker(mountpnt, 1);
-            common_sleep(1);
-        }
+        if( !modesetting_is_mounted(mountpnt) )
+            log_debug("%s is not mounted", mountpnt);
+        else
+            pending[n++] = mountpnt;
     }
 
-    /* Backend specific actions */
-    if( android_in_use() ) {
-        const gchar *mountdev = info[0].si_mountdevice;
-        android_set_enabled(false);
-        android_set_function("mass_storage");
-        android_set_attr("f_mass_storage", "lun/nofua", nofua ? "1" : "0");
-        android_set_attr("f_mass_storage", "lun/file", mountdev);
-        android_set_enabled(true);
-    }
-    else if( configfs_in_use() ) {
-        configfs_set_udc(false);
-        configfs_set_function(0);
-
-        for( size_t i = 0 ; i < count; ++i ) {
-            const gchar *mountdev = info[i].si_mountdevice;
-            if( configfs_add_mass_storage_lun(i) ) {
-                configfs_set_mass_storage_attr(i, "cdrom", "0");
-                configfs_set_mass_storage_attr(i, "nofua", nofua ? "1" : "0");
-                configfs_set_mass_storage_attr(i, "removable", "1");
-                configfs_set_mass_storage_attr(i, "ro", "0");
-                configfs_set_mass_storage_attr(i, "file", mountdev);
-            }
+    if( !modesetting_unmount_all_cb(pending) ) {
+        /* Applications might still be releasing the filesystems in
+         * response to USB_PRE_UNMOUNT -> retry all of them together
+         * until they succeed, so that waiting does not add up per lun */
+        for( size_t i = 0; pending[i]; ++i )
+            log_warning("failed to unmount %s - wait a bit", pending[i]);
+        modesetting_report_mass_storage_blocker(pending);
+
+        if( common_wait_path(MODESETTING_UNMOUNT_TIMEOUT_MS, NULL,
+                             modesetting_unmount_all_cb,
+                             pending) != WAIT_READY ) {
+            for( size_t i = 0; pending[i]; ++i )
+                log_err("failed to unmount %s - giving up", pending[i]);
+            log_err("Setting Mass storage blocked. Giving up.\n");
+            umdbus_send_error_signal(UMOUNT_ERROR);
+            goto EXIT;
         }
-        configfs_set_function("mass_storage");
-        configfs_set_udc(true);
     }
-    else if( modules_in_use() ) {
-        /* check if the file storage module has been loaded with sufficient luns in the parameter,
-         * if not, unload and reload or load it. Since  mountpoints start at 0 the amount of them is one more than their id */
 
-        snprintf(tmp, sizeof tmp,
-                 "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/file",
-                 count - 1);
+    /* Backing device tuning */
+    modesetting_set_write_cache(info, count);
 
-        if( access(tmp, R_OK) == -1 )
-        {
-            log_debug("%s does not exist, unloading and reloading mass_storage\n", tmp);
-            modules_unload_module(MODULE_MASS_STORAGE);
-            snprintf(tmp, sizeof tmp, "modprobe %s luns=%zd", MODULE_MASS_STORAGE, count);
-            log_debug("usb-load command = %s", tmp);
-            if( common_system(tmp) != 0 )
-                goto EXIT;
-        }
-
-        /* activate mounts after sleeping 1s to be sure enumeration happened and autoplay will work in windows*/
-        common_sleep(1);
-
-        for( size_t i = 0 ; i < count; ++i ) {
-            const gchar *mountdev = info[i].si_mountdevice;
-
-            snprintf(tmp, sizeof tmp, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/nofua", i);
-            write_to_file(tmp, nofua ? "1" : "0");
-
-            snprintf(tmp, sizeof tmp, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/file", i);
-            write_to_file(tmp, mountdev);
-            log_debug("usb lun = %s active\n", mountdev);
-        }
+    /* Backend specific actions */
+    luns = g_new0(gadget_lun_t, count + 1);
+    for( size_t i = 0 ; i < count; ++i ) {
+        luns[i] = (gadget_lun_t) {
+            .gl_file      = info[i].si_mountdevice,
+            .gl_nofua     = info[i].si_nofua,
+            .gl_ro        = info[i].si_ro,
+            .gl_removable = info[i].si_removable,
+            .gl_cdrom     = info[i].si_cdrom,
+        };
     }
-    else {
-        log_err("no suitable backend for mass-storage mode");
+
+    stall   = config_get_mass_storage_setting(FS_STORAGE_STALL_KEY);
+    buffers = config_get_mass_storage_setting(FS_STORAGE_NUM_BUFFERS_KEY);
+
+    gadget_config_t config = {
+        .gc_functions      = "mass_storage",
+        .gc_luns           = luns,
+        .gc_lun_count      = count,
+        .gc_ms_stall       = stall,
+        .gc_ms_num_buffers = buffers,
+    };
+    if( !gadget_apply(&config) )
         goto EXIT;
-    }
 
     /* Success */
     ack = true;
 
 EXIT:
 
+    g_free(buffers);
+    g_free(stall);
+    g_free(luns);
+    g_free(pending);
     modesetting_free_storage_info(info);
 
     if( ack ) {
@@ -583,39 +798,10 @@ static int modesetting_leave_mass_storage_mode(const modedata_t *data)
         goto EXIT;
 
     /* Backend specific actions */
-    if( android_in_use() ) {
-        log_debug("Disable android mass storage\n");
-        android_set_enabled(false);
-        android_set_attr("f_mass_storage", "lun/file", "");
-    }
-    else if( configfs_in_use() ) {
-        log_debug("Disable configfs mass storage\n");
-        configfs_set_udc(false);
-        configfs_set_function(0);
-
-        // reset lun0, remove the rest altogether
-        for( size_t i = 0 ; i < count; ++i ) {
-            // reset
-            configfs_set_mass_storage_attr(i, "cdrom", "0");
-            configfs_set_mass_storage_attr(i, "nofua", "0");
-            configfs_set_mass_storage_attr(i, "removable", "1");
-            configfs_set_mass_storage_attr(i, "ro", "0");
-            configfs_set_mass_storage_attr(i, "file", "");
-            // remove
-            if( i > 0 )
-                configfs_remove_mass_storage_lun(i);
-        }
-    }
-    else if( modules_in_use() ) {
-        for( size_t i = 0 ; i < count; ++i ) {
-            snprintf(tmp, sizeof tmp, "/sys/devices/platform/musb_hdrc/gadget/gadget-lun%zd/file", i);
-            write_to_file(tmp, "");
-            log_debug("usb lun = %s inactive\n", tmp);
-        }
-    }
-    else {
-        log_err("no suitable backend for mass-storage mode");
-    }
+    gadget_clear_luns(count);
+
+    /* Backing device tuning */
+    modesetting_restore_write_cache();
 
     /* Assume success i.e. all the mountpoints that could have been
      * unmounted due to mass-storage mode are mounted again. */
@@ -662,44 +848,306 @@ EXIT:
     return ack;
 }
 
-static void modesetting_report_mass_storage_blocker(const char *mountpoint, int try)
+/** Check if path resides on one of the given devices
+ *
+ * @param path   Path to check, symlinks are followed
+ * @param devs   Array of device numbers
+ * @param count  Number of entries in devs
+ *
+ * @return true if path is on one of the devices, false otherwise
+ */
+static bool modesetting_path_on_device(const char *path, const dev_t *devs, size_t count)
 {
     LOG_REGISTER_CONTEXT;
 
-    FILE *stream = 0;
-    gchar *lsof_command = 0;
-    int count = 0;
+    struct stat st;
 
-    lsof_command = g_strconcat("lsof ", mountpoint, NULL);
+    if( stat(path, &st) == -1 )
+        return false;
 
-    if( (stream = common_popen(lsof_command, "r")) )
-    {
-        char *text = 0;
-        size_t size = 0;
+    for( size_t i = 0; i < count; ++i ) {
+        if( st.st_dev == devs[i] )
+            return true;
+    }
+    return false;
+}
 
-        while( getline(&text, &size, stream) >= 0 )
-        {
-            /* skip the first line as it does not contain process info */
-            if(count != 0)
-            {
-                gchar **split = 0;
-                split = g_strsplit((const gchar*)text, " ", 2);
-                log_err("Mass storage blocked by process %s\n", split[0]);
-                umdbus_send_error_signal(split[0]);
-                g_strfreev(split);
+/** Report processes that keep mountpoints busy
+ *
+ * Scans /proc once for processes that have cwd, root, executable or
+ * open files on any of the given filesystems - like fuser -m does.
+ *
+ * @param mountpoints  NULL terminated array of mountpoint paths
+ */
+static void modesetting_report_mass_storage_blocker(const char **mountpoints)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char * const links[] = { "cwd", "root", "exe" };
+
+    DIR    *proc  = 0;
+    dev_t  *devs  = 0;
+    size_t  count = 0;
+
+    for( count = 0; mountpoints[count]; ++count )
+        ;
+    devs = g_new0(dev_t, count + 1);
+
+    for( size_t i = 0; i < count; ++i ) {
+        struct stat st;
+        if( stat(mountpoints[i], &st) == 0 )
+            devs[i] = st.st_dev;
+    }
+
+    if( !(proc = opendir("/proc")) )
+        goto EXIT;
+
+    struct dirent *pde;
+    while( (pde = readdir(proc)) ) {
+        char  path[PATH_MAX];
+        bool  busy = false;
+        pid_t pid  = (pid_t)strtol(pde->d_name, 0, 10);
+
+        if( pid <= 0 || pid == getpid() )
+            continue;
+
+        for( size_t i = 0; !busy && i < G_N_ELEMENTS(links); ++i ) {
+            snprintf(path, sizeof path, "/proc/%d/%s", (int)pid, links[i]);
+            busy = modesetting_path_on_device(path, devs, count);
+        }
+
+        snprintf(path, sizeof path, "/proc/%d/fd", (int)pid);
+        DIR *fds = busy ? 0 : opendir(path);
+        if( fds ) {
+            struct dirent *fde;
+            while( !busy && (fde = readdir(fds)) ) {
+                if( *fde->d_name == '.' )
+                    continue;
+                snprintf(path, sizeof path, "/proc/%d/fd/%s",
+                         (int)pid, fde->d_name);
+                busy = modesetting_path_on_device(path, devs, count);
             }
-            count++;
+            closedir(fds);
+        }
+
+        if( !busy )
+            continue;
+
+        snprintf(path, sizeof path, "/proc/%d/comm", (int)pid);
+        char *name = modesetting_read_from_file(path, 64);
+        if( name ) {
+            log_err("Mass storage blocked by process %s\n", name);
+            umdbus_send_error_signal(name);
+            free(name);
         }
-        pclose(stream);
-        free(text);
     }
-    g_free(lsof_command);
-    if(try == 2)
-        log_err("Setting Mass storage blocked. Giving up.\n");
 
+EXIT:
+    if( proc )
+        closedir(proc);
+    g_free(devs);
+}
+
+/** Check if two modes use identical gadget configuration
+ *
+ * @param prev  Mode data for the outgoing mode
+ * @param next  Mode data for the incoming mode
+ *
+ * @return true if functions and usb ids are the same, false otherwise
+ */
+static bool modesetting_same_gadget(const modedata_t *prev, const modedata_t *next)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return (!g_strcmp0(prev->sysfs_value, next->sysfs_value) &&
+            !g_strcmp0(prev->idProduct, next->idProduct) &&
+            !g_strcmp0(prev->idVendorOverride, next->idVendorOverride) &&
+            !g_strcmp0(prev->android_extra_sysfs_path, next->android_extra_sysfs_path) &&
+            !g_strcmp0(prev->android_extra_sysfs_value, next->android_extra_sysfs_value) &&
+            !g_strcmp0(prev->android_extra_sysfs_path2, next->android_extra_sysfs_path2) &&
+            !g_strcmp0(prev->android_extra_sysfs_value2, next->android_extra_sysfs_value2) &&
+            prev->net_qmult == next->net_qmult &&
+            !g_strcmp0(prev->net_host_addr, next->net_host_addr) &&
+            !g_strcmp0(prev->net_dev_addr, next->net_dev_addr));
+}
+
+/** Figure out which steps a dynamic mode switch needs to execute
+ *
+ * The returned steps should be passed to both
+ * #modesetting_leave_dynamic_mode() for the outgoing mode and
+ * #modesetting_enter_dynamic_mode() for the incoming mode.
+ *
+ * For example switching between two rndis based modes does
+ * not need to bounce the network interface.
+ *
+ * @param prev  Mode data for the outgoing mode, or NULL
+ * @param next  Mode data for the incoming mode, or NULL
+ *
+ * @return bitmask of #modesetting_step_t values
+ */
+unsigned modesetting_plan_transition(const modedata_t *prev, const modedata_t *next)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned steps = MODESETTING_STEP_ALL;
+
+    if( !prev || !next )
+        goto EXIT;
+
+    /* Mass storage handling does not mix with anything */
+    if( prev->mass_storage || next->mass_storage )
+        goto EXIT;
+
+    /* Kernel module reload resets everything anyway */
+    if( g_strcmp0(prev->mode_module, next->mode_module) )
+        goto EXIT;
+
+    bool same_gadget = modesetting_same_gadget(prev, next);
+    if( same_gadget )
+        steps &= ~MODESETTING_STEP_GADGET;
+
+    /* Ip forwarding cleanup is tied to bringing the interface down,
+     * so nat setting must match too. With some backends (configfs)
+     * the network interface persists over gadget function changes. */
+    if( prev->network && next->network && prev->nat == next->nat &&
+        !g_strcmp0(prev->network_interface, next->network_interface) &&
+        (same_gadget || gadget_keeps_netif()) ) {
+        steps &= ~MODESETTING_STEP_NETWORK;
+        if( prev->dhcp_server == next->dhcp_server )
+            steps &= ~MODESETTING_STEP_UDHCPD;
+    }
+
+#ifdef CONNMAN
+    if( prev->connman_tethering &&
+        !g_strcmp0(prev->connman_tethering, next->connman_tethering) )
+        steps &= ~MODESETTING_STEP_TETHERING;
+#endif
+
+EXIT:
+    log_debug("transition %s -> %s: steps = 0x%x",
+              prev ? prev->mode_name : "n/a",
+              next ? next->mode_name : "n/a",
+              steps);
+    return steps;
+}
+
+/** Pipeline stage: bring up network interface
+ *
+ * @param aptr  Mode data
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_network_stage_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const modedata_t *data = aptr;
+
+    log_debug("Dynamic mode is network");
+#ifdef DEBIAN
+    common_spawn(MODESETTING_IFUPDOWN_TIMEOUT_MS,
+                 "ifdown", data->network_interface);
+    common_spawn(MODESETTING_IFUPDOWN_TIMEOUT_MS,
+                 "ifup", data->network_interface);
+    return true;
+#else
+    int error = -1;
+    network_down(data);
+
+    /* Instead of blindly retrying, wait for the kernel to
+     * report the interface via rtnetlink and configure it once */
+    if( network_wait_present(data, MODESETTING_NETWORK_WAIT_TIMEOUT_MS) )
+        error = network_up(data);
+    else
+        log_warning("Network interface did not show up");
+    if( error )
+        log_err("Setting up the network failed");
+    return error == 0;
+#endif /* DEBIAN */
+}
+
+/** Pipeline stage: update dhcp server configuration
+ *
+ * @param aptr  Mode data
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_udhcpd_stage_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const modedata_t *data = aptr;
+
+    /* FIXME: The used condition is a bit questionable as dhcpd
+     * service is started based on appsync config - i.e. NOT
+     * based on either nat or setting in modedata ...
+     */
+    return network_update_udhcpd_config(data) == 0;
+}
+
+/** Pipeline stage: wait for usb enumeration
+ *
+ * Waits for a bit (max 350ms); proceeding without confirmed
+ * enumeration is not considered a failure.
+ *
+ * @param aptr  Mode data
+ *
+ * @return true
+ */
+static bool modesetting_settle_stage_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( common_wait_path(MODESETTING_SETTLE_TIMEOUT_MS, NULL,
+                         modesetting_enumerated_cb, aptr) != WAIT_READY )
+        log_debug("Enumeration not confirmed; proceeding anyway");
+    return true;
+}
+
+/** Pipeline stage: start post-enum applications
+ *
+ * Failures are not fatal for the mode switch.
+ *
+ * @param aptr  Mode data
+ *
+ * @return true
+ */
+static bool modesetting_appsync_post_stage_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const modedata_t *data = aptr;
+
+    log_debug("Dynamic mode is appsync: do post actions");
+    appsync_activate_post(data->mode_name);
+    return true;
 }
 
-bool modesetting_enter_dynamic_mode(void)
+#ifdef CONNMAN
+/** Pipeline stage: start tethering
+ *
+ * @param aptr  Mode data
+ *
+ * @return true on success, false on failure
+ */
+static bool modesetting_tethering_stage_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const modedata_t *data = aptr;
+
+    log_debug("Dynamic mode is tethering");
+    return connman_set_tethering(data->connman_tethering, true);
+}
+#endif
+
+/** Set up current dynamic mode
+ *
+ * @param steps  Steps to execute, see #modesetting_plan_transition()
+ *
+ * @return true on success, false on failure
+ */
+bool modesetting_enter_dynamic_mode(unsigned steps)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -730,6 +1178,7 @@ bool modesetting_enter_dynamic_mode(void)
     log_debug("data->idVendorOverride = %s", data->idVendorOverride ?: "n/a");
     log_debug("data->nat = %d", data->nat);
     log_debug("data->dhcp_server = %d", data->dhcp_server);
+    log_debug("steps = 0x%x", steps);
 
     /* - - - - - - - - - - - - - - - - - - - *
      * Is a mass storage dynamic mode?
@@ -759,107 +1208,82 @@ bool modesetting_enter_dynamic_mode(void)
      * Configure gadget
      * - - - - - - - - - - - - - - - - - - - */
 
-    if( configfs_in_use() ) {
-        /* Configfs based gadget configuration */
-        configfs_set_function(data->sysfs_value);
-        configfs_set_productid(data->idProduct);
-        char *id = config_get_android_vendor_id();
-        configfs_set_vendorid(data->idVendorOverride ?: id);
-        free(id);
-        if( !configfs_set_udc(true) )
-            goto EXIT;
+    if( !(steps & MODESETTING_STEP_GADGET) ) {
+        /* Already configured by the previous mode */
+        log_debug("gadget configuration retained");
     }
-    else if( android_in_use() ) {
-        /* Android USB based gadget configuration */
-        android_set_function(data->sysfs_value);
-        android_set_productid(data->idProduct);
+    else {
         char *id = config_get_android_vendor_id();
-        android_set_vendorid(data->idVendorOverride ?: id);
+        /* Unless the mode overrides it, use the persistent address
+         * also for ncm / ecm host side interface - otherwise kernel
+         * assigns a random one and hosts redo network setup. */
+        char *mac = data->net_host_addr ? 0 : mac_read_mac();
+        gadget_config_t config = {
+            .gc_functions   = data->sysfs_value,
+            .gc_productid   = data->idProduct,
+            .gc_vendorid    = data->idVendorOverride ?: id,
+            .gc_extra_path  = {
+                data->android_extra_sysfs_path,
+                data->android_extra_sysfs_path2,
+            },
+            .gc_extra_value = {
+                data->android_extra_sysfs_value,
+                data->android_extra_sysfs_value2,
+            },
+            .gc_net_qmult     = data->net_qmult,
+            .gc_net_host_addr = data->net_host_addr ?: mac,
+            .gc_net_dev_addr  = data->net_dev_addr,
+        };
+        bool applied = gadget_apply(&config);
+        free(mac);
         free(id);
-        write_to_file(data->android_extra_sysfs_path, data->android_extra_sysfs_value);
-        write_to_file(data->android_extra_sysfs_path2, data->android_extra_sysfs_value2);
-        if( !android_set_enabled(true) )
+        if( !applied )
             goto EXIT;
     }
-    else if( modules_in_use() ) {
-        /* Assume relevant module has already been successfully loaded
-         * from somewhere else.
-         */
-        // nop
-    }
-    else {
-        log_crit("no backend is selected, can't set dynamic mode");
-        goto EXIT;
-    }
 
     /* - - - - - - - - - - - - - - - - - - - *
-     * Setup network
+     * Post gadget stages
      * - - - - - - - - - - - - - - - - - - - */
 
-    /* functionality should be enabled, so we can enable the network now */
-    if(data->network)
-    {
-        log_debug("Dynamic mode is network");
-#ifdef DEBIAN
-        char command[256];
-
-        g_snprintf(command, sizeof command, "ifdown %s ; ifup %s", data->network_interface, data->network_interface);
-        common_system(command);
-#else
-        network_down(data);
-        int error = network_up(data);
-
-        /* In case of failure, retry upto 3 times */
-        for( int i = 0; error && i < 3; ++i ) {
-            log_warning("Retry setting up the network");
-            if( !common_msleep(1000) )
-                break;
-            if( !(error = network_up(data)) )
-                log_warning("Setting up the network succeeded");
-        }
-        if( error ) {
-            log_err("Setting up the network failed");
-            goto EXIT;
-        }
-#endif /* DEBIAN */
-    }
-
-    /* Needs to be called before application post synching so
+    /* Network setup needs only the interface to exist, while post-enum
+     * app sync waits for enumeration - run them in parallel, and start
+     * each stage as soon as what it depends on has been done. */
+    pipeline_t *pipe    = pipeline_create();
+    void       *aptr    = (void *)data;
+    unsigned    network = 0;
+    unsigned    udhcpd  = 0;
+
+    if( data->network && !(steps & MODESETTING_STEP_NETWORK) )
+        log_debug("network setup retained");
+    else if( data->network )
+        network = pipeline_add(pipe, "network_up",
+                               modesetting_network_stage_cb, aptr, 0);
+
+    /* Needs to be done before application post synching so
      * that the dhcp server has the right config */
-    if(data->nat || data->dhcp_server) {
-        /* FIXME: The used condition is a bit questionable as dhcpd
-         * service is started based on appsync config - i.e. NOT
-         * based on either nat or setting in modedata ...
-         */
-        if( network_update_udhcpd_config(data) != 0 )
-            goto EXIT;
-    }
-
-    /* - - - - - - - - - - - - - - - - - - - *
-     * Start post-enum app sync
-     * - - - - - - - - - - - - - - - - - - - */
+    if( (data->nat || data->dhcp_server) && (steps & MODESETTING_STEP_UDHCPD) )
+        udhcpd = pipeline_add(pipe, "udhcpd_config",
+                              modesetting_udhcpd_stage_cb, aptr, network);
 
-    /* no need to execute the post sync if there was an error setting the mode */
-    if(data->appsync )
-    {
-        log_debug("Dynamic mode is appsync: do post actions");
-        /* let's sleep for a bit (350ms) to allow interfaces to settle before running postsync */
-        common_msleep(350);
-        appsync_activate_post(data->mode_name);
+    if( data->appsync ) {
+        unsigned settle = pipeline_add(pipe, "settle",
+                                       modesetting_settle_stage_cb, aptr, 0);
+        pipeline_add(pipe, "appsync_post",
+                     modesetting_appsync_post_stage_cb, aptr,
+                     settle | network | udhcpd);
     }
 
-    /* - - - - - - - - - - - - - - - - - - - *
-     * Start tethering
-     * - - - - - - - - - - - - - - - - - - - */
-
 #ifdef CONNMAN
-    if( data->connman_tethering ) {
-        log_debug("Dynamic mode is tethering");
-        if( !connman_set_tethering(data->connman_tethering, true) )
-            goto EXIT;
-    }
+    if( data->connman_tethering && (steps & MODESETTING_STEP_TETHERING) )
+        pipeline_add(pipe, "tethering",
+                     modesetting_tethering_stage_cb, aptr, network | udhcpd);
 #endif
 
+    bool done = pipeline_run(pipe);
+    pipeline_delete(pipe);
+    if( !done )
+        goto EXIT;
+
     ack = true;
 
 EXIT:
@@ -868,7 +1292,11 @@ EXIT:
     return ack;
 }
 
-void modesetting_leave_dynamic_mode(void)
+/** Tear down current dynamic mode
+ *
+ * @param steps  Steps to execute, see #modesetting_plan_transition()
+ */
+void modesetting_leave_dynamic_mode(unsigned steps)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -890,6 +1318,7 @@ void modesetting_leave_dynamic_mode(void)
 #endif
     log_debug("data->appsync = %d", data->appsync);
     log_debug("data->network = %d", data->network);
+    log_debug("steps = 0x%x", steps);
 
     /* - - - - - - - - - - - - - - - - - - - *
      * Is a mass storage dynamic mode?
@@ -906,7 +1335,7 @@ void modesetting_leave_dynamic_mode(void)
      * - - - - - - - - - - - - - - - - - - - */
 
 #ifdef CONNMAN
-    if( data->connman_tethering ) {
+    if( data->connman_tethering && (steps & MODESETTING_STEP_TETHERING) ) {
         log_debug("Dynamic mode was tethering");
         connman_set_tethering(data->connman_tethering, false);
     }
@@ -926,7 +1355,7 @@ void modesetting_leave_dynamic_mode(void)
      * Teardown network
      * - - - - - - - - - - - - - - - - - - - */
 
-    if( data->network ) {
+    if( data->network && (steps & MODESETTING_STEP_NETWORK) ) {
         log_debug("Dynamic mode was network");
         network_down(data);
     }
@@ -935,22 +1364,12 @@ void modesetting_leave_dynamic_mode(void)
      * Configure gadget
      * - - - - - - - - - - - - - - - - - - - */
 
-    if( configfs_in_use() ) {
-        /* Leave as is. We will reprogram wnen mode is
-         * set, not when it is unset.
-         */
-    }
-    else if( android_in_use() ) {
-        /* Leave as is. We will reprogram wnen mode is
-         * set, not when it is unset.
-         */
-    }
-    else if( modules_in_use() ) {
-        /* Assume unloading happens somewhere else */
-    }
-    else {
+    /* Leave as is. We will reprogram wnen mode is set, not when
+     * it is unset. With kernel modules, assume unloading happens
+     * somewhere else.
+     */
+    if( !gadget_get_backend() )
         log_crit("no backend is selected, can't unset dynamic mode");
-    }
 
     /* - - - - - - - - - - - - - - - - - - - *
      * Stop pre-enum app sync
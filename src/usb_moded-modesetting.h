@@ -30,8 +30,31 @@
 #ifndef  USB_MODED_MODESETTING_H_
 # define USB_MODED_MODESETTING_H_
 
+# include "usb_moded-dyn-config.h"
+
 # include <stdbool.h>
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Dynamic mode setup / teardown steps that can be skipped
+ *
+ * When switching between two dynamic modes, steps dealing with
+ * state that is the same in both modes do not need to be redone.
+ *
+ * Appsync and mass storage handling is always executed.
+ */
+typedef enum modesetting_step_t
+{
+    MODESETTING_STEP_GADGET    = 1 << 0, /**< Gadget functions and usb ids */
+    MODESETTING_STEP_NETWORK   = 1 << 1, /**< Network interface setup */
+    MODESETTING_STEP_UDHCPD    = 1 << 2, /**< udhcpd config and ip forwarding */
+    MODESETTING_STEP_TETHERING = 1 << 3, /**< Connman tethering */
+
+    MODESETTING_STEP_ALL       = (1 << 4) - 1,
+} modesetting_step_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -40,15 +63,16 @@
  * MODESETTING
  * ------------------------------------------------------------------------- */
 
-void modesetting_verify_values     (void);
-int  modesetting_write_to_file_real(const char *file, int line, const char *func, const char *path, const char *text);
-bool modesetting_is_mounted        (const char *mountpoint);
-bool modesetting_mount             (const char *mountpoint);
-bool modesetting_unmount           (const char *mountpoint);
-bool modesetting_enter_dynamic_mode(void);
-void modesetting_leave_dynamic_mode(void);
-void modesetting_init              (void);
-void modesetting_quit              (void);
+void     modesetting_verify_values     (void);
+int      modesetting_write_to_file_real(const char *file, int line, const char *func, const char *path, const char *text);
+bool     modesetting_is_mounted        (const char *mountpoint);
+bool     modesetting_mount             (const char *mountpoint);
+bool     modesetting_unmount           (const char *mountpoint);
+unsigned modesetting_plan_transition   (const modedata_t *prev, const modedata_t *next);
+bool     modesetting_enter_dynamic_mode(unsigned steps);
+void     modesetting_leave_dynamic_mode(unsigned steps);
+void     modesetting_init              (void);
+void     modesetting_quit              (void);
 
 /* ========================================================================= *
  * Macros
@@ -30,12 +30,21 @@
 
 #include "usb_moded-modules.h"
 
+#include "usb_moded.h"
+#include "usb_moded-common.h"
+#include "usb_moded-config-private.h"
 #include "usb_moded-log.h"
+#include "usb_moded-modesetting.h"
+
+#include <unistd.h>
+#include <stdio.h>
 
 #include <libkmod.h>
 
 #include <glib.h>
 
+#include <pthread.h> // NOTRIM
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -44,18 +53,65 @@
  * MODULES
  * ------------------------------------------------------------------------- */
 
-static bool modules_have_module  (const char *module);
-bool        modules_in_use       (void);
-static bool modules_probe        (void);
-bool        modules_init         (void);
-void        modules_quit         (void);
-int         modules_load_module  (const char *module);
-int         modules_unload_module(const char *module);
+static bool                modules_have_module              (const char *module);
+bool                       modules_in_use                   (void);
+static bool                modules_probe                    (void);
+static void                modules_parse_spec               (const char *module, gchar **name, gchar **options);
+static struct kmod_module *modules_get_handle               (const char *name);
+static void                modules_resolve_handles          (void);
+static void               *modules_preload_cb               (void *aptr);
+static void                modules_preload                  (void);
+bool                       modules_init                     (void);
+void                       modules_quit                     (void);
+int                        modules_load_module              (const char *module);
+int                        modules_load_module_with_options (const char *module, const char *options);
+int                        modules_unload_module            (const char *module);
+static bool                modules_lun_ready_cb             (void *aptr);
+static bool                modules_gadget_apply             (const gadget_config_t *config);
+static bool                modules_gadget_clear_luns        (size_t count);
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Gadget directory exposed by mass storage kernel modules */
+#define MODULES_GADGET_DIRECTORY "/sys/devices/platform/musb_hdrc/gadget"
+
+/** Maximum time to wait for enumeration before activating luns [ms] */
+#define MODULES_ENUMERATE_TIMEOUT_MS 1000
 
 /* ========================================================================= *
  * Data
  * ========================================================================= */
 
+/** Gadget backend operations for kernel modules
+ *
+ * Charging mode is handled by the worker, which keeps track of the
+ * currently loaded kernel module.
+ */
+const gadget_backend_t modules_gadget_backend =
+{
+    .gb_name          = "modules",
+    .gb_max_luns      = 0,
+    .gb_keeps_netif   = false,
+    .gb_in_use        = modules_in_use,
+    .gb_apply         = modules_gadget_apply,
+    .gb_clear_luns    = modules_gadget_clear_luns,
+    .gb_set_charging  = 0,
+    .gb_is_configured = common_udc_is_configured,
+    .gb_take_adopted  = 0,
+    .gb_get_ifname    = 0,
+};
+
+/** Modules that are checked for on startup, and preloaded if enabled */
+static const char * const modules_known[] = {
+    MODULE_MASS_STORAGE,
+    MODULE_FILE_STORAGE,
+    MODULE_DEVELOPER,
+    MODULE_MTP,
+    0
+};
+
 /** Availability of kernel module based gadget configuration functionality
  *
  * -1 = not checked yet
@@ -68,6 +124,14 @@ static int modules_probed = -1;
  *  and cleaned up by ctx_cleanup() functions */
 static struct kmod_ctx *modules_ctx = 0;
 
+/** Module name -> struct kmod_module lookup table
+ *
+ * Handles for the modules used by dynamic modes are resolved at
+ * modules_init(), so that mode switches do not need to go through
+ * kmod module lookup.
+ */
+static GHashTable *modules_handles = 0;
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -112,21 +176,13 @@ static bool modules_probe(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    static const char * const lut[] = {
-        MODULE_MASS_STORAGE,
-        MODULE_FILE_STORAGE,
-        MODULE_DEVELOPER,
-        MODULE_MTP,
-        0
-    };
-
     if( modules_probed == -1 ) {
         modules_probed = false;
         /* Check if we have at least one of the kernel modules we
          * expect to use for something.
          */
-        for( size_t i = 0; lut[i] ; ++i ) {
-            if( modules_have_module(lut[i]) ) {
+        for( size_t i = 0; modules_known[i] ; ++i ) {
+            if( modules_have_module(modules_known[i]) ) {
                 modules_probed = true;
                 break;
             }
@@ -137,6 +193,192 @@ static bool modules_probe(void)
     return modules_in_use();
 }
 
+/** Split module specification to module name and options
+ *
+ * Module specifications used in dynamic mode configuration can
+ * contain module options after the name, e.g. MODULE_CHARGING.
+ *
+ * @param module   Module specification
+ * @param name     Where to store module name
+ * @param options  Where to store module options, or NULL if none
+ */
+static void modules_parse_spec(const char *module, gchar **name, gchar **options)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* since the mass_storage module is the newer one and we check against it to avoid
+     * loading failures we use it here, as we fall back to g_file_storage if g_mass_storage
+     * fails to load */
+    if(!strcmp(module, MODULE_CHARGING) || !strcmp(module, MODULE_CHARGE_FALLBACK))
+        module = MODULE_CHARGE_FALLBACK;
+
+    const char *end = strchr(module, ' ');
+
+    if( !end ) {
+        *name    = g_strdup(module);
+        *options = 0;
+    }
+    else {
+        *name    = g_strndup(module, end - module);
+        *options = g_strdup(end + 1);
+    }
+}
+
+/** Get kmod handle for a module
+ *
+ * @param name  Module name, without options
+ *
+ * @return kmod module handle owned by lookup table, or NULL
+ */
+static struct kmod_module *modules_get_handle(const char *name)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct kmod_module *mod = 0;
+
+    if( !modules_ctx )
+        goto EXIT;
+
+    if( !modules_handles )
+        modules_handles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify)kmod_module_unref);
+
+    if( (mod = g_hash_table_lookup(modules_handles, name)) )
+        goto EXIT;
+
+    if( kmod_module_new_from_name(modules_ctx, name, &mod) < 0 ) {
+        mod = 0;
+        goto EXIT;
+    }
+
+    /* since kmod_module_new_from_name does not check if the module
+     * exists we test it's path in case we deal with the mass-storage one */
+    if( !strcmp(name, MODULE_MASS_STORAGE) &&
+        kmod_module_get_path(mod) == NULL ) {
+        log_debug("Fallback on older g_file_storage\n");
+        kmod_module_unref(mod), mod = 0;
+        if( kmod_module_new_from_name(modules_ctx, MODULE_FILE_STORAGE, &mod) < 0 ) {
+            mod = 0;
+            goto EXIT;
+        }
+    }
+
+    g_hash_table_replace(modules_handles, g_strdup(name), mod);
+
+EXIT:
+    return mod;
+}
+
+/** Resolve kmod handles for known modules and those used by dynamic modes
+ */
+static void modules_resolve_handles(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; modules_known[i]; ++i )
+        modules_get_handle(modules_known[i]);
+
+    for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) ) {
+        const modedata_t *data = iter->data;
+        if( !data->mode_module || !strcmp(data->mode_module, MODULE_NONE) )
+            continue;
+
+        gchar *name    = 0;
+        gchar *options = 0;
+        modules_parse_spec(data->mode_module, &name, &options);
+        modules_get_handle(name);
+        g_free(options);
+        g_free(name);
+    }
+
+    log_debug("resolved %u module handles",
+              modules_handles ? g_hash_table_size(modules_handles) : 0);
+}
+
+/** Thread function for preloading module dependencies
+ *
+ * Uses a kmod context of its own, so that the worker thread is free
+ * to load / unload modules at the same time.
+ *
+ * @param aptr  NULL terminated array of module names (as void pointer)
+ *
+ * @return NULL
+ */
+static void *modules_preload_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar          **names = aptr;
+    struct kmod_ctx *ctx   = 0;
+
+    if( !(ctx = kmod_new(NULL, NULL)) )
+        goto EXIT;
+
+    for( size_t i = 0; names[i]; ++i ) {
+        struct kmod_module *mod  = 0;
+        struct kmod_list   *deps = 0;
+        struct kmod_list   *item = 0;
+
+        if( kmod_module_new_from_name(ctx, names[i], &mod) < 0 )
+            continue;
+
+        /* Loading the gadget driver itself would bind it to the
+         * udc, so only the modules it depends on are inserted */
+        deps = kmod_module_get_dependencies(mod);
+        kmod_list_foreach(item, deps) {
+            struct kmod_module *dep = kmod_module_get_module(item);
+            if( kmod_module_probe_insert_module(dep, KMOD_PROBE_APPLY_BLACKLIST,
+                                                NULL, NULL, NULL, NULL) == 0 )
+                log_debug("preloaded %s for %s", kmod_module_get_name(dep),
+                          names[i]);
+            kmod_module_unref(dep);
+        }
+        kmod_module_unref_list(deps);
+        kmod_module_unref(mod);
+    }
+
+EXIT:
+    if( ctx )
+        kmod_unref(ctx);
+    g_strfreev(names);
+
+    return 0;
+}
+
+/** Preload dependencies of gadget modules in background, if enabled
+ */
+static void modules_preload(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pthread_t      tid;
+    pthread_attr_t attr;
+    gchar        **names = 0;
+
+    if( !config_get_modules_preload() || !modules_handles )
+        goto EXIT;
+
+    GHashTableIter iter;
+    gpointer       key;
+    size_t         count = 0;
+
+    names = g_new0(gchar *, g_hash_table_size(modules_handles) + 1);
+    g_hash_table_iter_init(&iter, modules_handles);
+    while( g_hash_table_iter_next(&iter, &key, 0) )
+        names[count++] = g_strdup(key);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if( pthread_create(&tid, &attr, modules_preload_cb, names) != 0 )
+        log_warning("module preload thread: %m");
+    else
+        names = 0;
+    pthread_attr_destroy(&attr);
+
+EXIT:
+    g_strfreev(names);
+}
+
 /** kmod module init
  *
  * @return true if modules backend is ready for use, false otherwise
@@ -158,6 +400,9 @@ bool modules_init(void)
     if( !modules_probe() )
         goto EXIT;
 
+    modules_resolve_handles();
+    modules_preload();
+
     ack = true;
 EXIT:
     return ack;
@@ -168,6 +413,9 @@ void modules_quit(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    if( modules_handles )
+        g_hash_table_unref(modules_handles), modules_handles = 0;
+
     if( modules_ctx )
         kmod_unref(modules_ctx), modules_ctx = 0;
 }
@@ -182,12 +430,29 @@ int modules_load_module(const char *module)
 {
     LOG_REGISTER_CONTEXT;
 
-    int ret = 0;
+    return modules_load_module_with_options(module, NULL);
+}
 
-    const int probe_flags = KMOD_PROBE_APPLY_BLACKLIST;
-    struct kmod_module *mod;
-    char *charging_args = NULL;
-    char *load = NULL;
+/** load module with additional options
+ *
+ * Options are passed to kmod in addition to the ones present in the
+ * module specification and modprobe configuration.
+ *
+ * @param module   Name of the module to load
+ * @param options  Extra module options, or NULL
+ *
+ * @return 0 on success, non-zero on failure
+ */
+int modules_load_module_with_options(const char *module, const char *options)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int ret = -1;
+
+    const int           probe_flags = KMOD_PROBE_APPLY_BLACKLIST;
+    struct kmod_module *mod  = 0;
+    gchar              *name = 0;
+    gchar              *args = 0;
 
     if(!strcmp(module, MODULE_NONE))
         return 0;
@@ -197,50 +462,24 @@ int modules_load_module(const char *module)
         return -1;
     }
 
-    /* copy module to load as it might be modified if we're trying charging mode */
-    load = strdup(module);
-    if(!strcmp(module, MODULE_CHARGING) || !strcmp(module, MODULE_CHARGE_FALLBACK))
-    {
-        /* split the string in module name and argument, they are the same for MODULE_CHARGE_FALLBACK
-         * so no need to handle them separately  */
-        gchar **strings;
-
-        /* since the mass_storage module is the newer one and we check against it to avoid
-         * loading failures we use it here, as we fall back to g_file_storage if g_mass_storage
-         * fails to load */
-        strings = g_strsplit(MODULE_CHARGE_FALLBACK, " ", 2);
-        //log_debug("module args = %s, module = %s\n", strings[1], strings[0]);
-        charging_args = strdup(strings[1]);
-        /* load was already assigned. Free it to re-assign */
-        free(load);
-        load = strdup(strings[0]);
-        g_strfreev(strings);
+    modules_parse_spec(module, &name, &args);
 
-    }
-    ret = kmod_module_new_from_name(modules_ctx, load, &mod);
-    /* since kmod_module_new_from_name does not check if the module
-     * exists we test it's path in case we deal with the mass-storage one */
-    if(!strcmp(module, MODULE_MASS_STORAGE) &&
-       (kmod_module_get_path(mod) == NULL))
-    {
-        log_debug("Fallback on older g_file_storage\n");
-        ret = kmod_module_new_from_name(modules_ctx, MODULE_FILE_STORAGE, &mod);
+    if( options ) {
+        gchar *tmp = args ? g_strdup_printf("%s %s", args, options) : g_strdup(options);
+        g_free(args), args = tmp;
     }
 
-    if(!charging_args)
-        ret = kmod_module_probe_insert_module(mod, probe_flags, NULL, NULL, NULL, NULL);
-    else
-    {
-        ret = kmod_module_probe_insert_module(mod, probe_flags, charging_args, NULL, NULL, NULL);
-        free(charging_args);
-    }
-    kmod_module_unref(mod);
-    free(load);
+    if( (mod = modules_get_handle(name)) )
+        ret = kmod_module_probe_insert_module(mod, probe_flags, args, NULL, NULL, NULL);
 
     if( ret == 0)
         log_info("Module %s loaded successfully\n", module);
     else
         log_info("Module %s failed to load\n", module);
+
+    g_free(args);
+    g_free(name);
+
     return ret;
 }
 
@@ -254,9 +493,11 @@ int modules_unload_module(const char *module)
 {
     LOG_REGISTER_CONTEXT;
 
-    int ret = 0;
+    int ret = -1;
 
     struct kmod_module *mod;
+    gchar              *name = 0;
+    gchar              *args = 0;
 
     if(!strcmp(module, MODULE_NONE))
         return 0;
@@ -266,9 +507,119 @@ int modules_unload_module(const char *module)
         return -1;
     }
 
-    kmod_module_new_from_name(modules_ctx, module, &mod);
-    ret = kmod_module_remove_module(mod, KMOD_REMOVE_NOWAIT);
-    kmod_module_unref(mod);
+    modules_parse_spec(module, &name, &args);
+
+    if( (mod = modules_get_handle(name)) )
+        ret = kmod_module_remove_module(mod, KMOD_REMOVE_NOWAIT);
+
+    g_free(args);
+    g_free(name);
 
     return ret;
 }
+
+/** Wait callback for: mass storage lun is ready for activation
+ *
+ * @param aptr  Path to lun file (as void pointer)
+ *
+ * @return true if lun is ready, false otherwise
+ */
+static bool
+modules_lun_ready_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *path = aptr;
+
+    return access(path, W_OK) == 0 && common_udc_is_configured();
+}
+
+/** Activate kernel module gadget configuration
+ *
+ * Gadget functions are defined by the kernel module, which is
+ * assumed to have been loaded from elsewhere. Only mass storage
+ * luns need to be set up.
+ *
+ * @param config  Desired gadget configuration
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+modules_gadget_apply(const gadget_config_t *config)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   ack   = false;
+    size_t count = 0;
+    char   tmp[256];
+
+    count = config->gc_lun_count;
+
+    if( count == 0 ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    /* check if the file storage module has been loaded with sufficient luns in the parameter,
+     * if not, unload and reload or load it. Since  mountpoints start at 0 the amount of them is one more than their id */
+    snprintf(tmp, sizeof tmp, MODULES_GADGET_DIRECTORY "/gadget-lun%zd/file",
+             count - 1);
+
+    if( access(tmp, R_OK) == -1 )
+    {
+        log_debug("%s does not exist, unloading and reloading mass_storage\n", tmp);
+        modules_unload_module(MODULE_MASS_STORAGE);
+        snprintf(tmp, sizeof tmp, "luns=%zd", count);
+        log_debug("usb-load %s %s", MODULE_MASS_STORAGE, tmp);
+        if( modules_load_module_with_options(MODULE_MASS_STORAGE, tmp) != 0 )
+            goto EXIT;
+    }
+
+    /* activate mounts only after enumeration has happened so that autoplay will work in windows */
+    snprintf(tmp, sizeof tmp, MODULES_GADGET_DIRECTORY "/gadget-lun%zd/file",
+             count - 1);
+    if( common_wait_path(MODULES_ENUMERATE_TIMEOUT_MS, MODULES_GADGET_DIRECTORY,
+                         modules_lun_ready_cb, tmp) == WAIT_FAILED )
+        goto EXIT;
+
+    for( size_t i = 0 ; i < count; ++i ) {
+        const gadget_lun_t *lun = &config->gc_luns[i];
+
+        snprintf(tmp, sizeof tmp, MODULES_GADGET_DIRECTORY "/gadget-lun%zd/nofua", i);
+        write_to_file(tmp, lun->gl_nofua ? "1" : "0");
+
+        snprintf(tmp, sizeof tmp, MODULES_GADGET_DIRECTORY "/gadget-lun%zd/ro", i);
+        write_to_file(tmp, lun->gl_ro ? "1" : "0");
+
+        snprintf(tmp, sizeof tmp, MODULES_GADGET_DIRECTORY "/gadget-lun%zd/file", i);
+        write_to_file(tmp, lun->gl_file);
+        log_debug("usb lun = %s active\n", lun->gl_file);
+    }
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Detach kernel module mass storage luns
+ *
+ * @param count  Number of luns in use
+ *
+ * @return true if successful, false on failure
+ */
+static bool
+modules_gadget_clear_luns(size_t count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char tmp[256];
+
+    for( size_t i = 0 ; i < count; ++i ) {
+        snprintf(tmp, sizeof tmp, MODULES_GADGET_DIRECTORY "/gadget-lun%zd/file", i);
+        write_to_file(tmp, "");
+        log_debug("usb lun = %s inactive\n", tmp);
+    }
+
+    return true;
+}
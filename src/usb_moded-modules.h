@@ -30,6 +30,8 @@
 #ifndef  USB_MODED_MODULES_H_
 # define USB_MODED_MODULES_H_
 
+# include "usb_moded-gadget.h"
+
 # include <stdbool.h>
 
 /* ========================================================================= *
@@ -45,6 +47,12 @@
 # define MODULE_DEVELOPER        "g_ether"
 # define MODULE_MTP              "g_ffs"
 
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+extern const gadget_backend_t modules_gadget_backend;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -53,10 +61,11 @@
  * MODULES
  * ------------------------------------------------------------------------- */
 
-bool modules_in_use       (void);
-bool modules_init         (void);
-void modules_quit         (void);
-int  modules_load_module  (const char *module);
-int  modules_unload_module(const char *module);
+bool modules_in_use                  (void);
+bool modules_init                    (void);
+void modules_quit                    (void);
+int  modules_load_module             (const char *module);
+int  modules_load_module_with_options(const char *module, const char *options);
+int  modules_unload_module           (const char *module);
 
 #endif /* USB_MODED_MODULES_H_ */
@@ -39,10 +39,21 @@
 #include "usb_moded-modesetting.h"
 #include "usb_moded-worker.h"
 #include "usb_moded-dbus-private.h"
+#include "usb_moded-dhcpd.h"
+#include "usb_moded-gadget.h"
 
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h> // NOTRIM
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 /* ========================================================================= *
  * Constants
@@ -52,6 +63,25 @@
 #define UDHCP_CONFIG_DIR        "/run/usb-moded"
 #define UDHCP_CONFIG_LINK       "/etc/udhcpd.conf"
 
+#define FIREWALL_IPTABLES         "/sbin/iptables"
+#define FIREWALL_IPTABLES_RESTORE "/sbin/iptables-restore"
+#define FIREWALL_NFT              "/usr/sbin/nft"
+
+/** Maximum time to allow firewall tools to run [ms] */
+#define FIREWALL_TIMEOUT_MS       5000
+
+/** Name of nftables table used for connection sharing rules */
+#define FIREWALL_NFT_TABLE        "usb_moded"
+
+/** Size of rtnetlink request / reply buffers */
+#define RTNL_BUFFER_SIZE          8192
+
+/** Maximum number of requests in one rtnetlink batch */
+#define RTNL_BATCH_MAX            16
+
+/** Maximum time to wait for rtnetlink replies [ms] */
+#define RTNL_REPLY_TIMEOUT_MS     1000
+
 /* ========================================================================= *
  * Types
  * ========================================================================= */
@@ -67,6 +97,61 @@ typedef struct ipforward_data_t
     char *nat_interface;
 } ipforward_data_t;
 
+/** Firewall backend for connection sharing rules */
+typedef struct firewall_backend_t
+{
+    /** Backend name, as used in [network] firewall config */
+    const char *name;
+
+    /** Path to the tool the backend uses */
+    const char *tool;
+
+    /** Add forwarding / masquerading rules */
+    bool (*setup)(const char *interface, const char *nat_interface);
+
+    /** Remove forwarding rules */
+    bool (*cleanup)(void);
+} firewall_backend_t;
+
+#ifdef CONNMAN
+/** Connection details of a connman service */
+typedef struct connman_service_t
+{
+    /** Service type, e.g. "cellular" or "wifi" */
+    gchar *type;
+    /** Service state, e.g. "ready" or "online" */
+    gchar *state;
+    /** Network interface used by the service */
+    gchar *interface;
+    /** Address of primary DNS */
+    gchar *dns1;
+    /** Address of secondary DNS */
+    gchar *dns2;
+} connman_service_t;
+#endif
+
+/** Batch of rtnetlink requests sent in one go */
+typedef struct rtnl_batch_t
+{
+    /** Request messages */
+    union {
+        char            data[RTNL_BUFFER_SIZE];
+        struct nlmsghdr align;
+    } buf;
+
+    /** Bytes used in buf */
+    size_t  used;
+
+    /** Number of requests in batch */
+    int     count;
+
+    /** Sequence number of the first request */
+    unsigned seq;
+
+    /** Flags for: failure of request does not fail the batch */
+    bool    optional[RTNL_BATCH_MAX];
+} rtnl_batch_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -92,6 +177,23 @@ static gchar *ofono_get_modem_status  (const char *modem);
 static bool   ofono_get_roaming_status(void);
 #endif
 
+/* ------------------------------------------------------------------------- *
+ * OFONO_WATCH
+ * ------------------------------------------------------------------------- */
+
+#ifdef OFONO
+static void ofono_watch_set_status       (const char *modem, const char *status);
+static bool ofono_watch_get_roaming      (bool *roaming);
+static void ofono_watch_status_cb        (DBusPendingCall *pc, void *aptr);
+static void ofono_watch_query_status     (const char *modem);
+static void ofono_watch_modems_cb        (DBusPendingCall *pc, void *aptr);
+static void ofono_watch_query_modems     (void);
+static void ofono_watch_property_signal  (DBusMessage *msg);
+static void ofono_watch_available_changed(const char *owner);
+static void ofono_watch_available_cb     (const char *owner);
+static void ofono_watch_cancel           (void);
+#endif
+
 /* ------------------------------------------------------------------------- *
  * CONNMAN
  * ------------------------------------------------------------------------- */
@@ -99,11 +201,40 @@ static bool   ofono_get_roaming_status(void);
 #ifdef CONNMAN
 static bool   connman_technology_set_tethering   (DBusConnection *con, const char *technology, bool on, DBusError *err);
 static gchar *connman_manager_get_service_path   (DBusConnection *con, const char *type);
+static void   connman_service_clear              (connman_service_t *self);
+static void   connman_service_parse              (connman_service_t *self, DBusMessageIter *array_of_entries);
+static bool   connman_service_get_ipforward      (const connman_service_t *self, ipforward_data_t *ipforward);
 static bool   connman_service_get_connection_data(DBusConnection *con, const char *service, ipforward_data_t *ipforward);
 static bool   connman_get_connection_data        (ipforward_data_t *ipforward);
 bool          connman_set_tethering              (const char *technology, bool on);
 #endif
 
+/* ------------------------------------------------------------------------- *
+ * CONNMAN_WATCH
+ * ------------------------------------------------------------------------- */
+
+#ifdef CONNMAN
+static bool connman_watch_get_connection_data(ipforward_data_t *ipforward, bool *ack);
+static void connman_watch_services_cb        (DBusPendingCall *pc, void *aptr);
+static void connman_watch_query_services     (void);
+static void connman_watch_property_signal    (DBusMessage *msg);
+static void connman_watch_available_changed  (const char *owner);
+static void connman_watch_available_cb       (const char *owner);
+static void connman_watch_cancel             (void);
+#endif
+
+/* ------------------------------------------------------------------------- *
+ * NETWORK_WATCH
+ * ------------------------------------------------------------------------- */
+
+#if defined OFONO || defined CONNMAN
+static DBusPendingCall   *network_watch_call           (const char *service, const char *path, const char *interface, const char *member, DBusPendingCallNotifyFunction cb, void *aptr, DBusFreeFunction free_cb);
+static void               network_watch_name_owner_signal(DBusMessage *msg);
+static DBusHandlerResult  network_watch_filter_cb      (DBusConnection *con, DBusMessage *msg, void *aptr);
+#endif
+bool                      network_watch_start          (void);
+void                      network_watch_stop           (void);
+
 /* ------------------------------------------------------------------------- *
  * LEGACY
  * ------------------------------------------------------------------------- */
@@ -112,20 +243,57 @@ bool          connman_set_tethering              (const char *technology, bool o
 static bool legacy_get_connection_data(ipforward_data_t *ipforward);
 #endif
 
+/* ------------------------------------------------------------------------- *
+ * FIREWALL
+ * ------------------------------------------------------------------------- */
+
+static bool                      firewall_apply_batch     (const char *const *argv, const char *batch);
+static bool                      firewall_restore_setup   (const char *interface, const char *nat_interface);
+static bool                      firewall_restore_cleanup (void);
+static bool                      firewall_nft_setup       (const char *interface, const char *nat_interface);
+static bool                      firewall_nft_cleanup     (void);
+static bool                      firewall_shell_setup     (const char *interface, const char *nat_interface);
+static bool                      firewall_shell_cleanup   (void);
+static bool                      firewall_backend_usable  (const firewall_backend_t *backend);
+static const firewall_backend_t *firewall_select_backend  (void);
+
+/* ------------------------------------------------------------------------- *
+ * RTNL
+ * ------------------------------------------------------------------------- */
+
+static bool             rtnl_open         (void);
+static void             rtnl_close        (void);
+static struct nlmsghdr *rtnl_batch_add    (rtnl_batch_t *self, int type, int flags, bool optional, const void *body, size_t size);
+static bool             rtnl_batch_attr   (rtnl_batch_t *self, struct nlmsghdr *nh, int type, const void *data, size_t size);
+static bool             rtnl_batch_send   (rtnl_batch_t *self);
+static bool             rtnl_flush_addrs  (rtnl_batch_t *self, int ifindex, in_addr_t keep);
+static bool             rtnl_set_link_up  (rtnl_batch_t *self, int ifindex, bool up);
+static bool             rtnl_default_route(rtnl_batch_t *self, int type, int flags, bool optional, in_addr_t gw, int ifindex);
+static bool             rtnl_wait_link    (unsigned tmo_ms);
+
 /* ------------------------------------------------------------------------- *
  * NETWORK
  * ------------------------------------------------------------------------- */
 
-static bool  network_interface_exists     (char *interface);
-static char *network_get_interface        (const modedata_t *data);
-static int   network_setup_ip_forwarding  (const modedata_t *data, ipforward_data_t *ipforward);
-static void  network_cleanup_ip_forwarding(void);
-static int   network_check_udhcpd_symlink (void);
-static int   network_write_udhcpd_config  (const modedata_t *data, ipforward_data_t *ipforward);
-int          network_update_udhcpd_config (const modedata_t *data);
-int          network_up                   (const modedata_t *data);
-void         network_down                 (const modedata_t *data);
-void         network_update               (void);
+static bool  network_interface_exists      (char *interface);
+static char *network_get_interface         (const modedata_t *data);
+static int   network_setup_ip_forwarding   (const modedata_t *data, ipforward_data_t *ipforward);
+static void  network_cleanup_ip_forwarding (void);
+static int   network_check_udhcpd_symlink  (void);
+bool         network_use_builtin_dhcpd     (void);
+static int   network_start_builtin_dhcpd   (const modedata_t *data, ipforward_data_t *ipforward);
+static int   network_write_udhcpd_config   (const modedata_t *data, ipforward_data_t *ipforward);
+int          network_update_udhcpd_config  (const modedata_t *data);
+int          network_prestage_udhcpd_config(const modedata_t *data);
+int          network_up                    (const modedata_t *data);
+void         network_down                  (const modedata_t *data);
+static char *network_probe_interface       (void);
+static bool  network_interface_flags       (const char *interface, unsigned *flags);
+bool         network_is_present            (const modedata_t *data);
+bool         network_is_running            (const modedata_t *data);
+bool         network_wait_present          (const modedata_t *data, unsigned tmo_ms);
+void         network_update                (void);
+void         network_quit                  (void);
 
 /* ========================================================================= *
  * Data
@@ -133,6 +301,127 @@ void         network_update               (void);
 
 static const char default_interface[] = "usb0";
 
+static const firewall_backend_t firewall_restore_backend =
+{
+    .name    = "iptables-restore",
+    .tool    = FIREWALL_IPTABLES_RESTORE,
+    .setup   = firewall_restore_setup,
+    .cleanup = firewall_restore_cleanup,
+};
+
+static const firewall_backend_t firewall_nft_backend =
+{
+    .name    = "nft",
+    .tool    = FIREWALL_NFT,
+    .setup   = firewall_nft_setup,
+    .cleanup = firewall_nft_cleanup,
+};
+
+/** Rule by rule iptables execution, used as fallback */
+static const firewall_backend_t firewall_shell_backend =
+{
+    .name    = "iptables",
+    .tool    = FIREWALL_IPTABLES,
+    .setup   = firewall_shell_setup,
+    .cleanup = firewall_shell_cleanup,
+};
+
+/** Available firewall backends, in order of preference */
+static const firewall_backend_t * const firewall_backends[] =
+{
+    &firewall_restore_backend,
+    &firewall_nft_backend,
+    &firewall_shell_backend,
+    0
+};
+
+/** Backend that was used for setting up the current rules, or NULL */
+static const firewall_backend_t *firewall_active_backend = 0;
+
+/** Persistent rtnetlink socket, subscribed to link notifications
+ *
+ * Note: Used only from the worker thread, or from one mode switch
+ *       pipeline stage at a time.
+ */
+static int      rtnl_fd  = -1;
+
+/** Sequence number for rtnetlink requests */
+static unsigned rtnl_seq = 0;
+
+/** Default route added by network_up(), to be removed in network_down()
+ *
+ * Note: Used only from the worker thread.
+ */
+static struct
+{
+    bool      added;
+    in_addr_t gw;
+    int       ifindex;
+} network_default_route = { .added = false };
+
+#if defined OFONO || defined CONNMAN
+/** SystemBus connection ref used for connection data tracking */
+static DBusConnection *network_watch_con = 0;
+
+/** Tracked state is updated in main thread and read from worker thread */
+static pthread_mutex_t network_watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define NETWORK_WATCH_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&network_watch_mutex) != 0 ) { \
+        log_crit("NETWORK WATCH LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define NETWORK_WATCH_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&network_watch_mutex) != 0 ) { \
+        log_crit("NETWORK WATCH UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+#endif
+
+#ifdef OFONO
+/** Pending ofono name owner query */
+static DBusPendingCall *ofono_watch_owner_pc = 0;
+
+/** Pending ofono modem / status query */
+static DBusPendingCall *ofono_watch_pc       = 0;
+
+/** Object path of tracked modem, or NULL */
+static gchar           *ofono_watch_modem    = 0;
+
+/** Tracked roaming status */
+static bool             ofono_watch_roaming  = false;
+
+/** Flag for: ofono_watch_roaming reflects ofono state */
+static bool             ofono_watch_valid    = false;
+#endif
+
+#ifdef CONNMAN
+/** Pending connman name owner query */
+static DBusPendingCall  *connman_watch_owner_pc = 0;
+
+/** Pending connman services query */
+static DBusPendingCall  *connman_watch_pc       = 0;
+
+/** First cellular service known to connman */
+static connman_service_t connman_watch_cellular;
+
+/** First wifi service known to connman */
+static connman_service_t connman_watch_wifi;
+
+/** Flag for: tracked services reflect connman state */
+static bool              connman_watch_valid    = false;
+#endif
+
+/** Content last written to UDHCP_CONFIG_PATH
+ *
+ * Note: Used only from the worker thread, or from one mode switch
+ *       pipeline stage at a time.
+ */
+static gchar *network_udhcpd_config_text = 0;
+
 /* ========================================================================= *
  * IPFORWARD_DATA
  * ========================================================================= */
@@ -205,6 +494,27 @@ ipforward_data_set_nat_interface(ipforward_data_t *self, const char *interface)
  * ========================================================================= */
 
 #ifdef OFONO
+# define OFONO_SERVICE                  "org.ofono"
+# define OFONO_MANAGER_INTERFACE        "org.ofono.Manager"
+# define OFONO_NETREG_INTERFACE         "org.ofono.NetworkRegistration"
+# define OFONO_PROPERTY_CHANGED_SIG     "PropertyChanged"
+
+# define OFONO_MANAGER_MATCH\
+     "type='signal'"\
+     ",sender='"OFONO_SERVICE"'"\
+     ",interface='"OFONO_MANAGER_INTERFACE"'"
+
+# define OFONO_NETREG_MATCH\
+     "type='signal'"\
+     ",sender='"OFONO_SERVICE"'"\
+     ",interface='"OFONO_NETREG_INTERFACE"'"\
+     ",member='"OFONO_PROPERTY_CHANGED_SIG"'"
+
+# define OFONO_NAME_OWNER_CHANGED_MATCH\
+     "type='signal'"\
+     ",interface='"DBUS_INTERFACE_DBUS"'"\
+     ",member='"DBUS_NAME_OWNER_CHANGED_SIG"'"\
+     ",arg0='"OFONO_SERVICE"'"
 
 /** Get object path of the 1st modem known to ofono
  *
@@ -342,6 +652,10 @@ ofono_get_roaming_status(void)
     gchar *modem = 0;
     gchar *status = 0;
 
+    /* Use state tracked via D-Bus signals, if available */
+    if( ofono_watch_get_roaming(&roaming) )
+        goto EXIT;
+
     if( !(modem = ofono_get_default_modem()) )
         goto EXIT;
 
@@ -359,6 +673,281 @@ EXIT:
 
     return roaming;
 }
+
+/* ------------------------------------------------------------------------- *
+ * OFONO_WATCH
+ * ------------------------------------------------------------------------- */
+
+/** Update tracked modem status
+ *
+ * @param modem   Object path of modem, or NULL
+ * @param status  Network registration status, or NULL
+ */
+static void
+ofono_watch_set_status(const char *modem, const char *status)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool roaming = !g_strcmp0(status, "roaming");
+
+    NETWORK_WATCH_LOCKED_ENTER;
+
+    if( g_strcmp0(ofono_watch_modem, modem) ) {
+        g_free(ofono_watch_modem),
+            ofono_watch_modem = modem ? g_strdup(modem) : 0;
+        log_debug("tracked modem = %s", modem ?: "n/a");
+    }
+
+    if( !ofono_watch_valid || ofono_watch_roaming != roaming ) {
+        ofono_watch_valid   = true;
+        ofono_watch_roaming = roaming;
+        log_debug("tracked modem roaming = %d", roaming);
+    }
+
+    NETWORK_WATCH_LOCKED_LEAVE;
+}
+
+/** Get tracked roaming status
+ *
+ * @param roaming  Where to store roaming status
+ *
+ * @return true if tracked state was available, false otherwise
+ */
+static bool
+ofono_watch_get_roaming(bool *roaming)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool valid;
+
+    NETWORK_WATCH_LOCKED_ENTER;
+    if( (valid = ofono_watch_valid) )
+        *roaming = ofono_watch_roaming;
+    NETWORK_WATCH_LOCKED_LEAVE;
+
+    return valid;
+}
+
+/** Handle reply to network registration properties query
+ *
+ * @param pc    Pending call object
+ * @param aptr  Object path of modem (as void pointer)
+ */
+static void
+ofono_watch_status_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char  *modem  = aptr;
+    const char  *status = 0;
+    DBusMessage *rsp    = 0;
+    DBusError    err    = DBUS_ERROR_INIT;
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) )
+        goto EXIT;
+
+    /* Modem might not have network registration interface yet */
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_debug("%s: %s: %s", modem, err.name, err.message);
+        goto EXIT;
+    }
+
+    DBusMessageIter body;
+    if( umdbus_parser_init(&body, rsp) ) {
+        DBusMessageIter iter_array;
+        if( umdbus_parser_get_array(&body, &iter_array) ) {
+            DBusMessageIter entry;
+            while( umdbus_parser_get_entry(&iter_array, &entry) ) {
+                const char *key = 0;
+                if( !umdbus_parser_get_string(&entry, &key) )
+                    break;
+                if( strcmp(key, "Status") )
+                    continue;
+                DBusMessageIter var;
+                if( umdbus_parser_get_variant(&entry, &var) )
+                    umdbus_parser_get_string(&var, &status);
+                break;
+            }
+        }
+    }
+
+EXIT:
+    ofono_watch_set_status(modem, status);
+
+    if( rsp )
+        dbus_message_unref(rsp);
+
+    dbus_error_free(&err);
+
+    if( ofono_watch_pc == pc )
+        dbus_pending_call_unref(ofono_watch_pc), ofono_watch_pc = 0;
+}
+
+/** Start async network registration properties query
+ *
+ * @param modem  Object path of modem
+ */
+static void
+ofono_watch_query_status(const char *modem)
+{
+    LOG_REGISTER_CONTEXT;
+
+    ofono_watch_pc = network_watch_call(OFONO_SERVICE, modem,
+                                        OFONO_NETREG_INTERFACE,
+                                        "GetProperties",
+                                        ofono_watch_status_cb,
+                                        g_strdup(modem), g_free);
+}
+
+/** Handle reply to modems query
+ *
+ * @param pc    Pending call object
+ * @param aptr  (not used)
+ */
+static void
+ofono_watch_modems_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    gchar       *modem = 0;
+    DBusMessage *rsp   = 0;
+    DBusError    err   = DBUS_ERROR_INIT;
+
+    if( ofono_watch_pc == pc )
+        dbus_pending_call_unref(ofono_watch_pc), ofono_watch_pc = 0;
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) )
+        goto EXIT;
+
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_warning("%s.%s: %s: %s", OFONO_MANAGER_INTERFACE, "GetModems",
+                    err.name, err.message);
+        goto EXIT;
+    }
+
+    // a(oa{sv}) -> get object path in the first struct in the array
+    DBusMessageIter body;
+    if( umdbus_parser_init(&body, rsp) ) {
+        DBusMessageIter iter_array;
+        if( umdbus_parser_get_array(&body, &iter_array) ) {
+            DBusMessageIter astruct;
+            if( umdbus_parser_get_struct(&iter_array, &astruct) ) {
+                const char *object = 0;
+                if( umdbus_parser_get_object(&astruct, &object) )
+                    modem = g_strdup(object);
+            }
+        }
+    }
+
+EXIT:
+    if( modem )
+        ofono_watch_query_status(modem);
+    else
+        ofono_watch_set_status(0, 0);
+
+    g_free(modem);
+
+    if( rsp )
+        dbus_message_unref(rsp);
+
+    dbus_error_free(&err);
+}
+
+/** Start async modems query
+ */
+static void
+ofono_watch_query_modems(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    ofono_watch_cancel();
+
+    ofono_watch_pc = network_watch_call(OFONO_SERVICE, "/",
+                                        OFONO_MANAGER_INTERFACE,
+                                        "GetModems",
+                                        ofono_watch_modems_cb, 0, 0);
+}
+
+/** Handle network registration property change signal
+ *
+ * @param msg  Signal message
+ */
+static void
+ofono_watch_property_signal(DBusMessage *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *path = dbus_message_get_path(msg);
+
+    if( !ofono_watch_modem || g_strcmp0(path, ofono_watch_modem) )
+        goto EXIT;
+
+    DBusMessageIter body;
+    if( !umdbus_parser_init(&body, msg) )
+        goto EXIT;
+
+    const char *key = 0;
+    if( !umdbus_parser_get_string(&body, &key) || strcmp(key, "Status") )
+        goto EXIT;
+
+    DBusMessageIter var;
+    const char     *status = 0;
+    if( umdbus_parser_get_variant(&body, &var) &&
+        umdbus_parser_get_string(&var, &status) )
+        ofono_watch_set_status(path, status);
+
+EXIT:
+    return;
+}
+
+/** Handle ofono availability change
+ *
+ * @param owner  Name owner of ofono service, or NULL / empty
+ */
+static void
+ofono_watch_available_changed(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( owner && *owner ) {
+        log_debug("ofono is running");
+        ofono_watch_query_modems();
+    }
+    else {
+        log_debug("ofono is stopped");
+        ofono_watch_cancel();
+        ofono_watch_set_status(0, 0);
+    }
+}
+
+/** Handle reply to ofono name owner query
+ *
+ * @param owner  Name owner of ofono service, or NULL / empty
+ */
+static void
+ofono_watch_available_cb(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dbus_pending_call_unref(ofono_watch_owner_pc), ofono_watch_owner_pc = 0;
+
+    ofono_watch_available_changed(owner);
+}
+
+/** Cancel pending ofono queries
+ */
+static void
+ofono_watch_cancel(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( ofono_watch_pc ) {
+        dbus_pending_call_cancel(ofono_watch_pc);
+        dbus_pending_call_unref(ofono_watch_pc), ofono_watch_pc = 0;
+    }
+}
 #endif /* OFONO */
 
 /* ========================================================================= *
@@ -370,6 +959,28 @@ EXIT:
 # define CONNMAN_TECH_INTERFACE         "net.connman.Technology"
 # define CONNMAN_ERROR_ALREADY_ENABLED  "net.connman.Error.AlreadyEnabled"
 # define CONNMAN_ERROR_ALREADY_DISABLED "net.connman.Error.AlreadyDisabled"
+# define CONNMAN_MANAGER_INTERFACE      "net.connman.Manager"
+# define CONNMAN_SERVICE_INTERFACE      "net.connman.Service"
+# define CONNMAN_SERVICES_CHANGED_SIG   "ServicesChanged"
+# define CONNMAN_PROPERTY_CHANGED_SIG   "PropertyChanged"
+
+# define CONNMAN_SERVICES_CHANGED_MATCH\
+     "type='signal'"\
+     ",sender='"CONNMAN_SERVICE"'"\
+     ",interface='"CONNMAN_MANAGER_INTERFACE"'"\
+     ",member='"CONNMAN_SERVICES_CHANGED_SIG"'"
+
+# define CONNMAN_PROPERTY_CHANGED_MATCH\
+     "type='signal'"\
+     ",sender='"CONNMAN_SERVICE"'"\
+     ",interface='"CONNMAN_SERVICE_INTERFACE"'"\
+     ",member='"CONNMAN_PROPERTY_CHANGED_SIG"'"
+
+# define CONNMAN_NAME_OWNER_CHANGED_MATCH\
+     "type='signal'"\
+     ",interface='"DBUS_INTERFACE_DBUS"'"\
+     ",member='"DBUS_NAME_OWNER_CHANGED_SIG"'"\
+     ",arg0='"CONNMAN_SERVICE"'"
 
 /* ------------------------------------------------------------------------- *
  * TECHNOLOGY interface
@@ -515,11 +1126,143 @@ EXIT:
     return service;
 }
 
-/** Query ipforwarding parameters from connman
- *
- * @param con         D-Bus connection
- * @param service     D-Bus object path
- * @param ipforward   ipforward object to fill in
+/* ------------------------------------------------------------------------- *
+ * SERVICE interface
+ * ------------------------------------------------------------------------- */
+
+/** Release connman service details
+ *
+ * @param self  connman service object
+ */
+static void
+connman_service_clear(connman_service_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(self->type),      self->type      = 0;
+    g_free(self->state),     self->state     = 0;
+    g_free(self->interface), self->interface = 0;
+    g_free(self->dns1),      self->dns1      = 0;
+    g_free(self->dns2),      self->dns2      = 0;
+}
+
+/** Parse connman service properties
+ *
+ * @param self              connman service object to fill in
+ * @param array_of_entries  Iterator pointing to a{sv} properties
+ */
+static void
+connman_service_parse(connman_service_t *self, DBusMessageIter *array_of_entries)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char *type = 0;
+    const char *dns1 = 0;
+    const char *dns2 = 0;
+    const char *state = 0;
+    const char *interface = 0;
+
+    DBusMessageIter entry;
+    while( umdbus_parser_get_entry(array_of_entries, &entry) ) {
+        // @ dict entry
+        const char *key = 0;
+        if( !umdbus_parser_get_string(&entry, &key) )
+            break;
+        DBusMessageIter var;
+        if( !umdbus_parser_get_variant(&entry, &var) )
+            break;
+
+        if( !strcmp(key, "Type"))
+        {
+            umdbus_parser_get_string(&var, &type);
+        }
+        else if( !strcmp(key, "Nameservers"))
+        {
+            DBusMessageIter array_of_strings;
+            if( umdbus_parser_get_array(&var, &array_of_strings) ) {
+                // expect 0, 1, or 2 entries
+                if( !umdbus_parser_at_end(&array_of_strings) )
+                    umdbus_parser_get_string(&array_of_strings, &dns1);
+                if( !umdbus_parser_at_end(&array_of_strings) )
+                    umdbus_parser_get_string(&array_of_strings, &dns2);
+            }
+        }
+        else if( !strcmp(key, "State"))
+        {
+            umdbus_parser_get_string(&var, &state);
+        }
+        else if( !strcmp(key, "Ethernet"))
+        {
+            DBusMessageIter array_of_en_entries;
+            if( umdbus_parser_get_array(&var, &array_of_en_entries) ) {
+                DBusMessageIter en_entry;
+                while( umdbus_parser_get_entry(&array_of_en_entries, &en_entry) ) {
+                    const char *en_key = 0;
+                    if( !umdbus_parser_get_string(&en_entry, &en_key) )
+                        break;
+                    if( strcmp(en_key, "Interface") )
+                        continue;
+                    DBusMessageIter en_var;
+                    if( umdbus_parser_get_variant(&en_entry, &en_var) )
+                        umdbus_parser_get_string(&en_var, &interface);
+                }
+            }
+        }
+    }
+
+    connman_service_clear(self);
+    self->type      = g_strdup(type);
+    self->state     = g_strdup(state);
+    self->interface = g_strdup(interface);
+    self->dns1      = g_strdup(dns1);
+    self->dns2      = g_strdup(dns2);
+}
+
+/** Fill in ipforwarding parameters from connman service details
+ *
+ * @param self        connman service object
+ * @param ipforward   ipforward object to fill in
+ *
+ * @return true if service is connected and details are complete, false otherwise
+ */
+static bool
+connman_service_get_ipforward(const connman_service_t *self,
+                              ipforward_data_t *ipforward)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+    if( !self->type )
+        goto EXIT;
+
+    bool connected = (!g_strcmp0(self->state, "ready") ||
+                      !g_strcmp0(self->state, "online"));
+
+    log_debug("state = %s", self->state ?: "n/a");
+    log_debug("connected = %s", connected ? "true" : "false");
+    log_debug("interface = %s", self->interface ?: "n/a");
+    log_debug("dns1 = %s", self->dns1 ?: "n/a");
+    log_debug("dns2 = %s", self->dns2 ?: "n/a");
+
+    if( !self->dns1 || !self->interface || !connected )
+        goto EXIT;
+
+    ipforward_data_set_dns1(ipforward, self->dns1);
+    ipforward_data_set_dns2(ipforward, self->dns2 ?: self->dns1);
+    ipforward_data_set_nat_interface(ipforward, self->interface);
+
+    ack = true;
+
+EXIT:
+    return ack;
+}
+
+/** Query ipforwarding parameters from connman
+ *
+ * @param con         D-Bus connection
+ * @param service     D-Bus object path
+ * @param ipforward   ipforward object to fill in
  *
  * @return true on success, false otherwise
  */
@@ -530,9 +1273,10 @@ connman_service_get_connection_data(DBusConnection *con,
 {
     LOG_REGISTER_CONTEXT;
 
-    bool            ack   = false;
-    DBusMessage    *rsp   = NULL;
-    DBusError       err   = DBUS_ERROR_INIT;
+    bool              ack   = false;
+    DBusMessage      *rsp   = NULL;
+    DBusError         err   = DBUS_ERROR_INIT;
+    connman_service_t props = { .type = 0 };
 
     log_debug("Filling in dns data");
 
@@ -546,82 +1290,19 @@ connman_service_get_connection_data(DBusConnection *con,
     if( !rsp )
         goto EXIT;
 
-    const char *dns1 = 0;
-    const char *dns2 = 0;
-    const char *state = 0;
-    const char *interface = 0;
-
     DBusMessageIter body;
     if( umdbus_parser_init(&body, rsp) ) {
         // @ body
         DBusMessageIter array_of_entries;
-        if( umdbus_parser_get_array(&body, &array_of_entries) ) {
-            // @ array of entries
-            DBusMessageIter entry;
-            while( umdbus_parser_get_entry(&array_of_entries, &entry) ) {
-                // @ dict entry
-                const char *key = 0;
-                if( !umdbus_parser_get_string(&entry, &key) )
-                    break;
-                DBusMessageIter var;
-                if( !umdbus_parser_get_variant(&entry, &var) )
-                    break;
-
-                if( !strcmp(key, "Nameservers"))
-                {
-                    DBusMessageIter array_of_strings;
-                    if( umdbus_parser_get_array(&var, &array_of_strings) ) {
-                        // expect 0, 1, or 2 entries
-                        if( !umdbus_parser_at_end(&array_of_strings) )
-                            umdbus_parser_get_string(&array_of_strings, &dns1);
-                        if( !umdbus_parser_at_end(&array_of_strings) )
-                            umdbus_parser_get_string(&array_of_strings, &dns2);
-                    }
-                }
-                else if( !strcmp(key, "State"))
-                {
-                    umdbus_parser_get_string(&var, &state);
-                }
-                else if( !strcmp(key, "Ethernet"))
-                {
-                    DBusMessageIter array_of_en_entries;
-                    if( umdbus_parser_get_array(&var, &array_of_en_entries) ) {
-                        DBusMessageIter en_entry;
-                        while( umdbus_parser_get_entry(&array_of_en_entries, &en_entry) ) {
-                            const char *en_key = 0;
-                            if( !umdbus_parser_get_string(&en_entry, &en_key) )
-                                break;
-                            if( strcmp(en_key, "Interface") )
-                                continue;
-                            DBusMessageIter en_var;
-                            if( umdbus_parser_get_variant(&en_entry, &en_var) )
-                                umdbus_parser_get_string(&en_var, &interface);
-                        }
-                    }
-                }
-            }
-        }
+        if( umdbus_parser_get_array(&body, &array_of_entries) )
+            connman_service_parse(&props, &array_of_entries);
     }
 
-    bool connected = (!g_strcmp0(state, "ready") ||
-                      !g_strcmp0(state, "online"));
-
-    log_debug("state = %s", state ?: "n/a");
-    log_debug("connected = %s", connected ? "true" : "false");
-    log_debug("interface = %s", interface ?: "n/a");
-    log_debug("dns1 = %s", dns1 ?: "n/a");
-    log_debug("dns2 = %s", dns2 ?: "n/a");
-
-    if( !dns1 || !interface || !connected )
-        goto EXIT;
-
-    ipforward_data_set_dns1(ipforward, dns1);
-    ipforward_data_set_dns2(ipforward, dns2 ?: dns1);
-    ipforward_data_set_nat_interface(ipforward, interface);
-
-    ack = true;
+    ack = connman_service_get_ipforward(&props, ipforward);
 
 EXIT:
+    connman_service_clear(&props);
+
     if( rsp )
         dbus_message_unref(rsp);
 
@@ -650,6 +1331,10 @@ connman_get_connection_data(ipforward_data_t *ipforward)
     gchar          *cellular = 0;
     gchar          *wifi     = 0;
 
+    /* Use services tracked via D-Bus signals, if available */
+    if( connman_watch_get_connection_data(ipforward, &ack) )
+        goto CACHED;
+
     if( !(con = umdbus_get_connection()) )
         goto FAILURE;
 
@@ -672,6 +1357,7 @@ SUCCESS:
     ack = true;
 
 FAILURE:
+CACHED:
     if( !ack )
         log_warning("no connection data");
     else
@@ -718,77 +1404,1149 @@ EXIT:
 
     return res;
 }
+
+/* ------------------------------------------------------------------------- *
+ * CONNMAN_WATCH
+ * ------------------------------------------------------------------------- */
+
+/** Get ipforwarding parameters from tracked connman services
+ *
+ * Like #connman_get_connection_data(), cellular service is preferred
+ * over wifi.
+ *
+ * @param ipforward   ipforward object to fill in
+ * @param ack         Where to store success / failure
+ *
+ * @return true if tracked state was available, false otherwise
+ */
+static bool
+connman_watch_get_connection_data(ipforward_data_t *ipforward, bool *ack)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool valid;
+
+    NETWORK_WATCH_LOCKED_ENTER;
+    if( (valid = connman_watch_valid) ) {
+        *ack = (connman_service_get_ipforward(&connman_watch_cellular, ipforward) ||
+                connman_service_get_ipforward(&connman_watch_wifi, ipforward));
+    }
+    NETWORK_WATCH_LOCKED_LEAVE;
+
+    return valid;
+}
+
+/** Handle reply to services query
+ *
+ * @param pc    Pending call object
+ * @param aptr  (not used)
+ */
+static void
+connman_watch_services_cb(DBusPendingCall *pc, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    DBusMessage      *rsp      = 0;
+    DBusError         err      = DBUS_ERROR_INIT;
+    connman_service_t cellular = { .type = 0 };
+    connman_service_t wifi     = { .type = 0 };
+    connman_service_t props    = { .type = 0 };
+
+    if( connman_watch_pc == pc )
+        dbus_pending_call_unref(connman_watch_pc), connman_watch_pc = 0;
+
+    if( !(rsp = dbus_pending_call_steal_reply(pc)) )
+        goto EXIT;
+
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_warning("%s.%s: %s: %s", CONNMAN_MANAGER_INTERFACE, "GetServices",
+                    err.name, err.message);
+        goto EXIT;
+    }
+
+    // a(oa{sv}) -> properties of the first cellular and wifi services
+    DBusMessageIter body;
+    if( umdbus_parser_init(&body, rsp) ) {
+        DBusMessageIter array_of_structs;
+        if( umdbus_parser_get_array(&body, &array_of_structs) ) {
+            DBusMessageIter astruct;
+            while( umdbus_parser_get_struct(&array_of_structs, &astruct) ) {
+                const char *object = 0;
+                if( !umdbus_parser_get_object(&astruct, &object) )
+                    break;
+                DBusMessageIter array_of_entries;
+                if( !umdbus_parser_get_array(&astruct, &array_of_entries) )
+                    break;
+                connman_service_parse(&props, &array_of_entries);
+                if( !cellular.type && !g_strcmp0(props.type, "cellular") )
+                    cellular = props, props = (connman_service_t){ .type = 0 };
+                else if( !wifi.type && !g_strcmp0(props.type, "wifi") )
+                    wifi = props, props = (connman_service_t){ .type = 0 };
+            }
+        }
+    }
+
+EXIT:
+    NETWORK_WATCH_LOCKED_ENTER;
+    connman_service_clear(&connman_watch_cellular);
+    connman_service_clear(&connman_watch_wifi);
+    connman_watch_cellular = cellular;
+    connman_watch_wifi     = wifi;
+    connman_watch_valid    = (rsp && !dbus_error_is_set(&err));
+    NETWORK_WATCH_LOCKED_LEAVE;
+
+    log_debug("tracked cellular = %s, wifi = %s",
+              cellular.state ?: "n/a", wifi.state ?: "n/a");
+
+    connman_service_clear(&props);
+
+    if( rsp )
+        dbus_message_unref(rsp);
+
+    dbus_error_free(&err);
+}
+
+/** Start async services query
+ *
+ * All service properties are included in the reply, so one query
+ * is enough for refreshing the tracked state.
+ */
+static void
+connman_watch_query_services(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    connman_watch_cancel();
+
+    connman_watch_pc = network_watch_call(CONNMAN_SERVICE, "/",
+                                          CONNMAN_MANAGER_INTERFACE,
+                                          "GetServices",
+                                          connman_watch_services_cb, 0, 0);
+}
+
+/** Handle service property change signal
+ *
+ * Only changes to properties that affect connection sharing
+ * trigger refreshing of tracked state.
+ *
+ * @param msg  Signal message
+ */
+static void
+connman_watch_property_signal(DBusMessage *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessageIter body;
+    const char     *key = 0;
+
+    if( !umdbus_parser_init(&body, msg) ||
+        !umdbus_parser_get_string(&body, &key) )
+        goto EXIT;
+
+    if( !strcmp(key, "State") || !strcmp(key, "Nameservers") ||
+        !strcmp(key, "Ethernet") )
+        connman_watch_query_services();
+
+EXIT:
+    return;
+}
+
+/** Handle connman availability change
+ *
+ * @param owner  Name owner of connman service, or NULL / empty
+ */
+static void
+connman_watch_available_changed(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( owner && *owner ) {
+        log_debug("connman is running");
+        connman_watch_query_services();
+    }
+    else {
+        log_debug("connman is stopped");
+        connman_watch_cancel();
+
+        /* No connection data to be had */
+        NETWORK_WATCH_LOCKED_ENTER;
+        connman_service_clear(&connman_watch_cellular);
+        connman_service_clear(&connman_watch_wifi);
+        connman_watch_valid = true;
+        NETWORK_WATCH_LOCKED_LEAVE;
+    }
+}
+
+/** Handle reply to connman name owner query
+ *
+ * @param owner  Name owner of connman service, or NULL / empty
+ */
+static void
+connman_watch_available_cb(const char *owner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dbus_pending_call_unref(connman_watch_owner_pc), connman_watch_owner_pc = 0;
+
+    connman_watch_available_changed(owner);
+}
+
+/** Cancel pending connman queries
+ */
+static void
+connman_watch_cancel(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( connman_watch_pc ) {
+        dbus_pending_call_cancel(connman_watch_pc);
+        dbus_pending_call_unref(connman_watch_pc), connman_watch_pc = 0;
+    }
+}
 #endif /* CONNMAN */
 
 /* ========================================================================= *
- * LEGACY
+ * NETWORK_WATCH
  * ========================================================================= */
 
-#ifndef CONNMAN
-/** Read dns settings from /etc/resolv.conf
+#if defined OFONO || defined CONNMAN
+/** Start async method call without arguments
+ *
+ * @param service    D-Bus service name
+ * @param path       D-Bus object path
+ * @param interface  D-Bus interface name
+ * @param member     D-Bus method name
+ * @param cb         Reply notification callback
+ * @param aptr       Data to pass to callback
+ * @param free_cb    Function for releasing aptr, or NULL
+ *
+ * @return pending call object, or NULL on failure
+ */
+static DBusPendingCall *
+network_watch_call(const char *service, const char *path,
+                   const char *interface, const char *member,
+                   DBusPendingCallNotifyFunction cb,
+                   void *aptr, DBusFreeFunction free_cb)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusPendingCall *pc  = 0;
+    DBusMessage     *req = 0;
+
+    if( !network_watch_con )
+        goto EXIT;
+
+    if( !(req = dbus_message_new_method_call(service, path, interface, member)) )
+        goto EXIT;
+
+    if( !dbus_connection_send_with_reply(network_watch_con, req, &pc, -1) || !pc )
+        goto EXIT;
+
+    if( !dbus_pending_call_set_notify(pc, cb, aptr, free_cb) ) {
+        dbus_pending_call_cancel(pc);
+        dbus_pending_call_unref(pc), pc = 0;
+        goto EXIT;
+    }
+
+    /* Ownership of aptr was passed to pending call */
+    aptr = 0;
+
+EXIT:
+    if( aptr && free_cb )
+        free_cb(aptr);
+
+    if( req )
+        dbus_message_unref(req);
+
+    if( !pc )
+        log_err("%s.%s: failed to send request", interface, member);
+
+    return pc;
+}
+
+/** Handle name owner change signal
+ *
+ * @param msg  Signal message
+ */
+static void
+network_watch_name_owner_signal(DBusMessage *msg)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusError   err  = DBUS_ERROR_INIT;
+    const char *name = 0;
+    const char *prev = 0;
+    const char *curr = 0;
+
+    if( !dbus_message_get_args(msg, &err,
+                               DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_STRING, &prev,
+                               DBUS_TYPE_STRING, &curr,
+                               DBUS_TYPE_INVALID) ) {
+        log_err("failed to parse signal: %s: %s",
+                err.name, err.message);
+    }
+#ifdef OFONO
+    else if( !strcmp(name, OFONO_SERVICE) ) {
+        ofono_watch_available_changed(curr);
+    }
+#endif
+#ifdef CONNMAN
+    else if( !strcmp(name, CONNMAN_SERVICE) ) {
+        connman_watch_available_changed(curr);
+    }
+#endif
+
+    dbus_error_free(&err);
+}
+
+/** D-Bus message filter for connection data tracking
+ */
+static DBusHandlerResult
+network_watch_filter_cb(DBusConnection *con, DBusMessage *msg, void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)con;
+    (void)aptr;
+
+    if( dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_SIGNAL )
+        goto EXIT;
+
+    if( dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS,
+                               DBUS_NAME_OWNER_CHANGED_SIG) ) {
+        network_watch_name_owner_signal(msg);
+    }
+#ifdef OFONO
+    else if( dbus_message_is_signal(msg, OFONO_NETREG_INTERFACE,
+                                    OFONO_PROPERTY_CHANGED_SIG) ) {
+        ofono_watch_property_signal(msg);
+    }
+    else if( dbus_message_has_interface(msg, OFONO_MANAGER_INTERFACE) ) {
+        /* ModemAdded / ModemRemoved */
+        ofono_watch_query_modems();
+    }
+#endif
+#ifdef CONNMAN
+    else if( dbus_message_is_signal(msg, CONNMAN_SERVICE_INTERFACE,
+                                    CONNMAN_PROPERTY_CHANGED_SIG) ) {
+        connman_watch_property_signal(msg);
+    }
+    else if( dbus_message_is_signal(msg, CONNMAN_MANAGER_INTERFACE,
+                                    CONNMAN_SERVICES_CHANGED_SIG) ) {
+        connman_watch_query_services();
+    }
+#endif
+
+EXIT:
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+#endif /* OFONO || CONNMAN */
+
+/** Start tracking connection data via D-Bus signals
+ *
+ * Keeps connman service details and ofono roaming status up to date
+ * in the background, so that entering connection sharing modes does
+ * not need to wait for synchronous D-Bus queries. Until the initial
+ * state is known, the queries are made synchronously as before.
+ *
+ * @return true on success, false otherwise
+ */
+bool
+network_watch_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+
+#if defined OFONO || defined CONNMAN
+    if( network_watch_con ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( !(network_watch_con = umdbus_get_connection()) ) {
+        log_err("could not connect to dbus for network tracking");
+        goto EXIT;
+    }
+
+    if( !dbus_connection_add_filter(network_watch_con,
+                                    network_watch_filter_cb, 0, 0) ) {
+        log_err("adding system dbus filter for network tracking failed");
+        dbus_connection_unref(network_watch_con), network_watch_con = 0;
+        goto EXIT;
+    }
+
+    /* Add matches without blocking / error checking */
+#ifdef OFONO
+    dbus_bus_add_match(network_watch_con, OFONO_MANAGER_MATCH, 0);
+    dbus_bus_add_match(network_watch_con, OFONO_NETREG_MATCH, 0);
+    dbus_bus_add_match(network_watch_con, OFONO_NAME_OWNER_CHANGED_MATCH, 0);
+    umdbus_get_name_owner_async(OFONO_SERVICE, ofono_watch_available_cb,
+                                &ofono_watch_owner_pc);
+#endif
+#ifdef CONNMAN
+    dbus_bus_add_match(network_watch_con, CONNMAN_SERVICES_CHANGED_MATCH, 0);
+    dbus_bus_add_match(network_watch_con, CONNMAN_PROPERTY_CHANGED_MATCH, 0);
+    dbus_bus_add_match(network_watch_con, CONNMAN_NAME_OWNER_CHANGED_MATCH, 0);
+    umdbus_get_name_owner_async(CONNMAN_SERVICE, connman_watch_available_cb,
+                                &connman_watch_owner_pc);
+#endif
+#endif /* OFONO || CONNMAN */
+
+    ack = true;
+
+#if defined OFONO || defined CONNMAN
+EXIT:
+#endif
+    return ack;
+}
+
+/** Stop tracking connection data via D-Bus signals
+ */
+void
+network_watch_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+#if defined OFONO || defined CONNMAN
+    if( !network_watch_con )
+        goto EXIT;
+
+#ifdef OFONO
+    if( ofono_watch_owner_pc ) {
+        dbus_pending_call_cancel(ofono_watch_owner_pc);
+        dbus_pending_call_unref(ofono_watch_owner_pc), ofono_watch_owner_pc = 0;
+    }
+    ofono_watch_cancel();
+#endif
+#ifdef CONNMAN
+    if( connman_watch_owner_pc ) {
+        dbus_pending_call_cancel(connman_watch_owner_pc);
+        dbus_pending_call_unref(connman_watch_owner_pc), connman_watch_owner_pc = 0;
+    }
+    connman_watch_cancel();
+#endif
+
+    dbus_connection_remove_filter(network_watch_con, network_watch_filter_cb, 0);
+
+    if( dbus_connection_get_is_connected(network_watch_con) ) {
+        /* Remove matches without blocking / error checking */
+#ifdef OFONO
+        dbus_bus_remove_match(network_watch_con, OFONO_MANAGER_MATCH, 0);
+        dbus_bus_remove_match(network_watch_con, OFONO_NETREG_MATCH, 0);
+        dbus_bus_remove_match(network_watch_con, OFONO_NAME_OWNER_CHANGED_MATCH, 0);
+#endif
+#ifdef CONNMAN
+        dbus_bus_remove_match(network_watch_con, CONNMAN_SERVICES_CHANGED_MATCH, 0);
+        dbus_bus_remove_match(network_watch_con, CONNMAN_PROPERTY_CHANGED_MATCH, 0);
+        dbus_bus_remove_match(network_watch_con, CONNMAN_NAME_OWNER_CHANGED_MATCH, 0);
+#endif
+    }
+
+    dbus_connection_unref(network_watch_con), network_watch_con = 0;
+
+    /* Fall back to synchronous queries */
+    NETWORK_WATCH_LOCKED_ENTER;
+#ifdef OFONO
+    g_free(ofono_watch_modem), ofono_watch_modem = 0;
+    ofono_watch_valid = false;
+#endif
+#ifdef CONNMAN
+    connman_service_clear(&connman_watch_cellular);
+    connman_service_clear(&connman_watch_wifi);
+    connman_watch_valid = false;
+#endif
+    NETWORK_WATCH_LOCKED_LEAVE;
+
+EXIT:
+#endif /* OFONO || CONNMAN */
+    return;
+}
+
+/* ========================================================================= *
+ * LEGACY
+ * ========================================================================= */
+
+#ifndef CONNMAN
+/** Read dns settings from /etc/resolv.conf
+ *
+ * @return true on success, false on failure
+ */
+static bool
+legacy_get_connection_data(ipforward_data_t *ipforward)
+{
+    LOG_REGISTER_CONTEXT;
+
+    static const char path[] = "/etc/resolv.conf";
+
+    bool    ack  = false;
+    FILE   *file = 0;
+    char   *buff = 0;
+    size_t  size = 0;
+
+    if( !(file = fopen(path, "r")) ) {
+        log_warning("%s: can't open for reading: %m", path);
+        goto EXIT;
+    }
+
+    int count = 0;
+    while( count < 2 && getline(&buff, &size, file) >= 0 ) {
+        /* skip comment and empty lines */
+        if( strchr("#\n", *buff) )
+            continue;
+
+        gchar **tokens = g_strsplit(buff, " ", 3);
+        if( !tokens || !tokens[0] || !tokens[1] ) {
+            // ignore
+        }
+        else if( !g_strcmp0(tokens[0], "nameserver") ) {
+            // TODO: can have '\n' at eol?
+            g_strstrip(tokens[1]);
+            if( ++count == 1 )
+                ipforward_data_set_dns1(ipforward, tokens[1]);
+            else
+                ipforward_data_set_dns2(ipforward, tokens[1]);
+        }
+        g_strfreev(tokens);
+    }
+
+    if( count < 1 ) {
+        log_warning("%s: no nameserver lines found", path);
+        goto EXIT;
+    }
+
+    /* FIXME: connman_service_get_connection_data() duplicates
+     *        dns1 if dns2 is not set - is this necessary?
+     */
+    if( count == 1 )
+        ipforward_data_set_dns2(ipforward, ipforward->dns1);
+
+    ack = true;
+
+EXIT:
+    free(buff);
+
+    if( file )
+        fclose(file);
+
+    return ack;
+}
+#endif
+
+/* ========================================================================= *
+ * FIREWALL
+ * ========================================================================= */
+
+/** Feed a batch of rules to a firewall tool via stdin
+ *
+ * @param argv   NULL terminated command line vector to execute
+ * @param batch  rules to write to stdin of the command
+ *
+ * @return true if the command succeeded, false otherwise
+ */
+static bool
+firewall_apply_batch(const char *const *argv, const char *batch)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return common_spawnv(FIREWALL_TIMEOUT_MS, batch, argv) == 0;
+}
+
+/** Add forwarding rules in one go via iptables-restore
+ */
+static bool
+firewall_restore_setup(const char *interface, const char *nat_interface)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *batch =
+        g_strdup_printf("*nat\n"
+                        "-A POSTROUTING -o %s -j MASQUERADE\n"
+                        "COMMIT\n"
+                        "*filter\n"
+                        "-A FORWARD -i %s -o %s -m state --state RELATED,ESTABLISHED -j ACCEPT\n"
+                        "-A FORWARD -i %s -o %s -j ACCEPT\n"
+                        "COMMIT\n",
+                        nat_interface,
+                        nat_interface, interface,
+                        interface, nat_interface);
+
+    bool ack = firewall_apply_batch((const char *[]) { FIREWALL_IPTABLES_RESTORE, "--noflush", 0 },
+                                    batch);
+
+    g_free(batch);
+    return ack;
+}
+
+/** Flush forwarding rules via iptables-restore
+ */
+static bool
+firewall_restore_cleanup(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return firewall_apply_batch((const char *[]) { FIREWALL_IPTABLES_RESTORE, "--noflush", 0 },
+                                "*filter\n"
+                                "-F FORWARD\n"
+                                "COMMIT\n");
+}
+
+/** Add forwarding rules in one go into a private nftables table
+ */
+static bool
+firewall_nft_setup(const char *interface, const char *nat_interface)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Recreating the table makes this an atomic replace of whatever
+     * rules might have been left behind earlier */
+    gchar *batch =
+        g_strdup_printf("add table ip " FIREWALL_NFT_TABLE "\n"
+                        "delete table ip " FIREWALL_NFT_TABLE "\n"
+                        "table ip " FIREWALL_NFT_TABLE " {\n"
+                        "  chain postrouting {\n"
+                        "    type nat hook postrouting priority 100;\n"
+                        "    oifname \"%s\" masquerade\n"
+                        "  }\n"
+                        "  chain forward {\n"
+                        "    type filter hook forward priority 0;\n"
+                        "    iifname \"%s\" oifname \"%s\" ct state related,established accept\n"
+                        "    iifname \"%s\" oifname \"%s\" accept\n"
+                        "  }\n"
+                        "}\n",
+                        nat_interface,
+                        nat_interface, interface,
+                        interface, nat_interface);
+
+    bool ack = firewall_apply_batch((const char *[]) { FIREWALL_NFT, "-f", "-", 0 }, batch);
+
+    g_free(batch);
+    return ack;
+}
+
+/** Remove the private nftables table
+ */
+static bool
+firewall_nft_cleanup(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return firewall_apply_batch((const char *[]) { FIREWALL_NFT, "-f", "-", 0 },
+                                "add table ip " FIREWALL_NFT_TABLE "\n"
+                                "delete table ip " FIREWALL_NFT_TABLE "\n");
+}
+
+/** Add forwarding rules by executing iptables once per rule
+ */
+static bool
+firewall_shell_setup(const char *interface, const char *nat_interface)
+{
+    LOG_REGISTER_CONTEXT;
+
+    common_spawn(FIREWALL_TIMEOUT_MS, FIREWALL_IPTABLES,
+                 "-t", "nat", "-A", "POSTROUTING", "-o", nat_interface,
+                 "-j", "MASQUERADE");
+
+    common_spawn(FIREWALL_TIMEOUT_MS, FIREWALL_IPTABLES,
+                 "-A", "FORWARD", "-i", nat_interface, "-o", interface,
+                 "-m", "state", "--state", "RELATED,ESTABLISHED",
+                 "-j", "ACCEPT");
+
+    common_spawn(FIREWALL_TIMEOUT_MS, FIREWALL_IPTABLES,
+                 "-A", "FORWARD", "-i", interface, "-o", nat_interface,
+                 "-j", "ACCEPT");
+
+    return true;
+}
+
+/** Flush forwarding rules by executing iptables
+ */
+static bool
+firewall_shell_cleanup(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    common_spawn(FIREWALL_TIMEOUT_MS, FIREWALL_IPTABLES, "-F", "FORWARD");
+
+    return true;
+}
+
+/** Predicate for: the tool needed by a firewall backend is installed
+ */
+static bool
+firewall_backend_usable(const firewall_backend_t *backend)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return access(backend->tool, X_OK) == 0;
+}
+
+/** Choose firewall backend to use
+ *
+ * The backend can be selected with the [network] firewall config
+ * value; "auto" or missing value picks the first backend whose tool
+ * is installed.
+ *
+ * @return firewall backend, the single rule iptables backend is
+ *         used as fallback
+ */
+static const firewall_backend_t *
+firewall_select_backend(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const firewall_backend_t *backend = 0;
+    gchar *setting = config_get_conf_string(NETWORK_ENTRY, NETWORK_FIREWALL_KEY);
+
+    for( size_t i = 0; firewall_backends[i]; ++i ) {
+        if( setting && strcmp(setting, "auto") ) {
+            if( !strcmp(setting, firewall_backends[i]->name) ) {
+                backend = firewall_backends[i];
+                break;
+            }
+        }
+        else if( firewall_backend_usable(firewall_backends[i]) ) {
+            backend = firewall_backends[i];
+            break;
+        }
+    }
+
+    if( !backend ) {
+        if( setting && strcmp(setting, "auto") )
+            log_warning("unknown firewall backend '%s'", setting);
+        backend = &firewall_shell_backend;
+    }
+
+    log_debug("firewall backend = %s", backend->name);
+    g_free(setting);
+    return backend;
+}
+
+/* ========================================================================= *
+ * RTNL
+ * ========================================================================= */
+
+/** Open rtnetlink socket, if not already open
+ *
+ * @return true if socket is available, false otherwise
+ */
+static bool
+rtnl_open(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct sockaddr_nl sa = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_LINK,
+    };
+
+    if( rtnl_fd != -1 )
+        goto EXIT;
+
+    rtnl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                     NETLINK_ROUTE);
+    if( rtnl_fd == -1 ) {
+        log_err("rtnetlink socket: %m");
+        goto EXIT;
+    }
+
+    if( bind(rtnl_fd, (struct sockaddr *)&sa, sizeof sa) == -1 ) {
+        log_err("rtnetlink bind: %m");
+        rtnl_close();
+    }
+
+EXIT:
+    return rtnl_fd != -1;
+}
+
+/** Close rtnetlink socket
+ */
+static void
+rtnl_close(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( rtnl_fd != -1 )
+        close(rtnl_fd), rtnl_fd = -1;
+}
+
+/** Append request message to rtnetlink batch
+ *
+ * @param self      Batch object
+ * @param type      RTM_xxx message type
+ * @param flags     NLM_F_xxx flags in addition to request + ack
+ * @param optional  true if failure should not fail the whole batch
+ * @param body      Fixed size message body
+ * @param size      Size of message body
+ *
+ * @return message header, or NULL if batch is full
+ */
+static struct nlmsghdr *
+rtnl_batch_add(rtnl_batch_t *self, int type, int flags, bool optional,
+               const void *body, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct nlmsghdr *nh   = 0;
+    size_t           need = NLMSG_SPACE(size);
+
+    if( self->count >= RTNL_BATCH_MAX ||
+        self->used + need > sizeof self->buf.data ) {
+        log_err("rtnetlink batch overflow");
+        goto EXIT;
+    }
+
+    nh = (struct nlmsghdr *)(self->buf.data + self->used);
+    memset(nh, 0, need);
+    nh->nlmsg_len   = NLMSG_LENGTH(size);
+    nh->nlmsg_type  = type;
+    nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nh->nlmsg_seq   = ++rtnl_seq;
+    memcpy(NLMSG_DATA(nh), body, size);
+
+    if( self->count == 0 )
+        self->seq = nh->nlmsg_seq;
+    self->optional[self->count++] = optional;
+    self->used += need;
+
+EXIT:
+    return nh;
+}
+
+/** Append attribute to the last request message in rtnetlink batch
+ *
+ * @param self  Batch object
+ * @param nh    Message header returned by #rtnl_batch_add()
+ * @param type  Attribute type
+ * @param data  Attribute data
+ * @param size  Size of attribute data
+ *
+ * @return true on success, false if batch is full
+ */
+static bool
+rtnl_batch_attr(rtnl_batch_t *self, struct nlmsghdr *nh, int type,
+                const void *data, size_t size)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t offs = (char *)nh - self->buf.data + NLMSG_ALIGN(nh->nlmsg_len);
+
+    if( offs + RTA_SPACE(size) > sizeof self->buf.data ) {
+        log_err("rtnetlink batch overflow");
+        return false;
+    }
+
+    struct rtattr *rta = (struct rtattr *)(self->buf.data + offs);
+    rta->rta_type = type;
+    rta->rta_len  = RTA_LENGTH(size);
+    memcpy(RTA_DATA(rta), data, size);
+
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_SPACE(size);
+    self->used    = offs + RTA_SPACE(size);
+    return true;
+}
+
+/** Send rtnetlink batch and wait for all acknowledgements
+ *
+ * Link notifications received while waiting are ignored.
+ *
+ * @param self  Batch object
+ *
+ * @return true if all non-optional requests succeeded, false otherwise
+ */
+static bool
+rtnl_batch_send(rtnl_batch_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool               ack     = false;
+    int                pending = self->count;
+    bool               failed  = false;
+    struct sockaddr_nl sa      = { .nl_family = AF_NETLINK };
+    struct iovec       iov     = { self->buf.data, self->used };
+    struct msghdr      msg     = {
+        .msg_name    = &sa,
+        .msg_namelen = sizeof sa,
+        .msg_iov     = &iov,
+        .msg_iovlen  = 1,
+    };
+
+    if( !self->count ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( !rtnl_open() )
+        goto EXIT;
+
+    if( sendmsg(rtnl_fd, &msg, 0) == -1 ) {
+        log_err("rtnetlink send: %m");
+        goto EXIT;
+    }
+
+    while( pending > 0 ) {
+        union {
+            char            data[RTNL_BUFFER_SIZE];
+            struct nlmsghdr align;
+        } rsp;
+
+        struct pollfd pfd = { .fd = rtnl_fd, .events = POLLIN };
+        if( poll(&pfd, 1, RTNL_REPLY_TIMEOUT_MS) != 1 ) {
+            log_err("rtnetlink reply timeout");
+            goto EXIT;
+        }
+
+        ssize_t len = recv(rtnl_fd, rsp.data, sizeof rsp.data, 0);
+        if( len == -1 ) {
+            /* Overflowing link notifications are not an issue */
+            if( errno == EINTR || errno == EAGAIN || errno == ENOBUFS )
+                continue;
+            log_err("rtnetlink recv: %m");
+            goto EXIT;
+        }
+
+        for( struct nlmsghdr *nh = &rsp.align; NLMSG_OK(nh, (size_t)len);
+             nh = NLMSG_NEXT(nh, len) ) {
+            if( nh->nlmsg_type != NLMSG_ERROR )
+                continue;
+
+            unsigned idx = nh->nlmsg_seq - self->seq;
+            if( idx >= (unsigned)self->count )
+                continue;
+
+            struct nlmsgerr *err = NLMSG_DATA(nh);
+            if( err->error && !self->optional[idx] ) {
+                log_err("rtnetlink request %u failed: %s", idx,
+                        strerror(-err->error));
+                failed = true;
+            }
+            --pending;
+        }
+    }
+
+    ack = !failed;
+
+EXIT:
+    self->used  = 0;
+    self->count = 0;
+
+    return ack;
+}
+
+/** Queue removal of IPv4 addresses from network interface
+ *
+ * @param self     Batch object
+ * @param ifindex  Interface index
+ * @param keep     Address that should be left in place
+ *
+ * @return true on success, false on failure
+ */
+static bool
+rtnl_flush_addrs(rtnl_batch_t *self, int ifindex, in_addr_t keep)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool ack = false;
+    int  fd  = -1;
+
+    struct {
+        struct nlmsghdr  nh;
+        struct ifaddrmsg ifa;
+    } req = {
+        .nh = {
+            .nlmsg_len   = NLMSG_LENGTH(sizeof(struct ifaddrmsg)),
+            .nlmsg_type  = RTM_GETADDR,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+            .nlmsg_seq   = ++rtnl_seq,
+        },
+        .ifa = {
+            .ifa_family = AF_INET,
+        },
+    };
+
+    /* Use separate socket for the dump, so that replies do not get
+     * mixed with link notifications */
+    if( (fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) == -1 )
+        goto EXIT;
+
+    if( send(fd, &req, req.nh.nlmsg_len, 0) == -1 )
+        goto EXIT;
+
+    for( ;; ) {
+        union {
+            char            data[RTNL_BUFFER_SIZE];
+            struct nlmsghdr align;
+        } rsp;
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if( poll(&pfd, 1, RTNL_REPLY_TIMEOUT_MS) != 1 )
+            goto EXIT;
+
+        ssize_t len = recv(fd, rsp.data, sizeof rsp.data, 0);
+        if( len <= 0 )
+            goto EXIT;
+
+        for( struct nlmsghdr *nh = &rsp.align; NLMSG_OK(nh, (size_t)len);
+             nh = NLMSG_NEXT(nh, len) ) {
+            if( nh->nlmsg_type == NLMSG_DONE ) {
+                ack = true;
+                goto EXIT;
+            }
+            if( nh->nlmsg_type == NLMSG_ERROR )
+                goto EXIT;
+            if( nh->nlmsg_type != RTM_NEWADDR )
+                continue;
+
+            struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+            if( ifa->ifa_index != (unsigned)ifindex )
+                continue;
+
+            int        rlen = IFA_PAYLOAD(nh);
+            in_addr_t  addr = INADDR_ANY;
+            bool       have = false;
+            for( struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, rlen);
+                 rta = RTA_NEXT(rta, rlen) ) {
+                if( rta->rta_type == IFA_LOCAL &&
+                    RTA_PAYLOAD(rta) == sizeof addr ) {
+                    memcpy(&addr, RTA_DATA(rta), sizeof addr);
+                    have = true;
+                }
+            }
+            if( !have || addr == keep )
+                continue;
+
+            struct nlmsghdr *del = rtnl_batch_add(self, RTM_DELADDR, 0, true,
+                                                  ifa, sizeof *ifa);
+            if( !del || !rtnl_batch_attr(self, del, IFA_LOCAL,
+                                         &addr, sizeof addr) )
+                goto EXIT;
+        }
+    }
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    return ack;
+}
+
+/** Queue network interface up / down request
+ *
+ * @param self     Batch object
+ * @param ifindex  Interface index
+ * @param up       true to bring the link up, false to take it down
+ *
+ * @return true on success, false on failure
+ */
+static bool
+rtnl_set_link_up(rtnl_batch_t *self, int ifindex, bool up)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct ifinfomsg ifi = {
+        .ifi_family = AF_UNSPEC,
+        .ifi_index  = ifindex,
+        .ifi_flags  = up ? IFF_UP : 0,
+        .ifi_change = IFF_UP,
+    };
+
+    return rtnl_batch_add(self, RTM_NEWLINK, 0, false, &ifi, sizeof ifi) != 0;
+}
+
+/** Queue addition / removal of IPv4 default route
+ *
+ * @param self      Batch object
+ * @param type      RTM_NEWROUTE or RTM_DELROUTE
+ * @param flags     Additional NLM_F_xxx flags
+ * @param optional  true if failure should not fail the batch
+ * @param gw        Gateway address, in network byte order
+ * @param ifindex   Interface index, or zero to let kernel choose
+ *
+ * @return true on success, false on failure
+ */
+static bool
+rtnl_default_route(rtnl_batch_t *self, int type, int flags, bool optional,
+                   in_addr_t gw, int ifindex)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct rtmsg rtm = {
+        .rtm_family   = AF_INET,
+        .rtm_table    = RT_TABLE_MAIN,
+        .rtm_protocol = RTPROT_BOOT,
+        .rtm_scope    = RT_SCOPE_UNIVERSE,
+        .rtm_type     = RTN_UNICAST,
+    };
+
+    struct nlmsghdr *nh = rtnl_batch_add(self, type, flags, optional,
+                                         &rtm, sizeof rtm);
+    if( !nh || !rtnl_batch_attr(self, nh, RTA_GATEWAY, &gw, sizeof gw) )
+        return false;
+
+    if( ifindex > 0 &&
+        !rtnl_batch_attr(self, nh, RTA_OIF, &ifindex, sizeof ifindex) )
+        return false;
+
+    return true;
+}
+
+/** Wait until usable network interface shows up
  *
- * @return true on success, false on failure
+ * Blocks until RTM_NEWLINK notification makes a usable interface
+ * available, timeout expires, or ongoing worker job gets cancelled.
+ *
+ * @param tmo_ms  Maximum time to wait [ms]
+ *
+ * @return true if interface exists, false otherwise
  */
 static bool
-legacy_get_connection_data(ipforward_data_t *ipforward)
+rtnl_wait_link(unsigned tmo_ms)
 {
     LOG_REGISTER_CONTEXT;
 
-    static const char path[] = "/etc/resolv.conf";
-
-    bool    ack  = false;
-    FILE   *file = 0;
-    char   *buff = 0;
-    size_t  size = 0;
+    bool    ack      = false;
+    int64_t deadline = g_get_monotonic_time() / 1000 + tmo_ms;
+    char   *interface = 0;
 
-    if( !(file = fopen(path, "r")) ) {
-        log_warning("%s: can't open for reading: %m", path);
+    /* Subscribe before checking to avoid missing notifications */
+    if( !rtnl_open() )
         goto EXIT;
-    }
 
-    int count = 0;
-    while( count < 2 && getline(&buff, &size, file) >= 0 ) {
-        /* skip comment and empty lines */
-        if( strchr("#\n", *buff) )
-            continue;
+    for( ;; ) {
+        /* Drain already queued notifications */
+        char buf[RTNL_BUFFER_SIZE];
+        while( recv(rtnl_fd, buf, sizeof buf, 0) > 0 || errno == ENOBUFS )
+            ;
 
-        gchar **tokens = g_strsplit(buff, " ", 3);
-        if( !tokens || !tokens[0] || !tokens[1] ) {
-            // ignore
-        }
-        else if( !g_strcmp0(tokens[0], "nameserver") ) {
-            // TODO: can have '\n' at eol?
-            g_strstrip(tokens[1]);
-            if( ++count == 1 )
-                ipforward_data_set_dns1(ipforward, tokens[1]);
-            else
-                ipforward_data_set_dns2(ipforward, tokens[1]);
+        if( (interface = network_probe_interface()) ) {
+            ack = true;
+            break;
         }
-        g_strfreev(tokens);
-    }
 
-    if( count < 1 ) {
-        log_warning("%s: no nameserver lines found", path);
-        goto EXIT;
+        int64_t left = deadline - g_get_monotonic_time() / 1000;
+        if( left <= 0 )
+            break;
+
+        struct pollfd pfd[2] = {
+            { .fd = rtnl_fd,                .events = POLLIN },
+            { .fd = worker_get_cancel_fd(), .events = POLLIN },
+        };
+        int rc = poll(pfd, pfd[1].fd == -1 ? 1 : 2, (int)left);
+        if( rc == -1 && errno != EINTR )
+            break;
+        if( rc > 0 && (pfd[1].revents & POLLIN) ) {
+            log_debug("waiting for network interface cancelled");
+            break;
+        }
     }
 
-    /* FIXME: connman_service_get_connection_data() duplicates
-     *        dns1 if dns2 is not set - is this necessary?
-     */
-    if( count == 1 )
-        ipforward_data_set_dns2(ipforward, ipforward->dns1);
-
-    ack = true;
-
 EXIT:
-    free(buff);
-
-    if( file )
-        fclose(file);
-
+    free(interface);
     return ack;
 }
-#endif
 
 /* ========================================================================= *
  * NETWORK
@@ -806,11 +2564,7 @@ network_interface_exists(char *interface)
     bool ack = false;
 
     if(interface)
-    {
-        char path[PATH_MAX];
-        snprintf(path, sizeof path, "/sys/class/net/%s", interface);
-        ack = (access(path, F_OK) == 0);
-    }
+        ack = (if_nametoindex(interface) != 0);
 
     return ack;
 }
@@ -836,9 +2590,15 @@ network_get_interface(const modedata_t *data)
         /* Use the configured value */
         interface = setting, setting = 0;
     }
+    else if( network_interface_exists(interface = gadget_get_ifname()) )
+    {
+        /* Use the one kernel created for gadget network function */
+        log_debug("configured %s interface does not exist", setting ?: "NULL");
+    }
     else
     {
         /* Fall back to default value */
+        free(interface);
         interface = strdup(default_interface);
         if( !network_interface_exists(interface) )
         {
@@ -872,7 +2632,7 @@ network_setup_ip_forwarding(const modedata_t *data, ipforward_data_t *ipforward)
     char *interface     = 0;
     char *nat_interface = 0;
 
-    char command[256];
+    const firewall_backend_t *backend = 0;
 
     if( !(interface = network_get_interface(data)) )
         goto EXIT;
@@ -888,14 +2648,17 @@ network_setup_ip_forwarding(const modedata_t *data, ipforward_data_t *ipforward)
 
     write_to_file("/proc/sys/net/ipv4/ip_forward", "1");
 
-    snprintf(command, sizeof command, "/sbin/iptables -t nat -A POSTROUTING -o %s -j MASQUERADE", nat_interface);
-    common_system(command);
-
-    snprintf(command, sizeof command, "/sbin/iptables -A FORWARD -i %s -o %s  -m state  --state RELATED,ESTABLISHED -j ACCEPT", nat_interface, interface);
-    common_system(command);
-
-    snprintf(command, sizeof command, "/sbin/iptables -A FORWARD -i %s -o %s -j ACCEPT", interface, nat_interface);
-    common_system(command);
+    backend = firewall_select_backend();
+    if( !backend->setup(interface, nat_interface) ) {
+        log_warning("%s: applying firewall rules failed", backend->name);
+        /* Retry with plain iptables, if it was not tried yet */
+        if( backend == &firewall_shell_backend )
+            goto EXIT;
+        backend = &firewall_shell_backend;
+        if( !backend->setup(interface, nat_interface) )
+            goto EXIT;
+    }
+    firewall_active_backend = backend;
 
     log_debug("ipforwarding success!");
     failed = 0;
@@ -916,7 +2679,14 @@ network_cleanup_ip_forwarding(void)
 
     write_to_file("/proc/sys/net/ipv4/ip_forward", "0");
 
-    common_system("/sbin/iptables -F FORWARD");
+    /* Use the same backend that was used for setup */
+    const firewall_backend_t *backend = firewall_active_backend;
+    if( !backend )
+        backend = firewall_select_backend();
+    firewall_active_backend = 0;
+
+    if( !backend->cleanup() )
+        log_warning("%s: removing firewall rules failed", backend->name);
 }
 
 /** Validate udhcpd.conf symlink
@@ -961,10 +2731,11 @@ network_write_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
     // assume failure
     int err = -1;
 
-    FILE  *conffile = 0;
-    char  *interface = 0;
-    char  *ip = 0;
-    char  *netmask = 0;
+    FILE    *conffile = 0;
+    char    *interface = 0;
+    char    *ip = 0;
+    char    *netmask = 0;
+    GString *text = 0;
 
     if( !(interface = network_get_interface(data)) ) {
         log_err("no network interface");
@@ -988,34 +2759,51 @@ network_write_udhcpd_config(const modedata_t *data, ipforward_data_t *ipforward)
         goto EXIT;
     }
 
-    /* /tmp and /run is often tmpfs, so we avoid writing to flash */
-    if( mkdir(UDHCP_CONFIG_DIR, 0775) == -1 && errno != EEXIST ) {
-        log_warning("%s: can't create directory: %m", UDHCP_CONFIG_DIR);
-    }
-
-    /* print all data in the file */
-    if( !(conffile = fopen(UDHCP_CONFIG_PATH, "w")) ) {
-        log_err("%s: can't open for writing: %m", UDHCP_CONFIG_PATH);
-        goto EXIT;
-    }
-
-    fprintf(conffile, "start\t%.*s.1\n", len, ip);
-    fprintf(conffile, "end\t%.*s.15\n", len, ip);
-    fprintf(conffile, "interface\t%s\n", interface);
-    fprintf(conffile, "option\tsubnet\t%s\n", netmask);
-    fprintf(conffile, "option\tlease\t3600\n");
-    fprintf(conffile, "max_leases\t15\n");
+    text = g_string_new(0);
+    g_string_append_printf(text, "start\t%.*s.1\n", len, ip);
+    g_string_append_printf(text, "end\t%.*s.15\n", len, ip);
+    g_string_append_printf(text, "interface\t%s\n", interface);
+    g_string_append_printf(text, "option\tsubnet\t%s\n", netmask);
+    g_string_append_printf(text, "option\tlease\t3600\n");
+    g_string_append_printf(text, "max_leases\t15\n");
 
     if(ipforward != NULL)
     {
         if( !ipforward->dns1 || !ipforward->dns2 )
             log_debug("No dns info!");
         else
-            fprintf(conffile, "opt\tdns\t%s %s\n", ipforward->dns1, ipforward->dns2);
-        fprintf(conffile, "opt\trouter\t%s\n", ip);
+            g_string_append_printf(text, "opt\tdns\t%s %s\n", ipforward->dns1, ipforward->dns2);
+        g_string_append_printf(text, "opt\trouter\t%s\n", ip);
+    }
+
+    /* Skip rewriting if the file still holds the same data */
+    if( !g_strcmp0(network_udhcpd_config_text, text->str) &&
+        access(UDHCP_CONFIG_PATH, F_OK) == 0 ) {
+        log_debug("%s: unchanged", UDHCP_CONFIG_PATH);
     }
+    else {
+        g_free(network_udhcpd_config_text), network_udhcpd_config_text = 0;
+
+        /* /tmp and /run is often tmpfs, so we avoid writing to flash */
+        if( mkdir(UDHCP_CONFIG_DIR, 0775) == -1 && errno != EEXIST ) {
+            log_warning("%s: can't create directory: %m", UDHCP_CONFIG_DIR);
+        }
+
+        /* print all data in the file */
+        if( !(conffile = fopen(UDHCP_CONFIG_PATH, "w")) ) {
+            log_err("%s: can't open for writing: %m", UDHCP_CONFIG_PATH);
+            goto EXIT;
+        }
 
-    fclose(conffile), conffile = 0;
+        if( fputs(text->str, conffile) == EOF || fclose(conffile) == EOF ) {
+            conffile = 0;
+            log_err("%s: write failed: %m", UDHCP_CONFIG_PATH);
+            goto EXIT;
+        }
+        conffile = 0;
+
+        network_udhcpd_config_text = g_strdup(text->str);
+    }
 
     /* check that we have a valid symlink */
     if( network_check_udhcpd_symlink() != 0 ) {
@@ -1040,6 +2828,74 @@ EXIT:
     free(interface);
     if( conffile )
         fclose(conffile);
+    if( text )
+        g_string_free(text, TRUE);
+
+    return err;
+}
+
+/** Check if the embedded dhcp server should be used instead of udhcpd
+ *
+ * @return true if [network] dhcpd = builtin is configured, false otherwise
+ */
+bool
+network_use_builtin_dhcpd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gchar *setting = config_get_conf_string(NETWORK_ENTRY, NETWORK_DHCPD_KEY);
+    bool   builtin = !g_strcmp0(setting, "builtin");
+    g_free(setting);
+    return builtin;
+}
+
+/** Start the embedded dhcp server with udhcpd.conf equivalent settings
+ *
+ * @param data       Dynamic mode data
+ * @param ipforward  NULL if we want a simple config, otherwise include dns info etc...
+ *
+ * @return zero on success, non-zero otherwise
+ */
+static int
+network_start_builtin_dhcpd(const modedata_t *data, ipforward_data_t *ipforward)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int   err       = -1;
+    char *interface = 0;
+    char *ip        = 0;
+    char *netmask   = 0;
+
+    if( !(interface = network_get_interface(data)) ) {
+        log_err("no network interface");
+        goto EXIT;
+    }
+
+    if( !(ip = config_get_network_setting(NETWORK_IP_KEY)) ) {
+        log_err("no network address");
+        goto EXIT;
+    }
+
+    if( !(netmask = config_get_network_setting(NETWORK_NETMASK_KEY)) ) {
+        log_err("no network address mask");
+        goto EXIT;
+    }
+
+    if( ipforward && (!ipforward->dns1 || !ipforward->dns2) )
+        log_debug("No dns info!");
+
+    if( !dhcpd_start(interface, ip, netmask,
+                     ipforward ? ipforward->dns1 : 0,
+                     ipforward ? ipforward->dns2 : 0,
+                     ipforward != 0) )
+        goto EXIT;
+
+    err = 0;
+
+EXIT:
+    free(netmask);
+    free(ip);
+    free(interface);
 
     return err;
 }
@@ -1093,7 +2949,10 @@ network_update_udhcpd_config(const modedata_t *data)
     }
 
     /* ipforward can be NULL here, which is expected and handled in this function */
-    ret = network_write_udhcpd_config(data, ipforward);
+    if( data->dhcp_server && network_use_builtin_dhcpd() )
+        ret = network_start_builtin_dhcpd(data, ipforward);
+    else
+        ret = network_write_udhcpd_config(data, ipforward);
 
     if( ret == 0 && data->nat )
         ret = network_setup_ip_forwarding(data, ipforward);
@@ -1104,6 +2963,37 @@ EXIT:
     return ret;
 }
 
+/** Write udhcpd configuration ahead of mode activation
+ *
+ * Used for pre-staging while cable connection is being debounced.
+ * Only modes that do not share a data connection are handled, as
+ * connection details obtained this early might be stale by the time
+ * the mode actually gets activated.
+ *
+ * @param data  Dynamic mode data
+ *
+ * @return zero on success, non-zero otherwise
+ */
+int
+network_prestage_udhcpd_config(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int ret = 1;
+
+    if( !data->dhcp_server || data->nat )
+        goto EXIT;
+
+    /* Embedded server is started once the interface is up */
+    if( network_use_builtin_dhcpd() )
+        goto EXIT;
+
+    ret = network_write_udhcpd_config(data, NULL);
+
+EXIT:
+    return ret;
+}
+
 /** Activate the network interface
  *
  * @param data  Dynamic mode data (not used)
@@ -1123,7 +3013,8 @@ network_up(const modedata_t *data)
     gchar *netmask   = 0;
     gchar *gateway   = 0;
 
-    char command[256];
+    rtnl_batch_t batch  = { .count = 0 };
+    int          ifindex = 0;
 
     if( !(interface = network_get_interface(data)) ) {
         log_err("no network interface");
@@ -1147,28 +3038,86 @@ network_up(const modedata_t *data)
 
     if( !strcmp(address, "dhcp") )
     {
-        snprintf(command, sizeof command,"dhclient -d %s", interface);
-        if( common_system(command) != 0 ) {
-            snprintf(command, sizeof command,"udhcpc -i %s", interface);
-            if( common_system(command) != 0 )
+        /* Both clients stay in foreground - no time limit, but
+         * the worker canceling the mode switch terminates them,
+         * also when executed from a pipeline stage thread */
+        if( common_spawn(0, "dhclient", "-d", interface) != 0 ) {
+            if( common_spawn(0, "udhcpc", "-i", interface) != 0 )
                 goto EXIT;
         }
     }
     else
     {
-        snprintf(command, sizeof command,"ifconfig %s %s netmask %s", interface, address, netmask);
-        if( common_system(command) != 0 )
+        struct in_addr addr, mask;
+
+        if( !(ifindex = if_nametoindex(interface)) ) {
+            log_err("%s: no such interface", interface);
+            goto EXIT;
+        }
+        if( inet_pton(AF_INET, address, &addr) != 1 ) {
+            log_err("invalid network address '%s'", address);
+            goto EXIT;
+        }
+        if( inet_pton(AF_INET, netmask, &mask) != 1 ) {
+            log_err("invalid network address mask '%s'", netmask);
+            goto EXIT;
+        }
+
+        /* Address, link state and route changes are sent as
+         * one rtnetlink batch. Like with ifconfig, the configured
+         * address replaces any previous ones. */
+        struct in_addr broadcast = {
+            .s_addr = addr.s_addr | ~mask.s_addr,
+        };
+        struct ifaddrmsg ifa = {
+            .ifa_family    = AF_INET,
+            .ifa_prefixlen = __builtin_popcount(mask.s_addr),
+            .ifa_scope     = RT_SCOPE_UNIVERSE,
+            .ifa_index     = ifindex,
+        };
+
+        if( !rtnl_flush_addrs(&batch, ifindex, addr.s_addr) )
+            log_warning("%s: could not list old addresses", interface);
+
+        struct nlmsghdr *nh = rtnl_batch_add(&batch, RTM_NEWADDR,
+                                             NLM_F_CREATE | NLM_F_REPLACE,
+                                             false, &ifa, sizeof ifa);
+        if( !nh ||
+            !rtnl_batch_attr(&batch, nh, IFA_LOCAL, &addr, sizeof addr) ||
+            !rtnl_batch_attr(&batch, nh, IFA_ADDRESS, &addr, sizeof addr) ||
+            !rtnl_batch_attr(&batch, nh, IFA_BROADCAST, &broadcast, sizeof broadcast) )
+            goto EXIT;
+
+        if( !rtnl_set_link_up(&batch, ifindex, true) )
             goto EXIT;
     }
 
     /* TODO: Check first if there is a gateway set */
+    struct in_addr gw = { .s_addr = 0 };
     if( gateway )
     {
-        snprintf(command, sizeof command,"route add default gw %s", gateway);
-        if( common_system(command) != 0 )
+        if( inet_pton(AF_INET, gateway, &gw) != 1 ) {
+            log_err("invalid network gateway '%s'", gateway);
+            goto EXIT;
+        }
+
+        /* Like route(8) used to do: append, so that whatever default
+         * route the device already has (wlan, cellular) is retained */
+        if( !rtnl_default_route(&batch, RTM_NEWROUTE,
+                                NLM_F_CREATE | NLM_F_APPEND, false,
+                                gw.s_addr, ifindex) )
             goto EXIT;
     }
 
+    if( !rtnl_batch_send(&batch) )
+        goto EXIT;
+
+    if( gateway ) {
+        network_default_route.added   = true;
+        network_default_route.gw      = gw.s_addr;
+        network_default_route.ifindex = ifindex;
+    }
+
     ret = 0;
 
 EXIT:
@@ -1195,17 +3144,28 @@ network_down(const modedata_t *data)
 {
     LOG_REGISTER_CONTEXT;
 
-    gchar *interface = network_get_interface(data);
-
-    char command[256];
+    gchar        *interface = network_get_interface(data);
+    int           ifindex   = interface ? (int)if_nametoindex(interface) : 0;
+    rtnl_batch_t  batch     = { .count = 0 };
 
     log_debug("iface=%s nat=%d", interface ?: "n/a", data->nat);
 
-    if( interface ) {
-        snprintf(command, sizeof command,"ifconfig %s down", interface);
-        common_system(command);
+    dhcpd_stop();
+
+    /* Remove exactly the default route network_up() added */
+    if( network_default_route.added ) {
+        network_default_route.added = false;
+        rtnl_default_route(&batch, RTM_DELROUTE, 0, true,
+                           network_default_route.gw,
+                           network_default_route.ifindex);
     }
 
+    if( ifindex > 0 )
+        rtnl_set_link_up(&batch, ifindex, false);
+
+    if( !rtnl_batch_send(&batch) )
+        log_warning("%s: could not take interface down", interface ?: "n/a");
+
     /* dhcp client shutdown happens on disconnect automatically */
     if(data->nat)
         network_cleanup_ip_forwarding();
@@ -1213,9 +3173,137 @@ network_down(const modedata_t *data)
     g_free(interface);
 }
 
+/** Get network interface to use without diagnostic logging
+ *
+ * Like #network_get_interface(), but suitable for use from
+ * wait polling callbacks.
+ *
+ * @return interface name, or NULL if no suitable interface exists
+ */
+static char *
+network_probe_interface(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    char *interface = config_get_network_setting(NETWORK_INTERFACE_KEY);
+
+    if( !network_interface_exists(interface) ) {
+        free(interface);
+        interface = gadget_get_ifname();
+    }
+
+    if( !network_interface_exists(interface) ) {
+        free(interface);
+        interface = strdup(default_interface);
+        if( !network_interface_exists(interface) )
+            free(interface), interface = 0;
+    }
+
+    return interface;
+}
+
+/** Get network interface flags
+ *
+ * @param interface  Interface name
+ * @param flags      Where to store IFF_xxx flags
+ *
+ * @return true on success, false on failure
+ */
+static bool
+network_interface_flags(const char *interface, unsigned *flags)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool         ack = false;
+    int          fd  = -1;
+    struct ifreq ifr = {};
+
+    if( !interface || strlen(interface) >= sizeof ifr.ifr_name )
+        goto EXIT;
+
+    if( (fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1 )
+        goto EXIT;
+
+    strcpy(ifr.ifr_name, interface);
+    if( ioctl(fd, SIOCGIFFLAGS, &ifr) == -1 )
+        goto EXIT;
+
+    *flags = (unsigned short)ifr.ifr_flags;
+    ack = true;
+
+EXIT:
+    if( fd != -1 )
+        close(fd);
+
+    return ack;
+}
+
+/** Check if the network interface to use exists
+ *
+ * @param data  Dynamic mode data (not used)
+ *
+ * @return true if interface exists, false otherwise
+ */
+bool
+network_is_present(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)data;
+
+    char *interface = network_probe_interface();
+    bool  present   = (interface != 0);
+
+    free(interface);
+    return present;
+}
+
+/** Check if the network interface is up and has link
+ *
+ * @param data  Dynamic mode data (not used)
+ *
+ * @return true if interface is up and running, false otherwise
+ */
+bool
+network_is_running(const modedata_t *data)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)data;
+
+    char     *interface = network_probe_interface();
+    unsigned  flags     = 0;
+    bool      running   = false;
+
+    if( network_interface_flags(interface, &flags) )
+        running = (flags & (IFF_UP | IFF_RUNNING)) == (IFF_UP | IFF_RUNNING);
+
+    free(interface);
+    return running;
+}
+
+/** Wait until the network interface to use exists
+ *
+ * Uses rtnetlink link notifications instead of polling.
+ *
+ * @param data    Dynamic mode data (not used)
+ * @param tmo_ms  Maximum time to wait [ms]
+ *
+ * @return true if interface exists, false otherwise
+ */
+bool
+network_wait_present(const modedata_t *data, unsigned tmo_ms)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)data;
+
+    return rtnl_wait_link(tmo_ms);
+}
+
 /** Update the network interface with the new setting if connected.
  *
- * Should be called when relevant settings have changed.
+ * Executed in worker thread, see worker_request_network_refresh().
  */
 void
 network_update(void)
@@ -1228,6 +3316,19 @@ network_update(void)
             network_down(data);
             network_up(data);
         }
-        modedata_free(data);
+        modedata_unref(data);
     }
 }
+
+/** Release network resources on exit
+ */
+void
+network_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    dhcpd_stop();
+    rtnl_close();
+
+    g_free(network_udhcpd_config_text), network_udhcpd_config_text = 0;
+}
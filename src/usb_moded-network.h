@@ -42,13 +42,26 @@
 
 bool connman_set_tethering(const char *technology, bool on);
 
+/* ------------------------------------------------------------------------- *
+ * NETWORK_WATCH
+ * ------------------------------------------------------------------------- */
+
+bool network_watch_start(void);
+void network_watch_stop (void);
+
 /* ------------------------------------------------------------------------- *
  * NETWORK
  * ------------------------------------------------------------------------- */
 
-int  network_update_udhcpd_config(const modedata_t *data);
-int  network_up                  (const modedata_t *data);
-void network_down                (const modedata_t *data);
-void network_update              (void);
+bool network_use_builtin_dhcpd     (void);
+int  network_update_udhcpd_config  (const modedata_t *data);
+int  network_prestage_udhcpd_config(const modedata_t *data);
+int  network_up                    (const modedata_t *data);
+void network_down                  (const modedata_t *data);
+bool network_is_present            (const modedata_t *data);
+bool network_is_running            (const modedata_t *data);
+bool network_wait_present          (const modedata_t *data, unsigned tmo_ms);
+void network_update                (void);
+void network_quit                  (void);
 
 #endif /* USB_MODED_NETWORK_H_ */
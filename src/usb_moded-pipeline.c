@@ -0,0 +1,401 @@
+/**
+ * @file usb_moded-pipeline.c
+ *
+ * Executor for mode switch stages with explicit dependencies
+ *
+ * Stages whose dependencies have been satisfied are started right
+ * away, independent stages run concurrently in short lived threads.
+ * Stage threads follow cancellation of the worker job they were
+ * started from, see worker_set_cancel_token().
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "usb_moded-pipeline.h"
+
+#include "usb_moded-log.h"
+#include "usb_moded-trace.h"
+#include "usb_moded-worker.h"
+
+#include <pthread.h> // NOTRIM
+#include <unistd.h>
+
+#include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+typedef enum
+{
+    /** Waiting for dependencies */
+    PIPELINE_STAGE_WAITING,
+
+    /** Executing in a thread of its own */
+    PIPELINE_STAGE_RUNNING,
+
+    /** Finished successfully */
+    PIPELINE_STAGE_DONE,
+
+    /** Failed, or skipped due to failed dependencies */
+    PIPELINE_STAGE_FAILED,
+} pipeline_state_t;
+
+/** Pipeline stage */
+typedef struct pipeline_stage_t
+{
+    /** Stage name; must be a string literal - used as trace phase */
+    const char         *ps_name;
+
+    /** Stage callback */
+    pipeline_stage_fn   ps_fn;
+
+    /** Context pointer to pass to ps_fn */
+    void               *ps_aptr;
+
+    /** Bitmask of stages that must finish successfully first */
+    unsigned            ps_after;
+
+    /** Execution state */
+    pipeline_state_t    ps_state;
+
+    /** Set by the stage thread when ps_fn has returned */
+    bool                ps_finished;
+
+    /** Value returned by ps_fn */
+    bool                ps_result;
+
+    /** Stage thread, valid while ps_state is PIPELINE_STAGE_RUNNING */
+    pthread_t           ps_thread;
+
+    /** Cancellation token of the worker job that started the stage */
+    worker_cancel_token_t ps_cancel;
+
+    /** Trace span id */
+    int                 ps_span;
+
+    /** Pipeline the stage belongs to */
+    struct pipeline_t  *ps_pipeline;
+} pipeline_stage_t;
+
+/** Collection of stages that are executed together */
+struct pipeline_t
+{
+    /** Stages in the order of adding */
+    pipeline_stage_t  pl_stage[PIPELINE_STAGES_MAX];
+
+    /** Number of stages */
+    size_t            pl_count;
+
+    /** Mutex for stage completion bookkeeping */
+    pthread_mutex_t   pl_mutex;
+
+    /** Signaled when a stage thread finishes */
+    pthread_cond_t    pl_cond;
+};
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * PIPELINE_STAGE
+ * ------------------------------------------------------------------------- */
+
+static void *pipeline_stage_thread_cb(void *aptr);
+static bool  pipeline_stage_start    (pipeline_stage_t *self);
+static void  pipeline_stage_finish   (pipeline_stage_t *self, bool ack);
+
+/* ------------------------------------------------------------------------- *
+ * PIPELINE
+ * ------------------------------------------------------------------------- */
+
+pipeline_t *pipeline_create    (void);
+void        pipeline_delete    (pipeline_t *self);
+unsigned    pipeline_add       (pipeline_t *self, const char *name, pipeline_stage_fn fn, void *aptr, unsigned after);
+static void pipeline_wait_stage(pipeline_t *self);
+bool        pipeline_run       (pipeline_t *self);
+
+/* ========================================================================= *
+ * PIPELINE_STAGE
+ * ========================================================================= */
+
+static void *
+pipeline_stage_thread_cb(void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pipeline_stage_t *self = aptr;
+    pipeline_t       *pipe = self->ps_pipeline;
+
+    /* Waits within the stage must wake up when the job that
+     * started it gets superseded, just like in worker thread. */
+    worker_set_cancel_token(&self->ps_cancel);
+
+    bool ack = self->ps_fn(self->ps_aptr);
+
+    pthread_mutex_lock(&pipe->pl_mutex);
+    self->ps_result   = ack;
+    self->ps_finished = true;
+    pthread_cond_broadcast(&pipe->pl_cond);
+    pthread_mutex_unlock(&pipe->pl_mutex);
+
+    return 0;
+}
+
+/** Start executing stage in a thread of its own
+ *
+ * @param self  Stage object
+ *
+ * @return true if stage thread was started, false otherwise
+ */
+static bool
+pipeline_stage_start(pipeline_stage_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    self->ps_finished = false;
+    self->ps_cancel   = worker_get_cancel_token();
+    self->ps_span     = trace_span_begin_concurrent(self->ps_name);
+
+    int err = pthread_create(&self->ps_thread, 0,
+                             pipeline_stage_thread_cb, self);
+    if( err ) {
+        log_warning("%s: failed to start stage thread: %s",
+                    self->ps_name, g_strerror(err));
+        return false;
+    }
+
+    log_debug("%s: started", self->ps_name);
+    self->ps_state = PIPELINE_STAGE_RUNNING;
+    return true;
+}
+
+/** Record stage result
+ *
+ * @param self  Stage object
+ * @param ack   true if stage succeeded, false otherwise
+ */
+static void
+pipeline_stage_finish(pipeline_stage_t *self, bool ack)
+{
+    LOG_REGISTER_CONTEXT;
+
+    trace_span_end(self->ps_span);
+    self->ps_state = ack ? PIPELINE_STAGE_DONE : PIPELINE_STAGE_FAILED;
+    if( ack )
+        log_debug("%s: done", self->ps_name);
+    else
+        log_warning("%s: failed", self->ps_name);
+}
+
+/* ========================================================================= *
+ * PIPELINE
+ * ========================================================================= */
+
+/** Create an empty pipeline
+ *
+ * @return pipeline object, release with pipeline_delete()
+ */
+pipeline_t *
+pipeline_create(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    pipeline_t *self = g_malloc0(sizeof *self);
+
+    self->pl_count = 0;
+    pthread_mutex_init(&self->pl_mutex, 0);
+    pthread_cond_init(&self->pl_cond, 0);
+
+    return self;
+}
+
+/** Release pipeline object
+ *
+ * @param self  pipeline object that is not running, or NULL
+ */
+void
+pipeline_delete(pipeline_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        pthread_cond_destroy(&self->pl_cond);
+        pthread_mutex_destroy(&self->pl_mutex);
+        g_free(self);
+    }
+}
+
+/** Add a stage to pipeline
+ *
+ * As dependencies are expressed as values returned for previously
+ * added stages, stages always depend only on earlier stages.
+ *
+ * @param self   pipeline object
+ * @param name   stage name; must be a string literal
+ * @param fn     stage callback
+ * @param aptr   context pointer to pass to fn
+ * @param after  bitmask of stages that must succeed before this one,
+ *               or zero
+ *
+ * @return bitmask for the added stage, or zero if there is no room
+ */
+unsigned
+pipeline_add(pipeline_t *self, const char *name, pipeline_stage_fn fn,
+             void *aptr, unsigned after)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned id = 0;
+
+    if( self->pl_count >= PIPELINE_STAGES_MAX ) {
+        log_err("%s: too many pipeline stages", name);
+        goto EXIT;
+    }
+
+    pipeline_stage_t *stage = &self->pl_stage[self->pl_count];
+    stage->ps_name     = name;
+    stage->ps_fn       = fn;
+    stage->ps_aptr     = aptr;
+    stage->ps_after    = after;
+    stage->ps_state    = PIPELINE_STAGE_WAITING;
+    stage->ps_finished = false;
+    stage->ps_result   = false;
+    stage->ps_span     = -1;
+    stage->ps_pipeline = self;
+
+    id = 1u << self->pl_count++;
+
+EXIT:
+    return id;
+}
+
+/** Wait until at least one running stage finishes
+ *
+ * @param self  pipeline object with running stages
+ */
+static void
+pipeline_wait_stage(pipeline_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool reaped = false;
+
+    pthread_mutex_lock(&self->pl_mutex);
+    while( !reaped ) {
+        for( size_t i = 0; i < self->pl_count; ++i ) {
+            pipeline_stage_t *stage = &self->pl_stage[i];
+            if( stage->ps_state != PIPELINE_STAGE_RUNNING ||
+                !stage->ps_finished )
+                continue;
+            pthread_join(stage->ps_thread, 0);
+            pipeline_stage_finish(stage, stage->ps_result);
+            reaped = true;
+        }
+        if( !reaped )
+            pthread_cond_wait(&self->pl_cond, &self->pl_mutex);
+    }
+    pthread_mutex_unlock(&self->pl_mutex);
+}
+
+/** Execute all stages in pipeline
+ *
+ * Stages are started as soon as the stages they depend on have
+ * finished. When only one stage can make progress, it is executed
+ * directly from the calling thread.
+ *
+ * Stages that depend on failed stages are skipped. Stages that
+ * are already running are allowed to finish regardless.
+ *
+ * @param self  pipeline object
+ *
+ * @return true if all stages succeeded, false otherwise
+ */
+bool
+pipeline_run(pipeline_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    unsigned done   = 0;
+    unsigned failed = 0;
+
+    for( ;; ) {
+        size_t   running = 0;
+        size_t   ready   = 0;
+        size_t   last    = 0;
+
+        /* Note: Dependencies are always on earlier stages, so
+         *       failures propagate in one pass */
+        for( size_t i = 0; i < self->pl_count; ++i ) {
+            pipeline_stage_t *stage = &self->pl_stage[i];
+            unsigned          id    = 1u << i;
+
+            switch( stage->ps_state ) {
+            case PIPELINE_STAGE_DONE:
+                done |= id;
+                continue;
+            case PIPELINE_STAGE_FAILED:
+                failed |= id;
+                continue;
+            case PIPELINE_STAGE_RUNNING:
+                ++running;
+                continue;
+            default:
+                break;
+            }
+
+            if( stage->ps_after & failed ) {
+                log_warning("%s: skipped due to failed dependencies",
+                            stage->ps_name);
+                stage->ps_state = PIPELINE_STAGE_FAILED;
+                failed |= id;
+            }
+            else if( (stage->ps_after & done) == stage->ps_after ) {
+                ++ready;
+                last = i;
+            }
+        }
+
+        if( ready == 0 ) {
+            if( running == 0 )
+                break;
+            pipeline_wait_stage(self);
+            continue;
+        }
+
+        if( ready == 1 && running == 0 ) {
+            /* Nothing to overlap with */
+            pipeline_stage_t *stage = &self->pl_stage[last];
+            stage->ps_span = trace_span_begin_concurrent(stage->ps_name);
+            pipeline_stage_finish(stage, stage->ps_fn(stage->ps_aptr));
+            continue;
+        }
+
+        for( size_t i = 0; i < self->pl_count; ++i ) {
+            pipeline_stage_t *stage = &self->pl_stage[i];
+            if( stage->ps_state != PIPELINE_STAGE_WAITING )
+                continue;
+            if( (stage->ps_after & done) != stage->ps_after )
+                continue;
+            if( !pipeline_stage_start(stage) )
+                pipeline_stage_finish(stage, stage->ps_fn(stage->ps_aptr));
+        }
+    }
+
+    return failed == 0;
+}
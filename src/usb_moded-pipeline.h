@@ -0,0 +1,55 @@
+/**
+ * @file usb_moded-pipeline.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_PIPELINE_H_
+# define USB_MODED_PIPELINE_H_
+
+# include <stdbool.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of stages in a pipeline */
+# define PIPELINE_STAGES_MAX 16
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+typedef struct pipeline_t pipeline_t;
+
+/** Stage callback; returns true on success, false on failure */
+typedef bool (*pipeline_stage_fn)(void *aptr);
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * PIPELINE
+ * ------------------------------------------------------------------------- */
+
+pipeline_t *pipeline_create(void);
+void        pipeline_delete(pipeline_t *self);
+unsigned    pipeline_add   (pipeline_t *self, const char *name, pipeline_stage_fn fn, void *aptr, unsigned after);
+bool        pipeline_run   (pipeline_t *self);
+
+#endif /* USB_MODED_PIPELINE_H_ */
@@ -25,9 +25,14 @@
 
 #include "usb_moded-systemd.h"
 
+#include "usb_moded.h"
+#include "usb_moded-common.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
 
+#include <pthread.h> // NOTRIM
+#include <unistd.h>
+
 /* ========================================================================= *
  * Constants
  * ========================================================================= */
@@ -36,17 +41,76 @@
 #define SYSTEMD_DBUS_PATH      "/org/freedesktop/systemd1"
 #define SYSTEMD_DBUS_INTERFACE "org.freedesktop.systemd1.Manager"
 
+/** Address of user session systemd private socket, as printf format */
+#define SYSTEMD_USER_ADDRESS_FMT "unix:path=/run/user/%u/systemd/private"
+
+/** Maximum time to wait for unit control method call replies [ms] */
+#define SYSTEMD_CONTROL_TIMEOUT_MS (10 * 1000)
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Unit control job that has been sent to systemd */
+typedef struct systemd_job_t
+{
+    /** Unit name */
+    gchar           *sj_unit;
+
+    /** Method: SYSTEMD_START or SYSTEMD_STOP */
+    const char      *sj_method;
+
+    /** Pending method call, or NULL if sending failed */
+    DBusPendingCall *sj_pc;
+} systemd_job_t;
+
+/** Collection of unit control jobs that are waited for together */
+struct systemd_batch_t
+{
+    /** Which systemd instance to talk to */
+    systemd_manager_t  sb_manager;
+
+    /** Connection to systemd, or NULL if not available */
+    DBusConnection    *sb_con;
+
+    /** List of systemd_job_t objects */
+    GSList            *sb_jobs;
+};
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_JOB
+ * ------------------------------------------------------------------------- */
+
+static systemd_job_t *systemd_job_create(const char *unit, const char *method);
+static void           systemd_job_delete(systemd_job_t *self);
+static void           systemd_job_delete_cb(gpointer self);
+static bool           systemd_job_wait  (systemd_job_t *self);
+
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_BATCH
+ * ------------------------------------------------------------------------- */
+
+systemd_batch_t *systemd_batch_create(systemd_manager_t manager);
+void             systemd_batch_delete(systemd_batch_t *self);
+bool             systemd_batch_add   (systemd_batch_t *self, const char *unit, const char *method);
+bool             systemd_batch_wait  (systemd_batch_t *self, systemd_batch_done_fn done_cb, void *aptr);
+
 /* ------------------------------------------------------------------------- *
  * SYSTEMD
  * ------------------------------------------------------------------------- */
 
-gboolean systemd_control_service(const char *name, const char *method);
-gboolean systemd_control_start  (void);
-void     systemd_control_stop   (void);
+static const char     *systemd_manager_repr        (systemd_manager_t manager);
+static DBusConnection *systemd_get_user_connection (void);
+static void            systemd_drop_user_connection(void);
+static DBusConnection *systemd_get_connection      (systemd_manager_t manager);
+bool                   systemd_control_unit        (systemd_manager_t manager, const char *unit, const char *method);
+gboolean               systemd_control_service     (const char *name, const char *method);
+gboolean               systemd_control_start       (void);
+void                   systemd_control_stop        (void);
 
 /* ========================================================================= *
  * Data
@@ -55,8 +119,30 @@ void     systemd_control_stop   (void);
 /* SystemBus connection ref used for systemd control ipc */
 static DBusConnection *systemd_con = NULL;
 
+/** Private connection to user session systemd, or NULL */
+static DBusConnection *systemd_user_con = NULL;
+
+/** User whose systemd instance systemd_user_con is connected to */
+static uid_t systemd_user_uid = UID_UNKNOWN;
+
+static pthread_mutex_t  systemd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define SYSTEMD_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&systemd_mutex) != 0 ) { \
+        log_crit("SYSTEMD LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define SYSTEMD_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&systemd_mutex) != 0 ) { \
+        log_crit("SYSTEMD UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
 /* ========================================================================= *
- * Functions
+ * SYSTEMD_JOB
  * ========================================================================= */
 
 // QDBusObjectPath org.freedesktop.systemd1.Manager.StartUnit(QString name, QString mode)
@@ -64,20 +150,174 @@ static DBusConnection *systemd_con = NULL;
 
 //  mode = replace
 //  method = StartUnit or StopUnit
-gboolean systemd_control_service(const char *name, const char *method)
+
+static systemd_job_t *
+systemd_job_create(const char *unit, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_t *self = g_malloc0(sizeof *self);
+
+    self->sj_unit   = g_strdup(unit);
+    self->sj_method = method;
+    self->sj_pc     = 0;
+
+    return self;
+}
+
+static void
+systemd_job_delete(systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        if( self->sj_pc ) {
+            dbus_pending_call_cancel(self->sj_pc);
+            dbus_pending_call_unref(self->sj_pc);
+        }
+        g_free(self->sj_unit);
+        g_free(self);
+    }
+}
+
+static void
+systemd_job_delete_cb(gpointer self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_job_delete(self);
+}
+
+/** Wait for reply to unit control method call
+ *
+ * @param self  job object
+ *
+ * @return true if systemd accepted the job, false otherwise
+ */
+static bool
+systemd_job_wait(systemd_job_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusMessage *rsp = NULL;
+    DBusError    err = DBUS_ERROR_INIT;
+    const char  *res = 0;
+
+    if( !self->sj_pc )
+        goto EXIT;
+
+    /* Returns immediately if the reply has already arrived */
+    dbus_pending_call_block(self->sj_pc);
+
+    rsp = dbus_pending_call_steal_reply(self->sj_pc);
+    dbus_pending_call_unref(self->sj_pc), self->sj_pc = 0;
+
+    if( !rsp ) {
+        log_err("no reply to %s.%s request",
+                SYSTEMD_DBUS_INTERFACE,
+                self->sj_method);
+        goto EXIT;
+    }
+
+    if( dbus_set_error_from_message(&err, rsp) ) {
+        log_err("got error reply to %s.%s request: %s: %s",
+                SYSTEMD_DBUS_INTERFACE,
+                self->sj_method,
+                err.name, err.message);
+        goto EXIT;
+    }
+
+    if( !dbus_message_get_args(rsp, &err,
+                               DBUS_TYPE_OBJECT_PATH, &res,
+                               DBUS_TYPE_INVALID) ) {
+        log_err("failed to parse reply to %s.%s request: %s: %s",
+                SYSTEMD_DBUS_INTERFACE,
+                self->sj_method,
+                err.name, err.message);
+        goto EXIT;
+    }
+
+EXIT:
+    log_debug("%s(%s) -> %s", self->sj_method, self->sj_unit, res ?: "N/A");
+
+    dbus_error_free(&err);
+
+    if( rsp ) dbus_message_unref(rsp);
+
+    return res != 0;
+}
+
+/* ========================================================================= *
+ * SYSTEMD_BATCH
+ * ========================================================================= */
+
+/** Create a batch of unit control jobs
+ *
+ * Jobs are sent to systemd as they are added to the batch and
+ * the replies are then waited for in one go via systemd_batch_wait().
+ *
+ * @param manager  which systemd instance to control
+ *
+ * @return batch object, release with systemd_batch_delete()
+ */
+systemd_batch_t *
+systemd_batch_create(systemd_manager_t manager)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_batch_t *self = g_malloc0(sizeof *self);
+
+    self->sb_manager = manager;
+    self->sb_con     = systemd_get_connection(manager);
+    self->sb_jobs    = 0;
+
+    return self;
+}
+
+/** Release batch object
+ *
+ * Replies to jobs that have not been waited for are ignored.
+ *
+ * @param self  batch object, or NULL
+ */
+void
+systemd_batch_delete(systemd_batch_t *self)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( self ) {
+        g_slist_free_full(self->sb_jobs, systemd_job_delete_cb);
+        if( self->sb_con )
+            dbus_connection_unref(self->sb_con);
+        g_free(self);
+    }
+}
+
+/** Send unit control request without waiting for reply
+ *
+ * @param self    batch object
+ * @param unit    name of systemd unit
+ * @param method  SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @return true if request was sent, false otherwise
+ */
+bool
+systemd_batch_add(systemd_batch_t *self, const char *unit, const char *method)
 {
     LOG_REGISTER_CONTEXT;
 
-    DBusMessage    *req = NULL;
-    DBusMessage    *rsp = NULL;
-    DBusError       err = DBUS_ERROR_INIT;
-    const char     *arg = "replace";
-    const char     *res = 0;
+    DBusMessage   *req = NULL;
+    const char    *arg = "replace";
+    systemd_job_t *job = systemd_job_create(unit, method);
+
+    log_debug("%s(%s) @ %s ...", method, unit,
+              systemd_manager_repr(self->sb_manager));
 
-    log_debug("%s(%s) ...", method, name);
+    self->sb_jobs = g_slist_prepend(self->sb_jobs, job);
 
-    if( !systemd_con ) {
-        log_err("not connected to system bus; skip systemd unit control");
+    if( !self->sb_con ) {
+        log_err("not connected to %s systemd; skip unit control",
+                systemd_manager_repr(self->sb_manager));
         goto EXIT;
     }
 
@@ -93,7 +333,7 @@ gboolean systemd_control_service(const char *name, const char *method)
     }
 
     if( !dbus_message_append_args(req,
-                                  DBUS_TYPE_STRING, &name,
+                                  DBUS_TYPE_STRING, &job->sj_unit,
                                   DBUS_TYPE_STRING, &arg,
                                   DBUS_TYPE_INVALID))
     {
@@ -101,43 +341,211 @@ gboolean systemd_control_service(const char *name, const char *method)
         goto EXIT;
     }
 
-    rsp = dbus_connection_send_with_reply_and_block(systemd_con, req, -1, &err);
-    if( !rsp ) {
-        log_err("no reply to %s.%s request: %s: %s",
+    if( !dbus_connection_send_with_reply(self->sb_con, req, &job->sj_pc,
+                                         SYSTEMD_CONTROL_TIMEOUT_MS) ) {
+        log_err("failed to send %s.%s request",
                 SYSTEMD_DBUS_INTERFACE,
-                method,
-                err.name, err.message);
+                method);
         goto EXIT;
     }
 
-    if( dbus_set_error_from_message(&err, rsp) ) {
-        log_err("got error reply to %s.%s request: %s: %s",
-                SYSTEMD_DBUS_INTERFACE,
-                method,
-                err.name, err.message);
+    /* Null pending call means the connection was already closed */
+    if( !job->sj_pc )
+        log_err("%s systemd connection is closed",
+                systemd_manager_repr(self->sb_manager));
+
+EXIT:
+    if( req ) dbus_message_unref(req);
+
+    return job->sj_pc != 0;
+}
+
+/** Wait for replies to all jobs in a batch
+ *
+ * As the requests have already been sent, the total wait time is
+ * bounded by the slowest reply rather than sum of all of them,
+ * and each individual reply by SYSTEMD_CONTROL_TIMEOUT_MS.
+ *
+ * The batch is emptied and can be reused for submitting more jobs.
+ *
+ * @param self     batch object
+ * @param done_cb  function to call for each job, or NULL
+ * @param aptr     context pointer to pass to done_cb
+ *
+ * @return true if all jobs were accepted by systemd, false otherwise
+ */
+bool
+systemd_batch_wait(systemd_batch_t *self, systemd_batch_done_fn done_cb,
+                   void *aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int failed = 0;
+
+    /* Jobs were prepended; reverse to handle them in submit order */
+    self->sb_jobs = g_slist_reverse(self->sb_jobs);
+
+    for( GSList *iter = self->sb_jobs; iter; iter = iter->next ) {
+        systemd_job_t *job = iter->data;
+        bool ok = job->sj_pc && systemd_job_wait(job);
+        if( !ok )
+            ++failed;
+        if( done_cb )
+            done_cb(job->sj_unit, ok, aptr);
+    }
+
+    g_slist_free_full(self->sb_jobs, systemd_job_delete_cb),
+        self->sb_jobs = 0;
+
+    /* Private connection is probably not usable after failures */
+    if( failed && self->sb_manager == SYSTEMD_MANAGER_USER )
+        systemd_drop_user_connection();
+
+    return failed == 0;
+}
+
+/* ========================================================================= *
+ * SYSTEMD
+ * ========================================================================= */
+
+static const char *
+systemd_manager_repr(systemd_manager_t manager)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return manager == SYSTEMD_MANAGER_USER ? "user" : "system";
+}
+
+/** Get connection to systemd instance of the current user
+ *
+ * Connects directly to the private socket user session systemd
+ * provides, like "systemctl --user" does, so that no helper
+ * processes are needed.
+ *
+ * @return connection ref, or NULL
+ */
+static DBusConnection *
+systemd_get_user_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusConnection *con  = 0;
+    DBusError       err  = DBUS_ERROR_INIT;
+    gchar          *addr = 0;
+    uid_t           uid  = usbmoded_get_current_user();
+
+    SYSTEMD_LOCKED_ENTER;
+
+    if( systemd_user_con ) {
+        if( systemd_user_uid == uid &&
+            dbus_connection_get_is_connected(systemd_user_con) )
+            goto EXIT;
+
+        dbus_connection_close(systemd_user_con);
+        dbus_connection_unref(systemd_user_con),
+            systemd_user_con = 0;
+    }
+
+    if( uid == UID_UNKNOWN ) {
+        log_warning("current user unknown; skip user systemd connect");
         goto EXIT;
     }
 
-    if( !dbus_message_get_args(rsp, &err,
-                               DBUS_TYPE_OBJECT_PATH, &res,
-                               DBUS_TYPE_INVALID) ) {
-        log_err("failed to parse reply to %s.%s request: %s: %s",
-                SYSTEMD_DBUS_INTERFACE,
-                method,
-                err.name, err.message);
+    addr = g_strdup_printf(SYSTEMD_USER_ADDRESS_FMT, (unsigned)uid);
+    if( !(systemd_user_con = dbus_connection_open_private(addr, &err)) ) {
+        log_err("%s: can't connect: %s: %s", addr, err.name, err.message);
         goto EXIT;
     }
 
+    dbus_connection_set_exit_on_disconnect(systemd_user_con, false);
+    systemd_user_uid = uid;
+    log_debug("connected to %s", addr);
+
 EXIT:
+    if( systemd_user_con )
+        con = dbus_connection_ref(systemd_user_con);
+
+    SYSTEMD_LOCKED_LEAVE;
 
     dbus_error_free(&err);
+    g_free(addr);
 
-    if( rsp ) dbus_message_unref(rsp);
-    if( req ) dbus_message_unref(req);
+    return con;
+}
 
-    log_debug("%s(%s) -> %s", method, name, res ?: "N/A");
+/** Close private connection to user session systemd
+ */
+static void
+systemd_drop_user_connection(void)
+{
+    LOG_REGISTER_CONTEXT;
 
-    return res != 0;
+    SYSTEMD_LOCKED_ENTER;
+
+    if( systemd_user_con ) {
+        log_debug("disconnecting from user systemd");
+        dbus_connection_close(systemd_user_con);
+        dbus_connection_unref(systemd_user_con),
+            systemd_user_con = 0;
+    }
+    systemd_user_uid = UID_UNKNOWN;
+
+    SYSTEMD_LOCKED_LEAVE;
+}
+
+/** Get connection for controlling a systemd instance
+ *
+ * @param manager  which systemd instance to control
+ *
+ * @return connection ref, or NULL
+ */
+static DBusConnection *
+systemd_get_connection(systemd_manager_t manager)
+{
+    LOG_REGISTER_CONTEXT;
+
+    DBusConnection *con = 0;
+
+    if( manager == SYSTEMD_MANAGER_USER ) {
+        con = systemd_get_user_connection();
+    }
+    else {
+        SYSTEMD_LOCKED_ENTER;
+        if( systemd_con )
+            con = dbus_connection_ref(systemd_con);
+        SYSTEMD_LOCKED_LEAVE;
+    }
+
+    return con;
+}
+
+/** Start or stop a single systemd unit
+ *
+ * @param manager  which systemd instance to control
+ * @param unit     name of systemd unit
+ * @param method   SYSTEMD_START or SYSTEMD_STOP
+ *
+ * @return true if systemd accepted the job, false otherwise
+ */
+bool
+systemd_control_unit(systemd_manager_t manager, const char *unit,
+                     const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    systemd_batch_t *batch = systemd_batch_create(manager);
+    bool ack = (systemd_batch_add(batch, unit, method) &&
+                systemd_batch_wait(batch, 0, 0));
+    systemd_batch_delete(batch);
+
+    return ack;
+}
+
+gboolean systemd_control_service(const char *name, const char *method)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return systemd_control_unit(SYSTEMD_MANAGER_SYSTEM, name, method);
 }
 
 /* ========================================================================= *
@@ -154,11 +562,19 @@ systemd_control_start(void)
     log_debug("starting systemd control");
 
     /* Get connection ref */
-    if( (systemd_con = umdbus_get_connection()) == 0 )
+    DBusConnection *con = umdbus_get_connection();
+    if( con == 0 )
     {
         log_err("Could not connect to dbus for systemd control\n");
         goto cleanup;
     }
+
+    SYSTEMD_LOCKED_ENTER;
+    if( systemd_con )
+        dbus_connection_unref(systemd_con);
+    systemd_con = con;
+    SYSTEMD_LOCKED_LEAVE;
+
     ack = TRUE;
 
 cleanup:
@@ -173,10 +589,14 @@ systemd_control_stop(void)
 
     log_debug("stopping systemd control");
 
+    SYSTEMD_LOCKED_ENTER;
     if(systemd_con)
     {
         /* Let go of connection ref */
         dbus_connection_unref(systemd_con),
             systemd_con = 0;
     }
+    SYSTEMD_LOCKED_LEAVE;
+
+    systemd_drop_user_connection();
 }
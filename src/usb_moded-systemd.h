@@ -25,6 +25,7 @@
 #ifndef  USB_MODED_SYSTEMD_H_
 # define USB_MODED_SYSTEMD_H_
 
+# include <stdbool.h>
 # include <glib.h>
 
 /* ========================================================================= *
@@ -34,14 +35,47 @@
 # define SYSTEMD_STOP   "StopUnit"
 # define SYSTEMD_START   "StartUnit"
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Systemd instances usb-moded can control */
+typedef enum systemd_manager_t
+{
+    /** System wide systemd, via SystemBus */
+    SYSTEMD_MANAGER_SYSTEM,
+    /** Session systemd of the current user, via private socket */
+    SYSTEMD_MANAGER_USER,
+} systemd_manager_t;
+
+typedef struct systemd_batch_t systemd_batch_t;
+
+/** Callback for reporting results of individual jobs in a batch
+ *
+ * @param unit  name of systemd unit
+ * @param ok    true if systemd accepted the job, false otherwise
+ * @param aptr  context pointer given to systemd_batch_wait()
+ */
+typedef void (*systemd_batch_done_fn)(const char *unit, bool ok, void *aptr);
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
 
+/* ------------------------------------------------------------------------- *
+ * SYSTEMD_BATCH
+ * ------------------------------------------------------------------------- */
+
+systemd_batch_t *systemd_batch_create(systemd_manager_t manager);
+void             systemd_batch_delete(systemd_batch_t *self);
+bool             systemd_batch_add   (systemd_batch_t *self, const char *unit, const char *method);
+bool             systemd_batch_wait  (systemd_batch_t *self, systemd_batch_done_fn done_cb, void *aptr);
+
 /* ------------------------------------------------------------------------- *
  * SYSTEMD
  * ------------------------------------------------------------------------- */
 
+bool     systemd_control_unit   (systemd_manager_t manager, const char *unit, const char *method);
 gboolean systemd_control_service(const char *name, const char *method);
 gboolean systemd_control_start  (void);
 void     systemd_control_stop   (void);
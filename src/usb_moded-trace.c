@@ -0,0 +1,619 @@
+/**
+ * @file usb_moded-trace.c
+ *
+ * Mode switch latency tracing.
+ *
+ * The worker thread marks the beginning and end of each mode switch
+ * and of the phases within it. Completed switches are accumulated to
+ * per-mode latency histograms and a short history of recent switch
+ * traces, which can be queried over D-Bus without enabling debug
+ * logging.
+ *
+ * In addition, resource usage counters are bumped at choke points
+ * such as subprocess spawning and sysfs writes. Counts that accrue
+ * while a mode switch is in progress are attributed to that switch.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/* Tracing the tracer would only add noise */
+#define LOG_DISABLE_CALL_TRACE
+
+#include "usb_moded-trace.h"
+
+#include "usb_moded-log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h> // NOTRIM
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Maximum number of phases recorded per mode switch */
+#define TRACE_SPANS_MAX   24
+
+/** Number of completed mode switch traces to keep */
+#define TRACE_HISTORY_MAX 8
+
+/** Maximum length of mode names stored in traces */
+#define TRACE_MODE_MAX    64
+
+/** Upper bounds of latency histogram buckets [ms]
+ *
+ * The last bucket holds everything that is slower.
+ */
+static const unsigned trace_bucket_ms[] =
+{
+    50, 100, 200, 500, 1000, 2000, 5000, 10000,
+};
+
+#define TRACE_BUCKETS (G_N_ELEMENTS(trace_bucket_ms) + 1)
+
+/** Names of resource usage counters, for reporting purposes */
+static const char * const trace_counter_name[TRACE_COUNTER_NUMOF] =
+{
+    [TRACE_COUNTER_SPAWN]         = "spawn",
+    [TRACE_COUNTER_SYSFS_WRITE]   = "sysfs_write",
+    [TRACE_COUNTER_CONFIG_PARSE]  = "config_parse",
+    [TRACE_COUNTER_DBUS_CALL]     = "dbus_call",
+    [TRACE_COUNTER_DBUS_SEND]     = "dbus_send",
+    [TRACE_COUNTER_MODEDATA_COPY] = "modedata_copy",
+};
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Timing of one mode switch phase */
+typedef struct trace_span_t
+{
+    /** Phase name; must be a string literal */
+    const char *ts_phase;
+
+    /** Nesting level, zero for top level phases */
+    int         ts_depth;
+
+    /** Monotonic begin time [us] */
+    gint64      ts_begin;
+
+    /** Monotonic end time [us], or zero if still in progress */
+    gint64      ts_end;
+
+    /** Span overlaps with its siblings instead of nesting them */
+    bool        ts_concurrent;
+} trace_span_t;
+
+/** Timing of one mode switch */
+typedef struct trace_switch_t
+{
+    /** Running mode switch number */
+    unsigned     tw_id;
+
+    /** Requested mode */
+    char         tw_mode[TRACE_MODE_MAX];
+
+    /** Mode that actually got activated */
+    char         tw_activated[TRACE_MODE_MAX];
+
+    /** Monotonic begin time [us] */
+    gint64       tw_begin;
+
+    /** Monotonic end time [us] */
+    gint64       tw_end;
+
+    /** Current phase nesting level */
+    int          tw_depth;
+
+    /** Number of recorded phases */
+    size_t       tw_spans;
+
+    /** Recorded phases, in order of starting */
+    trace_span_t tw_span[TRACE_SPANS_MAX];
+
+    /** Resource usage counter values at start of the switch */
+    unsigned     tw_base[TRACE_COUNTER_NUMOF];
+
+    /** Resources used during the switch */
+    unsigned     tw_cost[TRACE_COUNTER_NUMOF];
+} trace_switch_t;
+
+/** Latency statistics for one mode */
+typedef struct trace_stats_t
+{
+    /** Number of switches to the mode */
+    unsigned ty_count;
+
+    /** Fastest switch [us] */
+    gint64   ty_min;
+
+    /** Slowest switch [us] */
+    gint64   ty_max;
+
+    /** Sum of all switch durations [us] */
+    gint64   ty_sum;
+
+    /** Latency histogram */
+    unsigned ty_hist[TRACE_BUCKETS];
+
+    /** Sum of resources used by all switches */
+    unsigned ty_cost[TRACE_COUNTER_NUMOF];
+} trace_stats_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TRACE
+ * ------------------------------------------------------------------------- */
+
+static void    trace_copy_mode      (char *buff, const char *mode);
+static size_t  trace_bucket         (gint64 duration);
+static void    trace_record_locked  (const trace_switch_t *sw);
+void           trace_count          (trace_counter_t counter);
+static void    trace_snapshot       (unsigned *counts);
+void           trace_switch_begin   (const char *mode);
+void           trace_switch_end     (const char *activated);
+static int     trace_span_begin_ex  (const char *phase, bool concurrent);
+int            trace_span_begin     (const char *phase);
+int            trace_span_begin_concurrent(const char *phase);
+void           trace_span_end       (int span);
+static void    trace_report_stats   (GString *str, const char *mode, const trace_stats_t *stats);
+static void    trace_report_switch  (GString *str, const trace_switch_t *sw);
+static void    trace_report_costs   (GString *str, const char *prefix, const unsigned *costs, unsigned count);
+gchar         *trace_get_report     (void);
+void           trace_quit           (void);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+/** Mode switch in progress
+ *
+ * Accessed only from the worker thread.
+ */
+static trace_switch_t trace_current;
+
+/** Flag for: trace_current holds mode switch in progress */
+static bool trace_current_active = false;
+
+/** Number of mode switches started so far */
+static unsigned trace_switch_count = 0;
+
+/** Ring buffer of recently completed mode switches */
+static trace_switch_t trace_history[TRACE_HISTORY_MAX];
+
+/** Number of mode switches recorded in trace_history */
+static unsigned trace_history_count = 0;
+
+/** Mode name -> trace_stats_t lookup table */
+static GHashTable *trace_stats = 0;
+
+/** Resource usage counters since startup
+ *
+ * Updated atomically from any thread, see #trace_count().
+ */
+static gint trace_counter_total[TRACE_COUNTER_NUMOF];
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define TRACE_LOCKED_ENTER do {\
+    if( pthread_mutex_lock(&trace_mutex) != 0 ) { \
+        log_crit("TRACE LOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+#define TRACE_LOCKED_LEAVE do {\
+    if( pthread_mutex_unlock(&trace_mutex) != 0 ) { \
+        log_crit("TRACE UNLOCK FAILED");\
+        _exit(EXIT_FAILURE);\
+    }\
+}while(0)
+
+/* ========================================================================= *
+ * TRACE
+ * ========================================================================= */
+
+/** Store mode name to fixed size buffer
+ *
+ * @param buff  Buffer of TRACE_MODE_MAX bytes
+ * @param mode  Mode name, or NULL
+ */
+static void
+trace_copy_mode(char *buff, const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_strlcpy(buff, mode ?: "", TRACE_MODE_MAX);
+}
+
+/** Map duration to histogram bucket
+ *
+ * @param duration  Duration [us]
+ *
+ * @return bucket index
+ */
+static size_t
+trace_bucket(gint64 duration)
+{
+    LOG_REGISTER_CONTEXT;
+
+    size_t bucket = 0;
+
+    while( bucket < G_N_ELEMENTS(trace_bucket_ms) &&
+           duration > trace_bucket_ms[bucket] * (gint64)1000 )
+        ++bucket;
+
+    return bucket;
+}
+
+/** Accumulate completed mode switch to statistics and history
+ *
+ * @param sw  Completed mode switch
+ */
+static void
+trace_record_locked(const trace_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gint64 duration = sw->tw_end - sw->tw_begin;
+
+    if( !trace_stats )
+        trace_stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, g_free);
+
+    trace_stats_t *stats = g_hash_table_lookup(trace_stats, sw->tw_mode);
+    if( !stats ) {
+        stats = g_malloc0(sizeof *stats);
+        g_hash_table_replace(trace_stats, g_strdup(sw->tw_mode), stats);
+    }
+
+    if( stats->ty_count == 0 || stats->ty_min > duration )
+        stats->ty_min = duration;
+    if( stats->ty_max < duration )
+        stats->ty_max = duration;
+    stats->ty_sum += duration;
+    stats->ty_count += 1;
+    stats->ty_hist[trace_bucket(duration)] += 1;
+    for( size_t i = 0; i < TRACE_COUNTER_NUMOF; ++i )
+        stats->ty_cost[i] += sw->tw_cost[i];
+
+    trace_history[trace_history_count++ % TRACE_HISTORY_MAX] = *sw;
+}
+
+/** Account use of a resource
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @param counter  Resource that was used
+ */
+void
+trace_count(trace_counter_t counter)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( counter >= 0 && counter < TRACE_COUNTER_NUMOF )
+        g_atomic_int_inc(&trace_counter_total[counter]);
+}
+
+/** Take snapshot of resource usage counters
+ *
+ * @param counts  Array of TRACE_COUNTER_NUMOF elements to fill in
+ */
+static void
+trace_snapshot(unsigned *counts)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( size_t i = 0; i < TRACE_COUNTER_NUMOF; ++i )
+        counts[i] = (unsigned)g_atomic_int_get(&trace_counter_total[i]);
+}
+
+/** Mark start of a mode switch
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param mode  Mode being activated
+ */
+void
+trace_switch_begin(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    memset(&trace_current, 0, sizeof trace_current);
+    trace_current.tw_id    = ++trace_switch_count;
+    trace_current.tw_begin = g_get_monotonic_time();
+    trace_copy_mode(trace_current.tw_mode, mode);
+    trace_snapshot(trace_current.tw_base);
+    trace_current_active = true;
+}
+
+/** Mark end of a mode switch
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param activated  Mode that ended up being activated
+ */
+void
+trace_switch_end(const char *activated)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !trace_current_active )
+        goto EXIT;
+
+    trace_current_active = false;
+    trace_current.tw_end = g_get_monotonic_time();
+    trace_copy_mode(trace_current.tw_activated, activated);
+
+    unsigned now[TRACE_COUNTER_NUMOF];
+    trace_snapshot(now);
+    for( size_t i = 0; i < TRACE_COUNTER_NUMOF; ++i )
+        trace_current.tw_cost[i] = now[i] - trace_current.tw_base[i];
+
+    log_debug("mode switch #%u: %s -> %s took %.1f ms",
+              trace_current.tw_id,
+              trace_current.tw_mode,
+              trace_current.tw_activated,
+              (trace_current.tw_end - trace_current.tw_begin) * 1e-3);
+
+    TRACE_LOCKED_ENTER;
+    trace_record_locked(&trace_current);
+    TRACE_LOCKED_LEAVE;
+
+EXIT:
+    return;
+}
+
+static int
+trace_span_begin_ex(const char *phase, bool concurrent)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int span = -1;
+
+    if( !trace_current_active )
+        goto EXIT;
+
+    if( trace_current.tw_spans >= TRACE_SPANS_MAX )
+        goto EXIT;
+
+    span = (int)trace_current.tw_spans++;
+
+    trace_span_t *ts = &trace_current.tw_span[span];
+    ts->ts_phase      = phase;
+    ts->ts_depth      = trace_current.tw_depth;
+    ts->ts_begin      = g_get_monotonic_time();
+    ts->ts_end        = 0;
+    ts->ts_concurrent = concurrent;
+
+    if( !concurrent )
+        trace_current.tw_depth++;
+
+EXIT:
+    return span;
+}
+
+/** Mark start of a mode switch phase
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param phase  Name of the phase; must be a string literal
+ *
+ * @return span handle to pass to #trace_span_end(), or -1
+ */
+int
+trace_span_begin(const char *phase)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return trace_span_begin_ex(phase, false);
+}
+
+/** Mark start of a mode switch phase that runs in parallel with others
+ *
+ * Unlike with #trace_span_begin(), spans started after this one are
+ * not nested under it, and ending order does not matter.
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param phase  Name of the phase; must be a string literal
+ *
+ * @return span handle to pass to #trace_span_end(), or -1
+ */
+int
+trace_span_begin_concurrent(const char *phase)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return trace_span_begin_ex(phase, true);
+}
+
+/** Mark end of a mode switch phase
+ *
+ * Note: This function should be called only from the worker thread.
+ *
+ * @param span  Value returned by #trace_span_begin()
+ */
+void
+trace_span_end(int span)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !trace_current_active )
+        goto EXIT;
+
+    if( span < 0 || (size_t)span >= trace_current.tw_spans )
+        goto EXIT;
+
+    trace_span_t *ts = &trace_current.tw_span[span];
+    if( ts->ts_end )
+        goto EXIT;
+
+    ts->ts_end = g_get_monotonic_time();
+    if( !ts->ts_concurrent )
+        trace_current.tw_depth = ts->ts_depth;
+
+EXIT:
+    return;
+}
+
+/** Append resource usage counts to report
+ *
+ * @param str     Report being constructed
+ * @param prefix  Text to start the line with
+ * @param costs   Array of TRACE_COUNTER_NUMOF counts
+ * @param count   Number of switches the counts cover, or zero for
+ *                reporting the counts as is instead of averages
+ */
+static void
+trace_report_costs(GString *str, const char *prefix,
+                   const unsigned *costs, unsigned count)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_string_append(str, prefix);
+    for( size_t i = 0; i < TRACE_COUNTER_NUMOF; ++i ) {
+        if( count )
+            g_string_append_printf(str, " %s=%.1f", trace_counter_name[i],
+                                   costs[i] / (double)count);
+        else
+            g_string_append_printf(str, " %s=%u", trace_counter_name[i],
+                                   costs[i]);
+    }
+    g_string_append_c(str, '\n');
+}
+
+/** Append per-mode statistics to report
+ *
+ * @param str    Report being constructed
+ * @param mode   Mode name
+ * @param stats  Statistics for the mode
+ */
+static void
+trace_report_stats(GString *str, const char *mode, const trace_stats_t *stats)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_string_append_printf(str, "mode %s: count=%u min=%.1f avg=%.1f max=%.1f ms; hist",
+                           mode, stats->ty_count,
+                           stats->ty_min * 1e-3,
+                           stats->ty_sum * 1e-3 / stats->ty_count,
+                           stats->ty_max * 1e-3);
+
+    for( size_t i = 0; i < TRACE_BUCKETS; ++i ) {
+        if( i < G_N_ELEMENTS(trace_bucket_ms) )
+            g_string_append_printf(str, " <=%u:%u",
+                                   trace_bucket_ms[i], stats->ty_hist[i]);
+        else
+            g_string_append_printf(str, " >%u:%u",
+                                   trace_bucket_ms[i - 1], stats->ty_hist[i]);
+    }
+    g_string_append_c(str, '\n');
+
+    trace_report_costs(str, "  avg cost:", stats->ty_cost, stats->ty_count);
+}
+
+/** Append mode switch trace to report
+ *
+ * @param str  Report being constructed
+ * @param sw   Completed mode switch
+ */
+static void
+trace_report_switch(GString *str, const trace_switch_t *sw)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_string_append_printf(str, "switch #%u: %s -> %s %.1f ms\n",
+                           sw->tw_id, sw->tw_mode, sw->tw_activated,
+                           (sw->tw_end - sw->tw_begin) * 1e-3);
+
+    for( size_t i = 0; i < sw->tw_spans; ++i ) {
+        const trace_span_t *ts = &sw->tw_span[i];
+        gint64 end = ts->ts_end ?: sw->tw_end;
+        g_string_append_printf(str, "  %*s%s: +%.1f %.1f ms%s\n",
+                               ts->ts_depth * 2, "", ts->ts_phase,
+                               (ts->ts_begin - sw->tw_begin) * 1e-3,
+                               (end - ts->ts_begin) * 1e-3,
+                               ts->ts_end ? "" : " (unfinished)");
+    }
+
+    trace_report_costs(str, "  cost:", sw->tw_cost, 0);
+}
+
+/** Get human readable mode switch latency and resource usage report
+ *
+ * Note: This function is safe to call from any thread.
+ *
+ * @return report text, release with g_free()
+ */
+gchar *
+trace_get_report(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GString *str = g_string_new(0);
+    unsigned total[TRACE_COUNTER_NUMOF];
+
+    trace_snapshot(total);
+    trace_report_costs(str, "total:", total, 0);
+
+    TRACE_LOCKED_ENTER;
+
+    if( trace_stats ) {
+        GList *modes = g_list_sort(g_hash_table_get_keys(trace_stats),
+                                   (GCompareFunc)g_strcmp0);
+        for( GList *iter = modes; iter; iter = iter->next ) {
+            const char *mode = iter->data;
+            trace_report_stats(str, mode,
+                               g_hash_table_lookup(trace_stats, mode));
+        }
+        g_list_free(modes);
+    }
+
+    unsigned count = MIN(trace_history_count, TRACE_HISTORY_MAX);
+    for( unsigned i = 0; i < count; ++i ) {
+        unsigned slot = (trace_history_count - count + i) % TRACE_HISTORY_MAX;
+        trace_report_switch(str, &trace_history[slot]);
+    }
+
+    TRACE_LOCKED_LEAVE;
+
+    return g_string_free(str, FALSE);
+}
+
+/** Release tracing related dynamic resources
+ */
+void
+trace_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    TRACE_LOCKED_ENTER;
+
+    if( trace_stats )
+        g_hash_table_unref(trace_stats), trace_stats = 0;
+
+    trace_history_count = 0;
+
+    TRACE_LOCKED_LEAVE;
+}
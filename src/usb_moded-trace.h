@@ -0,0 +1,72 @@
+/**
+ * @file usb_moded-trace.h
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef  USB_MODED_TRACE_H_
+# define USB_MODED_TRACE_H_
+
+# include <stdbool.h>
+# include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Resource usage counters accounted per mode switch */
+typedef enum trace_counter_t
+{
+    /** Subprocesses spawned */
+    TRACE_COUNTER_SPAWN,
+
+    /** Writes to sysfs / configfs control files */
+    TRACE_COUNTER_SYSFS_WRITE,
+
+    /** Configuration files parsed */
+    TRACE_COUNTER_CONFIG_PARSE,
+
+    /** Blocking D-Bus method calls made */
+    TRACE_COUNTER_DBUS_CALL,
+
+    /** D-Bus messages sent without waiting for reply */
+    TRACE_COUNTER_DBUS_SEND,
+
+    /** Mode data copies allocated */
+    TRACE_COUNTER_MODEDATA_COPY,
+
+    TRACE_COUNTER_NUMOF
+} trace_counter_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* ------------------------------------------------------------------------- *
+ * TRACE
+ * ------------------------------------------------------------------------- */
+
+void   trace_count       (trace_counter_t counter);
+void   trace_switch_begin(const char *mode);
+void   trace_switch_end  (const char *activated);
+int    trace_span_begin  (const char *phase);
+int    trace_span_begin_concurrent(const char *phase);
+void   trace_span_end    (int span);
+gchar *trace_get_report  (void);
+void   trace_quit        (void);
+
+#endif /* USB_MODED_TRACE_H_ */
@@ -172,38 +172,46 @@ static gboolean trigger_udev_input_cb(GIOChannel *iochannel G_GNUC_UNUSED, GIOCo
 {
     LOG_REGISTER_CONTEXT;
 
-    struct udev_device *dev;
+    struct udev_device *last = 0;
 
     if(cond & G_IO_IN)
     {
-        /* This normally blocks but G_IO_IN indicates that we can read */
-        dev = udev_monitor_receive_device (trigger_udev_monitor);
-        if (dev)
-        {
-            /* check if it is the actual device we want to check */
-            if(strcmp(trigger_udev_sysname, udev_device_get_sysname(dev))) {
-                log_crit("name does not match, disabling udev trigger io-watch");
+        /* Drain all queued events and evaluate only the latest
+         * state of the trigger device */
+        for( int count = 0; ; ++count ) {
+            struct udev_device *dev = udev_monitor_receive_device(trigger_udev_monitor);
+            if( !dev ) {
+                if( count )
+                    break;
+
+                /* if we get nothing from the 1st read something bad
+                 * happened stop watching to avoid busylooping */
+                log_debug("Bad trigger data. Stopping\n");
                 trigger_udev_watch_id = 0;
+                trigger_stop();
                 return FALSE;
             }
 
-            if(!strcmp(udev_device_get_action(dev), "change"))
-            {
-                log_debug("Trigger event recieved.\n");
-                trigger_parse_udev_properties(dev);
+            /* check if it is the actual device we want to check */
+            if( !strcmp(trigger_udev_sysname, udev_device_get_sysname(dev)) &&
+                !g_strcmp0(udev_device_get_action(dev), "change") ) {
+                if( last )
+                    udev_device_unref(last);
+                last = dev;
+            }
+            else {
+                udev_device_unref(dev);
             }
-            udev_device_unref(dev);
-        }
-        /* if we get something else something bad happened stop watching to avoid busylooping */
-        else
-        {
-            log_debug("Bad trigger data. Stopping\n");
-            trigger_udev_watch_id = 0;
-            trigger_stop();
-            return FALSE;
         }
     }
 
+    if( last )
+    {
+        log_debug("Trigger event recieved.\n");
+        trigger_parse_udev_properties(last);
+        udev_device_unref(last);
+    }
+
     /* keep watching */
     return TRUE;
 }
@@ -35,9 +35,12 @@
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-log.h"
+#include "usb_moded-loopwatch.h"
 
 #include <libudev.h>
 
+#include <stdlib.h>
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -53,11 +56,24 @@ static bool          umudev_cable_state_connected  (void);
 static cable_state_t umudev_cable_state_get        (void);
 static void          umudev_cable_state_set        (cable_state_t state);
 static void          umudev_cable_state_changed    (void);
-static void          umudev_cable_state_from_udev  (cable_state_t curr);
+static gint          umudev_cable_state_flap_delay (gint delay);
+static void          umudev_cable_state_from_udev  (cable_state_t curr, bool certain);
+static void          umudev_cable_state_evaluate   (void);
+static void          umudev_cable_state_from_psy   (cable_state_t curr, bool certain);
+gchar               *umudev_get_cable_report       (void);
+static bool          umudev_typec_role_is          (struct udev_device *dev, const char *attr, const char *role);
+static int           umudev_typec_host_capable     (struct udev_device *partner);
+static cable_state_t umudev_typec_cable_state      (bool *certain);
+static void          umudev_typec_update           (void);
+static bool          umudev_typec_probe            (void);
+static void          umudev_typec_quit             (void);
 static void          umudev_io_error_cb            (gpointer data);
 static gboolean      umudev_io_input_cb            (GIOChannel *iochannel, GIOCondition cond, gpointer data);
 static void          umudev_parse_properties       (struct udev_device *dev, bool initial);
-static int           umudev_score_as_power_supply  (const char *syspath);
+static int           umudev_score_device           (struct udev_device *dev, GString *inputs);
+static struct udev_device *umudev_psy_cache_lookup (void);
+static void          umudev_psy_cache_save         (const char *syspath, int score, const char *inputs, unsigned candidates);
+static struct udev_device *umudev_psy_scan         (void);
 gboolean             umudev_init                   (void);
 void                 umudev_quit                   (void);
 
@@ -85,6 +101,55 @@ static cable_state_t umudev_cable_state_previous = CABLE_STATE_UNKNOWN;
 static guint umudev_cable_state_timer_id = 0;
 static gint  umudev_cable_state_timer_delay = -1;
 
+/** Replugs within this time from the previous one count as flapping [ms] */
+#define UMUDEV_FLAP_WINDOW_MS    5000
+
+/** Upper limit for connect debounce delay while flapping [ms] */
+#define UMUDEV_FLAP_MAX_DELAY_MS 10000
+
+/** Monotonic timestamp of the latest connect report [ms], or zero */
+static gint64   umudev_flap_connect_time = 0;
+
+/** Number of consecutive rapid replugs, used as backoff exponent */
+static unsigned umudev_flap_level = 0;
+
+/** Total number of rapid replugs seen */
+static unsigned umudev_flap_total = 0;
+
+/** Total number of connect reports seen */
+static unsigned umudev_connect_total = 0;
+
+/** Debounce delay used for the latest connect report [ms] */
+static gint     umudev_connect_delay = 0;
+
+/** Cable state as evaluated from power supply properties */
+static cable_state_t umudev_psy_state   = CABLE_STATE_UNKNOWN;
+
+/** Whether power supply type leaves no room for reclassification */
+static bool          umudev_psy_certain = false;
+
+/** Heuristically chosen power supply, survives restarts but not reboots */
+#define UMUDEV_PSY_CACHE_FILE  "/run/usb-moded/power-supply.cache"
+#define UMUDEV_PSY_CACHE_GROUP "power_supply"
+
+/** Syspath of the tracked typec port, or NULL if there is none */
+static gchar *umudev_typec_port = 0;
+
+/** Whether the typec port currently has a partner */
+static bool   umudev_typec_partner = false;
+
+/** Whether a partner has ever been seen, i.e. the driver reports them */
+static bool   umudev_typec_partner_seen = false;
+
+/** Whether the port is acting in device data role */
+static bool   umudev_typec_data_device = false;
+
+/** Whether the port is acting in sink power role */
+static bool   umudev_typec_power_sink = false;
+
+/** Partner host capability from PD identity: 1=yes, 0=no, -1=unknown */
+static int    umudev_typec_host = -1;
+
 /* ========================================================================= *
  * cable state
  * ========================================================================= */
@@ -225,7 +290,56 @@ static void umudev_cable_state_changed(void)
     control_set_cable_state(umudev_cable_state_active);
 }
 
-static void umudev_cable_state_from_udev(cable_state_t curr)
+/** Update flap bookkeeping on connect and get debounce delay to use
+ *
+ * Connects that follow the previous one within UMUDEV_FLAP_WINDOW_MS
+ * double the delay up to UMUDEV_FLAP_MAX_DELAY_MS. A connection
+ * that stays stable for the window resets the backoff.
+ *
+ * @param delay  debounce delay for stable cable [ms]
+ *
+ * @return debounce delay to use [ms]
+ */
+static gint umudev_cable_state_flap_delay(gint delay)
+{
+    LOG_REGISTER_CONTEXT;
+
+    gint64 now = g_get_monotonic_time() / 1000;
+
+    ++umudev_connect_total;
+
+    if( umudev_flap_connect_time &&
+        now - umudev_flap_connect_time < UMUDEV_FLAP_WINDOW_MS ) {
+        ++umudev_flap_total;
+        if( umudev_flap_level < 16 )
+            ++umudev_flap_level;
+    }
+    else {
+        umudev_flap_level = 0;
+    }
+    umudev_flap_connect_time = now;
+
+    if( umudev_flap_level ) {
+        if( delay < 100 )
+            delay = 100;
+        for( unsigned i = 0; i < umudev_flap_level && delay < UMUDEV_FLAP_MAX_DELAY_MS; ++i )
+            delay *= 2;
+        if( delay > UMUDEV_FLAP_MAX_DELAY_MS )
+            delay = UMUDEV_FLAP_MAX_DELAY_MS;
+        log_warning("cable flapping: level=%u total=%u, debounce %d ms",
+                    umudev_flap_level, umudev_flap_total, delay);
+    }
+
+    return umudev_connect_delay = delay;
+}
+
+/** Handle cable state reported by udev
+ *
+ * @param curr     reported cable state
+ * @param certain  true if power supply type leaves no room for
+ *                 later reclassification, e.g. dedicated pc port
+ */
+static void umudev_cable_state_from_udev(cable_state_t curr, bool certain)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -256,14 +370,33 @@ static void umudev_cable_state_from_udev(cable_state_t curr)
         /* All other transitions are handled with at least 100 ms delay.
          * This should compress multiple stale disconnect + connect
          * pairs into single action.
+         *
+         * Except when the type reported by the charger detection
+         * can't turn out to be something else later on - then the
+         * connection can be acted on immediately.
          */
-        gint delay = 100;
+        gint delay = certain ? 0 : 100;
 
-        if( curr == CABLE_STATE_PC_CONNECTED && prev != CABLE_STATE_UNKNOWN ) {
+        if( curr == CABLE_STATE_PC_CONNECTED && prev != CABLE_STATE_UNKNOWN &&
+            !certain ) {
             if( delay < usbmoded_get_cable_connection_delay() )
                 delay = usbmoded_get_cable_connection_delay();
         }
 
+        /* Possibly flaky connector -> back off exponentially */
+        if( prev == CABLE_STATE_DISCONNECTED || prev == CABLE_STATE_UNKNOWN )
+            delay = umudev_cable_state_flap_delay(delay);
+
+        if( delay <= 0 ) {
+            umudev_cable_state_set(curr);
+            goto EXIT;
+        }
+
+        /* Make use of the debounce time by preparing
+         * the mode that is likely to get selected */
+        if( curr == CABLE_STATE_PC_CONNECTED && prev != CABLE_STATE_UNKNOWN )
+            control_prestage_usb_mode();
+
         umudev_cable_state_start_timer(delay);
     }
 
@@ -271,6 +404,285 @@ EXIT:
     return;
 }
 
+/** Combine power supply and typec information into reported cable state
+ *
+ * Power supply properties are the primary source. However, when the
+ * typec partner has advertised its PD identity, whether it can act as
+ * usb host is known right after attach - before charger detection has
+ * finished and without the USB_FLOAT / Unknown guesswork. Likewise
+ * partner removal is acted on without waiting for vbus to drop.
+ */
+static void umudev_cable_state_evaluate(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    cable_state_t state   = umudev_psy_state;
+    bool          certain = umudev_psy_certain;
+
+    bool          typec_certain = false;
+    cable_state_t typec_state   = umudev_typec_cable_state(&typec_certain);
+
+    if( typec_certain && typec_state != state ) {
+        log_debug("typec overrides power supply: %s -> %s",
+                  cable_state_repr(state),
+                  cable_state_repr(typec_state));
+        state   = typec_state;
+        certain = true;
+    }
+
+    if( state == CABLE_STATE_UNKNOWN )
+        goto EXIT;
+
+    umudev_cable_state_from_udev(state, certain);
+
+EXIT:
+    return;
+}
+
+/** Handle cable state derived from power supply properties
+ *
+ * @param curr     reported cable state
+ * @param certain  true if power supply type leaves no room for
+ *                 later reclassification
+ */
+static void umudev_cable_state_from_psy(cable_state_t curr, bool certain)
+{
+    LOG_REGISTER_CONTEXT;
+
+    umudev_psy_state   = curr;
+    umudev_psy_certain = certain;
+    umudev_cable_state_evaluate();
+}
+
+/** Get human readable cable debounce statistics
+ *
+ * @return report text, release with g_free()
+ */
+gchar *umudev_get_cable_report(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return g_strdup_printf("cable: connects=%u flaps=%u level=%u debounce=%d ms\n"
+                           "typec: port=%s partner=%d data=%s power=%s host=%d\n",
+                           umudev_connect_total, umudev_flap_total,
+                           umudev_flap_level, umudev_connect_delay,
+                           umudev_typec_port ?: "none",
+                           umudev_typec_partner,
+                           umudev_typec_data_device ? "device" : "host",
+                           umudev_typec_power_sink ? "sink" : "source",
+                           umudev_typec_host);
+}
+
+/* ========================================================================= *
+ * typec
+ * ========================================================================= */
+
+/** Check selected role from typec role attribute
+ *
+ * Role attributes list alternatives with the active one in brackets,
+ * e.g. "host [device]".
+ *
+ * @param dev   typec port device
+ * @param attr  attribute name, e.g. "data_role"
+ * @param role  role name, e.g. "device"
+ *
+ * @return true if role is selected, false otherwise
+ */
+static bool umudev_typec_role_is(struct udev_device *dev, const char *attr,
+                                 const char *role)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool        is    = false;
+    const char *value = udev_device_get_sysattr_value(dev, attr);
+    gchar      *want  = 0;
+
+    if( !value )
+        goto EXIT;
+
+    want = g_strdup_printf("[%s]", role);
+    /* Fixed role ports do not use brackets */
+    is = strstr(value, want) || !strcmp(value, role);
+
+EXIT:
+    g_free(want);
+    return is;
+}
+
+/** Get partner usb host capability from PD discover identity
+ *
+ * ID Header VDO bit 31 = "USB Communications Capable as USB Host".
+ *
+ * @param partner  typec partner device
+ *
+ * @return 1 if partner is usb host capable, 0 if not, or -1
+ *         if identity has not been discovered
+ */
+static int umudev_typec_host_capable(struct udev_device *partner)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const char    *value  = udev_device_get_sysattr_value(partner, "identity/id_header");
+    unsigned long  header = value ? strtoul(value, 0, 0) : 0;
+
+    if( !header )
+        return -1;
+
+    return (header & (1ul << 31)) ? 1 : 0;
+}
+
+/** Get cable state as seen via typec class
+ *
+ * @param certain  set to true if typec information should take
+ *                 precedence over power supply properties
+ *
+ * @return cable state, or CABLE_STATE_UNKNOWN
+ */
+static cable_state_t umudev_typec_cable_state(bool *certain)
+{
+    LOG_REGISTER_CONTEXT;
+
+    cable_state_t state = CABLE_STATE_UNKNOWN;
+
+    *certain = false;
+
+    if( !umudev_typec_port )
+        goto EXIT;
+
+    if( !umudev_typec_partner ) {
+        /* Trust partner removal only if the driver has
+         * been seen to report partners in the first place */
+        state    = CABLE_STATE_DISCONNECTED;
+        *certain = umudev_typec_partner_seen;
+        goto EXIT;
+    }
+
+    /* As usb host we are not connected to a pc */
+    if( !umudev_typec_data_device )
+        goto EXIT;
+
+    if( umudev_typec_host == 1 ) {
+        state    = CABLE_STATE_PC_CONNECTED;
+        *certain = true;
+    }
+    else if( umudev_typec_host == 0 && umudev_typec_power_sink ) {
+        state    = CABLE_STATE_CHARGER_CONNECTED;
+        *certain = true;
+    }
+
+EXIT:
+    return state;
+}
+
+/** Re-read typec port and partner state from sysfs
+ */
+static void umudev_typec_update(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct udev_device *port    = 0;
+    struct udev_device *partner = 0;
+    gchar              *path    = 0;
+    bool                had     = umudev_typec_partner;
+
+    if( !umudev_object || !umudev_typec_port )
+        goto EXIT;
+
+    if( !(port = udev_device_new_from_syspath(umudev_object, umudev_typec_port)) )
+        goto EXIT;
+
+    path = g_strdup_printf("%s/%s-partner", umudev_typec_port,
+                           udev_device_get_sysname(port));
+    partner = udev_device_new_from_syspath(umudev_object, path);
+
+    umudev_typec_partner     = (partner != 0);
+    umudev_typec_data_device = umudev_typec_role_is(port, "data_role", "device");
+    umudev_typec_power_sink  = umudev_typec_role_is(port, "power_role", "sink");
+    umudev_typec_host        = partner ? umudev_typec_host_capable(partner) : -1;
+
+    if( umudev_typec_partner )
+        umudev_typec_partner_seen = true;
+
+    log_debug("typec: partner=%d data=%s power=%s host=%d",
+              umudev_typec_partner,
+              umudev_typec_data_device ? "device" : "host",
+              umudev_typec_power_sink ? "sink" : "source",
+              umudev_typec_host);
+
+    /* Identity might not be known yet, but a fresh partner in device
+     * data role is likely a pc -> use charger detection time to
+     * prepare the mode that is likely to get selected */
+    if( !had && umudev_typec_partner && umudev_typec_data_device &&
+        umudev_typec_host != 0 && !umudev_cable_state_connected() )
+        control_prestage_usb_mode();
+
+    umudev_cable_state_evaluate();
+
+EXIT:
+    if( partner )
+        udev_device_unref(partner);
+    if( port )
+        udev_device_unref(port);
+    g_free(path);
+}
+
+/** Locate typec port to track
+ *
+ * @return true if a typec port was found, false otherwise
+ */
+static bool umudev_typec_probe(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct udev_enumerate  *list  = 0;
+    struct udev_list_entry *entry = 0;
+
+    umudev_typec_quit();
+
+    if( !(list = udev_enumerate_new(umudev_object)) )
+        goto EXIT;
+
+    udev_enumerate_add_match_subsystem(list, "typec");
+    udev_enumerate_scan_devices(list);
+
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(list)) {
+        const char         *name = udev_list_entry_get_name(entry);
+        struct udev_device *dev  = udev_device_new_from_syspath(umudev_object, name);
+        if( !dev )
+            continue;
+        if( !g_strcmp0(udev_device_get_devtype(dev), "typec_port") )
+            umudev_typec_port = g_strdup(name);
+        udev_device_unref(dev);
+        if( umudev_typec_port )
+            break;
+    }
+
+    if( umudev_typec_port )
+        log_debug("typec port = %s", umudev_typec_port);
+
+EXIT:
+    if( list )
+        udev_enumerate_unref(list);
+
+    return umudev_typec_port != 0;
+}
+
+/** Forget typec tracking state
+ */
+static void umudev_typec_quit(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    g_free(umudev_typec_port),
+        umudev_typec_port = 0;
+
+    umudev_typec_partner      = false;
+    umudev_typec_partner_seen = false;
+    umudev_typec_data_device  = false;
+    umudev_typec_power_sink   = false;
+    umudev_typec_host         = -1;
+}
+
 /* ========================================================================= *
  * legacy code
  * ========================================================================= */
@@ -297,35 +709,56 @@ static gboolean umudev_io_input_cb(GIOChannel *iochannel, GIOCondition cond, gpo
     (void)iochannel;
     (void)data;
 
-    gboolean continue_watching = TRUE;
-
-    /* No code paths are allowed to bypass the common_release_wakelock() call below */
-    common_acquire_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+    gboolean            continue_watching = TRUE;
+    struct udev_device *last              = 0;
+    bool                typec             = false;
 
     if( cond & G_IO_IN )
     {
-        /* This normally blocks but G_IO_IN indicates that we can read */
-        struct udev_device *dev = udev_monitor_receive_device(umudev_monitor);
-        if( !dev )
-        {
-            /* if we get something else something bad happened stop watching to avoid busylooping */
-            continue_watching = FALSE;
-        }
-        else
-        {
-            /* check if it is the actual device we want to check */
-            if( !strcmp(umudev_sysname, udev_device_get_sysname(dev)) )
-            {
-                if( !strcmp(udev_device_get_action(dev), "change") )
-                {
-                    umudev_parse_properties(dev, false);
-                }
+        /* Drain all queued events and evaluate only the latest state
+         * of the device we are tracking. The monitor socket is
+         * non-blocking, so running out of data returns NULL. */
+        for( int count = 0; ; ++count ) {
+            struct udev_device *dev = udev_monitor_receive_device(umudev_monitor);
+            if( !dev ) {
+                /* if we get nothing from the 1st read something bad
+                 * happened stop watching to avoid busylooping */
+                if( !count )
+                    continue_watching = FALSE;
+                break;
             }
 
-            udev_device_unref(dev);
+            /* typec events just trigger re-evaluation of port state */
+            if( !g_strcmp0(udev_device_get_subsystem(dev), "typec") ) {
+                typec = true;
+                udev_device_unref(dev);
+            }
+            /* check if it is the actual device we want to check */
+            else if( !strcmp(umudev_sysname, udev_device_get_sysname(dev)) &&
+                !g_strcmp0(udev_device_get_action(dev), "change") ) {
+                if( last )
+                    udev_device_unref(last);
+                last = dev;
+            }
+            else {
+                udev_device_unref(dev);
+            }
         }
     }
 
+    if( last || typec )
+    {
+        /* Block suspend only when there is something to process */
+        common_acquire_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+        if( typec )
+            umudev_typec_update();
+        if( last )
+            umudev_parse_properties(last, false);
+        common_release_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
+        if( last )
+            udev_device_unref(last);
+    }
+
     if( cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
     {
         /* Unhandled errors turn io watch to virtual busyloop too */
@@ -338,8 +771,6 @@ static gboolean umudev_io_input_cb(GIOChannel *iochannel, GIOCondition cond, gpo
         log_crit("udev io watch disabled");
     }
 
-    common_release_wakelock(USB_MODED_WAKELOCK_PROCESS_INPUT);
-
     return continue_watching;
 }
 
@@ -392,7 +823,7 @@ static void umudev_parse_properties(struct udev_device *dev, bool initial)
 
         if( warnings && !power_supply_present )
             log_err("No usable power supply indicator\n");
-        umudev_cable_state_from_udev(CABLE_STATE_DISCONNECTED);
+        umudev_cable_state_from_psy(CABLE_STATE_DISCONNECTED, false);
     }
     else {
         if( warnings && power_supply_online )
@@ -414,35 +845,40 @@ static void umudev_parse_properties(struct udev_device *dev, bool initial)
             if( warnings )
                 log_warning("Fallback since cable detection might not be accurate. "
                             "Will connect on any voltage on charger.\n");
-            umudev_cable_state_from_udev(CABLE_STATE_PC_CONNECTED);
+            umudev_cable_state_from_psy(CABLE_STATE_PC_CONNECTED, false);
             goto cleanup;
         }
 
         log_debug("CONNECTED - POWER_SUPPLY_TYPE = %s", power_supply_type);
 
-        if( !strcmp(power_supply_type, "USB") ||
-            !strcmp(power_supply_type, "USB_CDP") ) {
-            umudev_cable_state_from_udev(CABLE_STATE_PC_CONNECTED);
+        if( !strcmp(power_supply_type, "USB_CDP") ) {
+            /* Charging downstream port is always a pc */
+            umudev_cable_state_from_psy(CABLE_STATE_PC_CONNECTED, true);
+        }
+        else if( !strcmp(power_supply_type, "USB") ) {
+            /* Chargers can be reported as standard downstream
+             * port until charger detection has finished */
+            umudev_cable_state_from_psy(CABLE_STATE_PC_CONNECTED, false);
         }
         else if( !strcmp(power_supply_type, "USB_DCP") ||
                  !strcmp(power_supply_type, "USB_HVDCP") ||
                  !strcmp(power_supply_type, "USB_HVDCP_3") ) {
-            umudev_cable_state_from_udev(CABLE_STATE_CHARGER_CONNECTED);
+            umudev_cable_state_from_psy(CABLE_STATE_CHARGER_CONNECTED, false);
         }
         else if( !strcmp(power_supply_type, "USB_FLOAT")) {
             if( !umudev_cable_state_connected() )
                 log_warning("connection type detection failed, assuming charger");
-            umudev_cable_state_from_udev(CABLE_STATE_CHARGER_CONNECTED);
+            umudev_cable_state_from_psy(CABLE_STATE_CHARGER_CONNECTED, false);
         }
         else if( !strcmp(power_supply_type, "Unknown")) {
             // nop
             log_warning("unknown connection type reported, assuming disconnected");
-            umudev_cable_state_from_udev(CABLE_STATE_DISCONNECTED);
+            umudev_cable_state_from_psy(CABLE_STATE_DISCONNECTED, false);
         }
         else {
             if( warnings )
                 log_warning("unhandled power supply type: %s", power_supply_type);
-            umudev_cable_state_from_udev(CABLE_STATE_DISCONNECTED);
+            umudev_cable_state_from_psy(CABLE_STATE_DISCONNECTED, false);
         }
     }
 
@@ -450,55 +886,214 @@ cleanup:
     return;
 }
 
-static int umudev_score_as_power_supply(const char *syspath)
+/** Evaluate how likely power supply device is the usb cable indicator
+ *
+ * @param dev     power supply device
+ * @param inputs  where to append names of matched heuristics, or NULL
+ *
+ * @return weighed score, or zero if device is not suitable
+ */
+static int umudev_score_device(struct udev_device *dev, GString *inputs)
+{
+    LOG_REGISTER_CONTEXT;
+
+    int         score   = 0;
+    const char *sysname = 0;
+
+    if( !(sysname = udev_device_get_sysname(dev)) )
+        goto EXIT;
+
+    /* try to assign a weighed score */
+
+    /* check that it is not a battery */
+    if(strstr(sysname, "battery") || strstr(sysname, "BAT"))
+        goto EXIT;
+
+    static const struct {
+        int         points;
+        const char *input;
+    } lut[] = {
+        /* if it contains usb in the name it very likely is good */
+        { 10, "usb"     },
+        /* often charger is also mentioned in the name */
+        {  5, "charger" },
+        /* present property is used to detect activity, however online is better */
+        {  5, "present" },
+        { 10, "online"  },
+        /* type is used to detect if it is a cable or dedicated charger.
+         * Bonus points if it is there. */
+        { 10, "type"    },
+    };
+
+    const bool match[G_N_ELEMENTS(lut)] = {
+        strstr(sysname, "usb") != 0,
+        strstr(sysname, "charger") != 0,
+        udev_device_get_property_value(dev, "POWER_SUPPLY_PRESENT") != 0,
+        udev_device_get_property_value(dev, "POWER_SUPPLY_ONLINE") != 0,
+        udev_device_get_property_value(dev, "POWER_SUPPLY_TYPE") != 0,
+    };
+
+    for( size_t i = 0; i < G_N_ELEMENTS(lut); ++i ) {
+        if( !match[i] )
+            continue;
+        score += lut[i].points;
+        if( inputs )
+            g_string_append_printf(inputs, "%s%s", inputs->len ? "," : "",
+                                   lut[i].input);
+    }
+
+EXIT:
+    return score;
+}
+
+/** Look up power supply device chosen by previous heuristic scan
+ *
+ * The cached choice is used only if the device still exists and
+ * scores the same as when it was chosen.
+ *
+ * @return power supply device, or NULL
+ */
+static struct udev_device *
+umudev_psy_cache_lookup(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    int                 score   = 0;
     struct udev_device *dev     = 0;
-    const char         *sysname = 0;
+    GKeyFile           *ini     = g_key_file_new();
+    gchar              *syspath = 0;
+    int                 cached  = 0;
+    int                 score   = 0;
 
-    if( !umudev_object )
+    if( !g_key_file_load_from_file(ini, UMUDEV_PSY_CACHE_FILE, 0, 0) )
         goto EXIT;
 
-    if( !(dev = udev_device_new_from_syspath(umudev_object, syspath)) )
+    syspath = g_key_file_get_string(ini, UMUDEV_PSY_CACHE_GROUP, "syspath", 0);
+    cached  = g_key_file_get_integer(ini, UMUDEV_PSY_CACHE_GROUP, "score", 0);
+
+    if( !syspath || cached <= 0 )
         goto EXIT;
 
-    if( !(sysname = udev_device_get_sysname(dev)) )
+    if( !(dev = udev_device_new_from_syspath(umudev_object, syspath)) ) {
+        log_debug("cached power supply %s is gone", syspath);
         goto EXIT;
+    }
 
-    /* try to assign a weighed score */
+    if( (score = umudev_score_device(dev, 0)) != cached ) {
+        log_debug("cached power supply %s score changed: %d -> %d",
+                  syspath, cached, score);
+        udev_device_unref(dev), dev = 0;
+        goto EXIT;
+    }
 
-    /* check that it is not a battery */
-    if(strstr(sysname, "battery") || strstr(sysname, "BAT"))
+    log_debug("using cached power supply %s", syspath);
+
+EXIT:
+    g_free(syspath);
+    g_key_file_unref(ini);
+
+    return dev;
+}
+
+/** Cache result of power supply heuristic scan
+ *
+ * @param syspath     chosen device
+ * @param score       score of the chosen device
+ * @param inputs      heuristics that matched for the chosen device
+ * @param candidates  number of power supply devices evaluated
+ */
+static void
+umudev_psy_cache_save(const char *syspath, int score, const char *inputs,
+                      unsigned candidates)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *ini  = g_key_file_new();
+    gchar    *data = 0;
+    gchar    *dir  = g_path_get_dirname(UMUDEV_PSY_CACHE_FILE);
+    GError   *err  = 0;
+
+    g_key_file_set_string(ini, UMUDEV_PSY_CACHE_GROUP, "syspath", syspath);
+    g_key_file_set_integer(ini, UMUDEV_PSY_CACHE_GROUP, "score", score);
+    g_key_file_set_string(ini, UMUDEV_PSY_CACHE_GROUP, "inputs", inputs);
+    g_key_file_set_integer(ini, UMUDEV_PSY_CACHE_GROUP, "candidates", candidates);
+
+    data = g_key_file_to_data(ini, 0, 0);
+
+    if( g_mkdir_with_parents(dir, 0755) == -1 )
+        log_warning("%s: mkdir: %m", dir);
+    else if( !g_file_set_contents(UMUDEV_PSY_CACHE_FILE, data, -1, &err) )
+        log_warning("%s: save failed: %s", UMUDEV_PSY_CACHE_FILE, err->message);
+
+    g_clear_error(&err);
+    g_free(dir);
+    g_free(data);
+    g_key_file_unref(ini);
+}
+
+/** Find power supply device most likely to be the usb cable indicator
+ *
+ * @return power supply device, or NULL
+ */
+static struct udev_device *
+umudev_psy_scan(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    struct udev_device     *best       = 0;
+    int                     best_score = 0;
+    GString                *best_why   = g_string_new(0);
+    GString                *why        = g_string_new(0);
+    unsigned                candidates = 0;
+    struct udev_enumerate  *list       = 0;
+    struct udev_list_entry *entry;
+
+    log_debug("Trying to guess $power_supply device.\n");
+
+    if( !(list = udev_enumerate_new(umudev_object)) )
         goto EXIT;
 
-    /* if it contains usb in the name it very likely is good */
-    if(strstr(sysname, "usb"))
-        score = score + 10;
+    udev_enumerate_add_match_subsystem(list, "power_supply");
+    udev_enumerate_scan_devices(list);
 
-    /* often charger is also mentioned in the name */
-    if(strstr(sysname, "charger"))
-        score = score + 5;
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(list)) {
+        const char         *name = udev_list_entry_get_name(entry);
+        struct udev_device *dev  = udev_device_new_from_syspath(umudev_object, name);
 
-    /* present property is used to detect activity, however online is better */
-    if(udev_device_get_property_value(dev, "POWER_SUPPLY_PRESENT"))
-        score = score + 5;
+        if( !dev )
+            continue;
+
+        ++candidates;
+        g_string_truncate(why, 0);
+
+        int score = umudev_score_device(dev, why);
+        if( best_score < score ) {
+            if( best )
+                udev_device_unref(best);
+            best = dev, dev = 0;
+            best_score = score;
+            g_string_assign(best_why, why->str);
+        }
 
-    if(udev_device_get_property_value(dev, "POWER_SUPPLY_ONLINE"))
-        score = score + 10;
+        if( dev )
+            udev_device_unref(dev);
+    }
 
-    /* type is used to detect if it is a cable or dedicated charger.
-     * Bonus points if it is there. */
-    if(udev_device_get_property_value(dev, "POWER_SUPPLY_TYPE"))
-        score = score + 10;
+    /* check if we found anything with some kind of score */
+    if( best ) {
+        log_debug("power supply %s chosen out of %u: score=%d (%s)",
+                  udev_device_get_syspath(best), candidates, best_score,
+                  best_why->str);
+        umudev_psy_cache_save(udev_device_get_syspath(best), best_score,
+                              best_why->str, candidates);
+    }
 
 EXIT:
-    /* clean up */
-    if( dev )
-        udev_device_unref(dev);
+    if( list )
+        udev_enumerate_unref(list);
+    g_string_free(why, TRUE);
+    g_string_free(best_why, TRUE);
 
-    return score;
+    return best;
 }
 
 gboolean umudev_init(void)
@@ -532,36 +1127,10 @@ gboolean umudev_init(void)
     /* Try with configured / default device */
     dev = udev_device_new_from_syspath(umudev_object, configured_device);
 
-    /* If needed, try heuristics */
-    if( !dev ) {
-        log_debug("Trying to guess $power_supply device.\n");
-
-        int    current_score = 0;
-        gchar *current_name  = 0;
-
-        struct udev_enumerate  *list;
-        struct udev_list_entry *list_entry;
-        struct udev_list_entry *first_entry;
-
-        list = udev_enumerate_new(umudev_object);
-        udev_enumerate_add_match_subsystem(list, "power_supply");
-        udev_enumerate_scan_devices(list);
-        first_entry = udev_enumerate_get_list_entry(list);
-        udev_list_entry_foreach(list_entry, first_entry) {
-            const char *name = udev_list_entry_get_name(list_entry);
-            int score = umudev_score_as_power_supply(name);
-            if( current_score < score ) {
-                g_free(current_name);
-                current_name = g_strdup(name);
-                current_score = score;
-            }
-        }
-        /* check if we found anything with some kind of score */
-        if(current_score > 0) {
-            dev = udev_device_new_from_syspath(umudev_object, current_name);
-        }
-        g_free(current_name);
-    }
+    /* If needed, try heuristics - the full scan is done only if the
+     * choice made during previous startup is no longer valid */
+    if( !dev && !(dev = umudev_psy_cache_lookup()) )
+        dev = umudev_psy_scan();
 
     /* Give up if no power supply device was found */
     if( !dev ) {
@@ -592,6 +1161,17 @@ gboolean umudev_init(void)
         goto EXIT;
     }
 
+    /* Use typec class as additional cable detection source */
+    if( umudev_typec_probe() ) {
+        ret = udev_monitor_filter_add_match_subsystem_devtype(umudev_monitor,
+                                                              "typec",
+                                                              NULL);
+        if( ret != 0 ) {
+            log_warning("Udev typec match failed.\n");
+            umudev_typec_quit();
+        }
+    }
+
     ret = udev_monitor_enable_receiving(umudev_monitor);
     if(ret != 0)
     {
@@ -606,11 +1186,13 @@ gboolean umudev_init(void)
     umudev_watch_id = g_io_add_watch_full(iochannel, 0, G_IO_IN, umudev_io_input_cb, NULL, umudev_io_error_cb);
     if( !umudev_watch_id )
         goto EXIT;
+    loopwatch_name_fd(udev_monitor_get_fd(umudev_monitor), "udev");
 
     /* everything went well */
     success = TRUE;
 
     /* check initial status */
+    umudev_typec_update();
     umudev_parse_properties(dev, true);
 
 EXIT:
@@ -646,6 +1228,7 @@ void umudev_quit(void)
     }
 
     if( umudev_monitor ) {
+        loopwatch_name_fd(udev_monitor_get_fd(umudev_monitor), 0);
         udev_monitor_unref(umudev_monitor),
             umudev_monitor = 0;
     }
@@ -658,5 +1241,9 @@ void umudev_quit(void)
     g_free(umudev_sysname),
         umudev_sysname = 0;
 
+    umudev_typec_quit();
+    umudev_psy_state   = CABLE_STATE_UNKNOWN;
+    umudev_psy_certain = false;
+
     umudev_cable_state_stop_timer();
 }
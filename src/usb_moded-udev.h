@@ -43,7 +43,8 @@
  * UMUDEV
  * ------------------------------------------------------------------------- */
 
-gboolean umudev_init(void);
-void     umudev_quit(void);
+gboolean umudev_init            (void);
+void     umudev_quit            (void);
+gchar   *umudev_get_cable_report(void);
 
 #endif /* USB_MODED_UDEV_H_ */
@@ -44,18 +44,31 @@ uid_t       user_get_current_user   (void);
  * USER_WATCH
  * ------------------------------------------------------------------------- */
 
+static gboolean user_watch_settle_cb       (gpointer aptr);
 static gboolean user_watch_monitor_event_cb(GIOChannel *iochannel, GIOCondition cond, gpointer data);
 static bool     user_watch_connect         (void);
 static void     user_watch_disconnect      (void);
 bool            user_watch_init            (void);
 void            user_watch_stop            (void);
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** Time to wait for login state changes to settle [ms]
+ *
+ * User switching causes a burst of sd-login monitor wakeups,
+ * only the seat state after the burst is acted upon.
+ */
+#define USER_WATCH_SETTLE_DELAY_MS 250
+
 /* ========================================================================= *
  * Data
  * ========================================================================= */
 
 static sd_login_monitor    *user_watch_monitor = NULL;
 static guint                user_change_watch_id = 0;
+static guint                user_settle_timer_id = 0;
 static uid_t                user_current_uid = UID_UNKNOWN;
 
 /* ========================================================================= *
@@ -106,6 +119,17 @@ uid_t user_get_current_user(void)
     return user_current_uid;
 }
 
+/** Timer callback for: login state changes have settled
+ */
+static gboolean user_watch_settle_cb(gpointer aptr G_GNUC_UNUSED)
+{
+    LOG_REGISTER_CONTEXT;
+
+    user_settle_timer_id = 0;
+    user_update_current_user();
+    return G_SOURCE_REMOVE;
+}
+
 /** User change callback
  */
 static gboolean user_watch_monitor_event_cb(GIOChannel *iochannel G_GNUC_UNUSED, GIOCondition cond,
@@ -119,7 +143,10 @@ static gboolean user_watch_monitor_event_cb(GIOChannel *iochannel G_GNUC_UNUSED,
         success = false;
         goto EXIT;
     }
-    user_update_current_user();
+    /* Evaluate seat state once the burst of changes is over */
+    if( !user_settle_timer_id )
+        user_settle_timer_id = g_timeout_add(USER_WATCH_SETTLE_DELAY_MS,
+                                             user_watch_settle_cb, NULL);
 
     sd_login_monitor_flush(user_watch_monitor);
 
@@ -175,6 +202,10 @@ static void user_watch_disconnect(void)
         g_source_remove(user_change_watch_id);
         user_change_watch_id = 0;
     }
+    if ( user_settle_timer_id ) {
+        g_source_remove(user_settle_timer_id);
+        user_settle_timer_id = 0;
+    }
     if ( user_watch_monitor ) {
         sd_login_monitor_unref(user_watch_monitor);
         user_watch_monitor = NULL;
@@ -48,6 +48,19 @@ static int util_set_unhide_mode_config(char *mode);
 static int util_get_hiddenlist        (void);
 static int util_handle_network        (char *network);
 static int util_clear_user_config     (char *uid);
+static int util_dump_stats            (void);
+static int util_regenerate_mac        (void);
+
+/* ------------------------------------------------------------------------- *
+ * BATCH
+ * ------------------------------------------------------------------------- */
+
+static DBusMessage *util_batch_new_request (const char *method);
+static DBusMessage *util_batch_make_request(const char *command);
+static void         util_batch_print_value (const char *value);
+static bool         util_batch_print_reply (unsigned index, const char *command, DBusMessage *reply);
+static bool         util_batch_flush       (GPtrArray *commands, GPtrArray *pending, unsigned *index);
+static int          util_batch_run         (char **commands);
 
 /* ------------------------------------------------------------------------- *
  * MAIN
@@ -61,6 +74,17 @@ int main(int argc, char *argv[]);
 
 static DBusConnection *conn = 0;
 
+/** Long options, for those that do not have a short one */
+static const struct option util_long_options[] =
+{
+    { "dump-stats",     no_argument, 0, 'S' },
+    { "regenerate-mac", no_argument, 0, 'M' },
+    { 0,                0,           0, 0   },
+};
+
+/** Maximum number of batch requests waiting for replies at a time */
+#define UTIL_BATCH_WINDOW 16
+
 /* ========================================================================= *
  * Functions
  * ========================================================================= */
@@ -298,6 +322,52 @@ static int util_get_hiddenlist (void)
     return 1;
 }
 
+static int util_dump_stats (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    char *ret = 0;
+    int res = 1;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_SWITCH_STATS_GET)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            if (dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &ret, DBUS_TYPE_INVALID))
+            {
+                fputs(ret, stdout);
+                res = 0;
+            }
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+    }
+
+    return res;
+}
+
+static int util_regenerate_mac (void)
+{
+    DBusMessage *req = NULL, *reply = NULL;
+    char *ret = 0;
+    int res = 1;
+
+    if ((req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT, USB_MODE_INTERFACE, USB_MODE_MAC_REGENERATE)) != NULL)
+    {
+        if ((reply = dbus_connection_send_with_reply_and_block(conn, req, -1, NULL)) != NULL)
+        {
+            if (dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &ret, DBUS_TYPE_INVALID))
+            {
+                printf("usb ethernet mac = %s (applied after usb-moded restart)\n", ret);
+                res = 0;
+            }
+            dbus_message_unref(reply);
+        }
+        dbus_message_unref(req);
+    }
+
+    return res;
+}
+
 static int util_handle_network(char *network)
 {
     char *operation = 0, *setting = 0, *value = 0;
@@ -395,11 +465,285 @@ static int util_clear_user_config(char *uid)
     return ret;
 }
 
+/* ========================================================================= *
+ * BATCH
+ * ========================================================================= */
+
+/** Create usb_moded method call message
+ *
+ * @param method  method name
+ *
+ * @return method call message, or NULL
+ */
+static DBusMessage *util_batch_new_request(const char *method)
+{
+    return dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT,
+                                        USB_MODE_INTERFACE, method);
+}
+
+/** Translate batch command to method call message
+ *
+ * Commands use the same letters as command line options, followed
+ * by optional whitespace separated argument, e.g. "q", "s mtp_mode",
+ * "n get:ip" or "U 100001".
+ *
+ * @param command  batch command
+ *
+ * @return method call message, or NULL if command is not valid
+ */
+static DBusMessage *util_batch_make_request(const char *command)
+{
+    DBusMessage *req  = NULL;
+    gchar      **args = g_strsplit_set(command, " \t", 2);
+    const char  *cmd  = args[0] ? args[0] : "";
+    char        *arg  = args[0] && args[1] ? g_strstrip(args[1]) : NULL;
+
+    if( *cmd == '-' )
+        ++cmd;
+
+    if( strlen(cmd) != 1 )
+        goto EXIT;
+
+    switch( *cmd ) {
+    case 'q': req = util_batch_new_request(USB_MODE_STATE_REQUEST); break;
+    case 'm': req = util_batch_new_request(USB_MODE_LIST);          break;
+    case 'd': req = util_batch_new_request(USB_MODE_CONFIG_GET);    break;
+    case 'r': req = util_batch_new_request(USB_MODE_RESCUE_OFF);    break;
+    case 'v': req = util_batch_new_request(USB_MODE_HIDDEN_GET);    break;
+    case 'S': req = util_batch_new_request(USB_MODE_SWITCH_STATS_GET); break;
+    case 'M': req = util_batch_new_request(USB_MODE_MAC_REGENERATE);   break;
+    case 's': case 'c': case 'i': case 'u':
+        if( !arg || !*arg )
+            break;
+        req = util_batch_new_request(*cmd == 's' ? USB_MODE_STATE_SET :
+                                     *cmd == 'c' ? USB_MODE_CONFIG_SET :
+                                     *cmd == 'i' ? USB_MODE_HIDE :
+                                     USB_MODE_UNHIDE);
+        if( req )
+            dbus_message_append_args(req, DBUS_TYPE_STRING, &arg, DBUS_TYPE_INVALID);
+        break;
+    case 'U':
+        if( arg && *arg ) {
+            dbus_uint32_t user = atoi(arg);
+            if( (req = util_batch_new_request(USB_MODE_USER_CONFIG_CLEAR)) )
+                dbus_message_append_args(req, DBUS_TYPE_UINT32, &user, DBUS_TYPE_INVALID);
+        }
+        break;
+    case 'n':
+        if( arg && !strncmp(arg, "get:", 4) && arg[4] ) {
+            char *setting = arg + 4;
+            if( (req = util_batch_new_request(USB_MODE_NETWORK_GET)) )
+                dbus_message_append_args(req, DBUS_TYPE_STRING, &setting,
+                                         DBUS_TYPE_INVALID);
+        }
+        else if( arg && !strncmp(arg, "set:", 4) ) {
+            char *setting = arg + 4;
+            char *value   = strchr(setting, ',');
+            if( !value || value == setting )
+                break;
+            *value++ = 0;
+            if( (req = util_batch_new_request(USB_MODE_NETWORK_SET)) )
+                dbus_message_append_args(req, DBUS_TYPE_STRING, &setting,
+                                         DBUS_TYPE_STRING, &value,
+                                         DBUS_TYPE_INVALID);
+        }
+        break;
+    default:
+        break;
+    }
+
+EXIT:
+    g_strfreev(args);
+    return req;
+}
+
+/** Print value with tabs, newlines and backslashes escaped
+ *
+ * @param value  string to print
+ */
+static void util_batch_print_value(const char *value)
+{
+    for( ; *value; ++value ) {
+        switch( *value ) {
+        case '\\': fputs("\\\\", stdout); break;
+        case '\t': fputs("\\t", stdout);  break;
+        case '\n': fputs("\\n", stdout);  break;
+        default:   putchar(*value);        break;
+        }
+    }
+}
+
+/** Print batch command result
+ *
+ * Output format is one line per command, with tab separated
+ * fields: command index, command, "ok" or "error", followed
+ * by reply values or error name and message.
+ *
+ * @param index    zero based command index
+ * @param command  batch command
+ * @param reply    method call reply, or NULL
+ *
+ * @return true if command succeeded, false otherwise
+ */
+static bool util_batch_print_reply(unsigned index, const char *command,
+                                   DBusMessage *reply)
+{
+    bool ack = reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN;
+
+    printf("%u\t", index);
+    util_batch_print_value(command);
+    printf("\t%s", ack ? "ok" : "error");
+
+    if( !reply ) {
+        printf("\t%s", "invalid command");
+    }
+    else if( !ack ) {
+        const char *name = dbus_message_get_error_name(reply);
+        const char *text = 0;
+        dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &text, DBUS_TYPE_INVALID);
+        putchar('\t');
+        util_batch_print_value(name ?: "");
+        if( text ) {
+            putchar('\t');
+            util_batch_print_value(text);
+        }
+    }
+    else {
+        DBusMessageIter iter;
+        dbus_message_iter_init(reply, &iter);
+        for( ; ; dbus_message_iter_next(&iter) ) {
+            int type = dbus_message_iter_get_arg_type(&iter);
+            if( type == DBUS_TYPE_INVALID )
+                break;
+            putchar('\t');
+            if( type == DBUS_TYPE_STRING ) {
+                const char *val = 0;
+                dbus_message_iter_get_basic(&iter, &val);
+                util_batch_print_value(val ?: "");
+            }
+            else if( type == DBUS_TYPE_UINT32 || type == DBUS_TYPE_INT32 ) {
+                dbus_uint32_t val = 0;
+                dbus_message_iter_get_basic(&iter, &val);
+                printf(type == DBUS_TYPE_INT32 ? "%d" : "%u", val);
+            }
+            else if( type == DBUS_TYPE_BOOLEAN ) {
+                dbus_bool_t val = 0;
+                dbus_message_iter_get_basic(&iter, &val);
+                printf("%s", val ? "true" : "false");
+            }
+            else {
+                printf("<%c>", type);
+            }
+        }
+    }
+    putchar('\n');
+    return ack;
+}
+
+/** Collect replies to requests sent so far
+ *
+ * @param commands  batch commands, one per pending call slot
+ * @param pending   pending calls, NULL for invalid commands
+ * @param index     index of the first command, updated on return
+ *
+ * @return true if all commands succeeded, false otherwise
+ */
+static bool util_batch_flush(GPtrArray *commands, GPtrArray *pending, unsigned *index)
+{
+    bool ack = true;
+
+    for( guint i = 0; i < pending->len; ++i ) {
+        DBusPendingCall *pc    = g_ptr_array_index(pending, i);
+        DBusMessage     *reply = NULL;
+
+        if( pc ) {
+            dbus_pending_call_block(pc);
+            reply = dbus_pending_call_steal_reply(pc);
+            dbus_pending_call_unref(pc);
+        }
+        if( !util_batch_print_reply((*index)++, g_ptr_array_index(commands, i), reply) )
+            ack = false;
+        if( reply )
+            dbus_message_unref(reply);
+    }
+    fflush(stdout);
+
+    g_ptr_array_set_size(pending, 0);
+    g_ptr_array_set_size(commands, 0);
+    return ack;
+}
+
+/** Execute batch of commands over one D-Bus connection
+ *
+ * Requests are sent without waiting for replies in between, up to
+ * UTIL_BATCH_WINDOW at a time. As usb_moded handles method calls in
+ * order of arrival, results are the same as with sequential calls.
+ *
+ * @param commands  NULL terminated array of commands, or NULL to
+ *                  read commands from stdin, one per line
+ *
+ * @return 0 if all commands succeeded, 1 otherwise
+ */
+static int util_batch_run(char **commands)
+{
+    bool       ack     = true;
+    unsigned   index   = 0;
+    GPtrArray *queued  = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *pending = g_ptr_array_new();
+    char      *line    = NULL;
+    size_t     size    = 0;
+
+    for( ;; ) {
+        gchar *command = NULL;
+
+        if( commands ) {
+            if( !*commands )
+                break;
+            command = g_strdup(*commands++);
+        }
+        else {
+            if( getline(&line, &size, stdin) == -1 )
+                break;
+            command = g_strdup(line);
+        }
+
+        g_strstrip(command);
+        if( !*command || *command == '#' ) {
+            g_free(command);
+            continue;
+        }
+
+        DBusMessage     *req = util_batch_make_request(command);
+        DBusPendingCall *pc  = NULL;
+        if( req ) {
+            if( !dbus_connection_send_with_reply(conn, req, &pc, -1) )
+                pc = NULL;
+            dbus_message_unref(req);
+        }
+        g_ptr_array_add(queued, command);
+        g_ptr_array_add(pending, pc);
+
+        if( pending->len >= UTIL_BATCH_WINDOW ) {
+            if( !util_batch_flush(queued, pending, &index) )
+                ack = false;
+        }
+    }
+
+    if( !util_batch_flush(queued, pending, &index) )
+        ack = false;
+
+    free(line);
+    g_ptr_array_free(pending, TRUE);
+    g_ptr_array_free(queued, TRUE);
+
+    return ack ? 0 : 1;
+}
+
 int main (int argc, char *argv[])
 {
     int query = 0, network = 0, setmode = 0, config = 0;
     int modelist = 0, mode_configured = 0, hide = 0, unhide = 0, hiddenlist = 0, clear = 0;
-    int res = 1, opt, rescue = 0;
+    int res = 1, opt, rescue = 0, batch = 0, stats = 0, regen = 0;
     char *option = 0;
 
     if(argc == 1)
@@ -408,9 +752,12 @@ int main (int argc, char *argv[])
         exit(1);
     }
 
-    while ((opt = getopt(argc, argv, "c:dhi:mn:qrs:u:vU:")) != -1)
+    while ((opt = getopt_long(argc, argv, "+bc:dhi:mn:qrs:u:vMSU:", util_long_options, 0)) != -1)
     {
         switch (opt) {
+        case 'b':
+            batch = 1;
+            break;
         case 'c':
             config = 1;
             option = optarg;
@@ -446,6 +793,12 @@ int main (int argc, char *argv[])
         case 'v':
             hiddenlist = 1;
             break;
+        case 'M':
+            regen = 1;
+            break;
+        case 'S':
+            stats = 1;
+            break;
         case 'U':
             clear = 1;
             option = optarg;
@@ -454,6 +807,10 @@ int main (int argc, char *argv[])
         default:
                 fprintf(stderr, "\nUsage: %s -<option> <args>\n\n \
                    Options are: \n \
+                   \t-b [command...] to run a batch of commands, read from stdin\n \
+                   \t   if none given. Commands are option letters with optional\n \
+                   \t   argument, e.g. \"q\" or \"s mtp_mode\". One tab separated\n \
+                   \t   result line per command: index, command, ok/error, values\n \
                    \t-c to set a mode in the config file,\n \
                    \t-d to get the default mode set in the configuration, \n \
                    \t-h to get this help, \n \
@@ -465,6 +822,8 @@ int main (int argc, char *argv[])
                    \t-s to set/activate a mode,\n \
                    \t-u unhide a mode,\n \
                    \t-v to get the list of hidden modes\n \
+                   \t-M, --regenerate-mac to replace the usb ethernet address with a new random one\n \
+                   \t-S, --dump-stats to get mode switch latency and resource usage statistics\n \
                    \t-U <uid> to clear config for a user\n",
                         argv[0]);
             exit(1);
@@ -482,7 +841,14 @@ int main (int argc, char *argv[])
     }
 
     /* check which sub-routine to call */
-    if(query)
+    if(batch)
+    {
+        res = util_batch_run(optind < argc ? argv + optind : NULL);
+        dbus_connection_close(conn);
+        dbus_connection_unref(conn);
+        return res;
+    }
+    else if(query)
         res = util_query_mode();
     else if (modelist)
         res = util_get_modelist();
@@ -504,6 +870,10 @@ int main (int argc, char *argv[])
         res = util_get_hiddenlist();
     else if (clear)
         res = util_clear_user_config(option);
+    else if (stats)
+        res = util_dump_stats();
+    else if (regen)
+        res = util_regenerate_mac();
 
     /* subfunctions will return 1 if an error occured, print message */
     if(res)
@@ -25,16 +25,21 @@
 #include "usb_moded-worker.h"
 
 #include "usb_moded.h"
-#include "usb_moded-android.h"
 #include "usb_moded-configfs.h"
 #include "usb_moded-control.h"
+#include "usb_moded-gadget.h"
 #include "usb_moded-log.h"
+#include "usb_moded-loopwatch.h"
 #include "usb_moded-modes.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-modules.h"
+#include "usb_moded-network.h"
 #include "usb_moded-appsync.h"
+#include "usb_moded-systemd.h"
+#include "usb_moded-trace.h"
 
 #include <sys/stat.h>
+#include <sys/mount.h>
 #include <sys/types.h>
 #include <sys/eventfd.h>
 
@@ -42,6 +47,17 @@
 #include <unistd.h>
 #include <pwd.h>
 
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** User session systemd unit for mtp daemon */
+#define WORKER_MTPD_UNIT "buteo-mtp.service"
+
+/** Journal of activated mode, survives restarts but not reboots */
+#define WORKER_JOURNAL_FILE  "/run/usb-moded/worker.journal"
+#define WORKER_JOURNAL_GROUP "worker"
+
 /* ========================================================================= *
  * Types
  * ========================================================================= */
@@ -62,6 +78,28 @@ static const char * const devstate_name[] = {
   [DEVSTATE_MOUNTED]   = "mounted",
 };
 
+/** Job types worker thread can execute
+ *
+ * Each job type is queued at most once, so posting a job that is
+ * already pending just merges the requests. Pending jobs are
+ * executed in the order listed here.
+ */
+typedef enum {
+    /** Activate whatever hardware mode is requested at the time of
+     *  execution - also covers switching to charging fallback */
+    WORKER_JOB_MODE_SWITCH,
+    /** Reapply network settings of the active mode */
+    WORKER_JOB_NETWORK_REFRESH,
+    /** Load updated appsync configuration */
+    WORKER_JOB_APPSYNC_RELOAD,
+    /** Change functions of additional configfs gadgets */
+    WORKER_JOB_GADGET_FUNCTIONS,
+    /** Prepare likely mode while pc connection is debounced */
+    WORKER_JOB_PRESTAGE,
+
+    WORKER_JOB_NUMOF
+} worker_job_t;
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -70,12 +108,20 @@ static const char * const devstate_name[] = {
  * WORKER
  * ------------------------------------------------------------------------- */
 
-static bool        worker_thread_p                 (void);
 bool               worker_bailing_out              (void);
+int                worker_get_cancel_fd            (void);
+worker_cancel_token_t worker_get_cancel_token      (void);
+void               worker_set_cancel_token         (const worker_cancel_token_t *token);
+static bool        worker_job_canceled             (void);
+static void        worker_begin_job                (void);
 static devstate_t  worker_get_mtp_device_state     (void);
 static void        worker_unmount_mtp_device       (void);
 static bool        worker_mount_mtp_device         (void);
+static void        worker_journal_save             (const char *mode);
+static void        worker_journal_load             (void);
+static bool        worker_adopt_journal            (const char *mode);
 static bool        worker_mode_is_mtp_mode         (const char *mode);
+static bool        worker_can_keep_mtpd            (const char *mode);
 static bool        worker_is_mtpd_running          (void);
 static bool        worker_mtpd_running_p           (void *aptr);
 static bool        worker_mtpd_stopped_p           (void *aptr);
@@ -94,6 +140,18 @@ static const char *worker_get_requested_mode_locked(void);
 static bool        worker_set_requested_mode_locked(const char *mode);
 void               worker_request_hardware_mode    (const char *mode);
 void               worker_clear_hardware_mode      (void);
+static void        worker_post_job_locked          (worker_job_t job);
+static int         worker_take_job_locked          (void);
+static void        worker_post_job                 (worker_job_t job);
+void               worker_request_network_refresh  (void);
+void               worker_request_appsync_reload   (void);
+void               worker_request_gadget_functions (const char *gadget, const char *functions);
+static void        worker_execute_gadget_functions (void);
+void               worker_request_prestage         (const char *mode);
+static void        worker_discard_prestaged        (void);
+static bool        worker_claim_prestaged          (const char *mode);
+static void        worker_prestage_mode            (const char *mode);
+static void        worker_execute_mode_switch      (void);
 static void        worker_execute                  (void);
 static void        worker_switch_to_mode           (const char *mode);
 static guint       worker_add_iowatch              (int fd, bool close_on_unref, GIOCondition cnd, GIOFunc io_cb, gpointer aptr);
@@ -106,6 +164,7 @@ static bool        worker_create_eventfd           (void);
 bool               worker_init                     (void);
 void               worker_quit                     (void);
 void               worker_wakeup                   (void);
+static void        worker_signal                   (void);
 static void        worker_notify                   (void);
 
 /* ========================================================================= *
@@ -116,19 +175,44 @@ static pthread_t worker_thread_id = 0;
 
 static pthread_mutex_t  worker_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/** Flag for: Main thread has changed target mode worker should apply
+/** Cancellation serial number
+ *
+ * Incremented by main thread whenever it changes the target mode
+ * worker should apply. Worker should then bailout from synchronous
+ * activities related to ongoing activation of a usb mode.
+ */
+static volatile gint worker_cancel_serial = 0;
+
+/** Cancellation token of the job the calling thread is working for
+ *
+ * Set up for the worker thread when a job is started, and handed
+ * over to pipeline stage threads that execute parts of the job.
+ * Invalid in all other threads.
+ *
+ * When worker thread is cleaning up after abandoning mode switch,
+ * the token is flagged uncancellable so that asynchronous activities
+ * on mode cleanup are executed without bailing out.
+ */
+static __thread worker_cancel_token_t worker_cancel_token = {
+    .wct_valid         = false,
+    .wct_serial        = 0,
+    .wct_uncancellable = false,
+};
+
+/** Bitmask of pending #worker_job_t jobs
  *
- * Worker should bailout from synchronous activities related to
- * ongoing activation of a usb mode.
+ * Protected by worker_mutex.
  */
-static volatile bool worker_bailout_requested = false;
+static unsigned worker_jobs_pending = 0;
 
-/** Flag for: Worker thread is cleaning up after abandoning mode switch
+/** Pending function changes for additional gadgets: name -> functions
  *
- * Asynchronous activities on mode cleanup should be executed without
- * bailing out.
+ * Protected by worker_mutex.
  */
-static volatile bool worker_bailout_handled = false;
+static GHashTable *worker_gadget_requests = 0;
+
+/** eventfd descriptor for waking up waits in worker thread on cancel */
+static int worker_cancel_evfd = -1;
 
 #define WORKER_LOCKED_ENTER do {\
     if( pthread_mutex_lock(&worker_mutex) != 0 ) { \
@@ -148,23 +232,93 @@ static volatile bool worker_bailout_handled = false;
  * Functions
  * ========================================================================= */
 
+bool
+worker_bailing_out(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    // ref: see common_msleep_()
+    return (worker_cancel_token.wct_valid &&
+            !worker_cancel_token.wct_uncancellable &&
+            worker_job_canceled());
+}
+
+/** Get file descriptor that becomes readable on cancellation
+ *
+ * Allows waits to wake up immediately when the ongoing job is
+ * superseded instead of noticing it on the next periodic check.
+ *
+ * @return file descriptor to poll, or -1 if cancellation does not apply
+ */
+int
+worker_get_cancel_fd(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_cancel_token.wct_valid ||
+        worker_cancel_token.wct_uncancellable )
+        return -1;
+
+    /* Note: Only worker_begin_job() drains the eventfd, so it stays
+     *       readable for all threads of a cancelled job. */
+    return worker_cancel_evfd;
+}
+
+/** Get cancellation token of the job the calling thread works for
+ *
+ * @return token to pass to worker_set_cancel_token() in helper thread
+ */
+worker_cancel_token_t
+worker_get_cancel_token(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return worker_cancel_token;
+}
+
+/** Make calling helper thread follow cancellation of a worker job
+ *
+ * @param token  Token obtained via worker_get_cancel_token()
+ */
+void
+worker_set_cancel_token(const worker_cancel_token_t *token)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_cancel_token = *token;
+}
+
+/** Check if the current job has been superseded
+ *
+ * Note: This function should be called only from the worker thread,
+ *       or from threads that have taken over its cancellation token.
+ */
 static bool
-worker_thread_p(void)
+worker_job_canceled(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    return worker_thread_id && worker_thread_id == pthread_self();
+    return (g_atomic_int_get(&worker_cancel_serial) !=
+            worker_cancel_token.wct_serial);
 }
 
-bool
-worker_bailing_out(void)
+/** Take cancellation token for a job that is about to be executed
+ */
+static void
+worker_begin_job(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    // ref: see common_msleep_()
-    return (worker_thread_p() &&
-            worker_bailout_requested &&
-            !worker_bailout_handled);
+    /* Sample serial before clearing wakeup, so that cancellation
+     * can't get lost in between */
+    worker_cancel_token.wct_valid         = true;
+    worker_cancel_token.wct_serial        = g_atomic_int_get(&worker_cancel_serial);
+    worker_cancel_token.wct_uncancellable = false;
+
+    uint64_t cnt = 0;
+    if( read(worker_cancel_evfd, &cnt, sizeof cnt) == -1 &&
+        errno != EAGAIN && errno != EWOULDBLOCK )
+        log_warning("cancel fd read: %m");
 }
 
 /* ------------------------------------------------------------------------- *
@@ -206,6 +360,12 @@ worker_get_mtp_device_state(void)
     return state;
 }
 
+/** User that was active when mtp device was mounted
+ *
+ * UID_UNKNOWN while mtp device is not mounted.
+ */
+static uid_t worker_mtp_mount_uid = UID_UNKNOWN;
+
 /** Unmount mtp device
  */
 static void
@@ -215,8 +375,10 @@ worker_unmount_mtp_device(void)
 
     if( worker_get_mtp_device_state() != DEVSTATE_UNMOUNTED ) {
         log_debug("unmounting mtp device");
-        common_system("/bin/umount /dev/mtp");
+        if( umount("/dev/mtp") == -1 )
+            log_warning("/dev/mtp: umount failed: %m");
     }
+    worker_mtp_mount_uid = UID_UNKNOWN;
 }
 
 /** Mount mtp device
@@ -259,14 +421,14 @@ worker_mount_mtp_device(void)
     /* Attempt to mount mtp device using root uid and primary
      * gid of the current user.
      */
-    char cmd[256];
-    snprintf(cmd, sizeof cmd,
-             "/bin/mount -o mode=0770,uid=0,gid=%u -t functionfs mtp /dev/mtp",
-             (unsigned)gid);
+    char opts[64];
+    snprintf(opts, sizeof opts, "mode=0770,uid=0,gid=%u", (unsigned)gid);
 
     log_debug("mounting mtp device");
-    if( common_system(cmd) != 0 )
+    if( mount("mtp", "/dev/mtp", "functionfs", 0, opts) == -1 ) {
+        log_err("/dev/mtp: mount failed: %m");
         goto EXIT;
+    }
 
     /* Check that control endpoint is present */
     if( worker_get_mtp_device_state() != DEVSTATE_MOUNTED ) {
@@ -274,12 +436,151 @@ worker_mount_mtp_device(void)
         goto EXIT;
     }
 
+    worker_mtp_mount_uid = usbmoded_get_current_user();
     mounted = true;
 
 EXIT:
     return mounted;
 }
 
+/* ------------------------------------------------------------------------- *
+ * WORKER_JOURNAL
+ * ------------------------------------------------------------------------- */
+
+/** Mode left active by previous usb-moded instance, or NULL
+ *
+ * Loaded on startup and consumed by the first mode switch.
+ */
+static gchar *worker_journal_mode = 0;
+
+/** Mtp device mount uid left by previous usb-moded instance */
+static uid_t worker_journal_mtp_uid = UID_UNKNOWN;
+
+/** Mode adopted from previous usb-moded instance, or NULL
+ *
+ * Set only for the duration of the first mode switch.
+ */
+static gchar *worker_adopted_mode = 0;
+
+/** Save activated mode to journal
+ *
+ * @param mode  Dynamic mode that was activated, or NULL to clear journal
+ */
+static void
+worker_journal_save(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *ini  = 0;
+    gchar    *data = 0;
+    gchar    *dir  = 0;
+    GError   *err  = 0;
+
+    if( !mode ) {
+        if( unlink(WORKER_JOURNAL_FILE) == -1 && errno != ENOENT )
+            log_warning("%s: unlink: %m", WORKER_JOURNAL_FILE);
+        goto EXIT;
+    }
+
+    ini = g_key_file_new();
+    g_key_file_set_string(ini, WORKER_JOURNAL_GROUP, "mode", mode);
+    if( worker_mtp_mount_uid != UID_UNKNOWN )
+        g_key_file_set_uint64(ini, WORKER_JOURNAL_GROUP, "mtp_uid",
+                              worker_mtp_mount_uid);
+
+    dir  = g_path_get_dirname(WORKER_JOURNAL_FILE);
+    data = g_key_file_to_data(ini, 0, 0);
+
+    if( g_mkdir_with_parents(dir, 0755) == -1 )
+        log_warning("%s: mkdir: %m", dir);
+    else if( !g_file_set_contents(WORKER_JOURNAL_FILE, data, -1, &err) )
+        log_warning("%s: save failed: %s", WORKER_JOURNAL_FILE, err->message);
+
+EXIT:
+    g_clear_error(&err);
+    g_free(data);
+    g_free(dir);
+    if( ini )
+        g_key_file_unref(ini);
+}
+
+/** Load mode left active by previous usb-moded instance
+ */
+static void
+worker_journal_load(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GKeyFile *ini = g_key_file_new();
+
+    g_free(worker_journal_mode), worker_journal_mode = 0;
+    worker_journal_mtp_uid = UID_UNKNOWN;
+
+    if( !g_key_file_load_from_file(ini, WORKER_JOURNAL_FILE, 0, 0) )
+        goto EXIT;
+
+    worker_journal_mode = g_key_file_get_string(ini, WORKER_JOURNAL_GROUP,
+                                                "mode", 0);
+    if( g_key_file_has_key(ini, WORKER_JOURNAL_GROUP, "mtp_uid", 0) )
+        worker_journal_mtp_uid = g_key_file_get_uint64(ini, WORKER_JOURNAL_GROUP,
+                                                       "mtp_uid", 0);
+
+    log_debug("journaled mode: %s", worker_journal_mode ?: "n/a");
+
+EXIT:
+    g_key_file_unref(ini);
+}
+
+/** Check if mode left by previous usb-moded instance can be adopted
+ *
+ * Adoption is possible when the same mode gets selected on startup
+ * and the gadget backend has kept the gadget bound as it was. Then
+ * mtp daemon and mount can be kept too, and mode entry boils down to
+ * redoing steps that do not disturb the host connection.
+ *
+ * @param mode  Name of the mode to activate
+ *
+ * @return true if mode gets adopted, false otherwise
+ */
+static bool
+worker_adopt_journal(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool   adopted = false;
+    bool   gadget  = gadget_take_adopted();
+    gchar *prev    = worker_journal_mode;
+
+    worker_journal_mode = 0;
+
+    if( !prev )
+        goto EXIT;
+
+    if( g_strcmp0(prev, mode) ) {
+        log_debug("journaled mode %s not selected", prev);
+        goto EXIT;
+    }
+
+    if( !gadget ) {
+        log_debug("gadget for journaled mode %s not kept", prev);
+        goto EXIT;
+    }
+
+    log_notice("adopting %s mode left by previous instance", mode);
+
+    if( worker_get_mtp_device_state() == DEVSTATE_MOUNTED )
+        worker_mtp_mount_uid = worker_journal_mtp_uid;
+
+    g_free(worker_adopted_mode),
+        worker_adopted_mode = prev, prev = 0;
+    adopted = true;
+
+EXIT:
+    g_free(prev);
+
+    return adopted;
+}
+
 /* ------------------------------------------------------------------------- *
  * MTP_DAEMON
  * ------------------------------------------------------------------------- */
@@ -312,11 +613,86 @@ static unsigned worker_mtp_stop_delay  =  15 * 1000;
  */
 static bool worker_mtp_service_started = false;
 
+/** Check if a mode needs mtp daemon
+ *
+ * In addition to the mtp mode itself, composite modes
+ * that include mtp / ffs function are included.
+ *
+ * @param mode  Name of a mode
+ *
+ * @return true if mode uses mtp, false otherwise
+ */
 static bool worker_mode_is_mtp_mode(const char *mode)
 {
     LOG_REGISTER_CONTEXT;
 
-    return mode && !strcmp(mode, "mtp_mode");
+    bool        ack  = false;
+    modedata_t *data = 0;
+    gchar     **vec  = 0;
+
+    if( !mode )
+        goto EXIT;
+
+    if( !strcmp(mode, "mtp_mode") ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( !(data = usbmoded_dup_modedata(mode)) || !data->sysfs_value )
+        goto EXIT;
+
+    vec = g_strsplit(data->sysfs_value, ",", 0);
+    for( size_t i = 0; vec[i] && !ack; ++i )
+        ack = !strcmp(vec[i], "mtp") || !strcmp(vec[i], "ffs");
+
+EXIT:
+    g_strfreev(vec);
+    modedata_unref(data);
+
+    return ack;
+}
+
+/** Check if mtp daemon can be kept running over a mode switch
+ *
+ * Restarting mtpd takes a second or two, and is not needed when
+ * both the current and the next mode use mtp: the daemon rebinds
+ * endpoints by itself when gadget composition changes. Mtp device
+ * mount (and thus daemon) must be renewed only if the mount was
+ * made with gid of some other user.
+ *
+ * @param mode  Name of the mode to activate
+ *
+ * @return true if mtp daemon can be kept running, false otherwise
+ */
+static bool worker_can_keep_mtpd(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool keep = false;
+    const modedata_t *data = worker_get_usb_mode_data();
+
+    /* Mode adopted from previous instance counts as current mode */
+    const char *prev = data ? data->mode_name : worker_adopted_mode;
+
+    if( !prev || !worker_mode_is_mtp_mode(prev) )
+        goto EXIT;
+
+    if( !worker_mode_is_mtp_mode(mode) )
+        goto EXIT;
+
+    if( worker_mtp_mount_uid == UID_UNKNOWN ||
+        worker_mtp_mount_uid != usbmoded_get_current_user() )
+        goto EXIT;
+
+    if( !worker_is_mtpd_running() )
+        goto EXIT;
+
+    log_debug("keeping mtp daemon running over %s -> %s switch",
+              prev, mode);
+    keep = true;
+
+EXIT:
+    return keep;
 }
 
 static bool worker_is_mtpd_running(void)
@@ -378,16 +754,15 @@ worker_stop_mtpd(void)
         goto SUCCESS;
     }
 
-    int rc = common_system("systemctl-user stop buteo-mtp.service");
-    if( rc != 0 ) {
-        log_warning("failed to stop mtp daemon; exit code = %d", rc);
+    if( !systemd_control_unit(SYSTEMD_MANAGER_USER, WORKER_MTPD_UNIT, SYSTEMD_STOP) ) {
+        log_warning("failed to stop mtp daemon");
         goto FAILURE;
     }
 
     /* Have succesfully stopped mtp service */
     worker_mtp_service_started = false;
 
-    if( common_wait(worker_mtp_stop_delay, worker_mtpd_stopped_p, 0) != WAIT_READY ) {
+    if( common_wait_path(worker_mtp_stop_delay, "/dev/mtp", worker_mtpd_stopped_p, 0) != WAIT_READY ) {
         log_warning("failed to stop mtp daemon; giving up");
         goto FAILURE;
     }
@@ -416,13 +791,12 @@ worker_start_mtpd(void)
     /* Have attempted to start mtp service */
     worker_mtp_service_started = true;
 
-    int rc = common_system("systemctl-user start buteo-mtp.service");
-    if( rc != 0 ) {
-        log_warning("failed to start mtp daemon; exit code = %d", rc);
+    if( !systemd_control_unit(SYSTEMD_MANAGER_USER, WORKER_MTPD_UNIT, SYSTEMD_START) ) {
+        log_warning("failed to start mtp daemon");
         goto FAILURE;
     }
 
-    if( common_wait(worker_mtp_start_delay, worker_mtpd_running_p, 0) != WAIT_READY ) {
+    if( common_wait_path(worker_mtp_start_delay, "/dev/mtp", worker_mtpd_running_p, 0) != WAIT_READY ) {
         log_warning("failed to start mtp daemon; giving up");
         goto FAILURE;
     }
@@ -442,10 +816,7 @@ static bool worker_switch_to_charging(void)
 
     bool ack = true;
 
-    if( android_set_charging_mode() )
-        goto SUCCESS;
-
-    if( configfs_set_charging_mode() )
+    if( gadget_set_charging_mode() )
         goto SUCCESS;
 
     if( modules_in_use() ) {
@@ -545,9 +916,11 @@ const modedata_t *worker_get_usb_mode_data(void)
     return worker_mode_data;
 }
 
-/** get clone of the usb mode data
+/** get reference to the usb mode data
+ *
+ * The returned object is shared and must not be modified.
  *
- * Caller must release the returned object via #modedata_free().
+ * Caller must release the returned object via #modedata_unref().
  *
  * @return a pointer to the usb mode data
  */
@@ -557,7 +930,7 @@ modedata_t *worker_dup_usb_mode_data(void)
 
     WORKER_LOCKED_ENTER;
 
-    modedata_t *modedata = modedata_copy(worker_mode_data);
+    modedata_t *modedata = modedata_ref(worker_mode_data);
 
     WORKER_LOCKED_LEAVE;
 
@@ -576,8 +949,9 @@ void worker_set_usb_mode_data(const modedata_t *data)
 
     WORKER_LOCKED_ENTER;
 
-    modedata_free(worker_mode_data),
-        worker_mode_data = modedata_copy(data);
+    modedata_t *prev = worker_mode_data;
+    worker_mode_data = modedata_ref(data);
+    modedata_unref(prev);
 
     WORKER_LOCKED_LEAVE;
 }
@@ -661,6 +1035,7 @@ void worker_request_hardware_mode(const char *mode)
     if( !worker_set_requested_mode_locked(mode) )
         goto EXIT;
 
+    worker_post_job_locked(WORKER_JOB_MODE_SWITCH);
     worker_wakeup();
 
 EXIT:
@@ -677,8 +1052,291 @@ void worker_clear_hardware_mode(void)
     WORKER_LOCKED_LEAVE;
 }
 
+/* ------------------------------------------------------------------------- *
+ * JOB_QUEUE
+ * ------------------------------------------------------------------------- */
+
 static void
-worker_execute(void)
+worker_post_job_locked(worker_job_t job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_jobs_pending |= 1u << job;
+}
+
+/** Take the first pending job from the queue
+ *
+ * @return #worker_job_t value, or -1 if there are no pending jobs
+ */
+static int
+worker_take_job_locked(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( int job = 0; job < WORKER_JOB_NUMOF; ++job ) {
+        if( worker_jobs_pending & (1u << job) ) {
+            worker_jobs_pending &= ~(1u << job);
+            return job;
+        }
+    }
+    return -1;
+}
+
+/** Queue a job that does not supersede ongoing activity
+ */
+static void
+worker_post_job(worker_job_t job)
+{
+    LOG_REGISTER_CONTEXT;
+
+    WORKER_LOCKED_ENTER;
+    worker_post_job_locked(job);
+    WORKER_LOCKED_LEAVE;
+
+    worker_signal();
+}
+
+/** Request reapplying network settings of the active mode
+ */
+void
+worker_request_network_refresh(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_post_job(WORKER_JOB_NETWORK_REFRESH);
+}
+
+/** Request loading of updated appsync configuration
+ */
+void
+worker_request_appsync_reload(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    worker_post_job(WORKER_JOB_APPSYNC_RELOAD);
+}
+
+/** Request changing functions exposed via an additional gadget
+ *
+ * Only the latest request per gadget is executed.
+ *
+ * @param gadget     Name of additional configfs gadget
+ * @param functions  Comma separated list of functions, or empty
+ *                   string to unbind the gadget
+ */
+void
+worker_request_gadget_functions(const char *gadget, const char *functions)
+{
+    LOG_REGISTER_CONTEXT;
+
+    WORKER_LOCKED_ENTER;
+    if( !worker_gadget_requests )
+        worker_gadget_requests = g_hash_table_new_full(g_str_hash,
+                                                       g_str_equal,
+                                                       g_free, g_free);
+    g_hash_table_replace(worker_gadget_requests, g_strdup(gadget),
+                         g_strdup(functions ?: ""));
+    worker_post_job_locked(WORKER_JOB_GADGET_FUNCTIONS);
+    WORKER_LOCKED_LEAVE;
+
+    worker_signal();
+}
+
+/** Apply pending function changes for additional gadgets
+ */
+static void
+worker_execute_gadget_functions(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GHashTable *requests = 0;
+
+    WORKER_LOCKED_ENTER;
+    requests = worker_gadget_requests, worker_gadget_requests = 0;
+    WORKER_LOCKED_LEAVE;
+
+    if( !requests )
+        goto EXIT;
+
+    GHashTableIter iter;
+    gpointer       key, val;
+    g_hash_table_iter_init(&iter, requests);
+    while( g_hash_table_iter_next(&iter, &key, &val) ) {
+        if( !configfs_gadget_set_functions(key, val) )
+            log_warning("gadget %s: could not set functions '%s'",
+                        (const char *)key, (const char *)val);
+    }
+
+    g_hash_table_unref(requests);
+
+EXIT:
+    return;
+}
+
+/* ------------------------------------------------------------------------- *
+ * PRESTAGE
+ * ------------------------------------------------------------------------- */
+
+/** Mode main thread would like to have pre-staged, or NULL
+ *
+ * Protected by worker_mutex.
+ */
+static gchar *worker_prestage_request = NULL;
+
+/** Mode that has been pre-staged, or NULL
+ *
+ * Accessed only from the worker thread.
+ */
+static gchar *worker_prestaged_mode = NULL;
+
+/** User whose gid was used for mounting pre-staged mtp device
+ *
+ * UID_UNKNOWN if mtp device was not mounted during pre-staging.
+ */
+static uid_t worker_prestaged_uid = UID_UNKNOWN;
+
+/** Request preparing a mode while pc connection is being debounced
+ *
+ * Unlike worker_request_hardware_mode(), this does not make the
+ * worker thread bail out from ongoing mode switch. The request is
+ * acted on once the worker thread is idle.
+ *
+ * @param mode  Name of a dynamic mode
+ */
+void worker_request_prestage(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool signal = false;
+
+    WORKER_LOCKED_ENTER;
+    if( g_strcmp0(worker_prestage_request, mode) ) {
+        g_free(worker_prestage_request),
+            worker_prestage_request = g_strdup(mode);
+        worker_post_job_locked(WORKER_JOB_PRESTAGE);
+        signal = true;
+    }
+    WORKER_LOCKED_LEAVE;
+
+    if( signal )
+        worker_signal();
+}
+
+/** Undo pre-staging that is not going to be used
+ *
+ * Configfs functions are left registered, as unlinked
+ * functions do not affect the gadget in any way.
+ */
+static void
+worker_discard_prestaged(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( !worker_prestaged_mode )
+        goto EXIT;
+
+    log_debug("discarding pre-staged mode %s", worker_prestaged_mode);
+
+    if( worker_prestaged_uid != UID_UNKNOWN ) {
+        worker_unmount_mtp_device();
+        worker_prestaged_uid = UID_UNKNOWN;
+    }
+
+    g_free(worker_prestaged_mode), worker_prestaged_mode = 0;
+
+EXIT:
+    return;
+}
+
+/** Take pre-staged mtp device mount over for mode switch
+ *
+ * Pre-staging that does not match the mode to activate, or
+ * was made for another user, is discarded.
+ *
+ * @param mode  Name of the mode to activate
+ *
+ * @return true if mtp device is mounted and usable, false otherwise
+ */
+static bool
+worker_claim_prestaged(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool claimed = false;
+
+    if( !worker_prestaged_mode || g_strcmp0(worker_prestaged_mode, mode) )
+        goto EXIT;
+
+    if( worker_prestaged_uid == UID_UNKNOWN ||
+        worker_prestaged_uid != usbmoded_get_current_user() )
+        goto EXIT;
+
+    if( worker_get_mtp_device_state() != DEVSTATE_MOUNTED )
+        goto EXIT;
+
+    log_debug("using pre-staged mtp device for %s", mode);
+    worker_prestaged_uid = UID_UNKNOWN;
+    claimed = true;
+
+EXIT:
+    worker_discard_prestaged();
+
+    return claimed;
+}
+
+/** Prepare a mode without enabling the gadget
+ *
+ * Registers configfs functions, mounts mtp device and writes udhcpd
+ * configuration - whatever of those the mode needs - so that they
+ * are ready by the time the mode gets activated.
+ *
+ * @param mode  Name of a dynamic mode
+ */
+static void
+worker_prestage_mode(const char *mode)
+{
+    LOG_REGISTER_CONTEXT;
+
+    modedata_t *data = 0;
+
+    if( !g_strcmp0(worker_prestaged_mode, mode) )
+        goto EXIT;
+
+    worker_discard_prestaged();
+
+    /* Leave already active dynamic mode alone */
+    if( worker_get_usb_mode_data() )
+        goto EXIT;
+
+    /* Nothing done here exposes data to the host, so this
+     * is allowed also while device is locked */
+    if( !usbmoded_in_usermode() )
+        goto EXIT;
+
+    if( !(data = usbmoded_dup_modedata(mode)) )
+        goto EXIT;
+
+    log_debug("pre-staging mode %s", mode);
+    worker_prestaged_mode = g_strdup(mode);
+
+    if( configfs_in_use() ) {
+        configfs_prestage_functions(data->sysfs_value);
+
+        /* With configfs mtp device can be mounted before
+         * functions are enabled, see worker_switch_to_mode() */
+        if( worker_mode_is_mtp_mode(mode) && worker_mount_mtp_device() )
+            worker_prestaged_uid = usbmoded_get_current_user();
+    }
+
+    if( data->dhcp_server )
+        network_prestage_udhcpd_config(data);
+
+EXIT:
+    modedata_unref(data);
+}
+
+static void
+worker_execute_mode_switch(void)
 {
     LOG_REGISTER_CONTEXT;
 
@@ -707,6 +1365,54 @@ worker_execute(void)
     return;
 }
 
+/** Execute pending jobs until the queue is empty
+ */
+static void
+worker_execute(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    for( ;; ) {
+        gchar *prestage = 0;
+
+        WORKER_LOCKED_ENTER;
+        int job = worker_take_job_locked();
+        if( job == WORKER_JOB_PRESTAGE )
+            prestage = worker_prestage_request, worker_prestage_request = 0;
+        WORKER_LOCKED_LEAVE;
+
+        if( job < 0 )
+            break;
+
+        worker_begin_job();
+
+        switch( job ) {
+        case WORKER_JOB_MODE_SWITCH:
+            worker_execute_mode_switch();
+            break;
+        case WORKER_JOB_NETWORK_REFRESH:
+            network_update();
+            break;
+        case WORKER_JOB_APPSYNC_RELOAD:
+#ifdef APP_SYNC
+            appsync_load_configuration();
+#endif
+            break;
+        case WORKER_JOB_GADGET_FUNCTIONS:
+            worker_execute_gadget_functions();
+            break;
+        case WORKER_JOB_PRESTAGE:
+            if( prestage )
+                worker_prestage_mode(prestage);
+            break;
+        default:
+            break;
+        }
+
+        g_free(prestage);
+    }
+}
+
 /* ------------------------------------------------------------------------- *
  * MODE_SWITCH
  * ------------------------------------------------------------------------- */
@@ -718,9 +1424,40 @@ worker_switch_to_mode(const char *mode)
 
     const char *override = 0;
     modedata_t *data     = 0;
+    int         span     = -1;
+    bool        mounted  = false;
 
     /* set return to 1 to be sure to error out if no matching mode is found either */
 
+    trace_switch_begin(mode);
+
+    /* Gadget left by previous instance is kept if mode matches */
+    bool adopted = worker_adopt_journal(mode);
+
+    /* Mode mapping should mean we only see MODE_CHARGING here, but just
+     * in case redirect fixed charging related things to charging ... */
+    mode_atom_t atom      = common_mode_atom(mode);
+    bool        dynamic   = !common_mode_atom_is_static(atom) && atom != MODE_ATOM_ASK;
+    bool        permitted = dynamic && usbmoded_can_export();
+
+    /* Look up incoming mode data before cleaning up, so that steps
+     * that would not change anything can be skipped.
+     */
+    if( permitted )
+        data = usbmoded_dup_modedata(mode);
+
+    /* Adopted mode is already in effect, so plan the transition as if
+     * switching from it - network setup etc does not need to be redone.
+     * Except the builtin dhcp server, which went down with the previous
+     * instance. */
+    const modedata_t *curr = worker_get_usb_mode_data();
+    if( !curr && adopted )
+        curr = data;
+
+    unsigned steps = modesetting_plan_transition(curr, data);
+    if( adopted && network_use_builtin_dhcpd() )
+        steps |= MODESETTING_STEP_UDHCPD;
+
     log_debug("Cleaning up previous mode");
 
     /* Either mtp daemon is not needed, or it must be *started* in
@@ -728,39 +1465,61 @@ worker_switch_to_mode(const char *mode)
      *
      * Similarly, unmount mtp device to make sure sure it gets mounted
      * with appropriate uid/gid values when it is actually needed.
+     *
+     * Exception: When switching between modes that both use mtp, the
+     * daemon is kept running as long as the mount is still valid.
      */
-    worker_stop_mtpd();
-    worker_unmount_mtp_device();
+    span = trace_span_begin("mtpd_stop");
+    if( (mounted = worker_can_keep_mtpd(mode)) ) {
+        worker_discard_prestaged();
+    }
+    else {
+        /* Closing ep0 makes f_fs unbind the udc, so the gadget
+         * must be reprogrammed even if functions stay the same */
+        const modedata_t *prev = worker_get_usb_mode_data();
+        if( prev && worker_mode_is_mtp_mode(prev->mode_name) )
+            steps |= MODESETTING_STEP_GADGET;
+
+        worker_stop_mtpd();
+
+        /* Pre-staging is done for the dynamic mode that is expected
+         * to get activated later on - leave it alone while e.g.
+         * charging fallback is used during device lock */
+        if( dynamic )
+            mounted = worker_claim_prestaged(mode);
+        else
+            mounted = (worker_prestaged_uid != UID_UNKNOWN);
+
+        if( !mounted )
+            worker_unmount_mtp_device();
+    }
+    trace_span_end(span);
 
     if( worker_get_usb_mode_data() ) {
-        modesetting_leave_dynamic_mode();
+        span = trace_span_begin("leave_dynamic");
+        modesetting_leave_dynamic_mode(steps);
         worker_set_usb_mode_data(NULL);
+        trace_span_end(span);
     }
 
     /* Mode specific applications have been stopped and we can
      * take updated appsync configuration in use.
      */
+    span = trace_span_begin("appsync_switch");
     appsync_switch_configuration();
+    trace_span_end(span);
 
     log_debug("Setting %s\n", mode);
 
-    /* Mode mapping should mean we only see MODE_CHARGING here, but just
-     * in case redirect fixed charging related things to charging ... */
-
-    if( !strcmp(mode, MODE_CHARGING) ||
-        !strcmp(mode, MODE_CHARGING_FALLBACK) ||
-        !strcmp(mode, MODE_CHARGER) ||
-        !strcmp(mode, MODE_UNDEFINED) ||
-        !strcmp(mode, MODE_ASK)) {
+    if( !dynamic )
         goto CHARGE;
-    }
 
-    if( !usbmoded_can_export() ) {
+    if( !permitted ) {
         log_warning("Policy does not allow mode: %s", mode);
         goto FAILED;
     }
 
-    if( (data = usbmoded_dup_modedata(mode)) ) {
+    if( data ) {
         log_debug("Matching mode %s found.\n", mode);
 
         /* set data before calling any of the dynamic mode functions
@@ -770,26 +1529,34 @@ worker_switch_to_mode(const char *mode)
         /* When dealing with configfs, we can't enable UDC without
          * already having mtpd running */
         if( worker_mode_is_mtp_mode(mode) && configfs_in_use() ) {
-            if( !worker_mount_mtp_device() )
+            span = trace_span_begin("mtpd_start");
+            if( !mounted && !worker_mount_mtp_device() )
                 goto FAILED;
             if( !worker_start_mtpd() )
                 goto FAILED;
+            trace_span_end(span);
         }
 
+        span = trace_span_begin("module_load");
         if( !worker_set_kernel_module(data->mode_module) )
             goto FAILED;
+        trace_span_end(span);
 
-        if( !modesetting_enter_dynamic_mode() )
+        span = trace_span_begin("enter_dynamic");
+        if( !modesetting_enter_dynamic_mode(steps) )
             goto FAILED;
+        trace_span_end(span);
 
         /* When dealing with android usb, it must be enabled before
          * we can start mtpd. Assumption is that the same applies
          * when using kernel modules. */
         if( worker_mode_is_mtp_mode(mode) && !configfs_in_use() ) {
-            if( !worker_mount_mtp_device() )
+            span = trace_span_begin("mtpd_start");
+            if( !mounted && !worker_mount_mtp_device() )
                 goto FAILED;
             if( !worker_start_mtpd() )
                 goto FAILED;
+            trace_span_end(span);
         }
 
         goto SUCCESS;
@@ -798,16 +1565,36 @@ worker_switch_to_mode(const char *mode)
     log_warning("Matching mode %s was not found.", mode);
 
 FAILED:
-    worker_bailout_handled = true;
+    /* Close the phase that failed, if any */
+    trace_span_end(span);
+
+    worker_cancel_token.wct_uncancellable = true;
 
     /* Undo any changes we might have might have already done */
     if( worker_get_usb_mode_data() ) {
         log_debug("Cleaning up failed mode switch");
         worker_stop_mtpd();
-        modesetting_leave_dynamic_mode();
+        modesetting_leave_dynamic_mode(MODESETTING_STEP_ALL);
         worker_set_usb_mode_data(NULL);
     }
 
+    /* If a newer request superseded this mode switch, going via
+     * charging and overriding the requested mode would just delay
+     * things. Leave the hardware for the next job to deal with.
+     *
+     * Except during shutdown, when there is not going to be a next
+     * job and the switch was abandoned for getting out of the way.
+     */
+    if( worker_job_canceled() && !usbmoded_in_shutdown() ) {
+        log_warning("mode switch to %s superseded", mode);
+        worker_journal_save(0);
+        WORKER_LOCKED_ENTER;
+        worker_set_activated_mode_locked(MODE_BUSY);
+        WORKER_LOCKED_LEAVE;
+        trace_switch_end(MODE_BUSY);
+        goto EXIT;
+    }
+
     /* From usb configuration point of view MODE_UNDEFINED and
      * MODE_CHARGING are the same, but for the purposes of exposing
      * a sane state over D-Bus we need to differentiate between
@@ -825,8 +1612,12 @@ FAILED:
     log_warning("mode setting failed, try %s", override);
 
 CHARGE:
-    if( worker_switch_to_charging() )
+    span = trace_span_begin("charging");
+    if( worker_switch_to_charging() ) {
+        trace_span_end(span);
         goto SUCCESS;
+    }
+    trace_span_end(span);
 
     log_crit("failed to activate charging, all bets are off");
 
@@ -853,9 +1644,18 @@ SUCCESS:
     }
     WORKER_LOCKED_LEAVE;
 
-    worker_notify();
+    trace_switch_end(override ?: mode);
 
-    modedata_free(data);
+    /* Only dynamic modes are worth adopting after restart */
+    worker_journal_save(!override && worker_get_usb_mode_data() ? mode : 0);
+
+    /* Superseded switch gets reported when the next job is done */
+    if( !worker_job_canceled() )
+        worker_notify();
+
+EXIT:
+    g_free(worker_adopted_mode), worker_adopted_mode = 0;
+    modedata_unref(data);
 
     return;
 }
@@ -934,11 +1734,8 @@ static void *worker_thread_cb(void *aptr)
         if( rc != sizeof cnt )
             continue;
 
-        if( cnt > 0 ) {
-            worker_bailout_requested = false;
-            worker_bailout_handled = false;
+        if( cnt > 0 )
             worker_execute();
-        }
 
     }
 EXIT:
@@ -1080,7 +1877,10 @@ worker_delete_eventfd(void)
         g_source_remove(worker_rsp_wid), worker_rsp_wid = 0;
 
     if( worker_rsp_evfd != -1 )
-        close(worker_rsp_evfd), worker_req_evfd = -1;
+        close(worker_rsp_evfd), worker_rsp_evfd = -1;
+
+    if( worker_cancel_evfd != -1 )
+        close(worker_cancel_evfd), worker_cancel_evfd = -1;
 }
 
 static bool
@@ -1099,12 +1899,16 @@ worker_create_eventfd(void)
                                 worker_notify_cb, 0);
     if( !worker_rsp_wid )
         goto EXIT;
+    loopwatch_name_fd(worker_rsp_evfd, "worker_notify");
 
     /* Setup request pipeline */
 
     if( (worker_req_evfd = eventfd(0, EFD_CLOEXEC)) == -1 )
         goto EXIT;
 
+    if( (worker_cancel_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 )
+        goto EXIT;
+
     ack = true;
 
 EXIT:
@@ -1119,6 +1923,9 @@ worker_init(void)
 
     bool ack = false;
 
+    /* Must be done before the worker thread can execute jobs */
+    worker_journal_load();
+
     if( !worker_create_eventfd() )
         goto EXIT;
 
@@ -1144,6 +1951,12 @@ worker_quit(void)
 
     /* Worker thread is stopped and resources can be released. */
     worker_set_usb_mode_data(0);
+    worker_discard_prestaged();
+    g_free(worker_prestage_request), worker_prestage_request = 0;
+    g_free(worker_journal_mode), worker_journal_mode = 0;
+    if( worker_gadget_requests )
+        g_hash_table_unref(worker_gadget_requests), worker_gadget_requests = 0;
+    worker_jobs_pending = 0;
 }
 
 void
@@ -1151,7 +1964,20 @@ worker_wakeup(void)
 {
     LOG_REGISTER_CONTEXT;
 
-    worker_bailout_requested = true;
+    g_atomic_int_inc(&worker_cancel_serial);
+
+    uint64_t cnt = 1;
+    if( write(worker_cancel_evfd, &cnt, sizeof cnt) == -1 ) {
+        log_err("failed to signal cancel: %m");
+    }
+
+    worker_signal();
+}
+
+static void
+worker_signal(void)
+{
+    LOG_REGISTER_CONTEXT;
 
     uint64_t cnt = 1;
     if( write(worker_req_evfd, &cnt, sizeof cnt) == -1 ) {
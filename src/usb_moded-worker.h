@@ -27,6 +27,27 @@
 
 # include "usb_moded-dyn-config.h"
 
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Cancellation state of a worker job
+ *
+ * Passed on to helper threads that execute parts of the job, so
+ * that they can bail out when the job gets superseded.
+ */
+typedef struct worker_cancel_token_t
+{
+    /** Flag for: token belongs to a worker job */
+    bool wct_valid;
+
+    /** Value of cancellation serial when the job was started */
+    int  wct_serial;
+
+    /** Flag for: job is cleaning up and must not bail out */
+    bool wct_uncancellable;
+} worker_cancel_token_t;
+
 /* ========================================================================= *
  * Constants
  * ========================================================================= */
@@ -39,17 +60,24 @@
  * WORKER
  * ------------------------------------------------------------------------- */
 
-bool              worker_bailing_out          (void);
-const char       *worker_get_kernel_module    (void);
-bool              worker_set_kernel_module    (const char *module);
-void              worker_clear_kernel_module  (void);
-const modedata_t *worker_get_usb_mode_data    (void);
-modedata_t       *worker_dup_usb_mode_data    (void);
-void              worker_set_usb_mode_data    (const modedata_t *data);
-void              worker_request_hardware_mode(const char *mode);
-void              worker_clear_hardware_mode  (void);
-bool              worker_init                 (void);
-void              worker_quit                 (void);
-void              worker_wakeup               (void);
+bool              worker_bailing_out            (void);
+int               worker_get_cancel_fd          (void);
+worker_cancel_token_t worker_get_cancel_token   (void);
+void              worker_set_cancel_token       (const worker_cancel_token_t *token);
+const char       *worker_get_kernel_module      (void);
+bool              worker_set_kernel_module      (const char *module);
+void              worker_clear_kernel_module    (void);
+const modedata_t *worker_get_usb_mode_data      (void);
+modedata_t       *worker_dup_usb_mode_data      (void);
+void              worker_set_usb_mode_data      (const modedata_t *data);
+void              worker_request_hardware_mode  (const char *mode);
+void              worker_clear_hardware_mode    (void);
+void              worker_request_network_refresh(void);
+void              worker_request_appsync_reload (void);
+void              worker_request_gadget_functions(const char *gadget, const char *functions);
+void              worker_request_prestage       (const char *mode);
+bool              worker_init                   (void);
+void              worker_quit                   (void);
+void              worker_wakeup                 (void);
 
 #endif /* USB_MODED_WORKER_H_ */
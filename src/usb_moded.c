@@ -44,12 +44,16 @@
 #include "usb_moded-control.h"
 #include "usb_moded-dbus-private.h"
 #include "usb_moded-devicelock.h"
+#include "usb_moded-gadget.h"
 #include "usb_moded-log.h"
+#include "usb_moded-loopwatch.h"
 #include "usb_moded-mac.h"
 #include "usb_moded-modesetting.h"
 #include "usb_moded-modules.h"
+#include "usb_moded-network.h"
 #include "usb_moded-sigpipe.h"
 #include "usb_moded-systemd.h"
+#include "usb_moded-trace.h"
 #include "usb_moded-trigger.h"
 #include "usb_moded-udev.h"
 #include "usb_moded-worker.h"
@@ -60,6 +64,8 @@
 # include "usb_moded-user.h"
 #endif
 
+#include <sys/inotify.h>
+
 #include <getopt.h>
 #include <unistd.h>
 
@@ -101,6 +107,9 @@
 
 #define CABLE_CONNECTION_DELAY_MAXIMUM 4000
 
+/** Delay for letting bursts of configuration file changes settle [ms] */
+#define USBMODED_RELOAD_DELAY_MS 1000
+
 /* ========================================================================= *
  * Prototypes
  * ========================================================================= */
@@ -110,6 +119,7 @@
  * ------------------------------------------------------------------------- */
 
 GList            *usbmoded_get_modelist              (void);
+unsigned          usbmoded_get_modelist_generation   (void);
 void              usbmoded_load_modelist             (void);
 void              usbmoded_free_modelist             (void);
 const modedata_t *usbmoded_get_modedata              (const char *modename);
@@ -118,9 +128,13 @@ bool              usbmoded_get_rescue_mode           (void);
 void              usbmoded_set_rescue_mode           (bool rescue_mode);
 bool              usbmoded_get_diag_mode             (void);
 void              usbmoded_set_diag_mode             (bool diag_mode);
+static void       usbmoded_forget_permissions        (void);
+static bool       usbmoded_check_mode_permitted      (const char *modename, uid_t uid);
 bool              usbmoded_is_mode_permitted         (const char *modename, uid_t uid);
 void              usbmoded_set_cable_connection_delay(int delay_ms);
 int               usbmoded_get_cable_connection_delay(void);
+bool              usbmoded_get_prestage              (void);
+void              usbmoded_set_prestage              (bool prestage);
 static gboolean   usbmoded_allow_suspend_timer_cb    (gpointer aptr);
 void              usbmoded_allow_suspend             (void);
 void              usbmoded_delay_suspend             (void);
@@ -131,8 +145,18 @@ bool              usbmoded_can_export                (void);
 bool              usbmoded_init_done_p               (void);
 void              usbmoded_set_init_done             (bool reached);
 void              usbmoded_probe_init_done           (void);
+static bool       usbmoded_reload_modelist           (void);
+static void       usbmoded_reload_configuration      (bool modes, bool apps);
+static gboolean   usbmoded_reload_cb                 (gpointer aptr);
+static gboolean   usbmoded_watch_input_cb            (GIOChannel *chn, GIOCondition cnd, gpointer aptr);
+static bool       usbmoded_watch_start               (void);
+static void       usbmoded_watch_stop                (void);
 void              usbmoded_exit_mainloop             (int exitcode);
 void              usbmoded_handle_signal             (int signum);
+static bool       usbmoded_probe_backend             (void);
+static gboolean   usbmoded_probe_backend_cb          (gpointer aptr);
+static void       usbmoded_init_late                 (void);
+static gboolean   usbmoded_init_late_cb              (gpointer aptr);
 static bool       usbmoded_init                      (void);
 static void       usbmoded_cleanup                   (void);
 static void       usbmoded_usage                     (void);
@@ -157,6 +181,49 @@ static bool       usbmoded_systemd_notify = false;
 #endif
 static bool       usbmoded_auto_exit      = false;
 
+/** Mainloop stall threshold [ms], or zero to disable dispatch profiling */
+static unsigned   usbmoded_stall_ms       = 0;
+
+/** Remaining gadget backend probing attempts */
+static int        usbmoded_probe_tries    = 10;
+
+/** Timer id for retrying gadget backend probing */
+static guint      usbmoded_probe_id       = 0;
+
+/** Idle callback id for finishing initialization */
+static guint      usbmoded_init_late_id   = 0;
+
+/** Configuration directories tracked for changes */
+static struct
+{
+    /** Directory path */
+    const char *path;
+
+    /** Flag for: directory holds appsync configuration */
+    bool        apps;
+
+    /** Inotify watch descriptor, or -1 */
+    int         wd;
+} usbmoded_watch_dirs[] =
+{
+    { .path = MODE_DIR_PATH,      .apps = false, .wd = -1 },
+    { .path = DIAG_DIR_PATH,      .apps = false, .wd = -1 },
+    { .path = CONF_DIR_PATH,      .apps = true,  .wd = -1 },
+    { .path = CONF_DIR_DIAG_PATH, .apps = true,  .wd = -1 },
+};
+
+/** I/O watch id for configuration directory inotify fd */
+static guint      usbmoded_watch_id       = 0;
+
+/** Timer id for delayed configuration reload */
+static guint      usbmoded_reload_id      = 0;
+
+/** Flag for: dyn-modes reload is pending */
+static bool       usbmoded_reload_modes   = false;
+
+/** Flag for: appsync reload is pending */
+static bool       usbmoded_reload_apps    = false;
+
 static pthread_mutex_t  usbmoded_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 #define USBMODED_LOCKED_ENTER do {\
@@ -187,6 +254,18 @@ static pthread_mutex_t  usbmoded_mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 static GList *usbmoded_modelist = 0;
 
+/** Mode name to mode data lookup table for #usbmoded_modelist
+ *
+ * Borrows keys and values from the mode list items.
+ */
+static GHashTable *usbmoded_modeindex = 0;
+
+/** Counter for changes in #usbmoded_modelist
+ *
+ * Incremented whenever the mode list is loaded or released.
+ */
+static unsigned usbmoded_modelist_gen = 0;
+
 /** Get list of dynamic mode data items
  *
  * Note: This function should be called only from the main thread.
@@ -201,6 +280,23 @@ usbmoded_get_modelist(void)
     return usbmoded_modelist;
 }
 
+/** Get mode list generation
+ *
+ * Can be used for detecting whether data derived from the
+ * mode list needs to be re-evaluated.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @returns mode list generation number
+ */
+unsigned
+usbmoded_get_modelist_generation(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return usbmoded_modelist_gen;
+}
+
 /** Load dynamic mode data items
  *
  * Note: This function should be called only from the main thread.
@@ -215,6 +311,8 @@ usbmoded_load_modelist(void)
     if( !usbmoded_modelist ) {
         log_notice("load modelist");
         usbmoded_modelist = modelist_load(usbmoded_get_diag_mode());
+        usbmoded_modeindex = modelist_index(usbmoded_modelist);
+        ++usbmoded_modelist_gen;
     }
 
     USBMODED_LOCKED_LEAVE;
@@ -233,8 +331,12 @@ usbmoded_free_modelist(void)
 
     if( usbmoded_modelist ) {
         log_notice("free modelist");
+        if( usbmoded_modeindex )
+            g_hash_table_unref(usbmoded_modeindex),
+                usbmoded_modeindex = 0;
         modelist_free(usbmoded_modelist),
             usbmoded_modelist = 0;
+        ++usbmoded_modelist_gen;
     }
 
     USBMODED_LOCKED_LEAVE;
@@ -255,21 +357,19 @@ usbmoded_get_modedata(const char *modename)
 
     modedata_t *modedata = 0;
 
-    for( GList *iter = usbmoded_get_modelist(); iter; iter = g_list_next(iter) ) {
-        modedata_t *data = iter->data;
-        if( !g_strcmp0(data->mode_name, modename) ) {
-            modedata = data;
-            break;
-        }
-    }
+    if( usbmoded_modeindex && modename )
+        modedata = g_hash_table_lookup(usbmoded_modeindex, modename);
+
     return modedata;
 }
 
-/** Lookup and clone dynamic mode data by name
+/** Lookup dynamic mode data by name and acquire a reference to it
  *
  * Note: This function is safe to call from worker thread too.
  *
- * Caller must release the returned object via #modedata_free().
+ * The returned object is shared and must not be modified.
+ *
+ * Caller must release the returned object via #modedata_unref().
  *
  * @param modename  Name of mode to lookup
  *
@@ -282,7 +382,7 @@ usbmoded_dup_modedata(const char *modename)
 
     USBMODED_LOCKED_ENTER;
 
-    modedata_t *modedata = modedata_copy(usbmoded_get_modedata(modename));
+    modedata_t *modedata = modedata_ref(usbmoded_get_modedata(modename));
 
     USBMODED_LOCKED_LEAVE;
 
@@ -360,7 +460,45 @@ void usbmoded_set_diag_mode(bool diag_mode)
  * ACCESS_CHECKS
  * ------------------------------------------------------------------------- */
 
-bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
+#ifdef SAILFISH_ACCESS_CONTROL
+/** Cached permission check results
+ *
+ * Maps "uid:mode" strings to allowed / denied booleans.
+ *
+ * Note: This should be accessed only from the main thread.
+ */
+static GHashTable *usbmoded_permit_cache = 0;
+
+/** Configuration generation usbmoded_permit_cache is valid for */
+static unsigned usbmoded_permit_cache_config_gen = 0;
+
+/** Mode list generation usbmoded_permit_cache is valid for */
+static unsigned usbmoded_permit_cache_modelist_gen = 0;
+
+/** Current user usbmoded_permit_cache is valid for */
+static uid_t usbmoded_permit_cache_user = UID_UNKNOWN;
+#endif
+
+/** Release cached permission check results
+ */
+static void usbmoded_forget_permissions(void)
+{
+#ifdef SAILFISH_ACCESS_CONTROL
+    LOG_REGISTER_CONTEXT;
+
+    if( usbmoded_permit_cache )
+        g_hash_table_unref(usbmoded_permit_cache), usbmoded_permit_cache = 0;
+#endif
+}
+
+/** Evaluate whether user is allowed to use a mode
+ *
+ * @param modename  name of mode to check
+ * @param uid       user id to check for
+ *
+ * @return true if mode is allowed, false otherwise
+ */
+static bool usbmoded_check_mode_permitted(const char *modename, uid_t uid)
 {
 #ifdef SAILFISH_ACCESS_CONTROL
     LOG_REGISTER_CONTEXT;
@@ -369,16 +507,6 @@ bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
     modedata_t *data = 0;
     char       *group = 0;
 
-    /* all modes are allowed for root */
-    if( uid == 0 )
-        goto EXIT;
-
-    /* non-existing special value, deny everything */
-    if( uid == UID_UNKNOWN ) {
-        allowed = false;
-        goto EXIT;
-    }
-
     /* non-dynamic modes are allowed for all */
     if( !(data = usbmoded_dup_modedata(modename)) )
         goto EXIT;
@@ -391,16 +519,86 @@ bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
 EXIT:
 
     g_free(group);
-    modedata_free(data);
+    modedata_unref(data);
 
     return allowed;
 
 #else
+    (void)modename;
+    (void)uid;
     return true;
 
 #endif
 }
 
+/** Check whether user is allowed to use a mode
+ *
+ * Results are cached until user, configuration or
+ * mode list changes.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param modename  name of mode to check
+ * @param uid       user id to check for
+ *
+ * @return true if mode is allowed, false otherwise
+ */
+bool usbmoded_is_mode_permitted(const char *modename, uid_t uid)
+{
+#ifdef SAILFISH_ACCESS_CONTROL
+    LOG_REGISTER_CONTEXT;
+
+    bool     allowed = true;
+    gchar   *key     = 0;
+    gpointer val     = 0;
+
+    /* all modes are allowed for root */
+    if( uid == 0 )
+        goto EXIT;
+
+    /* non-existing special value, deny everything */
+    if( uid == UID_UNKNOWN ) {
+        allowed = false;
+        goto EXIT;
+    }
+
+    unsigned config_gen   = config_get_generation();
+    unsigned modelist_gen = usbmoded_get_modelist_generation();
+    uid_t    current_user = usbmoded_get_current_user();
+
+    if( !usbmoded_permit_cache ||
+        usbmoded_permit_cache_config_gen != config_gen ||
+        usbmoded_permit_cache_modelist_gen != modelist_gen ||
+        usbmoded_permit_cache_user != current_user ) {
+        usbmoded_forget_permissions();
+        usbmoded_permit_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                      g_free, 0);
+        usbmoded_permit_cache_config_gen   = config_gen;
+        usbmoded_permit_cache_modelist_gen = modelist_gen;
+        usbmoded_permit_cache_user         = current_user;
+    }
+
+    key = g_strdup_printf("%u:%s", (unsigned)uid, modename ?: "");
+    if( g_hash_table_lookup_extended(usbmoded_permit_cache, key, 0, &val) ) {
+        allowed = GPOINTER_TO_INT(val);
+    }
+    else {
+        allowed = usbmoded_check_mode_permitted(modename, uid);
+        g_hash_table_insert(usbmoded_permit_cache, key, GINT_TO_POINTER(allowed)),
+            key = 0;
+    }
+
+EXIT:
+    g_free(key);
+
+    return allowed;
+
+#else
+    return usbmoded_check_mode_permitted(modename, uid);
+
+#endif
+}
+
 /* ------------------------------------------------------------------------- *
  * CABLE_CONNECT_DELAY
  * ------------------------------------------------------------------------- */
@@ -446,6 +644,37 @@ usbmoded_get_cable_connection_delay(void)
     return usbmoded_cable_connection_delay;
 }
 
+/* ------------------------------------------------------------------------- *
+ * PRESTAGE
+ * ------------------------------------------------------------------------- */
+
+/** Pre-staging enabled flag
+ *
+ * When enabled, gadget functions for the most likely mode are prepared
+ * while pc connection is being debounced - so that the actual mode
+ * switch has less to do once the mode selection has been made.
+ *
+ * Used for implementing --prestage option.
+ */
+static bool usbmoded_prestage = false;
+
+bool usbmoded_get_prestage(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    return usbmoded_prestage;
+}
+
+void usbmoded_set_prestage(bool prestage)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( usbmoded_prestage != prestage ) {
+        log_info("prestage: %d -> %d",  usbmoded_prestage, prestage);
+        usbmoded_prestage = prestage;
+    }
+}
+
 /* ------------------------------------------------------------------------- *
  * SUSPEND_BLOCKING
  * ------------------------------------------------------------------------- */
@@ -509,7 +738,10 @@ void usbmoded_delay_suspend(void)
 
     /* Use of automatically terminating wakelocks also means we need
      * to renew the wakelock when extending the suspend delay. */
-    common_acquire_wakelock(USB_MODED_WAKELOCK_STATE_CHANGE);
+    if( !usbmoded_blocking_suspend )
+        common_acquire_wakelock(USB_MODED_WAKELOCK_STATE_CHANGE);
+    else
+        common_renew_wakelock(USB_MODED_WAKELOCK_STATE_CHANGE);
 
     usbmoded_blocking_suspend = true;
 
@@ -655,6 +887,335 @@ void usbmoded_probe_init_done(void)
     usbmoded_set_init_done(access(usbmoded_init_done_flagfile, F_OK) == 0);
 }
 
+/* ------------------------------------------------------------------------- *
+ * CONFIG_RELOAD
+ * ------------------------------------------------------------------------- */
+
+/** Reload dynamic mode data items
+ *
+ * Only the files that have changed are parsed again, see inicache_open(),
+ * and the mode list is replaced only if the set of modes or some
+ * definitions actually changed.
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @return true if mode list changed, false otherwise
+ */
+static bool
+usbmoded_reload_modelist(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    GList *modelist = modelist_load(usbmoded_get_diag_mode());
+    bool   changed  = false;
+
+    USBMODED_LOCKED_ENTER;
+
+    if( (changed = modelist_reuse(usbmoded_modeindex, modelist)) ) {
+        log_notice("update modelist");
+        if( usbmoded_modeindex )
+            g_hash_table_unref(usbmoded_modeindex);
+        modelist_free(usbmoded_modelist);
+        usbmoded_modelist  = modelist, modelist = 0;
+        usbmoded_modeindex = modelist_index(usbmoded_modelist);
+        ++usbmoded_modelist_gen;
+    }
+
+    USBMODED_LOCKED_LEAVE;
+
+    modelist_free(modelist);
+
+    return changed;
+}
+
+/** Reload configuration files and react to changes
+ *
+ * Note: This function should be called only from the main thread.
+ *
+ * @param modes  true to reload dynamic mode configuration
+ * @param apps   true to reload appsync configuration
+ */
+static void
+usbmoded_reload_configuration(bool modes, bool apps)
+{
+    LOG_REGISTER_CONTEXT;
+
+    /* Reload appsync configuration files
+     *
+     * Updated configuration is loaded and set aside.
+     *
+     * Switch happens when applications started based
+     * on currently active configuration have been
+     * stopped.
+     */
+#ifdef APP_SYNC
+    if( apps ) {
+        log_debug("reloading appsync configuration");
+        worker_request_appsync_reload();
+    }
+#else
+    (void)apps;
+#endif
+
+    if( !modes )
+        goto EXIT;
+
+    /* Reload mode list
+     *
+     * Note that copy of mode data related to the current
+     * mode is stored separately and that copy is used
+     * when making exit from current mode.
+     */
+    log_debug("reloading dynamic mode configuration");
+
+    const char *current = control_get_target_mode();
+    modedata_t *prev    = usbmoded_dup_modedata(current);
+
+    if( !usbmoded_reload_modelist() ) {
+        log_debug("dynamic mode configuration not changed");
+        modedata_unref(prev);
+        goto EXIT;
+    }
+
+    if( prev && usbmoded_get_modedata(current) &&
+        usbmoded_get_modedata(current) != prev )
+        log_notice("current mode '%s' definition changed; takes effect"
+                   " on next activation", current);
+    modedata_unref(prev);
+
+    /* If default mode selection became invalid,
+     * revert setting to "ask" */
+    uid_t current_user = usbmoded_get_current_user();
+    gchar *config = config_get_mode_setting(current_user);
+    if( g_strcmp0(config, MODE_ASK) &&
+        common_valid_mode(config) ) {
+        log_warning("default mode '%s' is not valid, reset to '%s'",
+                    config, MODE_ASK);
+        config_set_mode_setting(MODE_ASK, current_user);
+    }
+    else {
+        log_debug("default mode '%s' is still valid", config);
+    }
+    g_free(config);
+
+    /* If current mode became invalid, select appropriate mode.
+     *
+     * Use target mode so that we catch also situations where
+     * we are making transition to invalid state.
+     */
+    if( common_modename_is_internal(current) ) {
+        /* Internal modes are not affected by configuration
+         * file changes - no changes required. */
+        log_debug("current mode '%s' is internal", current);
+    }
+    else if( common_valid_mode(current) ) {
+        /* Dynamic mode that is no longer valid - choose
+         * something else. */
+        log_warning("current mode '%s' is not valid, re-evaluating",
+                    current);
+        control_settings_changed();
+    }
+    else {
+        /* Dynamic mode that is still valid - do nothing.
+         *
+         * Note: While the mode details /might/ have changed,
+         * skipping immediate usb reprogramming is assumed to
+         * be less harmful than potentially cutting developer
+         * mode connection during upgrade, etc. */
+        log_debug("current mode '%s' is still valid", current);
+    }
+
+    /* Signal availability */
+    log_debug("broadcast mode availability lists");
+    common_send_supported_modes_signal();
+    common_send_available_modes_signal();
+
+EXIT:
+    return;
+}
+
+/** Timer callback for reloading configuration after changes settle
+ *
+ * @param aptr  (unused)
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean
+usbmoded_reload_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    usbmoded_reload_id = 0;
+
+    bool modes = usbmoded_reload_modes;
+    bool apps  = usbmoded_reload_apps;
+    usbmoded_reload_modes = usbmoded_reload_apps = false;
+
+    usbmoded_reload_configuration(modes, apps);
+
+    return G_SOURCE_REMOVE;
+}
+
+/** Glib io watch callback for reading inotify events
+ *
+ * Events are collected and acted on only after no further
+ * changes have been seen for USBMODED_RELOAD_DELAY_MS, so that
+ * package installs touching several files cause just one reload.
+ *
+ * @param chn   glib io channel
+ * @param cnd   wakeup reason
+ * @param aptr  user data (unused)
+ *
+ * @return TRUE to keep the iowatch, or FALSE to disable it
+ */
+static gboolean
+usbmoded_watch_input_cb(GIOChannel *chn, GIOCondition cnd, gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    gboolean keep_watch = FALSE;
+    bool     changed    = false;
+    char     buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    if( cnd & (G_IO_ERR | G_IO_HUP | G_IO_NVAL) )
+        goto EXIT;
+
+    int fd = g_io_channel_unix_get_fd(chn);
+    ssize_t rc = read(fd, buf, sizeof buf);
+    if( rc == -1 ) {
+        if( errno == EINTR || errno == EAGAIN )
+            keep_watch = TRUE;
+        else
+            log_err("config reload watch read: %m");
+        goto EXIT;
+    }
+
+    for( ssize_t pos = 0; pos + (ssize_t)sizeof(struct inotify_event) <= rc; ) {
+        const struct inotify_event *eve = (void *)(buf + pos);
+        pos += sizeof *eve + eve->len;
+
+        if( eve->mask & IN_Q_OVERFLOW ) {
+            usbmoded_reload_modes = usbmoded_reload_apps = changed = true;
+            continue;
+        }
+
+        if( eve->len == 0 || !g_str_has_suffix(eve->name, ".ini") )
+            continue;
+
+        for( size_t i = 0; i < G_N_ELEMENTS(usbmoded_watch_dirs); ++i ) {
+            if( usbmoded_watch_dirs[i].wd != eve->wd )
+                continue;
+            if( usbmoded_watch_dirs[i].apps )
+                usbmoded_reload_apps = true;
+            else
+                usbmoded_reload_modes = true;
+            changed = true;
+        }
+    }
+
+    keep_watch = TRUE;
+
+EXIT:
+    if( changed ) {
+        if( usbmoded_reload_id )
+            g_source_remove(usbmoded_reload_id);
+        usbmoded_reload_id = g_timeout_add(USBMODED_RELOAD_DELAY_MS,
+                                           usbmoded_reload_cb, 0);
+    }
+
+    if( !keep_watch ) {
+        log_warning("config reload watch disabled");
+        usbmoded_watch_id = 0;
+    }
+
+    return keep_watch;
+}
+
+/** Start tracking dyn-modes and appsync directory changes
+ *
+ * @return true if changes can be tracked, false otherwise
+ */
+static bool
+usbmoded_watch_start(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    const uint32_t mask = (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                           IN_MOVED_FROM | IN_MOVED_TO);
+
+    bool        ack = false;
+    int         fd  = -1;
+    GIOChannel *chn = 0;
+
+    if( usbmoded_watch_id ) {
+        ack = true;
+        goto EXIT;
+    }
+
+    if( (fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1 ) {
+        log_err("inotify_init: %m");
+        goto EXIT;
+    }
+
+    /* Directories that do not exist are not needed either */
+    for( size_t i = 0; i < G_N_ELEMENTS(usbmoded_watch_dirs); ++i ) {
+#ifndef APP_SYNC
+        if( usbmoded_watch_dirs[i].apps )
+            continue;
+#endif
+        usbmoded_watch_dirs[i].wd = inotify_add_watch(fd, usbmoded_watch_dirs[i].path, mask);
+        if( usbmoded_watch_dirs[i].wd == -1 )
+            log_debug("%s: can't watch: %m", usbmoded_watch_dirs[i].path);
+    }
+
+    if( !(chn = g_io_channel_unix_new(fd)) )
+        goto EXIT;
+
+    usbmoded_watch_id = g_io_add_watch(chn, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                       usbmoded_watch_input_cb, 0);
+    if( !usbmoded_watch_id )
+        goto EXIT;
+
+    g_io_channel_set_close_on_unref(chn, true), fd = -1;
+
+    ack = true;
+
+EXIT:
+    if( chn )
+        g_io_channel_unref(chn);
+
+    if( fd != -1 )
+        close(fd);
+
+    if( !ack )
+        log_warning("config changes are not tracked; reload via SIGHUP");
+
+    return ack;
+}
+
+/** Stop tracking dyn-modes and appsync directory changes
+ */
+static void
+usbmoded_watch_stop(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    if( usbmoded_watch_id )
+        g_source_remove(usbmoded_watch_id), usbmoded_watch_id = 0;
+
+    if( usbmoded_reload_id )
+        g_source_remove(usbmoded_reload_id), usbmoded_reload_id = 0;
+
+    for( size_t i = 0; i < G_N_ELEMENTS(usbmoded_watch_dirs); ++i )
+        usbmoded_watch_dirs[i].wd = -1;
+
+    usbmoded_reload_modes = usbmoded_reload_apps = false;
+}
+
 /* ------------------------------------------------------------------------- *
  * MAINLOOP
  * ------------------------------------------------------------------------- */
@@ -695,83 +1256,151 @@ void usbmoded_handle_signal(int signum)
     }
     else if( signum == SIGHUP )
     {
-        /* Reload mode list
-         *
-         * Note that copy of mode data related to the current
-         * mode is stored separately and that copy is used
-         * when making exit from current mode.
-         */
-        log_debug("reloading dynamic mode configuration");
-        usbmoded_free_modelist();
-        usbmoded_load_modelist();
-
-        /* Reload appsync configuration files
-         *
-         * Updated configuration is loaded and set aside.
-         *
-         * Switch happens when applications started based
-         * on currently active configuration have been
-         * stopped.
-         */
+        usbmoded_reload_configuration(true, true);
+    }
+    else
+    {
+        usbmoded_exit_mainloop(EXIT_FAILURE);
+    }
+}
+
+/** Probe for usb gadget control mechanism
+ *
+ * During bootup the sysfs control structures might not be already
+ * in there when usb-moded starts up. Failed probing is retried few
+ * times unless init done is / gets reached while waiting, after which
+ * kernel modules are assumed.
+ *
+ * @return true if probing is finished, false if it should be retried
+ */
+static bool usbmoded_probe_backend(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    bool done = true;
+
+    if( configfs_init() )
+        goto EXIT;
+
+    if( android_init() )
+        goto EXIT;
+
+    usbmoded_probe_init_done();
+
+    if( usbmoded_init_done_p() || --usbmoded_probe_tries <= 0 ) {
+        if( !modules_init() )
+            log_crit("No supported usb control mechanisms found");
+        goto EXIT;
+    }
+
+    done = false;
+
+EXIT:
+    if( done )
+        gadget_init();
+
+    return done;
+}
+
+/** Timer callback for retrying gadget backend probing
+ *
+ * @param aptr (unused)
+ *
+ * @return G_SOURCE_CONTINUE until probing is finished
+ */
+static gboolean usbmoded_probe_backend_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    if( !usbmoded_probe_backend() )
+        return G_SOURCE_CONTINUE;
+
+    usbmoded_probe_id = 0;
+    usbmoded_init_late();
+    return G_SOURCE_REMOVE;
+}
+
+/** Initialize things that are not needed for claiming D-Bus name
+ *
+ * Mode selection gets enabled only after this, so that cable state
+ * changes seen before finishing initialization are acted on here.
+ */
+static void usbmoded_init_late(void)
+{
+    LOG_REGISTER_CONTEXT;
+
+    log_debug("late init");
+
 #ifdef APP_SYNC
-        log_debug("reloading appsync configuration");
-        appsync_load_configuration();
+    appsync_load_configuration();
 #endif
-        /* If default mode selection became invalid,
-         * revert setting to "ask" */
-        uid_t current_user = usbmoded_get_current_user();
-        gchar *config = config_get_mode_setting(current_user);
-        if( g_strcmp0(config, MODE_ASK) &&
-            common_valid_mode(config) ) {
-            log_warning("default mode '%s' is not valid, reset to '%s'",
-                        config, MODE_ASK);
-            config_set_mode_setting(MODE_ASK, current_user);
-        }
-        else {
-            log_debug("default mode '%s' is still valid", config);
-        }
-        g_free(config);
 
-        /* If current mode became invalid, select appropriate mode.
-         *
-         * Use target mode so that we catch also situations where
-         * we are making transition to invalid state.
-         */
-        const char *current = control_get_target_mode();
-        if( common_modename_is_internal(current) ) {
-            /* Internal modes are not affected by configuration
-             * file changes - no changes required. */
-            log_debug("current mode '%s' is internal", current);
-        }
-        else if( common_valid_mode(current) ) {
-            /* Dynamic mode that is no longer valid - choose
-             * something else. */
-            log_warning("current mode '%s' is not valid, re-evaluating",
-                        current);
-            control_settings_changed();
-        }
-        else {
-            /* Dynamic mode that is still valid - do nothing.
-             *
-             * Note: While the mode details /might/ have changed,
-             * skipping immediate usb reprogramming is assumed to
-             * be less harmful than potentially cutting developer
-             * mode connection during upgrade, etc. */
-            log_debug("current mode '%s' is still valid", current);
-        }
+    if(config_check_trigger())
+        trigger_init();
 
-        /* Signal availability */
-        log_debug("broadcast mode availability lists");
-        common_send_supported_modes_signal();
-        common_send_available_modes_signal();
+    /* If usb-moded happens to crash, it could leave appsync processes
+     * running. To make sure things are in the order expected by usb-moded
+     * force stopping of appsync processes during usb-moded startup.
+     *
+     * The exception is: When usb-moded starts as a part of bootup. Then
+     * we can be relatively sure that usb-moded has not been running yet
+     * and therefore no appsync processes have been started and we can
+     * skip the blocking ipc required to stop the appsync systemd units. */
+#ifdef APP_SYNC
+    if( usbmoded_init_done_p() ) {
+        log_warning("usb-moded started after init-done; "
+                    "forcing appsync stop");
+        appsync_deactivate_all(true);
     }
-    else
-    {
-        usbmoded_exit_mainloop(EXIT_FAILURE);
+#endif
+
+    /* Broadcast supported / hidden modes */
+    common_send_supported_modes_signal();
+    common_send_available_modes_signal();
+    common_send_hidden_modes_signal();
+    common_send_whitelisted_modes_signal();
+
+    /* Act on '--fallback' commandline option */
+    if( usbmoded_hw_fallback ) {
+        log_warning("Forcing USB state to connected always. ASK mode non functional!");
+        /* Since there will be no disconnect signals coming from hw the state should not change */
+        control_set_cable_state(CABLE_STATE_PC_CONNECTED);
     }
+
+    control_set_enabled(true);
 }
 
-/* Prepare usb-moded for running the mainloop */
+/** Idle callback for finishing initialization from mainloop
+ *
+ * @param aptr (unused)
+ *
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean usbmoded_init_late_cb(gpointer aptr)
+{
+    LOG_REGISTER_CONTEXT;
+
+    (void)aptr;
+
+    usbmoded_init_late_id = 0;
+
+    if( usbmoded_probe_backend() )
+        usbmoded_init_late();
+    else
+        usbmoded_probe_id = g_timeout_add(2000, usbmoded_probe_backend_cb, 0);
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Prepare usb-moded for running the mainloop
+ *
+ * Only things needed for owning the D-Bus name and tracking cable
+ * state are done here - the rest is finished from the mainloop via
+ * usbmoded_init_late_cb() so that startup is not delayed by gadget
+ * probing and appsync handling.
+ */
 static bool usbmoded_init(void)
 {
     LOG_REGISTER_CONTEXT;
@@ -824,6 +1453,11 @@ static bool usbmoded_init(void)
     }
 #endif
 
+    /* Connection sharing data is tracked in the background; failure
+     * just means it will be queried synchronously when needed. */
+    if( !network_watch_start() )
+        log_warning("network tracking could not be started");
+
     /* Set daemon config/state data to sane state */
     modesetting_init();
 
@@ -833,48 +1467,18 @@ static bool usbmoded_init(void)
         goto EXIT;
     }
 
-#ifdef APP_SYNC
-    appsync_load_configuration();
-#endif
-
-    /* always read dyn modes even if appsync is not used */
+    /* always read dyn modes even if appsync is not used; needed
+     * already for answering D-Bus queries */
     usbmoded_load_modelist();
 
-    if(config_check_trigger())
-        trigger_init();
+    /* Reload mode and appsync configuration on changes */
+    usbmoded_watch_start();
 
-    /* Set-up mac address before kmod */
+    /* Set-up mac address before kmod. Existing address is retained
+     * so that hosts do not need to redo network setup on every boot. */
     if(access("/etc/modprobe.d/g_ether.conf", F_OK) != 0)
     {
-        mac_generate_random_mac();
-    }
-
-    /* During bootup the sysfs control structures might
-     * not be already in there when usb-moded starts up.
-     * Retry few times unless init done is / gets reached
-     * while waiting.
-     *
-     * Note that waiting here delays also systemd notification
-     * -> changes in wait time might require adjustemnts to
-     *    startup timeout value in usb-moded.service file.
-     */
-    for( int i = 10; ; ) {
-        if( configfs_init() )
-            break;
-
-        if( android_init() )
-            break;
-
-        /* Must probe / poll since we're not yet running mainloop */
-        usbmoded_probe_init_done();
-
-        if( usbmoded_init_done_p() || --i <= 0 ) {
-            if( !modules_init() )
-                log_crit("No supported usb control mechanisms found");
-            break;
-        }
-
-        common_msleep(2000);
+        mac_generate_mac();
     }
 
     /* Allow making systemd control ipc */
@@ -883,22 +1487,6 @@ static bool usbmoded_init(void)
         goto EXIT;
     }
 
-    /* If usb-moded happens to crash, it could leave appsync processes
-     * running. To make sure things are in the order expected by usb-moded
-     * force stopping of appsync processes during usb-moded startup.
-     *
-     * The exception is: When usb-moded starts as a part of bootup. Then
-     * we can be relatively sure that usb-moded has not been running yet
-     * and therefore no appsync processes have been started and we can
-     * skip the blocking ipc required to stop the appsync systemd units. */
-#ifdef APP_SYNC
-    if( usbmoded_init_done_p() ) {
-        log_warning("usb-moded started after init-done; "
-                    "forcing appsync stop");
-        appsync_deactivate_all(true);
-    }
-#endif
-
     /* Claim D-Bus service name before proceeding with things that
      * could result in dbus signal broadcasts from usb-moded interface.
      */
@@ -907,7 +1495,8 @@ static bool usbmoded_init(void)
         goto EXIT;
     }
 
-    /* Initialize udev listener. Can cause mode changes.
+    /* Initialize udev listener. Cable state gets tracked, but
+     * mode changes are not made before usbmoded_init_late().
      *
      * Failing here is allowed if '--fallback' commandline option is used.
      */
@@ -917,25 +1506,21 @@ static bool usbmoded_init(void)
     }
 
 #ifdef MEEGOLOCK
-    /* Initialize current user tracking. Can cause mode changes */
+    /* Initialize current user tracking */
     if ( !user_watch_init() ) {
         log_crit("user watch init failed");
         goto EXIT;
     }
 #endif
 
-    /* Broadcast supported / hidden modes */
-    // TODO: should this happen before umudev_init()?
-    common_send_supported_modes_signal();
-    common_send_available_modes_signal();
-    common_send_hidden_modes_signal();
-    common_send_whitelisted_modes_signal();
-
-    /* Act on '--fallback' commandline option */
-    if( usbmoded_hw_fallback ) {
-        log_warning("Forcing USB state to connected always. ASK mode non functional!");
-        /* Since there will be no disconnect signals coming from hw the state should not change */
-        control_set_cable_state(CABLE_STATE_PC_CONNECTED);
+    if( usbmoded_auto_exit ) {
+        /* No mainloop - finish initialization synchronously */
+        while( !usbmoded_probe_backend() )
+            common_msleep(2000);
+        usbmoded_init_late();
+    }
+    else {
+        usbmoded_init_late_id = g_idle_add(usbmoded_init_late_cb, 0);
     }
 
     ack = true;
@@ -950,15 +1535,27 @@ static void usbmoded_cleanup(void)
 {
     LOG_REGISTER_CONTEXT;
 
+    /* Cancel pending startup stages */
+    if( usbmoded_init_late_id )
+        g_source_remove(usbmoded_init_late_id), usbmoded_init_late_id = 0;
+    if( usbmoded_probe_id )
+        g_source_remove(usbmoded_probe_id), usbmoded_probe_id = 0;
+
     /* Stop user change listener */
 #ifdef MEEGOLOCK
     user_watch_stop();
 #endif
 
+    /* Mainloop is not going to be iterated anymore */
+    loopwatch_quit();
+
     /* Stop the worker thread first to avoid confusion about shared
      * resources we are just about to release. */
     worker_quit();
 
+    /* Close rtnetlink socket used by the worker thread */
+    network_quit();
+
     /* Detach from SystemBus. Components that hold reference to the
      * shared bus connection can still perform cleanup tasks, but new
      * references can't be obtained anymore and usb-moded myethod call
@@ -978,6 +1575,9 @@ static void usbmoded_cleanup(void)
     devicelock_stop_listener();
 #endif
 
+    /* Stop tracking connection sharing data */
+    network_watch_stop();
+
     /* Stop tracking device state */
 #ifdef MEEGOLOCK
     dsme_stop_listener();
@@ -987,6 +1587,7 @@ static void usbmoded_cleanup(void)
     umudev_quit();
 
     /* Do backend specific cleanup */
+    gadget_quit();
     modules_quit();
     android_quit();
     configfs_quit();
@@ -994,14 +1595,21 @@ static void usbmoded_cleanup(void)
     /* Undo trigger_init() */
     trigger_stop();
 
+    /* Undo usbmoded_watch_start() */
+    usbmoded_watch_stop();
+
     /* Undo usbmoded_load_modelist() */
     usbmoded_free_modelist();
+    usbmoded_forget_permissions();
 
 #ifdef APP_SYNC
     /* Undo appsync_load_configuration() */
     appsync_free_configuration();
 #endif
 
+    /* Undo config_init() */
+    config_quit();
+
     /* Release dynamic memory */
     worker_clear_kernel_module();
     worker_clear_hardware_mode();
@@ -1009,6 +1617,8 @@ static void usbmoded_cleanup(void)
     control_clear_internal_mode();
     control_clear_external_mode();
     control_clear_target_mode();
+    trace_quit();
+    common_mode_list_quit();
 
     modesetting_quit();
 
@@ -1042,6 +1652,8 @@ static const char usbmoded_usage_info[] =
 "      log to stderr\n"
 "  -l,  --log-line-info\n"
 "      log to stderr and show origin of logging\n"
+"  -t,  --trace-calls\n"
+"      write function call trace to ftrace marker\n"
 "  -D,  --debug\n"
 "      turn on debug printing\n"
 "  -d,  --diag\n"
@@ -1058,6 +1670,11 @@ static const char usbmoded_usage_info[] =
 "      output version information and exit\n"
 "  -m,  --max-cable-delay=<ms>\n"
 "      maximum delay before accepting cable connection\n"
+"  -p,  --prestage\n"
+"      prepare likely mode while cable connection is debounced\n"
+"  -P,  --profile-mainloop=<ms>\n"
+"      account mainloop dispatch times and report dispatches\n"
+"      taking longer than given time as stalls\n"
 "  -b,  --android-bootup-function=<function>\n"
 "      Setup given function during bootup. Might be required\n"
 "      on some devices to make enumeration work on the 1st\n"
@@ -1076,6 +1693,7 @@ static const struct option usbmoded_long_options[] =
     { "force-syslog",                   no_argument,       0, 's' },
     { "force-stderr",                   no_argument,       0, 'T' },
     { "log-line-info",                  no_argument,       0, 'l' },
+    { "trace-calls",                    no_argument,       0, 't' },
     { "debug",                          no_argument,       0, 'D' },
     { "diag",                           no_argument,       0, 'd' },
     { "help",                           no_argument,       0, 'h' },
@@ -1083,6 +1701,8 @@ static const struct option usbmoded_long_options[] =
     { "systemd",                        no_argument,       0, 'n' },
     { "version",                        no_argument,       0, 'v' },
     { "max-cable-delay",                required_argument, 0, 'm' },
+    { "prestage",                       no_argument,       0, 'p' },
+    { "profile-mainloop",               required_argument, 0, 'P' },
     { "android-bootup-function",        required_argument, 0, 'b' },
     { "auto-exit",                      no_argument,       0, 'Q' },
     { "dbus-introspect-xml",            no_argument,       0, 'I' },
@@ -1090,7 +1710,7 @@ static const struct option usbmoded_long_options[] =
     { 0, 0, 0, 0 }
 };
 
-static const char usbmoded_short_options[] = "aifsTlDdhrnvm:b:QIB";
+static const char usbmoded_short_options[] = "aifsTltDdhrnvm:pP:b:QIB";
 
 /* Display usbmoded_usage information */
 static void usbmoded_usage(void)
@@ -1141,6 +1761,10 @@ static void usbmoded_parse_options(int argc, char* argv[])
             log_set_lineinfo(true);
             break;
 
+        case 't':
+            log_set_call_trace(true);
+            break;
+
         case 'd':
             usbmoded_set_diag_mode(true);
             break;
@@ -1165,6 +1789,14 @@ static void usbmoded_parse_options(int argc, char* argv[])
             usbmoded_set_cable_connection_delay(strtol(optarg, 0, 0));
             break;
 
+        case 'p':
+            usbmoded_set_prestage(true);
+            break;
+
+        case 'P':
+            usbmoded_stall_ms = strtoul(optarg, 0, 0);
+            break;
+
         case 'b':
             log_warning("Deprecated option: --android-bootup-function");
             break;
@@ -1217,7 +1849,7 @@ int main(int argc, char* argv[])
     fprintf(stderr, "usb_moded %s starting\n", VERSION);
     fflush(stderr);
 
-    /* Silence common_system() calls */
+    /* Silence output from subprocesses */
     if( log_get_type() != LOG_TO_STDERR && log_get_level() != LOG_DEBUG )
     {
         if( !freopen("/dev/null", "a", stdout) ) {
@@ -1228,6 +1860,9 @@ int main(int argc, char* argv[])
         }
     }
 
+    /* Keep slow log consumers from stalling mode switching */
+    log_async_start();
+
     /* - - - - - - - - - - - - - - - - - - - *
      * INITIALIZE
      * - - - - - - - - - - - - - - - - - - - */
@@ -1250,13 +1885,15 @@ int main(int argc, char* argv[])
     /* init succesful, run main loop */
     usbmoded_exitcode = EXIT_SUCCESS;
 
-    control_set_enabled(true);
-
     if( usbmoded_auto_exit )
         goto EXIT;
 
     usbmoded_mainloop = g_main_loop_new(NULL, FALSE);
 
+    /* Act on '--profile-mainloop' commandline option */
+    if( usbmoded_stall_ms )
+        loopwatch_init(usbmoded_stall_ms);
+
     log_debug("enter usb-moded mainloop");
     g_main_loop_run(usbmoded_mainloop);
     log_debug("leave usb-moded mainloop");
@@ -1282,6 +1919,7 @@ EXIT:
     /* Must be done just before exit to make sure no more wakelocks
      * are taken and left behind on exit path */
     usbmoded_allow_suspend();
+    common_wakelock_quit();
 
     log_debug("usb-moded return from main, with exit code %d",
               usbmoded_exitcode);
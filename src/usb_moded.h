@@ -65,6 +65,7 @@
  * ------------------------------------------------------------------------- */
 
 GList            *usbmoded_get_modelist              (void);
+unsigned          usbmoded_get_modelist_generation   (void);
 void              usbmoded_load_modelist             (void);
 void              usbmoded_free_modelist             (void);
 const modedata_t *usbmoded_get_modedata              (const char *modename);
@@ -76,6 +77,8 @@ void              usbmoded_set_diag_mode             (bool diag_mode);
 bool              usbmoded_is_mode_permitted         (const char *modename, uid_t uid);
 void              usbmoded_set_cable_connection_delay(int delay_ms);
 int               usbmoded_get_cable_connection_delay(void);
+bool              usbmoded_get_prestage              (void);
+void              usbmoded_set_prestage              (bool prestage);
 void              usbmoded_allow_suspend             (void);
 void              usbmoded_delay_suspend             (void);
 bool              usbmoded_in_usermode               (void);
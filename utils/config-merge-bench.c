@@ -0,0 +1,532 @@
+/**
+ * @file config-merge-bench.c
+ *
+ * This is a development utility for measuring how usb_moded settings
+ * handling scales with large multi-user configurations.
+ *
+ * Synthetic static and dynamic settings are generated in memory - the
+ * dynamic part contains per-user mode settings for the given number
+ * of users, plus overrides for static values out of which some match
+ * the defaults and thus are candidates for purging.
+ *
+ * The data is loaded into the layered settings storage used by
+ * usb_moded, after which lookups, settings changes (including
+ * serializing dynamic settings as is done before saving), purging and
+ * serializing are timed. With --compare the same operations are done
+ * also with the key by key GKeyFile merging that was used previously,
+ * and the results are cross checked.
+ *
+ * When the time taken by any phase goes over a given limit, exit status
+ * is nonzero, so that the tool can be used for catching regressions.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "../src/usb_moded-config.h"
+#include "../src/usb_moded-confmerge.h"
+#include "../src/usb_moded-log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+/* ========================================================================= *
+ * Constants
+ * ========================================================================= */
+
+/** First uid used for additional users, see MIN_ADDITIONAL_USER */
+#define BENCH_FIRST_UID 100001
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Synthetic settings and the operations to do on them */
+typedef struct
+{
+    gchar  *static_data;  /**< Static settings in ini format */
+    gchar  *dynamic_data; /**< Dynamic settings in ini format */
+    gchar **lookup_keys;  /**< Per-user keys to lookup */
+    int     lookups;      /**< Number of lookup_keys */
+    gchar **set_groups;   /**< Groups of values to set */
+    gchar **set_keys;     /**< Keys of values to set */
+    gchar **set_values;   /**< Values to set */
+    int     sets;         /**< Number of values to set */
+} bench_data_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* -- bench -- */
+
+static double     bench_now              (void);
+static void       bench_report           (const char *phase, const char *engine, double ms, int ops, double limit_ms, bool *ok);
+static void       bench_data_init        (bench_data_t *data, int users, int groups, int keys, int lookups, int sets);
+static void       bench_data_free        (bench_data_t *data);
+
+/* -- confmerge -- */
+
+static gchar     *bench_cm_get_user      (const confmerge_t *merge, const char *key);
+
+/* -- reference -- */
+
+static GKeyFile  *bench_ref_load         (const char *data);
+static void       bench_ref_merge_data   (GKeyFile *dest, GKeyFile *srce);
+static void       bench_ref_purge_data   (GKeyFile *dest, GKeyFile *srce);
+static void       bench_ref_purge_groups (GKeyFile *dest);
+static GKeyFile  *bench_ref_build        (const char *static_data, const char *dynamic_data);
+static gchar     *bench_ref_get_user     (GKeyFile *ini, const char *key);
+static gchar     *bench_ref_set          (const char *static_data, const char *dynamic_data, const char *group, const char *key, const char *value);
+
+/* -- main -- */
+
+static void       bench_usage            (const char *name);
+int main(int argc, char *argv[]);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+static const struct option bench_long_options[] =
+{
+    { "users",   required_argument, 0, 'u' },
+    { "groups",  required_argument, 0, 'g' },
+    { "keys",    required_argument, 0, 'k' },
+    { "lookups", required_argument, 0, 'n' },
+    { "sets",    required_argument, 0, 's' },
+    { "limit",   required_argument, 0, 'l' },
+    { "compare", no_argument,       0, 'c' },
+    { "help",    no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+static const char bench_short_options[] = "u:g:k:n:s:l:ch";
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static void bench_report(const char *phase, const char *engine, double ms,
+                         int ops, double limit_ms, bool *ok)
+{
+    const char *verdict = "";
+
+    if( limit_ms > 0 && ms > limit_ms ) {
+        verdict = "  LIMIT EXCEEDED";
+        *ok = false;
+    }
+
+    printf("%-8s %-10s %10.3f ms %10.3f us/op%s\n", phase, engine, ms,
+           ops > 0 ? ms * 1e3 / ops : 0.0, verdict);
+}
+
+/** Generate synthetic settings
+ *
+ * Random choices use a fixed seed, so that results are comparable
+ * between runs.
+ */
+static void bench_data_init(bench_data_t *data, int users, int groups,
+                            int keys, int lookups, int sets)
+{
+    static const char * const modes[] = {
+        "mtp_mode", "developer_mode", "charging_only", "ask",
+    };
+
+    GRand   *rnd = g_rand_new_with_seed(1);
+    GString *sta = g_string_new(0);
+    GString *dyn = g_string_new(0);
+
+    g_string_append_printf(sta, "[%s]\n%s=%s\n", MODE_SETTING_ENTRY,
+                           MODE_SETTING_KEY, "ask");
+    for( int g = 0; g < groups; ++g ) {
+        g_string_append_printf(sta, "\n[group%d]\n", g);
+        for( int k = 0; k < keys; ++k )
+            g_string_append_printf(sta, "key%d=value%d\n", k, k);
+    }
+
+    g_string_append_printf(dyn, "[%s]\n", MODE_SETTING_ENTRY);
+    for( int u = 0; u < users; ++u )
+        g_string_append_printf(dyn, "%s_%d=%s\n", MODE_SETTING_KEY,
+                               BENCH_FIRST_UID + u, modes[u % G_N_ELEMENTS(modes)]);
+
+    /* Override every 4th static value, half of them with the default */
+    for( int g = 0; g < groups; ++g ) {
+        g_string_append_printf(dyn, "\n[group%d]\n", g);
+        for( int k = 0; k < keys; k += 4 ) {
+            if( k % 8 )
+                g_string_append_printf(dyn, "key%d=custom%d\n", k, k);
+            else
+                g_string_append_printf(dyn, "key%d=value%d\n", k, k);
+        }
+    }
+
+    /* Lookups include users that do not have a setting */
+    data->lookups     = lookups;
+    data->lookup_keys = g_new0(gchar *, lookups + 1);
+    for( int i = 0; i < lookups; ++i ) {
+        int uid = BENCH_FIRST_UID + g_rand_int_range(rnd, 0, users + users / 4 + 1);
+        data->lookup_keys[i] = g_strdup_printf("%s_%d", MODE_SETTING_KEY, uid);
+    }
+
+    /* Mostly per-user mode changes, every 4th set restores a default */
+    data->sets       = sets;
+    data->set_groups = g_new0(gchar *, sets + 1);
+    data->set_keys   = g_new0(gchar *, sets + 1);
+    data->set_values = g_new0(gchar *, sets + 1);
+    for( int i = 0; i < sets; ++i ) {
+        if( i % 4 == 3 && groups > 0 && keys > 0 ) {
+            int g = g_rand_int_range(rnd, 0, groups);
+            int k = g_rand_int_range(rnd, 0, keys);
+            data->set_groups[i] = g_strdup_printf("group%d", g);
+            data->set_keys[i]   = g_strdup_printf("key%d", k);
+            data->set_values[i] = g_strdup_printf("value%d", k);
+        }
+        else {
+            int uid = BENCH_FIRST_UID + g_rand_int_range(rnd, 0, users + 1);
+            data->set_groups[i] = g_strdup(MODE_SETTING_ENTRY);
+            data->set_keys[i]   = g_strdup_printf("%s_%d", MODE_SETTING_KEY, uid);
+            data->set_values[i] = g_strdup(modes[g_rand_int_range(rnd, 0, G_N_ELEMENTS(modes))]);
+        }
+    }
+
+    data->static_data  = g_string_free(sta, FALSE);
+    data->dynamic_data = g_string_free(dyn, FALSE);
+    g_rand_free(rnd);
+}
+
+static void bench_data_free(bench_data_t *data)
+{
+    g_free(data->static_data);
+    g_free(data->dynamic_data);
+    g_strfreev(data->lookup_keys);
+    g_strfreev(data->set_groups);
+    g_strfreev(data->set_keys);
+    g_strfreev(data->set_values);
+}
+
+/** Per-user lookup with fallback, as in config_get_user_conf_string() */
+static gchar *bench_cm_get_user(const confmerge_t *merge, const char *key)
+{
+    gchar *value = confmerge_get_string(merge, MODE_SETTING_ENTRY, key);
+    if( !value )
+        value = confmerge_get_string(merge, MODE_SETTING_ENTRY, MODE_SETTING_KEY);
+    return value;
+}
+
+static GKeyFile *bench_ref_load(const char *data)
+{
+    GKeyFile *ini = g_key_file_new();
+    g_key_file_load_from_data(ini, data, -1, 0, 0);
+    return ini;
+}
+
+/** Key by key merge, as usb_moded used to do */
+static void bench_ref_merge_data(GKeyFile *dest, GKeyFile *srce)
+{
+    gchar **grp = g_key_file_get_groups(srce, 0);
+    for( size_t g = 0; grp && grp[g]; ++g ) {
+        gchar **key = g_key_file_get_keys(srce, grp[g], 0, 0);
+        for( size_t k = 0; key && key[k]; ++k ) {
+            gchar *val = g_key_file_get_value(srce, grp[g], key[k], 0);
+            if( val )
+                g_key_file_set_value(dest, grp[g], key[k], val);
+            g_free(val);
+        }
+        g_strfreev(key);
+    }
+    g_strfreev(grp);
+}
+
+static void bench_ref_purge_data(GKeyFile *dest, GKeyFile *srce)
+{
+    gchar **grp = g_key_file_get_groups(srce, 0);
+    for( size_t g = 0; grp && grp[g]; ++g ) {
+        gchar **key = g_key_file_get_keys(srce, grp[g], 0, 0);
+        for( size_t k = 0; key && key[k]; ++k ) {
+            gchar *cur = g_key_file_get_value(dest, grp[g], key[k], 0);
+            if( !cur )
+                continue;
+            gchar *def = g_key_file_get_value(srce, grp[g], key[k], 0);
+            if( !g_strcmp0(cur, def) )
+                g_key_file_remove_key(dest, grp[g], key[k], 0);
+            g_free(def);
+            g_free(cur);
+        }
+        g_strfreev(key);
+    }
+    g_strfreev(grp);
+}
+
+static void bench_ref_purge_groups(GKeyFile *dest)
+{
+    gchar **grp = g_key_file_get_groups(dest, 0);
+    for( size_t g = 0; grp && grp[g]; ++g ) {
+        gsize keys = 0;
+        gchar **key = g_key_file_get_keys(dest, grp[g], &keys, 0);
+        if( keys == 0 )
+            g_key_file_remove_group(dest, grp[g], 0);
+        g_strfreev(key);
+    }
+    g_strfreev(grp);
+}
+
+static GKeyFile *bench_ref_build(const char *static_data,
+                                 const char *dynamic_data)
+{
+    GKeyFile *ini = g_key_file_new();
+    GKeyFile *sta = bench_ref_load(static_data);
+    GKeyFile *dyn = bench_ref_load(dynamic_data);
+    bench_ref_merge_data(ini, sta);
+    bench_ref_merge_data(ini, dyn);
+    g_key_file_free(dyn);
+    g_key_file_free(sta);
+    return ini;
+}
+
+static gchar *bench_ref_get_user(GKeyFile *ini, const char *key)
+{
+    gchar *value = g_key_file_get_string(ini, MODE_SETTING_ENTRY, key, 0);
+    if( !value )
+        value = g_key_file_get_string(ini, MODE_SETTING_ENTRY, MODE_SETTING_KEY, 0);
+    return value;
+}
+
+/** Change a setting the way usb_moded used to do it
+ *
+ * @return new dynamic settings data
+ */
+static gchar *bench_ref_set(const char *static_data, const char *dynamic_data,
+                            const char *group, const char *key,
+                            const char *value)
+{
+    GKeyFile *sta = bench_ref_load(static_data);
+    GKeyFile *ini = bench_ref_build(static_data, dynamic_data);
+
+    gchar *prev = g_key_file_get_string(ini, group, key, 0);
+    if( g_strcmp0(prev, value) )
+        g_key_file_set_string(ini, group, key, value);
+    g_free(prev);
+
+    bench_ref_purge_data(ini, sta);
+    bench_ref_purge_groups(ini);
+    gchar *data = g_key_file_to_data(ini, 0, 0);
+
+    g_key_file_free(ini);
+    g_key_file_free(sta);
+    return data;
+}
+
+static void bench_usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "\n"
+           "  -u, --users=N     number of users with mode settings [5000]\n"
+           "  -g, --groups=N    number of static settings groups [20]\n"
+           "  -k, --keys=N      number of keys per static group [50]\n"
+           "  -n, --lookups=N   number of per-user lookups [100000]\n"
+           "  -s, --sets=N      number of settings changes [200]\n"
+           "  -l, --limit=MS    fail if any phase takes longer than MS\n"
+           "  -c, --compare     run also the previously used GKeyFile merging\n"
+           "  -h, --help        print this help and exit\n",
+           name);
+}
+
+int main(int argc, char *argv[])
+{
+    int           exitcode = EXIT_FAILURE;
+    int           users    = 5000;
+    int           groups   = 20;
+    int           keys     = 50;
+    int           lookups  = 100000;
+    int           sets     = 200;
+    double        limit_ms = 0;
+    bool          compare  = false;
+    bool          ok       = true;
+    bench_data_t  data     = {};
+    confmerge_t  *merge    = 0;
+    GKeyFile     *ref      = 0;
+    gchar        *ref_dyn  = 0;
+    GKeyFile     *sta      = 0;
+    size_t        checksum = 0;
+    double        t;
+    int           opt;
+
+    while( (opt = getopt_long(argc, argv, bench_short_options,
+                              bench_long_options, 0)) != -1 ) {
+        switch( opt ) {
+        case 'u':
+            users = MAX(atoi(optarg), 0);
+            break;
+        case 'g':
+            groups = MAX(atoi(optarg), 0);
+            break;
+        case 'k':
+            keys = MAX(atoi(optarg), 0);
+            break;
+        case 'n':
+            lookups = MAX(atoi(optarg), 1);
+            break;
+        case 's':
+            sets = MAX(atoi(optarg), 0);
+            break;
+        case 'l':
+            limit_ms = strtod(optarg, 0);
+            break;
+        case 'c':
+            compare = true;
+            break;
+        case 'h':
+            bench_usage(*argv);
+            exitcode = EXIT_SUCCESS;
+            goto EXIT;
+        default:
+            bench_usage(*argv);
+            goto EXIT;
+        }
+    }
+
+    /* Keep purge debug logging from skewing the results */
+    log_set_level(LOG_WARNING);
+
+    bench_data_init(&data, users, groups, keys, lookups, sets);
+    printf("# users=%d groups=%d keys=%d lookups=%d sets=%d"
+           " static=%zu bytes dynamic=%zu bytes\n",
+           users, groups, keys, lookups, sets,
+           strlen(data.static_data), strlen(data.dynamic_data));
+
+    /* - - - - - - - - - - - - - - - - - - - *
+     * layered hash tables
+     * - - - - - - - - - - - - - - - - - - - */
+
+    t = bench_now();
+    merge = confmerge_create();
+    confmerge_merge_data(merge, CONFMERGE_LAYER_STATIC, data.static_data);
+    confmerge_merge_data(merge, CONFMERGE_LAYER_DYNAMIC, data.dynamic_data);
+    bench_report("build", "confmerge", bench_now() - t, 1, limit_ms, &ok);
+
+    t = bench_now();
+    for( int i = 0; i < data.lookups; ++i ) {
+        gchar *val = bench_cm_get_user(merge, data.lookup_keys[i]);
+        checksum += val ? strlen(val) : 0;
+        g_free(val);
+    }
+    bench_report("lookup", "confmerge", bench_now() - t, data.lookups,
+                 limit_ms, &ok);
+
+    t = bench_now();
+    size_t purged = confmerge_purge(merge);
+    bench_report("purge", "confmerge", bench_now() - t, 1, limit_ms, &ok);
+
+    t = bench_now();
+    for( int i = 0; i < data.sets; ++i ) {
+        if( confmerge_set_string(merge, data.set_groups[i], data.set_keys[i],
+                                 data.set_values[i]) )
+            g_free(confmerge_to_data(merge, CONFMERGE_LAYER_DYNAMIC));
+    }
+    bench_report("set", "confmerge", bench_now() - t, data.sets,
+                 limit_ms, &ok);
+
+    t = bench_now();
+    g_free(confmerge_to_data(merge, CONFMERGE_LAYER_DYNAMIC));
+    bench_report("save", "confmerge", bench_now() - t, 1, limit_ms, &ok);
+
+    printf("# static=%zu dynamic=%zu values, %zu purged, checksum=%zu\n",
+           confmerge_count(merge, CONFMERGE_LAYER_STATIC),
+           confmerge_count(merge, CONFMERGE_LAYER_DYNAMIC),
+           purged, checksum);
+
+    /* - - - - - - - - - - - - - - - - - - - *
+     * key by key GKeyFile merging
+     * - - - - - - - - - - - - - - - - - - - */
+
+    if( !compare )
+        goto DONE;
+
+    checksum = 0;
+
+    t = bench_now();
+    ref = bench_ref_build(data.static_data, data.dynamic_data);
+    bench_report("build", "keyfile", bench_now() - t, 1, 0, &ok);
+
+    t = bench_now();
+    for( int i = 0; i < data.lookups; ++i ) {
+        gchar *val = bench_ref_get_user(ref, data.lookup_keys[i]);
+        checksum += val ? strlen(val) : 0;
+        g_free(val);
+    }
+    bench_report("lookup", "keyfile", bench_now() - t, data.lookups, 0, &ok);
+
+    t = bench_now();
+    sta = bench_ref_load(data.static_data);
+    bench_ref_purge_data(ref, sta);
+    bench_ref_purge_groups(ref);
+    g_key_file_free(sta), sta = 0;
+    bench_report("purge", "keyfile", bench_now() - t, 1, 0, &ok);
+
+    t = bench_now();
+    ref_dyn = g_strdup(data.dynamic_data);
+    for( int i = 0; i < data.sets; ++i ) {
+        gchar *tmp = bench_ref_set(data.static_data, ref_dyn,
+                                   data.set_groups[i], data.set_keys[i],
+                                   data.set_values[i]);
+        g_free(ref_dyn), ref_dyn = tmp;
+    }
+    bench_report("set", "keyfile", bench_now() - t, data.sets, 0, &ok);
+
+    printf("# checksum=%zu\n", checksum);
+
+    /* Cross check effective values after all changes */
+    g_key_file_free(ref);
+    ref = bench_ref_build(data.static_data, ref_dyn);
+    for( int i = 0; i < data.sets + data.lookups; ++i ) {
+        const char *grp = i < data.sets ? data.set_groups[i] : MODE_SETTING_ENTRY;
+        const char *key = i < data.sets ? data.set_keys[i] : data.lookup_keys[i - data.sets];
+        gchar *val1 = confmerge_get_string(merge, grp, key);
+        gchar *val2 = g_key_file_get_string(ref, grp, key, 0);
+        if( g_strcmp0(val1, val2) ) {
+            printf("MISMATCH: [%s] %s: %s vs %s\n", grp, key,
+                   val1 ?: "(null)", val2 ?: "(null)");
+            ok = false;
+        }
+        g_free(val1);
+        g_free(val2);
+    }
+
+DONE:
+    exitcode = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+
+EXIT:
+    g_free(ref_dyn);
+    if( ref )
+        g_key_file_free(ref);
+    confmerge_delete(merge);
+    bench_data_free(&data);
+    return exitcode;
+}
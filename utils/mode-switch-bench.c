@@ -0,0 +1,553 @@
+/**
+ * @file mode-switch-bench.c
+ *
+ * This is a development utility for measuring how long usb_moded
+ * takes to switch between modes.
+ *
+ * Modes are activated repeatedly via the usb_moded D-Bus interface
+ * and the time until the matching current state signal is received
+ * is recorded. After each mode the latency distribution and the
+ * read/write syscall and context switch counts the daemon accumulated
+ * during the switches (as seen from /proc/PID) are printed. When the
+ * timing goes over a given limit exit status is nonzero, so that the
+ * tool can be used for catching regressions.
+ *
+ * Real hardware is not needed: "mode-switch-bench --fake-gadget DIR"
+ * populates a directory with a minimal configfs gadget layout. Point
+ * usb_moded at it via [configfs] gadget_base_directory in a config
+ * ini file and run the daemon in --fallback mode so that it considers
+ * cable to be connected.
+ *
+ * Copyright (c) 2026 Jolla Ltd.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the Lesser GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the Lesser GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include "../src/usb_moded-dbus.h"
+#include "../src/usb_moded-modes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include <sys/stat.h>
+
+#include <dbus/dbus.h>
+#include <glib.h>
+
+/* ========================================================================= *
+ * Types
+ * ========================================================================= */
+
+/** Daemon side resource usage counters */
+typedef struct
+{
+    long long syscr;   /**< read() like syscalls */
+    long long syscw;   /**< write() like syscalls */
+    long long vctxsw;  /**< voluntary context switches */
+    long long nvctxsw; /**< involuntary context switches */
+} bench_counters_t;
+
+/* ========================================================================= *
+ * Prototypes
+ * ========================================================================= */
+
+/* -- bench -- */
+
+static double  bench_now             (void);
+static int     bench_compare_double  (const void *a, const void *b);
+static double  bench_percentile      (const double *sorted, int count, int pct);
+static gchar  *bench_call            (const char *method, const char *arg);
+static unsigned bench_get_daemon_pid (void);
+static void    bench_read_counters   (unsigned pid, bench_counters_t *cnt);
+static bool    bench_wait_mode       (const char *mode, int timeout_ms);
+static double  bench_switch          (const char *mode, int timeout_ms);
+static bool    bench_run_mode        (const char *mode, const char *reset, int iterations, int timeout_ms, double limit_ms, unsigned pid);
+static bool    bench_write_file      (const char *dir, const char *file, const char *text);
+static int     bench_make_fake_gadget(const char *dir);
+static void    bench_usage           (const char *name);
+
+/* -- main -- */
+
+int main(int argc, char *argv[]);
+
+/* ========================================================================= *
+ * Data
+ * ========================================================================= */
+
+static DBusConnection *conn = 0;
+
+static const struct option bench_long_options[] =
+{
+    { "mode",        required_argument, 0, 'm' },
+    { "reset-mode",  required_argument, 0, 'r' },
+    { "iterations",  required_argument, 0, 'n' },
+    { "timeout",     required_argument, 0, 't' },
+    { "limit",       required_argument, 0, 'l' },
+    { "fake-gadget", required_argument, 0, 'g' },
+    { "stats",       no_argument,       0, 's' },
+    { "help",        no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+};
+
+static const char bench_short_options[] = "m:r:n:t:l:g:sh";
+
+/* ========================================================================= *
+ * Functions
+ * ========================================================================= */
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(const double *sorted, int count, int pct)
+{
+    int i = (count * pct + 99) / 100 - 1;
+    if( i < 0 )
+        i = 0;
+    if( i >= count )
+        i = count - 1;
+    return sorted[i];
+}
+
+/** Make a usb_moded method call that takes and returns a string
+ *
+ * @param method  Method name
+ * @param arg     String argument, or NULL for none
+ *
+ * @return reply string, or NULL on failure; caller must release with g_free()
+ */
+static gchar *bench_call(const char *method, const char *arg)
+{
+    gchar       *res = 0;
+    DBusMessage *req = 0;
+    DBusMessage *rsp = 0;
+    DBusError    err = DBUS_ERROR_INIT;
+    const char  *str = 0;
+
+    req = dbus_message_new_method_call(USB_MODE_SERVICE, USB_MODE_OBJECT,
+                                       USB_MODE_INTERFACE, method);
+    if( !req )
+        goto EXIT;
+
+    if( arg )
+        dbus_message_append_args(req, DBUS_TYPE_STRING, &arg, DBUS_TYPE_INVALID);
+
+    if( !(rsp = dbus_connection_send_with_reply_and_block(conn, req, -1, &err)) ) {
+        fprintf(stderr, "%s: %s: %s\n", method, err.name, err.message);
+        goto EXIT;
+    }
+
+    if( !dbus_message_get_args(rsp, &err, DBUS_TYPE_STRING, &str, DBUS_TYPE_INVALID) ) {
+        fprintf(stderr, "%s: %s: %s\n", method, err.name, err.message);
+        goto EXIT;
+    }
+
+    res = g_strdup(str);
+
+EXIT:
+    dbus_error_free(&err);
+    if( rsp )
+        dbus_message_unref(rsp);
+    if( req )
+        dbus_message_unref(req);
+    return res;
+}
+
+/** Get process id of the usb_moded D-Bus service
+ *
+ * @return pid, or 0 if not known
+ */
+static unsigned bench_get_daemon_pid(void)
+{
+    dbus_uint32_t  pid  = 0;
+    const char    *name = USB_MODE_SERVICE;
+    DBusMessage   *req  = 0;
+    DBusMessage   *rsp  = 0;
+
+    req = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                       DBUS_INTERFACE_DBUS,
+                                       "GetConnectionUnixProcessID");
+    if( !req )
+        goto EXIT;
+
+    dbus_message_append_args(req, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+
+    if( (rsp = dbus_connection_send_with_reply_and_block(conn, req, -1, 0)) )
+        dbus_message_get_args(rsp, 0, DBUS_TYPE_UINT32, &pid, DBUS_TYPE_INVALID);
+
+EXIT:
+    if( rsp )
+        dbus_message_unref(rsp);
+    if( req )
+        dbus_message_unref(req);
+    return pid;
+}
+
+/** Read daemon resource usage counters
+ *
+ * Counters that are not accessible are left as zero.
+ *
+ * @param pid  Daemon process id
+ * @param cnt  Where to store the counters
+ */
+static void bench_read_counters(unsigned pid, bench_counters_t *cnt)
+{
+    char  path[64];
+    char *line = 0;
+    size_t size = 0;
+    FILE *file;
+
+    memset(cnt, 0, sizeof *cnt);
+
+    if( !pid )
+        goto EXIT;
+
+    snprintf(path, sizeof path, "/proc/%u/io", pid);
+    if( (file = fopen(path, "r")) ) {
+        while( getline(&line, &size, file) != -1 ) {
+            sscanf(line, "syscr: %lld", &cnt->syscr);
+            sscanf(line, "syscw: %lld", &cnt->syscw);
+        }
+        fclose(file);
+    }
+
+    snprintf(path, sizeof path, "/proc/%u/status", pid);
+    if( (file = fopen(path, "r")) ) {
+        while( getline(&line, &size, file) != -1 ) {
+            sscanf(line, "voluntary_ctxt_switches: %lld", &cnt->vctxsw);
+            sscanf(line, "nonvoluntary_ctxt_switches: %lld", &cnt->nvctxsw);
+        }
+        fclose(file);
+    }
+
+EXIT:
+    free(line);
+}
+
+/** Wait for usb_moded to report the given mode as current
+ *
+ * @param mode        Mode name
+ * @param timeout_ms  Maximum time to wait
+ *
+ * @return true if the mode was reported, false on timeout
+ */
+static bool bench_wait_mode(const char *mode, int timeout_ms)
+{
+    bool   ack      = false;
+    double deadline = bench_now() + timeout_ms;
+
+    while( !ack ) {
+        int remaining = (int)(deadline - bench_now());
+        if( remaining <= 0 )
+            break;
+
+        if( !dbus_connection_read_write(conn, remaining) )
+            break;
+
+        DBusMessage *msg;
+        while( !ack && (msg = dbus_connection_pop_message(conn)) ) {
+            const char *current = 0;
+            if( dbus_message_is_signal(msg, USB_MODE_INTERFACE,
+                                       USB_MODE_CURRENT_STATE_SIGNAL_NAME) &&
+                dbus_message_get_args(msg, 0, DBUS_TYPE_STRING, &current,
+                                      DBUS_TYPE_INVALID) )
+                ack = !strcmp(current, mode);
+            dbus_message_unref(msg);
+        }
+    }
+
+    return ack;
+}
+
+/** Switch to mode and measure time it takes
+ *
+ * @param mode        Mode name
+ * @param timeout_ms  Maximum time to wait
+ *
+ * @return switch latency in milliseconds, or negative value on failure
+ */
+static double bench_switch(const char *mode, int timeout_ms)
+{
+    double  res     = -1;
+    double  started = bench_now();
+    gchar  *current = 0;
+
+    if( !(current = bench_call(USB_MODE_STATE_SET, mode)) )
+        goto EXIT;
+
+    /* Method call reply is sent when the request has been queued; mode
+     * is active when it gets reported via current state signal */
+    if( !bench_wait_mode(mode, timeout_ms) ) {
+        fprintf(stderr, "%s: not activated within %d ms\n", mode, timeout_ms);
+        goto EXIT;
+    }
+
+    res = bench_now() - started;
+
+EXIT:
+    g_free(current);
+    return res;
+}
+
+/** Measure switching to one mode
+ *
+ * @param mode        Mode name
+ * @param reset       Mode to return to between iterations
+ * @param iterations  Number of switches to make
+ * @param timeout_ms  Maximum time to wait for single switch
+ * @param limit_ms    Maximum allowed p99 latency, or zero for no limit
+ * @param pid         Daemon pid, or zero if not known
+ *
+ * @return true if all switches succeeded within limits, false otherwise
+ */
+static bool bench_run_mode(const char *mode, const char *reset, int iterations,
+                           int timeout_ms, double limit_ms, unsigned pid)
+{
+    bool              ack     = false;
+    int               count   = 0;
+    double           *samples = g_new0(double, iterations);
+    bench_counters_t  beg, end;
+    bench_counters_t  sum     = { 0, 0, 0, 0 };
+
+    for( int i = 0; i < iterations; ++i ) {
+        if( bench_switch(reset, timeout_ms) < 0 )
+            goto EXIT;
+
+        bench_read_counters(pid, &beg);
+        double ms = bench_switch(mode, timeout_ms);
+        bench_read_counters(pid, &end);
+        if( ms < 0 )
+            goto EXIT;
+
+        sum.syscr   += end.syscr   - beg.syscr;
+        sum.syscw   += end.syscw   - beg.syscw;
+        sum.vctxsw  += end.vctxsw  - beg.vctxsw;
+        sum.nvctxsw += end.nvctxsw - beg.nvctxsw;
+
+        samples[count++] = ms;
+    }
+
+    qsort(samples, count, sizeof *samples, bench_compare_double);
+
+    double p50 = bench_percentile(samples, count, 50);
+    double p99 = bench_percentile(samples, count, 99);
+
+    printf("%-28s n=%-4d min=%8.1f p50=%8.1f p99=%8.1f max=%8.1f ms"
+           "  syscr=%lld syscw=%lld ctxsw=%lld/%lld\n",
+           mode, count, samples[0], p50, p99, samples[count - 1],
+           sum.syscr / count, sum.syscw / count,
+           sum.vctxsw / count, sum.nvctxsw / count);
+
+    ack = true;
+    if( limit_ms > 0 && p99 > limit_ms ) {
+        fprintf(stderr, "%s: p99 %.1f ms exceeds limit %.1f ms\n",
+                mode, p99, limit_ms);
+        ack = false;
+    }
+
+EXIT:
+    if( !ack && count < iterations )
+        printf("%-28s FAILED\n", mode);
+    g_free(samples);
+    return ack;
+}
+
+static bool bench_write_file(const char *dir, const char *file, const char *text)
+{
+    bool   ack  = false;
+    gchar *path = g_build_filename(dir, file, NULL);
+    gchar *base = g_path_get_dirname(path);
+
+    if( g_mkdir_with_parents(base, 0775) == -1 )
+        fprintf(stderr, "%s: mkdir failed: %m\n", base);
+    else if( !g_file_set_contents(path, text, -1, 0) )
+        fprintf(stderr, "%s: write failed\n", path);
+    else
+        ack = true;
+
+    g_free(base);
+    g_free(path);
+    return ack;
+}
+
+/** Populate directory with minimal configfs gadget layout
+ *
+ * Real configfs creates attribute files when function directories
+ * are made. Here the attributes usb_moded writes to are created in
+ * advance for the functions that default configuration uses.
+ *
+ * @param dir  Directory to use as gadget base directory
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int bench_make_fake_gadget(const char *dir)
+{
+    static const char * const files[] =
+    {
+        "UDC",
+        "idVendor",
+        "idProduct",
+        "strings/0x409/manufacturer",
+        "strings/0x409/product",
+        "strings/0x409/serialnumber",
+        "configs/b.1/strings/0x409/configuration",
+        "functions/mass_storage.usb0/lun.0/cdrom",
+        "functions/mass_storage.usb0/lun.0/nofua",
+        "functions/mass_storage.usb0/lun.0/removable",
+        "functions/mass_storage.usb0/lun.0/ro",
+        "functions/mass_storage.usb0/lun.0/file",
+        "functions/rndis_bam.rndis/wceis",
+        "functions/rndis_bam.rndis/ethaddr",
+        "functions/ffs.mtp/.keep",
+        "functions/ffs.adb/.keep",
+        0
+    };
+
+    for( size_t i = 0; files[i]; ++i ) {
+        if( !bench_write_file(dir, files[i], "") )
+            return EXIT_FAILURE;
+    }
+
+    printf("# Add to usb-moded config, e.g. /etc/usb-moded/99-bench.ini\n"
+           "[configfs]\n"
+           "gadget_base_directory = %s\n", dir);
+    return EXIT_SUCCESS;
+}
+
+static void bench_usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "\n"
+           "  -m, --mode=MODE         add mode to measure; default is all available modes\n"
+           "  -r, --reset-mode=MODE   mode to return to between switches [%s]\n"
+           "  -n, --iterations=N      number of switches per mode [20]\n"
+           "  -t, --timeout=MS        timeout for a single switch [30000]\n"
+           "  -l, --limit=MS          fail if p99 latency of any mode exceeds MS\n"
+           "  -s, --stats             print usb_moded switch statistics when done\n"
+           "  -g, --fake-gadget=DIR   create fake configfs gadget tree in DIR and exit\n"
+           "  -h, --help              print this help and exit\n",
+           name, MODE_CHARGING);
+}
+
+int main(int argc, char *argv[])
+{
+    int         exitcode   = EXIT_FAILURE;
+    GPtrArray  *modes      = g_ptr_array_new_with_free_func(g_free);
+    const char *reset      = MODE_CHARGING;
+    int         iterations = 20;
+    int         timeout_ms = 30000;
+    double      limit_ms   = 0;
+    bool        stats      = false;
+    gchar      *text       = 0;
+    int         opt;
+
+    while( (opt = getopt_long(argc, argv, bench_short_options,
+                              bench_long_options, 0)) != -1 ) {
+        switch( opt ) {
+        case 'm':
+            g_ptr_array_add(modes, g_strdup(optarg));
+            break;
+        case 'r':
+            reset = optarg;
+            break;
+        case 'n':
+            if( (iterations = atoi(optarg)) < 1 )
+                iterations = 1;
+            break;
+        case 't':
+            timeout_ms = atoi(optarg);
+            break;
+        case 'l':
+            limit_ms = strtod(optarg, 0);
+            break;
+        case 's':
+            stats = true;
+            break;
+        case 'g':
+            exitcode = bench_make_fake_gadget(optarg);
+            goto EXIT;
+        case 'h':
+            bench_usage(*argv);
+            exitcode = EXIT_SUCCESS;
+            goto EXIT;
+        default:
+            bench_usage(*argv);
+            goto EXIT;
+        }
+    }
+
+    if( !(conn = dbus_bus_get(DBUS_BUS_SYSTEM, 0)) ) {
+        fprintf(stderr, "could not connect to system bus\n");
+        goto EXIT;
+    }
+
+    dbus_bus_add_match(conn,
+                       "type='signal'"
+                       ",interface='" USB_MODE_INTERFACE "'"
+                       ",member='" USB_MODE_CURRENT_STATE_SIGNAL_NAME "'",
+                       0);
+
+    if( modes->len == 0 ) {
+        if( !(text = bench_call(USB_MODE_AVAILABLE_MODES_GET, 0)) )
+            goto EXIT;
+
+        gchar **vec = g_strsplit(text, ",", 0);
+        for( size_t i = 0; vec[i]; ++i ) {
+            g_strstrip(vec[i]);
+            if( *vec[i] && strcmp(vec[i], reset) )
+                g_ptr_array_add(modes, g_strdup(vec[i]));
+        }
+        g_strfreev(vec);
+        g_free(text), text = 0;
+    }
+
+    unsigned pid = bench_get_daemon_pid();
+    if( !pid )
+        fprintf(stderr, "usb_moded pid not known; syscall counts not available\n");
+
+    exitcode = EXIT_SUCCESS;
+    for( guint i = 0; i < modes->len; ++i ) {
+        if( !bench_run_mode(modes->pdata[i], reset, iterations,
+                            timeout_ms, limit_ms, pid) )
+            exitcode = EXIT_FAILURE;
+    }
+
+    bench_switch(reset, timeout_ms);
+
+    if( stats && (text = bench_call(USB_MODE_SWITCH_STATS_GET, 0)) )
+        printf("\n%s", text);
+
+EXIT:
+    g_free(text);
+    g_ptr_array_free(modes, TRUE);
+    if( conn )
+        dbus_connection_unref(conn);
+    return exitcode;
+}